@@ -46,10 +46,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_registry.h"
+
 /**********************************************************************/
 
 #define CODE_ID		"U2ND"		/* from code_pattern.h */
@@ -126,6 +131,7 @@ void usage(void) __attribute__ (( __noreturn__ ));
 void usage(void)
 {
 	fprintf(stderr, "Usage: addpattern [-i trxfile] [-o binfile] [-B board_id] [-p pattern] [-s serial] [-g] [-b] [-v v#.#.#] [-r #.#] [-{0|1|2|4|5}] -h\n");
+	fprintf(stderr, "       addpattern -i trxfile -B board_id -o binfile [-B board_id -o binfile...] [options]\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -145,13 +151,85 @@ static void set_source_date_epoch() {
 
 struct board_info *find_board(char *id)
 {
+	static struct fw_registry registry = FW_REGISTRY_INIT(boards, id, true);
+
+	return fw_registry_find(&registry, id);
+}
+
+static void set_board(struct code_header *hdr, struct board_info *board,
+		      char *pattern, int pbotflag)
+{
+	if (board) {
+		pattern = board->pattern;
+		hdr->hw_ver = board->hw_ver;
+		hdr->sn = board->sn;
+		hdr->flags[0] = board->flags[0];
+		hdr->flags[1] = board->flags[1];
+	}
+
+	memcpy(hdr->magic, pattern, strlen(pattern));
+	if (pbotflag)
+		memcpy(&hdr->magic[4], PBOT_PATTERN, 4);
+}
+
+/*
+ * Multi-board mode: every image is the same trx behind a board specific
+ * header, so the payload is copied from the one input by the kernel and
+ * only the header (and the garbage padding) is written from here.
+ */
+struct image {
+	char *board_id;
+	char *ofn;
 	struct board_info *board;
+	int res;
+};
 
-	for (board = boards; board->id != NULL; board++)
-		if (strcasecmp(id, board->id) == 0)
-			return board;
+static struct code_header image_hdr;
+static char *image_pattern;
+static int image_pbotflag;
+static int image_gflag;
+static int image_in = -1;
+static size_t image_size;
 
-	return NULL;
+static void write_image(void *arg, unsigned int idx)
+{
+	struct image *img = (struct image *)arg + idx;
+	struct code_header hdr = image_hdr;
+	char garbage[1024];
+	size_t off = sizeof(struct code_header) + image_size;
+	size_t n = 0;
+	int out;
+
+	img->res = EXIT_FAILURE;
+	set_board(&hdr, img->board, image_pattern, image_pbotflag);
+
+	/* keep garbage[] at 1k, as buf[] in main */
+	if (image_gflag && off % sizeof(garbage)) {
+		n = sizeof(garbage) - off % sizeof(garbage);
+		memset(garbage, 0xff, n);
+		fprintf(stderr, "adding %zu bytes of garbage\n", n);
+	}
+
+	out = open(img->ofn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		fprintf(stderr, "can not open \"%s\" for writing\n", img->ofn);
+		return;
+	}
+
+	if (pwrite(out, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    fw_io_copy_fd(out, sizeof(hdr), image_in, 0, image_size) != image_size ||
+	    (n && pwrite(out, garbage, n, off) != n)) {
+		fprintf(stderr, "write error on \"%s\"\n", img->ofn);
+		close(out);
+		return;
+	}
+
+	if (close(out)) {
+		fprintf(stderr, "write error on \"%s\"\n", img->ofn);
+		return;
+	}
+
+	img->res = EXIT_SUCCESS;
 }
 
 int main(int argc, char **argv)
@@ -163,10 +241,12 @@ int main(int argc, char **argv)
 	char *ifn = NULL;
 	char *ofn = NULL;
 	char *pattern = CODE_PATTERN;
-	char *pbotpat = PBOT_PATTERN;
 	char *version = CYBERTAN_VERSION;
 	char *board_id = NULL;
 	struct board_info *board = NULL;
+	struct image *images;
+	unsigned int num_boards = 0, num_outputs = 0, i;
+	struct stat st;
 	int gflag = 0;
 	int pbotflag = 0;
 	int c;
@@ -180,13 +260,19 @@ int main(int argc, char **argv)
 	hdr = (struct code_header *) buf;
 	memset(hdr, 0, sizeof(struct code_header));
 
+	images = calloc(argc, sizeof(*images));
+	if (!images) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
 	while ((c = getopt(argc, argv, "i:o:p:s:gbv:01245hr:B:")) != -1) {
 		switch (c) {
 			case 'i':
 				ifn = optarg;
 				break;
 			case 'o':
-				ofn = optarg;
+				ofn = images[num_outputs++].ofn = optarg;
 				break;
 			case 'p':
 				pattern = optarg;
@@ -233,7 +319,7 @@ int main(int argc, char **argv)
                                 hdr->hw_ver = (char)(atof(optarg)*10)+0x30;
                                 break;
                         case 'B':
-                                board_id = optarg;
+                                board_id = images[num_boards++].board_id = optarg;
                                 break;
 
                         case 'h':
@@ -247,30 +333,40 @@ int main(int argc, char **argv)
 		usage();
 	}
 
-	if (board_id) {
-		board = find_board(board_id);
-		if (board == NULL) {
-			fprintf(stderr, "unknown board \"%s\"\n", board_id);
+	for (i = 0; i < num_boards; i++) {
+		images[i].board = find_board(images[i].board_id);
+		if (images[i].board == NULL) {
+			fprintf(stderr, "unknown board \"%s\"\n", images[i].board_id);
 			usage();
 		}
-		pattern = board->pattern;
-		hdr->hw_ver = board->hw_ver;
-		hdr->sn = board->sn;
-		hdr->flags[0] = board->flags[0];
-		hdr->flags[1] = board->flags[1];
 	}
+	if (board_id)
+		board = images[num_boards - 1].board;
 
 	if (strlen(pattern) > 8) {
 		fprintf(stderr, "illegal pattern \"%s\"\n", pattern);
 		usage();
 	}
 
-	if (ifn && !(in = fopen(ifn, "r"))) {
+	if (num_boards > 1 || num_outputs > 1) {
+		if (num_boards != num_outputs || !ifn) {
+			fprintf(stderr, "multiple boards need an input file and one output per board\n");
+			usage();
+		}
+		image_in = open(ifn, O_RDONLY);
+		if (image_in < 0 || fstat(image_in, &st)) {
+			fprintf(stderr, "can not open \"%s\" for reading\n", ifn);
+			usage();
+		}
+		image_size = st.st_size;
+	}
+
+	if (image_in < 0 && ifn && !(in = fopen(ifn, "r"))) {
 		fprintf(stderr, "can not open \"%s\" for reading\n", ifn);
 		usage();
 	}
 
-	if (ofn && !(out = fopen(ofn, "w"))) {
+	if (image_in < 0 && ofn && !(out = fopen(ofn, "w"))) {
 		fprintf(stderr, "can not open \"%s\" for writing\n", ofn);
 		usage();
 	}
@@ -290,9 +386,6 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	memcpy(hdr->magic, pattern, strlen(pattern));
-	if (pbotflag)
-		memcpy(&hdr->magic[4], pbotpat, 4);
 	hdr->fwdate[0] = ptm->tm_year % 100;
 	hdr->fwdate[1] = ptm->tm_mon + 1;
 	hdr->fwdate[2] = ptm->tm_mday;
@@ -307,6 +400,26 @@ int main(int argc, char **argv)
 			v0, v1, v2,
 			hdr->fwdate[0], hdr->fwdate[1], hdr->fwdate[2]);
 
+	if (image_in >= 0) {
+		int res = EXIT_SUCCESS;
+
+		image_hdr = *hdr;
+		image_pattern = pattern;
+		image_pbotflag = pbotflag;
+		image_gflag = gflag;
+		fw_pool_run(num_boards, write_image, images);
+
+		for (i = 0; i < num_boards; i++)
+			if (images[i].res != EXIT_SUCCESS)
+				res = EXIT_FAILURE;
+
+		close(image_in);
+		free(images);
+		return res;
+	}
+
+	set_board(hdr, board, pattern, pbotflag);
+	free(images);
 
 	while ((n = fread(buf + off, 1, sizeof(buf)-off, in) + off) > 0) {
 		off = 0;
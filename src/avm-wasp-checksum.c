@@ -17,6 +17,10 @@
 #include <string.h>
 #include <getopt.h>     /* for getopt() */
 #include <byteswap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fw_crc32.h"
 
 char *infile;
 char *outfile;
@@ -28,22 +32,53 @@ enum {
 
 #define CHUNK_SIZE 256
 
-uint32_t crc32_for_byte(uint32_t r)
+/* Standard zlib-style CRC-32 (conditioning included) */
+void crc32(const void *data, size_t n_bytes, uint32_t *crc)
 {
-	for (int j = 0; j < 8; ++j)
-		r = (r & 1 ? 0 : (uint32_t)0xEDB88320L) ^ r >> 1;
-	return r ^ (uint32_t)0xFF000000L;
+	*crc = ~fw_crc32_parallel(~*crc, data, n_bytes);
 }
 
-void crc32(const void *data, size_t n_bytes, uint32_t *crc)
+/*
+ * Checksum and copy the whole input in a single pass over a read-only
+ * mapping. Returns 1 if the input can't be mapped (pipes, empty files),
+ * leaving the caller to stream it instead.
+ */
+static int process_mapped(FILE *in_fp, FILE *out_fp, uint32_t *crc)
 {
-	static uint32_t table[0x100];
+	struct stat st;
+	size_t len;
+	void *map;
+
+	if (fstat(fileno(in_fp), &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return 1;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(in_fp), 0);
+	if (map == MAP_FAILED)
+		return 1;
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	switch (model) {
+	case MODEL_3390:
+		/* Like the word-wise fread(), a trailing partial word is dropped */
+		len = st.st_size & ~(sizeof(uint32_t) - 1);
+		for (size_t i = 0; i < len / sizeof(uint32_t); i++)
+			*crc ^= ((uint32_t *)map)[i];
+		break;
+	case MODEL_X490:
+	default:
+		len = st.st_size;
+		crc32(map, len, crc);
+		break;
+	}
+
+	if (fwrite(map, 1, len, out_fp) != len) {
+		munmap(map, st.st_size);
+		return -1;
+	}
 
-	if (!*table)
-		for (size_t i = 0; i < 0x100; ++i)
-			table[i] = crc32_for_byte(i);
-	for (size_t i = 0; i < n_bytes; ++i)
-		*crc = table[(uint8_t)*crc ^ ((uint8_t *)data)[i]] ^ *crc >> 8;
+	munmap(map, st.st_size);
+	return 0;
 }
 
 static void usage(int status)
@@ -116,6 +151,18 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	switch (process_mapped(in_fp, out_fp, &crc)) {
+	case 0:
+		goto write_crc;
+	case 1:
+		break;
+	default:
+		fprintf(stderr, "Error writing output file: %s\n", outfile);
+		fclose(in_fp);
+		fclose(out_fp);
+		return EXIT_FAILURE;
+	}
+
 	while (!feof(in_fp)) {
 		switch (model) {
 		case MODEL_3390:
@@ -155,6 +202,8 @@ int main(int argc, char *argv[])
 			break;
 		}
 	}
+
+write_crc:
 	if (model == MODEL_X490)
 		crc = bswap_32(crc);
 	fwrite(&crc, sizeof(uint32_t), 1, out_fp);
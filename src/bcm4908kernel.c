@@ -6,12 +6,15 @@
 #include <byteswap.h>
 #include <endian.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "fw_io.h"
+
 #if !defined(__BYTE_ORDER)
 #error "Unknown byte order"
 #endif
@@ -39,15 +42,38 @@ static void usage() {
 	printf("\n");
 	printf("\t-i pathname\t\t\tinput kernel filepath\n");
 	printf("\t-o pathname\t\t\toutput kernel filepath\n");
+	printf("\t-p\t\t\t\tprint the header of an input kernel instead\n");
+}
+
+/* Only the header is read, so it's instant whatever the kernel size */
+static int bcm4908kernel_probe(FILE *in)
+{
+	struct bcm4908kernel_header header;
+
+	if (fread(&header, 1, sizeof(header), in) != sizeof(header)) {
+		fprintf(stderr, "Failed to read %zu bytes from input file\n", sizeof(header));
+		return -EIO;
+	}
+
+	if (memcmp(header.magic, "BRCM", 4)) {
+		fprintf(stderr, "Input file doesn't contain BCM4908 kernel header\n");
+		return -EINVAL;
+	}
+
+	printf("Load address:\t\t0x%08x\n", le32_to_cpu(header.boot_load_addr));
+	printf("Entry point:\t\t0x%08x\n", le32_to_cpu(header.boot_addr));
+	printf("Data length:\t\t%u\n", le32_to_cpu(header.data_len));
+	printf("Uncompressed length:\t%u\n", le32_to_cpu(header.uncomplen));
+
+	return 0;
 }
 
 int main(int argc, char **argv) {
 	struct bcm4908kernel_header header;
-	uint8_t buf[1024];
+	bool probe = false;
 	FILE *out = NULL;
 	FILE *in = NULL;
-	size_t length;
-	size_t bytes;
+	ssize_t length;
 	int err = 0;
 	char c;
 
@@ -56,7 +82,7 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "i:o:")) != -1) {
+	while ((c = getopt(argc, argv, "i:o:p")) != -1) {
 		switch (c) {
 		case 'i':
 			in = fopen(optarg, "r");
@@ -64,9 +90,20 @@ int main(int argc, char **argv) {
 		case 'o':
 			out = fopen(optarg, "w+");
 			break;
+		case 'p':
+			probe = true;
+			break;
 		}
 	}
 
+	if (probe && in) {
+		err = bcm4908kernel_probe(in);
+		fclose(in);
+		if (out)
+			fclose(out);
+		return err;
+	}
+
 	if (!in || !out) {
 		fprintf(stderr, "Failed to open input and/or output file\n");
 		usage();
@@ -92,15 +129,12 @@ int main(int argc, char **argv) {
 		goto err_close;
 	}
 
-	length = 0;
 	rewind(in);
-	while ((bytes = fread(buf, 1, sizeof(buf), in)) > 0) {
-		if (fwrite(buf, 1, bytes, out) != bytes) {
-			fprintf(stderr, "Failed to write %zu B to the output file\n", bytes);
-			err = -EIO;
-			goto err_close;
-		}
-		length += bytes;
+	length = fw_io_copy(out, in, FW_IO_ALL, NULL, NULL);
+	if (length < 0) {
+		fprintf(stderr, "Failed to write the kernel to the output file\n");
+		err = -EIO;
+		goto err_close;
 	}
 
 	header.boot_load_addr = cpu_to_le32(0x00080000);
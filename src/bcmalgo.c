@@ -9,6 +9,7 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include "bcmalgo.h"
+#include "fw_crc32.h"
 
 
 #define UTIL_VERSION "0.1"
@@ -38,57 +39,25 @@ uint16_t reverse_endian16 ( uint16_t data )
 
 
 
+/* CRC-32/BZIP2: MSB-first, initial value and final xor 0xffffffff */
 uint32_t get_buffer_crc ( char* filebuffer,size_t size )
 {
-
-	long crc=0xffffffffL;
-	long crcxor = 0xffffffffL;
-	long num4 = 0xffffffffL;
-	long num5 = size;
-	long num6 = 0x4c11db7L;
-	long num7 = 0x80000000L;
-	int i;
-	long j;
-	for ( i = 0; i < ( num5 ); i++ )
-	{
-		long num2 = filebuffer[i];
-		for ( j = 0x80L; j != 0L; j = j >> 1 )
-		{
-			long num3 = crc & num7;
-			crc = crc << 1;
-			if ( ( num2 & j ) != 0L )
-			{
-				num3 ^= num7;
-			}
-			if ( num3 != 0L )
-			{
-				crc ^= num6;
-			}
-		}
-	}
-	crc ^= crcxor;
-	crc &= num4;
-
-	uint8_t b1 = ( uint8_t ) ( ( crc & -16777216L ) >> 0x18 );
-	uint8_t b2 = ( uint8_t ) ( ( crc & 0xff0000L ) >> 0x10 );
-	uint8_t b3 = ( uint8_t ) ( ( crc & 0xff00L ) >> 8 );
-	uint8_t b4 = ( uint8_t ) ( crc & 0xffL );
-	int32_t crc_result = ( b1 | b2 << 8| b3 << 16| b4 <<24 );
-	return reverse_endian32 ( crc_result );
+	return fw_crc32_be ( 0xffffffff, filebuffer, size ) ^ 0xffffffff;
 }
 
 //Thnx to Vector for the algo.
 uint32_t get_file_crc ( char* filename )
 {
-	struct stat buf;
-	stat ( filename,&buf );
-	char* filebuffer = malloc ( buf.st_size+10 );
+	char buf[0x10000];
+	uint32_t crc = 0xffffffff;
+	size_t bytes;
 	FILE* fd = fopen ( filename,"r" );
-	fread ( filebuffer, 1, buf.st_size,fd );
+	if ( !fd )
+		return 0;
+	while ( ( bytes = fread ( buf, 1, sizeof ( buf ), fd ) ) > 0 )
+		crc = fw_crc32_be ( crc, buf, bytes );
 	fclose ( fd );
-	uint32_t crc = get_buffer_crc ( filebuffer,buf.st_size );
-	free ( filebuffer );
-	return crc;
+	return crc ^ 0xffffffff;
 }
 
 
@@ -133,7 +102,7 @@ uint16_t get_hcs ( ldr_header_t* hd )
 
 ldr_header_t* construct_header ( uint32_t magic, uint16_t rev_maj,uint16_t rev_min, uint32_t build_date, uint32_t filelen, uint32_t ldaddress, const char* filename, uint32_t crc_data )
 {
-	ldr_header_t* hd = malloc ( sizeof ( ldr_header_t ) );
+	ldr_header_t* hd = calloc ( 1, sizeof ( ldr_header_t ) );
 	hd->magic=reverse_endian16 ( magic );
 	hd->control=0; //FixMe: Make use of it once compression is around
 	hd->rev_min = reverse_endian16 ( rev_min );
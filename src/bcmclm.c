@@ -6,6 +6,7 @@
 #include <byteswap.h>
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -15,6 +16,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_scan.h"
+
 #if !defined(__BYTE_ORDER)
 #error "Unknown byte order"
 #endif
@@ -156,13 +161,75 @@ static void bcmclm_close(FILE *fp)
  * Existing CLM parser
  **************************************************/
 
+struct bcmclm_scan {
+	const struct fw_io_map *map;
+	size_t offset;
+};
+
+static int bcmclm_search_match(void *priv, unsigned int pattern, size_t offset)
+{
+	struct bcmclm_scan *scan = priv;
+	uint32_t unk;
+
+	if (offset + 12 > scan->map->len)
+		return 0;
+
+	unk = le32_to_cpu(*(uint32_t *)(&scan->map->data[offset + 8]));
+	if (unk & 0xff00ffff)
+		return 0;
+
+	scan->offset = offset;
+
+	return 1;
+}
+
+/* Finds a 4-aligned CLM header anywhere in a mapping of the whole file */
+static int bcmclm_search_map(FILE *fp, struct bcmclm_info *info)
+{
+	static const struct fw_scan_pattern clm_pattern = {
+		.magic = BCMCLM_MAGIC,
+		.len = 8,
+		.align = 4,
+	};
+	struct bcmclm_scan scan = {};
+	struct fw_io_map map;
+	struct stat st;
+	int found;
+
+	if (fstat(fileno(fp), &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return 1;
+	if (fw_io_map(&map, fileno(fp), 0, st.st_size))
+		return 1;
+
+	scan.map = &map;
+	found = fw_scan(map.data, map.len, &clm_pattern, 1, bcmclm_search_match, &scan);
+	fw_io_unmap(&map);
+
+	if (!found)
+		return -ENOENT;
+
+	info->clm_offset = scan.offset;
+
+	return 0;
+}
+
 static int bcmclm_search(FILE *fp, struct bcmclm_info *info)
 {
 	uint8_t buf[1024];
 	size_t offset = 0;
 	size_t bytes;
+	int err;
 	int i;
 
+	err = bcmclm_search_map(fp, info);
+	if (err <= 0) {
+		if (!err) {
+			printf("Found CLM at offset 0x%zx\n", info->clm_offset);
+			printf("\n");
+		}
+		return err;
+	}
+
 	while ((bytes = fread(buf, 1, sizeof(buf), fp)) == sizeof(buf)) {
 		for (i = 0; i < bytes - 12; i += 4) {
 			uint32_t unk = le32_to_cpu(*(uint32_t *)(&buf[i + 8]));
@@ -227,6 +294,195 @@ static int bcmclm_parse(FILE *fp, struct bcmclm_info *info)
 	return 0;
 }
 
+/**************************************************
+ * JSON info about many CLMs
+ **************************************************/
+
+struct bcmclm_job {
+	char *path;
+	bool search;
+	char *out;
+	size_t out_len;
+	bool failed;
+};
+
+static void bcmclm_json_string(FILE *out, const char *s, size_t len)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < len && s[i]; i++) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20 || c >= 0x7f)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+static void bcmclm_json_field(FILE *out, const char *key, const char *s, size_t len)
+{
+	fprintf(out, ",\"%s\":", key);
+	bcmclm_json_string(out, s, len);
+}
+
+/*
+ * bcmclm_search() and bcmclm_parse() on a mapping of the whole file, with
+ * what bcmclm_info() prints written as JSON. Returns NULL or an error
+ * message.
+ */
+static const char *bcmclm_json_map(struct bcmclm_job *job, FILE *out, const struct fw_io_map *map)
+{
+	static const struct fw_scan_pattern clm_pattern = {
+		.magic = BCMCLM_MAGIC,
+		.len = 8,
+		.align = 4,
+	};
+	const struct bcmclm_lookup_table *lookup_table;
+	const struct bcmclm_header *header;
+	struct bcmclm_scan scan = {
+		.map = map,
+	};
+	size_t offsets_fixup;
+	size_t offset;
+
+	if (job->search &&
+	    fw_scan(map->data, map->len, &clm_pattern, 1, bcmclm_search_match, &scan) <= 0)
+		return "Failed to find CLM in input file";
+
+	if (scan.offset + sizeof(*header) > map->len)
+		return "Failed to read CLM header";
+
+	header = (const void *)(map->data + scan.offset);
+	if (strncmp(header->magic, BCMCLM_MAGIC, 8))
+		return "Invalid CLM header magic";
+
+	offsets_fixup = scan.offset - le32_to_cpu(header->virtual_header_address);
+
+	fprintf(out, ",\"offset\":%zu", scan.offset);
+	bcmclm_json_field(out, "api", header->api, sizeof(header->api));
+	bcmclm_json_field(out, "compiler", header->compiler, sizeof(header->compiler));
+	bcmclm_json_field(out, "clm_import_ver", header->clm_import_ver, sizeof(header->clm_import_ver));
+	bcmclm_json_field(out, "manufacturer", header->manufacturer, sizeof(header->manufacturer));
+	fprintf(out, ",\"virtual_header_address\":%u,\"virtual_lookup_table_address\":%u",
+		le32_to_cpu(header->virtual_header_address), le32_to_cpu(header->lookup_table_address));
+
+	offset = le32_to_cpu(header->lookup_table_address) + offsets_fixup;
+	if (offset > map->len || map->len - offset < sizeof(*lookup_table))
+		return "Failed to read lookup table";
+	lookup_table = (const void *)(map->data + offset);
+
+	if (lookup_table->offset_creation_date) {
+		offset = le32_to_cpu(lookup_table->offset_creation_date) + offsets_fixup;
+		if (offset < map->len)
+			bcmclm_json_field(out, "creation_date", (const char *)map->data + offset,
+					  bcmclm_min(64, map->len - offset));
+	}
+
+	return NULL;
+}
+
+static void bcmclm_job(void *arg, unsigned int idx)
+{
+	struct bcmclm_job *job = (struct bcmclm_job *)arg + idx;
+	struct fw_io_map map = {};
+	const char *msg = NULL;
+	struct stat st;
+	FILE *out;
+	int fd;
+
+	out = open_memstream(&job->out, &job->out_len);
+	if (!out) {
+		job->failed = true;
+		return;
+	}
+
+	fprintf(out, "{\"file\":");
+	bcmclm_json_string(out, job->path, strlen(job->path));
+
+	fd = open(job->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		msg = strerror(errno);
+	} else {
+		fprintf(out, ",\"size\":%jd", (intmax_t)st.st_size);
+		if (fw_io_map(&map, fd, 0, st.st_size))
+			msg = "Failed to map CLM";
+		else
+			msg = bcmclm_json_map(job, out, &map);
+	}
+
+	if (msg) {
+		bcmclm_json_field(out, "error", msg, strlen(msg));
+		job->failed = true;
+	}
+	fputc('}', out);
+	fclose(out);
+
+	fw_io_unmap(&map);
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * Parses the given files, and every regular file under the given
+ * directories, each from a mapping on the worker pool, and prints them as
+ * one JSON array in path order.
+ */
+static int bcmclm_json(int argc, char **argv, bool search)
+{
+	struct bcmclm_job *jobs;
+	char **paths = NULL;
+	size_t n = 0;
+	size_t i;
+	int err = 0;
+	int ret = 0;
+	int j;
+
+	for (j = 0; j < argc; j++) {
+		err = fw_io_walk(argv[j], &paths, &n);
+		if (err) {
+			fprintf(stderr, "Failed to read %s: %d\n", argv[j], err);
+			ret = err;
+		}
+	}
+
+	jobs = calloc(n ? n : 1, sizeof(*jobs));
+	if (!jobs) {
+		fprintf(stderr, "Failed to allocate jobs\n");
+		for (i = 0; i < n; i++)
+			free(paths[i]);
+		free(paths);
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		jobs[i].path = paths[i];
+		jobs[i].search = search;
+	}
+
+	fw_pool_run(n, bcmclm_job, jobs);
+
+	printf("[");
+	for (i = 0; i < n; i++) {
+		printf("%s\n", i ? "," : "");
+		if (jobs[i].out)
+			fwrite(jobs[i].out, 1, jobs[i].out_len, stdout);
+		else
+			printf("null");
+		if (jobs[i].failed && !ret)
+			ret = -EPROTO;
+		free(jobs[i].out);
+		free(jobs[i].path);
+	}
+	printf("\n]\n");
+
+	free(paths);
+	free(jobs);
+
+	return ret;
+}
+
 /**************************************************
  * Info
  **************************************************/
@@ -253,11 +509,12 @@ static int bcmclm_info(int argc, char **argv)
 	struct bcmclm_info info = {};
 	const char *pathname = NULL;
 	int search = 0;
+	bool json = false;
 	FILE *fp;
 	int c;
 	int err = 0;
 
-	while ((c = getopt(argc, argv, "i:s")) != -1) {
+	while ((c = getopt(argc, argv, "i:sJ")) != -1) {
 		switch (c) {
 		case 'i':
 			pathname = optarg;
@@ -265,7 +522,18 @@ static int bcmclm_info(int argc, char **argv)
 		case 's':
 			search = 1;
 			break;
+		case 'J':
+			json = true;
+			break;
+		}
+	}
+
+	if (json) {
+		if (optind == argc) {
+			fprintf(stderr, "No CLMs given for -J\n");
+			return -EINVAL;
 		}
+		return bcmclm_json(argc - optind, argv + optind, search);
 	}
 
 	fp = bcmclm_open(pathname, "r");
@@ -317,10 +585,12 @@ static void usage()
 	printf("\tbcmclm info <options>\n");
 	printf("\t-i <file>\t\t\t\t\tinput CLM\n");
 	printf("\t-s\t\t\t\t\tsearch for CLM data in bigger file\n");
+	printf("\t-J <file|dir>...\t\t\t\tparse many CLMs, report as JSON\n");
 	printf("\n");
 	printf("Examples:\n");
 	printf("\tbcmclm info -i x.clm\n");
 	printf("\tbcmclm info -s -i brcmfmac4366c-pcie.bin\n");
+	printf("\tbcmclm info -s -J /lib/firmware/brcm/\n");
 }
 
 int main(int argc, char **argv)
@@ -10,8 +10,13 @@
 #include <libgen.h>
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "buffalo-lib.h"
+#include "fw_io.h"
 
 #define ERR(fmt, args...) do { \
 	fflush(0); \
@@ -57,42 +62,118 @@ void usage(int status)
 	exit(status);
 }
 
-static int decrypt_file(void)
+#define STREAM_CHUNK_LEN	(64 * 1024)
+
+static unsigned char stream_buf[STREAM_CHUNK_LEN];
+
+/*
+ * Regular files are mapped instead: the data goes from the input mapping
+ * straight into a shared mapping of the output, with no copies through
+ * stdio or stream_buf. These return 1 when a file can't be mapped, e.g.
+ * a pipe, so the caller can stream it instead.
+ */
+static int output_is_regular(void)
 {
-	struct enc_param ep;
-	ssize_t src_len;
-	unsigned char *buf = NULL;
-	int err;
-	int ret = -1;
+	struct stat st;
 
-	src_len = get_file_size(ifname);
-	if (src_len < 0) {
+	return stat(ofname, &st) || S_ISREG(st.st_mode);
+}
+
+/* Create the output with len bytes, all zero, and map it */
+static unsigned char *map_output(int *fd, size_t len)
+{
+	void *map;
+
+	*fd = open(ofname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (*fd < 0)
+		return NULL;
+
+	if (ftruncate(*fd, len))
+		goto err;
+	if (!len)
+		return (unsigned char *) "";
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (map != MAP_FAILED)
+		return map;
+
+err:
+	close(*fd);
+	unlink(ofname);
+	return NULL;
+}
+
+static void unmap_output(int fd, unsigned char *map, size_t len)
+{
+	if (len)
+		munmap(map, len);
+	close(fd);
+}
+
+static int decrypt_file_map(void)
+{
+	struct fw_io_map in;
+	struct bcrypt_ctx ctx;
+	struct enc_param ep;
+	unsigned char *src, *out;
+	unsigned long hdrlen;
+	uint32_t csum;
+	ssize_t len;
+	int fd, ret = -1;
+
+	len = get_file_size(ifname);
+	if (len < 0) {
 		ERR("unable to get size of '%s'", ifname);
-		goto out;
+		return -1;
 	}
 
-	buf = malloc(src_len);
-	if (buf == NULL) {
-		ERR("no memory for the buffer");
-		goto out;
-	}
+	if (!output_is_regular() || len <= offset)
+		return 1;
 
-	err = read_file_to_buf(ifname, buf, src_len);
-	if (err) {
+	fd = open(ifname, O_RDONLY);
+	if (fd < 0) {
 		ERR("unable to read from file '%s'", ifname);
-		goto out;
+		return -1;
 	}
+	ret = fw_io_map(&in, fd, 0, len);
+	close(fd);
+	if (ret)
+		return 1;
+	ret = -1;
+
+	src = (unsigned char *) in.data + offset;
+	len -= offset;
 
 	memset(&ep, '\0', sizeof(ep));
 	ep.key = (unsigned char *) crypt_key;
 	ep.longstate = longstate;
 
-	err = decrypt_buf(&ep, buf + offset, src_len - offset);
-	if (err) {
+	if (decrypt_hdr(&ep, src, len, &hdrlen, &ctx)) {
 		ERR("unable to decrypt '%s'", ifname);
 		goto out;
 	}
 
+	if (len - hdrlen < ep.datalen + sizeof(uint32_t)) {
+		ERR("unable to decrypt '%s'", ifname);
+		goto out_ctx;
+	}
+
+	out = map_output(&fd, ep.datalen);
+	if (!out) {
+		ERR("unable to write to file '%s'", ofname);
+		goto out_ctx;
+	}
+
+	csum = decrypt_data(&ctx, ep.datalen, src + hdrlen, out, ep.datalen);
+	unmap_output(fd, out, ep.datalen);
+
+	ep.csum = decrypt_trailer(src + hdrlen + ep.datalen);
+	if (csum != ep.csum) {
+		ERR("unable to decrypt '%s'", ifname);
+		unlink(ofname);
+		goto out_ctx;
+	}
+
 	printf("Magic\t\t: '%s'\n", ep.magic);
 	printf("Seed\t\t: 0x%02x\n", ep.seed);
 	printf("Product\t\t: '%s'\n", ep.product);
@@ -100,91 +181,317 @@ static int decrypt_file(void)
 	printf("Data len\t: %u\n", ep.datalen);
 	printf("Checksum\t: 0x%08x\n", ep.csum);
 
-	err = write_buf_to_file(ofname, buf + offset, ep.datalen);
-	if (err) {
+	ret = 0;
+
+out_ctx:
+	bcrypt_finish(&ctx);
+out:
+	fw_io_unmap(&in);
+	return ret;
+}
+
+static int encrypt_file_map(ssize_t data_len, ssize_t tail_len)
+{
+	struct fw_io_map in;
+	struct bcrypt_ctx ctx;
+	struct enc_param ep;
+	unsigned char *src, *out;
+	ssize_t totlen;
+	uint32_t hdrlen;
+	int fd, ret;
+
+	if (!output_is_regular() || !data_len)
+		return 1;
+
+	fd = open(ifname, O_RDONLY);
+	if (fd < 0) {
+		ERR("unable to read from file '%s'", ifname);
+		return -1;
+	}
+	ret = fw_io_map(&in, fd, 0, data_len + tail_len);
+	close(fd);
+	if (ret)
+		return 1;
+	ret = -1;
+	src = (unsigned char *) in.data;
+
+	totlen = enc_compute_buf_len(product, version, data_len);
+	hdrlen = enc_compute_header_len(product, version);
+
+	memset(&ep, '\0', sizeof(ep));
+	ep.key = (unsigned char *) crypt_key;
+	ep.seed = seed;
+	ep.longstate = longstate;
+	ep.datalen = data_len;
+	strcpy((char *) ep.magic, magic);
+	strcpy((char *) ep.product, product);
+	strcpy((char *) ep.version, version);
+
+	out = map_output(&fd, totlen + tail_len);
+	if (!out) {
 		ERR("unable to write to file '%s'", ofname);
 		goto out;
 	}
 
+	if (encrypt_hdr(&ep, out, &ctx)) {
+		ERR("invalid input file");
+		unmap_output(fd, out, totlen + tail_len);
+		unlink(ofname);
+		goto out;
+	}
+
+	/* checksum, zero padding up to totlen, then the -S tail */
+	ep.csum = encrypt_data(&ctx, data_len, src, out + hdrlen, data_len);
+	encrypt_trailer(&ep, out + hdrlen + data_len);
+	memcpy(out + totlen, src + data_len, tail_len);
+
+	bcrypt_finish(&ctx);
+	unmap_output(fd, out, totlen + tail_len);
+
 	ret = 0;
 
 out:
-	free(buf);
+	fw_io_unmap(&in);
 	return ret;
 }
 
-static int encrypt_file(void)
+/*
+ * Otherwise both directions work on fixed-size chunks, so memory use does
+ * not depend on the image size: the header only depends on the parameters
+ * and the data length, and the checksum trails the data.
+ */
+static int decrypt_file(void)
 {
+	unsigned char hdr[DEC_MAX_HEADER_LEN];
+	struct bcrypt_ctx ctx;
 	struct enc_param ep;
-	ssize_t src_len, tail_dst, tail_len, tail_src;
-	unsigned char *buf;
-	uint32_t hdrlen;
-	ssize_t totlen = 0;
+	FILE *in = NULL, *out = NULL;
+	unsigned long hdrlen;
+	uint32_t csum;
+	size_t n, remain;
 	int err;
 	int ret = -1;
 
-	src_len = get_file_size(ifname);
-	if (src_len < 0) {
+	if (get_file_size(ifname) < 0) {
 		ERR("unable to get size of '%s'", ifname);
 		goto out;
 	}
 
-	if (size) {
-		tail_dst = enc_compute_buf_len(product, version, size);
-		tail_len = src_len - size;
-		totlen = tail_dst + tail_len;
-	} else
-		totlen = enc_compute_buf_len(product, version, src_len);
-
-	buf = malloc(totlen);
-	if (buf == NULL) {
-		ERR("no memory for the buffer");
+	in = fopen(ifname, "r");
+	if (in == NULL || fseek(in, offset, SEEK_SET)) {
+		ERR("unable to read from file '%s'", ifname);
 		goto out;
 	}
 
-	hdrlen = enc_compute_header_len(product, version);
+	n = fread(hdr, 1, sizeof(hdr), in);
+
+	memset(&ep, '\0', sizeof(ep));
+	ep.key = (unsigned char *) crypt_key;
+	ep.longstate = longstate;
 
-	err = read_file_to_buf(ifname, &buf[hdrlen], src_len);
+	err = decrypt_hdr(&ep, hdr, n, &hdrlen, &ctx);
 	if (err) {
-		ERR("unable to read from file '%s'", ofname);
-		goto free_buf;
+		ERR("unable to decrypt '%s'", ifname);
+		goto out;
+	}
+
+	if (fseek(in, offset + hdrlen, SEEK_SET)) {
+		ERR("unable to read from file '%s'", ifname);
+		goto out_ctx;
 	}
 
-	if (size) {
-		tail_src = hdrlen + size;
-		memmove(&buf[tail_dst], &buf[tail_src], tail_len);
-		memset(&buf[tail_src], 0, tail_dst - tail_src);
-		src_len = size;
+	out = fopen(ofname, "w");
+	if (out == NULL) {
+		ERR("unable to write to file '%s'", ofname);
+		goto out_ctx;
+	}
+
+	csum = ep.datalen;
+	for (remain = ep.datalen; remain > 0; remain -= n) {
+		n = fread(stream_buf, 1, remain < STREAM_CHUNK_LEN ?
+					 remain : STREAM_CHUNK_LEN, in);
+		if (!n)
+			goto err_decrypt;
+
+		bcrypt_process(&ctx, stream_buf, stream_buf, n);
+		csum = buffalo_csum(csum, stream_buf, n);
+
+		if (fwrite(stream_buf, n, 1, out) != 1)
+			goto err_write;
+	}
+
+	if (fread(hdr, sizeof(uint32_t), 1, in) != 1)
+		goto err_decrypt;
+	ep.csum = decrypt_trailer(hdr);
+	if (csum != ep.csum)
+		goto err_decrypt;
+
+	if (fflush(out))
+		goto err_write;
+
+	printf("Magic\t\t: '%s'\n", ep.magic);
+	printf("Seed\t\t: 0x%02x\n", ep.seed);
+	printf("Product\t\t: '%s'\n", ep.product);
+	printf("Version\t\t: '%s'\n", ep.version);
+	printf("Data len\t: %u\n", ep.datalen);
+	printf("Checksum\t: 0x%08x\n", ep.csum);
+
+	ret = 0;
+	goto out_ctx;
+
+err_decrypt:
+	ERR("unable to decrypt '%s'", ifname);
+	goto err_unlink;
+err_write:
+	ERR("unable to write to file '%s'", ofname);
+err_unlink:
+	fclose(out);
+	out = NULL;
+	unlink(ofname);
+out_ctx:
+	if (out)
+		fclose(out);
+	bcrypt_finish(&ctx);
+out:
+	if (in)
+		fclose(in);
+	return ret;
+}
+
+/*
+ * data_len bytes of the input are encrypted, the tail_len bytes after them
+ * (-S) are appended unencrypted after the checksum and padding.
+ */
+static int encrypt_file_stream(ssize_t data_len, ssize_t tail_len)
+{
+	unsigned char *hdr = NULL;
+	struct bcrypt_ctx ctx;
+	struct enc_param ep;
+	FILE *in = NULL, *out = NULL;
+	ssize_t totlen, remain;
+	uint32_t hdrlen;
+	size_t n;
+	int ret = -1;
+
+	totlen = enc_compute_buf_len(product, version, data_len);
+	hdrlen = enc_compute_header_len(product, version);
+
+	hdr = calloc(1, hdrlen);
+	if (hdr == NULL) {
+		ERR("no memory for the buffer");
+		goto out;
 	}
 
 	memset(&ep, '\0', sizeof(ep));
 	ep.key = (unsigned char *) crypt_key;
 	ep.seed = seed;
 	ep.longstate = longstate;
-	ep.csum = buffalo_csum(src_len, &buf[hdrlen], src_len);
-	ep.datalen = src_len;
+	ep.csum = data_len;
+	ep.datalen = data_len;
 	strcpy((char *) ep.magic, magic);
 	strcpy((char *) ep.product, product);
 	strcpy((char *) ep.version, version);
 
-	err = encrypt_buf(&ep, buf, &buf[hdrlen]);
-	if (err) {
+	if (encrypt_hdr(&ep, hdr, &ctx)) {
 		ERR("invalid input file");
-		goto free_buf;
+		goto out;
 	}
 
-	err = write_buf_to_file(ofname, buf, totlen);
-	if (err) {
+	in = fopen(ifname, "r");
+	if (in == NULL) {
+		ERR("unable to read from file '%s'", ifname);
+		goto out_ctx;
+	}
+
+	out = fopen(ofname, "w");
+	if (out == NULL) {
 		ERR("unable to write to file '%s'", ofname);
-		goto free_buf;
+		goto out_ctx;
 	}
 
-	ret = 0;
+	if (fwrite(hdr, hdrlen, 1, out) != 1)
+		goto err_write;
+
+	for (remain = data_len; remain > 0; remain -= n) {
+		n = fread(stream_buf, 1, remain < STREAM_CHUNK_LEN ?
+					 remain : STREAM_CHUNK_LEN, in);
+		if (!n)
+			goto err_read;
+
+		ep.csum = buffalo_csum(ep.csum, stream_buf, n);
+		bcrypt_process(&ctx, stream_buf, stream_buf, n);
+
+		if (fwrite(stream_buf, n, 1, out) != 1)
+			goto err_write;
+	}
+
+	/* checksum followed by zero padding up to totlen */
+	n = totlen - hdrlen - data_len;
+	memset(stream_buf, 0, n);
+	encrypt_trailer(&ep, stream_buf);
+	if (fwrite(stream_buf, n, 1, out) != 1)
+		goto err_write;
+
+	for (remain = tail_len; remain > 0; remain -= n) {
+		n = fread(stream_buf, 1, remain < STREAM_CHUNK_LEN ?
+					 remain : STREAM_CHUNK_LEN, in);
+		if (!n)
+			goto err_read;
+
+		if (fwrite(stream_buf, n, 1, out) != 1)
+			goto err_write;
+	}
 
-free_buf:
- 	free(buf);
+	if (fflush(out))
+		goto err_write;
+
+	ret = 0;
+	goto out_ctx;
+
+err_read:
+	ERR("unable to read from file '%s'", ifname);
+	goto err_unlink;
+err_write:
+	ERR("unable to write to file '%s'", ofname);
+err_unlink:
+	fclose(out);
+	out = NULL;
+	unlink(ofname);
+out_ctx:
+	if (out)
+		fclose(out);
+	if (in)
+		fclose(in);
+	bcrypt_finish(&ctx);
 out:
- 	return ret;
+	free(hdr);
+	return ret;
+}
+
+static int encrypt_file(void)
+{
+	ssize_t src_len;
+	int ret;
+
+	src_len = get_file_size(ifname);
+	if (src_len < 0) {
+		ERR("unable to get size of '%s'", ifname);
+		return -1;
+	}
+
+	if (!size)
+		size = src_len;
+
+	if (size > src_len) {
+		ERR("size %d is larger than '%s'", size, ifname);
+		return -1;
+	}
+
+	ret = encrypt_file_map(size, src_len - size);
+	if (ret <= 0)
+		return ret;
+
+	return encrypt_file_stream(size, src_len - size);
 }
 
 static int check_params(void)
@@ -303,9 +610,11 @@ int main(int argc, char *argv[])
 	if (err)
 		goto out;
 
-	if (do_decrypt)
-		err = decrypt_file();
-	else
+	if (do_decrypt) {
+		err = decrypt_file_map();
+		if (err > 0)
+			err = decrypt_file();
+	} else
 		err = encrypt_file();
 
 	if (err)
@@ -11,74 +11,102 @@
 #include <sys/stat.h>
 
 #include "buffalo-lib.h"
+#include "fw_crc32.h"
+#include "fw_io.h"
 
-static uint32_t crc32_table[256] =
-{
-	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
-	0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
-	0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
-	0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
-	0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9,
-	0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
-	0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011,
-	0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
-	0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
-	0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
-	0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81,
-	0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
-	0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49,
-	0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
-	0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
-	0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
-	0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae,
-	0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
-	0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16,
-	0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
-	0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
-	0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
-	0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066,
-	0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
-	0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e,
-	0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
-	0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
-	0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
-	0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e,
-	0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
-	0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686,
-	0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
-	0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
-	0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
-	0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f,
-	0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
-	0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47,
-	0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
-	0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
-	0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
-	0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7,
-	0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
-	0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f,
-	0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
-	0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
-	0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
-	0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f,
-	0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
-	0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640,
-	0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
-	0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
-	0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
-	0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30,
-	0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
-	0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088,
-	0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
-	0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
-	0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
-	0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18,
-	0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
-	0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0,
-	0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
-	0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
-	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
-};
+/*
+ * buffalo_csum() is a reflected CRC-32 where every data byte is sign
+ * extended before it is mixed in. By linearity that is the plain CRC with
+ * 0x00ffffff injected after each byte that has its top bit set, so the CRC
+ * itself is left to fw_crc32() and only the injected term is tracked here:
+ * csum_adv8 advances it over eight bytes, csum_inj8 holds the combined
+ * injection for each possible set of top bits in an eight byte word.
+ */
+static uint32_t csum_adv8[4][256];
+static uint32_t csum_inj8[256];
+
+static uint32_t csum_adv1(uint32_t c)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		c = (c >> 1) ^ ((c & 1) ? 0xedb88320ul : 0);
+
+	return c;
+}
+
+__attribute__((constructor))
+static void buffalo_csum_init(void)
+{
+	uint32_t inj[8];
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < 256; j++) {
+			int k;
+
+			c = (uint32_t)j << (8 * i);
+			for (k = 0; k < 8; k++)
+				c = csum_adv1(c);
+			csum_adv8[i][j] = c;
+		}
+	}
+
+	/* inj[n]: 0x00ffffff injected after byte n, advanced to the word end */
+	c = 0x00ffffff;
+	for (i = 7; i >= 0; i--) {
+		inj[i] = c;
+		c = csum_adv1(c);
+	}
+
+	for (i = 0; i < 256; i++) {
+		c = 0;
+		for (j = 0; j < 8; j++)
+			if (i & (1 << j))
+				c ^= inj[j];
+		csum_inj8[i] = c;
+	}
+}
+
+static inline uint32_t csum_fix_word(uint32_t fix, const unsigned char *p)
+{
+	uint64_t w;
+	unsigned int m;
+
+	memcpy(&w, p, sizeof(w));
+	w = (w >> 7) & 0x0101010101010101ull;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	/* gather the eight top bits, byte n ends up in bit n */
+	m = (w * 0x0102040810204080ull) >> 56;
+
+	return csum_adv8[0][fix & 0xff] ^ csum_adv8[1][(fix >> 8) & 0xff] ^
+	       csum_adv8[2][(fix >> 16) & 0xff] ^ csum_adv8[3][fix >> 24] ^
+	       csum_inj8[m];
+}
+
+static uint32_t csum_fix(uint32_t fix, const unsigned char *p,
+			 unsigned long len)
+{
+	for (; len >= 8; len -= 8, p += 8)
+		fix = csum_fix_word(fix, p);
+
+	while (len--) {
+		fix = csum_adv1(fix);
+		if (*p++ & 0x80)
+			fix ^= 0x00ffffff;
+	}
+
+	return fix;
+}
+
+
+static int bcrypt_process_generic(struct bcrypt_ctx *ctx, unsigned char *src,
+				  unsigned char *dst, unsigned long len);
+static int bcrypt_process_256(struct bcrypt_ctx *ctx, unsigned char *src,
+			      unsigned char *dst, unsigned long len);
 
 int bcrypt_init(struct bcrypt_ctx *ctx, void *key, int keylen,
 		unsigned long state_len)
@@ -96,6 +124,8 @@ int bcrypt_init(struct bcrypt_ctx *ctx, void *key, int keylen,
 	ctx->j = 0;
 	ctx->state = state;
 	ctx->state_len = state_len;
+	ctx->process = (state_len == 256) ? bcrypt_process_256 :
+					    bcrypt_process_generic;
 
 	for (i = 0; i < state_len; i++)
 		state[i] = i;
@@ -112,8 +142,8 @@ int bcrypt_init(struct bcrypt_ctx *ctx, void *key, int keylen,
 	return 0;
 }
 
-int bcrypt_process(struct bcrypt_ctx *ctx, unsigned char *src,
-		   unsigned char *dst, unsigned long len)
+static int bcrypt_process_generic(struct bcrypt_ctx *ctx, unsigned char *src,
+				  unsigned char *dst, unsigned long len)
 {
 	unsigned char *state = ctx->state;
 	unsigned long state_len = ctx->state_len;
@@ -141,19 +171,65 @@ int bcrypt_process(struct bcrypt_ctx *ctx, unsigned char *src,
 	return len;
 }
 
+/*
+ * With the usual 256 byte state all the modulo operations are just byte
+ * wrap-around, so let uint8_t arithmetic do them.
+ */
+#define BCRYPT_STEP_256(n) do {					\
+	i++;							\
+	si = state[i];						\
+	j += si;						\
+	sj = state[j];						\
+	state[i] = sj;						\
+	state[j] = si;						\
+	dst[k + (n)] = src[k + (n)] ^ state[(uint8_t)(si + sj)];	\
+} while (0)
+
+static int bcrypt_process_256(struct bcrypt_ctx *ctx, unsigned char *src,
+			      unsigned char *dst, unsigned long len)
+{
+	unsigned char *state = ctx->state;
+	uint8_t i, j, si, sj;
+	unsigned long k = 0;
+
+	i = ctx->i;
+	j = ctx->j;
+
+	for (; k + 4 <= len; k += 4) {
+		BCRYPT_STEP_256(0);
+		BCRYPT_STEP_256(1);
+		BCRYPT_STEP_256(2);
+		BCRYPT_STEP_256(3);
+	}
+
+	for (; k < len; k++)
+		BCRYPT_STEP_256(0);
+
+	ctx->i = i;
+	ctx->j = j;
+
+	return len;
+}
+
+#undef BCRYPT_STEP_256
+
+int bcrypt_process(struct bcrypt_ctx *ctx, unsigned char *src,
+		   unsigned char *dst, unsigned long len)
+{
+	return ctx->process(ctx, src, dst, len);
+}
+
 void bcrypt_finish(struct bcrypt_ctx *ctx)
 {
 	if (ctx->state)
 		free(ctx->state);
 }
 
-int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
-	       unsigned char *dst, unsigned long len, int longstate)
+int bcrypt_seed_init(struct bcrypt_ctx *ctx, unsigned char seed,
+		     unsigned char *key, unsigned long state_len)
 {
 	unsigned char bckey[BCRYPT_MAX_KEYLEN + 1];
 	unsigned int keylen;
-	struct bcrypt_ctx ctx;
-	int ret;
 
 	/* setup decryption key */
 	keylen = strlen((char *) key);
@@ -162,8 +238,17 @@ int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
 
 	keylen++;
 
-	ret = bcrypt_init(&ctx, bckey, keylen,
-			  (longstate) ? len : BCRYPT_DEFAULT_STATE_LEN);
+	return bcrypt_init(ctx, bckey, keylen, state_len);
+}
+
+int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
+	       unsigned char *dst, unsigned long len, int longstate)
+{
+	struct bcrypt_ctx ctx;
+	int ret;
+
+	ret = bcrypt_seed_init(&ctx, seed, key,
+			       (longstate) ? len : BCRYPT_DEFAULT_STATE_LEN);
 	if (ret)
 		return ret;
 
@@ -175,34 +260,56 @@ int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
 
 uint32_t buffalo_csum(uint32_t csum, void *buf, unsigned long len)
 {
-	signed char *p = buf;
+	return fw_crc32(csum, buf, len) ^ csum_fix(0, buf, len);
+}
 
-	while (len--) {
-		int i;
+uint32_t buffalo_crc_update(uint32_t crc, void *buf, unsigned long len)
+{
+	return fw_crc32_be(crc, buf, len);
+}
+
+uint32_t buffalo_crc_final(uint32_t crc, unsigned long len)
+{
+	unsigned char c;
 
-		csum ^= *p++;
-		for (i = 0; i < 8; i++)
-			csum = (csum >> 1) ^ ((csum & 1) ? 0xedb88320ul : 0);
+	while (len) {
+		c = len & 0xff;
+		crc = fw_crc32_be(crc, &c, 1);
+		len >>= 8;
 	}
 
-	return csum;
+	return ~crc;
 }
 
 uint32_t buffalo_crc(void *buf, unsigned long len)
 {
-	unsigned char *p = buf;
-	unsigned long t = len;
-	uint32_t crc = 0;
-
-	while (len--)
-		crc = (crc << 8) ^ crc32_table[((crc >> 24) ^ *p++) & 0xFF];
+	return buffalo_crc_final(buffalo_crc_update(0, buf, len), len);
+}
 
-	while (t) {
-		crc = (crc << 8) ^ crc32_table[((crc >> 24) ^ t) & 0xFF];
-		t >>= 8;
+void buffalo_csum_crc(uint32_t *csum, uint32_t *crc, void *buf,
+		      unsigned long len)
+{
+	unsigned char *p = buf;
+	unsigned long total = len;
+	unsigned long chunk;
+	uint32_t s = *csum;
+	uint32_t fix = 0;
+	uint32_t c = 0;
+
+	/* walk the buffer once, in blocks that stay resident in L2 */
+	while (len) {
+		chunk = len < BUFFALO_CSUM_CHUNK ? len : BUFFALO_CSUM_CHUNK;
+
+		s = fw_crc32(s, p, chunk);
+		fix = csum_fix(fix, p, chunk);
+		c = fw_crc32_be(c, p, chunk);
+
+		p += chunk;
+		len -= chunk;
 	}
 
-	return ~crc;
+	*csum = s ^ fix;
+	*crc = buffalo_crc_final(c, total);
 }
 
 unsigned long enc_compute_header_len(char *product, char *version)
@@ -254,8 +361,8 @@ static int check_magic(void *magic)
 	return -1;
 }
 
-int encrypt_buf(struct enc_param *ep, unsigned char *hdr,
-		unsigned char *data)
+int encrypt_hdr(struct enc_param *ep, unsigned char *hdr,
+		struct bcrypt_ctx *data_ctx)
 {
 	unsigned char *p;
 	uint32_t len;
@@ -302,46 +409,111 @@ int encrypt_buf(struct enc_param *ep, unsigned char *hdr,
 	/* put data length */
 	put_be32(p, ep->datalen);
 
-	/* encrypt data */
-	err = bcrypt_buf(s, ep->key, data, data, ep->datalen, ep->longstate);
+	/* the data is encrypted with the first byte of the encrypted version */
+	err = bcrypt_seed_init(data_ctx, s, ep->key,
+			       (ep->longstate) ? ep->datalen :
+						 BCRYPT_DEFAULT_STATE_LEN);
 	if (err)
 		goto out;
 
-	/* put checksum */
-	put_be32(&data[ep->datalen], ep->csum);
-
 	ret = 0;
 
 out:
 	return ret;
 }
 
-int decrypt_buf(struct enc_param *ep, unsigned char *data,
-		unsigned long datalen)
+void encrypt_trailer(struct enc_param *ep, unsigned char *trailer)
+{
+	put_be32(trailer, ep->csum);
+}
+
+uint32_t encrypt_data(struct bcrypt_ctx *ctx, uint32_t csum,
+		      unsigned char *src, unsigned char *dst,
+		      unsigned long len)
+{
+	unsigned long chunk;
+
+	/* checksum each chunk while it is still in cache from encrypting it */
+	while (len) {
+		chunk = len < BUFFALO_CSUM_CHUNK ? len : BUFFALO_CSUM_CHUNK;
+
+		csum = buffalo_csum(csum, src, chunk);
+		bcrypt_process(ctx, src, dst, chunk);
+
+		src += chunk;
+		dst += chunk;
+		len -= chunk;
+	}
+
+	return csum;
+}
+
+uint32_t decrypt_data(struct bcrypt_ctx *ctx, uint32_t csum,
+		      unsigned char *src, unsigned char *dst,
+		      unsigned long len)
+{
+	unsigned long chunk;
+
+	while (len) {
+		chunk = len < BUFFALO_CSUM_CHUNK ? len : BUFFALO_CSUM_CHUNK;
+
+		bcrypt_process(ctx, src, dst, chunk);
+		csum = buffalo_csum(csum, dst, chunk);
+
+		src += chunk;
+		dst += chunk;
+		len -= chunk;
+	}
+
+	return csum;
+}
+
+int encrypt_buf(struct enc_param *ep, unsigned char *hdr,
+		unsigned char *data)
+{
+	struct bcrypt_ctx ctx;
+	int err;
+
+	err = encrypt_hdr(ep, hdr, &ctx);
+	if (err)
+		return err;
+
+	/* encrypt data */
+	bcrypt_process(&ctx, data, data, ep->datalen);
+	bcrypt_finish(&ctx);
+
+	/* put checksum */
+	encrypt_trailer(ep, &data[ep->datalen]);
+
+	return 0;
+}
+
+int decrypt_hdr(struct enc_param *ep, unsigned char *hdr,
+		unsigned long len, unsigned long *hdrlen,
+		struct bcrypt_ctx *data_ctx)
 {
 	unsigned char *p;
 	uint32_t prod_len;
 	uint32_t ver_len;
-	uint32_t len;
-	uint32_t csum;
+	uint32_t flen;
 	ssize_t remain;
 	int err;
 	int ret = -1;
 
 #define CHECKLEN(_l) do {		\
-	len = (_l);			\
-	if (remain < len) {		\
+	flen = (_l);			\
+	if (remain < flen) {		\
 		goto out;		\
 	}				\
 } while (0)
 
 #define INCP() do {			\
-	p += len;			\
-	remain -= len;			\
+	p += flen;			\
+	remain -= flen;			\
 } while (0)
 
-	remain = datalen;
-	p = data;
+	remain = len;
+	p = hdr;
 
 	CHECKLEN(ENC_MAGIC_LEN);
 	err = check_magic(p);
@@ -378,35 +550,30 @@ int decrypt_buf(struct enc_param *ep, unsigned char *data,
 	ep->datalen = get_be32(p);
 	INCP();
 
-	/* decrypt data */
-	CHECKLEN(ep->datalen);
-	err = bcrypt_buf(ep->version[0], ep->key, p, data, ep->datalen,
-			 ep->longstate);
+	/* the data is decrypted with the first byte of the encrypted version */
+	err = bcrypt_seed_init(data_ctx, ep->version[0], ep->key,
+			       (ep->longstate) ? ep->datalen :
+						 BCRYPT_DEFAULT_STATE_LEN);
 	if (err)
 		goto out;
-	INCP();
-
-	CHECKLEN(sizeof(uint32_t));
-	ep->csum = get_be32(p);
-	INCP();
-
-	csum = buffalo_csum(ep->datalen, data, ep->datalen);
-	if (csum != ep->csum)
-		goto out;
 
 	/* decrypt product name */
 	err = bcrypt_buf(ep->product[0], ep->key, ep->version, ep->version,
 			 ver_len, ep->longstate);
 	if (err)
-		goto out;
+		goto out_ctx;
 
 	/* decrypt version */
 	err = bcrypt_buf(ep->seed, ep->key, ep->product, ep->product, prod_len,
 			 ep->longstate);
 	if (err)
-		goto out;
+		goto out_ctx;
 
-	ret = 0;
+	*hdrlen = p - hdr;
+	return 0;
+
+out_ctx:
+	bcrypt_finish(data_ctx);
 out:
 	return ret;
 
@@ -414,12 +581,46 @@ out:
 #undef INCP
 }
 
+uint32_t decrypt_trailer(unsigned char *trailer)
+{
+	return get_be32(trailer);
+}
+
+int decrypt_buf(struct enc_param *ep, unsigned char *data,
+		unsigned long datalen)
+{
+	struct bcrypt_ctx ctx;
+	unsigned long hdrlen;
+	uint32_t csum;
+	int err;
+
+	err = decrypt_hdr(ep, data, datalen, &hdrlen, &ctx);
+	if (err)
+		return err;
+
+	if (datalen - hdrlen < ep->datalen + sizeof(uint32_t)) {
+		bcrypt_finish(&ctx);
+		return -1;
+	}
+
+	/* decrypt and checksum data, moving it to the start of the buffer */
+	csum = decrypt_data(&ctx, ep->datalen, &data[hdrlen], data,
+			    ep->datalen);
+	bcrypt_finish(&ctx);
+
+	ep->csum = decrypt_trailer(&data[hdrlen + ep->datalen]);
+	if (csum != ep->csum)
+		return -1;
+
+	return 0;
+}
+
 ssize_t get_file_size(char *name)
 {
 	struct stat st;
 	int err;
 
-	err = stat(name, &st);
+	err = fw_io_stat_input(name, &st);
 	if (err)
 		return -1;
 
@@ -436,6 +637,8 @@ int read_file_to_buf(char *name, void *buf, ssize_t buflen)
 	if (f == NULL)
 		goto out;
 
+	fw_io_advise(fileno(f), 0, buflen);
+
 	errno = 0;
 	done = fread(buf, buflen, 1, f);
 	if (done != 1)
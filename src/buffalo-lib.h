@@ -117,6 +117,8 @@ struct bcrypt_ctx {
 	unsigned long j;
 	unsigned char *state;
 	unsigned long state_len;
+	int (*process)(struct bcrypt_ctx *ctx, unsigned char *src,
+		       unsigned char *dst, unsigned long len);
 };
 
 int bcrypt_init(struct bcrypt_ctx *ctx, void *key, int keylen,
@@ -124,12 +126,62 @@ int bcrypt_init(struct bcrypt_ctx *ctx, void *key, int keylen,
 int bcrypt_process(struct bcrypt_ctx *ctx, unsigned char *src,
 		   unsigned char *dst, unsigned long len);
 void bcrypt_finish(struct bcrypt_ctx *ctx);
+int bcrypt_seed_init(struct bcrypt_ctx *ctx, unsigned char seed,
+		     unsigned char *key, unsigned long state_len);
 int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
 	       unsigned char *dst, unsigned long len, int longstate);
 
+/*
+ * encrypt_buf() in pieces, for images that are streamed rather than held in
+ * memory: encrypt_hdr() fills in the header and sets up data_ctx, the data
+ * is then run through bcrypt_process() chunk by chunk, and encrypt_trailer()
+ * stores ep->csum right after it.
+ */
+int encrypt_hdr(struct enc_param *ep, unsigned char *hdr,
+		struct bcrypt_ctx *data_ctx);
+void encrypt_trailer(struct enc_param *ep, unsigned char *trailer);
+
+/*
+ * The data pass of encrypt_buf()/decrypt_buf() between any two buffers,
+ * such as mappings of the input and the output file, or in place when src
+ * and dst are the same. The data is processed in BUFFALO_CSUM_CHUNK pieces
+ * that are checksummed while still in cache. Returns csum updated with
+ * buffalo_csum() of the plain data.
+ */
+uint32_t encrypt_data(struct bcrypt_ctx *ctx, uint32_t csum,
+		      unsigned char *src, unsigned char *dst,
+		      unsigned long len);
+uint32_t decrypt_data(struct bcrypt_ctx *ctx, uint32_t csum,
+		      unsigned char *src, unsigned char *dst,
+		      unsigned long len);
+
+/*
+ * decrypt_buf() in pieces: decrypt_hdr() parses the header from the first
+ * len bytes of hdr, decrypts product and version into ep, stores the header
+ * length in *hdrlen and sets up data_ctx for the ep->datalen bytes of data
+ * that follow it. decrypt_trailer() returns the checksum stored after the
+ * data, to be compared with buffalo_csum() of the decrypted data.
+ */
+#define DEC_MAX_HEADER_LEN	(ENC_MAGIC_LEN + 1 + 4 + ENC_PRODUCT_LEN + \
+				 4 + ENC_VERSION_LEN + 4)
+
+int decrypt_hdr(struct enc_param *ep, unsigned char *hdr,
+		unsigned long len, unsigned long *hdrlen,
+		struct bcrypt_ctx *data_ctx);
+uint32_t decrypt_trailer(unsigned char *trailer);
+
 uint32_t buffalo_csum(uint32_t csum, void *buf, unsigned long len);
 uint32_t buffalo_crc(void *buf, unsigned long len);
 
+/* buffalo_crc() in pieces: start with 0, pass the total length at the end */
+uint32_t buffalo_crc_update(uint32_t crc, void *buf, unsigned long len);
+uint32_t buffalo_crc_final(uint32_t crc, unsigned long len);
+
+/* buffalo_csum() and buffalo_crc() of the same data in one pass */
+#define BUFFALO_CSUM_CHUNK	(64 * 1024)
+void buffalo_csum_crc(uint32_t *csum, uint32_t *crc, void *buf,
+		      unsigned long len);
+
 ssize_t get_file_size(char *name);
 int read_file_to_buf(char *name, void *buf, ssize_t buflen);
 int write_buf_to_file(char *name, void *buf, ssize_t buflen);
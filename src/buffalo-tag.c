@@ -12,6 +12,7 @@
 #include <netinet/in.h>
 
 #include "buffalo-lib.h"
+#include "fw_crc32.h"
 
 #define ERR(fmt, ...) do { \
 	fflush(0); \
@@ -46,6 +47,19 @@ static uint32_t region_mask;
 static int num_regions;
 static int dhp;
 
+/* One tagged output; NULL or empty fields take the -p/-w value */
+struct tag_variant {
+	char *ofname;
+	char *product;
+	char *hwver;
+};
+
+static struct tag_variant *variants;
+static int num_variants;
+
+/* fw_crc32_be() register over the payload, shared by every variant */
+static uint32_t payload_crc;
+
 void usage(int status)
 {
 	FILE *stream = (status != EXIT_SUCCESS) ? stderr : stdout;
@@ -64,6 +78,10 @@ void usage(int status)
 "  -l <language>   set language to <language>\n"
 "  -m <version>    set minor version to <version>\n"
 "  -o <file>       write output to the file <file>\n"
+"  -O <product>:<hwver>:<file>\n"
+"                  also write a variant with this product and hardware\n"
+"                  version to <file>, may be repeated; an empty field keeps\n"
+"                  the -p / -w value\n"
 "  -p <product>    set product to <product>\n"
 "  -r <region>     set image region to <region>\n"
 "		   valid regions: JP, US, EU, AP, TW, KR, M_\n"
@@ -91,10 +109,13 @@ static int check_params(void)
 	}						\
 } while (0)
 
+	int i;
+
 	if (num_files == 0)
 		ERR("no input files specified");
 
-	CHECKSTR(ofname, "output file", 0);
+	if (num_variants == 0)
+		CHECKSTR(ofname, "output file", 0);
 	CHECKSTR(brand, "brand", TAG_BRAND_LEN);
 	CHECKSTR(product, "product", TAG_PRODUCT_LEN);
 	CHECKSTR(platform, "platform", TAG_PLATFORM_LEN);
@@ -105,6 +126,13 @@ static int check_params(void)
 	if (hwver)
 		CHECKSTR(hwver, "hardware version", 2);
 
+	for (i = 0; i < num_variants; i++) {
+		if (variants[i].product)
+			CHECKSTR(variants[i].product, "product", TAG_PRODUCT_LEN);
+		if (variants[i].hwver)
+			CHECKSTR(variants[i].hwver, "hardware version", 2);
+	}
+
 	if (num_regions == 0) {
 		ERR("no region code specified");
 		return -1;
@@ -154,6 +182,48 @@ static int process_ifname(char *name)
 	return 0;
 }
 
+static int process_variant(char *arg)
+{
+	struct tag_variant *v;
+	char *hw, *file;
+
+	hw = strchr(arg, ':');
+	file = hw ? strchr(hw + 1, ':') : NULL;
+	if (!file || !file[1]) {
+		ERR("invalid variant '%s', expected <product>:<hwver>:<file>", arg);
+		return -1;
+	}
+	*hw++ = '\0';
+	*file++ = '\0';
+
+	v = realloc(variants, (num_variants + 1) * sizeof(*variants));
+	if (!v) {
+		ERR("no memory for variants");
+		return -1;
+	}
+	variants = v;
+	v += num_variants++;
+
+	v->ofname = file;
+	v->product = *arg ? arg : NULL;
+	v->hwver = *hw ? hw : NULL;
+
+	return 0;
+}
+
+/*
+ * buffalo_crc() of the tag followed by the payload, with only the tag
+ * itself run through the CRC kernel again
+ */
+static uint32_t tag_crc(unsigned char *buf, ssize_t hdrlen, ssize_t buflen)
+{
+	uint32_t crc = buffalo_crc_update(0, buf, hdrlen);
+
+	crc = fw_crc32_be_combine(crc, payload_crc, buflen - hdrlen);
+
+	return buffalo_crc_final(crc, buflen);
+}
+
 static void fixup_tag(unsigned char *buf, ssize_t buflen)
 {
 	struct buffalo_tag *tag = (struct buffalo_tag *) buf;
@@ -187,7 +257,7 @@ static void fixup_tag(unsigned char *buf, ssize_t buflen)
 	}
 
 	if (!skipcrc)
-		tag->crc = htonl(buffalo_crc(buf, buflen));
+		tag->crc = htonl(tag_crc(buf, sizeof(*tag), buflen));
 }
 
 static void fixup_tag2(unsigned char *buf, ssize_t buflen)
@@ -222,7 +292,7 @@ static void fixup_tag2(unsigned char *buf, ssize_t buflen)
 	}
 
 	if (!skipcrc)
-		tag->crc = htonl(buffalo_crc(buf, buflen));
+		tag->crc = htonl(tag_crc(buf, sizeof(*tag), buflen));
 }
 
 static void fixup_tag3(unsigned char *buf, ssize_t totlen)
@@ -258,6 +328,8 @@ static void fixup_tag3(unsigned char *buf, ssize_t totlen)
 
 static int tag_file(void)
 {
+	char *default_product = product;
+	char *default_hwver = hwver;
 	unsigned char *buf;
 	ssize_t offset;
 	ssize_t hdrlen;
@@ -301,17 +373,37 @@ static int tag_file(void)
 		offset += fsize[i];
 	}
 
-	if (dhp)
-		fixup_tag3(buf, fsize[0] + 200);
-	else if (num_files == 1)
-		fixup_tag(buf, buflen);
-	else
-		fixup_tag2(buf, buflen);
+	if (!skipcrc && !dhp)
+		payload_crc = buffalo_crc_update(0, buf + hdrlen, buflen - hdrlen);
+
+	for (i = -1; i < num_variants; i++) {
+		const char *name = ofname;
 
-	err = write_buf_to_file(ofname, buf, buflen);
-	if (err) {
-		ERR("unable to write to file '%s'", ofname);
-		goto free_buf;
+		if (i >= 0) {
+			name = variants[i].ofname;
+			if (variants[i].product)
+				product = variants[i].product;
+			if (variants[i].hwver)
+				hwver = variants[i].hwver;
+		} else if (!ofname) {
+			continue;
+		}
+
+		if (dhp)
+			fixup_tag3(buf, fsize[0] + 200);
+		else if (num_files == 1)
+			fixup_tag(buf, buflen);
+		else
+			fixup_tag2(buf, buflen);
+
+		err = write_buf_to_file((char *)name, buf, buflen);
+		if (err) {
+			ERR("unable to write to file '%s'", name);
+			goto free_buf;
+		}
+
+		product = default_product;
+		hwver = default_hwver;
 	}
 
 	ret = 0;
@@ -332,7 +424,7 @@ int main(int argc, char *argv[])
 	while ( 1 ) {
 		int c;
 
-		c = getopt(argc, argv, "a:b:c:d:f:hi:l:m:o:p:r:sv:w:I:");
+		c = getopt(argc, argv, "a:b:c:d:f:hi:l:m:o:O:p:r:sv:w:I:");
 		if (c == -1)
 			break;
 
@@ -369,6 +461,11 @@ int main(int argc, char *argv[])
 		case 'o':
 			ofname = optarg;
 			break;
+		case 'O':
+			err = process_variant(optarg);
+			if (err)
+				goto out;
+			break;
 		case 'p':
 			product = optarg;
 			break;
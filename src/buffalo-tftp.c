@@ -10,8 +10,11 @@
 #include <libgen.h>
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "buffalo-lib.h"
+#include "fw_io.h"
 
 #define ERR(fmt, args...) do { \
 	fflush(0); \
@@ -34,7 +37,8 @@ void usage(int status)
 "Options:\n"
 "  -d              decrypt instead of encrypt\n"
 "  -i <file>       read input from the file <file>\n"
-"  -o <file>       write output to the file <file>\n"
+"  -o <file>       write output to the file <file>, which may be the\n"
+"                  input file to only rewrite its header in place\n"
 "  -h              show this screen\n"
 	);
 
@@ -62,46 +66,82 @@ static void crypt_header(unsigned char *buf, ssize_t len,
 	}
 }
 
+#define HEADER_LEN	512
+
+/*
+ * Only the first 512 bytes are scrambled. The rest is copied as is,
+ * kernel-side where possible, or left alone when the output is the input
+ * file itself and just the header gets rewritten.
+ */
 static int crypt_file(void)
 {
-	unsigned char *buf = NULL;
-	ssize_t src_len;
-	int err;
+	unsigned char buf[HEADER_LEN];
+	struct stat in_st, out_st;
+	FILE *in = NULL, *out = NULL;
+	ssize_t len;
 	int ret = -1;
 
-	src_len = get_file_size(ifname);
-	if (src_len < 0) {
-		ERR("unable to get size of '%s'", ifname);
-		goto out;
-	}
-
-	buf = malloc(src_len);
-	if (buf == NULL) {
-		ERR("no memory for the buffer");
+	in = fopen(ifname, "r");
+	if (in == NULL) {
+		ERR("unable to read from file '%s'", ifname);
 		goto out;
 	}
 
-	err = read_file_to_buf(ifname, buf, src_len);
-	if (err) {
+	len = fread(buf, 1, sizeof(buf), in);
+	if (ferror(in)) {
 		ERR("unable to read from file '%s'", ifname);
 		goto out;
 	}
-
 	if (do_decrypt)
-		crypt_header(buf, 512, crypt_key2, crypt_key1);
+		crypt_header(buf, len, crypt_key2, crypt_key1);
 	else
-		crypt_header(buf, 512, crypt_key1, crypt_key2);
+		crypt_header(buf, len, crypt_key1, crypt_key2);
+
+	if (!fstat(fileno(in), &in_st) && !stat(ofname, &out_st) &&
+	    in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+		out = fopen(ofname, "r+");
+		if (out == NULL ||
+		    (len && fwrite(buf, len, 1, out) != 1) || fflush(out)) {
+			ERR("unable to write to file '%s'", ofname);
+			goto out;
+		}
+		ret = 0;
+		goto out;
+	}
 
-	err = write_buf_to_file(ofname, buf, src_len);
-	if (err) {
+	out = fopen(ofname, "w");
+	if (out == NULL) {
 		ERR("unable to write to file '%s'", ofname);
 		goto out;
 	}
 
+	if (len && fwrite(buf, len, 1, out) != 1) {
+		ERR("unable to write to file '%s'", ofname);
+		goto err_unlink;
+	}
+
+	if (fw_io_copy(out, in, FW_IO_ALL, NULL, NULL) < 0) {
+		ERR("unable to copy '%s' to '%s'", ifname, ofname);
+		goto err_unlink;
+	}
+
+	if (fflush(out)) {
+		ERR("unable to write to file '%s'", ofname);
+		goto err_unlink;
+	}
+
 	ret = 0;
+	goto out;
 
+err_unlink:
+	fclose(out);
+	out = NULL;
+	unlink(ofname);
 out:
-	free(buf);
+	if (out)
+		fclose(out);
+	if (in)
+		fclose(in);
 	return ret;
 }
 
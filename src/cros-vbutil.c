@@ -43,16 +43,20 @@
  * by the Free Software Foundation.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <openssl/rsa.h>
 #include <openssl/x509.h>
 #include <openssl/sha.h>
 
+#include "fw_io.h"
+
 #define BLOCK_PAD 65536
 /* Sections are aligned to 4K blocks */
 #define ALIGN 4096
@@ -347,42 +351,48 @@ struct vb2_kernel_preamble {
 	uint32_t flags;
 } __attribute__((packed));
 
-/*
- * Order matters. |data| may overlap with |siginfo|, so we need to fill out
- * |siginfo| before computing the signature.
- */
-static int sign(const void *data, size_t len, struct vb2_signature *siginfo,
-		void *sigout)
+/* Parsed once and shared by every kernel signed in this run */
+static RSA *privk_rsa;
+
+static RSA *load_privk(void)
 {
-	unsigned char hash[SHA256_DIGEST_LENGTH];
-	SHA256_CTX sha256;
-	int ret;
+	const unsigned char *p = privk;
 
+	if (privk_rsa)
+		return privk_rsa;
+
+	privk_rsa = d2i_RSAPrivateKey(0, &p, privk_len);
+	if (!privk_rsa)
+		fprintf(stderr, "Failed d2i_RSAPrivateKey()\n");
+	return privk_rsa;
+}
+
+static void fill_siginfo(struct vb2_signature *siginfo, size_t len,
+			 void *sigout)
+{
 	memset(siginfo, 0, sizeof(*siginfo));
 	siginfo->sig_offset = (uintptr_t)(void *)sigout - (uintptr_t)(void *)siginfo;
 	siginfo->sig_size = SIG_SIZE;
 	siginfo->data_size = len;
+}
 
-	const unsigned char *p = privk;
+/* RSA-sign an already computed SHA-256 hash into sigout */
+static int sign_hash(const unsigned char *hash, void *sigout)
+{
 	char digest_info[] = {
 		0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01,
 		0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20,
 	};
-
-	uint8_t digest[sizeof(digest_info) + sizeof(hash)];
-
-	SHA256_Init(&sha256);
-	SHA256_Update(&sha256, data, len);
-	SHA256_Final(hash, &sha256);
+	uint8_t digest[sizeof(digest_info) + SHA256_DIGEST_LENGTH];
+	RSA *key;
+	int ret;
 
 	memcpy(digest, digest_info, sizeof(digest_info));
-	memcpy(digest + sizeof(digest_info), hash, sizeof(hash));
+	memcpy(digest + sizeof(digest_info), hash, SHA256_DIGEST_LENGTH);
 
-	RSA *key = d2i_RSAPrivateKey(0, &p, privk_len);
-	if (!key) {
-		fprintf(stderr, "Failed d2i_RSAPrivateKey()\n");
+	key = load_privk();
+	if (!key)
 		return -1;
-	}
 
 	ret = RSA_private_encrypt(sizeof(digest), digest, sigout, key,
 				  RSA_PKCS1_PADDING);
@@ -394,17 +404,45 @@ static int sign(const void *data, size_t len, struct vb2_signature *siginfo,
 	return 0;
 }
 
+/*
+ * Order matters. |data| may overlap with |siginfo|, so we need to fill out
+ * |siginfo| before computing the signature.
+ */
+static int sign(const void *data, size_t len, struct vb2_signature *siginfo,
+		void *sigout)
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	SHA256_CTX sha256;
+
+	fill_siginfo(siginfo, len, sigout);
+
+	SHA256_Init(&sha256);
+	SHA256_Update(&sha256, data, len);
+	SHA256_Final(hash, &sha256);
+
+	return sign_hash(hash, sigout);
+}
+
+/* Size of the preamble block, which does not depend on the kernel */
+static uint32_t preamble_size(void)
+{
+	uint32_t signed_size = sizeof(struct vb2_kernel_preamble) + SIG_SIZE;
+	uint32_t block_size = signed_size + SIG_SIZE;
+
+	if (block_size + keyblock_len < BLOCK_PAD)
+		block_size = BLOCK_PAD - keyblock_len;
+	return block_size;
+}
+
 static struct vb2_kernel_preamble *
-generate_preamble(const void *kblob, size_t kblob_len,
+generate_preamble(const unsigned char *kblob_hash, size_t kblob_len,
 		  size_t kernel_len, size_t config_len)
 {
 	struct vb2_kernel_preamble *h;
 	uint32_t signed_size = sizeof(struct vb2_kernel_preamble) + SIG_SIZE;
-	uint32_t block_size = signed_size + SIG_SIZE;
+	uint32_t block_size = preamble_size();
 	int ret;
 
-	if (block_size + keyblock_len < BLOCK_PAD)
-		block_size = BLOCK_PAD - keyblock_len;
 	h = (struct vb2_kernel_preamble *)calloc(block_size, 1);
 	if (!h) {
 		perror("calloc");
@@ -412,9 +450,11 @@ generate_preamble(const void *kblob, size_t kblob_len,
 	}
 
 	/* Sign the body, place the signature in the preamble */
-	ret = sign(kblob, kblob_len, &h->body_signature, h + 1);
+	fill_siginfo(&h->body_signature, kblob_len, h + 1);
+	ret = sign_hash(kblob_hash, h + 1);
 	if (ret) {
 		fprintf(stderr, "sign() failed: %d\n", ret);
+		free(h);
 		return NULL;
 	}
 
@@ -440,104 +480,184 @@ generate_preamble(const void *kblob, size_t kblob_len,
 		   (void *)(h + 1) + SIG_SIZE);
 	if (ret) {
 		fprintf(stderr, "failed to sign preamble: %d\n", ret);
+		free(h);
 		return NULL;
 	}
 	return h;
 }
 
+/* Body output: everything written is hashed on the way */
+struct body_stream {
+	SHA256_CTX sha256;
+	int fd;
+	off_t off;
+	size_t len;
+};
+
+static int body_write(struct body_stream *s, const void *data, size_t len)
+{
+	SHA256_Update(&s->sha256, data, len);
+	s->len += len;
+
+	while (len) {
+		ssize_t ret = pwrite(s->fd, data, len, s->off);
+		if (ret < 0) {
+			perror("write");
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+		s->off += ret;
+	}
+
+	return 0;
+}
+
+/* Zero-fill the body up to the next ALIGN boundary plus extra bytes */
+static int body_pad(struct body_stream *s, size_t extra)
+{
+	static const unsigned char zero[ALIGN];
+	size_t len = ROUNDUP(s->len) - s->len + extra;
+
+	while (len) {
+		size_t n = len < sizeof(zero) ? len : sizeof(zero);
+
+		if (body_write(s, zero, n))
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Hash the kernel from a mapping and copy it kernel-side, 1 if it can't be */
+static int body_copy_kernel(struct body_stream *s, int kernel_fd)
+{
+	struct fw_io_map map;
+	struct stat st;
+	ssize_t ret;
+	size_t len;
+
+	if (fstat(kernel_fd, &st) || !S_ISREG(st.st_mode) ||
+	    fw_io_map(&map, kernel_fd, 0, st.st_size))
+		return 1;
+
+	len = map.len;
+	SHA256_Update(&s->sha256, map.data, len);
+	fw_io_unmap(&map);
+
+	ret = fw_io_copy_fd(s->fd, s->off, kernel_fd, 0, len);
+	if (ret != (ssize_t)len) {
+		fprintf(stderr, "failed to copy kernel: %s\n",
+			strerror(ret < 0 ? -ret : EIO));
+		return -1;
+	}
+	s->off += ret;
+	s->len += ret;
+
+	return 0;
+}
 
 /*
  * Distilled from vboot_reference futility/cmd_vbutil_kernel.c pack command.
  *
+ * The kernel goes straight into its final position in out_fd, hashed from
+ * a mapping and copied with copy_file_range() where it is a regular file
+ * and streamed through a buffer otherwise. Keyblock and preamble are
+ * written in one go once the body signature is known.
+ *
  * NB: "config" is the kernel cmdline
  */
-static int vbutil_pack(const char *kernel, size_t kernel_len,
-		       const char *config, size_t config_len,
-		       void **out, size_t *out_len)
+static int vbutil_pack(int kernel_fd, const char *config, size_t config_len,
+		       int out_fd)
 {
-	size_t kblob_len = ROUNDUP(kernel_len) + ROUNDUP(config_len) + ALIGN + ALIGN;
-	void *kblob = malloc(kblob_len);
-	if (!kblob) {
-		perror("malloc");
-		return -1;
-	}
-	void *kp = kblob;
-	memset(kblob, 0, kblob_len);
+	static unsigned char buf[BLOCK_PAD];
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	struct vb2_kernel_preamble *h;
+	struct body_stream s = {
+		.fd = out_fd,
+		.off = sizeof(keyblock) + preamble_size(),
+	};
+	size_t kernel_len, kblob_len;
+	struct iovec iov[2];
+	ssize_t ret;
+
+	SHA256_Init(&s.sha256);
 
 	/* Kernel */
-	memcpy(kp, kernel, kernel_len);
-	kp += ROUNDUP(kernel_len);
+	ret = body_copy_kernel(&s, kernel_fd);
+	if (ret < 0)
+		return -1;
+	while (ret && (ret = read(kernel_fd, buf, sizeof(buf))) != 0) {
+		if (ret < 0) {
+			perror("read");
+			return -1;
+		}
+		if (body_write(&s, buf, ret))
+			return -1;
+	}
+	kernel_len = s.len;
+	if (body_pad(&s, 0))
+		return -1;
 
 	/* Kernel command line */
-	memcpy(kp, config, config_len);
-	kp += ROUNDUP(config_len);
+	if (body_write(&s, config, config_len))
+		return -1;
 
 	/* "Parameters" -- empty, 4K-aligned */
 	/* "Bootloader" region -- empty, 4K-aligned */
 	/* Vmlinuz header -- only for x86 (not currently supported), empty */
+	if (body_pad(&s, ALIGN + ALIGN))
+		return -1;
 
-	struct vb2_kernel_preamble *h;
-	h = generate_preamble(kblob, kblob_len, kernel_len, config_len);
+	kblob_len = s.len;
+	SHA256_Final(hash, &s.sha256);
+
+	h = generate_preamble(hash, kblob_len, kernel_len, config_len);
 	if (!h) {
 		fprintf(stderr, "Failed to generate preamble\n");
 		return -1;
 	}
-	size_t outlen = sizeof(keyblock) + h->preamble_size + kblob_len;
-	void *outbuf = malloc(outlen);
-	if (!outbuf)
-		return -1;
-
-	void *p = outbuf;
-	memcpy(p, keyblock, sizeof(keyblock));
-	p += sizeof(keyblock);
-
-	memcpy(p, h, h->preamble_size);
-	p += h->preamble_size;
 
-	memcpy(p, kblob, kblob_len);
-	p += kblob_len;
-
-	if (outbuf) {
-		*out = outbuf;
-		*out_len = outlen;
+	iov[0].iov_base = (void *)keyblock;
+	iov[0].iov_len = sizeof(keyblock);
+	iov[1].iov_base = h;
+	iov[1].iov_len = h->preamble_size;
+	if (pwritev(out_fd, iov, 2, 0) != sizeof(keyblock) + h->preamble_size) {
+		perror("write");
+		free(h);
+		return -1;
 	}
+	free(h);
 
 	return 0;
 }
 
-static void * read_file(const char *path, size_t *out_len)
+static int sign_kernel(const char *kernel_file, const char *cmdline,
+		       size_t cmdline_len, const char *out_file)
 {
-	struct stat st;
-	int fd = open(path, O_RDONLY);
-	if (fd == -1) {
-		perror("failed to open");
-		return NULL;
-	}
+	int kernel_fd, fd, ret;
 
-	if (fstat(fd, &st) < 0) {
-		perror("fstat");
-		return NULL;
+	kernel_fd = open(kernel_file, O_RDONLY);
+	if (kernel_fd == -1) {
+		perror("failed to open");
+		fprintf(stderr, "failed to read kernel file: %s\n", kernel_file);
+		return -1;
 	}
+	fw_io_advise(kernel_fd, 0, 0);
 
-	size_t len = st.st_size;
-	void *p = malloc(len);
-	if (!p)
-		return NULL;
-
-	size_t count = 0;
-	while (count < len) {
-		ssize_t ret = read(fd, p + count, len - count);
-		if (ret < 0) {
-			perror("read");
-			return NULL;
-		}
-		count += ret;
+	fd = open(out_file, O_RDWR|O_CREAT, 0644);
+	if (fd == -1) {
+		perror("open");
+		close(kernel_fd);
+		return -1;
 	}
 
+	ret = vbutil_pack(kernel_fd, cmdline, cmdline_len, fd);
+	close(kernel_fd);
 	close(fd);
 
-	*out_len = len;
-	return p;
+	return ret;
 }
 
 int main(int argc, char * const argv[])
@@ -547,10 +667,6 @@ int main(int argc, char * const argv[])
 	const char *out_file = NULL;
 	const char *cmdline = NULL;
 	size_t cmdline_len;
-	void *kernel;
-	size_t kernel_len;
-	void *out;
-	size_t out_len;
 
 	int opt;
 	while ((opt = getopt(argc, argv, "k:c:o:")) != -1) {
@@ -565,15 +681,18 @@ int main(int argc, char * const argv[])
 			out_file = optarg;
 			break;
 		default:
-			fprintf(stderr, "Usage [-k <kernel>] [-c <command line>] -o <outfile>\n");
+			fprintf(stderr, "Usage [-k <kernel>] [-c <command line>] -o <outfile>\n"
+				"      -c <command line> <kernel> <outfile> [<kernel> <outfile>]...\n");
 			return -1;
 		}
 	}
-	if (optind < argc) {
+	/* Batch mode: any further arguments are kernel/outfile pairs */
+	if ((argc - optind) % 2) {
 		fprintf(stderr, "Unexpected args?\n");
 		return -1;
 	}
-	if (!out_file || !cmdline || !kernel_file) {
+	if (!cmdline || (!kernel_file != !out_file) ||
+	    (!kernel_file && optind == argc)) {
 		fprintf(stderr, "Missing required argument\n");
 		return -1;
 	}
@@ -581,28 +700,18 @@ int main(int argc, char * const argv[])
 	/* Include the \0 terminator */
 	cmdline_len = strlen(cmdline) + 1;
 
-	kernel = read_file(kernel_file, &kernel_len);
-	if (!kernel) {
-		fprintf(stderr, "failed to read kernel file: %s\n", kernel_file);
-		return -1;
+	if (kernel_file) {
+		ret = sign_kernel(kernel_file, cmdline, cmdline_len, out_file);
+		if (ret)
+			return ret;
 	}
 
-	ret = vbutil_pack(kernel, kernel_len, cmdline, cmdline_len, &out, &out_len);
-	if (ret)
-		return ret;
-
-	int fd = open(out_file, O_RDWR|O_CREAT, 0644);
-	if (fd == -1) {
-		perror("open");
-		return -1;
-	}
-
-	ret = write(fd, out, out_len);
-	if (ret == -1) {
-		perror("write");
-		return -1;
+	for (; optind < argc; optind += 2) {
+		ret = sign_kernel(argv[optind], cmdline, cmdline_len,
+				  argv[optind + 1]);
+		if (ret)
+			return ret;
 	}
-	close(fd);
 
 	return 0;
 }
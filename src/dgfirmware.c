@@ -2,6 +2,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fw_sum.h"
 
 
 #define IMG_SIZE     0x3e0000
@@ -28,46 +34,47 @@ void print_usage(void)
   fprintf(stderr, "          -m  <file>  merge in rootfs fil\e from <file>\n");
   fprintf(stderr, "          -k  <file>  merge in kernel from <file>\n");
   fprintf(stderr, "          -w  <file>  write back the modified firmware\n");
+  fprintf(stderr, "          -i          modify <img> in place\n");
 }
 
 
-unsigned char* read_img(const char *fname)
+/*
+ * The image is mapped rather than read. Changes only reach the file in
+ * place mode, where just the pages that were touched are written back.
+ */
+unsigned char* read_img(const char *fname, int in_place)
 {
-  FILE *fp;
-  int size;
+  struct stat st;
   unsigned char *img;
+  int fd;
 
-  fp = fopen(fname, "rb");
-  if (fp == NULL) {
+  fd = open(fname, in_place ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
     perror(app_name);
     exit(-1);
   }
 
-  fseek(fp, 0, SEEK_END);
-  size = ftell(fp);
-  
-  if (size != IMG_SIZE) {
-    fprintf(stderr, "%s: image file has wrong size\n", app_name);
-    fclose(fp);
+  if (fstat(fd, &st) < 0) {
+    perror(app_name);
+    close(fd);
     exit(-1);
   }
 
-  rewind(fp);
-
-  img = malloc(IMG_SIZE);
-  if (img == NULL) {
-    perror(app_name);
-    fclose(fp);
+  if (st.st_size != IMG_SIZE) {
+    fprintf(stderr, "%s: image file has wrong size\n", app_name);
+    close(fd);
     exit(-1);
   }
 
-  if (fread(img, 1, IMG_SIZE, fp) != IMG_SIZE) {
+  img = mmap(NULL, IMG_SIZE, PROT_READ | PROT_WRITE,
+             in_place ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  if (img == MAP_FAILED) {
     fprintf(stderr, "%s: can't read image file\n", app_name);
-    fclose(fp);
+    close(fd);
     exit(-1);
   }
 
-  fclose(fp);
+  close(fd);
   return img;
 }
 
@@ -136,10 +143,8 @@ unsigned char* read_rootfs(unsigned char* img, const char *fname)
 {
   FILE *fp;
   int size;
-  int i;
 
-  for (i=ROOTFS_START; i<ROOTFS_START+ROOTFS_SIZE; i++)
-    img[i] = 0xff;
+  memset(img+ROOTFS_START, 0xff, ROOTFS_SIZE);
 
   fp = fopen(fname, "rb");
   if (fp == NULL) {
@@ -173,10 +178,8 @@ unsigned char* read_kernel(unsigned char* img, const char *fname)
 {
   FILE *fp;
   int size;
-  int i;
 
-  for (i=KERNEL_START; i<KERNEL_START+KERNEL_SIZE; i++)
-    img[i] = 0xff;
+  memset(img+KERNEL_START, 0xff, KERNEL_SIZE);
 
   fp = fopen(fname, "rb");
   if (fp == NULL) {
@@ -225,13 +228,12 @@ void set_checksum(unsigned char*img, unsigned short sum)
 
 int compute_checksum(unsigned char* img)
 {
-  int i;
-  short s=0;
+  struct fw_sum s;
 
-  for (i=0; i<0x3dfffc; i++)
-    s += img[i];
+  fw_sum_init(&s);
+  fw_sum8_update(&s, img, 0x3dfffc);
 
-  return s;
+  return (short) s.sum;
 }
 
 
@@ -248,6 +250,7 @@ int main(int argc, char* argv[])
   int do_read_rootfs  = 0;
   int do_write_kernel = 0;
   int do_read_kernel  = 0;
+  int do_in_place     = 0;
 
   int i;
   unsigned char *img;
@@ -300,6 +303,9 @@ int main(int argc, char* argv[])
       kernel_fname = argv[i+1];
       i++;
     }
+    else if (!strcmp(argv[i], "-i")) {
+      do_in_place = 1;
+    }
     else if (!strcmp(argv[i], "-w")) {
       if (i+1 >= argc) {
 	fprintf(stderr, "%s: missing argument\n", app_name);
@@ -330,9 +336,10 @@ int main(int argc, char* argv[])
   }
 
   printf ("** Read firmware file\n");
-  img = read_img(img_fname);
+  img = read_img(img_fname, do_in_place);
 
-  printf ("Firmware product: %s\n", img+0x3dffbd);
+  /* the mapping ends right behind the image, keep within it */
+  printf ("Firmware product: %.*s\n", IMG_SIZE - 0x3dffbd, img+0x3dffbd);
   printf ("Firmware version: 1.%02d.%02d\n", (img[0x3dffeb] & 0x7f), img[0x3dffec]);
 
   if (do_write_rootfs) {
@@ -378,7 +385,7 @@ int main(int argc, char* argv[])
     write_img(img, new_img_fname);
   }
 
-  free(img);
+  munmap(img, IMG_SIZE);
   return 0;
 }
 
@@ -7,6 +7,16 @@
  *
  * Usage:
  *   ./dlink-sge-image DEVICE_MODEL infile outfile [-d: decrypt]
+ *   ./dlink-sge-image DEVICE_MODEL infile outfile -v
+ *   ./dlink-sge-image DEVICE_MODEL infile --no-output
+ *
+ * -v decrypts like -d, but checks both digests and both signatures before
+ * any plaintext is written; --no-output only checks them.
+ *
+ * The payload is processed in a pipeline: the calling thread reads chunks
+ * into a small ring, while separate threads run AES plus one SHA-512, the
+ * other SHA-512 and the writer. FWUTILS_SGE_CHUNK overrides the chunk size
+ * in bytes (default 65536, rounded down to the AES block size).
  *
  */
 
@@ -16,11 +26,17 @@
 #include <openssl/pem.h>
 
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
-#define BUFSIZE		4096
+#include "fw_io.h"
+
+#define SGE_CHUNK_DEFAULT	(64 * 1024)
+#define SGE_SLOTS		4
 
 #define HEAD_MAGIC		"SHRS"
 #define HEAD_MAGIC_LEN		4
@@ -31,10 +47,6 @@
 
 unsigned char aes_iv[AES_BLOCK_SIZE];
 
-unsigned char readbuf[BUFSIZE];
-unsigned char encbuf[BUFSIZE];
-
-unsigned int read_bytes;
 unsigned long read_total;
 unsigned int i;
 
@@ -57,6 +69,263 @@ int pass_cb(char *buf, int size, int rwflag, void *u)
     return len;
 }
 
+/*
+  payload pipeline
+
+  Stage order per slot: the reader fills slot->in, AES turns it into
+  slot->out and feeds one digest, the "before" digest hashes the plaintext
+  side and the writer drains slot->out. A slot returns to the reader once
+  both the before digest and the writer are done with it, so buffers are
+  handed from stage to stage without copying.
+*/
+enum {
+	STAGE_READ,
+	STAGE_CIPHER,
+	STAGE_BEFORE,
+	STAGE_WRITE,
+	STAGE_NUM,
+};
+
+struct sge_slot {
+	unsigned char *in;
+	unsigned char *out;
+	size_t len;		/* bytes read into in[] */
+	size_t crypt_len;	/* bytes run through AES, including padding */
+	size_t keep_len;	/* decrypt: plaintext bytes before the padding */
+};
+
+struct sge_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long done[STAGE_NUM];
+	unsigned long nslots;	/* total slots, known once the reader stops */
+	int eof;
+	int decrypt;
+	size_t chunk;
+	EVP_MD_CTX *digest_before;
+	EVP_MD_CTX *digest_post;
+	struct sge_slot slot[SGE_SLOTS];
+};
+
+static size_t sge_chunk_size(void)
+{
+	const char *env = getenv("FWUTILS_SGE_CHUNK");
+	unsigned long val;
+	char *end;
+
+	if (!env || !*env)
+		return SGE_CHUNK_DEFAULT;
+
+	val = strtoul(env, &end, 0);
+	if (*end || val < AES_BLOCK_SIZE)
+		return SGE_CHUNK_DEFAULT;
+
+	return val - (val % AES_BLOCK_SIZE);
+}
+
+static int sge_stage_dep(const struct sge_pipe *p, int stage)
+{
+	switch (stage) {
+	case STAGE_BEFORE:
+		return p->decrypt ? STAGE_CIPHER : STAGE_READ;
+	case STAGE_WRITE:
+		return STAGE_CIPHER;
+	default:
+		return STAGE_READ;
+	}
+}
+
+/* wait until slot n is ready for stage, NULL once the payload is done */
+static struct sge_slot *sge_wait(struct sge_pipe *p, int stage, unsigned long n)
+{
+	int dep = sge_stage_dep(p, stage);
+	struct sge_slot *slot = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->done[dep] <= n && !(p->eof && n >= p->nslots))
+		pthread_cond_wait(&p->cond, &p->lock);
+	if (p->done[dep] > n)
+		slot = &p->slot[n % SGE_SLOTS];
+	pthread_mutex_unlock(&p->lock);
+
+	return slot;
+}
+
+static void sge_done(struct sge_pipe *p, int stage)
+{
+	pthread_mutex_lock(&p->lock);
+	p->done[stage]++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *sge_cipher_thread(void *arg)
+{
+	struct sge_pipe *p = arg;
+	struct sge_slot *slot;
+	unsigned long n;
+	int outlen;
+
+	for (n = 0; (slot = sge_wait(p, STAGE_CIPHER, n)); n++) {
+		if (p->decrypt) {
+			EVP_DigestUpdate(p->digest_post, slot->in, slot->len);
+			EVP_DecryptUpdate(aes_ctx, slot->out, &outlen, slot->in,
+				slot->crypt_len);
+		} else {
+			EVP_EncryptUpdate(aes_ctx, slot->out, &outlen, slot->in,
+				slot->crypt_len);
+			EVP_DigestUpdate(p->digest_post, slot->out, slot->crypt_len);
+		}
+		sge_done(p, STAGE_CIPHER);
+	}
+
+	return NULL;
+}
+
+static void *sge_before_thread(void *arg)
+{
+	struct sge_pipe *p = arg;
+	struct sge_slot *slot;
+	unsigned long n;
+
+	for (n = 0; (slot = sge_wait(p, STAGE_BEFORE, n)); n++) {
+		if (p->decrypt)
+			EVP_DigestUpdate(p->digest_before, slot->out, slot->keep_len);
+		else
+			EVP_DigestUpdate(p->digest_before, slot->in, slot->len);
+		sge_done(p, STAGE_BEFORE);
+	}
+
+	return NULL;
+}
+
+static void *sge_write_thread(void *arg)
+{
+	struct sge_pipe *p = arg;
+	struct sge_slot *slot;
+	unsigned long n;
+
+	for (n = 0; (slot = sge_wait(p, STAGE_WRITE, n)); n++) {
+		fwrite(slot->out, 1, p->decrypt ? slot->keep_len : slot->crypt_len,
+			output_file);
+		sge_done(p, STAGE_WRITE);
+	}
+
+	return NULL;
+}
+
+/*
+  fill slot from input_file, return 1 if this is the last slot
+  encrypt: read a chunk, zero-pad the final one to the AES block size
+  decrypt: read up to payload_length_post, keep bytes up to payload_length_before
+*/
+static int sge_fill(struct sge_pipe *p, struct sge_slot *slot,
+		    uint32_t length_before, uint32_t length_post)
+{
+	size_t want = p->chunk;
+	uint32_t pad_len;
+
+	if (!p->decrypt) {
+		slot->len = fread(slot->in, 1, want, input_file);
+		slot->crypt_len = slot->len;
+		read_total += slot->len;
+		if (slot->len == want)
+			return 0;
+
+		pad_len = AES_BLOCK_SIZE - (read_total % AES_BLOCK_SIZE);
+		memset(slot->in + slot->len, 0, pad_len);
+		slot->crypt_len += pad_len;
+		return 1;
+	}
+
+	if (length_post - read_total < want)
+		want = length_post - read_total;
+	slot->len = fread(slot->in, 1, want, input_file);
+	slot->crypt_len = slot->len;
+	slot->keep_len = 0;
+	if (read_total < length_before)
+		slot->keep_len = length_before - read_total;
+	if (slot->keep_len > slot->len)
+		slot->keep_len = slot->len;
+	read_total += slot->len;
+
+	return slot->len < want || read_total >= length_post;
+}
+
+/*
+  run the payload through the pipeline, the calling thread acts as reader
+  length_before/length_post are only used when decrypting
+*/
+static int sge_pipeline(int decrypt, EVP_MD_CTX *digest_before,
+			EVP_MD_CTX *digest_post, uint32_t length_before,
+			uint32_t length_post)
+{
+	pthread_t threads[STAGE_NUM - 1];
+	void *(*stage_fn[STAGE_NUM - 1])(void *) = {
+		sge_cipher_thread, sge_before_thread, sge_write_thread,
+	};
+	struct sge_pipe p = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.decrypt = decrypt,
+		.chunk = sge_chunk_size(),
+		.digest_before = digest_before,
+		.digest_post = digest_post,
+	};
+	struct sge_slot *slot;
+	unsigned long n, free_seq;
+	int i, last, ret = 0;
+
+	for (i = 0; i < SGE_SLOTS; i++) {
+		p.slot[i].in = malloc(p.chunk + AES_BLOCK_SIZE);
+		p.slot[i].out = malloc(p.chunk + AES_BLOCK_SIZE);
+		if (!p.slot[i].in || !p.slot[i].out) {
+			fprintf(stderr, "Out of memory.\n");
+			ret = -1;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < STAGE_NUM - 1; i++)
+		pthread_create(&threads[i], NULL, stage_fn[i], &p);
+
+	for (n = 0, last = 0; !last; n++) {
+		pthread_mutex_lock(&p.lock);
+		for (;;) {
+			free_seq = p.done[STAGE_BEFORE];
+			if (p.done[STAGE_WRITE] < free_seq)
+				free_seq = p.done[STAGE_WRITE];
+			if (n < free_seq + SGE_SLOTS)
+				break;
+			pthread_cond_wait(&p.cond, &p.lock);
+		}
+		pthread_mutex_unlock(&p.lock);
+
+		slot = &p.slot[n % SGE_SLOTS];
+		last = sge_fill(&p, slot, length_before, length_post);
+
+		pthread_mutex_lock(&p.lock);
+		p.done[STAGE_READ]++;
+		if (last) {
+			p.nslots = n + 1;
+			p.eof = 1;
+		}
+		pthread_cond_broadcast(&p.cond);
+		pthread_mutex_unlock(&p.lock);
+	}
+
+	for (i = 0; i < STAGE_NUM - 1; i++)
+		pthread_join(threads[i], NULL);
+
+out:
+	for (i = 0; i < SGE_SLOTS; i++) {
+		free(p.slot[i].in);
+		free(p.slot[i].out);
+	}
+
+	return ret;
+}
+
 void image_encrypt(void)
 {
 	char buf[HEADER_LEN];
@@ -96,32 +365,12 @@ void image_encrypt(void)
 	aes_ctx = EVP_CIPHER_CTX_new();
 	EVP_EncryptInit_ex(aes_ctx, aes128, NULL, &vendor_key[0], aes_iv);
 	EVP_CIPHER_CTX_set_padding(aes_ctx, 0);
-	int outlen;
-
-	while ((read_bytes = fread(&readbuf, 1, BUFSIZE, input_file)) == BUFSIZE) {
-		EVP_DigestUpdate(digest_before, &readbuf[0], read_bytes);
-		read_total += read_bytes;
-
-		EVP_EncryptUpdate(aes_ctx, encbuf, &outlen, &readbuf[0], BUFSIZE);
-		fwrite(&encbuf, 1, BUFSIZE, output_file);
-
-		EVP_DigestUpdate(digest_post, &encbuf[0], BUFSIZE);
-	}
 
-	// handle last block of data (read_bytes < BUFSIZE)
-	EVP_DigestUpdate(digest_before, &readbuf[0], read_bytes);
-	read_total += read_bytes;
-
-	pad_len = AES_BLOCK_SIZE - (read_total % AES_BLOCK_SIZE);
-	if (pad_len == 0)
-		pad_len = AES_BLOCK_SIZE;
-	memset(&readbuf[read_bytes], 0, pad_len);
-
-	EVP_EncryptUpdate(aes_ctx, encbuf, &outlen, &readbuf[0], read_bytes + pad_len);
+	if (sge_pipeline(0, digest_before, digest_post, 0, 0))
+		exit(1);
 	EVP_CIPHER_CTX_free(aes_ctx);
-	fwrite(&encbuf, 1, read_bytes + pad_len, output_file);
 
-	EVP_DigestUpdate(digest_post, &encbuf[0], read_bytes + pad_len);
+	pad_len = AES_BLOCK_SIZE - (read_total % AES_BLOCK_SIZE);
 
 	fclose(input_file);
 	payload_length_before = read_total;
@@ -179,6 +428,7 @@ void image_encrypt(void)
 	fwrite(&sigret[0], 1, RSA_KEY_LENGTH_BYTES, output_file);
 
 	// sign md_before
+	siglen = sizeof(sigret);
 	EVP_PKEY_sign(rsa_ctx, &sigret[0], &siglen, &md_before[0], SHA512_DIGEST_LENGTH);
 	printf("\nsigned before:\n");
 	for (i = 0; i < RSA_KEY_LENGTH_BYTES; i++)
@@ -186,6 +436,7 @@ void image_encrypt(void)
 	fwrite(&sigret[0], 1, RSA_KEY_LENGTH_BYTES, output_file);
 
 	// sign md_post
+	siglen = sizeof(sigret);
 	EVP_PKEY_sign(rsa_ctx, &sigret[0], &siglen, &md_post[0], SHA512_DIGEST_LENGTH);
 	printf("\nsigned post:\n");
 	for (i = 0; i < RSA_KEY_LENGTH_BYTES; i++)
@@ -200,13 +451,14 @@ void image_encrypt(void)
 void image_decrypt(void)
 {
 	char magic[4];
-	uint32_t payload_length_before, payload_length_post, pad_len;
+	uint32_t payload_length_before, payload_length_post;
 	char salt[AES_BLOCK_SIZE];
 	char md_vendor[SHA512_DIGEST_LENGTH];
 	char md_before[SHA512_DIGEST_LENGTH];
 	char md_post[SHA512_DIGEST_LENGTH];
 	EVP_PKEY *signing_key;
 	EVP_PKEY_CTX *rsa_ctx;
+	unsigned char rsa_pub[RSA_KEY_LENGTH_BYTES];
 	unsigned char rsa_sign_before[RSA_KEY_LENGTH_BYTES];
 	unsigned char rsa_sign_post[RSA_KEY_LENGTH_BYTES];
 	unsigned char md_post_actual[SHA512_DIGEST_LENGTH];
@@ -244,7 +496,7 @@ void image_decrypt(void)
 		goto error_read;
 
 	// skip rsa_pub
-	if (fread(readbuf, 1, RSA_KEY_LENGTH_BYTES, input_file) == 0)
+	if (fread(rsa_pub, 1, RSA_KEY_LENGTH_BYTES, input_file) == 0)
 		goto error_read;
 
 	if (fread(rsa_sign_before, 1, RSA_KEY_LENGTH_BYTES, input_file) == 0)
@@ -265,39 +517,21 @@ void image_decrypt(void)
 	aes_ctx = EVP_CIPHER_CTX_new();
 	EVP_DecryptInit_ex(aes_ctx, aes128, NULL, &vendor_key[0], aes_iv);
 	EVP_CIPHER_CTX_set_padding(aes_ctx, 0);
-	int outlen;
-	pad_len = payload_length_post - payload_length_before;
 
-	while (read_total < payload_length_post) {
-		if (read_total + BUFSIZE <= payload_length_post)
-			read_bytes = fread(&readbuf, 1, BUFSIZE, input_file);
-		else
-			read_bytes = fread(&readbuf, 1, payload_length_post - read_total, \
-				input_file);
-
-		read_total += read_bytes;
-
-		EVP_DigestUpdate(digest_post, &readbuf[0], read_bytes);
-
-		EVP_DecryptUpdate(aes_ctx, encbuf, &outlen, &readbuf[0], read_bytes);
-
-		// only update digest_before until payload_length_before,
-		// do not hash decrypted padding
-		if (read_total > payload_length_before) {
-			// only calc hash for data before padding
-			EVP_DigestUpdate(digest_before, &encbuf[0], read_bytes - pad_len);
-			fwrite(&encbuf[0], 1, read_bytes - pad_len, output_file);
-
-			// copy digest state, since we need another one with vendor key appended
-			EVP_MD_CTX_copy_ex(digest_vendor, digest_before);
+	if (sge_pipeline(1, digest_before, digest_post, payload_length_before,
+			 payload_length_post))
+		goto error;
+	if (read_total < payload_length_post) {
+		fprintf(stderr, "Error reading payload from input file.\n");
+		goto error;
+	}
 
-			// append vendor_key
-			EVP_DigestUpdate(digest_vendor, &vendor_key[0], AES_BLOCK_SIZE);
-		} else {
-			// calc hash for all of read_bytes
-			EVP_DigestUpdate(digest_before, &encbuf[0], read_bytes);
-			fwrite(&encbuf[0], 1, read_bytes, output_file);
-		}
+	// digest_before stops at payload_length_before, do not hash decrypted
+	// padding; copy its state, since we need another one with vendor key
+	// appended
+	if (read_total > payload_length_before) {
+		EVP_MD_CTX_copy_ex(digest_vendor, digest_before);
+		EVP_DigestUpdate(digest_vendor, &vendor_key[0], AES_BLOCK_SIZE);
 	}
 
 	fclose(input_file);
@@ -374,6 +608,268 @@ error:
 	exit(1);
 }
 
+/*
+  verify path
+
+  The input is mapped, so the post digest is taken straight over the
+  ciphertext on a thread of its own while the calling thread decrypts into
+  plain[] and another thread hashes the plaintext behind it. plain[] holds
+  the whole payload when it is to be written out afterwards, and only
+  SGE_SLOTS chunks of it for --no-output.
+*/
+struct sge_verify {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const unsigned char *cipher;
+	unsigned char *plain;
+	size_t plain_size;
+	size_t chunk;
+	size_t length_before;
+	size_t length_post;
+	size_t decrypted;	/* plaintext bytes produced so far */
+	size_t hashed;		/* ... of which the before digest is done with */
+	EVP_MD_CTX *digest_before;
+	EVP_MD_CTX *digest_post;
+};
+
+static void *sge_verify_post_thread(void *arg)
+{
+	struct sge_verify *v = arg;
+
+	EVP_DigestUpdate(v->digest_post, v->cipher, v->length_post);
+
+	return NULL;
+}
+
+static void *sge_verify_before_thread(void *arg)
+{
+	struct sge_verify *v = arg;
+	size_t ofs, n;
+
+	while (v->hashed < v->length_post) {
+		pthread_mutex_lock(&v->lock);
+		while (v->decrypted == v->hashed)
+			pthread_cond_wait(&v->cond, &v->lock);
+		n = v->decrypted - v->hashed;
+		pthread_mutex_unlock(&v->lock);
+
+		ofs = v->hashed % v->plain_size;
+		if (n > v->chunk - ofs % v->chunk)
+			n = v->chunk - ofs % v->chunk;
+		if (v->hashed < v->length_before)
+			EVP_DigestUpdate(v->digest_before, v->plain + ofs,
+				v->length_before - v->hashed < n ?
+				v->length_before - v->hashed : n);
+
+		pthread_mutex_lock(&v->lock);
+		v->hashed += n;
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	return NULL;
+}
+
+static void sge_verify_run(struct sge_verify *v)
+{
+	pthread_t post, before;
+	size_t ofs, n;
+	int outlen;
+
+	pthread_create(&post, NULL, sge_verify_post_thread, v);
+	pthread_create(&before, NULL, sge_verify_before_thread, v);
+
+	for (ofs = 0; ofs < v->length_post; ofs += n) {
+		n = v->length_post - ofs;
+		if (n > v->chunk)
+			n = v->chunk;
+
+		pthread_mutex_lock(&v->lock);
+		while (ofs + n - v->hashed > v->plain_size)
+			pthread_cond_wait(&v->cond, &v->lock);
+		pthread_mutex_unlock(&v->lock);
+
+		EVP_DecryptUpdate(aes_ctx, v->plain + ofs % v->plain_size, &outlen,
+			v->cipher + ofs, n);
+
+		pthread_mutex_lock(&v->lock);
+		v->decrypted = ofs + n;
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	pthread_join(post, NULL);
+	pthread_join(before, NULL);
+}
+
+static void print_digest(const char *name, const unsigned char *md)
+{
+	printf("\n%s: ", name);
+	for (i = 0; i < SHA512_DIGEST_LENGTH; i++)
+		printf("%02x", md[i]);
+}
+
+/*
+  check an image without writing anything, then write the plaintext to
+  out_name unless it is NULL; exits with 1 if any check fails
+*/
+void image_verify(const char *out_name)
+{
+	const unsigned char *head, *md_vendor, *md_before, *md_post;
+	const unsigned char *rsa_sign_before, *rsa_sign_post;
+	unsigned char md_post_actual[SHA512_DIGEST_LENGTH];
+	unsigned char md_before_actual[SHA512_DIGEST_LENGTH];
+	unsigned char md_vendor_actual[SHA512_DIGEST_LENGTH];
+	struct sge_verify v = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.chunk = sge_chunk_size(),
+	};
+	struct fw_io_map map;
+	EVP_MD_CTX *digest_vendor;
+	EVP_PKEY *signing_key;
+	EVP_PKEY_CTX *rsa_ctx;
+	const EVP_MD *sha512;
+	uint32_t len;
+	struct stat st;
+	bool ok = true;
+
+	printf("\nverify mode\n");
+
+	if (fstat(fileno(input_file), &st) || st.st_size < HEADER_LEN ||
+	    fw_io_map(&map, fileno(input_file), 0, st.st_size)) {
+		fprintf(stderr, "Error reading header fields from input file.\n");
+		exit(1);
+	}
+	fclose(input_file);
+	head = map.data;
+
+	if (memcmp(head, HEAD_MAGIC, HEAD_MAGIC_LEN) != 0) {
+		fprintf(stderr, "Input File header magic does not match '%s'.\n"
+			"Maybe this file is not encrypted?\n", HEAD_MAGIC);
+		exit(1);
+	}
+	head += HEAD_MAGIC_LEN;
+
+	memcpy(&len, head, 4);
+	v.length_before = ntohl(len);
+	memcpy(&len, head + 4, 4);
+	v.length_post = ntohl(len);
+	head += 8;
+	if (v.length_post % AES_BLOCK_SIZE || v.length_before > v.length_post ||
+	    v.length_post > map.len - HEADER_LEN) {
+		fprintf(stderr, "Error reading payload from input file.\n");
+		exit(1);
+	}
+
+	memcpy(&aes_iv, head, AES_BLOCK_SIZE);
+	head += AES_BLOCK_SIZE;
+	md_vendor = head;
+	md_before = md_vendor + SHA512_DIGEST_LENGTH;
+	md_post = md_before + SHA512_DIGEST_LENGTH;
+	// skip rsa_pub
+	rsa_sign_before = md_post + SHA512_DIGEST_LENGTH + RSA_KEY_LENGTH_BYTES;
+	rsa_sign_post = rsa_sign_before + RSA_KEY_LENGTH_BYTES;
+
+	v.cipher = map.data + HEADER_LEN;
+	v.plain_size = out_name ? v.length_post : SGE_SLOTS * v.chunk;
+	v.plain = malloc(v.plain_size ? v.plain_size : 1);
+	if (!v.plain) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	v.digest_before = EVP_MD_CTX_new();
+	v.digest_post = EVP_MD_CTX_new();
+	digest_vendor = EVP_MD_CTX_new();
+	sha512 = EVP_sha512();
+	EVP_DigestInit_ex(v.digest_before, sha512, NULL);
+	EVP_DigestInit_ex(v.digest_post, sha512, NULL);
+
+	aes_ctx = EVP_CIPHER_CTX_new();
+	EVP_DecryptInit_ex(aes_ctx, aes128, NULL, &vendor_key[0], aes_iv);
+	EVP_CIPHER_CTX_set_padding(aes_ctx, 0);
+
+	sge_verify_run(&v);
+	EVP_CIPHER_CTX_free(aes_ctx);
+
+	EVP_MD_CTX_copy_ex(digest_vendor, v.digest_before);
+	EVP_DigestUpdate(digest_vendor, &vendor_key[0], AES_BLOCK_SIZE);
+
+	EVP_DigestFinal_ex(v.digest_post, &md_post_actual[0], NULL);
+	EVP_MD_CTX_free(v.digest_post);
+	EVP_DigestFinal_ex(v.digest_before, &md_before_actual[0], NULL);
+	EVP_MD_CTX_free(v.digest_before);
+	EVP_DigestFinal_ex(digest_vendor, &md_vendor_actual[0], NULL);
+	EVP_MD_CTX_free(digest_vendor);
+
+	print_digest("digest_post", md_post_actual);
+	if (memcmp(md_post, md_post_actual, SHA512_DIGEST_LENGTH) != 0) {
+		fprintf(stderr, "\nSHA512 post does not match file contents.\n");
+		ok = false;
+	}
+
+	print_digest("digest_before", md_before_actual);
+	if (memcmp(md_before, md_before_actual, SHA512_DIGEST_LENGTH) != 0) {
+		fprintf(stderr, "\nSHA512 before does not match decrypted payload.\n");
+		ok = false;
+	}
+
+	print_digest("digest_vendor", md_vendor_actual);
+	if (memcmp(md_vendor, md_vendor_actual, SHA512_DIGEST_LENGTH) != 0) {
+		fprintf(stderr, "\nSHA512 vendor does not match decrypted payload padded" \
+			" with vendor key.\n");
+		ok = false;
+	}
+
+	signing_key = PEM_read_bio_PrivateKey(rsa_private_bio, NULL, pass_cb, NULL);
+	rsa_ctx = EVP_PKEY_CTX_new(signing_key, NULL);
+	EVP_PKEY_verify_init(rsa_ctx);
+	EVP_PKEY_CTX_set_signature_md(rsa_ctx, sha512);
+
+	if (EVP_PKEY_verify(rsa_ctx, rsa_sign_before, RSA_KEY_LENGTH_BYTES, \
+		&md_before_actual[0], SHA512_DIGEST_LENGTH) == 1) {
+		printf("\nsignature before verification success");
+	} else {
+		fprintf(stderr, "\nSignature before verification failed.\n");
+		ok = false;
+	}
+
+	if (EVP_PKEY_verify(rsa_ctx, rsa_sign_post, RSA_KEY_LENGTH_BYTES, \
+		&md_post_actual[0], SHA512_DIGEST_LENGTH) == 1) {
+		printf("\nsignature post verification success");
+	} else {
+		fprintf(stderr, "\nSignature post verification failed.\n");
+		ok = false;
+	}
+
+	printf("\n");
+
+	EVP_PKEY_CTX_free(rsa_ctx);
+	EVP_PKEY_free(signing_key);
+	fw_io_unmap(&map);
+
+	if (!ok) {
+		fprintf(stderr, "Image verification failed, nothing written.\n");
+		exit(1);
+	}
+
+	if (out_name) {
+		output_file = fopen(out_name, "wb");
+		if (output_file == NULL) {
+			fprintf(stderr, "Output File %s could not be opened.\n", out_name);
+			exit(1);
+		}
+		if (fwrite(v.plain, 1, v.length_before, output_file) != v.length_before ||
+		    fclose(output_file)) {
+			fprintf(stderr, "Error writing output file.\n");
+			exit(1);
+		}
+	}
+
+	free(v.plain);
+}
+
 /*
   generate legacy vendor key for COVR-C1200, COVR-P2500, DIR-882, DIR-2660, ...
   decrypt ciphertext key2 using aes128 with key1 and iv, write result to *vkey
@@ -435,9 +931,16 @@ void generate_vendorkey_dimgkey(const unsigned char *enk, size_t len, unsigned c
 
 int main(int argc, char **argv)
 {
+	const char *out_name = NULL;
+	bool verify = false;
+
 	if (argc < 3 || argc > 5) {
 		fprintf(stderr, "Usage:\n"
-			"\tdlink-sge-image DEVICE_MODEL infile outfile [-d: decrypt]\n\n"
+			"\tdlink-sge-image DEVICE_MODEL infile outfile [-d: decrypt]\n"
+			"\tdlink-sge-image DEVICE_MODEL infile outfile -v\n"
+			"\tdlink-sge-image DEVICE_MODEL infile --no-output\n\n"
+			"-v decrypts, but only writes outfile once all digests and\n"
+			"signatures have been verified; --no-output just verifies.\n\n"
 			"DEVICE_MODEL can be any of:\n"
 			"\tCOVR-C1200\n"
 			"\tCOVR-P2500\n"
@@ -463,11 +966,21 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	output_file = fopen(argv[3], "wb");
-	if (input_file == NULL) {
-		fprintf(stderr, "Output File %s could not be opened.\n", argv[3]);
-		fclose(input_file);
-		exit(1);
+	if (argc == 4 && strcmp(argv[3], "--no-output") == 0) {
+		verify = true;
+	} else if (argc == 5 && strcmp(argv[4], "-v") == 0) {
+		verify = true;
+		out_name = argv[3];
+	}
+
+	// the verify path opens its output only once the image has checked out
+	if (!verify) {
+		output_file = fopen(argv[3], "wb");
+		if (output_file == NULL) {
+			fprintf(stderr, "Output File %s could not be opened.\n", argv[3]);
+			fclose(input_file);
+			exit(1);
+		}
 	}
 
 	aes128 = EVP_aes_128_cbc();
@@ -503,7 +1016,9 @@ int main(int argc, char **argv)
 	for (i = 0; i < AES_BLOCK_SIZE; i++)
 		printf("%02x", vendor_key[i]);
 
-	if (argc == 5 && strncmp(argv[4], "-d", 2) == 0)
+	if (verify)
+		image_verify(out_name);
+	else if (argc == 5 && strncmp(argv[4], "-d", 2) == 0)
 		image_decrypt();
 	else
 		image_encrypt();
@@ -12,11 +12,15 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include "fw_io.h"
+#include "fw_sum.h"
+
 #define MAX_MAGIC_LEN		16
 #define MAX_MODEL_LEN		32
 #define MAX_VERSION_LEN		14
@@ -43,6 +47,7 @@ struct edimax_header {
  */
 static char *ofname;
 static char *ifname;
+static char *restamp_name;
 static char *progname;
 
 static char *model;
@@ -93,6 +98,7 @@ static void usage(int status)
 "  -n <name>       set MTD device name to <name>\n"
 "  -s <addr>       set start address to <addr>\n"
 "  -t <type>       set image type to <type>\n"
+"  -u <file>       rewrite the header of the existing image <file> in place\n"
 "  -v <version>    set firmware version to <version>\n"
 	);
 
@@ -145,32 +151,6 @@ static int get_file_size(char *name)
 	return st.st_size;
 }
 
-static int read_to_buf(char *name, char *buf, int buflen)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(name, "r");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for reading", name);
-		goto out;
-	}
-
-	errno = 0;
-	fread(buf, buflen, 1, f);
-	if (errno != 0) {
-		ERRS("unable to read from file \"%s\"", name);
-		goto out_close;
-	}
-
-	ret = EXIT_SUCCESS;
-
-out_close:
-	fclose(f);
-out:
-	return ret;
-}
-
 static int check_options(void)
 {
 #define CHKSTR(_name, _msg)				\
@@ -193,115 +173,150 @@ static int check_options(void)
 		}							\
 	} while (0)
 
-	CHKSTR(ofname, "output file");
-	CHKSTR(ifname, "input file");
+	if (restamp_name) {
+		if (ifname || ofname) {
+			ERR("-u doesn't take an input or output file");
+			return -1;
+		}
+	} else {
+		CHKSTR(ofname, "output file");
+		CHKSTR(ifname, "input file");
+	}
 
 	CHKSTRLEN(magic, "magic");
 	CHKSTRLEN(model, "model");
 	CHKSTRLEN(mtd_name, "MTD device name");
 	CHKSTRLEN(fw_version, "firware version");
 
-	data_size = get_file_size(ifname);
+	data_size = get_file_size(restamp_name ? restamp_name : ifname);
 	if (data_size < 0)
 		return -1;
 
+	if (restamp_name) {
+		if (data_size < sizeof(struct edimax_header)) {
+			ERR("\"%s\" is too short for an image", restamp_name);
+			return -1;
+		}
+		data_size -= sizeof(struct edimax_header);
+	}
+
 	return 0;
 }
 
-static int write_fw(char *data, int len)
+static unsigned char checksum(const void *p, unsigned len)
 {
-	FILE *f;
+	struct fw_sum sum;
+
+	fw_sum_init(&sum);
+	fw_sum8_update(&sum, p, len);
+
+	return (unsigned char)sum.sum ^ 0xb9;
+}
+
+/* fw_io_prepend() digest: fills in the header from the mapped data */
+static void fill_header(void *priv, const void *data, size_t len)
+{
+	struct edimax_header *hdr = priv;
+
+	memset(hdr, 0, sizeof(struct edimax_header));
+
+	strncpy(hdr->model, model, sizeof(hdr->model));
+	strncpy(hdr->magic, magic, sizeof(hdr->magic));
+	strncpy(hdr->fw_version, fw_version, sizeof(hdr->fw_version));
+	strncpy(hdr->mtd_name, mtd_name, sizeof(hdr->mtd_name));
+
+	hdr->force = force;
+	hdr->start_addr = htonl(start_addr);
+	hdr->end_addr = htonl(end_addr);
+	hdr->data_size = htonl(data_size);
+	hdr->type = image_type;
+
+	hdr->data_csum = checksum(data, len);
+	hdr->header_csum = checksum(hdr, sizeof(struct edimax_header));
+}
+
+static int build_fw(void)
+{
+	struct edimax_header hdr;
+	int in, out;
 	int ret = EXIT_FAILURE;
+	int err;
 
-	f = fopen(ofname, "w");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
+	in = open(ifname, O_RDONLY);
+	if (in < 0) {
+		ERRS("could not open \"%s\" for reading", ifname);
 		goto out;
 	}
 
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
+	out = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		ERRS("could not open \"%s\" for writing", ofname);
+		goto out_close;
+	}
+
+	/* header first, then the data copied behind it kernel-side */
+	err = fw_io_prepend(out, &hdr, sizeof(hdr), in, 0, data_size,
+			    NULL, 0, fill_header, &hdr);
+	if (close(out) && !err)
+		err = -errno;
+	if (err) {
+		errno = -err;
 		ERRS("unable to write output file");
-		goto out_flush;
+		unlink(ofname);
+		goto out_close;
 	}
 
 	DBG("firmware file \"%s\" completed", ofname);
 
 	ret = EXIT_SUCCESS;
 
-out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
+out_close:
+	close(in);
 out:
 	return ret;
 }
 
-static unsigned char checksum(unsigned char *p, unsigned len)
-{
-	unsigned char csum = 0;
-
-	while (len--)
-		csum += *p++;
-
-	csum ^= 0xb9;
-
-	return csum;
-}
-
-static int build_fw(void)
+/*
+ * Re-stamp an existing image: the header is built from the options over
+ * the data already behind it and written over the old one.
+ */
+static int restamp_fw(void)
 {
-	int buflen;
-	char *buf;
-	char *data;
-	struct edimax_header *hdr;
+	struct edimax_header hdr;
+	struct fw_io_map map;
 	int ret = EXIT_FAILURE;
+	int fd, err;
 
-	buflen = sizeof(struct edimax_header) + data_size;
-
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
+	fd = open(restamp_name, O_RDWR);
+	if (fd < 0) {
+		ERRS("could not open \"%s\" for updating", restamp_name);
 		goto out;
 	}
 
-	data = buf + sizeof(struct edimax_header);
-
-	/* read input file */
-	ret = read_to_buf(ifname, data, data_size);
-	if (ret)
-		goto out_free_buf;
+	err = fw_io_map(&map, fd, sizeof(hdr), data_size);
+	if (err) {
+		errno = -err;
+		ERRS("unable to map \"%s\"", restamp_name);
+		goto out_close;
+	}
 
-	/* fill firmware header */
-	hdr = (struct edimax_header *)buf;
-	memset(hdr, 0, sizeof(struct edimax_header));
+	fill_header(&hdr, map.data, data_size);
+	fw_io_unmap(&map);
 
-	strncpy(hdr->model, model, sizeof(hdr->model));
-	strncpy(hdr->magic, magic, sizeof(hdr->magic));
-	strncpy(hdr->fw_version, fw_version, sizeof(hdr->fw_version));
-	strncpy(hdr->mtd_name, mtd_name, sizeof(hdr->mtd_name));
-
-	hdr->force = force;
-	hdr->start_addr = htonl(start_addr);
-	hdr->end_addr = htonl(end_addr);
-	hdr->data_size = htonl(data_size);
-	hdr->type = image_type;
-
-	hdr->data_csum = checksum((unsigned char *)data, data_size);
-	hdr->header_csum = checksum((unsigned char *)hdr,
-				    sizeof(struct edimax_header));
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		ERRS("unable to write \"%s\"", restamp_name);
+		goto out_close;
+	}
 
-	ret = write_fw(buf, buflen);
-	if (ret)
-		goto out_free_buf;
+	DBG("firmware file \"%s\" updated", restamp_name);
 
 	ret = EXIT_SUCCESS;
 
-out_free_buf:
-	free(buf);
+out_close:
+	if (close(fd) && ret == EXIT_SUCCESS) {
+		ERRS("unable to write \"%s\"", restamp_name);
+		ret = EXIT_FAILURE;
+	}
 out:
 	return ret;
 }
@@ -315,7 +330,7 @@ int main(int argc, char *argv[])
 	while (1) {
 		int c;
 
-		c = getopt(argc, argv, "e:fhi:o:m:M:n:s:t:v:");
+		c = getopt(argc, argv, "e:fhi:o:m:M:n:s:t:u:v:");
 		if (c == -1)
 			break;
 
@@ -362,6 +377,9 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 'u':
+			restamp_name = optarg;
+			break;
 		case 'v':
 			fw_version = optarg;
 			break;
@@ -375,7 +393,10 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto out;
 
-	ret = build_fw();
+	if (restamp_name)
+		ret = restamp_fw();
+	else
+		ret = build_fw();
 
 out:
 	return ret;
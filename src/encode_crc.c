@@ -4,7 +4,7 @@
    This program creates a CRC checksum and encodes the file that is named
    in the command line.
    
-   Compile with:  gcc encode_crc.c -Wall -o encode_crc
+   Built with the rest of firmware-utils, it needs the fwutils library.
 
    Author:     Michael Margraf  (michael.margraf@freecom.com)
    Copyright:  Freecom Technology GmbH, Berlin, 2004
@@ -16,63 +16,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
-// *******************************************************************
-// CCITT polynom G(x)=x^16+x^12+x^5+1
-#define POLYNOM  0x1021
+#include "fw_crc16.h"
+#include "fw_io.h"
 
-// CRC algorithm with MSB first
-int make_crc16(int crc, char new)
-{
-  int i;
-  crc = crc ^ (((int)new) << 8);
-  
-  for(i=0; i<8; i++) {  // work on 8 bits in "new"
-    crc <<= 1;          // MSBs first
-    if(crc & 0x10000)  crc ^= POLYNOM;
-  }
-  return crc & 0xFFFF;
-}
+#define BUF_LEN  (64 * 1024)
 
 // *******************************************************************
-// Reads the file "filename" into memory and returns pointer to the buffer.
-static char *readfile(char *filename, int *size)
+// CCITT polynom G(x)=x^16+x^12+x^5+1, MSB first, via the shared engine
+static void crc_sink(void *priv, const void *buf, size_t len)
 {
-	FILE		*fp;
-	char		*buffer;
-	struct stat	info;
-	
-	if (stat(filename,&info)!=0)
-		return NULL;
-
-	if ((fp=fopen(filename,"r"))==NULL)
-		return NULL;
-
-	buffer=NULL;
-	for (;;)
-	{
-		if ((buffer=(char *)malloc(info.st_size+1))==NULL)
-			break;
-
-		if (fread(buffer,1,info.st_size,fp)!=info.st_size)
-		{
-			free(buffer);
-			buffer=NULL;
-			break;
-		}
-
-		buffer[info.st_size]='\0';
-		if(size) *size = info.st_size;
-
-		break;
-	}
-
-	(void)fclose(fp);
-
-	return buffer;
-}
+  uint16_t *crc = priv;
 
+  *crc = fw_crc16(*crc, buf, len);
+}
 
 // *******************************************************************
 int main(int argc, char** argv)
@@ -82,37 +41,24 @@ int main(int argc, char** argv)
     return 1;
   }
 
-  int count;  // size of file in bytes
-  char *p, *master = readfile(argv[1], &count);
-  if(!master) {
+  // the input is streamed twice: once for the CRC, once to encode it
+  FILE *in = fopen(argv[1], "r");
+  uint16_t crc16v = FW_CRC16_CCITT_INIT;
+  if(!in || fw_io_copy(NULL, in, FW_IO_ALL, crc_sink, &crc16v) < 0) {
     printf("ERROR: File not found!\n");
     return 1;
   }
 
-  int crc = 0xFFFF, z;
-
-  p = master;
-  for(z=0; z<count; z++)
-    crc = make_crc16(crc, *(p++));  // calculate CRC
-  short crc16 = (short)crc;
-
-	/*
-  if(argc > 2) {   // with flag for device recognition ?
-    p = argv[2];
-    for(z=strlen(p); z>0; z--) {
-      crc ^= (int)(*p);
-      *(p++) = (char)crc;  // encode device flag
-    }
-  }
-	*/
+  short crc16 = (short)crc16v;
 
-  p = master;
-  for(z=0; z<count; z++) {
-    crc ^= (int)(*p);
-    *(p++) = (char)crc;  // encode file
+  // ...so it can't be overwritten by the output
+  struct stat st_in, st_out;
+  if(!fstat(fileno(in), &st_in) && !stat(argv[2], &st_out) &&
+     st_in.st_dev == st_out.st_dev && st_in.st_ino == st_out.st_ino) {
+    printf("ERROR: Input and output are the same file!\n");
+    return 1;
   }
 
-
   // write encoded file...
   FILE *fp = fopen(argv[2], "w");
   if(!fp) {
@@ -130,9 +76,27 @@ int main(int argc, char** argv)
 
   fwrite(&crc16, 1, sizeof(short), fp);     // first write CRC
 
-  fwrite(master, count, sizeof(char), fp);  // write content
+  // encode file: every byte is XORed into the running key, starting with
+  // the low CRC byte, and the key is written out
+  unsigned char *buf = malloc(BUF_LEN);
+  unsigned char key = crc16v & 0xFF;
+  size_t n, z;
+  if(!buf || fseek(in, 0, SEEK_SET)) {
+    printf("ERROR: File not found!\n");
+    return 1;
+  }
+
+  while((n = fread(buf, 1, BUF_LEN, in)) > 0) {
+    for(z=0; z<n; z++) {
+      key ^= buf[z];
+      buf[z] = key;
+    }
+    fwrite(buf, n, sizeof(char), fp);  // write content
+  }
+
   fclose(fp);
+  fclose(in);
 
-  free(master);
+  free(buf);
   return 0;
 }
@@ -11,9 +11,11 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include "cyg_crc.h"
+#include "fw_io.h"
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -141,40 +143,15 @@ static int get_file_stat(struct if_info *fdata)
 	if (fdata->file_name == NULL)
 		return 0;
 
-	res = stat(fdata->file_name, &st);
+	res = fw_io_stat_input(fdata->file_name, &st);
 	if (res){
 		ERRS("stat failed on %s", fdata->file_name);
 		return res;
 	}
 
 	fdata->file_size = st.st_size;
-	return 0;
-}
-
-static int read_to_buf(struct if_info *fdata, char *buf)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
 
-	f = fopen(fdata->file_name, "r");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for reading", fdata->file_name);
-		goto out;
-	}
-
-	errno = 0;
-	fread(buf, fdata->file_size, 1, f);
-	if (errno != 0) {
-		ERRS("unable to read from file \"%s\"", fdata->file_name);
-		goto out_close;
-	}
-
-	ret = EXIT_SUCCESS;
-
-out_close:
-	fclose(f);
-out:
-	return ret;
+	return 0;
 }
 
 static int check_options(void)
@@ -198,64 +175,80 @@ static int check_options(void)
 	return 0;
 }
 
-static int write_fw(char *data, int len)
+/*
+ * Only the header changes, so it is patched where it is: in the input
+ * itself when that is also the output, otherwise in a copy that the
+ * kernel makes of the rest of the file.
+ */
+static int write_fw(int in_fd, struct u_media_header *hdr)
 {
-	FILE *f;
-	int ret = EXIT_FAILURE;
+	struct stat in_st, out_st;
+	size_t len = sizeof(*hdr);
+	ssize_t n;
+	int fd;
+
+	if (!fstat(in_fd, &in_st) && !stat(ofname, &out_st) &&
+	    in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+		fd = open(ofname, O_WRONLY);
+		if (fd < 0) {
+			ERRS("could not open \"%s\" for writing", ofname);
+			return EXIT_FAILURE;
+		}
+		if (pwrite(fd, hdr, len, 0) != len) {
+			ERRS("unable to write output file");
+			close(fd);
+			return EXIT_FAILURE;
+		}
+		close(fd);
+		return EXIT_SUCCESS;
+	}
 
-	f = fopen(ofname, "w");
-	if (f == NULL) {
+	fd = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
 		ERRS("could not open \"%s\" for writing", ofname);
-		goto out;
+		return EXIT_FAILURE;
 	}
 
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
+	n = fw_io_copy_fd(fd, len, in_fd, len, if_info.file_size - len);
+	if (n != if_info.file_size - len)
+		errno = n < 0 ? -n : EIO;
+	if (n != if_info.file_size - len || pwrite(fd, hdr, len, 0) != len) {
 		ERRS("unable to write output file");
-		goto out_flush;
-	}
-
-	ret = EXIT_SUCCESS;
-
-out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
+		close(fd);
 		unlink(ofname);
+		return EXIT_FAILURE;
 	}
-out:
-	return ret;
+
+	close(fd);
+	return EXIT_SUCCESS;
 }
 
 static int fix_header(void)
 {
-	int buflen;
-	char *buf;
 	uint32_t crc, crc_orig;
-	struct u_media_header *hdr;
+	struct u_media_header header, *hdr = &header;
 	int ret = EXIT_FAILURE;
+	int fd;
 
-	buflen = if_info.file_size;
-	if (buflen < sizeof(*hdr)) {
+	if (if_info.file_size < sizeof(*hdr)) {
 		ERR("invalid input file\n");
 		return ret;
 	}
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
+	fd = open(if_info.file_name, O_RDONLY);
+	if (fd < 0) {
+		ERRS("could not open \"%s\" for reading", if_info.file_name);
 		goto out;
 	}
 
-	ret = read_to_buf(&if_info, buf);
-	if (ret)
-		goto out_free_buf;
+	if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)) {
+		ERRS("unable to read from file \"%s\"", if_info.file_name);
+		goto out_close;
+	}
 
-	hdr = (struct u_media_header *) buf;
 	if (ntohl(hdr->ih_magic) != IH_MAGIC) {
 		ERR("invalid input file, bad magic\n");
-		goto out_free_buf;
+		goto out_close;
 	}
 
 	/* verify header CRC */
@@ -264,7 +257,7 @@ static int fix_header(void)
 	crc = cyg_ether_crc32((unsigned char *)hdr, sizeof(*hdr));
 	if (crc != crc_orig) {
 		ERR("invalid input file, bad header CRC\n");
-		goto out_free_buf;
+		goto out_close;
 	}
 
 	hdr->ih_name[IH_NMLEN - UM_HEADER_LEN - 1] = '\0';
@@ -279,16 +272,16 @@ static int fix_header(void)
 	crc = cyg_ether_crc32((unsigned char *)hdr, sizeof(*hdr));
 	hdr->ih_hcrc = htonl(crc);
 
-	ret = write_fw(buf, buflen);
+	ret = write_fw(fd, hdr);
 	if (ret)
-		goto out_free_buf;
+		goto out_close;
 
 	DBG("U-Media header fixed in \"%s\"", ofname);
 
 	ret = EXIT_SUCCESS;
 
-out_free_buf:
-	free(buf);
+out_close:
+	close(fd);
 out:
 	return ret;
 }
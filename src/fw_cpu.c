@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * CPU feature probing for the kernel dispatchers
+ *
+ * The kernels are picked by constructors, whose order across objects is
+ * unspecified, so the probe runs on first use rather than from one of its
+ * own.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fw_cpu.h"
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1	(1 << 5)
+#endif
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+#endif
+
+static const struct {
+	const char *name;
+	unsigned int feature;
+} fw_cpu_names[] = {
+	{ "ssse3", FW_CPU_SSSE3 },
+	{ "sse4.1", FW_CPU_SSE41 },
+	{ "pclmul", FW_CPU_PCLMUL },
+	{ "avx2", FW_CPU_AVX2 },
+	{ "sha", FW_CPU_SHA },
+	{ "crc32", FW_CPU_ARM_CRC32 },
+	{ "sha1", FW_CPU_ARM_SHA1 },
+};
+
+static pthread_once_t fw_cpu_once = PTHREAD_ONCE_INIT;
+static unsigned int fw_cpu_mask;
+
+static unsigned int fw_cpu_probe(void)
+{
+	unsigned int features = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3"))
+		features |= FW_CPU_SSSE3;
+	if (__builtin_cpu_supports("sse4.1"))
+		features |= FW_CPU_SSE41;
+	if (__builtin_cpu_supports("pclmul"))
+		features |= FW_CPU_PCLMUL;
+	if (__builtin_cpu_supports("avx2"))
+		features |= FW_CPU_AVX2;
+	if (__builtin_cpu_supports("sha"))
+		features |= FW_CPU_SHA;
+#elif defined(__aarch64__)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+
+	if (hwcap & HWCAP_CRC32)
+		features |= FW_CPU_ARM_CRC32;
+	if (hwcap & HWCAP_SHA1)
+		features |= FW_CPU_ARM_SHA1;
+#endif
+
+	return features;
+}
+
+/* Parses a FWUTILS_FORCE_ISA list into the features it allows */
+static unsigned int fw_cpu_parse(const char *list)
+{
+	unsigned int allowed = 0;
+	size_t len, i;
+
+	for (; *list; list += len + (list[len] == ',')) {
+		len = strcspn(list, ",");
+		if (!len || (len == 7 && !strncmp(list, "generic", len)))
+			continue;
+
+		for (i = 0; i < sizeof(fw_cpu_names) / sizeof(fw_cpu_names[0]); i++)
+			if (strlen(fw_cpu_names[i].name) == len &&
+			    !strncmp(list, fw_cpu_names[i].name, len))
+				break;
+
+		if (i < sizeof(fw_cpu_names) / sizeof(fw_cpu_names[0]))
+			allowed |= fw_cpu_names[i].feature;
+		else
+			fprintf(stderr, "fwutils: ignoring unknown feature '%.*s' in FWUTILS_FORCE_ISA\n",
+				(int)len, list);
+	}
+
+	return allowed;
+}
+
+static void fw_cpu_init(void)
+{
+	const char *env;
+
+	fw_cpu_mask = fw_cpu_probe();
+
+	/* Reference runs compare the accelerated kernels against these */
+	if (getenv("FWUTILS_GENERIC")) {
+		fw_cpu_mask = 0;
+		return;
+	}
+
+	env = getenv("FWUTILS_FORCE_ISA");
+	if (env)
+		fw_cpu_mask &= fw_cpu_parse(env);
+}
+
+unsigned int fw_cpu_features(void)
+{
+	pthread_once(&fw_cpu_once, fw_cpu_init);
+
+	return fw_cpu_mask;
+}
+
+bool fw_cpu_has(unsigned int features)
+{
+	return (fw_cpu_features() & features) == features;
+}
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * CPU feature probing for the kernel dispatchers
+ */
+
+#ifndef _FW_CPU_H
+#define _FW_CPU_H
+
+#include <stdbool.h>
+
+/* Features some kernel is built for, named as in FWUTILS_FORCE_ISA */
+#define FW_CPU_SSSE3		(1u << 0)	/* "ssse3" */
+#define FW_CPU_SSE41		(1u << 1)	/* "sse4.1" */
+#define FW_CPU_PCLMUL		(1u << 2)	/* "pclmul" */
+#define FW_CPU_AVX2		(1u << 3)	/* "avx2" */
+#define FW_CPU_SHA		(1u << 4)	/* "sha", x86 SHA extensions */
+#define FW_CPU_ARM_CRC32	(1u << 5)	/* "crc32", ARMv8 CRC32 */
+#define FW_CPU_ARM_SHA1		(1u << 6)	/* "sha1", ARMv8 SHA1 */
+
+/*
+ * Features of the running CPU, probed once with cpuid or HWCAP. Every
+ * dispatcher in fwutils picks its kernel from these, so the environment
+ * can narrow them down for all of them at once:
+ *
+ *   FWUTILS_FORCE_ISA=generic		portable kernels only
+ *   FWUTILS_FORCE_ISA=ssse3,pclmul	only kernels needing no more than that
+ *
+ * Features the CPU lacks can't be forced on. FWUTILS_GENERIC=1 is the same
+ * as FWUTILS_FORCE_ISA=generic.
+ */
+unsigned int fw_cpu_features(void);
+
+/* True when all of the given features are usable */
+bool fw_cpu_has(unsigned int features);
+
+#endif /* _FW_CPU_H */
@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Shared CRC-16 engine
+ *
+ * The portable path walks four bytes per step through sliced tables. On
+ * x86 the bulk of the buffer is folded with PCLMULQDQ the same way
+ * fw_crc32_be() does it, with the 16-bit polynomial's constants.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "fw_cpu.h"
+#include "fw_crc16.h"
+#include "fw_stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FW_CRC16_X86
+#include <immintrin.h>
+#endif
+
+static uint16_t crc16_tbl[4][256];
+
+static void fw_crc16_init_tables(void)
+{
+	uint16_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i << 8;
+		for (j = 0; j < 8; j++)
+			c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+		crc16_tbl[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 4; j++)
+			crc16_tbl[j][i] = (crc16_tbl[j - 1][i] << 8) ^
+					  crc16_tbl[0][crc16_tbl[j - 1][i] >> 8];
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint16_t fw_crc16_generic(uint16_t crc, const void *buf, size_t len)
+{
+	const uint8_t *in = buf;
+	uint32_t a;
+
+	while (len >= 4) {
+		a = get_be32(in) ^ ((uint32_t)crc << 16);
+
+		crc = crc16_tbl[3][a >> 24] ^ crc16_tbl[2][(a >> 16) & 0xff] ^
+		      crc16_tbl[1][(a >> 8) & 0xff] ^ crc16_tbl[0][a & 0xff];
+
+		in += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		crc = crc16_tbl[0][(crc >> 8) ^ *in++] ^ (crc << 8);
+
+	return crc;
+}
+
+#ifdef FW_CRC16_X86
+
+/* x^n mod P, { x^n, x^(n+64) } pairs */
+static const uint64_t k512[2] __attribute__((aligned(16))) = { 0x13fc, 0x8832 };
+static const uint64_t k128[2] __attribute__((aligned(16))) = { 0xaefc, 0x650b };
+
+/*
+ * Same scheme as crc32_be_pclmul_fold(): fold byte-reversed 128-bit blocks
+ * four lanes at a time, then run the congruent remainder through the table
+ * code. The products of a 64-bit half and a 16-bit constant fit easily.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint16_t crc16_pclmul_fold(uint16_t crc, const uint8_t *buf, size_t len)
+{
+	const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					    7, 6, 5, 4, 3, 2, 1, 0);
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+	uint8_t rem[16];
+
+	x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x00)), bswap);
+	x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x10)), bswap);
+	x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x20)), bswap);
+	x4 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x30)), bswap);
+	x1 = _mm_xor_si128(x1, _mm_setr_epi32(0, 0, 0, (uint32_t)crc << 16));
+	x0 = _mm_load_si128((const __m128i *)k512);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x00)), bswap));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x10)), bswap));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x20)), bswap));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x30)), bswap));
+		buf += 64;
+		len -= 64;
+	}
+
+	x0 = _mm_load_si128((const __m128i *)k128);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buf), bswap);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)rem, _mm_shuffle_epi8(x1, bswap));
+
+	return fw_crc16_generic(0, rem, sizeof(rem));
+}
+
+static uint16_t fw_crc16_pclmul(uint16_t crc, const void *buf, size_t len)
+{
+	const uint8_t *in = buf;
+	size_t chunk;
+
+	if (len >= 64) {
+		chunk = len & ~(size_t)15;
+		crc = crc16_pclmul_fold(crc, in, chunk);
+		in += chunk;
+		len -= chunk;
+	}
+
+	return fw_crc16_generic(crc, in, len);
+}
+
+#endif /* FW_CRC16_X86 */
+
+static uint16_t (*fw_crc16_fn)(uint16_t crc, const void *buf, size_t len) = fw_crc16_generic;
+static const char *fw_crc16_name = "slice4";
+
+__attribute__((constructor))
+static void fw_crc16_init(void)
+{
+	fw_crc16_init_tables();
+
+#if defined(FW_CRC16_X86)
+	if (fw_cpu_has(FW_CPU_PCLMUL | FW_CPU_SSSE3)) {
+		fw_crc16_fn = fw_crc16_pclmul;
+		fw_crc16_name = "pclmul";
+	}
+#endif
+
+	fw_stats_impl(FW_STATS_CRC16, fw_crc16_name);
+}
+
+uint16_t fw_crc16(uint16_t crc, const void *buf, size_t len)
+{
+	uint64_t start;
+
+	if (!fw_stats_on)
+		return fw_crc16_fn(crc, buf, len);
+
+	start = fw_stats_now();
+	crc = fw_crc16_fn(crc, buf, len);
+	fw_stats_kernel(FW_STATS_CRC16, start, len);
+
+	return crc;
+}
+
+const char *fw_crc16_impl(void)
+{
+	return fw_crc16_name;
+}
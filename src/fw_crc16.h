@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Shared CRC-16 engine
+ *
+ * MSB-first CRC-16 with the CCITT polynomial x^16+x^12+x^5+1 (0x1021), as
+ * used by eCos, XMODEM and the Freecom loaders.
+ */
+
+#ifndef _FW_CRC16_H
+#define _FW_CRC16_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Initial register values of the common variants */
+#define FW_CRC16_XMODEM_INIT	0x0000
+#define FW_CRC16_CCITT_INIT	0xffff
+
+/*
+ * Advance the CRC shift register over len bytes of buf. As with fw_crc32(),
+ * no conditioning is applied; neither variant inverts the result.
+ */
+uint16_t fw_crc16(uint16_t crc, const void *buf, size_t len);
+
+/* Portable slice-by-4 implementation, always available */
+uint16_t fw_crc16_generic(uint16_t crc, const void *buf, size_t len);
+
+/*
+ * Name of the kernel fw_crc16() dispatches to. FWUTILS_GENERIC forces the
+ * portable one, as for fw_crc32().
+ */
+const char *fw_crc16_impl(void);
+
+#endif /* _FW_CRC16_H */
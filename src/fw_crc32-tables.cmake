@@ -0,0 +1,129 @@
+# Generates the constant CRC-32 tables of fw_crc32.c at configure time:
+# slice-by-16 for the reflected polynomial 0xedb88320, slice-by-8 for the
+# MSB-first 0x04c11db7 and the x^(2^k) powers used to combine CRCs.
+#
+# MATH() only takes decimal operands before CMake 3.13, hence the constants.
+
+SET(_FW_CRC32_POLY 3988292384)		# 0xedb88320
+SET(_FW_CRC32_BE_POLY 79764919)		# 0x04c11db7
+SET(_FW_CRC32_MASK 4294967295)		# 0xffffffff
+SET(_FW_CRC32_TOP 2147483648)		# 0x80000000
+
+# Appends a list of values as C initializer lines, eight to a line
+FUNCTION(_FW_CRC32_EMIT out values)
+  SET(_text "")
+  SET(_n 0)
+  FOREACH(_v ${values})
+    MATH(EXPR _col "${_n} % 8")
+    IF(_col EQUAL 0)
+      SET(_text "${_text}\n\t\t")
+    ELSE()
+      SET(_text "${_text} ")
+    ENDIF()
+    SET(_text "${_text}${_v}u,")
+    MATH(EXPR _n "${_n} + 1")
+  ENDFOREACH()
+  SET(${out} "${${out}}\t{${_text}\n\t},\n" PARENT_SCOPE)
+ENDFUNCTION()
+
+# a * b modulo P, both reflected
+FUNCTION(_FW_CRC32_MULTMODP out a b)
+  SET(_m ${_FW_CRC32_TOP})
+  SET(_p 0)
+  WHILE(1)
+    MATH(EXPR _bit "${a} & ${_m}")
+    IF(_bit)
+      MATH(EXPR _p "${_p} ^ ${b}")
+      MATH(EXPR _rest "${a} & (${_m} - 1)")
+      IF(_rest EQUAL 0)
+        BREAK()
+      ENDIF()
+    ENDIF()
+    MATH(EXPR _m "${_m} >> 1")
+    MATH(EXPR _lsb "${b} & 1")
+    IF(_lsb)
+      MATH(EXPR b "(${b} >> 1) ^ ${_FW_CRC32_POLY}")
+    ELSE()
+      MATH(EXPR b "${b} >> 1")
+    ENDIF()
+  ENDWHILE()
+  SET(${out} ${_p} PARENT_SCOPE)
+ENDFUNCTION()
+
+FUNCTION(FW_CRC32_TABLES out)
+  SET(_le "")
+  SET(_tbl0 "")
+  FOREACH(_i RANGE 255)
+    SET(_c ${_i})
+    FOREACH(_j RANGE 7)
+      MATH(EXPR _lsb "${_c} & 1")
+      IF(_lsb)
+        MATH(EXPR _c "(${_c} >> 1) ^ ${_FW_CRC32_POLY}")
+      ELSE()
+        MATH(EXPR _c "${_c} >> 1")
+      ENDIF()
+    ENDFOREACH()
+    LIST(APPEND _tbl0 ${_c})
+  ENDFOREACH()
+  _FW_CRC32_EMIT(_le "${_tbl0}")
+
+  SET(_prev ${_tbl0})
+  FOREACH(_j RANGE 1 15)
+    SET(_cur "")
+    FOREACH(_c ${_prev})
+      MATH(EXPR _idx "${_c} & 255")
+      LIST(GET _tbl0 ${_idx} _t)
+      MATH(EXPR _c "(${_c} >> 8) ^ ${_t}")
+      LIST(APPEND _cur ${_c})
+    ENDFOREACH()
+    _FW_CRC32_EMIT(_le "${_cur}")
+    SET(_prev ${_cur})
+  ENDFOREACH()
+
+  SET(_be "")
+  SET(_tbl0 "")
+  FOREACH(_i RANGE 255)
+    MATH(EXPR _c "${_i} << 24")
+    FOREACH(_j RANGE 7)
+      MATH(EXPR _msb "${_c} & ${_FW_CRC32_TOP}")
+      IF(_msb)
+        MATH(EXPR _c "((${_c} << 1) ^ ${_FW_CRC32_BE_POLY}) & ${_FW_CRC32_MASK}")
+      ELSE()
+        MATH(EXPR _c "(${_c} << 1) & ${_FW_CRC32_MASK}")
+      ENDIF()
+    ENDFOREACH()
+    LIST(APPEND _tbl0 ${_c})
+  ENDFOREACH()
+  _FW_CRC32_EMIT(_be "${_tbl0}")
+
+  SET(_prev ${_tbl0})
+  FOREACH(_j RANGE 1 7)
+    SET(_cur "")
+    FOREACH(_c ${_prev})
+      MATH(EXPR _idx "${_c} >> 24")
+      LIST(GET _tbl0 ${_idx} _t)
+      MATH(EXPR _c "((${_c} << 8) & ${_FW_CRC32_MASK}) ^ ${_t}")
+      LIST(APPEND _cur ${_c})
+    ENDFOREACH()
+    _FW_CRC32_EMIT(_be "${_cur}")
+    SET(_prev ${_cur})
+  ENDFOREACH()
+
+  # x^(2^k) modulo P, starting at x^1
+  SET(_p 1073741824)
+  SET(_x2n ${_p})
+  FOREACH(_k RANGE 1 31)
+    _FW_CRC32_MULTMODP(_p ${_p} ${_p})
+    LIST(APPEND _x2n ${_p})
+  ENDFOREACH()
+  SET(_x2n_text "")
+  _FW_CRC32_EMIT(_x2n_text "${_x2n}")
+  # A one-dimensional table, so drop the braces around the single row
+  STRING(REGEX REPLACE "^\t{(.*)\n\t},\n$" "\\1" _x2n_text "${_x2n_text}")
+  STRING(REPLACE "\n\t\t" "\n\t" _x2n_text "${_x2n_text}")
+
+  SET(FW_CRC32_TBL "${_le}")
+  SET(FW_CRC32_BE_TBL "${_be}")
+  SET(FW_CRC32_X2N_TBL "${_x2n_text}")
+  CONFIGURE_FILE(${CMAKE_CURRENT_SOURCE_DIR}/src/fw_crc32-tables.h.in ${out} @ONLY)
+ENDFUNCTION()
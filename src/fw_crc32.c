@@ -0,0 +1,657 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Shared CRC-32 engine
+ *
+ * The portable path is the usual slice-by-16 table walk. On x86 the bulk of
+ * the buffer is folded with PCLMULQDQ (Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ" scheme), on arm64 the ARMv8 CRC32
+ * instructions are used. The kernel is picked once at startup.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "fw_cpu.h"
+#include "fw_crc32.h"
+#include "fw_dcache.h"
+#include "fw_pool.h"
+#include "fw_stats.h"
+#include "fw_trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FW_CRC32_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define FW_CRC32_ARM64
+#include <arm_acle.h>
+#endif
+
+/* crc32_tbl, crc32_be_tbl and crc32_x2n_tbl, see fw_crc32-tables.cmake */
+#include "fw_crc32-tables.h"
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t fw_crc32_generic(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *in = buf;
+	uint32_t a, b, c, d;
+
+	while (len >= 16) {
+		a = get_le32(in) ^ crc;
+		b = get_le32(in + 4);
+		c = get_le32(in + 8);
+		d = get_le32(in + 12);
+
+		crc = crc32_tbl[15][a & 0xff] ^ crc32_tbl[14][(a >> 8) & 0xff] ^
+		      crc32_tbl[13][(a >> 16) & 0xff] ^ crc32_tbl[12][a >> 24] ^
+		      crc32_tbl[11][b & 0xff] ^ crc32_tbl[10][(b >> 8) & 0xff] ^
+		      crc32_tbl[9][(b >> 16) & 0xff] ^ crc32_tbl[8][b >> 24] ^
+		      crc32_tbl[7][c & 0xff] ^ crc32_tbl[6][(c >> 8) & 0xff] ^
+		      crc32_tbl[5][(c >> 16) & 0xff] ^ crc32_tbl[4][c >> 24] ^
+		      crc32_tbl[3][d & 0xff] ^ crc32_tbl[2][(d >> 8) & 0xff] ^
+		      crc32_tbl[1][(d >> 16) & 0xff] ^ crc32_tbl[0][d >> 24];
+
+		in += 16;
+		len -= 16;
+	}
+
+	while (len--)
+		crc = crc32_tbl[0][(crc ^ *in++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint32_t fw_crc32_be_generic(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *in = buf;
+	uint32_t a, b;
+
+	while (len >= 8) {
+		a = get_be32(in) ^ crc;
+		b = get_be32(in + 4);
+
+		crc = crc32_be_tbl[7][a >> 24] ^ crc32_be_tbl[6][(a >> 16) & 0xff] ^
+		      crc32_be_tbl[5][(a >> 8) & 0xff] ^ crc32_be_tbl[4][a & 0xff] ^
+		      crc32_be_tbl[3][b >> 24] ^ crc32_be_tbl[2][(b >> 16) & 0xff] ^
+		      crc32_be_tbl[1][(b >> 8) & 0xff] ^ crc32_be_tbl[0][b & 0xff];
+
+		in += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc32_be_tbl[0][(crc >> 24) ^ *in++] ^ (crc << 8);
+
+	return crc;
+}
+
+#ifdef FW_CRC32_X86
+
+/* x^n mod P constants for the bit-reflected polynomial */
+static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+/*
+ * Fold len bytes (len >= 64, multiple of 16) into the CRC. Four 128-bit
+ * lanes are folded 64 bytes at a time, then merged and Barrett-reduced.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Remaining 16-byte blocks */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 -> 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t fw_crc32_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *in = buf;
+	size_t chunk;
+
+	if (len >= 64) {
+		chunk = len & ~(size_t)15;
+		crc = crc32_pclmul_fold(crc, in, chunk);
+		in += chunk;
+		len -= chunk;
+	}
+
+	return fw_crc32_generic(crc, in, len);
+}
+
+/* x^n mod P for the MSB-first polynomial, { x^n, x^(n+64) } pairs */
+static const uint64_t be_k512[2] __attribute__((aligned(16))) = { 0xe6228b11, 0x8833794c };
+static const uint64_t be_k128[2] __attribute__((aligned(16))) = { 0xe8a45605, 0xc5b9cd4c };
+
+/*
+ * MSB-first counterpart of crc32_pclmul_fold(). Blocks are byte-reversed
+ * so that bit 127 is the first message bit, which turns every fold into a
+ * plain carry-less multiply. The folded remainder is then written back out
+ * and run through the table code; it is congruent to the consumed prefix,
+ * so this yields the same CRC while avoiding a separate Barrett step.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32_be_pclmul_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					    7, 6, 5, 4, 3, 2, 1, 0);
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+	uint8_t rem[16];
+
+	x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x00)), bswap);
+	x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x10)), bswap);
+	x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x20)), bswap);
+	x4 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x30)), bswap);
+	x1 = _mm_xor_si128(x1, _mm_setr_epi32(0, 0, 0, crc));
+	x0 = _mm_load_si128((const __m128i *)be_k512);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x00)), bswap));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x10)), bswap));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x20)), bswap));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(buf + 0x30)), bswap));
+		buf += 64;
+		len -= 64;
+	}
+
+	x0 = _mm_load_si128((const __m128i *)be_k128);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)buf), bswap);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)rem, _mm_shuffle_epi8(x1, bswap));
+
+	return fw_crc32_be_generic(0, rem, sizeof(rem));
+}
+
+static uint32_t fw_crc32_be_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *in = buf;
+	size_t chunk;
+
+	if (len >= 64) {
+		chunk = len & ~(size_t)15;
+		crc = crc32_be_pclmul_fold(crc, in, chunk);
+		in += chunk;
+		len -= chunk;
+	}
+
+	return fw_crc32_be_generic(crc, in, len);
+}
+
+#endif /* FW_CRC32_X86 */
+
+#ifdef FW_CRC32_ARM64
+
+__attribute__((target("+crc")))
+static uint32_t fw_crc32_armv8(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *in = buf;
+	uint64_t v;
+
+	while (len && ((uintptr_t)in & 7)) {
+		crc = __crc32b(crc, *in++);
+		len--;
+	}
+
+	while (len >= 32) {
+		memcpy(&v, in, 8);
+		crc = __crc32d(crc, v);
+		memcpy(&v, in + 8, 8);
+		crc = __crc32d(crc, v);
+		memcpy(&v, in + 16, 8);
+		crc = __crc32d(crc, v);
+		memcpy(&v, in + 24, 8);
+		crc = __crc32d(crc, v);
+		in += 32;
+		len -= 32;
+	}
+
+	while (len >= 8) {
+		memcpy(&v, in, 8);
+		crc = __crc32d(crc, v);
+		in += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32b(crc, *in++);
+
+	return crc;
+}
+
+#endif /* FW_CRC32_ARM64 */
+
+/**************************************************
+ * Combine
+ **************************************************/
+
+/* a * b modulo P, both reflected */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1u << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+
+	return p;
+}
+
+/* x^(n * 2^k) modulo P */
+static uint32_t x2nmodp(uint64_t n, unsigned int k)
+{
+	uint32_t p = 1u << 31;
+
+	while (n) {
+		if (n & 1)
+			p = multmodp(crc32_x2n_tbl[k & 31], p);
+		n >>= 1;
+		k++;
+	}
+
+	return p;
+}
+
+uint32_t fw_crc32_shift(uint32_t crc, size_t len)
+{
+	return multmodp(x2nmodp(len, 3), crc);
+}
+
+uint32_t fw_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	return fw_crc32_shift(crc1, len2) ^ crc2;
+}
+
+uint32_t fw_crc32_fill(uint32_t crc, uint8_t c, size_t len)
+{
+	uint32_t run = fw_crc32(0, &c, 1), fill = 0;
+	size_t n = 1;
+
+	crc = fw_crc32_shift(crc, len);
+
+	/*
+	 * From a zero register, len bytes of c are put together from runs of
+	 * 1, 2, 4, ... bytes, one per set bit of len, and each run is just
+	 * two of the one before.
+	 */
+	for (; len; len >>= 1) {
+		if (len & 1)
+			fill = fw_crc32_shift(fill, n) ^ run;
+		if (len > 1)
+			run = fw_crc32_shift(run, n) ^ run;
+		n <<= 1;
+	}
+
+	return crc ^ fill;
+}
+
+/* x has order 2^32 - 1 modulo P, so going back n bits is going ahead 2^32 - 1 - n */
+#define CRC32_X_ORDER	0xffffffffull
+
+uint32_t fw_crc32_unshift(uint32_t crc, size_t len)
+{
+	uint64_t n = ((uint64_t) len % CRC32_X_ORDER) * 8 % CRC32_X_ORDER;
+
+	return multmodp(x2nmodp(CRC32_X_ORDER - n, 0), crc);
+}
+
+int fw_crc32_forge(uint32_t crc, void *buf, size_t len, size_t offset,
+		   uint32_t want)
+{
+	uint8_t *p = buf;
+	uint32_t prefix, suffix, patch;
+	size_t tail;
+	int i;
+
+	if (len < 4 || offset > len - 4)
+		return -EINVAL;
+
+	tail = len - offset - 4;
+	prefix = fw_crc32_parallel(crc, p, offset);
+	suffix = fw_crc32_parallel(0, p + offset + 4, tail);
+
+	/*
+	 * Four bytes w take register r to (r ^ w) * x^32, so the patch is
+	 * what's left of the wanted register taken back over the tail and
+	 * the patch itself.
+	 */
+	patch = prefix ^ fw_crc32_unshift(want ^ suffix, tail + 4);
+	for (i = 0; i < 4; i++)
+		p[offset + i] = patch >> (8 * i);
+
+	/* The rest of the buffer is unchanged, so this is a complete check */
+	crc = fw_crc32(prefix, p + offset, 4);
+	if (fw_crc32_combine(crc, suffix, tail) != want)
+		return -EIO;
+
+	return 0;
+}
+
+uint32_t fw_crc32_patch(uint32_t crc, size_t len, size_t offset,
+			const void *old, const void *new, size_t n)
+{
+	uint32_t delta;
+
+	/*
+	 * From a zero register the CRC is linear in the data, so the change
+	 * is the CRC of old ^ new carried over the bytes that follow it.
+	 */
+	delta = fw_crc32(0, new, n);
+	if (old)
+		delta ^= fw_crc32(0, old, n);
+
+	return crc ^ fw_crc32_shift(delta, len - offset - n);
+}
+
+static uint32_t bitrev32(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+	return __builtin_bswap32(x);
+}
+
+/*
+ * Zero bytes have no bit order, so the MSB-first register is advanced by
+ * reflecting it into the domain of fw_crc32_shift() and back.
+ */
+uint32_t fw_crc32_be_shift(uint32_t crc, size_t len)
+{
+	return bitrev32(fw_crc32_shift(bitrev32(crc), len));
+}
+
+uint32_t fw_crc32_be_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	return fw_crc32_be_shift(crc1, len2) ^ crc2;
+}
+
+/**************************************************
+ * Parallel
+ **************************************************/
+
+#define FW_CRC32_PAR_MAX_CHUNKS	256
+
+struct fw_crc32_par {
+	const uint8_t *buf;
+	uint32_t crc[FW_CRC32_PAR_MAX_CHUNKS];
+};
+
+static void fw_crc32_par_chunk(void *arg, unsigned int idx, size_t offset,
+			       size_t len)
+{
+	struct fw_crc32_par *par = arg;
+
+	/* Chunk 0 carries the caller's register, the rest start from zero */
+	par->crc[idx] = fw_crc32(par->crc[idx], par->buf + offset, len);
+}
+
+uint32_t fw_crc32_parallel(uint32_t crc, const void *buf, size_t len)
+{
+	struct fw_crc32_par par = { .buf = buf };
+	uint32_t init = crc;
+	unsigned int nchunks, i;
+	struct fw_trace t;
+	size_t chunk, last;
+
+	if (fw_pool_threads() < 2 || len < FW_CRC32_PAR_MIN)
+		return fw_crc32(crc, buf, len);
+
+	fw_trace_begin(&t, "crc32_parallel");
+
+	par.crc[0] = crc;
+	nchunks = fw_pool_run_range(len, FW_CRC32_PAR_MIN / 4,
+				    FW_CRC32_PAR_MAX_CHUNKS, &chunk,
+				    fw_crc32_par_chunk, &par);
+
+	/* Merge strictly in file order so the result never depends on timing */
+	crc = par.crc[0];
+	for (i = 1; i < nchunks; i++) {
+		last = len - (size_t)i * chunk;
+		if (last > chunk)
+			last = chunk;
+		crc = fw_crc32_combine(crc, par.crc[i], last);
+	}
+
+	fw_trace_end(&t, len);
+
+	if (fw_pool_selfcheck() && crc != fw_crc32(init, buf, len)) {
+		fprintf(stderr, "fwutils: parallel CRC-32 differs from the serial one\n");
+		abort();
+	}
+
+	return crc;
+}
+
+int fw_crc32_fd(uint32_t *crc, int fd, off_t offset, size_t len)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t base = offset & ~((off_t)pagesize - 1);
+	size_t delta = offset - base;
+	struct fw_trace t;
+	uint8_t digest[4];
+	uint32_t raw;
+	void *map;
+
+	if (!len)
+		return 0;
+
+	/*
+	 * The register is linear in its initial value, so the cache holds
+	 * the CRC from zero and the caller's value is shifted in afterwards.
+	 */
+	if (fw_dcache_get(fd, offset, len, FW_DCACHE_CRC32, digest, sizeof(digest))) {
+		raw = (uint32_t)digest[0] << 24 | digest[1] << 16 |
+		      digest[2] << 8 | digest[3];
+		*crc = fw_crc32_shift(*crc, len) ^ raw;
+		return 0;
+	}
+
+	map = mmap(NULL, len + delta, PROT_READ, MAP_SHARED, fd, base);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	fw_trace_begin(&t, "crc32_fd");
+
+	madvise(map, len + delta, MADV_SEQUENTIAL);
+	if (fw_dcache_enabled()) {
+		raw = fw_crc32_parallel(0, (uint8_t *)map + delta, len);
+		digest[0] = raw >> 24;
+		digest[1] = raw >> 16;
+		digest[2] = raw >> 8;
+		digest[3] = raw;
+		fw_dcache_put(fd, offset, len, FW_DCACHE_CRC32, digest, sizeof(digest));
+		*crc = fw_crc32_shift(*crc, len) ^ raw;
+	} else {
+		*crc = fw_crc32_parallel(*crc, (uint8_t *)map + delta, len);
+	}
+
+	munmap(map, len + delta);
+
+	fw_trace_end(&t, len);
+
+	return 0;
+}
+
+static uint32_t (*fw_crc32_fn)(uint32_t crc, const void *buf, size_t len) = fw_crc32_generic;
+static const char *fw_crc32_name = "slice16";
+static uint32_t (*fw_crc32_be_fn)(uint32_t crc, const void *buf, size_t len) = fw_crc32_be_generic;
+static const char *fw_crc32_be_name = "slice8";
+
+__attribute__((constructor))
+static void fw_crc32_init(void)
+{
+#if defined(FW_CRC32_X86)
+	if (fw_cpu_has(FW_CPU_PCLMUL | FW_CPU_SSE41)) {
+		fw_crc32_fn = fw_crc32_pclmul;
+		fw_crc32_name = "pclmul";
+	}
+	if (fw_cpu_has(FW_CPU_PCLMUL | FW_CPU_SSSE3)) {
+		fw_crc32_be_fn = fw_crc32_be_pclmul;
+		fw_crc32_be_name = "pclmul";
+	}
+#elif defined(FW_CRC32_ARM64)
+	if (fw_cpu_has(FW_CPU_ARM_CRC32)) {
+		fw_crc32_fn = fw_crc32_armv8;
+		fw_crc32_name = "armv8-crc";
+	}
+#endif
+
+	fw_stats_impl(FW_STATS_CRC32, fw_crc32_name);
+	fw_stats_impl(FW_STATS_CRC32_BE, fw_crc32_be_name);
+}
+
+uint32_t fw_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	uint64_t start;
+
+	if (!fw_stats_on)
+		return fw_crc32_fn(crc, buf, len);
+
+	start = fw_stats_now();
+	crc = fw_crc32_fn(crc, buf, len);
+	fw_stats_kernel(FW_STATS_CRC32, start, len);
+
+	return crc;
+}
+
+uint32_t fw_crc32_be(uint32_t crc, const void *buf, size_t len)
+{
+	uint64_t start;
+
+	if (!fw_stats_on)
+		return fw_crc32_be_fn(crc, buf, len);
+
+	start = fw_stats_now();
+	crc = fw_crc32_be_fn(crc, buf, len);
+	fw_stats_kernel(FW_STATS_CRC32_BE, start, len);
+
+	return crc;
+}
+
+const char *fw_crc32_impl(void)
+{
+	return fw_crc32_name;
+}
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Shared CRC-32 engine
+ *
+ * Reflected IEEE 802.3 CRC-32 (polynomial 0xedb88320) as used by TRX,
+ * bcm63xx tags, Xiaomi and most other vendor containers.
+ */
+
+#ifndef _FW_CRC32_H
+#define _FW_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Advance the CRC shift register over len bytes of buf.
+ *
+ * No pre- or post-conditioning is applied: callers pass their own initial
+ * value (usually 0xffffffff) and invert the result if their format wants
+ * that, exactly like the per-tool table loops this replaces.
+ */
+uint32_t fw_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* Portable slice-by-16 implementation, always available */
+uint32_t fw_crc32_generic(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * MSB-first (non-reflected) CRC-32 with the same polynomial, as used by
+ * POSIX cksum and the Broadcom/TI loaders. Same conventions as fw_crc32().
+ */
+uint32_t fw_crc32_be(uint32_t crc, const void *buf, size_t len);
+uint32_t fw_crc32_be_generic(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Advance a register over len zero bytes in O(log len), without touching
+ * any data.
+ */
+uint32_t fw_crc32_shift(uint32_t crc, size_t len);
+
+/*
+ * Given crc1 of A and crc2 of B (len2 bytes), return the CRC of A followed
+ * by B. Either both values come from fw_crc32() with crc2 started from a
+ * zero register, or both are conditioned zlib-style CRCs.
+ */
+uint32_t fw_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+/*
+ * Advance a register over len bytes that all hold c, as in 0xff flash
+ * padding, in O(log^2 len) without a buffer to run over.
+ */
+uint32_t fw_crc32_fill(uint32_t crc, uint8_t c, size_t len);
+
+/* Inverse of fw_crc32_shift(): take a register back over len zero bytes */
+uint32_t fw_crc32_unshift(uint32_t crc, size_t len);
+
+/*
+ * Overwrite the 4 bytes of buf at offset so that fw_crc32(crc, buf, len)
+ * becomes want. Costs one pass over the rest of the buffer, after which
+ * the result is checked in constant time. Returns 0, -EINVAL if the
+ * patch doesn't fit or -EIO if the check fails.
+ */
+int fw_crc32_forge(uint32_t crc, void *buf, size_t len, size_t offset,
+		   uint32_t want);
+
+/*
+ * Update crc, taken over len bytes, for n of them at offset changing from
+ * old to new. old may be NULL for bytes that were zero, as in padding that
+ * was just filled in. Costs O(n + log len) and works on raw registers and
+ * conditioned zlib-style CRCs alike.
+ */
+uint32_t fw_crc32_patch(uint32_t crc, size_t len, size_t offset,
+			const void *old, const void *new, size_t n);
+
+/* fw_crc32_shift() and fw_crc32_combine() for fw_crc32_be() registers */
+uint32_t fw_crc32_be_shift(uint32_t crc, size_t len);
+uint32_t fw_crc32_be_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+/*
+ * Same result as fw_crc32(), but buffers of at least FW_CRC32_PAR_MIN bytes
+ * are split into chunks that are checksummed on the worker pool and then
+ * combined in order.
+ */
+#define FW_CRC32_PAR_MIN	(4 * 1024 * 1024)
+uint32_t fw_crc32_parallel(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Map len bytes of fd at offset and run fw_crc32_parallel() over them.
+ * Returns 0 on success or -errno if the range can't be mapped (pipes and
+ * the like), in which case *crc is untouched and the caller should fall
+ * back to reading.
+ */
+int fw_crc32_fd(uint32_t *crc, int fd, off_t offset, size_t len);
+
+/*
+ * Name of the kernel fw_crc32() dispatches to. Setting FWUTILS_GENERIC in
+ * the environment forces the portable kernels, FWUTILS_FORCE_ISA limits
+ * the choice to the features it lists (see fw_cpu.h).
+ */
+const char *fw_crc32_impl(void);
+
+#endif /* _FW_CRC32_H */
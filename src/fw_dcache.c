@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Optional on-disk cache of digests over ranges of input files
+ *
+ * Every entry is a small file named after its full key, so a lookup is a
+ * single open() and an entry can never be confused with another one.
+ * Entries are written to a temporary file and renamed into place, which
+ * keeps concurrent readers and writers from parallel make jobs safe
+ * without any locking: a reader sees either nothing or a complete entry,
+ * and racing writers store the same bytes.
+ *
+ * A file modified twice within one mtime tick could keep its key while its
+ * contents change, so, like git's index, digests of files modified in the
+ * last FW_DCACHE_RACY_SEC seconds are never stored.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fw_dcache.h"
+
+#define FW_DCACHE_RACY_SEC	2
+#define FW_DCACHE_MAX_DIGEST	64
+
+static const char *fw_dcache_dir(void)
+{
+	const char *dir = getenv("FWUTILS_DIGEST_CACHE");
+
+	return dir && *dir ? dir : NULL;
+}
+
+bool fw_dcache_enabled(void)
+{
+	return fw_dcache_dir() != NULL;
+}
+
+static bool fw_dcache_path(char *path, size_t size, const char *dir,
+			   const struct stat *st, off_t offset, size_t len,
+			   enum fw_dcache_alg alg)
+{
+	int n;
+
+	n = snprintf(path, size, "%s/%jx-%jx-%jx-%jd.%09ld-%jx-%zx-%u", dir,
+		     (uintmax_t)st->st_dev, (uintmax_t)st->st_ino,
+		     (uintmax_t)st->st_size, (intmax_t)st->st_mtim.tv_sec,
+		     st->st_mtim.tv_nsec, (uintmax_t)offset, len, alg);
+
+	return n > 0 && (size_t)n < size;
+}
+
+/* Fails for anything a digest can't be cached for */
+static bool fw_dcache_stat(int fd, off_t offset, size_t len, struct stat *st)
+{
+	if (fstat(fd, st) || !S_ISREG(st->st_mode))
+		return false;
+
+	return offset >= 0 && (uint64_t)offset + len <= (uint64_t)st->st_size;
+}
+
+bool fw_dcache_get(int fd, off_t offset, size_t len, enum fw_dcache_alg alg,
+		   void *digest, size_t digest_len)
+{
+	uint8_t buf[FW_DCACHE_MAX_DIGEST + 1];
+	const char *dir = fw_dcache_dir();
+	char path[PATH_MAX];
+	struct stat st;
+	ssize_t n;
+	int cfd;
+
+	if (!dir || digest_len > FW_DCACHE_MAX_DIGEST ||
+	    !fw_dcache_stat(fd, offset, len, &st) ||
+	    !fw_dcache_path(path, sizeof(path), dir, &st, offset, len, alg))
+		return false;
+
+	cfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (cfd < 0)
+		return false;
+
+	/* One byte extra to reject entries of the wrong size */
+	do {
+		n = read(cfd, buf, sizeof(buf));
+	} while (n < 0 && errno == EINTR);
+	close(cfd);
+
+	if (n != (ssize_t)digest_len)
+		return false;
+
+	memcpy(digest, buf, digest_len);
+
+	return true;
+}
+
+void fw_dcache_put(int fd, off_t offset, size_t len, enum fw_dcache_alg alg,
+		   const void *digest, size_t digest_len)
+{
+	const char *dir = fw_dcache_dir();
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct timespec now;
+	struct stat st;
+	int cfd, n;
+
+	if (!dir || digest_len > FW_DCACHE_MAX_DIGEST ||
+	    !fw_dcache_stat(fd, offset, len, &st) ||
+	    !fw_dcache_path(path, sizeof(path), dir, &st, offset, len, alg))
+		return;
+
+	if (clock_gettime(CLOCK_REALTIME, &now) ||
+	    st.st_mtim.tv_sec >= now.tv_sec - FW_DCACHE_RACY_SEC)
+		return;
+
+	n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if (n < 0 || (size_t)n >= sizeof(tmp))
+		return;
+
+	cfd = mkstemp(tmp);
+	if (cfd < 0)
+		return;
+
+	if (write(cfd, digest, digest_len) != (ssize_t)digest_len) {
+		close(cfd);
+		unlink(tmp);
+		return;
+	}
+
+	if (close(cfd)) {
+		unlink(tmp);
+		return;
+	}
+
+	if (rename(tmp, path))
+		unlink(tmp);
+}
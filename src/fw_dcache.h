@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Optional on-disk cache of digests over ranges of input files
+ */
+
+#ifndef _FW_DCACHE_H
+#define _FW_DCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * What a cached digest was computed with. CRCs are stored for a zero
+ * initial register and no final inversion, which lets the caller apply any
+ * initial value afterwards with fw_crc32_shift().
+ */
+enum fw_dcache_alg {
+	FW_DCACHE_CRC32,	/* fw_crc32(0, ...), big-endian bytes */
+	FW_DCACHE_CRC32_BE,	/* fw_crc32_be(0, ...), big-endian bytes */
+	FW_DCACHE_MD5,
+	FW_DCACHE_SHA1,
+};
+
+/*
+ * The cache is off unless FWUTILS_DIGEST_CACHE names a directory. Entries
+ * are keyed by device, inode, size and mtime of the file together with
+ * the range and algorithm, so any change to the file misses.
+ */
+bool fw_dcache_enabled(void);
+
+/*
+ * Look up the digest of len bytes of fd at offset. Returns true and fills
+ * digest on a hit; misses, errors and non-regular files return false.
+ */
+bool fw_dcache_get(int fd, off_t offset, size_t len, enum fw_dcache_alg alg,
+		   void *digest, size_t digest_len);
+
+/*
+ * Remember a digest computed by the caller. Failures are silently ignored,
+ * the cache is only ever an optimisation.
+ */
+void fw_dcache_put(int fd, off_t offset, size_t len, enum fw_dcache_alg alg,
+		   const void *digest, size_t digest_len);
+
+#endif /* _FW_DCACHE_H */
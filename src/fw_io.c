@@ -0,0 +1,759 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Shared payload I/O for the container tools
+ *
+ * Payloads are moved between descriptors by the kernel wherever it can do
+ * that: copy_file_range() between regular files, sendfile() from a regular
+ * file into a pipe. Anything checksummed on the way is read straight out of
+ * the page cache through a mapping, so a byte is never copied through a
+ * user-space buffer unless one of the ends is a pipe.
+ *
+ * Images made of several inputs can be handed over as a list of extents at
+ * their final offsets, which are then copied concurrently on the worker
+ * pool rather than one file after another.
+ *
+ * When a tool rebuilds over an earlier build of its image (--update), the
+ * data is compared with what the output already holds in 64 KiB blocks and
+ * only blocks that differ are written, so a new rootfs doesn't rewrite an
+ * image's unchanged kernel or padding.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_mem.h"
+#include "fw_pool.h"
+#include "fw_trace.h"
+
+#define FW_IO_BUF_LEN		(256 * 1024)
+#define FW_IO_SPLICE_MAX	(1 << 30)
+#define FW_IO_UPDATE_BLOCK	(64 * 1024)
+
+void fw_io_advise(int fd, off_t offset, size_t len)
+{
+	posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+}
+
+void fw_io_prefetch(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+int fw_io_stat_input(const char *path, struct stat *st)
+{
+	int res;
+
+	res = stat(path, st);
+	if (!res)
+		fw_io_prefetch(path);
+
+	return res;
+}
+
+int fw_io_map(struct fw_io_map *map, int fd, off_t offset, size_t len)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	off_t base = offset & ~((off_t)pagesize - 1);
+	size_t delta = offset - base;
+	void *p;
+
+	memset(map, 0, sizeof(*map));
+	if (!len)
+		return 0;
+
+	p = mmap(NULL, len + delta, PROT_READ, MAP_SHARED, fd, base);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	madvise(p, len + delta, MADV_SEQUENTIAL);
+	madvise(p, len + delta, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	/* Used where the page cache of the file system can hold hugepages */
+	if (len + delta >= FW_MEM_HUGE)
+		madvise(p, len + delta, MADV_HUGEPAGE);
+#endif
+
+	map->base = p;
+	map->map_len = len + delta;
+	map->data = (uint8_t *)p + delta;
+	map->len = len;
+
+	return 0;
+}
+
+void fw_io_unmap(struct fw_io_map *map)
+{
+	if (map->base)
+		munmap(map->base, map->map_len);
+	memset(map, 0, sizeof(*map));
+}
+
+/*
+ * Move len bytes from in_fd at *in_off to out_fd without user-space copies.
+ * out_off is the explicit output offset for seekable outputs or NULL for
+ * pipes. Stops at the first call the kernel refuses and returns how much
+ * made it; the caller finishes the rest the slow way.
+ */
+static size_t fw_io_splice(int out_fd, off_t *out_off, int in_fd, off_t *in_off,
+			   size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t n = len - done;
+		ssize_t ret;
+
+		if (n > FW_IO_SPLICE_MAX)
+			n = FW_IO_SPLICE_MAX;
+
+		if (out_off)
+			ret = copy_file_range(in_fd, in_off, out_fd, out_off, n, 0);
+		else
+			ret = sendfile(out_fd, in_fd, in_off, n);
+		if (ret <= 0)
+			break;
+
+		done += ret;
+	}
+
+	return done;
+}
+
+/*
+ * Handle a regular input file from in_off: feed the sink from a mapping and
+ * splice the data to out. Returns the bytes done, with both streams
+ * positioned after them, or -errno. Returning less than n tells the caller
+ * to carry on with buffered I/O, which can only happen without a sink.
+ */
+static ssize_t fw_io_copy_reg(FILE *out, FILE *in, off_t in_off, size_t n,
+			      fw_io_sink sink, void *priv)
+{
+	struct fw_io_map map = {};
+	off_t out_start = -1, out_off, src_off = in_off;
+	size_t done = n;
+	int err;
+
+	if (sink) {
+		err = fw_io_map(&map, fileno(in), in_off, n);
+		if (err)
+			return 0;
+		if (n)
+			sink(priv, map.data, n);
+	}
+
+	if (out) {
+		out_start = out_off = ftello(out);
+		done = fw_io_splice(fileno(out), out_start < 0 ? NULL : &out_off,
+				    fileno(in), &src_off, n);
+		if (out_start >= 0 && fseeko(out, out_start + done, SEEK_SET)) {
+			fw_io_unmap(&map);
+			return -EIO;
+		}
+
+		/* The sink has seen everything, so finish from the mapping */
+		if (done < n && sink) {
+			if (fwrite(map.data + done, 1, n - done, out) != n - done) {
+				fw_io_unmap(&map);
+				return -EIO;
+			}
+			done = n;
+		}
+	}
+
+	fw_io_unmap(&map);
+
+	if (fseeko(in, in_off + done, SEEK_SET))
+		return -EIO;
+
+	return done;
+}
+
+static ssize_t fw_io_do_copy(FILE *out, FILE *in, size_t len, fw_io_sink sink,
+			     void *priv)
+{
+	struct stat st;
+	size_t done = 0;
+	off_t in_off;
+	uint8_t *buf;
+	int err = 0;
+
+	if (out && fflush(out))
+		return -EIO;
+
+	in_off = ftello(in);
+	if (in_off >= 0 && !fstat(fileno(in), &st) && S_ISREG(st.st_mode)) {
+		size_t avail = st.st_size > in_off ? st.st_size - in_off : 0;
+		size_t n = len < avail ? len : avail;
+		ssize_t ret;
+
+		ret = fw_io_copy_reg(out, in, in_off, n, sink, priv);
+		if (ret < 0 || ret == n)
+			return ret;
+		done = ret;
+	}
+
+	buf = malloc(FW_IO_BUF_LEN);
+	if (!buf)
+		return -ENOMEM;
+
+	while (done < len) {
+		size_t want = len - done < FW_IO_BUF_LEN ? len - done : FW_IO_BUF_LEN;
+		size_t bytes;
+
+		bytes = fread(buf, 1, want, in);
+		if (!bytes) {
+			if (ferror(in))
+				err = -EIO;
+			break;
+		}
+
+		if (sink)
+			sink(priv, buf, bytes);
+		if (out && fwrite(buf, 1, bytes, out) != bytes) {
+			err = -EIO;
+			break;
+		}
+
+		done += bytes;
+	}
+
+	free(buf);
+
+	return err ? err : done;
+}
+
+ssize_t fw_io_copy(FILE *out, FILE *in, size_t len, fw_io_sink sink, void *priv)
+{
+	struct fw_trace t;
+	ssize_t ret;
+
+	fw_trace_begin(&t, "io_copy");
+	ret = fw_io_do_copy(out, in, len, sink, priv);
+	fw_trace_end(&t, ret > 0 ? ret : 0);
+
+	return ret;
+}
+
+static ssize_t fw_io_do_copy_fd(int out_fd, off_t out_off, int in_fd,
+				off_t in_off, size_t len)
+{
+	size_t done = 0;
+	uint8_t *buf;
+
+	while (done < len) {
+		size_t n = len - done;
+		ssize_t ret;
+
+		if (n > FW_IO_SPLICE_MAX)
+			n = FW_IO_SPLICE_MAX;
+
+		ret = copy_file_range(in_fd, &in_off, out_fd, &out_off, n, 0);
+		if (ret == 0)
+			return done;
+		if (ret < 0)
+			break;
+
+		done += ret;
+	}
+
+	if (done == len)
+		return done;
+
+	buf = malloc(FW_IO_BUF_LEN);
+	if (!buf)
+		return -ENOMEM;
+
+	while (done < len) {
+		size_t want = len - done < FW_IO_BUF_LEN ? len - done : FW_IO_BUF_LEN;
+		ssize_t bytes, ret, off;
+
+		bytes = pread(in_fd, buf, want, in_off);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			break;
+
+		for (off = 0; off < bytes; off += ret) {
+			ret = pwrite(out_fd, buf + off, bytes - off, out_off + off);
+			if (ret < 0 && errno == EINTR)
+				ret = 0;
+			else if (ret <= 0) {
+				int err = ret ? -errno : -EIO;
+
+				free(buf);
+				return err;
+			}
+		}
+
+		in_off += bytes;
+		out_off += bytes;
+		done += bytes;
+	}
+
+	free(buf);
+
+	return done;
+}
+
+ssize_t fw_io_copy_fd(int out_fd, off_t out_off, int in_fd, off_t in_off,
+		      size_t len)
+{
+	struct fw_trace t;
+	ssize_t ret;
+
+	fw_trace_begin(&t, "io_copy_fd");
+	ret = fw_io_do_copy_fd(out_fd, out_off, in_fd, in_off, len);
+	fw_trace_end(&t, ret > 0 ? ret : 0);
+
+	return ret;
+}
+
+static int fw_io_pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const uint8_t *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret ? -errno : -EIO;
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+struct fw_io_extents {
+	int out_fd;
+	struct fw_io_extent *ext;
+};
+
+static void fw_io_extent_job(void *arg, unsigned int idx)
+{
+	struct fw_io_extents *job = arg;
+	struct fw_io_extent *ext = &job->ext[idx];
+	struct fw_io_map map = {};
+	ssize_t ret;
+
+	if (ext->fd < 0) {
+		if (!ext->buf)
+			return;
+		if (ext->sink && ext->len)
+			ext->sink(ext->priv, ext->buf, ext->len);
+		ext->err = fw_io_pwrite_all(job->out_fd, ext->buf, ext->len,
+					    ext->out_off);
+		return;
+	}
+
+	if (ext->sink) {
+		ext->err = fw_io_map(&map, ext->fd, ext->in_off, ext->len);
+		if (ext->err)
+			return;
+		if (ext->len)
+			ext->sink(ext->priv, map.data, ext->len);
+	}
+
+	ret = fw_io_copy_fd(job->out_fd, ext->out_off, ext->fd, ext->in_off,
+			    ext->len);
+	if (ret < 0)
+		ext->err = ret;
+	else if ((size_t)ret != ext->len)
+		ext->err = -EIO;
+
+	fw_io_unmap(&map);
+}
+
+int fw_io_copy_extents(int out_fd, struct fw_io_extent *ext, unsigned int n)
+{
+	struct fw_io_extents job = { .out_fd = out_fd, .ext = ext };
+	struct fw_trace t;
+	size_t total = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		ext[i].err = 0;
+		total += ext[i].len;
+	}
+
+	fw_trace_begin(&t, "io_copy_extents");
+	fw_pool_run(n, fw_io_extent_job, &job);
+	fw_trace_end(&t, total);
+
+	for (i = 0; i < n; i++)
+		if (ext[i].err)
+			return ext[i].err;
+
+	return 0;
+}
+
+static void fw_io_crc32_sink(void *priv, const void *buf, size_t len)
+{
+	uint32_t *crc = priv;
+
+	*crc = fw_crc32(*crc, buf, len);
+}
+
+int fw_io_copy_extents_crc32(int out_fd, struct fw_io_extent *ext,
+			     unsigned int n, uint32_t *crc)
+{
+	uint32_t *part;
+	unsigned int i;
+	int err;
+
+	part = calloc(n ?: 1, sizeof(*part));
+	if (!part)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		ext[i].sink = fw_io_crc32_sink;
+		ext[i].priv = &part[i];
+	}
+
+	err = fw_io_copy_extents(out_fd, ext, n);
+	if (!err)
+		for (i = 0; i < n; i++)
+			*crc = fw_crc32_combine(*crc, part[i], ext[i].len);
+
+	free(part);
+
+	return err;
+}
+
+int fw_io_prepend(int out_fd, const void *head, size_t head_len, int in_fd,
+		  off_t in_off, size_t len, const void *tail, size_t tail_len,
+		  fw_io_sink digest, void *priv)
+{
+	struct fw_io_map map;
+	struct fw_trace t;
+	ssize_t ret;
+	int err;
+
+	fw_trace_begin(&t, "io_prepend");
+
+	if (digest) {
+		err = fw_io_map(&map, in_fd, in_off, len);
+		if (err)
+			goto out;
+		digest(priv, map.data, len);
+		fw_io_unmap(&map);
+	}
+
+	err = fw_io_pwrite_all(out_fd, head, head_len, 0);
+	if (err)
+		goto out;
+
+	ret = fw_io_copy_fd(out_fd, head_len, in_fd, in_off, len);
+	if (ret < 0) {
+		err = ret;
+		goto out;
+	}
+	if ((size_t)ret != len) {
+		err = -EIO;
+		goto out;
+	}
+
+	err = fw_io_pwrite_all(out_fd, tail, tail_len, head_len + len);
+
+out:
+	fw_trace_end(&t, err ? 0 : head_len + len + tail_len);
+
+	return err;
+}
+
+static ssize_t fw_io_pread_all(int fd, void *buf, size_t len, off_t off)
+{
+	uint8_t *p = buf;
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, p + done, len - done, off + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+int fw_io_pwrite_changed(int fd, const void *buf, size_t len, off_t off,
+			 size_t *written)
+{
+	static const uint8_t zeros[FW_IO_UPDATE_BLOCK];
+	size_t done, n;
+	uint8_t *old;
+	ssize_t ret;
+	int err = 0;
+
+	old = malloc(FW_IO_UPDATE_BLOCK);
+	if (!old)
+		return -ENOMEM;
+
+	for (done = 0; done < len; done += n) {
+		const uint8_t *p = buf ? (const uint8_t *)buf + done : zeros;
+
+		n = len - done < FW_IO_UPDATE_BLOCK ? len - done : FW_IO_UPDATE_BLOCK;
+
+		ret = fw_io_pread_all(fd, old, n, off + done);
+		if (ret < 0) {
+			err = ret;
+			break;
+		}
+		if ((size_t)ret == n && !memcmp(old, p, n))
+			continue;
+
+		err = fw_io_pwrite_all(fd, p, n, off + done);
+		if (err)
+			break;
+		if (written)
+			*written += n;
+	}
+
+	free(old);
+
+	return err;
+}
+
+static void fw_io_update_job(void *arg, unsigned int idx)
+{
+	struct fw_io_extents *job = arg;
+	struct fw_io_extent *ext = &job->ext[idx];
+	struct fw_io_map map = {};
+	const void *data = ext->buf;
+
+	if (ext->fd >= 0) {
+		ext->err = fw_io_map(&map, ext->fd, ext->in_off, ext->len);
+		if (ext->err)
+			return;
+		data = map.data;
+	}
+
+	if (ext->sink && data)
+		ext->sink(ext->priv, data, ext->len);
+
+	ext->err = fw_io_pwrite_changed(job->out_fd, data, ext->len,
+					ext->out_off, &ext->written);
+
+	fw_io_unmap(&map);
+}
+
+int fw_io_update_extents(int out_fd, struct fw_io_extent *ext, unsigned int n)
+{
+	struct fw_io_extents job = { .out_fd = out_fd, .ext = ext };
+	struct fw_trace t;
+	size_t written = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		ext[i].err = 0;
+		ext[i].written = 0;
+	}
+
+	fw_trace_begin(&t, "io_update_extents");
+	fw_pool_run(n, fw_io_update_job, &job);
+
+	for (i = 0; i < n; i++)
+		written += ext[i].written;
+	fw_trace_end(&t, written);
+
+	for (i = 0; i < n; i++)
+		if (ext[i].err)
+			return ext[i].err;
+
+	return 0;
+}
+
+int fw_io_open_update(const char *path, const char *existing)
+{
+	struct stat st, ex_st;
+	ssize_t ret;
+	int fd, ex;
+
+	ex = open(existing, O_RDONLY | O_CLOEXEC);
+	if (ex < 0 && errno != ENOENT)
+		return -errno;
+
+	if (ex >= 0 && fstat(ex, &ex_st)) {
+		ret = -errno;
+		close(ex);
+		return ret;
+	}
+
+	if (ex >= 0 && !stat(path, &st) &&
+	    st.st_dev == ex_st.st_dev && st.st_ino == ex_st.st_ino) {
+		close(ex);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		return fd < 0 ? -errno : fd;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		ret = -errno;
+		if (ex >= 0)
+			close(ex);
+		return ret;
+	}
+
+	if (ex < 0)
+		return fd;
+
+	/* Shares the blocks with existing where the filesystem can reflink */
+	ret = fw_io_copy_fd(fd, 0, ex, 0, ex_st.st_size);
+	close(ex);
+	if (ret != ex_st.st_size) {
+		close(fd);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	return fd;
+}
+
+int fw_io_update_file(int fd, int src_fd, size_t *written)
+{
+	struct fw_io_map map;
+	struct stat st;
+	int err;
+
+	if (fstat(src_fd, &st))
+		return -errno;
+
+	err = fw_io_map(&map, src_fd, 0, st.st_size);
+	if (err)
+		return err;
+
+	err = fw_io_pwrite_changed(fd, map.data, st.st_size, 0, written);
+	fw_io_unmap(&map);
+	if (err)
+		return err;
+
+	return ftruncate(fd, st.st_size) ? -errno : 0;
+}
+
+FILE *fw_io_stage(void)
+{
+	FILE *fp;
+	int fd;
+
+	fd = memfd_create("fwutils-stage", MFD_CLOEXEC);
+	if (fd < 0)
+		return tmpfile();
+
+	fp = fdopen(fd, "w+");
+	if (!fp)
+		close(fd);
+
+	return fp;
+}
+
+ssize_t fw_io_slurp(int fd, void **bufp)
+{
+	size_t len = 0, size = 0;
+	uint8_t *buf = NULL, *tmp;
+	ssize_t ret;
+
+	for (;;) {
+		if (len == size) {
+			size = size ? size * 2 : FW_IO_BUF_LEN;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				free(buf);
+				return -ENOMEM;
+			}
+			buf = tmp;
+		}
+
+		ret = read(fd, buf + len, size - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			ret = -errno;
+			free(buf);
+			return ret;
+		}
+		if (!ret)
+			break;
+		len += ret;
+	}
+
+	*bufp = buf;
+
+	return len;
+}
+
+static char **walk_files;
+static size_t walk_n, walk_alloc;
+
+static int fw_io_walk_one(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	char **files;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	if (walk_n == walk_alloc) {
+		walk_alloc = walk_alloc ? 2 * walk_alloc : 64;
+		files = realloc(walk_files, walk_alloc * sizeof(*files));
+		if (!files)
+			return -1;
+		walk_files = files;
+	}
+
+	walk_files[walk_n] = strdup(path);
+	if (!walk_files[walk_n])
+		return -1;
+	walk_n++;
+
+	return 0;
+}
+
+static int fw_io_walk_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int fw_io_walk(const char *path, char ***files, size_t *n)
+{
+	size_t first = *n;
+	int err = 0;
+
+	walk_files = *files;
+	walk_n = walk_alloc = *n;
+
+	if (nftw(path, fw_io_walk_one, 16, FTW_PHYS))
+		err = errno ? -errno : -ENOMEM;
+	qsort(walk_files + first, walk_n - first, sizeof(*walk_files), fw_io_walk_cmp);
+
+	*files = walk_files;
+	*n = walk_n;
+	walk_files = NULL;
+
+	return err;
+}
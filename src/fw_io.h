@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Shared payload I/O for the container tools
+ */
+
+#ifndef _FW_IO_H
+#define _FW_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Copy everything up to EOF */
+#define FW_IO_ALL	SIZE_MAX
+
+/* Receives every byte fw_io_copy() moves, e.g. to update a CRC or MD5 */
+typedef void (*fw_io_sink)(void *priv, const void *buf, size_t len);
+
+/*
+ * Copy len bytes (or all of it with FW_IO_ALL) from the current position of
+ * in to the current position of out, handing the same bytes to sink when
+ * one is given. out may be NULL to only feed the sink.
+ *
+ * Regular input files are mapped for the sink and copied kernel-side with
+ * copy_file_range() or sendfile(); pipes and other odd descriptors fall back
+ * to large buffered reads. Both streams are left positioned right after the
+ * data, so callers can keep using stdio on them.
+ *
+ * Returns the number of bytes copied, which is only short of len if in hit
+ * EOF, or -errno.
+ */
+ssize_t fw_io_copy(FILE *out, FILE *in, size_t len, fw_io_sink sink, void *priv);
+
+/*
+ * Copy len bytes from in_fd at in_off to out_fd at out_off without touching
+ * either file offset or any stdio buffering: copy_file_range() where the
+ * kernel allows it, otherwise pread()/pwrite() through a large buffer.
+ *
+ * Returns the number of bytes copied, which is only short of len if in_fd
+ * hit EOF, or -errno.
+ */
+ssize_t fw_io_copy_fd(int out_fd, off_t out_off, int in_fd, off_t in_off,
+		      size_t len);
+
+/*
+ * One piece of an output file for fw_io_copy_extents(): len bytes from fd
+ * at in_off, or from buf when fd is -1. With neither (fd -1, buf NULL) the
+ * extent is left as a hole, i.e. reads back as zeros once the file has been
+ * extended past it. sink, when given, sees exactly this extent's bytes.
+ */
+struct fw_io_extent {
+	int fd;
+	off_t in_off;
+	const void *buf;
+	size_t len;
+	off_t out_off;
+	fw_io_sink sink;
+	void *priv;
+	int err;		/* 0, -errno, or -EIO for a short input */
+	size_t written;		/* bytes fw_io_update_extents() had to write */
+};
+
+/*
+ * Write n extents to out_fd, each at its own out_off. The extents are
+ * copied concurrently on the worker pool, so a multi-part image keeps
+ * several reads and writes in flight instead of one file at a time; their
+ * sinks may run concurrently too, but only one per extent. Returns 0 or
+ * the error of the first extent that failed.
+ */
+int fw_io_copy_extents(int out_fd, struct fw_io_extent *ext, unsigned int n);
+
+/*
+ * fw_io_copy_extents() for the usual converter: advance the fw_crc32()
+ * register *crc over the data of all extents, in array order, as if they
+ * were one buffer. Each extent is checksummed by its own job and the
+ * results combined afterwards; holes count as zeros. Any sinks of ext are
+ * replaced.
+ */
+int fw_io_copy_extents_crc32(int out_fd, struct fw_io_extent *ext,
+			     unsigned int n, uint32_t *crc);
+
+/*
+ * The usual header-prepend converter: write head, len bytes of in_fd from
+ * in_off and then tail (may be empty) to out_fd from offset 0. When digest
+ * is given it is called once with the whole payload, mapped, before
+ * anything is written, so it can fill in checksums of head or tail from
+ * it; the payload itself is then copied kernel-side. Returns 0 or -errno,
+ * -EIO if in_fd ends early.
+ */
+int fw_io_prepend(int out_fd, const void *head, size_t head_len, int in_fd,
+		  off_t in_off, size_t len, const void *tail, size_t tail_len,
+		  fw_io_sink digest, void *priv);
+
+/*
+ * Rebuilding over an earlier build of an image (--update <existing>).
+ * fw_io_open_update() opens path for that: path itself when it is the
+ * existing file, otherwise a fresh copy of existing, made with
+ * copy_file_range() so filesystems with reflinks share the blocks. A
+ * missing existing image is fine, everything gets written then. Returns a
+ * descriptor open for reading and writing, or -errno.
+ */
+int fw_io_open_update(const char *path, const char *existing);
+
+/*
+ * pwrite() of len bytes of buf (zeros if buf is NULL) to fd at off that
+ * skips every 64 KiB block fd already holds, so only the changed ranges of
+ * an image are written. Bytes past the end of fd count as changed. fd must
+ * be readable too. Adds the number of bytes written to *written if not
+ * NULL. Returns 0 or -errno.
+ */
+int fw_io_pwrite_changed(int fd, const void *buf, size_t len, off_t off,
+			 size_t *written);
+
+/*
+ * fw_io_copy_extents() through fw_io_pwrite_changed(): holes are compared
+ * against zeros rather than skipped, and every extent's written count is
+ * set. Sinks still see all of every extent's data.
+ */
+int fw_io_update_extents(int out_fd, struct fw_io_extent *ext, unsigned int n);
+
+/*
+ * For tools that write their image through stdio: fw_io_stage() returns a
+ * temporary stream in memory (memfd, or tmpfile() without one) to build
+ * the image in, and fw_io_update_file() then brings fd up to date with the
+ * whole of src_fd and truncates it to the same length.
+ */
+FILE *fw_io_stage(void);
+int fw_io_update_file(int fd, int src_fd, size_t *written);
+
+/*
+ * Read everything from fd into a malloc'ed buffer, for inputs whose length
+ * isn't known up front (pipes). Returns the length or -errno.
+ */
+ssize_t fw_io_slurp(int fd, void **buf);
+
+/*
+ * Tell the kernel fd is about to be read sequentially from offset and have
+ * it start pulling len bytes (0: up to EOF) into the page cache in the
+ * background. A hint only; failures are ignored.
+ */
+void fw_io_advise(int fd, off_t offset, size_t len);
+
+/*
+ * Start reading a whole file into the page cache without waiting for it,
+ * for inputs that are only read once the headers have been worked out.
+ * The data stays cached after the descriptor is closed again.
+ */
+void fw_io_prefetch(const char *path);
+
+/*
+ * stat() an input that is only read once the image has been laid out, and
+ * start pulling it into the page cache with fw_io_prefetch() so the data
+ * streams in while options are checked and the header is built. Returns
+ * what stat() returned.
+ */
+int fw_io_stat_input(const char *path, struct stat *st);
+
+/*
+ * Append the regular files under path to the malloc'ed array *files of *n
+ * strdup'ed names, in strcmp() order; a path that isn't a directory is
+ * appended itself if it is a regular file. Symlinks aren't followed. Not
+ * thread-safe. Returns 0, or -errno with what was found so far kept.
+ */
+int fw_io_walk(const char *path, char ***files, size_t *n);
+
+struct fw_io_map {
+	const uint8_t *data;
+	size_t len;
+	void *base;		/* page aligned start of the mapping */
+	size_t map_len;
+};
+
+/*
+ * Map len bytes of fd from offset read-only for a sequential pass. offset
+ * needn't be page aligned. An empty range succeeds with data == NULL.
+ * Returns 0 or -errno.
+ */
+int fw_io_map(struct fw_io_map *map, int fd, off_t offset, size_t len);
+void fw_io_unmap(struct fw_io_map *map);
+
+#endif /* _FW_IO_H */
@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Entry point of every standalone tool
+ *
+ * Where the linker supports it, the tools are linked with --wrap=main (see
+ * CMakeLists.txt), so the C runtime starts here and the tool's own main()
+ * is __real_main(). Options every tool understands are taken out of argv
+ * before it sees them.
+ */
+
+#include <stdlib.h>
+
+#include "fw_stats.h"
+
+int __real_main(int argc, char **argv, char **envp);
+
+int __wrap_main(int argc, char **argv, char **envp)
+{
+	if (fw_stats_setup(&argc, argv))
+		return EXIT_FAILURE;
+
+	return __real_main(argc, argv, envp);
+}
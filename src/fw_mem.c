@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Whole-image buffers that stay within a memory budget
+ *
+ * Most builders assemble the image in one buffer and write it out at the
+ * end, which suits their formats: headers are patched in after the fact,
+ * partitions are placed at absolute offsets and some later options write
+ * over earlier data. Rather than turning each of them into a streaming
+ * writer, buffers over the FWUTILS_MAX_MEM budget are backed by a
+ * temporary file. Their pages are then file cache the kernel can write
+ * back and reclaim, so the anonymous memory of a tool stays at a few MB
+ * whatever the image size.
+ *
+ * Which of its three kinds a buffer is follows from its length alone,
+ * which is why fw_mem_free() and fw_mem_realloc() need to be told it.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fw_mem.h"
+
+size_t fw_mem_limit(void)
+{
+	const char *env = getenv("FWUTILS_MAX_MEM");
+	unsigned long long n;
+	char *end;
+
+	if (!env || !*env)
+		return 0;
+
+	n = strtoull(env, &end, 0);
+	switch (*end) {
+	case 'g':
+	case 'G':
+		n <<= 10;
+		/* fall through */
+	case 'm':
+	case 'M':
+		n <<= 10;
+		/* fall through */
+	case 'k':
+	case 'K':
+		n <<= 10;
+		break;
+	}
+
+	return n > SIZE_MAX ? SIZE_MAX : n;
+}
+
+enum fw_mem_kind {
+	FW_MEM_HEAP,
+	FW_MEM_ANON,
+	FW_MEM_TMP,
+};
+
+static enum fw_mem_kind fw_mem_kind(size_t len)
+{
+	size_t limit = fw_mem_limit();
+
+	if (limit && len > limit)
+		return FW_MEM_TMP;
+
+	return len < FW_MEM_HUGE ? FW_MEM_HEAP : FW_MEM_ANON;
+}
+
+static size_t fw_mem_page_align(size_t len)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	return (len + pagesize - 1) & ~(pagesize - 1);
+}
+
+static void *fw_mem_heap(size_t len)
+{
+	void *buf;
+	int err;
+
+	err = posix_memalign(&buf, FW_MEM_ALIGN, len);
+	if (err) {
+		errno = err;
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void fw_mem_advise_huge(void *buf, size_t len)
+{
+#ifdef MADV_HUGEPAGE
+	madvise(buf, len, MADV_HUGEPAGE);
+#endif
+}
+
+/*
+ * Hugepages only back whole, aligned 2 MiB ranges: over-allocate by one
+ * and unmap what lies outside the aligned start and the page rounded end.
+ */
+static void *fw_mem_map_anon(size_t len)
+{
+	size_t map_len, keep, head;
+	uint8_t *p;
+
+	keep = fw_mem_page_align(len);
+	if (keep < len || keep > SIZE_MAX - FW_MEM_HUGE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	map_len = keep + FW_MEM_HUGE;
+
+	p = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	head = -(uintptr_t)p & (FW_MEM_HUGE - 1);
+	if (head)
+		munmap(p, head);
+	if (map_len - head > keep)
+		munmap(p + head + keep, map_len - head - keep);
+	p += head;
+
+	fw_mem_advise_huge(p, keep);
+
+	return p;
+}
+
+static void *fw_mem_map_tmp(size_t len)
+{
+	const char *dir = getenv("TMPDIR");
+	char path[PATH_MAX];
+	void *buf;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/fwutils.XXXXXX", dir && *dir ? dir : "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0)
+		return NULL;
+	unlink(path);
+
+	if (ftruncate(fd, len)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if (buf == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+
+	return buf;
+}
+
+void *fw_mem_alloc(size_t len)
+{
+	switch (fw_mem_kind(len)) {
+	case FW_MEM_HEAP:
+		return fw_mem_heap(len);
+	case FW_MEM_ANON:
+		return fw_mem_map_anon(len);
+	default:
+		return fw_mem_map_tmp(len);
+	}
+}
+
+void *fw_mem_realloc(void *buf, size_t old_len, size_t len)
+{
+	enum fw_mem_kind old_kind = fw_mem_kind(old_len);
+	enum fw_mem_kind kind = fw_mem_kind(len);
+	void *p;
+
+	if (!buf)
+		return fw_mem_alloc(len);
+
+	if (old_kind == FW_MEM_HEAP && kind == FW_MEM_HEAP) {
+		p = realloc(buf, len);
+		/* realloc() only keeps malloc()'s own alignment */
+		if (!p || !((uintptr_t)p & (FW_MEM_ALIGN - 1)))
+			return p;
+		buf = p;
+		old_len = len;
+	} else if (old_kind == FW_MEM_ANON && kind == FW_MEM_ANON) {
+		/* Moved pages stay page but not necessarily hugepage aligned */
+		p = mremap(buf, fw_mem_page_align(old_len),
+			   fw_mem_page_align(len), MREMAP_MAYMOVE);
+		if (p == MAP_FAILED)
+			return NULL;
+		fw_mem_advise_huge(p, fw_mem_page_align(len));
+		return p;
+	}
+
+	p = fw_mem_alloc(len);
+	if (!p)
+		return NULL;
+
+	memcpy(p, buf, old_len < len ? old_len : len);
+	fw_mem_free(buf, old_len);
+
+	return p;
+}
+
+void fw_mem_free(void *buf, size_t len)
+{
+	if (!buf)
+		return;
+
+	if (fw_mem_kind(len) == FW_MEM_HEAP)
+		free(buf);
+	else
+		munmap(buf, len);
+}
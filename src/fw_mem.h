@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Whole-image buffers that stay within a memory budget
+ */
+
+#ifndef _FW_MEM_H
+#define _FW_MEM_H
+
+#include <stddef.h>
+
+/*
+ * The budget from FWUTILS_MAX_MEM (bytes, or with a k, M or G suffix), or 0
+ * when it isn't set. "fwtool --max-mem <size>" sets it for a tool.
+ */
+size_t fw_mem_limit(void);
+
+/* Every fw_mem_alloc() buffer starts on a cache line */
+#define FW_MEM_ALIGN		64
+
+/* From this size on, buffers are mappings of their own, see fw_mem_alloc() */
+#define FW_MEM_HUGE		(2 * 1024 * 1024)
+
+/*
+ * Allocate a buffer for a whole image or input, FW_MEM_ALIGN aligned.
+ * Within the budget small buffers come from the heap, and those of
+ * FW_MEM_HUGE or more are anonymous mappings aligned to it and backed by
+ * transparent hugepages where the kernel has them, so passes over the
+ * image don't miss the TLB every 4 KiB. Beyond the budget the buffer is a
+ * shared mapping of an unlinked temporary file in $TMPDIR, so the kernel
+ * writes it back and drops it under memory pressure instead of the build
+ * host running out of memory. Returns NULL with errno set on failure.
+ */
+void *fw_mem_alloc(size_t len);
+
+/* realloc() for fw_mem_alloc() buffers; old_len is the current size */
+void *fw_mem_realloc(void *buf, size_t old_len, size_t len);
+
+/* Free a fw_mem_alloc() buffer of len bytes */
+void fw_mem_free(void *buf, size_t len);
+
+#endif /* _FW_MEM_H */
@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Minimal worker pool for data-parallel loops
+ *
+ * Threads are created per fw_pool_run() call and pull indices from a shared
+ * counter. The tools run one or two such loops per invocation, so keeping
+ * threads around between calls would not buy anything.
+ *
+ * The tools are mostly run from OpenWrt's build, which is a parallel make
+ * of its own. When make's jobserver is advertised in MAKEFLAGS, each extra
+ * thread takes a token from it for the duration of the loop and gives it
+ * back afterwards, so a make -jN never ends up with more than N busy jobs.
+ *
+ * Loop bodies only write state of their own index and callers merge in
+ * index order, so images don't depend on the thread count or on which
+ * thread ran what. FWUTILS_SCHED=reverse hands indices out last first to
+ * let fwbench -c and FWUTILS_SELFCHECK=1 runs prove that.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fw_mem.h"
+#include "fw_pool.h"
+
+#define FW_POOL_MAX_THREADS	64
+
+struct fw_pool_job {
+	void (*fn)(void *arg, unsigned int idx);
+	void *arg;
+	unsigned int n;
+	unsigned int next;
+	bool reverse;
+};
+
+static bool fw_pool_env_reverse(void)
+{
+	const char *env = getenv("FWUTILS_SCHED");
+
+	return env && !strcmp(env, "reverse");
+}
+
+bool fw_pool_selfcheck(void)
+{
+	const char *env = getenv("FWUTILS_SELFCHECK");
+
+	return env && *env && strcmp(env, "0");
+}
+
+/*
+ * Jobserver state. rfd is a descriptor of our own in non-blocking mode:
+ * the one make hands down is shared with every other job, so its flags
+ * must not be touched.
+ */
+static struct {
+	pthread_once_t once;
+	bool serial;
+	int rfd;
+	int wfd;
+} jobserver = { PTHREAD_ONCE_INIT, false, -1, -1 };
+
+/* Returns the value of the last "--<name>=" option in MAKEFLAGS, or NULL */
+static const char *makeflags_opt(const char *flags, const char *name)
+{
+	const char *p, *last = NULL;
+	size_t len = strlen(name);
+
+	for (p = flags; (p = strstr(p, name)); p += len)
+		if (p[len] == '=')
+			last = p + len + 1;
+
+	return last;
+}
+
+static void fw_pool_jobserver_init(void)
+{
+	const char *flags, *auth;
+	char path[64];
+	int rfd, wfd;
+
+	flags = getenv("MAKEFLAGS");
+	if (!flags)
+		return;
+
+	auth = makeflags_opt(flags, "--jobserver-auth");
+	if (!auth)
+		auth = makeflags_opt(flags, "--jobserver-fds");
+	if (!auth)
+		return;
+
+	/* From here on make runs in parallel; don't add to it if unsure */
+	jobserver.serial = true;
+
+	if (!strncmp(auth, "fifo:", 5)) {
+		char *fifo = strndup(auth + 5, strcspn(auth + 5, " "));
+
+		if (!fifo)
+			return;
+		rfd = open(fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		free(fifo);
+		if (rfd < 0)
+			return;
+		wfd = rfd;
+	} else {
+		if (sscanf(auth, "%d,%d", &rfd, &wfd) != 2 || rfd < 0 || wfd < 0)
+			return;
+
+		/* Recipes not marked '+' get the descriptors closed */
+		if (fcntl(rfd, F_GETFD) < 0 || fcntl(wfd, F_GETFD) < 0)
+			return;
+
+		/* Reopening the pipe gives a file description of our own */
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", rfd);
+		rfd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (rfd < 0)
+			return;
+	}
+
+	jobserver.rfd = rfd;
+	jobserver.wfd = wfd;
+	jobserver.serial = false;
+}
+
+/* Grabs up to want job tokens without waiting; returns how many it got */
+static unsigned int fw_pool_get_tokens(char *tokens, unsigned int want)
+{
+	ssize_t n;
+
+	if (jobserver.rfd < 0)
+		return want;
+	if (!want)
+		return 0;
+
+	do {
+		n = read(jobserver.rfd, tokens, want);
+	} while (n < 0 && errno == EINTR);
+
+	return n > 0 ? n : 0;
+}
+
+static void fw_pool_put_tokens(const char *tokens, unsigned int n)
+{
+	ssize_t ret;
+
+	if (jobserver.wfd < 0)
+		return;
+
+	while (n) {
+		ret = write(jobserver.wfd, tokens, n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		tokens += ret;
+		n -= ret;
+	}
+}
+
+unsigned int fw_pool_threads(void)
+{
+	const char *env;
+	cpu_set_t set;
+	long n = 0;
+
+	pthread_once(&jobserver.once, fw_pool_jobserver_init);
+	if (jobserver.serial)
+		return 1;
+
+	env = getenv("FWUTILS_THREADS");
+	if (env)
+		n = strtol(env, NULL, 0);
+	if (n <= 0 && !sched_getaffinity(0, sizeof(set), &set))
+		n = CPU_COUNT(&set);
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0)
+		n = 1;
+	if (n > FW_POOL_MAX_THREADS)
+		n = FW_POOL_MAX_THREADS;
+
+	return n;
+}
+
+static void *fw_pool_worker(void *data)
+{
+	struct fw_pool_job *job = data;
+	unsigned int idx;
+
+	while ((idx = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n)
+		job->fn(job->arg, job->reverse ? job->n - 1 - idx : idx);
+
+	return NULL;
+}
+
+void fw_pool_run(unsigned int n, void (*fn)(void *arg, unsigned int idx),
+		 void *arg)
+{
+	struct fw_pool_job job = {
+		.fn = fn, .arg = arg, .n = n, .reverse = fw_pool_env_reverse()
+	};
+	pthread_t tid[FW_POOL_MAX_THREADS];
+	char tokens[FW_POOL_MAX_THREADS];
+	unsigned int nthreads, ntokens, started, i;
+
+	nthreads = fw_pool_threads();
+	if (nthreads > n)
+		nthreads = n;
+
+	/* The calling thread is a worker as well, on make's token for us */
+	ntokens = fw_pool_get_tokens(tokens, nthreads ? nthreads - 1 : 0);
+
+	for (started = 0; started < ntokens; started++)
+		if (pthread_create(&tid[started], NULL, fw_pool_worker, &job))
+			break;
+
+	fw_pool_worker(&job);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	if (jobserver.rfd >= 0)
+		fw_pool_put_tokens(tokens, ntokens);
+}
+
+struct fw_pool_range {
+	void (*fn)(void *arg, unsigned int idx, size_t offset, size_t n);
+	void *arg;
+	size_t len;
+	size_t chunk;
+};
+
+static void fw_pool_range_job(void *arg, unsigned int idx)
+{
+	struct fw_pool_range *range = arg;
+	size_t offset = idx * range->chunk;
+	size_t n = range->len - offset;
+
+	if (n > range->chunk)
+		n = range->chunk;
+
+	range->fn(range->arg, idx, offset, n);
+}
+
+unsigned int fw_pool_run_range(size_t len, size_t min_chunk,
+			       unsigned int max_chunks, size_t *chunk,
+			       void (*fn)(void *arg, unsigned int idx,
+					  size_t offset, size_t n),
+			       void *arg)
+{
+	struct fw_pool_range range = { .fn = fn, .arg = arg, .len = len };
+	unsigned int nchunks;
+
+	/* A few chunks per thread evens out uneven progress */
+	nchunks = fw_pool_threads() * 4;
+	if (nchunks > max_chunks)
+		nchunks = max_chunks;
+	if (!nchunks)
+		nchunks = 1;
+	range.chunk = (len + nchunks - 1) / nchunks;
+	if (range.chunk < min_chunk)
+		range.chunk = min_chunk;
+	/*
+	 * Whole cache lines, so with an FW_MEM_ALIGN aligned buffer every
+	 * chunk starts aligned and no two threads write the same line
+	 */
+	range.chunk = (range.chunk + FW_MEM_ALIGN - 1) & ~(size_t)(FW_MEM_ALIGN - 1);
+	if (!range.chunk)
+		range.chunk = FW_MEM_ALIGN;
+	nchunks = (len + range.chunk - 1) / range.chunk;
+
+	*chunk = range.chunk;
+	fw_pool_run(nchunks, fw_pool_range_job, &range);
+
+	return nchunks;
+}
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Minimal worker pool for data-parallel loops
+ */
+
+#ifndef _FW_POOL_H
+#define _FW_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Number of threads fw_pool_run() may use: FWUTILS_THREADS if set,
+ * otherwise the number of CPUs the process is allowed to run on. Under a
+ * parallel make whose jobserver can't be reached this is 1.
+ */
+unsigned int fw_pool_threads(void);
+
+/*
+ * Call fn(arg, idx) for every idx in [0, n) and return once all calls have
+ * finished. Calls may run concurrently and in any order, so fn must only
+ * write to state owned by its own index; merging results is left to the
+ * caller, which keeps reductions in a fixed order.
+ *
+ * Under make's jobserver every thread but the calling one needs a job
+ * token, so the tools never run more jobs than make -jN allows.
+ */
+void fw_pool_run(unsigned int n, void (*fn)(void *arg, unsigned int idx),
+		 void *arg);
+
+/*
+ * Parallel-for over len bytes: the range is cut into at most max_chunks
+ * pieces of at least min_chunk bytes, a few per thread and each a whole
+ * number of FW_MEM_ALIGN cache lines but the last, and fn(arg, idx,
+ * offset, n) is called for each as with fw_pool_run(). Returns the number
+ * of chunks and stores their size in *chunk; chunk idx covers
+ * [idx * *chunk, min(len, (idx + 1) * *chunk)).
+ */
+unsigned int fw_pool_run_range(size_t len, size_t min_chunk,
+			       unsigned int max_chunks, size_t *chunk,
+			       void (*fn)(void *arg, unsigned int idx,
+					  size_t offset, size_t n),
+			       void *arg);
+
+/*
+ * True when FWUTILS_SELFCHECK is set: parallel reductions then also run
+ * serially and abort if the two results differ, so a reproducible build
+ * can turn on threading and still catch a scheduling dependence.
+ */
+bool fw_pool_selfcheck(void);
+
+#endif /* _FW_POOL_H */
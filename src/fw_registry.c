@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Hashed lookup of board and layout tables by name
+ *
+ * The tables stay where the tools define them; the registry only adds an
+ * open-addressed index of pointers into them, sized to a power of two at
+ * least twice the number of entries so probe chains stay short. Names are
+ * hashed with FNV-1a, case folded for the case-insensitive tables.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "fw_registry.h"
+
+static pthread_mutex_t fw_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *entry_name(const struct fw_registry *reg, const void *entry)
+{
+	return *(const char *const *)((const char *)entry + reg->name_offset);
+}
+
+static const void *entry_at(const struct fw_registry *reg, size_t idx)
+{
+	return (const char *)reg->table + idx * reg->entry_size;
+}
+
+static uint32_t name_hash(const char *name, bool nocase)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *name; name++) {
+		unsigned char c = *name;
+
+		h ^= nocase ? tolower(c) : c;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static int name_cmp(const struct fw_registry *reg, const char *a, const char *b)
+{
+	return reg->nocase ? strcasecmp(a, b) : strcmp(a, b);
+}
+
+size_t fw_registry_count(const struct fw_registry *reg)
+{
+	size_t n = 0;
+
+	while (entry_name(reg, entry_at(reg, n)))
+		n++;
+
+	return n;
+}
+
+static const void **fw_registry_build(struct fw_registry *reg)
+{
+	size_t i, n = fw_registry_count(reg), size = 8;
+	const void **slots;
+
+	while (size < 2 * n)
+		size <<= 1;
+
+	slots = calloc(size, sizeof(*slots));
+	if (!slots) {
+		fprintf(stderr, "fw_registry: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+		const void *entry = entry_at(reg, i);
+		const char *name = entry_name(reg, entry);
+		size_t s = name_hash(name, reg->nocase) & (size - 1);
+
+		/* Keep the first of duplicate names, like a linear scan would */
+		while (slots[s] && name_cmp(reg, entry_name(reg, slots[s]), name))
+			s = (s + 1) & (size - 1);
+		if (!slots[s])
+			slots[s] = entry;
+	}
+
+	reg->mask = size - 1;
+
+	return slots;
+}
+
+void *fw_registry_find(struct fw_registry *reg, const char *name)
+{
+	const void **slots;
+	size_t s;
+
+	slots = __atomic_load_n(&reg->slots, __ATOMIC_ACQUIRE);
+	if (!slots) {
+		pthread_mutex_lock(&fw_registry_lock);
+		slots = reg->slots;
+		if (!slots) {
+			slots = fw_registry_build(reg);
+			__atomic_store_n(&reg->slots, slots, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&fw_registry_lock);
+	}
+
+	for (s = name_hash(name, reg->nocase) & reg->mask; slots[s];
+	     s = (s + 1) & reg->mask)
+		if (!name_cmp(reg, entry_name(reg, slots[s]), name))
+			return (void *)slots[s];
+
+	return NULL;
+}
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Hashed lookup of board and layout tables by name
+ */
+
+#ifndef _FW_REGISTRY_H
+#define _FW_REGISTRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A NULL-terminated array of entries that carry their name in a
+ * "const char *" member, like the boards[] and layouts[] tables of the
+ * image tools. The hash index is built on the first lookup, so a registry
+ * costs nothing for tools that never search it.
+ */
+struct fw_registry {
+	const void *table;
+	size_t entry_size;
+	size_t name_offset;
+	bool nocase;
+
+	/* private, filled in by fw_registry_find() */
+	const void **slots;
+	size_t mask;
+};
+
+#define FW_REGISTRY_INIT(_table, _member, _nocase) {			\
+	.table = (_table),						\
+	.entry_size = sizeof((_table)[0]),				\
+	.name_offset = offsetof(__typeof__((_table)[0]), _member),	\
+	.nocase = (_nocase),						\
+}
+
+/*
+ * Return the first entry named name (compared case-insensitively for nocase
+ * registries), or NULL. Safe to call from several threads at once.
+ */
+void *fw_registry_find(struct fw_registry *reg, const char *name);
+
+/* Number of entries before the sentinel */
+size_t fw_registry_count(const struct fw_registry *reg);
+
+#endif /* _FW_REGISTRY_H */
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Multi-pattern magic scanner for locating embedded headers
+ *
+ * Every FW_SCAN_STEP bytes the first and the last byte of each pattern are
+ * compared against two overlapping vector loads, so a candidate needs two
+ * bytes to agree before it is verified with memcmp(). On random data that
+ * leaves one false candidate per 64 KiB and pattern, and a flash dump is
+ * scanned at close to memory bandwidth.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fw_scan.h"
+
+#define FW_SCAN_STEP	16
+
+typedef uint8_t fw_scan_vec __attribute__((vector_size(FW_SCAN_STEP)));
+
+struct fw_scan_ctx {
+	const uint8_t *data;
+	size_t len;
+	const struct fw_scan_pattern *patterns;
+	unsigned int n_patterns;
+	fw_scan_cb cb;
+	void *priv;
+};
+
+/* Verifies every pattern at offset and reports the matches */
+static int fw_scan_check(const struct fw_scan_ctx *ctx, size_t offset)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < ctx->n_patterns; i++) {
+		const struct fw_scan_pattern *p = &ctx->patterns[i];
+
+		if (p->len > ctx->len - offset)
+			continue;
+		if (p->align > 1 && offset % p->align)
+			continue;
+		if (memcmp(ctx->data + offset, p->magic, p->len))
+			continue;
+
+		ret = ctx->cb(ctx->priv, i, offset);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int fw_scan(const void *data, size_t len, const struct fw_scan_pattern *patterns,
+	    unsigned int n_patterns, fw_scan_cb cb, void *priv)
+{
+	struct fw_scan_ctx ctx = {
+		.data = data,
+		.len = len,
+		.patterns = patterns,
+		.n_patterns = n_patterns,
+		.cb = cb,
+		.priv = priv,
+	};
+	fw_scan_vec first[FW_SCAN_MAX_PATTERNS], last[FW_SCAN_MAX_PATTERNS];
+	size_t offset = 0, max_len = 0;
+	unsigned int i;
+	int ret;
+
+	if (!n_patterns || n_patterns > FW_SCAN_MAX_PATTERNS)
+		return -EINVAL;
+
+	for (i = 0; i < n_patterns; i++) {
+		const uint8_t *magic = patterns[i].magic;
+
+		if (!patterns[i].len || patterns[i].len > FW_SCAN_MAX_LEN)
+			return -EINVAL;
+		if (patterns[i].len > max_len)
+			max_len = patterns[i].len;
+
+		memset(&first[i], magic[0], sizeof(first[i]));
+		memset(&last[i], magic[patterns[i].len - 1], sizeof(last[i]));
+	}
+
+	/* Both loads of a step have to stay within the data */
+	for (; len >= FW_SCAN_STEP + max_len - 1 &&
+	       offset <= len - FW_SCAN_STEP - max_len + 1; offset += FW_SCAN_STEP) {
+		fw_scan_vec hit = {};
+		uint64_t mask[2];
+		int word;
+
+		for (i = 0; i < n_patterns; i++) {
+			fw_scan_vec a, b;
+
+			memcpy(&a, ctx.data + offset, sizeof(a));
+			memcpy(&b, ctx.data + offset + patterns[i].len - 1, sizeof(b));
+			hit |= (fw_scan_vec)((a == first[i]) & (b == last[i]));
+		}
+
+		memcpy(mask, &hit, sizeof(mask));
+		if (!(mask[0] | mask[1]))
+			continue;
+
+		/* Lanes are all-ones or zero, find them in memory order */
+		for (word = 0; word < 2; word++) {
+			while (mask[word]) {
+				unsigned int lane;
+
+				if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+					lane = __builtin_ctzll(mask[word]) / 8;
+				else
+					lane = __builtin_clzll(mask[word]) / 8;
+				mask[word] &= ~(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ?
+						0xffULL << (lane * 8) :
+						0xff00000000000000ULL >> (lane * 8));
+
+				ret = fw_scan_check(&ctx, offset + word * 8 + lane);
+				if (ret)
+					return ret;
+			}
+		}
+	}
+
+	for (; offset < len; offset++) {
+		ret = fw_scan_check(&ctx, offset);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
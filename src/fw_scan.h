@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Multi-pattern magic scanner for locating embedded headers
+ */
+
+#ifndef _FW_SCAN_H
+#define _FW_SCAN_H
+
+#include <stddef.h>
+
+#define FW_SCAN_MAX_PATTERNS	8
+
+struct fw_scan_pattern {
+	const void *magic;
+	size_t len;		/* 1 .. FW_SCAN_MAX_LEN */
+	size_t align;		/* match only at multiples of align, 0 for any */
+};
+
+#define FW_SCAN_MAX_LEN		64
+
+/*
+ * Called for each match in offset order, patterns matching at the same
+ * offset in table order. A non-zero return stops the scan.
+ */
+typedef int (*fw_scan_cb)(void *priv, unsigned int pattern, size_t offset);
+
+/*
+ * Scan len bytes of data for up to FW_SCAN_MAX_PATTERNS patterns. Returns
+ * what the callback stopped the scan with, 0 when it ran to the end or
+ * -EINVAL for a bad pattern table.
+ */
+int fw_scan(const void *data, size_t len, const struct fw_scan_pattern *patterns,
+	    unsigned int n_patterns, fw_scan_cb cb, void *priv);
+
+#endif /* _FW_SCAN_H */
@@ -0,0 +1,272 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * End-of-run summary of what a tool did
+ *
+ * This lives outside libfwutils: fwtool links every applet with a private
+ * copy of the fwutils objects it uses, but all of them have to count into
+ * the one set of totals here.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fw_stats.h"
+
+#define FW_STATS_MAX_PHASES	32
+
+bool fw_stats_on;
+
+static struct {
+	const char *name;
+	const char *impl;
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t ns;
+} kernels[FW_STATS_NKERNELS] = {
+	[FW_STATS_CRC16] = { "crc16" },
+	[FW_STATS_CRC32] = { "crc32" },
+	[FW_STATS_CRC32_BE] = { "crc32-be" },
+	[FW_STATS_MD5] = { "md5" },
+	[FW_STATS_MD5_MULTI] = { "md5-multi" },
+	[FW_STATS_SHA1] = { "sha1" },
+};
+
+static struct {
+	const char *name;
+	uint64_t calls;
+	uint64_t bytes;
+	double wall;
+} phases[FW_STATS_MAX_PHASES];
+
+static pthread_mutex_t phases_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int nphases;
+
+static const char *stats_tool;
+static const char *stats_path;
+static double stats_start;
+
+static double fw_stats_clock(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t fw_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void fw_stats_impl(enum fw_stats_kernel k, const char *impl)
+{
+	kernels[k].impl = impl;
+}
+
+void fw_stats_kernel(enum fw_stats_kernel k, uint64_t start, size_t len)
+{
+	uint64_t ns = fw_stats_now() - start;
+
+	__atomic_fetch_add(&kernels[k].calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&kernels[k].bytes, len, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&kernels[k].ns, ns, __ATOMIC_RELAXED);
+}
+
+void fw_stats_phase(const char *phase, double wall, uint64_t bytes)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&phases_lock);
+	for (i = 0; i < nphases; i++)
+		if (!strcmp(phases[i].name, phase))
+			break;
+	if (i == nphases && nphases < FW_STATS_MAX_PHASES)
+		phases[nphases++].name = phase;
+	if (i < nphases) {
+		phases[i].calls++;
+		phases[i].bytes += bytes;
+		phases[i].wall += wall;
+	}
+	pthread_mutex_unlock(&phases_lock);
+}
+
+/* rchar and wchar of /proc/self/io, zero where that isn't available */
+static void fw_stats_io(uint64_t *rchar, uint64_t *wchar)
+{
+	char line[64];
+	FILE *f;
+
+	*rchar = *wchar = 0;
+	f = fopen("/proc/self/io", "re");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "rchar: %" SCNu64, rchar) == 1)
+			continue;
+		sscanf(line, "wchar: %" SCNu64, wchar);
+	}
+	fclose(f);
+}
+
+struct fw_stats_buf {
+	char data[4096];
+	size_t len;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void fw_stats_printf(struct fw_stats_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (b->len >= sizeof(b->data))
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(b->data + b->len, sizeof(b->data) - b->len, fmt, ap);
+	va_end(ap);
+
+	b->len = n < 0 ? sizeof(b->data) : b->len + n;
+}
+
+static void fw_stats_report(void)
+{
+	struct fw_stats_buf b = {};
+	uint64_t rchar, wchar;
+	struct rusage ru;
+	const char *sep;
+	double busy;
+	unsigned int i;
+	int fd;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		memset(&ru, 0, sizeof(ru));
+	fw_stats_io(&rchar, &wchar);
+
+	fw_stats_printf(&b, "{\"tool\":\"%s\",\"pid\":%d,\"wall_s\":%.6f,"
+			"\"cpu_s\":%.6f,\"max_rss_kb\":%ld,\"read_bytes\":%" PRIu64
+			",\"write_bytes\":%" PRIu64 ",\"kernels\":{",
+			stats_tool, (int)getpid(),
+			fw_stats_clock(CLOCK_MONOTONIC) - stats_start,
+			ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+			ru.ru_maxrss, rchar, wchar);
+
+	sep = "";
+	for (i = 0; i < FW_STATS_NKERNELS; i++) {
+		if (!kernels[i].impl)
+			continue;
+		busy = kernels[i].ns / 1e9;
+		fw_stats_printf(&b, "%s\"%s\":{\"impl\":\"%s\",\"calls\":%" PRIu64
+				",\"bytes\":%" PRIu64 ",\"busy_s\":%.6f,\"mb_s\":%.1f}",
+				sep, kernels[i].name, kernels[i].impl,
+				kernels[i].calls, kernels[i].bytes, busy,
+				busy > 0 ? kernels[i].bytes / busy / 1e6 : 0.0);
+		sep = ",";
+	}
+
+	fw_stats_printf(&b, "},\"phases\":{");
+	sep = "";
+	for (i = 0; i < nphases; i++) {
+		fw_stats_printf(&b, "%s\"%s\":{\"calls\":%" PRIu64 ",\"bytes\":%"
+				PRIu64 ",\"wall_s\":%.6f}", sep, phases[i].name,
+				phases[i].calls, phases[i].bytes, phases[i].wall);
+		sep = ",";
+	}
+	fw_stats_printf(&b, "}}\n");
+
+	if (b.len > sizeof(b.data))
+		return;
+
+	if (stats_path)
+		fd = open(stats_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	else
+		fd = STDERR_FILENO;
+	if (fd < 0)
+		return;
+	if (write(fd, b.data, b.len) < 0) {
+		/* Nowhere left to report it */
+	}
+	if (fd != STDERR_FILENO)
+		close(fd);
+}
+
+/* Accepts "json" and "json:<path>" */
+static int fw_stats_format(const char *fmt)
+{
+	if (!strcmp(fmt, "json")) {
+		stats_path = NULL;
+		return 0;
+	}
+	if (!strncmp(fmt, "json:", 5) && fmt[5]) {
+		stats_path = fmt + 5;
+		return 0;
+	}
+
+	fprintf(stderr, "%s: unknown --stats format '%s'\n", stats_tool, fmt);
+
+	return -1;
+}
+
+int fw_stats_setup(int *argc, char **argv)
+{
+	const char *env = getenv("FWUTILS_STATS");
+	bool on = false;
+	int i, n;
+
+	stats_tool = argv[0] ? strrchr(argv[0], '/') : NULL;
+	stats_tool = stats_tool ? stats_tool + 1 : argv[0] ? argv[0] : "?";
+
+	if (env && *env && strcmp(env, "0")) {
+		if (fw_stats_format(env))
+			return -1;
+		on = true;
+	}
+
+	for (i = n = 1; i < *argc; i++) {
+		if (!strcmp(argv[i], "--")) {
+			while (i < *argc)
+				argv[n++] = argv[i++];
+			break;
+		}
+		if (!strcmp(argv[i], "--stats")) {
+			stats_path = NULL;
+			on = true;
+			continue;
+		}
+		if (!strncmp(argv[i], "--stats=", 8)) {
+			if (fw_stats_format(argv[i] + 8))
+				return -1;
+			on = true;
+			continue;
+		}
+		argv[n++] = argv[i];
+	}
+	if (*argc > 0) {
+		*argc = n;
+		argv[n] = NULL;
+	}
+
+	if (on && !fw_stats_on) {
+		stats_start = fw_stats_clock(CLOCK_MONOTONIC);
+		fw_stats_on = true;
+		atexit(fw_stats_report);
+	}
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * End-of-run summary of what a tool did
+ */
+
+#ifndef _FW_STATS_H
+#define _FW_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * With --stats=json (or just --stats) on the command line of any tool, or
+ * FWUTILS_STATS=json in the environment, the tool writes one JSON line to
+ * stderr when it exits:
+ *
+ *   {"tool":"otrx","pid":42,"wall_s":0.031,"cpu_s":0.058,"max_rss_kb":9120,
+ *    "read_bytes":8392704,"write_bytes":8392704,
+ *    "kernels":{"crc32":{"impl":"pclmul","calls":3,"bytes":8388608,
+ *               "busy_s":0.000412,"mb_s":20361.0},...},
+ *    "phases":{"io_copy":{"calls":1,"bytes":8388608,"wall_s":0.011},...}}
+ *
+ * "json:<path>" appends the line to path instead, with one write() so the
+ * tools of a whole build can share the file.
+ *
+ * read_bytes and write_bytes count what went through read- and write-like
+ * system calls, kernel-side copies included (rchar and wchar of
+ * /proc/self/io); mapped input isn't in them. kernels has every checksum
+ * and digest kernel linked into the tool with the implementation its
+ * dispatcher picked; busy_s adds up the time spent in it over all threads,
+ * so mb_s is the throughput of one thread. phases sums up the fw_trace
+ * spans that ran.
+ */
+
+enum fw_stats_kernel {
+	FW_STATS_CRC16,
+	FW_STATS_CRC32,
+	FW_STATS_CRC32_BE,
+	FW_STATS_MD5,
+	FW_STATS_MD5_MULTI,
+	FW_STATS_SHA1,
+	FW_STATS_NKERNELS
+};
+
+/* Set once the summary is on; kernels check it before timing anything */
+extern bool fw_stats_on;
+
+/*
+ * Called with main()'s arguments before the tool sees them: takes every
+ * --stats[=<format>] before a "--" out of argv and turns the summary on
+ * for it or for FWUTILS_STATS. The standalone tools get this through
+ * fw_main.c where the linker has --wrap, fwtool calls it for its applets. Returns 0, or -1 after an
+ * error message about an unknown format.
+ */
+int fw_stats_setup(int *argc, char **argv);
+
+/* For the dispatchers' constructors: the implementation k runs on */
+void fw_stats_impl(enum fw_stats_kernel k, const char *impl);
+
+/* Monotonic nanoseconds, the start argument of fw_stats_kernel() */
+uint64_t fw_stats_now(void);
+
+/* Account one call of kernel k over len bytes that began at start */
+void fw_stats_kernel(enum fw_stats_kernel k, uint64_t start, size_t len);
+
+/* Account one fw_trace span; phase must be a string constant */
+void fw_stats_phase(const char *phase, double wall, uint64_t bytes);
+
+#endif /* _FW_STATS_H */
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Additive checksums: byte sums and 16-bit word sums
+ *
+ * The kernels add 16 bytes at a time into vector lanes that are narrow
+ * enough to stay cheap and are flushed into the wide sum before they can
+ * overflow. Byte sums split every 16-bit lane into its two bytes, word
+ * sums split every 32-bit lane into its two words, byte-swapping them
+ * first when the data's order differs from the host's.
+ *
+ * On x86-64 byte sums use psadbw instead, which adds up eight bytes into a
+ * 64-bit lane in one instruction. It is part of SSE2 and so always there.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define FW_SUM8_SAD
+#endif
+
+#include "fw_sum.h"
+
+#define FW_SUM_STEP	16
+
+typedef uint16_t fw_sum_vec16 __attribute__((vector_size(FW_SUM_STEP)));
+typedef uint32_t fw_sum_vec32 __attribute__((vector_size(FW_SUM_STEP)));
+
+/* Steps before a lane could overflow: 2 * 255 and 2 * 65535 per step */
+#define FW_SUM8_FLUSH	128
+#define FW_SUM16_FLUSH	32768
+
+static uint64_t fw_sum_lanes16(fw_sum_vec16 acc)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < FW_SUM_STEP / sizeof(uint16_t); i++)
+		sum += acc[i];
+
+	return sum;
+}
+
+static uint64_t fw_sum_lanes32(fw_sum_vec32 acc)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < FW_SUM_STEP / sizeof(uint32_t); i++)
+		sum += acc[i];
+
+	return sum;
+}
+
+#ifdef FW_SUM8_SAD
+/* Two accumulators over 32 bytes a step; the lanes can't overflow */
+static uint64_t fw_sum8_sad(const uint8_t *p, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, b = zero;
+
+	for (; len >= 2 * FW_SUM_STEP; len -= 2 * FW_SUM_STEP, p += 2 * FW_SUM_STEP) {
+		a = _mm_add_epi64(a, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)p), zero));
+		b = _mm_add_epi64(b, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p + FW_SUM_STEP)), zero));
+	}
+	if (len >= FW_SUM_STEP)
+		a = _mm_add_epi64(a, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)p), zero));
+
+	a = _mm_add_epi64(a, b);
+	a = _mm_add_epi64(a, _mm_unpackhi_epi64(a, a));
+
+	return _mm_cvtsi128_si64(a);
+}
+#endif
+
+void fw_sum8_update(struct fw_sum *s, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+#ifdef FW_SUM8_SAD
+	s->sum += fw_sum8_sad(p, len);
+	p += len & ~(size_t)(FW_SUM_STEP - 1);
+	len &= FW_SUM_STEP - 1;
+#endif
+
+	while (len >= FW_SUM_STEP) {
+		fw_sum_vec16 acc = {};
+		unsigned int n;
+
+		for (n = 0; n < FW_SUM8_FLUSH && len >= FW_SUM_STEP; n++) {
+			fw_sum_vec16 v;
+
+			memcpy(&v, p, sizeof(v));
+			acc += (v & 0xff) + (v >> 8);
+			p += FW_SUM_STEP;
+			len -= FW_SUM_STEP;
+		}
+
+		s->sum += fw_sum_lanes16(acc);
+	}
+
+	while (len--)
+		s->sum += *p++;
+}
+
+/* Sum of whole words in host order, swapped when the data's order differs */
+static uint64_t fw_sum16_words(const uint8_t *p, size_t words, bool swap)
+{
+	uint64_t sum = 0;
+	uint16_t w;
+
+	while (words >= FW_SUM_STEP / sizeof(uint16_t)) {
+		fw_sum_vec32 acc = {};
+		unsigned int n;
+
+		for (n = 0; n < FW_SUM16_FLUSH && words >= FW_SUM_STEP / sizeof(uint16_t); n++) {
+			fw_sum_vec32 v;
+
+			memcpy(&v, p, sizeof(v));
+			if (swap)
+				v = ((v & 0x00ff00ff) << 8) | ((v >> 8) & 0x00ff00ff);
+			acc += (v & 0xffff) + (v >> 16);
+			p += FW_SUM_STEP;
+			words -= FW_SUM_STEP / sizeof(uint16_t);
+		}
+
+		sum += fw_sum_lanes32(acc);
+	}
+
+	for (; words; words--, p += 2) {
+		memcpy(&w, p, sizeof(w));
+		sum += swap ? (uint16_t)(w << 8 | w >> 8) : w;
+	}
+
+	return sum;
+}
+
+static void fw_sum16_update(struct fw_sum *s, const uint8_t *p, size_t len, bool be)
+{
+	bool swap = be != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+
+	if (!len)
+		return;
+
+	if (s->odd) {
+		s->sum += be ? (s->pending << 8 | p[0]) : (p[0] << 8 | s->pending);
+		s->odd = 0;
+		p++;
+		len--;
+	}
+
+	s->sum += fw_sum16_words(p, len / 2, swap);
+
+	if (len & 1) {
+		s->pending = p[len - 1];
+		s->odd = 1;
+	}
+}
+
+void fw_sum16_le_update(struct fw_sum *s, const void *buf, size_t len)
+{
+	fw_sum16_update(s, buf, len, false);
+}
+
+void fw_sum16_be_update(struct fw_sum *s, const void *buf, size_t len)
+{
+	fw_sum16_update(s, buf, len, true);
+}
+
+uint64_t fw_sum16_le_final(const struct fw_sum *s)
+{
+	return s->sum + (s->odd ? s->pending : 0);
+}
+
+uint64_t fw_sum16_be_final(const struct fw_sum *s)
+{
+	return s->sum + (s->odd ? s->pending << 8 : 0);
+}
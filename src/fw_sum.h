@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Additive checksums: byte sums and 16-bit word sums
+ */
+
+#ifndef _FW_SUM_H
+#define _FW_SUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming state. The sum is kept wide, so callers truncate it to the
+ * width their format uses or fold it into a one's-complement sum at the
+ * end. Word sums treat all updates as one byte stream: a word may start
+ * at the end of one buffer and finish at the start of the next.
+ */
+struct fw_sum {
+	uint64_t sum;
+	uint8_t pending;	/* first byte of a split word */
+	uint8_t odd;		/* pending is valid */
+};
+
+static inline void fw_sum_init(struct fw_sum *s)
+{
+	s->sum = 0;
+	s->pending = 0;
+	s->odd = 0;
+}
+
+/* Sum of all bytes */
+void fw_sum8_update(struct fw_sum *s, const void *buf, size_t len);
+
+/* Sum of little- or big-endian 16-bit words */
+void fw_sum16_le_update(struct fw_sum *s, const void *buf, size_t len);
+void fw_sum16_be_update(struct fw_sum *s, const void *buf, size_t len);
+
+/* Word sum with a split word completed by a zero byte */
+uint64_t fw_sum16_le_final(const struct fw_sum *s);
+uint64_t fw_sum16_be_final(const struct fw_sum *s);
+
+/* Fold a wide word sum into a 16-bit one's-complement sum (end-around carry) */
+static inline uint16_t fw_sum16_fold(uint64_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+#endif /* _FW_SUM_H */
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Per-phase timing for the tools and the shared layers
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fw_stats.h"
+#include "fw_trace.h"
+
+static pthread_once_t fw_trace_once = PTHREAD_ONCE_INIT;
+static int fw_trace_fd = -1;
+
+static void fw_trace_init(void)
+{
+	const char *dest = getenv("FWUTILS_TRACE");
+
+	if (!dest || !*dest || !strcmp(dest, "0"))
+		return;
+
+	if (!strcmp(dest, "1") || !strcmp(dest, "-"))
+		fw_trace_fd = STDERR_FILENO;
+	else
+		fw_trace_fd = open(dest, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+}
+
+bool fw_trace_enabled(void)
+{
+	pthread_once(&fw_trace_once, fw_trace_init);
+
+	return fw_trace_fd >= 0;
+}
+
+static double fw_trace_clock(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fw_trace_begin(struct fw_trace *t, const char *phase)
+{
+	t->on = fw_trace_enabled();
+	t->stats = fw_stats_on;
+	if (!t->on && !t->stats)
+		return;
+
+	t->phase = phase;
+	t->wall = fw_trace_clock(CLOCK_MONOTONIC);
+	if (t->on)
+		t->cpu = fw_trace_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void fw_trace_end(struct fw_trace *t, uint64_t bytes)
+{
+	double wall, cpu;
+	struct rusage ru;
+	char line[256];
+	int len, saved_errno = errno;
+
+	if (!t->on && !t->stats)
+		return;
+
+	wall = fw_trace_clock(CLOCK_MONOTONIC) - t->wall;
+	if (t->stats) {
+		fw_stats_phase(t->phase, wall, bytes);
+		t->stats = false;
+	}
+	if (!t->on)
+		return;
+
+	cpu = fw_trace_clock(CLOCK_PROCESS_CPUTIME_ID) - t->cpu;
+	if (getrusage(RUSAGE_SELF, &ru))
+		ru.ru_maxrss = 0;
+
+	len = snprintf(line, sizeof(line),
+		       "{\"tool\":\"%s\",\"pid\":%d,\"phase\":\"%s\",\"wall_s\":%.6f,"
+		       "\"cpu_s\":%.6f,\"bytes\":%" PRIu64 ",\"max_rss_kb\":%ld}\n",
+		       program_invocation_short_name, (int)getpid(), t->phase,
+		       wall, cpu, bytes, ru.ru_maxrss);
+	if (len > 0 && (size_t)len < sizeof(line) && write(fw_trace_fd, line, len) < 0) {
+		/* Nowhere left to report it */
+	}
+
+	t->on = false;
+	/* Tracing must never change what a caller sees in errno */
+	errno = saved_errno;
+}
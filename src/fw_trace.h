@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Per-phase timing for the tools and the shared layers
+ */
+
+#ifndef _FW_TRACE_H
+#define _FW_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * With FWUTILS_TRACE set, every traced phase appends one JSON line:
+ *
+ *   {"tool":"otrx","pid":42,"phase":"crc32_fd","wall_s":0.012,
+ *    "cpu_s":0.034,"bytes":8388608,"max_rss_kb":9120}
+ *
+ * cpu_s is process CPU time, so it includes the worker pool. The lines go
+ * to stderr for "1" or "-", otherwise they are appended to the file named
+ * by the variable, one write() per line so concurrent tools can share it.
+ * Spans are also summed up for --stats (fw_stats.h). With neither a span
+ * costs a branch on a cached flag.
+ */
+struct fw_trace {
+	const char *phase;
+	double wall;
+	double cpu;
+	bool on;
+	bool stats;
+};
+
+bool fw_trace_enabled(void);
+
+void fw_trace_begin(struct fw_trace *t, const char *phase);
+
+/* bytes is whatever the phase processed, 0 if that means nothing */
+void fw_trace_end(struct fw_trace *t, uint64_t bytes);
+
+#endif /* _FW_TRACE_H */
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Repeating-pattern XOR engine
+ *
+ * The pattern is unrolled once into a stream covering a whole number of
+ * repetitions plus one step of overlap, so every FW_XOR_STEP bytes of data
+ * line up with a contiguous window of the stream and the inner loop is a
+ * plain vector XOR with no per-byte modulo.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fw_xor.h"
+
+typedef uint8_t fw_xor_vec __attribute__((vector_size(16)));
+
+int fw_xor_init(struct fw_xor *x, const void *pattern, size_t len, size_t off)
+{
+	size_t i;
+
+	if (!len)
+		return -EINVAL;
+
+	x->plen = len;
+	x->period = len * ((FW_XOR_STEP + len - 1) / len);
+	x->off = off % len;
+
+	x->stream = malloc(x->period + FW_XOR_STEP);
+	if (!x->stream)
+		return -ENOMEM;
+
+	for (i = 0; i < x->period + FW_XOR_STEP; i++)
+		x->stream[i] = ((const uint8_t *)pattern)[i % len];
+
+	return 0;
+}
+
+void fw_xor_free(struct fw_xor *x)
+{
+	free(x->stream);
+	x->stream = NULL;
+}
+
+static inline void fw_xor_step(uint8_t *d, const uint8_t *k)
+{
+	fw_xor_vec a, b;
+	int i;
+
+	for (i = 0; i < FW_XOR_STEP; i += sizeof(a)) {
+		memcpy(&a, d + i, sizeof(a));
+		memcpy(&b, k + i, sizeof(b));
+		a ^= b;
+		memcpy(d + i, &a, sizeof(a));
+	}
+}
+
+void fw_xor_apply(struct fw_xor *x, void *data, size_t len)
+{
+	uint8_t *d = data;
+	size_t off = x->off;
+
+	for (; len >= FW_XOR_STEP; len -= FW_XOR_STEP, d += FW_XOR_STEP) {
+		fw_xor_step(d, x->stream + off);
+		off += FW_XOR_STEP;
+		if (off >= x->period)
+			off -= x->period;
+	}
+
+	while (len--) {
+		*d++ ^= x->stream[off++];
+		if (off == x->period)
+			off = 0;
+	}
+
+	x->off = off;
+}
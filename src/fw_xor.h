@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Repeating-pattern XOR engine
+ */
+
+#ifndef _FW_XOR_H
+#define _FW_XOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct fw_xor {
+	uint8_t *stream;	/* pattern repeated over period + FW_XOR_STEP */
+	size_t period;		/* multiple of the pattern length, >= FW_XOR_STEP */
+	size_t plen;
+	size_t off;		/* current position within the period */
+};
+
+#define FW_XOR_STEP	64
+
+/*
+ * Prepare to XOR with pattern (len bytes), starting at pattern byte off.
+ * Returns 0 or -ENOMEM.
+ */
+int fw_xor_init(struct fw_xor *x, const void *pattern, size_t len, size_t off);
+void fw_xor_free(struct fw_xor *x);
+
+/* XOR len bytes of data in place and advance the pattern position */
+void fw_xor_apply(struct fw_xor *x, void *data, size_t len);
+
+#endif /* _FW_XOR_H */
@@ -0,0 +1,880 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * fwbench - throughput benchmarks for the shared kernels and image builders
+ *
+ * Micro benchmarks run every checksum and cipher kernel fwutils and the
+ * helper libraries export over a range of buffer sizes and alignments.
+ * Macro benchmarks time complete image builds by running the tools next
+ * to fwbench on synthetic inputs. Results are printed as JSON lines so
+ * they can be collected and compared across releases.
+ *
+ * With -c every accelerated kernel is also checked against its portable
+ * version, and every image is built a second time through the reference
+ * path (FWUTILS_GENERIC=1, FWUTILS_THREADS=1) and must come out byte for
+ * byte the same, as must one more build on an odd thread count with the
+ * worker pool's schedule reversed and FWUTILS_SELFCHECK set. -B compares throughput against an earlier run's output
+ * and fails on regressions beyond -x percent.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC	1
+#endif
+
+#include "bcmalgo.h"
+#include "buffalo-lib.h"
+#include "cyg_crc.h"
+#include "fw_crc16.h"
+#include "fw_crc32.h"
+#include "fw_xor.h"
+#include "md5.h"
+#include "sha1.h"
+
+#define MAX_ALIGN	64
+
+static const size_t micro_sizes[] = { 64, 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+static const size_t micro_aligns[] = { 0, 1, 3 };
+
+static double min_time = 0.2;
+static volatile uint32_t result_sink;
+static bool failed;
+
+/* Throughput of an earlier run, from -B */
+struct baseline {
+	char key[128];
+	double mb_s;
+};
+
+static struct baseline *baselines;
+static size_t n_baselines;
+static double max_regression = 10;
+
+struct micro {
+	const char *name;
+	const char *(*impl)(void);
+	void (*setup)(void);
+	void (*run)(uint8_t *buf, size_t len);
+};
+
+static const char *impl_generic(void)
+{
+	return "generic";
+}
+
+static void run_crc32(uint8_t *buf, size_t len)
+{
+	result_sink = fw_crc32(0xffffffff, buf, len);
+}
+
+static void run_crc16(uint8_t *buf, size_t len)
+{
+	result_sink = fw_crc16(FW_CRC16_CCITT_INIT, buf, len);
+}
+
+static void run_crc16_generic(uint8_t *buf, size_t len)
+{
+	result_sink = fw_crc16_generic(FW_CRC16_CCITT_INIT, buf, len);
+}
+
+static void run_crc32_generic(uint8_t *buf, size_t len)
+{
+	result_sink = fw_crc32_generic(0xffffffff, buf, len);
+}
+
+static void run_crc32_be(uint8_t *buf, size_t len)
+{
+	result_sink = fw_crc32_be(0xffffffff, buf, len);
+}
+
+static void run_crc32_be_generic(uint8_t *buf, size_t len)
+{
+	result_sink = fw_crc32_be_generic(0xffffffff, buf, len);
+}
+
+static void run_crc32_parallel(uint8_t *buf, size_t len)
+{
+	result_sink = fw_crc32_parallel(0xffffffff, buf, len);
+}
+
+static void run_cyg_crc32(uint8_t *buf, size_t len)
+{
+	result_sink = cyg_crc32_accumulate(0, buf, len);
+}
+
+static void run_bcm_crc(uint8_t *buf, size_t len)
+{
+	result_sink = get_buffer_crc((char *)buf, len);
+}
+
+static void run_md5(uint8_t *buf, size_t len)
+{
+	unsigned char digest[16];
+	MD5_CTX ctx;
+
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, buf, len);
+	MD5_Final(digest, &ctx);
+	result_sink = digest[0];
+}
+
+static void run_sha1(uint8_t *buf, size_t len)
+{
+	unsigned char digest[20];
+
+	sha1_csum(buf, len, digest);
+	result_sink = digest[0];
+}
+
+static struct fw_xor xor_ctx;
+
+static void setup_xor(void)
+{
+	static const char pattern[] = "12345678ABCDEFGH";
+
+	fw_xor_free(&xor_ctx);
+	if (fw_xor_init(&xor_ctx, pattern, 16, 0)) {
+		fprintf(stderr, "fwbench: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void run_xor(uint8_t *buf, size_t len)
+{
+	fw_xor_apply(&xor_ctx, buf, len);
+}
+
+static struct bcrypt_ctx bcrypt_ctx;
+
+static void setup_bcrypt(void)
+{
+	static char key[] = "Buffalo";
+
+	bcrypt_finish(&bcrypt_ctx);
+	bcrypt_init(&bcrypt_ctx, key, strlen(key), BCRYPT_DEFAULT_STATE_LEN);
+}
+
+static void run_bcrypt(uint8_t *buf, size_t len)
+{
+	bcrypt_process(&bcrypt_ctx, buf, buf, len);
+}
+
+static const struct micro micros[] = {
+	{ "crc16", fw_crc16_impl, NULL, run_crc16 },
+	{ "crc16", impl_generic, NULL, run_crc16_generic },
+	{ "crc32", fw_crc32_impl, NULL, run_crc32 },
+	{ "crc32", impl_generic, NULL, run_crc32_generic },
+	{ "crc32-be", fw_crc32_impl, NULL, run_crc32_be },
+	{ "crc32-be", impl_generic, NULL, run_crc32_be_generic },
+	{ "crc32-parallel", fw_crc32_impl, NULL, run_crc32_parallel },
+	{ "cyg-crc32", impl_generic, NULL, run_cyg_crc32 },
+	{ "bcm-crc32", fw_crc32_impl, NULL, run_bcm_crc },
+	{ "md5", impl_generic, NULL, run_md5 },
+	{ "sha1", impl_generic, NULL, run_sha1 },
+	{ "xor", impl_generic, setup_xor, run_xor },
+	{ "bcrypt", impl_generic, setup_bcrypt, run_bcrypt },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Deterministic filler, so runs are comparable across machines */
+static void fill(uint8_t *buf, size_t len, uint64_t seed)
+{
+	uint64_t x = seed | 1;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = x >> 24;
+	}
+}
+
+/* Pulls a string or number field out of one of our own JSON lines */
+static bool json_field(const char *line, const char *field, char *buf, size_t size)
+{
+	char pattern[64];
+	const char *p;
+	size_t n;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":", field);
+	p = strstr(line, pattern);
+	if (!p)
+		return false;
+	p += strlen(pattern);
+	if (*p == '"')
+		p++;
+	n = strcspn(p, "\",}");
+	if (n >= size)
+		return false;
+	memcpy(buf, p, n);
+	buf[n] = '\0';
+
+	return true;
+}
+
+static void micro_key(char *key, size_t size, const char *name, const char *impl,
+		      size_t len, size_t align)
+{
+	snprintf(key, size, "micro/%s/%s/%zu/%zu", name, impl, len, align);
+}
+
+static void load_baseline(const char *path)
+{
+	char *line = NULL, type[16], name[48], impl[32], size[24], align[8], mb_s[32];
+	size_t line_len = 0, alloc = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "fwbench: unable to open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while (getline(&line, &line_len, f) >= 0) {
+		struct baseline *b;
+
+		if (!json_field(line, "type", type, sizeof(type)) ||
+		    !json_field(line, "name", name, sizeof(name)) ||
+		    !json_field(line, "mb_s", mb_s, sizeof(mb_s)))
+			continue;
+
+		if (n_baselines == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			baselines = realloc(baselines, alloc * sizeof(*baselines));
+			if (!baselines) {
+				fprintf(stderr, "fwbench: out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		b = &baselines[n_baselines];
+
+		if (!strcmp(type, "micro") &&
+		    json_field(line, "impl", impl, sizeof(impl)) &&
+		    json_field(line, "size", size, sizeof(size)) &&
+		    json_field(line, "align", align, sizeof(align)))
+			micro_key(b->key, sizeof(b->key), name, impl,
+				  strtoul(size, NULL, 10), strtoul(align, NULL, 10));
+		else if (!strcmp(type, "macro"))
+			snprintf(b->key, sizeof(b->key), "macro/%s", name);
+		else
+			continue;
+
+		b->mb_s = strtod(mb_s, NULL);
+		n_baselines++;
+	}
+
+	free(line);
+	fclose(f);
+}
+
+/* Flags a throughput drop against the baseline, if there is one */
+static void check_baseline(const char *key, double mb_s)
+{
+	size_t i;
+
+	for (i = 0; i < n_baselines; i++) {
+		double drop;
+
+		if (strcmp(baselines[i].key, key))
+			continue;
+
+		drop = (1 - mb_s / baselines[i].mb_s) * 100;
+		if (drop > max_regression) {
+			printf("{\"type\":\"regression\",\"key\":\"%s\",\"baseline_mb_s\":%.1f,"
+			       "\"mb_s\":%.1f,\"drop_pct\":%.1f}\n",
+			       key, baselines[i].mb_s, mb_s, drop);
+			failed = true;
+		}
+		return;
+	}
+}
+
+static void run_micro(const struct micro *m, uint8_t *buf, size_t len, size_t align)
+{
+	char key[128];
+	double mb_s;
+	uint64_t iters = 0, batch = 1, c0, c1;
+	double t0, t1;
+
+	if (m->setup)
+		m->setup();
+
+	/* Warm up caches and any lazily initialised tables */
+	m->run(buf + align, len);
+
+	t0 = now();
+	c0 = cycles();
+	do {
+		uint64_t i;
+
+		for (i = 0; i < batch; i++)
+			m->run(buf + align, len);
+		iters += batch;
+		batch *= 2;
+		t1 = now();
+	} while (t1 - t0 < min_time);
+	c1 = cycles();
+
+	mb_s = (double)len * iters / (t1 - t0) / 1e6;
+	printf("{\"type\":\"micro\",\"name\":\"%s\",\"impl\":\"%s\","
+	       "\"size\":%zu,\"align\":%zu,\"iterations\":%ju,\"seconds\":%.6f,"
+	       "\"mb_s\":%.1f",
+	       m->name, m->impl(), len, align, (uintmax_t)iters, t1 - t0, mb_s);
+	if (c1 > c0)
+		printf(",\"cycles_per_byte\":%.3f", (double)(c1 - c0) / ((double)len * iters));
+	printf("}\n");
+	fflush(stdout);
+
+	micro_key(key, sizeof(key), m->name, m->impl(), len, align);
+	check_baseline(key, mb_s);
+}
+
+/* Accelerated kernels and the portable ones they must agree with */
+struct micro_check {
+	const char *name;
+	uint32_t (*fast)(uint32_t crc, const void *buf, size_t len);
+	uint32_t (*ref)(uint32_t crc, const void *buf, size_t len);
+};
+
+static const struct micro_check micro_checks[] = {
+	{ "crc32", fw_crc32, fw_crc32_generic },
+	{ "crc32-be", fw_crc32_be, fw_crc32_be_generic },
+	{ "crc32-parallel", fw_crc32_parallel, fw_crc32_generic },
+};
+
+static void check_micro(const struct micro_check *c, const uint8_t *buf, size_t max)
+{
+	size_t len, align, bad = 0, checked = 0;
+
+	/* Every short length catches tail handling, the big ones the folding */
+	for (align = 0; align < 16; align++)
+		for (len = 0; len <= 1024 && len + align <= max; len++, checked++)
+			if (c->fast(0xffffffff, buf + align, len) !=
+			    c->ref(0xffffffff, buf + align, len))
+				bad++;
+	for (len = 4096; len + 3 <= max; len *= 4, checked += 2) {
+		if (c->fast(0, buf, len) != c->ref(0, buf, len))
+			bad++;
+		if (c->fast(0x12345678, buf + 3, len - 1) != c->ref(0x12345678, buf + 3, len - 1))
+			bad++;
+	}
+
+	printf("{\"type\":\"check\",\"name\":\"%s\",\"impl\":\"%s\","
+	       "\"cases\":%zu,\"ok\":%s}\n",
+	       c->name, fw_crc32_impl(), checked, bad ? "false" : "true");
+	fflush(stdout);
+	if (bad)
+		failed = true;
+}
+
+static void micro_benchmarks(const char *filter, bool check)
+{
+	size_t max = micro_sizes[sizeof(micro_sizes) / sizeof(micro_sizes[0]) - 1];
+	size_t i, j, k;
+	uint8_t *buf;
+
+	buf = aligned_alloc(MAX_ALIGN, max + MAX_ALIGN);
+	if (!buf) {
+		fprintf(stderr, "fwbench: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	fill(buf, max + MAX_ALIGN, 1);
+
+	for (i = 0; check && i < sizeof(micro_checks) / sizeof(micro_checks[0]); i++)
+		if (!filter || strstr(micro_checks[i].name, filter))
+			check_micro(&micro_checks[i], buf, max + MAX_ALIGN);
+
+	for (i = 0; i < sizeof(micros) / sizeof(micros[0]); i++) {
+		if (filter && !strstr(micros[i].name, filter))
+			continue;
+		for (j = 0; j < sizeof(micro_sizes) / sizeof(micro_sizes[0]); j++)
+			for (k = 0; k < sizeof(micro_aligns) / sizeof(micro_aligns[0]); k++)
+				run_micro(&micros[i], buf, micro_sizes[j], micro_aligns[k]);
+	}
+
+	free(buf);
+}
+
+/*
+ * Macro benchmarks. Arguments may refer to the synthetic inputs and
+ * outputs as @KERNEL@, @ROOTFS@ (size split 1:3), @SLKERNEL@, @SLROOTFS@
+ * (fixed sizes that fit a 16 MB TP-Link layout) and @OUT@.
+ */
+#define MACRO_MAX_ARGS	24
+
+struct macro {
+	const char *name;
+	const char *tool;
+	const char *args[MACRO_MAX_ARGS];
+	const char *suffix;	/* appended to @OUT@ by the tool */
+};
+
+static const struct macro macros[] = {
+	{ "otrx-create", "otrx",
+	  { "create", "@OUT@", "-f", "@KERNEL@", "-a", "0x10000", "-f", "@ROOTFS@" } },
+	{ "seama", "seama", { "-i", "@OUT@", "-m", "dev=bench" }, ".seama" },
+	{ "imagetag", "imagetag",
+	  { "-i", "@KERNEL@", "-f", "@ROOTFS@", "-o", "@OUT@", "-b", "96345GW2",
+	    "-c", "6345", "-l", "0x80010000", "-e", "0x80010000" } },
+	{ "tplink-safeloader", "tplink-safeloader",
+	  { "-B", "DECO-M4R-V4", "-k", "@SLKERNEL@", "-r", "@SLROOTFS@", "-o", "@OUT@" } },
+	{ "pc1crypt", "pc1crypt", { "-i", "@ROOTFS@", "-o", "@OUT@" } },
+	{ "nand_ecc", "nand_ecc", { "@ROOTFS@", "@OUT@" } },
+	{ "nand_ecc-bch", "nand_ecc", { "-b", "8", "@ROOTFS@", "@OUT@" } },
+	{ "zytrx", "zytrx", { "-B", "NR7101", "-v", "bench", "-i", "@ROOTFS@", "-o", "@OUT@" } },
+	{ "buffalo-enc", "buffalo-enc",
+	  { "-i", "@ROOTFS@", "-o", "@OUT@", "-p", "BENCH", "-v", "1.00" } },
+};
+
+#define SL_KERNEL_SIZE	(2 * 1024 * 1024)
+#define SL_ROOTFS_SIZE	(10 * 1024 * 1024)
+
+struct macro_env {
+	char dir[PATH_MAX - 16];	/* leaves room for the file names */
+	char kernel[PATH_MAX];
+	char rootfs[PATH_MAX];
+	char sl_kernel[PATH_MAX];
+	char sl_rootfs[PATH_MAX];
+	char out[PATH_MAX];
+	char ref[PATH_MAX];
+	size_t kernel_size, rootfs_size;
+};
+
+static void write_input(const char *path, size_t len, uint64_t seed)
+{
+	size_t chunk = 1024 * 1024;
+	uint8_t *buf;
+	FILE *f;
+
+	buf = malloc(chunk);
+	f = fopen(path, "wb");
+	if (!buf || !f) {
+		fprintf(stderr, "fwbench: unable to create %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while (len) {
+		size_t n = len < chunk ? len : chunk;
+
+		fill(buf, n, seed++);
+		if (fwrite(buf, 1, n, f) != n) {
+			fprintf(stderr, "fwbench: unable to write %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		len -= n;
+	}
+
+	fclose(f);
+	free(buf);
+}
+
+static const char *macro_arg(const struct macro_env *env, const char *arg)
+{
+	if (!strcmp(arg, "@KERNEL@"))
+		return env->kernel;
+	if (!strcmp(arg, "@ROOTFS@"))
+		return env->rootfs;
+	if (!strcmp(arg, "@SLKERNEL@"))
+		return env->sl_kernel;
+	if (!strcmp(arg, "@SLROOTFS@"))
+		return env->sl_rootfs;
+	if (!strcmp(arg, "@OUT@"))
+		return env->out;
+
+	return arg;
+}
+
+static size_t macro_input_bytes(const struct macro *m, const struct macro_env *env)
+{
+	size_t i, bytes = 0;
+
+	for (i = 0; m->args[i]; i++) {
+		if (!strcmp(m->args[i], "@KERNEL@"))
+			bytes += env->kernel_size;
+		else if (!strcmp(m->args[i], "@ROOTFS@"))
+			bytes += env->rootfs_size;
+		else if (!strcmp(m->args[i], "@SLKERNEL@"))
+			bytes += SL_KERNEL_SIZE;
+		else if (!strcmp(m->args[i], "@SLROOTFS@"))
+			bytes += SL_ROOTFS_SIZE;
+	}
+
+	/* seama packs the file it's given */
+	if (!bytes)
+		bytes = env->kernel_size;
+
+	return bytes;
+}
+
+/* Runs the tool once, returns its wall time or a negative value on failure */
+static double macro_once(const char *tool, const struct macro *m,
+			 const struct macro_env *env, char **envp, double *cpu)
+{
+	posix_spawn_file_actions_t fa;
+	char *argv[MACRO_MAX_ARGS + 2];
+	struct rusage ru;
+	double t0, t1;
+	int status, i;
+	pid_t pid;
+
+	/* seama writes next to its input, so give it a fresh copy each time */
+	if (!strcmp(m->tool, "seama"))
+		write_input(env->out, env->kernel_size, 1);
+
+	argv[0] = (char *)m->tool;
+	for (i = 0; m->args[i]; i++)
+		argv[i + 1] = (char *)macro_arg(env, m->args[i]);
+	argv[i + 1] = NULL;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+	t0 = now();
+	if (posix_spawn(&pid, tool, &fa, NULL, argv, envp)) {
+		posix_spawn_file_actions_destroy(&fa);
+		return -1;
+	}
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (wait4(pid, &status, 0, &ru) < 0)
+		return -1;
+	t1 = now();
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+
+	*cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+	return t1 - t0;
+}
+
+static const char *const reference_vars[] = {
+	"FWUTILS_GENERIC=1", "FWUTILS_THREADS=1", NULL
+};
+
+/* Same output as the reference whatever the thread count and schedule */
+static const char *const scrambled_vars[] = {
+	"FWUTILS_THREADS=3", "FWUTILS_SCHED=reverse", "FWUTILS_SELFCHECK=1", NULL
+};
+
+/* environ with vars taking the place of any earlier values */
+static char **override_environ(const char *const *vars)
+{
+	size_t i, k, n, nvars, j = 0;
+	char **envp;
+
+	for (n = 0; environ[n]; n++)
+		;
+	for (nvars = 0; vars[nvars]; nvars++)
+		;
+
+	envp = calloc(n + nvars + 1, sizeof(*envp));
+	if (!envp) {
+		fprintf(stderr, "fwbench: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < nvars; k++)
+			if (!strncmp(environ[i], vars[k], strchr(vars[k], '=') - vars[k] + 1))
+				break;
+		if (k == nvars)
+			envp[j++] = environ[i];
+	}
+	for (k = 0; k < nvars; k++)
+		envp[j++] = (char *)vars[k];
+
+	return envp;
+}
+
+static bool same_file(const char *a, const char *b)
+{
+	uint8_t ba[65536], bb[65536];
+	FILE *fa, *fb;
+	bool same = false;
+	size_t na, nb;
+
+	fa = fopen(a, "rb");
+	fb = fopen(b, "rb");
+	if (!fa || !fb)
+		goto out;
+
+	do {
+		na = fread(ba, 1, sizeof(ba), fa);
+		nb = fread(bb, 1, sizeof(bb), fb);
+		if (na != nb || memcmp(ba, bb, na))
+			goto out;
+	} while (na);
+
+	same = true;
+out:
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+
+	return same;
+}
+
+/* Builds the image through the reference path and keeps it in env->ref */
+static bool macro_reference(const char *tool, const struct macro *m,
+			    const struct macro_env *env, double *wall)
+{
+	char out[PATH_MAX];
+	char **envp;
+	double cpu;
+
+	envp = override_environ(reference_vars);
+	*wall = macro_once(tool, m, env, envp, &cpu);
+	free(envp);
+	if (*wall < 0)
+		return false;
+
+	snprintf(out, sizeof(out), "%s%s", env->out, m->suffix ? m->suffix : "");
+
+	return !rename(out, env->ref);
+}
+
+static void run_macro(const struct macro *m, const char *tool_dir,
+		      const struct macro_env *env, int runs, bool check)
+{
+	double best = -1, best_cpu = 0, ref_wall = 0;
+	char tool[PATH_MAX], out[PATH_MAX], key[128];
+	size_t bytes;
+	int i;
+
+	snprintf(tool, sizeof(tool), "%s/%s", tool_dir, m->tool);
+	if (access(tool, X_OK)) {
+		fprintf(stderr, "fwbench: %s not found, skipping %s\n", tool, m->name);
+		return;
+	}
+
+	if (check && !macro_reference(tool, m, env, &ref_wall)) {
+		fprintf(stderr, "fwbench: %s failed in the reference path\n", m->name);
+		failed = true;
+		return;
+	}
+
+	/* Best of several runs, the others only suffer from noise */
+	for (i = 0; i < runs; i++) {
+		double cpu, wall = macro_once(tool, m, env, environ, &cpu);
+
+		if (wall < 0) {
+			fprintf(stderr, "fwbench: %s failed\n", m->name);
+			failed = true;
+			return;
+		}
+		if (best < 0 || wall < best) {
+			best = wall;
+			best_cpu = cpu;
+		}
+	}
+
+	bytes = macro_input_bytes(m, env);
+	printf("{\"type\":\"macro\",\"name\":\"%s\",\"input_bytes\":%zu,\"runs\":%d,"
+	       "\"wall_s\":%.6f,\"cpu_s\":%.6f,\"mb_s\":%.1f}\n",
+	       m->name, bytes, runs, best, best_cpu, bytes / best / 1e6);
+
+	if (check) {
+		bool same, sched_same;
+		char **envp;
+		double cpu;
+
+		snprintf(out, sizeof(out), "%s%s", env->out, m->suffix ? m->suffix : "");
+		same = same_file(out, env->ref);
+
+		envp = override_environ(scrambled_vars);
+		sched_same = macro_once(tool, m, env, envp, &cpu) >= 0 &&
+			     same_file(out, env->ref);
+		free(envp);
+
+		printf("{\"type\":\"check\",\"name\":\"%s\",\"reference_wall_s\":%.6f,"
+		       "\"wall_s\":%.6f,\"ok\":%s,\"sched_ok\":%s}\n",
+		       m->name, ref_wall, best, same ? "true" : "false",
+		       sched_same ? "true" : "false");
+		if (!same || !sched_same)
+			failed = true;
+		unlink(env->ref);
+	}
+	fflush(stdout);
+
+	snprintf(key, sizeof(key), "macro/%s", m->name);
+	check_baseline(key, bytes / best / 1e6);
+}
+
+static void macro_benchmarks(const char *filter, const char *tool_dir,
+			     size_t size, int runs, bool check)
+{
+	const char *tmp = getenv("TMPDIR");
+	struct macro_env env = {};
+	size_t i;
+
+	snprintf(env.dir, sizeof(env.dir), "%s/fwbench.XXXXXX", tmp ? tmp : "/tmp");
+	if (!mkdtemp(env.dir)) {
+		fprintf(stderr, "fwbench: unable to create %s: %s\n", env.dir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(env.kernel, sizeof(env.kernel), "%s/kernel", env.dir);
+	snprintf(env.rootfs, sizeof(env.rootfs), "%s/rootfs", env.dir);
+	snprintf(env.sl_kernel, sizeof(env.sl_kernel), "%s/sl-kernel", env.dir);
+	snprintf(env.sl_rootfs, sizeof(env.sl_rootfs), "%s/sl-rootfs", env.dir);
+	snprintf(env.out, sizeof(env.out), "%s/out", env.dir);
+	snprintf(env.ref, sizeof(env.ref), "%s/ref", env.dir);
+
+	/* Keep embedded build dates out of the comparison */
+	setenv("SOURCE_DATE_EPOCH", "0", 0);
+
+	env.kernel_size = size / 4;
+	env.rootfs_size = size - env.kernel_size;
+	write_input(env.kernel, env.kernel_size, 1);
+	write_input(env.rootfs, env.rootfs_size, 2);
+	write_input(env.sl_kernel, SL_KERNEL_SIZE, 3);
+	write_input(env.sl_rootfs, SL_ROOTFS_SIZE, 4);
+
+	for (i = 0; i < sizeof(macros) / sizeof(macros[0]); i++) {
+		if (filter && !strstr(macros[i].name, filter))
+			continue;
+		run_macro(&macros[i], tool_dir, &env, runs, check);
+		unlink(env.out);
+	}
+
+	unlink(env.kernel);
+	unlink(env.rootfs);
+	unlink(env.sl_kernel);
+	unlink(env.sl_rootfs);
+	strcat(env.out, ".seama");
+	unlink(env.out);
+	rmdir(env.dir);
+}
+
+static void usage(FILE *out)
+{
+	fprintf(out,
+		"Usage: fwbench [OPTIONS...]\n"
+		"\n"
+		"Options:\n"
+		"  -m              run the kernel micro benchmarks only\n"
+		"  -M              run the image build macro benchmarks only\n"
+		"  -f <name>       only run benchmarks whose name contains <name>\n"
+		"  -t <ms>         minimum time per micro measurement (default: 200)\n"
+		"  -s <MB>         macro benchmark input size, 8 to 256 (default: 64)\n"
+		"  -r <runs>       macro benchmark runs, the best is reported (default: 3)\n"
+		"  -T <dir>        directory of the tools (default: next to fwbench)\n"
+		"  -c              check fast paths against the reference path\n"
+		"  -B <file>       fail on throughput regressions against an earlier run\n"
+		"  -x <percent>    tolerated regression for -B (default: 10)\n"
+		"  -h              show this help\n");
+}
+
+int main(int argc, char **argv)
+{
+	bool micro = true, macro = true, check = false;
+	char tool_dir[PATH_MAX] = ".";
+	const char *filter = NULL;
+	unsigned long size = 64;
+	int runs = 3, c;
+	ssize_t n;
+
+	n = readlink("/proc/self/exe", tool_dir, sizeof(tool_dir) - 1);
+	if (n > 0) {
+		char *dir;
+
+		tool_dir[n] = '\0';
+		dir = dirname(tool_dir);
+		memmove(tool_dir, dir, strlen(dir) + 1);
+	}
+
+	while ((c = getopt(argc, argv, "mMf:t:s:r:T:cB:x:h")) != -1) {
+		switch (c) {
+		case 'm':
+			macro = false;
+			break;
+		case 'M':
+			micro = false;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 't':
+			min_time = strtoul(optarg, NULL, 0) / 1000.0;
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			if (size < 8 || size > 256) {
+				fprintf(stderr, "fwbench: size must be between 8 and 256 MB\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			if (runs < 1)
+				runs = 1;
+			break;
+		case 'T':
+			snprintf(tool_dir, sizeof(tool_dir), "%s", optarg);
+			break;
+		case 'c':
+			check = true;
+			break;
+		case 'B':
+			load_baseline(optarg);
+			break;
+		case 'x':
+			max_regression = strtod(optarg, NULL);
+			break;
+		case 'h':
+			usage(stdout);
+			return EXIT_SUCCESS;
+		default:
+			usage(stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (micro)
+		micro_benchmarks(filter, check);
+	if (macro)
+		macro_benchmarks(filter, tool_dir, size * 1024 * 1024, runs, check);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,591 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * fwtool identify - tell which container format a file uses
+ *
+ * Every file is mapped once and its start is matched against the headers
+ * of the formats the tools can take apart. A match is only described once
+ * the format's own checksums have been run over the mapping, so a file
+ * that merely starts with the right magic shows which check failed.
+ * Directories are walked and their files identified in parallel.
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_scan.h"
+#include "fwtool.h"
+#include "md5.h"
+
+struct identify_file {
+	const uint8_t *data;
+	size_t len;
+	bool threads;		/* the only file, so its CRCs may use the pool */
+};
+
+static uint32_t identify_crc32(const struct identify_file *f, uint32_t crc,
+			       const void *buf, size_t len)
+{
+	return f->threads ? fw_crc32_parallel(crc, buf, len) : fw_crc32(crc, buf, len);
+}
+
+static const char *identify_ok(bool ok)
+{
+	return ok ? "ok" : "BAD";
+}
+
+static bool identify_md5(const void *buf, size_t len, const uint8_t *expected,
+			 const uint8_t *salt, size_t salt_len)
+{
+	uint8_t digest[16];
+	MD5_CTX ctx;
+
+	MD5_Init(&ctx);
+	if (salt)
+		MD5_Update(&ctx, salt, salt_len);
+	MD5_Update(&ctx, buf, len);
+	MD5_Final(digest, &ctx);
+
+	return !memcmp(digest, expected, sizeof(digest));
+}
+
+/**************************************************
+ * TRX (otrx, trx)
+ **************************************************/
+
+struct trx_header {
+	uint32_t magic;
+	uint32_t length;
+	uint32_t crc32;
+	uint16_t flags;
+	uint16_t version;
+	uint32_t offset[3];
+};
+
+static bool identify_trx(const struct identify_file *f, FILE *out)
+{
+	const struct trx_header *hdr = (const void *)f->data;
+	uint32_t length, crc;
+	int i, parts = 0;
+
+	if (f->len < sizeof(*hdr))
+		return false;
+
+	length = le32toh(hdr->length);
+	for (i = 0; i < 3; i++)
+		if (hdr->offset[i])
+			parts++;
+
+	fprintf(out, "TRX v%u, %d partitions, %u B", le16toh(hdr->version), parts, length);
+	if (length < sizeof(*hdr) || length > f->len) {
+		fprintf(out, ", truncated (%zu B in file)\n", f->len);
+		return true;
+	}
+
+	crc = identify_crc32(f, 0xffffffff, f->data + 12, length - 12);
+	fprintf(out, ", CRC32 %s\n", identify_ok(crc == le32toh(hdr->crc32)));
+
+	return true;
+}
+
+/**************************************************
+ * Seama (oseama, seama)
+ **************************************************/
+
+struct seama_seal_header {
+	uint32_t magic;
+	uint16_t reserved;
+	uint16_t metasize;
+	uint32_t imagesize;
+} __attribute__ ((packed));
+
+struct seama_entity_header {
+	uint32_t magic;
+	uint16_t reserved;
+	uint16_t metasize;
+	uint32_t imagesize;
+	uint8_t md5[16];
+} __attribute__ ((packed));
+
+#define SEAMA_MAGIC	0x5ea3a417
+
+/* Checks the entity at pos and returns where the next one starts, 0 if bad */
+static size_t identify_seama_entity(const struct identify_file *f, size_t pos, bool *md5_ok)
+{
+	const struct seama_entity_header *hdr = (const void *)(f->data + pos);
+	size_t metasize, imagesize;
+
+	if (f->len - pos < sizeof(*hdr) || be32toh(hdr->magic) != SEAMA_MAGIC)
+		return 0;
+
+	metasize = be16toh(hdr->metasize);
+	imagesize = be32toh(hdr->imagesize);
+	if (f->len - pos - sizeof(*hdr) < metasize + imagesize)
+		return 0;
+
+	*md5_ok = identify_md5(f->data + pos + sizeof(*hdr) + metasize, imagesize, hdr->md5, NULL, 0);
+
+	return pos + sizeof(*hdr) + metasize + imagesize;
+}
+
+static bool identify_seama(const struct identify_file *f, FILE *out)
+{
+	const struct seama_seal_header *seal = (const void *)f->data;
+	size_t pos, next;
+	bool ok, all_ok = true;
+	int n = 0;
+
+	if (f->len < sizeof(*seal))
+		return false;
+
+	/* A seal has no image of its own, an entity always has */
+	if (seal->imagesize) {
+		fprintf(out, "Seama entity");
+		if (!identify_seama_entity(f, 0, &ok)) {
+			fprintf(out, ", truncated\n");
+			return true;
+		}
+		fprintf(out, ", %u B image, MD5 %s\n", be32toh(seal->imagesize), identify_ok(ok));
+		return true;
+	}
+
+	pos = sizeof(*seal) + be16toh(seal->metasize);
+	while (pos < f->len && (next = identify_seama_entity(f, pos, &ok))) {
+		all_ok &= ok;
+		pos = next;
+		n++;
+	}
+
+	fprintf(out, "Seama seal, %d entities", n);
+	if (pos < f->len)
+		fprintf(out, ", %zu B of trailing data", f->len - pos);
+	if (n)
+		fprintf(out, ", MD5 %s", identify_ok(all_ok));
+	fprintf(out, "\n");
+
+	return true;
+}
+
+/**************************************************
+ * Luxul (lxlfw)
+ **************************************************/
+
+struct lxl_hdr {
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	hdr_len;
+	uint32_t	flags;
+	char		board[16];
+	uint8_t		release[4];
+	uint32_t	blobs_offset;
+	uint32_t	blobs_len;
+} __attribute__((packed));
+
+struct lxl_blob {
+	char		magic[2];
+	uint16_t	type;
+	uint32_t	len;
+} __attribute__((packed));
+
+static bool identify_lxl(const struct identify_file *f, FILE *out)
+{
+	const struct lxl_hdr *hdr = (const void *)f->data;
+	uint32_t version, hdr_len;
+
+	if (f->len < 12)
+		return false;
+
+	version = le32toh(hdr->version);
+	hdr_len = le32toh(hdr->hdr_len);
+
+	fprintf(out, "Luxul firmware v%u, %u B header", version, hdr_len);
+	if (hdr_len > f->len || (version >= 1 && f->len < 12 + 4 + 16)) {
+		fprintf(out, ", truncated (%zu B in file)\n", f->len);
+		return true;
+	}
+	if (version >= 1)
+		fprintf(out, ", board \"%.*s\"", (int)strnlen(hdr->board, sizeof(hdr->board)), hdr->board);
+	if (version >= 3 && hdr_len >= sizeof(*hdr) && hdr->blobs_offset) {
+		size_t pos = le32toh(hdr->blobs_offset);
+		size_t end = pos + le32toh(hdr->blobs_len);
+		int n = 0;
+
+		while (end <= hdr_len && pos + sizeof(struct lxl_blob) <= end) {
+			const struct lxl_blob *blob = (const void *)(f->data + pos);
+
+			pos += sizeof(*blob) + le32toh(blob->len);
+			n++;
+		}
+		fprintf(out, ", %d blobs", n);
+	}
+	fprintf(out, ", %zu B image, no checksum\n", f->len - hdr_len);
+
+	return true;
+}
+
+/**************************************************
+ * Xiaomi (xiaomifw)
+ **************************************************/
+
+struct xiaomi_header {
+	char magic[4];
+	uint32_t signature_offset;
+	uint32_t crc32;
+	uint16_t unused;
+	uint16_t device_id;
+	uint32_t blob_offsets[8];
+};
+
+static bool identify_xiaomi(const struct identify_file *f, FILE *out)
+{
+	const struct xiaomi_header *hdr = (const void *)f->data;
+	uint32_t crc;
+	int i;
+
+	if (f->len < sizeof(*hdr))
+		return false;
+
+	for (i = 0; i < 8 && hdr->blob_offsets[i]; i++)
+		;
+
+	crc = identify_crc32(f, 0xffffffff, f->data + 12, f->len - 12);
+	fprintf(out, "Xiaomi firmware, device 0x%04x, %d blobs, CRC32 %s\n",
+		le16toh(hdr->device_id), i, identify_ok(crc == le32toh(hdr->crc32)));
+
+	return true;
+}
+
+/**************************************************
+ * Broadcom BLOB (bcmblob)
+ **************************************************/
+
+struct bcmblob_entry {
+	uint32_t unk0;
+	uint32_t offset;
+	uint32_t size;
+	uint32_t crc32;
+	uint32_t unk1;
+};
+
+struct bcmblob_header {
+	char magic[4];
+	uint32_t hdr_len;
+	uint32_t crc32;
+	uint32_t unk0;
+	uint32_t unk1;
+	struct bcmblob_entry entries[2];
+};
+
+static bool identify_bcmblob(const struct identify_file *f, FILE *out)
+{
+	const struct bcmblob_header *hdr = (const void *)f->data;
+	bool ok;
+	int i;
+
+	if (f->len < sizeof(*hdr))
+		return false;
+
+	ok = (identify_crc32(f, 0xffffffff, f->data + 12, sizeof(*hdr) - 12) ^ ~0U) == le32toh(hdr->crc32);
+
+	for (i = 0; i < 2; i++) {
+		size_t offset = le32toh(hdr->entries[i].offset);
+		size_t size = le32toh(hdr->entries[i].size);
+
+		if (offset > f->len || size > f->len - offset) {
+			fprintf(out, "Broadcom BLOB, entry %d truncated\n", i);
+			return true;
+		}
+		ok &= (identify_crc32(f, 0xffffffff, f->data + offset, size) ^ ~0U) ==
+		      le32toh(hdr->entries[i].crc32);
+	}
+
+	fprintf(out, "Broadcom BLOB, 2 entries, CRC32 %s\n", identify_ok(ok));
+
+	return true;
+}
+
+/**************************************************
+ * TP-Link safeloader (tplink-safeloader)
+ **************************************************/
+
+#define SAFELOADER_PREAMBLE_SIZE	0x14
+#define SAFELOADER_PAYLOAD_OFFSET	0x1014
+#define SAFELOADER_QNEW_PAYLOAD_OFFSET	0x1050
+#define SAFELOADER_PAYLOAD_TABLE_SIZE	0x800
+
+static const uint8_t safeloader_md5_salt[16] = {
+	0x7a, 0x2b, 0x15, 0xed,
+	0x9b, 0x98, 0x59, 0x6d,
+	0xe5, 0x04, 0xab, 0x44,
+	0xac, 0x2a, 0x9f, 0x4e,
+};
+
+static int identify_safeloader_parts(const struct identify_file *f, size_t offset)
+{
+	const char *table = (const char *)f->data + offset;
+	size_t len = SAFELOADER_PAYLOAD_TABLE_SIZE;
+	const char *p = table;
+	int n = 0;
+
+	while ((p = memmem(p, len - (p - table), "fwup-ptn ", 9))) {
+		p += 9;
+		n++;
+	}
+
+	return n;
+}
+
+static bool identify_safeloader(const struct identify_file *f, FILE *out)
+{
+	size_t size;
+
+	if (f->len < SAFELOADER_QNEW_PAYLOAD_OFFSET + SAFELOADER_PAYLOAD_TABLE_SIZE)
+		return false;
+
+	if (!memcmp(f->data + SAFELOADER_PAYLOAD_OFFSET, "fwup-ptn ", 9)) {
+		fprintf(out, "TP-Link safeloader factory image, %d partitions",
+			identify_safeloader_parts(f, SAFELOADER_PAYLOAD_OFFSET));
+
+		size = be32toh(*(const uint32_t *)f->data);
+		if (size < SAFELOADER_PREAMBLE_SIZE || size > f->len) {
+			fprintf(out, ", truncated (%zu B in file)\n", f->len);
+			return true;
+		}
+
+		fprintf(out, ", MD5 %s\n",
+			identify_ok(identify_md5(f->data + SAFELOADER_PREAMBLE_SIZE,
+						 size - SAFELOADER_PREAMBLE_SIZE, f->data + 4,
+						 safeloader_md5_salt, sizeof(safeloader_md5_salt))));
+		return true;
+	}
+
+	if (!memcmp(f->data + SAFELOADER_PREAMBLE_SIZE, "?NEW", 4) &&
+	    !memcmp(f->data + SAFELOADER_QNEW_PAYLOAD_OFFSET, "fwup-ptn ", 9)) {
+		fprintf(out, "TP-Link safeloader factory image (?NEW), %d partitions, MD5 not checked\n",
+			identify_safeloader_parts(f, SAFELOADER_QNEW_PAYLOAD_OFFSET));
+		return true;
+	}
+
+	return false;
+}
+
+/**************************************************
+ * Broadcom CLM (bcmclm)
+ **************************************************/
+
+struct bcmclm_header {
+	char magic[8];
+	uint32_t unk0;
+	uint8_t unk1[2];
+	char api[20];
+	char compiler[10];
+	uint32_t virtual_header_address;
+	uint32_t lookup_table_address;
+	char clm_import_ver[30];
+	char manufacturer[22];
+};
+
+struct identify_bcmclm_scan {
+	const struct identify_file *f;
+	size_t offset;
+};
+
+static int identify_bcmclm_match(void *priv, unsigned int pattern, size_t offset)
+{
+	struct identify_bcmclm_scan *scan = priv;
+	const struct bcmclm_header *hdr = (const void *)(scan->f->data + offset);
+
+	if (offset + sizeof(*hdr) > scan->f->len || le32toh(hdr->unk0) & 0xff00ffff)
+		return 0;
+
+	scan->offset = offset;
+
+	return 1;
+}
+
+/* CLM data is usually embedded somewhere in a Wi-Fi firmware blob */
+static bool identify_bcmclm(const struct identify_file *f, FILE *out)
+{
+	static const struct fw_scan_pattern clm_pattern = {
+		.magic = "CLM DATA",
+		.len = 8,
+		.align = 4,
+	};
+	struct identify_bcmclm_scan scan = {
+		.f = f,
+	};
+	const struct bcmclm_header *hdr;
+
+	if (fw_scan(f->data, f->len, &clm_pattern, 1, identify_bcmclm_match, &scan) <= 0)
+		return false;
+
+	hdr = (const void *)(f->data + scan.offset);
+	fprintf(out, "Broadcom CLM data at 0x%zx, api \"%.*s\", manufacturer \"%.*s\", no checksum\n",
+		scan.offset, (int)strnlen(hdr->api, sizeof(hdr->api)), hdr->api,
+		(int)strnlen(hdr->manufacturer, sizeof(hdr->manufacturer)), hdr->manufacturer);
+
+	return true;
+}
+
+/**************************************************
+ * Dispatch
+ **************************************************/
+
+struct identify_format {
+	const char *magic;	/* at offset 0, NULL if identify() looks itself */
+	size_t magic_len;
+	bool (*identify)(const struct identify_file *f, FILE *out);
+};
+
+/* Fixed magics first, the CLM scan reads the whole file */
+static const struct identify_format formats[] = {
+	{ "HDR0", 4, identify_trx },
+	{ "\x5e\xa3\xa4\x17", 4, identify_seama },
+	{ "LXL#", 4, identify_lxl },
+	{ "HDR1", 4, identify_xiaomi },
+	{ "BLOB", 4, identify_bcmblob },
+	{ NULL, 0, identify_safeloader },
+	{ NULL, 0, identify_bcmclm },
+};
+
+static int identify_path(const char *path, FILE *out, bool threads)
+{
+	struct identify_file f = { .threads = threads };
+	struct fw_io_map map;
+	struct stat st;
+	size_t i;
+	int fd, err;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		err = -errno;
+		fprintf(out, "%s: %s\n", path, strerror(-err));
+		if (fd >= 0)
+			close(fd);
+		return err;
+	}
+
+	fprintf(out, "%s: ", path);
+
+	if (!S_ISREG(st.st_mode) || !st.st_size) {
+		fprintf(out, "%s\n", st.st_size ? "not a regular file" : "empty");
+		close(fd);
+		return 0;
+	}
+
+	err = fw_io_map(&map, fd, 0, st.st_size);
+	close(fd);
+	if (err) {
+		fprintf(out, "%s\n", strerror(-err));
+		return err;
+	}
+	f.data = map.data;
+	f.len = map.len;
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		const struct identify_format *fmt = &formats[i];
+
+		if (fmt->magic && (f.len < fmt->magic_len || memcmp(f.data, fmt->magic, fmt->magic_len)))
+			continue;
+		if (fmt->identify(&f, out))
+			break;
+	}
+	if (i == sizeof(formats) / sizeof(formats[0]))
+		fprintf(out, "data\n");
+
+	fw_io_unmap(&map);
+
+	return 0;
+}
+
+/**************************************************
+ * Directory walk
+ **************************************************/
+
+struct identify_job {
+	char *path;
+	char *out;
+	size_t out_len;
+	int err;
+};
+
+static void identify_job(void *arg, unsigned int idx)
+{
+	struct identify_job *job = (struct identify_job *)arg + idx;
+	FILE *out;
+
+	out = open_memstream(&job->out, &job->out_len);
+	if (!out) {
+		job->err = -ENOMEM;
+		return;
+	}
+
+	job->err = identify_path(job->path, out, false);
+	fclose(out);
+}
+
+int fwtool_identify(int argc, char **argv)
+{
+	struct identify_job *jobs;
+	char **paths = NULL;
+	size_t n = 0;
+	struct stat st;
+	int ret = EXIT_SUCCESS;
+	size_t i;
+	int j, err;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: fwtool identify <file|dir>...\n");
+		return EXIT_FAILURE;
+	}
+
+	/* A single file is checked here, with the CRCs on the worker pool */
+	if (argc == 2 && (stat(argv[1], &st) || !S_ISDIR(st.st_mode)))
+		return identify_path(argv[1], stdout, true) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	for (j = 1; j < argc; j++) {
+		err = fw_io_walk(argv[j], &paths, &n);
+		if (err) {
+			fprintf(stderr, "fwtool: unable to read %s: %s\n", argv[j], strerror(-err));
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	jobs = calloc(n ? n : 1, sizeof(*jobs));
+	if (!jobs) {
+		fprintf(stderr, "fwtool: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < n; i++)
+		jobs[i].path = paths[i];
+
+	fw_pool_run(n, identify_job, jobs);
+
+	for (i = 0; i < n; i++) {
+		struct identify_job *job = &jobs[i];
+
+		if (job->out)
+			fwrite(job->out, 1, job->out_len, stdout);
+		if (job->err)
+			ret = EXIT_FAILURE;
+
+		free(job->out);
+		free(job->path);
+	}
+	free(paths);
+	free(jobs);
+
+	return ret;
+}
@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * fwtool build server
+ *
+ * Buildbots that produce hundreds of images pay for an exec, dynamic
+ * linking and libc/OpenSSL start-up for every one of them. The server is
+ * started once; every job is a fork of it that takes over the client's
+ * working directory, stdio and environment and calls the tool's main()
+ * directly.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fw_pool.h"
+#include "fw_stats.h"
+#include "fwtool.h"
+
+#define FWTOOL_REQ_FDS	4	/* cwd, stdin, stdout, stderr */
+
+static int socket_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "fwtool: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+
+	while (len) {
+		ssize_t n = read(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Splits len bytes of NUL-terminated strings into a NULL-terminated vector */
+static char **split_strings(char *buf, size_t len, size_t count, char **end)
+{
+	char **vec;
+	size_t i;
+
+	vec = calloc(count + 1, sizeof(*vec));
+	if (!vec)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		char *nul = memchr(buf, '\0', len);
+
+		if (!nul) {
+			free(vec);
+			return NULL;
+		}
+		vec[i] = buf;
+		len -= nul + 1 - buf;
+		buf = nul + 1;
+	}
+
+	*end = buf;
+
+	return vec;
+}
+
+/* Runs in the job process; never returns */
+static void run_job(const int *fds, char **argv, char **envp)
+{
+	const char *name;
+	fwtool_main tool;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		if (dup2(fds[i + 1], i) < 0)
+			_exit(127);
+	if (fchdir(fds[0]))
+		_exit(127);
+	for (i = 0; i < FWTOOL_REQ_FDS; i++)
+		if (fds[i] > 2)
+			close(fds[i]);
+
+	signal(SIGPIPE, SIG_DFL);
+	environ = envp;
+
+	name = strrchr(argv[0], '/');
+	name = name ? name + 1 : argv[0];
+	tool = fwtool_find(name);
+	if (!tool) {
+		fprintf(stderr, "fwtool: unknown tool '%s'\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; argv[i]; i++)
+		;
+	if (fw_stats_setup(&i, argv))
+		exit(EXIT_FAILURE);
+	exit(tool(i, argv, envp));
+}
+
+/* Handles one connection in its own process and returns the exit code */
+static int serve_conn(int conn)
+{
+	char cbuf[CMSG_SPACE(FWTOOL_REQ_FDS * sizeof(int))];
+	int fds[FWTOOL_REQ_FDS], status;
+	char **argv, **envp, *buf, *end;
+	struct fwtool_req req;
+	struct cmsghdr *cmsg;
+	struct iovec iov = {
+		.iov_base = &req,
+		.iov_len = sizeof(req),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	int32_t ret;
+	ssize_t n;
+	pid_t pid;
+
+	/* Jobs run with the server's rights, so only its own user gets any */
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) ||
+	    cred.uid != geteuid())
+		return EXIT_FAILURE;
+
+	do {
+		n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return EXIT_FAILURE;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+		return EXIT_FAILURE;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	/* The descriptors came with the first byte, the rest may lag behind */
+	if ((size_t)n < sizeof(req) &&
+	    read_full(conn, (char *)&req + n, sizeof(req) - n))
+		return EXIT_FAILURE;
+	if (req.magic != FWTOOL_REQ_MAGIC || !req.argc || req.len > FWTOOL_REQ_MAX)
+		return EXIT_FAILURE;
+
+	/* Every string takes at least its NUL */
+	if (req.argc > req.len || req.envc > req.len - req.argc)
+		return EXIT_FAILURE;
+
+	buf = malloc(req.len);
+	if (!buf || read_full(conn, buf, req.len))
+		return EXIT_FAILURE;
+
+	argv = split_strings(buf, req.len, req.argc, &end);
+	if (!argv)
+		return EXIT_FAILURE;
+	envp = split_strings(end, req.len - (end - buf), req.envc, &end);
+	if (!envp)
+		return EXIT_FAILURE;
+
+	/* Forked once more so the tool's exit() can't skip the reply */
+	pid = fork();
+	if (pid < 0)
+		return EXIT_FAILURE;
+	if (!pid) {
+		close(conn);
+		run_job(fds, argv, envp);
+	}
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return EXIT_FAILURE;
+
+	if (WIFEXITED(status))
+		ret = WEXITSTATUS(status);
+	else
+		ret = 128 + WTERMSIG(status);
+
+	return write_full(conn, &ret, sizeof(ret)) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int fwtool_serve(const char *path)
+{
+	unsigned int running = 0, max_jobs = fw_pool_threads();
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int fd, err;
+
+	if (socket_addr(&addr, path))
+		return -1;
+
+	/* Replace a stale socket, but nothing else */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	/* Created 0600 rather than by the umask; peers are checked as well */
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0) {
+		mask = umask(077);
+		err = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+		umask(mask);
+	}
+	if (fd < 0 || err || listen(fd, SOMAXCONN)) {
+		fprintf(stderr, "fwtool: unable to listen on %s: %s\n",
+			path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		int conn;
+		pid_t pid;
+
+		while (running && waitpid(-1, NULL, running < max_jobs ? WNOHANG : 0) > 0)
+			running--;
+
+		conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "fwtool: accept: %s\n", strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		pid = fork();
+		if (!pid) {
+			close(fd);
+			_exit(serve_conn(conn));
+		}
+		if (pid > 0)
+			running++;
+		close(conn);
+	}
+}
+
+int fwtool_client(const char *path, int argc, char **argv, char **envp)
+{
+	char cbuf[CMSG_SPACE(FWTOOL_REQ_FDS * sizeof(int))] = {};
+	int fds[FWTOOL_REQ_FDS] = { -1, 0, 1, 2 };
+	struct fwtool_req req = {
+		.magic = FWTOOL_REQ_MAGIC,
+		.argc = argc,
+	};
+	struct iovec iov = {
+		.iov_base = &req,
+		.iov_len = sizeof(req),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct sockaddr_un addr;
+	struct cmsghdr *cmsg;
+	char *buf, *p;
+	size_t len = 0;
+	int fd, i;
+	int32_t ret;
+
+	if (socket_addr(&addr, path))
+		return -1;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	for (i = 0; envp[i]; i++)
+		len += strlen(envp[i]) + 1;
+	req.envc = i;
+	req.len = len;
+	if (len > FWTOOL_REQ_MAX)
+		return -1;
+
+	buf = p = malloc(len);
+	if (!buf)
+		return -1;
+	for (i = 0; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+	for (i = 0; envp[i]; i++)
+		p = stpcpy(p, envp[i]) + 1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		if (fd >= 0)
+			close(fd);
+		free(buf);
+		return -1;
+	}
+
+	fds[0] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fds[0] < 0) {
+		close(fd);
+		free(buf);
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The server only starts the job once it has read the whole request */
+	if (sendmsg(fd, &msg, 0) != sizeof(req) || write_full(fd, buf, len)) {
+		ret = -1;
+	} else if (read_full(fd, &ret, sizeof(ret))) {
+		fprintf(stderr, "fwtool: lost connection to %s\n", path);
+		ret = EXIT_FAILURE;
+	}
+
+	close(fds[0]);
+	close(fd);
+	free(buf);
+
+	return ret;
+}
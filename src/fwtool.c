@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * fwtool - all firmware utilities in one multicall binary
+ *
+ * Run a tool as "fwtool <tool> [args...]" or through a link named after
+ * the tool. Saves the exec and dynamic linking cost of dozens of separate
+ * executables when images are built in bulk.
+ *
+ * "fwtool --serve <socket>" keeps one instance running as a build server.
+ * With FWTOOL_SOCKET set in the environment, tools are run on that server
+ * instead, falling back to running them directly when it can't be reached.
+ *
+ * "fwtool identify <file|dir>..." tells which container format files use.
+ *
+ * "fwtool --max-mem <size> <tool> [args...]" runs a tool with its image
+ * buffers kept within <size> (FWUTILS_MAX_MEM, see fw_mem.h).
+ *
+ * Like the standalone tools, every tool here takes --stats[=json[:<path>]]
+ * for an end-of-run summary (see fw_stats.h), given either among its own
+ * arguments or as "fwtool --stats[=<format>] <tool> [args...]".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fw_stats.h"
+#include "fwtool.h"
+
+extern char **environ;
+
+#define FWTOOL_APPLET(name, id) \
+	int fwtool_##id##_main(int argc, char **argv, char **envp);
+#include "fwtool-applets.h"
+#undef FWTOOL_APPLET
+
+struct fwtool_applet {
+	const char *name;
+	fwtool_main main;
+};
+
+/* Sorted by name at configure time */
+static const struct fwtool_applet applets[] = {
+#define FWTOOL_APPLET(name, id) { name, fwtool_##id##_main },
+#include "fwtool-applets.h"
+#undef FWTOOL_APPLET
+};
+
+static int applet_cmp(const void *key, const void *elem)
+{
+	const struct fwtool_applet *applet = elem;
+
+	return strcmp(key, applet->name);
+}
+
+fwtool_main fwtool_find(const char *name)
+{
+	const struct fwtool_applet *applet;
+
+	applet = bsearch(name, applets, sizeof(applets) / sizeof(applets[0]),
+			 sizeof(applets[0]), applet_cmp);
+
+	return applet ? applet->main : NULL;
+}
+
+static void usage(FILE *out)
+{
+	size_t i;
+
+	fprintf(out, "usage: fwtool <tool> [args...]\n"
+		"       fwtool --list\n"
+		"       fwtool identify <file|dir>...\n"
+		"       fwtool --max-mem <size> <tool> [args...]\n"
+		"       fwtool --stats[=<format>] <tool> [args...]\n"
+		"       fwtool --serve <socket>\n"
+		"       fwtool --connect <socket> <tool> [args...]\n\n"
+		"Tools:\n");
+	for (i = 0; i < sizeof(applets) / sizeof(applets[0]); i++)
+		fprintf(out, "  %s\n", applets[i].name);
+}
+
+int main(int argc, char **argv, char **envp)
+{
+	const char *name, *sock;
+	fwtool_main tool;
+	size_t i;
+	int ret;
+
+	name = strrchr(argv[0], '/');
+	name = name ? name + 1 : argv[0];
+
+	if (!strcmp(name, "fwtool")) {
+		if (argc < 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+			usage(argc < 2 ? stderr : stdout);
+			return argc < 2 ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+
+		/* Handed on as the tool's own option, wherever the tool runs */
+		if (argc > 2 && (!strcmp(argv[1], "--stats") || !strncmp(argv[1], "--stats=", 8))) {
+			char *opt = argv[1];
+
+			argv[1] = argv[2];
+			argv[2] = opt;
+		}
+
+		if (!strcmp(argv[1], "--list")) {
+			for (i = 0; i < sizeof(applets) / sizeof(applets[0]); i++)
+				printf("%s\n", applets[i].name);
+			return EXIT_SUCCESS;
+		}
+
+		if (!strcmp(argv[1], "--max-mem")) {
+			if (argc < 4) {
+				usage(stderr);
+				return EXIT_FAILURE;
+			}
+			setenv("FWUTILS_MAX_MEM", argv[2], 1);
+			envp = environ;
+			argc -= 2;
+			argv += 2;
+		}
+
+		if (!strcmp(argv[1], "identify"))
+			return fwtool_identify(argc - 1, argv + 1);
+
+		if (!strcmp(argv[1], "--serve")) {
+			if (argc != 3) {
+				usage(stderr);
+				return EXIT_FAILURE;
+			}
+			fwtool_serve(argv[2]);
+			return EXIT_FAILURE;
+		}
+
+		if (!strcmp(argv[1], "--connect")) {
+			if (argc < 4) {
+				usage(stderr);
+				return EXIT_FAILURE;
+			}
+			ret = fwtool_client(argv[2], argc - 3, argv + 3, envp);
+			if (ret < 0) {
+				fprintf(stderr, "fwtool: unable to reach server at %s\n", argv[2]);
+				return EXIT_FAILURE;
+			}
+			return ret;
+		}
+
+		/* The tool sees its own name as argv[0] */
+		argc--;
+		argv++;
+		name = argv[0];
+	}
+
+	tool = fwtool_find(name);
+	if (!tool) {
+		fprintf(stderr, "fwtool: unknown tool '%s'\n", name);
+		return EXIT_FAILURE;
+	}
+
+	sock = getenv("FWTOOL_SOCKET");
+	if (sock && *sock) {
+		ret = fwtool_client(sock, argc, argv, envp);
+		if (ret >= 0)
+			return ret;
+	}
+
+	/* What fw_main.c does for the standalone tools */
+	if (fw_stats_setup(&argc, argv))
+		return EXIT_FAILURE;
+
+	return tool(argc, argv, envp);
+}
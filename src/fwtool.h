@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * fwtool - all firmware utilities in one multicall binary
+ */
+
+#ifndef _FWTOOL_H
+#define _FWTOOL_H
+
+#include <stdint.h>
+
+typedef int (*fwtool_main)(int argc, char **argv, char **envp);
+
+/* Look a tool up by name */
+fwtool_main fwtool_find(const char *name);
+
+/*
+ * Build server protocol, over a SOCK_STREAM UNIX socket:
+ *
+ * The client sends a struct fwtool_req together with four descriptors as
+ * SCM_RIGHTS: its working directory, stdin, stdout and stderr. len bytes of
+ * NUL-terminated strings follow, argc arguments (argv[0] names the tool)
+ * and then envc environment entries. The server runs the job with those
+ * descriptors and environment and answers with an int32_t exit status,
+ * 128 + signal number if the tool was killed.
+ */
+#define FWTOOL_REQ_MAGIC	0x6677746fu	/* "fwto" */
+#define FWTOOL_REQ_MAX		(1 << 20)
+
+struct fwtool_req {
+	uint32_t magic;
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t len;
+};
+
+/*
+ * Listen on path and run jobs until killed, at most fw_pool_threads() at a
+ * time. Every job runs in a fork of the server, so a tool's globals and
+ * exit() calls never leak into the next one. The socket is created 0600
+ * and connections from other users are dropped, since a job runs with the
+ * server's rights. Returns only on errors.
+ */
+int fwtool_serve(const char *path);
+
+/*
+ * Run argv on the server at path. Returns the job's exit status, or -1 if
+ * no server could be reached, in which case nothing has happened yet and
+ * the caller may run the tool itself.
+ */
+int fwtool_client(const char *path, int argc, char **argv, char **envp);
+
+/*
+ * "fwtool identify": describe the container format of every file given,
+ * walking directories. argv[0] is "identify".
+ */
+int fwtool_identify(int argc, char **argv);
+
+#endif /* _FWTOOL_H */
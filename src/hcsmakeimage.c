@@ -9,8 +9,10 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include "bcmalgo.h"
+#include "fw_io.h"
 
 
 int flag_print_version;
@@ -176,15 +178,24 @@ int main ( int argc, char** argv )
 
 	struct stat buf;
 	stat ( input,&buf );
-	ldr_header_t* head = construct_header ( magicnum, (uint16_t) majrev, (uint16_t) minrev, ( uint32_t ) t, ( uint32_t ) buf.st_size, ldaddress, fname, get_file_crc ( input ) );
+	//The input is mapped once for the crc and then copied behind the header by the kernel
+	int in_fd = open ( input, O_RDONLY );
+	struct fw_io_map map;
+	uint32_t crc_data;
+	if ( in_fd >= 0 && !fw_io_map ( &map, in_fd, 0, buf.st_size ) )
+	{
+		crc_data = get_buffer_crc ( ( char* ) map.data, map.len );
+		fw_io_unmap ( &map );
+	}
+	else
+	{
+		crc_data = get_file_crc ( input );
+	}
+	ldr_header_t* head = construct_header ( magicnum, (uint16_t) majrev, (uint16_t) minrev, ( uint32_t ) t, ( uint32_t ) buf.st_size, ldaddress, fname, crc_data );
 	free(dupe);
 	//uint32_t magic, uint16_t rev_maj,uint16_t rev_min, uint32_t build_date, uint32_t filelen, uint32_t ldaddress, const char* filename, uint32_t crc
 	//FILE* fd = fopen ("/tftpboot/haxorware11rev32.bin","r");
 	//fread(head,sizeof(ldr_header_t),1,fd);
-	char* filebuffer = malloc ( buf.st_size+10 );
-	FILE* fd = fopen ( input,"r" );
-	fread ( filebuffer, 1, buf.st_size,fd );
-	fclose (fd);
 	if (!output)
 		{
 		output = malloc(strlen(input+5));
@@ -196,13 +207,17 @@ int main ( int argc, char** argv )
 	if (!fd_out)
 		{
 		fprintf(stderr, "Failed to open output file: %s\n", output);
-		free(filebuffer);
 		exit(1);
 		}
 	fwrite ( head,1,sizeof ( ldr_header_t ),fd_out );
-	fwrite ( filebuffer,1,buf.st_size,fd_out );
+	fflush ( fd_out );
+	if ( fw_io_copy_fd ( fileno ( fd_out ), sizeof ( ldr_header_t ), in_fd, 0, buf.st_size ) != buf.st_size )
+		{
+		fprintf(stderr, "Failed to copy %s to output file: %s\n", input, output);
+		exit(1);
+		}
 	printf("Firmware image %s is ready\n", output);
-	free(filebuffer);
+	close(in_fd);
 	fclose(fd_out);
 	return 0;
 }
@@ -7,6 +7,7 @@
  * Copyright (C) 2009-2010 Daniel Dickinson <openwrt@cshore.neomailbox.net>
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +20,9 @@
 #include "bcm_tag.h"
 #include "imagetag_cmdline.h"
 #include "cyg_crc.h"
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_trace.h"
 
 #define DEADCODE			0xDEADC0DE
 
@@ -36,27 +40,197 @@ void int2tag(char *tag, uint32_t value) {
   memcpy(tag, (char *)(&network), 4);
 }
 
-uint32_t compute_crc32(uint32_t crc, FILE *binfile, size_t compute_start, size_t compute_len)
+/* A CRC over [start, start + len) of the output image */
+struct crc_range {
+	size_t start;
+	size_t len;
+	uint32_t *crc;
+};
+
+/*
+ * Compute all CRC ranges in a single pass over the output: the image is cut
+ * at every range boundary, each covered piece is checksummed once from a
+ * zero register and the ranges are then assembled with fw_crc32_combine().
+ * Ranges are clipped to the end of the file.
+ */
+static int compute_crc32s(FILE *binfile, struct crc_range *ranges, int n)
+{
+	size_t bounds[8], size;
+	struct fw_io_map map;
+	struct stat st;
+	int nb = 0;
+	int i, j, k;
+
+	if (fflush(binfile) || fstat(fileno(binfile), &st))
+		return -1;
+	size = st.st_size;
+
+	for (i = 0; i < n; i++) {
+		size_t start = ranges[i].start < size ? ranges[i].start : size;
+		size_t end = size - start < ranges[i].len ? size : start + ranges[i].len;
+
+		ranges[i].start = start;
+		ranges[i].len = end - start;
+		bounds[nb++] = start;
+		bounds[nb++] = end;
+	}
+
+	/* sort the boundaries */
+	for (i = 1; i < nb; i++)
+		for (j = i; j > 0 && bounds[j - 1] > bounds[j]; j--) {
+			size_t t = bounds[j];
+
+			bounds[j] = bounds[j - 1];
+			bounds[j - 1] = t;
+		}
+
+	if (fw_io_map(&map, fileno(binfile), 0, size))
+		return -1;
+
+	for (k = 0; k + 1 < nb; k++) {
+		size_t start = bounds[k], len = bounds[k + 1] - bounds[k];
+		uint32_t crc;
+		int covered = 0;
+
+		if (!len)
+			continue;
+
+		for (i = 0; i < n; i++)
+			if (ranges[i].start <= start && start < ranges[i].start + ranges[i].len)
+				covered = 1;
+		if (!covered)
+			continue;
+
+		crc = fw_crc32_parallel(0, map.data + start, len);
+		for (i = 0; i < n; i++)
+			if (ranges[i].start <= start && start < ranges[i].start + ranges[i].len)
+				*ranges[i].crc = fw_crc32_combine(*ranges[i].crc, crc, len);
+	}
+
+	fw_io_unmap(&map);
+
+	return 0;
+}
+
+/*
+ * What the CRC ranges of an image cover, relative to where its kernel (or
+ * with --root-first its rootfs) starts: the same for every board of a
+ * --batch that tags the same kernel and rootfs with the same layout, so
+ * their CRCs are only computed once.
+ */
+struct crc_key {
+	const char *kernel, *rootfs;
+	struct kernelhdr khdr;
+	int root_first, has_header;
+	size_t kernellen, rootfsoffpadlen, rootfslen, oldrootfslen;
+	size_t ranges[3][2];
+};
+
+struct crc_cache {
+	struct crc_cache *next;
+	struct crc_key key;
+	uint32_t crc[3];
+};
+
+static struct crc_cache *crc_cache;
+
+static int crc_key_eq(const struct crc_key *a, const struct crc_key *b)
+{
+	return !strcmp(a->kernel, b->kernel) && !strcmp(a->rootfs, b->rootfs) &&
+	       !memcmp(&a->khdr, &b->khdr, sizeof(a->khdr)) &&
+	       a->root_first == b->root_first && a->has_header == b->has_header &&
+	       a->kernellen == b->kernellen &&
+	       a->rootfsoffpadlen == b->rootfsoffpadlen &&
+	       a->rootfslen == b->rootfslen && a->oldrootfslen == b->oldrootfslen &&
+	       !memcmp(a->ranges, b->ranges, sizeof(a->ranges));
+}
+
+/* compute_crc32s() for the three ranges of a tag, cached for --batch */
+static int cached_crc32s(FILE *binfile, struct crc_key *key, size_t base,
+			 struct crc_range *ranges)
+{
+	struct crc_cache *c;
+	char *kernel, *rootfs;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		key->ranges[i][0] = ranges[i].start - base;
+		key->ranges[i][1] = ranges[i].len;
+	}
+
+	for (c = crc_cache; c; c = c->next)
+		if (crc_key_eq(&c->key, key))
+			break;
+	if (c) {
+		for (i = 0; i < 3; i++)
+			*ranges[i].crc = c->crc[i];
+		return 0;
+	}
+
+	if (compute_crc32s(binfile, ranges, 3))
+		return -1;
+
+	/* Not having it cached only costs time */
+	c = malloc(sizeof(*c));
+	kernel = strdup(key->kernel);
+	rootfs = strdup(key->rootfs);
+	if (!c || !kernel || !rootfs) {
+		free(c);
+		free(kernel);
+		free(rootfs);
+		return 0;
+	}
+	c->key = *key;
+	c->key.kernel = kernel;
+	c->key.rootfs = rootfs;
+	for (i = 0; i < 3; i++)
+		c->crc[i] = *ranges[i].crc;
+	c->next = crc_cache;
+	crc_cache = c;
+
+	return 0;
+}
+
+/* Append len bytes of 0xff to the output */
+static void write_ff(FILE *binfile, size_t len)
 {
-	uint8_t readbuf[1024];
-	size_t read;
+	uint8_t buf[4096];
+	size_t total = len;
+	struct fw_trace t;
+
+	fw_trace_begin(&t, "pad");
 
-	fseek(binfile, compute_start, SEEK_SET);
+	memset(buf, 0xff, sizeof(buf));
+	while (len) {
+		size_t n = len < sizeof(buf) ? len : sizeof(buf);
 
-	/* read block of 1024 bytes */
-	while (binfile && !feof(binfile) && !ferror(binfile) && (compute_len >= sizeof(readbuf))) {
-		read = fread(readbuf, sizeof(uint8_t), sizeof(readbuf), binfile);
-		crc = cyg_crc32_accumulate(crc, readbuf, read);
-		compute_len = compute_len - read;
+		fwrite(buf, sizeof(uint8_t), n, binfile);
+		len -= n;
 	}
 
-	/* Less than 1024 bytes remains, read compute_len bytes */
-	if (binfile && !feof(binfile) && !ferror(binfile) && (compute_len > 0)) {
-		read = fread(readbuf, sizeof(uint8_t), compute_len, binfile);
-		crc = cyg_crc32_accumulate(crc, readbuf, read);
+	fw_trace_end(&t, total);
+}
+
+/* Write only the blocks of the staged image that differ from existing */
+static int update_output(const char *bin, const char *existing, FILE *binfile)
+{
+	int fd, err;
+
+	fd = fw_io_open_update(bin, existing);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open output file \"%s\"\n", bin);
+		return 1;
 	}
 
-	return crc;
+	err = fw_io_update_file(fd, fileno(binfile), NULL);
+	if (close(fd) && !err)
+		err = -EIO;
+	if (err) {
+		fprintf(stderr, "Unable to update output file \"%s\"\n", bin);
+		return 1;
+	}
+
+	return 0;
 }
 
 size_t getlen(FILE *fp)
@@ -81,12 +255,11 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin, \
 {
 	struct bcm_tag tag;
 	struct kernelhdr khdr;
+	struct crc_key key;
 	FILE *kernelfile = NULL, *rootfsfile = NULL, *binfile = NULL, *cfefile = NULL;
 	size_t cfelen, kerneloff, kernellen, rootfsoff, rootfslen, \
-	  read, imagelen, rootfsoffpadlen = 0, oldrootfslen, \
+	  imagelen, rootfsoffpadlen = 0, oldrootfslen, \
 	  rootfsend;
-	uint8_t readbuf[1024];
-	uint32_t imagecrc = IMAGETAG_CRC_START;
 	uint32_t kernelcrc = IMAGETAG_CRC_START;
 	uint32_t rootfscrc = IMAGETAG_CRC_START;
 	uint32_t kernelfscrc = IMAGETAG_CRC_START;
@@ -97,6 +270,8 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin, \
 
 
 	memset(&tag, 0, sizeof(struct bcm_tag));
+	memset(&khdr, 0, sizeof(khdr));
+	memset(&key, 0, sizeof(key));
 
 	if (!kernel || !rootfs) {
 		fprintf(stderr, "imagetag can't create an image without both kernel and rootfs\n");
@@ -112,7 +287,8 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin, \
 		return 1;
 	}
 
-	if (!bin || !(binfile = fopen(bin, "wb+"))) {
+	/* With --update the image is built in memory, see update_output() */
+	if (!bin || !(binfile = args->update_given ? fw_io_stage() : fopen(bin, "wb+"))) {
 		fprintf(stderr, "Unable to open output file \"%s\"\n", bin);
 		return 1;
 	}
@@ -130,15 +306,17 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin, \
 	  fseek(binfile, sizeof(tag), SEEK_SET);
 	  
 	  /* Write the cfe */
-	  while (cfefile && !feof(cfefile) && !ferror(cfefile)) {
-		read = fread(readbuf, sizeof(uint8_t), sizeof(readbuf), cfefile);
-		fwrite(readbuf, sizeof(uint8_t), read, binfile);
-	  }
+	  fw_io_copy(binfile, cfefile, FW_IO_ALL, NULL, NULL);
 
 	} else {
 	  cfelen = 0;
 	}
 
+	key.kernel = kernel;
+	key.rootfs = rootfs;
+	key.root_first = args->root_first_flag;
+	key.has_header = args->kernel_file_has_header_flag;
+
 	if (!args->root_first_flag) {
 	  /* Build the kernel address and length (doesn't need to be aligned, read only) */
 	  kerneloff = fwaddr + sizeof(tag);
@@ -178,17 +356,13 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin, \
 	  fwrite(&khdr, sizeof(khdr), 1, binfile);
 	  
 	  /* Write the kernel */
-	  while (kernelfile && !feof(kernelfile) && !ferror(kernelfile)) {
-		read = fread(readbuf, sizeof(uint8_t), sizeof(readbuf), kernelfile);
-		fwrite(readbuf, sizeof(uint8_t), read, binfile);
-	  }
+	  if (kernelfile)
+		fw_io_copy(binfile, kernelfile, FW_IO_ALL, NULL, NULL);
 
 	  /* Write the RootFS */
 	  fseek(binfile, rootfsoff - fwaddr + cfelen, SEEK_SET);
-	  while (rootfsfile && !feof(rootfsfile) && !ferror(rootfsfile)) {
-		read = fread(readbuf, sizeof(uint8_t), sizeof(readbuf), rootfsfile);
-		fwrite(readbuf, sizeof(uint8_t), read, binfile);
-	  }
+	  if (rootfsfile)
+		fw_io_copy(binfile, rootfsfile, FW_IO_ALL, NULL, NULL);
 
 	  /* Align image to specified erase block size and append deadc0de */
 	  printf("Data alignment to %dk with 'deadc0de' appended\n", block_size/1024);
@@ -197,38 +371,44 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin, \
 
 	  oldrootfslen = rootfslen;
 	  if (args->pad_given) {
-		uint32_t allfs = 0xffffffff;
 		uint32_t pad_size = args->pad_arg * 1024 * 1024;
 
 		printf("Padding image to %d bytes ...\n", pad_size);
-		while (imagelen < pad_size) {
-			fwrite(&allfs, sizeof(uint32_t), 1, binfile);
-			imagelen += 4;
-			rootfslen += 4;
+		if (imagelen < pad_size) {
+			/* in whole words, like the loader expects */
+			size_t padlen = (pad_size - imagelen + 3) & ~3;
+
+			write_ff(binfile, padlen);
+			imagelen += padlen;
+			rootfslen += padlen;
 		}
 	  }
 
-	  /* Flush the binfile buffer so that when we read from file, it contains
-	   * everything in the buffer
-	   */
-	  fflush(binfile);
-
-	  /* Compute the crc32 of the entire image (deadC0de included) */
-	  imagecrc = compute_crc32(imagecrc, binfile, kerneloff - fwaddr + cfelen, imagelen);
-	  /* Compute the crc32 of the kernel and padding between kernel and rootfs) */
-	  kernelcrc = compute_crc32(kernelcrc, binfile, kerneloff - fwaddr + cfelen, kernellen + rootfsoffpadlen);
-	  /* Compute the crc32 of the kernel and padding between kernel and rootfs) */
-	  kernelfscrc = compute_crc32(kernelfscrc, binfile, kerneloff - fwaddr + cfelen, kernellen + rootfsoffpadlen + rootfslen + sizeof(deadcode));
-	  /* Compute the crc32 of the flashImageStart to rootLength.
-	   * The broadcom firmware assumes the rootfs starts the image,
-	   * therefore uses the rootfs start to determine where to flash
-	   * the image.  Since we have the kernel first we have to give
-	   * it the kernel address, but the crc uses the length
-	   * associated with this address, which is added to the kernel
-	   * length to determine the length of image to flash and thus
-	   * needs to be rootfs + deadcode
-	   */
-	  rootfscrc = compute_crc32(rootfscrc, binfile, kerneloff - fwaddr + cfelen, rootfslen + sizeof(deadcode));
+	  {
+		/* kernel + padding between kernel and rootfs */
+		struct crc_range ranges[] = {
+			{ kerneloff - fwaddr + cfelen, kernellen + rootfsoffpadlen, &kernelcrc },
+			{ kerneloff - fwaddr + cfelen, kernellen + rootfsoffpadlen + rootfslen + sizeof(deadcode), &kernelfscrc },
+			/*
+			 * The broadcom firmware assumes the rootfs starts the
+			 * image, therefore uses the rootfs start to determine
+			 * where to flash the image.  Since we have the kernel
+			 * first we have to give it the kernel address, but the
+			 * crc uses the length associated with this address,
+			 * which is added to the kernel length to determine the
+			 * length of image to flash and thus needs to be rootfs
+			 * + deadcode
+			 */
+			{ kerneloff - fwaddr + cfelen, rootfslen + sizeof(deadcode), &rootfscrc },
+		};
+
+		key.khdr = khdr;
+		key.kernellen = kernellen;
+		key.rootfsoffpadlen = rootfsoffpadlen;
+		key.rootfslen = rootfslen;
+		key.oldrootfslen = oldrootfslen;
+		cached_crc32s(binfile, &key, kerneloff - fwaddr + cfelen, ranges);
+	  }
 
 	} else {
 	  /* Build the kernel address and length (doesn't need to be aligned, read only) */
@@ -260,29 +440,26 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin, \
 	  }
 	  
 	  /* Write the kernel */
-	  while (kernelfile && !feof(kernelfile) && !ferror(kernelfile)) {
-		read = fread(readbuf, sizeof(uint8_t), sizeof(readbuf), kernelfile);
-		fwrite(readbuf, sizeof(uint8_t), read, binfile);
-	  }
+	  if (kernelfile)
+		fw_io_copy(binfile, kernelfile, FW_IO_ALL, NULL, NULL);
 
 	  /* Write the RootFS */
 	  fseek(binfile, rootfsoff - fwaddr + cfelen, SEEK_SET);
-	  while (rootfsfile && !feof(rootfsfile) && !ferror(rootfsfile)) {
-		read = fread(readbuf, sizeof(uint8_t), sizeof(readbuf), rootfsfile);
-		fwrite(readbuf, sizeof(uint8_t), read, binfile);
+	  if (rootfsfile)
+		fw_io_copy(binfile, rootfsfile, FW_IO_ALL, NULL, NULL);
+
+	  {
+		struct crc_range ranges[] = {
+			{ kerneloff - fwaddr + cfelen, kernellen + rootfsoffpadlen, &kernelcrc },
+			{ rootfsoff - fwaddr + cfelen, kernellen + rootfslen, &kernelfscrc },
+			{ rootfsoff - fwaddr + cfelen, rootfslen, &rootfscrc },
+		};
+
+		key.khdr = khdr;
+		key.kernellen = kernellen;
+		key.rootfslen = rootfslen;
+		cached_crc32s(binfile, &key, rootfsoff - fwaddr + cfelen, ranges);
 	  }
-
-	  /* Flush the binfile buffer so that when we read from file, it contains
-	   * everything in the buffer
-	   */
-	  fflush(binfile);
-
-	  /* Compute the crc32 of the entire image (deadC0de included) */
-	  imagecrc = compute_crc32(imagecrc, binfile, sizeof(tag), imagelen);
-	  /* Compute the crc32 of the kernel and padding between kernel and rootfs) */
-	  kernelcrc = compute_crc32(kernelcrc, binfile, kerneloff - fwaddr + cfelen, kernellen + rootfsoffpadlen);
-	  kernelfscrc = compute_crc32(kernelfscrc, binfile, rootfsoff - fwaddr + cfelen, kernellen + rootfslen);
-	  rootfscrc = compute_crc32(rootfscrc, binfile, rootfsoff - fwaddr + cfelen, rootfslen);
 	}
 
 	/* Close the files */
@@ -380,100 +557,93 @@ int tagfile(const char *kernel, const char *rootfs, const char *bin, \
 	fwrite(&tag, sizeof(uint8_t), sizeof(tag), binfile);
 
     fflush(binfile);
+	if (args->update_given && update_output(bin, args->update_arg, binfile)) {
+		fclose(binfile);
+		return 1;
+	}
 	fclose(binfile);
 
 	return 0;
 }
 
-int main(int argc, char **argv)
+/* Check the options of one image and tag it */
+static int tag_image(const struct gengetopt_args_info *args)
 {
 	char *kernel, *rootfs, *bin;
 	uint32_t flash_start, image_offset, block_size, load_address, entry;
 	flash_start = image_offset = block_size = load_address = entry = 0;
-	struct gengetopt_args_info parsed_args;
-
-	kernel = rootfs = bin = NULL;
-
-	if (imagetag_cmdline(argc, argv, &parsed_args)) {
-	  exit(1);
-	}
-
-	printf("Broadcom 63xx image tagger - v2.0.0\n");
-	printf("Copyright (C) 2008 Axel Gembe\n");
-	printf("Copyright (C) 2009-2010 Daniel Dickinson\n");
-	printf("Licensed under the terms of the Gnu General Public License\n");
 
-	kernel = parsed_args.kernel_arg;
-	rootfs = parsed_args.rootfs_arg;
-	bin = parsed_args.output_arg;
-	if (strlen(parsed_args.tag_version_arg) >= TAGVER_LEN) {
+	kernel = args->kernel_arg;
+	rootfs = args->rootfs_arg;
+	bin = args->output_arg;
+	if (strlen(args->tag_version_arg) >= TAGVER_LEN) {
 	  fprintf(stderr, "Error: Tag Version (tag_version,v) too long.\n");
-	  exit(1);
+	  return 1;
 	}
-	if (strlen(parsed_args.boardid_arg) >= BOARDID_LEN) {
+	if (strlen(args->boardid_arg) >= BOARDID_LEN) {
 	  fprintf(stderr, "Error: Board ID (boardid,b) too long.\n");
-	  exit(1);
+	  return 1;
 	}
-	if (strlen(parsed_args.chipid_arg) >= CHIPID_LEN) {
+	if (strlen(args->chipid_arg) >= CHIPID_LEN) {
 	  fprintf(stderr, "Error: Chip ID (chipid,c) too long.\n");
-	  exit(1);
+	  return 1;
 	}
-	if (strlen(parsed_args.signature_arg) >= SIG1_LEN) {
+	if (strlen(args->signature_arg) >= SIG1_LEN) {
 	  fprintf(stderr, "Error: Magic string (signature,a) too long.\n");
-	  exit(1);
+	  return 1;
 	}
-	if (strlen(parsed_args.signature2_arg) >= SIG2_LEN) {
+	if (strlen(args->signature2_arg) >= SIG2_LEN) {
 	  fprintf(stderr, "Error: Second magic string (signature2,m) too long.\n");
-	  exit(1);
+	  return 1;
 	}
-	if (parsed_args.layoutver_given) {
-	  if (strlen(parsed_args.layoutver_arg) > FLASHLAYOUTVER_LEN) {
+	if (args->layoutver_given) {
+	  if (strlen(args->layoutver_arg) > FLASHLAYOUTVER_LEN) {
 		fprintf(stderr, "Error: Flash layout version (layoutver,y) too long.\n");
-		exit(1);
+		return 1;
 	  }
 	}
-	if (parsed_args.rsa_signature_given) {
-	  if (strlen(parsed_args.rsa_signature_arg) > RSASIG_LEN) {
+	if (args->rsa_signature_given) {
+	  if (strlen(args->rsa_signature_arg) > RSASIG_LEN) {
 		fprintf(stderr, "Error: RSA Signature (rsa_signature,r) too long.\n");
-		exit(1);
+		return 1;
 	  }
 	}
 
-	if (parsed_args.info1_given) {
-	  if (strlen(parsed_args.info1_arg) >= TAGINFO1_LEN) {
+	if (args->info1_given) {
+	  if (strlen(args->info1_arg) >= TAGINFO1_LEN) {
 		fprintf(stderr, "Error: Vendor Information 1 (info1) too long.\n");
-		exit(1);
+		return 1;
 	  }
 	}
 
-	if (parsed_args.info2_given) {
-	  if (strlen(parsed_args.info2_arg) >= TAGINFO2_LEN) {
+	if (args->info2_given) {
+	  if (strlen(args->info2_arg) >= TAGINFO2_LEN) {
 		fprintf(stderr, "Error: Vendor Information 2 (info2) too long.\n");
-		exit(1);
+		return 1;
 	  }
 	}
 
-	if (parsed_args.altinfo_given) {
-	  if (strlen(parsed_args.altinfo_arg) >= ALTTAGINFO_LEN) {
+	if (args->altinfo_given) {
+	  if (strlen(args->altinfo_arg) >= ALTTAGINFO_LEN) {
 		fprintf(stderr, "Error: Vendor Information 1 (info1) too long.\n");
-		exit(1);
+		return 1;
 	  }
 	}
 
-	if (parsed_args.pad_given) {
-	  if (parsed_args.pad_arg < 0) {
+	if (args->pad_given) {
+	  if (args->pad_arg < 0) {
 		fprintf(stderr, "Error: pad size must be positive.\r");
-		exit(1);
+		return 1;
 	  }
 	}
 
-	flash_start = strtoul(parsed_args.flash_start_arg, NULL, 16);
-	image_offset = strtoul(parsed_args.image_offset_arg, NULL, 16);
-	block_size = strtoul(parsed_args.block_size_arg, NULL, 16);
+	flash_start = strtoul(args->flash_start_arg, NULL, 16);
+	image_offset = strtoul(args->image_offset_arg, NULL, 16);
+	block_size = strtoul(args->block_size_arg, NULL, 16);
 
-	if (!parsed_args.kernel_file_has_header_flag) {
-	  load_address = strtoul(parsed_args.load_addr_arg, NULL, 16);
-	  entry = strtoul(parsed_args.entry_arg, NULL, 16);
+	if (!args->kernel_file_has_header_flag) {
+	  load_address = strtoul(args->load_addr_arg, NULL, 16);
+	  entry = strtoul(args->entry_arg, NULL, 16);
 	  if (load_address == 0) {
 		fprintf(stderr, "Error: Invalid value for load address\n");
 	  }
@@ -482,5 +652,131 @@ int main(int argc, char **argv)
 	  }
 	}
 	
-	return tagfile(kernel, rootfs, bin, &parsed_args, flash_start, image_offset, block_size, load_address, entry);
+	return tagfile(kernel, rootfs, bin, args, flash_start, image_offset, block_size, load_address, entry);
+}
+
+/*
+ * Split a --batch line into words at blanks, double quotes grouping.
+ * Returns the number of words, or -1 if there are more than max.
+ */
+static int split_words(char *line, char **words, int max)
+{
+	char *out;
+	int n = 0, quoted;
+
+	for (;;) {
+		while (*line == ' ' || *line == '\t' || *line == '\n' || *line == '\r')
+			line++;
+		if (!*line || *line == '#')
+			return n;
+		if (n == max)
+			return -1;
+
+		words[n++] = out = line;
+		for (quoted = 0; *line; line++) {
+			if (*line == '"')
+				quoted = !quoted;
+			else if (!quoted && strchr(" \t\n\r", *line))
+				break;
+			else
+				*out++ = *line;
+		}
+		if (*line)
+			line++;
+		*out = 0;
+	}
+}
+
+/*
+ * One image for every line of the --batch file, each with the options of
+ * the command line plus those of its line. The images share one process
+ * and, where they tag the same kernel and rootfs alike, their CRCs.
+ */
+static int tag_batch(int argc, char **argv, const char *batch)
+{
+	struct gengetopt_args_info args;
+	struct imagetag_cmdline_params params;
+	char *line = NULL, *words[64];
+	char **lineargv;
+	size_t linesize = 0;
+	int n, lineno = 0, ret = 0;
+	FILE *f;
+
+	f = fopen(batch, "r");
+	if (!f) {
+		fprintf(stderr, "Unable to open batch file \"%s\"\n", batch);
+		return 1;
+	}
+
+	lineargv = malloc(sizeof(*lineargv) * (argc + 64 + 1));
+	if (!lineargv) {
+		fclose(f);
+		return 1;
+	}
+
+	imagetag_cmdline_params_init(&params);
+	while (!ret && getline(&line, &linesize, f) >= 0) {
+		lineno++;
+		n = split_words(line, words, 64);
+		if (n < 0) {
+			fprintf(stderr, "%s:%d: too many options\n", batch, lineno);
+			ret = 1;
+			break;
+		}
+		if (!n)
+			continue;
+
+		/* The line's options override those of the command line */
+		lineargv[0] = argv[0];
+		memcpy(lineargv + 1, words, n * sizeof(*words));
+		lineargv[n + 1] = NULL;
+
+		/* Bad options end the run right in imagetag_cmdline_ext() */
+		params.initialize = 1;
+		params.override = 0;
+		params.check_required = 0;
+		imagetag_cmdline_ext(argc, argv, &args, &params);
+		params.initialize = 0;
+		params.override = 1;
+		params.check_required = 1;
+		imagetag_cmdline_ext(n + 1, lineargv, &args, &params);
+
+		ret = tag_image(&args);
+		imagetag_cmdline_free(&args);
+	}
+
+	free(line);
+	free(lineargv);
+	fclose(f);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct gengetopt_args_info parsed_args;
+	struct imagetag_cmdline_params params;
+	int ret;
+
+	/* With --batch the required options may come from its lines */
+	imagetag_cmdline_params_init(&params);
+	params.check_required = 0;
+	imagetag_cmdline_ext(argc, argv, &parsed_args, &params);
+	if (!parsed_args.batch_given &&
+	    imagetag_cmdline_required(&parsed_args, argv[0])) {
+	  exit(1);
+	}
+
+	printf("Broadcom 63xx image tagger - v2.0.0\n");
+	printf("Copyright (C) 2008 Axel Gembe\n");
+	printf("Copyright (C) 2009-2010 Daniel Dickinson\n");
+	printf("Licensed under the terms of the Gnu General Public License\n");
+
+	if (parsed_args.batch_given)
+		ret = tag_batch(argc, argv, parsed_args.batch_arg);
+	else
+		ret = tag_image(&parsed_args);
+	imagetag_cmdline_free(&parsed_args);
+
+	return ret;
 }
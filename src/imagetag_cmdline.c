@@ -60,6 +60,8 @@ const char *gengetopt_args_info_help[] = {
   "      --kernel-file-has-header  Indicates that the kernel file includes the \n                                  kernel header with correct load address and \n                                  entry point, so no changes are needed  \n                                  (default=off)",
   "  -p, --pad=size (in MiB)       Pad the image to this size if smaller (in MiB)",
   "      --align-rootfs            Align the rootfs start to erase block size  \n                                  (default=off)",
+  "      --update=filename         Only rewrite what differs from this earlier \n                                  build of the output.",
+  "      --batch=filename          Tag the kernel and rootfs for several boards, \n                                  one line of further options per image.",
     0
 };
 
@@ -118,6 +120,8 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->kernel_file_has_header_given = 0 ;
   args_info->pad_given = 0 ;
   args_info->align_rootfs_given = 0 ;
+  args_info->update_given = 0 ;
+  args_info->batch_given = 0 ;
 }
 
 static
@@ -172,6 +176,10 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->kernel_file_has_header_flag = 0;
   args_info->pad_orig = NULL;
   args_info->align_rootfs_flag = 0;
+  args_info->update_arg = NULL;
+  args_info->update_orig = NULL;
+  args_info->batch_arg = NULL;
+  args_info->batch_orig = NULL;
   
 }
 
@@ -208,6 +216,8 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->kernel_file_has_header_help = gengetopt_args_info_help[25] ;
   args_info->pad_help = gengetopt_args_info_help[26] ;
   args_info->align_rootfs_help = gengetopt_args_info_help[27] ;
+  args_info->update_help = gengetopt_args_info_help[28] ;
+  args_info->batch_help = gengetopt_args_info_help[29] ;
   
 }
 
@@ -333,6 +343,10 @@ imagetag_cmdline_release (struct gengetopt_args_info *args_info)
   free_string_field (&(args_info->reserved2_arg));
   free_string_field (&(args_info->reserved2_orig));
   free_string_field (&(args_info->pad_orig));
+  free_string_field (&(args_info->update_arg));
+  free_string_field (&(args_info->update_orig));
+  free_string_field (&(args_info->batch_arg));
+  free_string_field (&(args_info->batch_orig));
   
   
 
@@ -460,6 +474,10 @@ imagetag_cmdline_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "pad", args_info->pad_orig, 0);
   if (args_info->align_rootfs_given)
     write_into_file(outfile, "align-rootfs", 0, 0 );
+  if (args_info->update_given)
+    write_into_file(outfile, "update", args_info->update_orig, 0);
+  if (args_info->batch_given)
+    write_into_file(outfile, "batch", args_info->batch_orig, 0);
   
 
   i = EXIT_SUCCESS;
@@ -817,6 +835,8 @@ imagetag_cmdline_internal (
         { "kernel-file-has-header",	0, NULL, 0 },
         { "pad",	1, NULL, 'p' },
         { "align-rootfs",	0, NULL, 0 },
+        { "update",	1, NULL, 0 },
+        { "batch",	1, NULL, 0 },
         { 0,  0, 0, 0 }
       };
 
@@ -1159,6 +1179,34 @@ imagetag_cmdline_internal (
                 additional_error))
               goto failure;
           
+          }
+          /* Only rewrite what differs from this earlier build of the output..  */
+          else if (strcmp (long_options[option_index].name, "update") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->update_arg), 
+                 &(args_info->update_orig), &(args_info->update_given),
+                &(local_args_info.update_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "update", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Tag the kernel and rootfs for several boards, one line of further options per image..  */
+          else if (strcmp (long_options[option_index].name, "batch") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->batch_arg), 
+                 &(args_info->batch_orig), &(args_info->batch_given),
+                &(local_args_info.batch_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "batch", '-',
+                additional_error))
+              goto failure;
+          
           }
           
           break;
@@ -114,6 +114,12 @@ struct gengetopt_args_info
   const char *pad_help; /**< @brief Pad the image to this size if smaller (in MiB) help description.  */
   int align_rootfs_flag;	/**< @brief Align the rootfs start to erase block size (default=off).  */
   const char *align_rootfs_help; /**< @brief Align the rootfs start to erase block size help description.  */
+  char * update_arg;	/**< @brief Only rewrite what differs from this earlier build of the output..  */
+  char * update_orig;	/**< @brief Only rewrite what differs from this earlier build of the output. original value given at command line.  */
+  const char *update_help; /**< @brief Only rewrite what differs from this earlier build of the output. help description.  */
+  char * batch_arg;	/**< @brief Tag the kernel and rootfs for several boards, one line of further options per image..  */
+  char * batch_orig;	/**< @brief Tag the kernel and rootfs for several boards, one line of further options per image. original value given at command line.  */
+  const char *batch_help; /**< @brief Tag the kernel and rootfs for several boards, one line of further options per image. help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int version_given ;	/**< @brief Whether version was given.  */
@@ -143,6 +149,8 @@ struct gengetopt_args_info
   unsigned int kernel_file_has_header_given ;	/**< @brief Whether kernel-file-has-header was given.  */
   unsigned int pad_given ;	/**< @brief Whether pad was given.  */
   unsigned int align_rootfs_given ;	/**< @brief Whether align-rootfs was given.  */
+  unsigned int update_given ;	/**< @brief Whether update was given.  */
+  unsigned int batch_given ;	/**< @brief Whether batch was given.  */
 
 } ;
 
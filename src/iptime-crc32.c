@@ -23,6 +23,10 @@
 #include <unistd.h>
 
 #include "cyg_crc.h"
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_registry.h"
 
 #if !defined(__BYTE_ORDER)
 #error "Unknown byte order"
@@ -60,31 +64,27 @@ struct board_info boards[] = {
 
 struct board_info *find_board(const char *model)
 {
-	struct board_info *ret = NULL;
-	struct board_info *board;
+	static struct fw_registry registry = FW_REGISTRY_INIT(boards, model, false);
 
-	for (board = boards; board->model != NULL; board++) {
-		if (strcmp(model, board->model) == 0) {
-			ret = board;
-			break;
-		}
-	}
-
-	return ret;
+	return fw_registry_find(&registry, model);
 }
 
-uint32_t make_checksum(struct fw_header *header, uint8_t *payload, int size)
+uint32_t make_checksum(struct fw_header *header, uint32_t payload_crc, size_t size)
 {
 	cyg_uint32 checksum;
 
 	/* get CRC of header */
 	checksum = cyg_crc32_accumulate(~0L, header, sizeof(*header));
 
-	/* get CRC of payload buffer with header CRC as initial value */
-	return (uint32_t)cyg_crc32_accumulate(checksum, payload, size);
+	/*
+	 * CRC of payload with header CRC as initial value: the payload's CRC
+	 * from zero is shared by all boards, the header CRC is shifted in
+	 */
+	return fw_crc32_shift(checksum, size) ^ payload_crc;
 }
 
-void make_header(struct board_info *board, uint8_t *buffer, size_t img_size)
+void make_header(struct board_info *board, uint8_t *buffer, size_t img_size,
+		 uint32_t payload_crc)
 {
 	struct fw_header *header = (struct fw_header *)buffer;
 	uint32_t checksum;
@@ -92,31 +92,81 @@ void make_header(struct board_info *board, uint8_t *buffer, size_t img_size)
 	strncpy((char *)header->model, board->model, sizeof(header->model)-1);
 	strncpy((char *)header->version, FW_VERSION, sizeof(header->version)-1);
 	header->size = HOST_TO_LE32(img_size);
-	checksum = make_checksum(header, buffer + board->payload_offset, img_size);
+	checksum = make_checksum(header, payload_crc, img_size);
 	header->checksum = HOST_TO_LE32(checksum);
 }
 
-int main(int argc, const char *argv[])
-{
-	const char *model_name, *img_in, *img_out;
+struct image {
 	struct board_info *board;
-	int file_in, file_out;
-	struct stat stat_in;
-	size_t size_in, size_out;
+	const char *name;
+};
+
+static int file_in;
+static size_t size_in;
+static uint32_t payload_crc;
+
+static void write_image(void *arg, unsigned int idx)
+{
+	struct image *img = (struct image *)arg + idx;
+	struct board_info *board = img->board;
+	int file_out;
 	uint8_t *buffer;
 
-	if (argc != 4) {
-		fprintf(stderr, "Usage: %s <model> <input> <output>\n", argv[0]);
-		return EXIT_FAILURE;
+	if ((buffer = calloc(1, board->payload_offset)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	make_header(board, buffer, size_in, payload_crc);
+
+	if ((file_out = creat(img->name, 0644)) == -1)
+		err(EXIT_FAILURE, "%s", img->name);
+	if (write(file_out, buffer, board->payload_offset) != board->payload_offset ||
+	    fw_io_copy_fd(file_out, board->payload_offset, file_in, 0, size_in) != size_in)
+		err(EXIT_FAILURE, "%s", img->name);
+	close(file_out);
+
+	free(buffer);
+}
+
+static void __attribute__((noreturn)) usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s <model> <input> <output>\n", name);
+	fprintf(stderr, "       %s -m <input> <model> <output> [<model> <output>...]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, const char *argv[])
+{
+	const char *img_in, *single[2], **pairs;
+	struct stat stat_in;
+	struct image *images;
+	unsigned int num_images, i;
+
+	/* -m builds the same payload for several boards at once */
+	if (argc >= 5 && !strcmp(argv[1], "-m") && argc % 2 == 1) {
+		img_in = argv[2];
+		pairs = argv + 3;
+		num_images = (argc - 3) / 2;
+	} else if (argc == 4) {
+		img_in = argv[2];
+		single[0] = argv[1];
+		single[1] = argv[3];
+		pairs = single;
+		num_images = 1;
+	} else {
+		usage(argv[0]);
 	}
-	model_name = argv[1];
-	img_in = argv[2];
-	img_out = argv[3];
-
-	board = find_board(model_name);
-	if (board == NULL) {
-		fprintf(stderr, "%s: Not supported model\n", model_name);
-		return EXIT_FAILURE;
+
+	images = calloc(num_images, sizeof(*images));
+	if (images == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	for (i = 0; i < num_images; i++) {
+		images[i].board = find_board(pairs[2 * i]);
+		images[i].name = pairs[2 * i + 1];
+		if (images[i].board == NULL) {
+			fprintf(stderr, "%s: Not supported model\n", pairs[2 * i]);
+			return EXIT_FAILURE;
+		}
 	}
 
 	if ((file_in = open(img_in, O_RDONLY)) == -1)
@@ -126,24 +176,17 @@ int main(int argc, const char *argv[])
 		err(EXIT_FAILURE, "%s", img_in);
 
 	size_in = stat_in.st_size;
-	size_out = board->payload_offset + size_in;
 
-	if ((buffer = malloc(size_out)) == NULL)
-		err(EXIT_FAILURE, "malloc");
-
-	read(file_in, buffer + board->payload_offset, size_in);
-	close(file_in);
-
-	memset(buffer, 0, board->payload_offset);
-
-	make_header(board, buffer, size_in);
+	/* the payload is only read once, whatever the number of boards */
+	payload_crc = 0;
+	errno = -fw_crc32_fd(&payload_crc, file_in, 0, size_in);
+	if (errno)
+		err(EXIT_FAILURE, "%s", img_in);
 
-	if ((file_out = creat(img_out, 0644)) == -1)
-		err(EXIT_FAILURE, "%s", img_out);
-	write(file_out, buffer, size_out);
-	close(file_out);
+	fw_pool_run(num_images, write_image, images);
 
-	free(buffer);
+	close(file_in);
+	free(images);
 
 	return EXIT_SUCCESS;
 }
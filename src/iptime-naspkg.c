@@ -23,6 +23,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_sum.h"
+
 #if !defined(__BYTE_ORDER)
 #error "Unknown byte order"
 #endif
@@ -133,26 +137,21 @@ char *get_ctime(void)
 	return asctime(gmtime(&timestamp));
 }
 
-uint32_t make_checksum(const char *model_name, uint8_t *bytes, int length)
+uint32_t make_checksum(const char *model_name, uint32_t sum)
 {
-	int i;
-	uint32_t sum = 0;
 	uint32_t magic = 0x19283745;
 
-	for (i = 0; i < length; i++)
-		sum += bytes[i];
 	return ((uint32_t)strlen(model_name) * magic + ~sum) ^ sum;
 }
 
-void make_header(struct board_info *board, uint8_t *buffer, size_t img_size)
+void make_header(struct board_info *board, uint8_t *buffer, size_t img_size,
+		 uint32_t sum, const char *time_created)
 {
 	struct fw_header *header = (struct fw_header *)buffer;
-	char *time_created;
 	uint32_t checksum;
 	size_t bootloader_size, image_end_offset;
 
-	time_created = get_ctime();
-	checksum = make_checksum(board->model, buffer + FW_HEADER_SIZE, img_size);
+	checksum = make_checksum(board->model, sum);
 	bootloader_size = board_types[board->type].bootloader_size;
 	image_end_offset = bootloader_size + FW_HEADER_SIZE + img_size;
 
@@ -174,27 +173,81 @@ void make_header(struct board_info *board, uint8_t *buffer, size_t img_size)
 	}
 }
 
+struct image {
+	struct board_info *board;
+	const char *name;
+};
+
+static int file_in;
+static size_t size_in;
+static uint32_t payload_sum;
+static const char *time_created;
+
+static void write_image(void *arg, unsigned int idx)
+{
+	struct image *img = (struct image *)arg + idx;
+	struct board_info *board = img->board;
+	size_t size_in_padded;
+	uint8_t buffer[FW_HEADER_SIZE];
+	int file_out;
+
+	/* the zero padding adds nothing to the sum and is left as a hole */
+	size_in_padded = size_in + calc_padding(board->type, size_in);
+
+	memset(buffer, 0, FW_HEADER_SIZE);
+	make_header(board, buffer, size_in_padded, payload_sum, time_created);
+
+	if ((file_out = creat(img->name, 0644)) == -1)
+		err(EXIT_FAILURE, "%s", img->name);
+	if (write(file_out, buffer, FW_HEADER_SIZE) != FW_HEADER_SIZE ||
+	    fw_io_copy_fd(file_out, FW_HEADER_SIZE, file_in, 0, size_in) != size_in ||
+	    ftruncate(file_out, FW_HEADER_SIZE + size_in_padded) == -1)
+		err(EXIT_FAILURE, "%s", img->name);
+	close(file_out);
+}
+
+static void __attribute__((noreturn)) usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s <model> <input> <output>\n", name);
+	fprintf(stderr, "       %s -m <input> <model> <output> [<model> <output>...]\n", name);
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, const char *argv[])
 {
-	const char *model_name, *img_in, *img_out;
-	struct board_info *board;
-	int file_in, file_out;
+	const char *img_in, *single[2], **pairs;
 	struct stat stat_in;
-	size_t size_in, size_in_padded, size_out;
-	uint8_t *buffer;
-
-	if (argc != 4) {
-		fprintf(stderr, "Usage: %s <model> <input> <output>\n", argv[0]);
-		return EXIT_FAILURE;
+	struct fw_io_map map;
+	struct fw_sum sum;
+	struct image *images;
+	unsigned int num_images, i;
+
+	/* -m builds the same payload for several boards at once */
+	if (argc >= 5 && !strcmp(argv[1], "-m") && argc % 2 == 1) {
+		img_in = argv[2];
+		pairs = argv + 3;
+		num_images = (argc - 3) / 2;
+	} else if (argc == 4) {
+		img_in = argv[2];
+		single[0] = argv[1];
+		single[1] = argv[3];
+		pairs = single;
+		num_images = 1;
+	} else {
+		usage(argv[0]);
 	}
-	model_name = argv[1];
-	img_in = argv[2];
-	img_out = argv[3];
-
-	board = find_board(model_name);
-	if (board == NULL) {
-		fprintf(stderr, "%s: Not supported model\n", model_name);
-		return EXIT_FAILURE;
+
+	images = calloc(num_images, sizeof(*images));
+	if (images == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	for (i = 0; i < num_images; i++) {
+		images[i].board = find_board(pairs[2 * i]);
+		images[i].name = pairs[2 * i + 1];
+		if (images[i].board == NULL) {
+			fprintf(stderr, "%s: Not supported model\n", pairs[2 * i]);
+			return EXIT_FAILURE;
+		}
 	}
 
 	if ((file_in = open(img_in, O_RDONLY)) == -1)
@@ -204,25 +257,22 @@ int main(int argc, const char *argv[])
 		err(EXIT_FAILURE, "%s", img_in);
 
 	size_in = stat_in.st_size;
-	size_in_padded = size_in + calc_padding(board->type, size_in);
-	size_out = FW_HEADER_SIZE + size_in_padded;
-
-	if ((buffer = malloc(size_out)) == NULL)
-		err(EXIT_FAILURE, "malloc");
-
-	read(file_in, buffer + FW_HEADER_SIZE, size_in);
-	close(file_in);
 
-	memset(buffer, 0, FW_HEADER_SIZE);
+	/* the payload is only read once, whatever the number of boards */
+	errno = -fw_io_map(&map, file_in, 0, size_in);
+	if (errno)
+		err(EXIT_FAILURE, "%s", img_in);
+	fw_sum_init(&sum);
+	fw_sum8_update(&sum, map.data, map.len);
+	payload_sum = sum.sum;
+	fw_io_unmap(&map);
 
-	make_header(board, buffer, size_in_padded);
+	time_created = get_ctime();
 
-	if ((file_out = creat(img_out, 0644)) == -1)
-		err(EXIT_FAILURE, "%s", img_out);
-	write(file_out, buffer, size_out);
-	close(file_out);
+	fw_pool_run(num_images, write_image, images);
 
-	free(buffer);
+	close(file_in);
+	free(images);
 
 	return EXIT_SUCCESS;
 }
@@ -86,6 +86,8 @@
 #include <assert.h>
 #include <inttypes.h>
 
+#include "fw_crc32.h"
+
 /*
  * JCG Firmware image header
  */
@@ -251,35 +253,9 @@ mkuheader(struct uimage_header *h, size_t ksize, size_t fsize)
 void
 craftcrc(uint32_t dcrc, uint8_t *buf, size_t len)
 {
-	int i;
-	uint32_t a;
-	uint32_t patch = 0;
-	uint32_t crc = crc32(0L, Z_NULL, 0);
-
-	a = ~dcrc;
-	for (i = 0; i < 32; i++) {
-		if (patch & 1)
-			patch = (patch >> 1) ^ 0xedb88320L;
-		else
-			patch >>= 1;
-
-		if (a & 1)
-			patch ^= 0x5b358fd3L;
-
-		a >>= 1;
-	}
-	patch ^= ~crc32(crc, buf, len - 4);
-	for (i = 0; i < 4; i++) {
-		buf[len - 4 + i] = patch & 0xff;
-		patch >>= 8;
-	}
-	/* Verify that we actually get the desired result */
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, buf, len);
-	if (crc != dcrc)
-		errx(1, "CRC patching is broken: wanted %08x, but got %08x.",
-		     dcrc, crc);
-
+	/* zlib's crc32() is the register from ~0, inverted */
+	if (fw_crc32_forge(0xffffffff, buf, len, len - 4, ~dcrc))
+		errx(1, "CRC patching is broken: cannot get %08x.", dcrc);
 }
 
 void
@@ -10,14 +10,19 @@
 #include <byteswap.h>
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "fw_io.h"
+#include "fw_trace.h"
+
 #if __BYTE_ORDER == __BIG_ENDIAN
 #define cpu_to_le32(x)	bswap_32(x)
 #define cpu_to_le16(x)	bswap_16(x)
@@ -76,6 +81,25 @@ struct lxl_blob {
 	uint8_t		data[0];
 } __attribute__((packed));
 
+struct lxl_blob_entry {
+	const struct lxl_blob *blob;	/* in the table's mapping of the section */
+	off_t		offset;		/* of the blob in the file */
+	size_t		size;		/* header and data */
+	int		complete;	/* data within the section */
+};
+
+/* Blobs section mapped in one go and indexed */
+struct lxl_blob_table {
+	struct fw_io_map map;
+	const uint8_t	*data;
+	size_t		len;		/* declared section length */
+	size_t		read;		/* bytes of it within the file */
+	struct lxl_blob_entry *entries;
+	size_t		n;
+	size_t		end;		/* where the last blob ends */
+	int		err;		/* a blob header couldn't be read */
+};
+
 /**************************************************
  * Helpers
  **************************************************/
@@ -172,30 +196,16 @@ err_out:
  */
 static ssize_t lxlfw_copy_data(FILE *from, FILE *to, size_t size)
 {
-	int copy_all = size == 0;
-	char buf[512];
-	size_t ret = 0;
-
-	while (copy_all || size) {
-		size_t to_read = copy_all ? sizeof(buf) : min(size, sizeof(buf));
-		size_t bytes;
-
-		bytes = fread(buf, 1, to_read, from);
-		if (bytes == 0 && copy_all) {
-			break;
-		} else if (bytes <= 0) {
-			fprintf(stderr, "Failed to read data\n");
-			return -EIO;
-		}
-
-		if (fwrite(buf, 1, bytes, to) != bytes) {
-			fprintf(stderr, "Failed to write data\n");
-			return -EIO;
-		}
+	ssize_t ret;
 
-		if (!copy_all)
-			size -= bytes;
-		ret += bytes;
+	ret = fw_io_copy(to, from, size ?: FW_IO_ALL, NULL, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "Failed to write data\n");
+		return -EIO;
+	}
+	if (size && ret != size) {
+		fprintf(stderr, "Failed to read data\n");
+		return -EIO;
 	}
 
 	return ret;
@@ -252,6 +262,134 @@ static ssize_t lxlfw_write_blob(FILE *lxl, uint16_t type, const char *pathname)
 	return blob_data_len + sizeof(blob);
 }
 
+/**
+ * lxlfw_blob_table_read - map the blobs section and index its blobs
+ *
+ * @lxl: Luxul firmware FILE
+ * @hdr: header read by lxlfw_open()
+ * @table: table to fill, left empty if there are no blobs
+ *
+ * Only the section itself is mapped, so the image body is never read.
+ * A blob header that can't be read is recorded in @table->err so callers
+ * can still handle the blobs before it.
+ */
+static int lxlfw_blob_table_read(FILE *lxl, const struct lxl_hdr *hdr, struct lxl_blob_table *table)
+{
+	off_t blobs_offset = le32_to_cpu(hdr->blobs_offset);
+	struct stat st;
+	size_t offset;
+	int err;
+
+	memset(table, 0, sizeof(*table));
+
+	if (le32_to_cpu(hdr->version) < 3 || !hdr->blobs_offset)
+		return 0;
+
+	table->len = le32_to_cpu(hdr->blobs_len);
+
+	/* Whatever part of the section the file holds */
+	if (fstat(fileno(lxl), &st))
+		return -errno;
+	if (st.st_size > blobs_offset)
+		table->read = min((uint64_t)table->len, (uint64_t)(st.st_size - blobs_offset));
+
+	err = fw_io_map(&table->map, fileno(lxl), blobs_offset, table->read);
+	if (err)
+		return err;
+	table->data = table->map.data;
+
+	for (offset = 0; offset < table->len; ) {
+		struct lxl_blob_entry *entry;
+		const struct lxl_blob *blob;
+
+		if (offset + sizeof(*blob) > table->read) {
+			table->err = -ENXIO;
+			break;
+		}
+		blob = (const struct lxl_blob *)(table->data + offset);
+
+		entry = realloc(table->entries, (table->n + 1) * sizeof(*entry));
+		if (!entry)
+			return -ENOMEM;
+		table->entries = entry;
+
+		entry = &table->entries[table->n++];
+		entry->blob = blob;
+		entry->offset = blobs_offset + offset;
+		entry->size = sizeof(*blob) + le32_to_cpu(blob->len);
+		entry->complete = offset + entry->size <= table->read;
+
+		offset += entry->size;
+	}
+	table->end = offset;
+
+	return 0;
+}
+
+static void lxlfw_blob_table_free(struct lxl_blob_table *table)
+{
+	free(table->entries);
+	fw_io_unmap(&table->map);
+}
+
+/**
+ * lxlfw_blob_append - append a blob with data from external file to buffer
+ *
+ * @buf: buffer to grow
+ * @buf_len: its length
+ * @type: blob type
+ * @pathname: external file pathname to read blob data from
+ */
+static ssize_t lxlfw_blob_append(uint8_t **buf, size_t *buf_len, uint16_t type, const char *pathname)
+{
+	struct lxl_blob blob = {
+		.magic = { 'D', '#' },
+		.type = cpu_to_le16(type),
+	};
+	size_t start = *buf_len;
+	size_t alloc;
+	size_t bytes;
+	uint8_t *tmp;
+	FILE *data;
+
+	data = fopen(pathname, "r");
+	if (!data) {
+		fprintf(stderr, "Could not open input file %s\n", pathname);
+		return -EIO;
+	}
+
+	alloc = start + sizeof(blob);
+	*buf_len = alloc;
+	for (;;) {
+		if (*buf_len == alloc) {
+			alloc *= 2;
+			tmp = realloc(*buf, alloc);
+			if (!tmp) {
+				fclose(data);
+				return -ENOMEM;
+			}
+			*buf = tmp;
+		}
+
+		bytes = fread(*buf + *buf_len, 1, alloc - *buf_len, data);
+		if (!bytes)
+			break;
+		*buf_len += bytes;
+	}
+
+	if (ferror(data)) {
+		fprintf(stderr, "Could not read input file %s\n", pathname);
+		fclose(data);
+		return -EIO;
+	}
+	fclose(data);
+
+	blob.len = cpu_to_le32(*buf_len - start - sizeof(blob));
+	memcpy(*buf + start, &blob, sizeof(blob));
+
+	return *buf_len - start;
+}
+
 /**************************************************
  * Info
  **************************************************/
@@ -306,40 +444,37 @@ static int lxlfw_info(int argc, char **argv) {
 	}
 
 	if (version >= 3 && hdr.blobs_offset) {
-		size_t offset;
-
-		fseek(lxl, le32_to_cpu(hdr.blobs_offset), SEEK_SET);
-		for (offset = 0; offset < le32_to_cpu(hdr.blobs_len); ) {
-			struct lxl_blob blob;
-			size_t bytes;
-			size_t len;
-
-			bytes = fread(&blob, 1, sizeof(blob), lxl);
-			if (bytes != sizeof(blob)) {
-				fprintf(stderr, "Failed to read blob section\n");
-				err = -ENXIO;
-				goto err_close;
-			}
+		struct lxl_blob_table table;
+		size_t i;
+
+		err = lxlfw_blob_table_read(lxl, &hdr, &table);
+		if (err) {
+			fprintf(stderr, "Failed to read blob section\n");
+			goto err_free;
+		}
 
-			len = le32_to_cpu(blob.len);
+		for (i = 0; i < table.n; i++) {
+			const struct lxl_blob *blob = table.entries[i].blob;
 
 			printf("\n");
 			printf("Blob\n");
-			printf("Magic:\t\t%s\n", blob.magic);
-			printf("Type:\t\t0x%04x\n", le16_to_cpu(blob.type));
-			printf("Length:\t\t%zu\n", len);
-
-			offset += sizeof(blob) + len;
-			fseek(lxl, len, SEEK_CUR);
+			printf("Magic:\t\t%s\n", blob->magic);
+			printf("Type:\t\t0x%04x\n", le16_to_cpu(blob->type));
+			printf("Length:\t\t%u\n", le32_to_cpu(blob->len));
 		}
 
-		if (offset != le32_to_cpu(hdr.blobs_len)) {
+		if (table.err) {
+			fprintf(stderr, "Failed to read blob section\n");
+			err = table.err;
+		} else if (table.end != table.len) {
 			printf("\n");
-			fprintf(stderr, "Blobs size (0x%zx) doesn't match declared length (0x%x)\n", offset, le32_to_cpu(hdr.blobs_len));
+			fprintf(stderr, "Blobs size (0x%zx) doesn't match declared length (0x%x)\n", table.end, le32_to_cpu(hdr.blobs_len));
 		}
+
+err_free:
+		lxlfw_blob_table_free(&table);
 	}
 
-err_close:
 	fclose(lxl);
 out:
 	return err;
@@ -423,11 +558,12 @@ out:
 /**
  * lxlfw_blob_save - save blob data to external file
  *
- * @lxl: Luxul firmware FILE with position seeked to blob data
- * @len: blob data length
+ * @lxl: Luxul firmware FILE
+ * @entry: the blob's entry in the blob table
  * @path: external file pathname to write
  */
-static int lxlfw_blob_save(FILE *lxl, size_t len, const char *path) {
+static int lxlfw_blob_save(FILE *lxl, const struct lxl_blob_entry *entry, const char *path) {
+	size_t len = le32_to_cpu(entry->blob->len);
 	char buf[256];
 	size_t bytes;
 	FILE *out;
@@ -440,6 +576,16 @@ static int lxlfw_blob_save(FILE *lxl, size_t len, const char *path) {
 		goto err_out;
 	}
 
+	/* Straight from the mapping unless the blob runs past the section */
+	if (entry->complete) {
+		if (fwrite(entry->blob->data, 1, len, out) != len) {
+			fprintf(stderr, "Could not copy %zu bytes from input file\n", len);
+			err = -EIO;
+		}
+		goto err_close_out;
+	}
+
+	fseeko(lxl, entry->offset + sizeof(*entry->blob), SEEK_SET);
 	while (len && (bytes = fread(buf, 1, min(len, sizeof(buf)), lxl)) > 0) {
 		if (fwrite(buf, 1, bytes, out) != bytes) {
 			fprintf(stderr, "Could not copy %zu bytes from input file\n", bytes);
@@ -464,12 +610,12 @@ err_out:
 static int lxlfw_blobs(int argc, char **argv) {
 	char *certificate_path = NULL;
 	char *signature_path = NULL;
+	struct lxl_blob_table table;
 	struct lxl_hdr hdr;
 	uint32_t version;
-	size_t offset;
-	size_t bytes;
 	int err = 0;
 	FILE *lxl;
+	size_t i;
 	int c;
 
 	if (argc < 3) {
@@ -511,43 +657,41 @@ static int lxlfw_blobs(int argc, char **argv) {
 		goto err_close;
 	}
 
-	fseek(lxl, le32_to_cpu(hdr.blobs_offset), SEEK_SET);
-	for (offset = 0; offset < le32_to_cpu(hdr.blobs_len); ) {
-		struct lxl_blob blob;
-		uint16_t type;
-		size_t len;
+	err = lxlfw_blob_table_read(lxl, &hdr, &table);
+	if (err) {
+		fprintf(stderr, "Failed to read blob section\n");
+		goto err_free;
+	}
 
-		bytes = fread(&blob, 1, sizeof(blob), lxl);
-		if (bytes != sizeof(blob)) {
-			fprintf(stderr, "Failed to read blob section\n");
-			err = -ENXIO;
-			goto err_close;
-		}
-		offset += bytes;
+	for (i = 0; i < table.n; i++) {
+		const struct lxl_blob *blob = table.entries[i].blob;
+		uint16_t type;
 
-		if (memcmp(blob.magic, "D#", 2)) {
+		if (memcmp(blob->magic, "D#", 2)) {
 			fprintf(stderr, "Failed to parse blob section\n");
 			err = -ENXIO;
-			goto err_close;
+			goto err_free;
 		}
 
-		type = le16_to_cpu(blob.type);
-		len = le32_to_cpu(blob.len);
+		type = le16_to_cpu(blob->type);
 
 		if (type == LXL_BLOB_CERTIFICATE && certificate_path) {
-			err = lxlfw_blob_save(lxl, len, certificate_path);
+			err = lxlfw_blob_save(lxl, &table.entries[i], certificate_path);
 			certificate_path = NULL;
 		} else if (type == LXL_BLOB_SIGNATURE && signature_path) {
-			err = lxlfw_blob_save(lxl, len, signature_path);
+			err = lxlfw_blob_save(lxl, &table.entries[i], signature_path);
 			signature_path = NULL;
-		} else {
-			fseek(lxl, len, SEEK_CUR);
 		}
 		if (err) {
 			fprintf(stderr, "Failed to save blob section\n");
-			goto err_close;
+			goto err_free;
 		}
-		offset += len;
+	}
+
+	if (table.err) {
+		fprintf(stderr, "Failed to read blob section\n");
+		err = table.err;
+		goto err_free;
 	}
 
 	if (certificate_path) {
@@ -559,6 +703,8 @@ static int lxlfw_blobs(int argc, char **argv) {
 		err = -ENOENT;
 	}
 
+err_free:
+	lxlfw_blob_table_free(&table);
 err_close:
 	fclose(lxl);
 out:
@@ -580,12 +726,16 @@ static int lxlfw_create(int argc, char **argv) {
 	uint32_t hdr_raw_len;	/* Header length without blobs */
 	uint32_t hdr_len;	/* Header length with blobs */
 	uint32_t blobs_len;
-	ssize_t bytes;
+	uint32_t reserve = 0;	/* Room for blobs inserted later */
+	struct fw_trace t;
+	ssize_t bytes = 0;
 	int err = 0;
 	FILE *lxl;
 	FILE *in;
 	int c;
 
+	fw_trace_begin(&t, "lxlfw_create");
+
 	if (argc < 3) {
 		fprintf(stderr, "Missing <file> argument\n");
 		err = -EINVAL;
@@ -593,7 +743,7 @@ static int lxlfw_create(int argc, char **argv) {
 	}
 
 	optind = 3;
-	while ((c = getopt(argc, argv, "i:lb:r:")) != -1) {
+	while ((c = getopt(argc, argv, "i:lb:r:c:s:p:")) != -1) {
 		switch (c) {
 		case 'i':
 			in_path = optarg;
@@ -622,11 +772,15 @@ static int lxlfw_create(int argc, char **argv) {
 			signature_path = optarg;
 			version = max(version, 3);
 			break;
+		case 'p':
+			reserve = strtoul(optarg, NULL, 0);
+			version = max(version, 3);
+			break;
 		}
 	}
 
 	hdr_raw_len = lxlfw_hdr_len(version);
-	hdr_len = hdr_raw_len;
+	hdr_len = hdr_raw_len + reserve;
 
 	if (!in_path) {
 		fprintf(stderr, "Missing input file argument\n");
@@ -691,7 +845,7 @@ static int lxlfw_create(int argc, char **argv) {
 
 	/* Write input data */
 
-	fseek(lxl, 0, SEEK_END);
+	fseek(lxl, hdr_len, SEEK_SET);
 	bytes = lxlfw_copy_data(in, lxl, 0);
 	if (bytes < 0) {
 		fprintf(stderr, "Could not copy %zu bytes from input file\n", bytes);
@@ -704,6 +858,7 @@ err_close_lxl:
 err_close_in:
 	fclose(in);
 out:
+	fw_trace_end(&t, bytes > 0 ? bytes : 0);
 	return err;
 }
 
@@ -711,7 +866,56 @@ out:
  * Insert
  **************************************************/
 
+/**
+ * lxlfw_insert_in_place - write new header and blobs over the old ones
+ *
+ * @path: Luxul firmware file
+ * @hdr: new header
+ * @hdr_raw_len: length of @hdr without blobs
+ * @blobs: new blobs section
+ * @blobs_len: its length
+ * @old_end: where the old blobs section ended
+ *
+ * Only valid if everything fits into the existing header so the image
+ * data after it stays where it is.
+ */
+static int lxlfw_insert_in_place(const char *path, const struct lxl_hdr *hdr, uint32_t hdr_raw_len,
+				 const uint8_t *blobs, uint32_t blobs_len, uint32_t old_end)
+{
+	size_t len = max(hdr_raw_len + blobs_len, old_end);
+	uint8_t *buf;
+	ssize_t bytes;
+	int err = 0;
+	int fd;
+
+	buf = calloc(1, len);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, hdr, hdr_raw_len);
+	memcpy(buf + hdr_raw_len, blobs, blobs_len);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		err = -errno;
+		fprintf(stderr, "Could not open \"%s\" file\n", path);
+		goto out;
+	}
+
+	bytes = pwrite(fd, buf, len, 0);
+	if (bytes != len) {
+		err = -EIO;
+		fprintf(stderr, "Could not write Luxul's header\n");
+	}
+
+	if (close(fd) && !err)
+		err = -errno;
+out:
+	free(buf);
+	return err;
+}
+
 static int lxlfw_insert(int argc, char **argv) {
+	struct lxl_blob_table table = { };
 	struct lxl_hdr hdr = { };
 	char *certificate_path = NULL;
 	char *signature_path = NULL;
@@ -719,11 +923,15 @@ static int lxlfw_insert(int argc, char **argv) {
 	uint32_t version = 0;
 	uint32_t hdr_raw_len;	/* Header length without blobs */
 	uint32_t hdr_len;	/* Header length with blobs */
-	uint32_t blobs_len;
+	uint32_t old_hdr_len;
+	uint32_t old_end;
+	uint8_t *blobs = NULL;
+	size_t blobs_len;
 	ssize_t bytes;
 	char *path;
 	FILE *lxl;
 	FILE *tmp;
+	size_t i;
 	int fd;
 	int c;
 	int err = 0;
@@ -766,107 +974,108 @@ static int lxlfw_insert(int argc, char **argv) {
 		goto err_close_lxl;
 	}
 
+	old_hdr_len = le32_to_cpu(hdr.hdr_len);
+	old_end = lxlfw_hdr_len(version);
+
 	version = max(version, 3);
 
 	hdr_raw_len = lxlfw_hdr_len(version);
-	hdr_len = hdr_raw_len;
 
-	/* Temporary file */
+	/* Collect old blobs, except those that have to be replaced */
 
-	path = strdup(argv[2]);
-	if (!path) {
-		err = -ENOMEM;
-		goto err_close_lxl;
-	}
-	asprintf(&tmp_path, "%s/lxlfwXXXXXX", dirname(path));
-	free(path);
-	if (!tmp_path) {
-		err = -ENOMEM;
-		goto err_close_lxl;
+	err = lxlfw_blob_table_read(lxl, &hdr, &table);
+	if (err || table.err) {
+		fprintf(stderr, "Failed to read blob section\n");
+		err = err ?: table.err;
+		goto err_free_blobs;
 	}
+	if (table.len)
+		old_end = le32_to_cpu(hdr.blobs_offset) + table.len;
 
-	fd = mkstemp(tmp_path);
-	if (fd < 0) {
-		err = -errno;
-		fprintf(stderr, "Failed to open temporary file\n");
-		goto err_free_path;
+	blobs = malloc(table.end ?: 1);
+	if (!blobs) {
+		err = -ENOMEM;
+		goto err_free_blobs;
 	}
-	tmp = fdopen(fd, "w+");
-
-	/* Blobs */
 
-	fseek(tmp, hdr_raw_len, SEEK_SET);
 	blobs_len = 0;
+	for (i = 0; i < table.n; i++) {
+		const struct lxl_blob_entry *entry = &table.entries[i];
+		uint16_t type = le16_to_cpu(entry->blob->type);
 
-	/* Copy old blobs */
-
-	if (hdr.blobs_offset) {
-		size_t offset;
-
-		fseek(lxl, le32_to_cpu(hdr.blobs_offset), SEEK_SET);
-		for (offset = 0; offset < le32_to_cpu(hdr.blobs_len); ) {
-			struct lxl_blob blob;
-			uint16_t type;
-			size_t len;
-
-			bytes = fread(&blob, 1, sizeof(blob), lxl);
-			if (bytes != sizeof(blob)) {
-				fprintf(stderr, "Failed to read blob section\n");
-				err = -ENXIO;
-				goto err_close_tmp;
-			}
-
-			type = le16_to_cpu(blob.type);
-			len = le32_to_cpu(blob.len);
-
-			/* Don't copy blobs that have to be replaced */
-			if ((type == LXL_BLOB_CERTIFICATE && certificate_path) ||
-			    (type == LXL_BLOB_SIGNATURE && signature_path)) {
-				fseek(lxl, len, SEEK_CUR);
-			} else {
-				fseek(lxl, -sizeof(blob), SEEK_CUR);
-				bytes = lxlfw_copy_data(lxl, tmp, sizeof(blob) + len);
-				if (bytes != sizeof(blob) + len) {
-					fprintf(stderr, "Failed to copy original blob\n");
-					err = -EIO;
-					goto err_close_tmp;
-				}
-				blobs_len += sizeof(blob) + len;
-			}
+		if ((type == LXL_BLOB_CERTIFICATE && certificate_path) ||
+		    (type == LXL_BLOB_SIGNATURE && signature_path))
+			continue;
 
-			offset += sizeof(blob) + len;
+		if (!entry->complete) {
+			fprintf(stderr, "Failed to copy original blob\n");
+			err = -EIO;
+			goto err_free_blobs;
 		}
+		memcpy(blobs + blobs_len, entry->blob, entry->size);
+		blobs_len += entry->size;
 	}
 
-	/* Write new blobs */
+	/* New blobs */
 
 	if (certificate_path) {
-		bytes = lxlfw_write_blob(tmp, LXL_BLOB_CERTIFICATE, certificate_path);
+		bytes = lxlfw_blob_append(&blobs, &blobs_len, LXL_BLOB_CERTIFICATE, certificate_path);
 		if (bytes <= 0) {
 			fprintf(stderr, "Failed to write certificate\n");
-			goto err_close_tmp;
+			goto err_free_blobs;
 		}
-		blobs_len += bytes;
 	}
 	if (signature_path) {
-		bytes = lxlfw_write_blob(tmp, LXL_BLOB_SIGNATURE, signature_path);
+		bytes = lxlfw_blob_append(&blobs, &blobs_len, LXL_BLOB_SIGNATURE, signature_path);
 		if (bytes <= 0) {
 			fprintf(stderr, "Failed to write signature\n");
-			goto err_close_tmp;
+			goto err_free_blobs;
 		}
-		blobs_len += bytes;
 	}
 
 	hdr.blobs_offset = cpu_to_le32(hdr_raw_len);
 	hdr.blobs_len = cpu_to_le32(blobs_len);
-	hdr_len += blobs_len;
+	hdr.version = cpu_to_le32(version);
 
-	/* Write header */
+	/* Update just the header if the blobs fit into it */
 
-	hdr.version = cpu_to_le32(version);
+	if (hdr_raw_len + blobs_len <= old_hdr_len) {
+		fclose(lxl);
+		lxlfw_blob_table_free(&table);
+
+		err = lxlfw_insert_in_place(argv[2], &hdr, hdr_raw_len, blobs, blobs_len, old_end);
+		free(blobs);
+
+		return err;
+	}
+
+	hdr_len = hdr_raw_len + blobs_len;
 	hdr.hdr_len = cpu_to_le32(hdr_len);
 
-	fseek(tmp, 0, SEEK_SET);
+	/* Temporary file */
+
+	path = strdup(argv[2]);
+	if (!path) {
+		err = -ENOMEM;
+		goto err_free_blobs;
+	}
+	asprintf(&tmp_path, "%s/lxlfwXXXXXX", dirname(path));
+	free(path);
+	if (!tmp_path) {
+		err = -ENOMEM;
+		goto err_free_blobs;
+	}
+
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		err = -errno;
+		fprintf(stderr, "Failed to open temporary file\n");
+		goto err_free_path;
+	}
+	tmp = fdopen(fd, "w+");
+
+	/* Write header and blobs */
+
 	bytes = fwrite(&hdr, 1, hdr_raw_len, tmp);
 	if (bytes != hdr_raw_len) {
 		fprintf(stderr, "Could not write Luxul's header\n");
@@ -874,9 +1083,16 @@ static int lxlfw_insert(int argc, char **argv) {
 		goto err_close_tmp;
 	}
 
+	bytes = fwrite(blobs, 1, blobs_len, tmp);
+	if (bytes != blobs_len) {
+		fprintf(stderr, "Failed to write blobs\n");
+		err = -EIO;
+		goto err_close_tmp;
+	}
+
 	/* Write original data */
 
-	fseek(tmp, 0, SEEK_END);
+	fseek(lxl, old_hdr_len, SEEK_SET);
 	bytes = lxlfw_copy_data(lxl, tmp, 0);
 	if (bytes < 0) {
 		fprintf(stderr, "Failed to copy original file\n");
@@ -887,6 +1103,8 @@ static int lxlfw_insert(int argc, char **argv) {
 	fclose(tmp);
 
 	fclose(lxl);
+	lxlfw_blob_table_free(&table);
+	free(blobs);
 
 	/* Replace original file */
 
@@ -903,6 +1121,9 @@ err_close_tmp:
 	fclose(tmp);
 err_free_path:
 	free(tmp_path);
+err_free_blobs:
+	free(blobs);
+	lxlfw_blob_table_free(&table);
 err_close_lxl:
 	fclose(lxl);
 out:
@@ -936,9 +1157,11 @@ static void usage() {
 	printf("\t-r release\t\t\trelease number (e.g. 5.1.0, 7.1.0.2)\n");
 	printf("\t-c file\t\t\t\tcertificate file\n");
 	printf("\t-s file\t\t\t\tsignature file\n");
+	printf("\t-p size\t\t\t\treserve header space for blobs inserted later\n");
 	printf("\n");
 	printf("Insert blob to Luxul firmware:\n");
 	printf("\tlxlfw insert <file> [options]\n");
+	printf("\t\t\t\t\tupdates the header in place if the blobs fit into it\n");
 	printf("\t-c file\t\t\t\tcertificate file\n");
 	printf("\t-s file\t\t\t\tsignature file\n");
 
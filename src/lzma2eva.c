@@ -7,7 +7,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <zlib.h> /* crc32 */
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fw_crc32.h"
+#include "fw_io.h"
 
 #define checksum_add32(csum, data) \
   csum += ((uint8_t *)&data)[0]; \
@@ -15,10 +19,17 @@
   csum += ((uint8_t *)&data)[2]; \
   csum += ((uint8_t *)&data)[3];
 
+/* LZMA alone header: properties, dictionary size, uncompressed size */
+#define LZMA_HDR_LEN 13
+
+/* Checksummed in blocks that stay in cache for the second loop */
+#define SUM_BLOCK (64 * 1024)
+
 void
 usage(void)
 {
-  fprintf(stderr, "usage: lzma2eva <loadadddr> <entry> <lzmafile> <evafile>\n");
+  fprintf(stderr, "usage: lzma2eva <loadadddr> <entry> <lzmafile> <evafile>\n"
+                  "  '-' reads the lzmafile from stdin or writes the evafile to stdout\n");
   exit(1);
 }
 
@@ -29,14 +40,55 @@ pexit(const char *msg)
   exit(1);
 }
 
+/*
+ * Return the whole input, mapped when it is a regular file and read into
+ * memory otherwise, so compsize is known before the header goes out.
+ */
+static const uint8_t *
+read_input(FILE *in, struct fw_io_map *map, uint8_t **buf, size_t *len)
+{
+  struct stat st;
+  size_t alloc = 0, elems;
+
+  if (!fstat(fileno(in), &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      !fw_io_map(map, fileno(in), 0, st.st_size)) {
+    *len = map->len;
+    return map->data;
+  }
+
+  *buf = NULL;
+  *len = 0;
+  for (;;) {
+    if (*len == alloc) {
+      uint8_t *p;
+
+      alloc = alloc ? alloc * 2 : 1024 * 1024;
+      p = realloc(*buf, alloc);
+      if (!p)
+        pexit("realloc");
+      *buf = p;
+    }
+    elems = fread(*buf + *len, 1, alloc - *len, in);
+    if (!elems)
+      break;
+    *len += elems;
+  }
+  if (ferror(in))
+    pexit("fread");
+
+  return *buf;
+}
+
 int
 main(int argc, char *argv[])
 {
 
   const char *infile, *outfile;
   FILE *in, *out;
-  static uint8_t buf[4096];
-  size_t elems;
+  struct fw_io_map map = {};
+  uint8_t *inbuf = NULL;
+  const uint8_t *data;
+  size_t len, off;
 
   uint8_t properties;
   uint32_t dictsize;
@@ -44,15 +96,14 @@ main(int argc, char *argv[])
 
   uint32_t magic = 0xfeed1281L;
   uint32_t reclength = 0;
-  fpos_t reclengthpos;
   uint32_t loadaddress = 0;
   uint32_t type = 0x075a0201L; /* might be 7Z 2.1? */
   uint32_t checksum = 0;
 
   uint32_t compsize = 0;
-  fpos_t compsizepos;
   uint32_t datasize32 = 0;
-  uint32_t datacrc32 = crc32(0, 0, 0);
+  uint32_t datacrc32 = 0xffffffff;
+  uint32_t datasum = 0;
 
   uint32_t zero = 0;
   uint32_t entry = 0;
@@ -66,26 +117,54 @@ main(int argc, char *argv[])
   infile = argv[3];
   outfile = argv[4];
 
-  in = fopen(infile, "rb");
+  in = strcmp(infile, "-") ? fopen(infile, "rb") : stdin;
   if (!in)
     pexit("fopen");
-  out = fopen(outfile, "w+b");
+  out = strcmp(outfile, "-") ? fopen(outfile, "wb") : stdout;
   if (!out)
     pexit("fopen");
 
-  /* read LZMA header */
-  if (1 != fread(&properties, sizeof properties, 1, in))
-    pexit("fread");
-  if (1 != fread(&dictsize, sizeof dictsize, 1, in))
-    pexit("fread");
-  if (1 != fread(&datasize, sizeof datasize, 1, in))
+  /* read LZMA header, the size of the rest follows from the input size */
+  data = read_input(in, &map, &inbuf, &len);
+  if (len < LZMA_HDR_LEN)
     pexit("fread");
+  memcpy(&properties, data, sizeof properties);
+  memcpy(&dictsize, data + 1, sizeof dictsize);
+  memcpy(&datasize, data + 5, sizeof datasize);
+  data += LZMA_HDR_LEN;
+  /* XXX check length */
+  compsize = len - LZMA_HDR_LEN;
+  datasize32 = (uint32_t)datasize;
+  reclength = compsize + 24;
+
+  /* modified LZMA header is part of the record checksum */
+  datasum += properties;
+  checksum_add32(datasum, dictsize);
+
+  /* one pass over the compressed data for both crc32 and byte sum */
+  for (off = 0; off < compsize; off += SUM_BLOCK) {
+    size_t n = compsize - off < SUM_BLOCK ? compsize - off : SUM_BLOCK;
+    size_t i;
+
+    datacrc32 = fw_crc32(datacrc32, data + off, n);
+    for (i = 0; i < n; ++i)
+      datasum += data[off + i];
+  }
+  datacrc32 = ~datacrc32;
+
+  /* calculate record checksum */
+  checksum += reclength;
+  checksum += loadaddress;
+  checksum_add32(checksum, type);
+  checksum_add32(checksum, compsize);
+  checksum_add32(checksum, datasize32);
+  checksum_add32(checksum, datacrc32);
+  checksum += datasum;
+  checksum = ~checksum + 1;
 
   /* write EVA header */
   if (1 != fwrite(&magic, sizeof magic, 1, out))
     pexit("fwrite");
-  if (fgetpos(out, &reclengthpos))
-    pexit("fgetpos");
   if (1 != fwrite(&reclength, sizeof reclength, 1, out))
     pexit("fwrite");
   if (1 != fwrite(&loadaddress, sizeof loadaddress, 1, out))
@@ -94,12 +173,8 @@ main(int argc, char *argv[])
     pexit("fwrite");
 
   /* write EVA LZMA header */
-  if (fgetpos(out, &compsizepos))
-    pexit("fgetpos");
   if (1 != fwrite(&compsize, sizeof compsize, 1, out))
     pexit("fwrite");
-  /* XXX check length */
-  datasize32 = (uint32_t)datasize;
   if (1 != fwrite(&datasize32, sizeof datasize32, 1, out))
     pexit("fwrite");
   if (1 != fwrite(&datacrc32, sizeof datacrc32, 1, out))
@@ -113,54 +188,14 @@ main(int argc, char *argv[])
   if (1 != fwrite(&zero, 3, 1, out))
     pexit("fwrite");
 
-  /* copy compressed data, calculate crc32 */
-  while (0 < (elems = fread(&buf, sizeof buf[0], sizeof buf, in))) {
-    compsize += elems;
-    if (elems != fwrite(&buf, sizeof buf[0], elems, out))
-      pexit("fwrite");
-    datacrc32 = crc32(datacrc32, buf, elems);
-  }
-  if (ferror(in))
-    pexit("fread");
-  fclose(in);
-
-  /* re-write record length */
-  reclength = compsize + 24;
-  if (fsetpos(out, &reclengthpos))
-    pexit("fsetpos");
-  if (1 != fwrite(&reclength, sizeof reclength, 1, out))
-    pexit("fwrite");
-
-  /* re-write EVA LZMA header including size and data crc */
-  if (fsetpos(out, &compsizepos))
-    pexit("fsetpos");
-  if (1 != fwrite(&compsize, sizeof compsize, 1, out))
-    pexit("fwrite");
-  if (1 != fwrite(&datasize32, sizeof datasize32, 1, out))
-    pexit("fwrite");
-  if (1 != fwrite(&datacrc32, sizeof datacrc32, 1, out))
+  /* copy compressed data */
+  if (compsize != fwrite(data, 1, compsize, out))
     pexit("fwrite");
 
-  /* calculate record checksum */
-  checksum += reclength;
-  checksum += loadaddress;
-  checksum_add32(checksum, type);
-  checksum_add32(checksum, compsize);
-  checksum_add32(checksum, datasize32);
-  checksum_add32(checksum, datacrc32);
-  if (fseek(out, 0, SEEK_CUR))
-    pexit("fseek");
-  while (0 < (elems = fread(&buf, sizeof buf[0], sizeof buf, out))) {
-    size_t i;
-    for (i = 0; i < elems; ++i)
-      checksum += buf[i];
-  }
-  if (ferror(out))
-    pexit("fread");
-  if (fseek(out, 0, SEEK_CUR))
-    pexit("fseek");
+  fw_io_unmap(&map);
+  free(inbuf);
+  fclose(in);
 
-  checksum = ~checksum + 1;
   if (1 != fwrite(&checksum, sizeof checksum, 1, out))
     pexit("fwrite");
 
@@ -11,6 +11,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "fw_io.h"
+#include "fw_sum.h"
+
 
 /* defaults: Level One WAP-0007 */
 static char *ascii1 = "DDC_RUS001";
@@ -107,25 +110,22 @@ a76e cec8
 4e..4f inverted checksum of header
 */
 
+unsigned short checksum_final(const struct fw_sum *sum)
+{
+	return fw_sum16_fold(fw_sum16_le_final(sum));
+}
+
 unsigned short checksum(unsigned char *data, long size)
 {
-	long n;
-	unsigned short d, cs = 0;
-	for (n = 0; n < size; n += 2)
-	{
-		d = READ_SHORT(data, n);
-		cs += d;
-		if (cs < d)
-			cs++;
-	}
-	if (size & 1)
-	{
-		d = data[n];
-		cs += d;
-		if (cs < d)
-			cs++;
-	}
-	return cs;
+	struct fw_sum sum;
+	fw_sum_init(&sum);
+	fw_sum16_le_update(&sum, data, size);
+	return checksum_final(&sum);
+}
+
+void checksum_sink(void *priv, const void *buf, size_t len)
+{
+	fw_sum16_le_update(priv, buf, len);
 }
 
 void showhdr(unsigned char *hdr)
@@ -148,7 +148,7 @@ void showhdr(unsigned char *hdr)
 }
 
 void makehdr(unsigned char *hdr, struct hdrinfo *info,
-             unsigned char *data, long size, int last)
+             unsigned short csum, long size, int last)
 {
 	unsigned int offset = info->addr + 0x10;
 	memset(hdr, 0, HDRSIZE);
@@ -165,42 +165,10 @@ void makehdr(unsigned char *hdr, struct hdrinfo *info,
 	COPY_LONG(hdr, 0x44, last ? 0x01050050 : 0x01000050);
 	COPY_LONG(hdr, 0x48, info->addr);
 	COPY_SHORT(hdr, 0x4c, info->unknown == 0xcb5f06b5 ? 0x0016 : 0x000b);
-	COPY_SHORT(hdr, 0x0e, checksum(data, size));
+	COPY_SHORT(hdr, 0x0e, csum);
 	COPY_SHORT(hdr, 0x4e, ~checksum(hdr, HDRSIZE));
 }
 
-unsigned char *read_file(const char *name, long *size)
-{
-	FILE *f;
-	unsigned char *data = NULL;
-	*size = 0;
-	f = fopen(name, "r");
-	if (f != NULL)
-	{
-		if (fseek(f, 0, SEEK_END) == 0)
-		{
-	    *size = ftell(f);
-			if (*size != -1)
-			{
-				if (fseek(f, 0, SEEK_SET) == 0)
-				{
-					data = (unsigned char *)malloc(*size);
-					if (data != NULL)
-					{
-						if (fread(data, sizeof(char), *size, f) != *size)
-						{
-							free(data);
-							data = NULL;
-						}
-					}
-				}
-			}
-		}
-		fclose(f);
-	}
-	return data;
-}
-
 struct hdrinfo *find_hdrinfo(const char *name)
 {
 	int n;
@@ -247,8 +215,9 @@ void show_fwids(void)
 int main(int argc, char *argv[])
 {
 	unsigned char hdr[HDRSIZE];
-	unsigned char *data;
-	FILE *of;
+	struct fw_sum sum;
+	FILE *of, *in;
+	long hdrpos;
 	char *outfile = NULL;
 	char *type;
 	struct hdrinfo *info;
@@ -282,16 +251,25 @@ int main(int argc, char *argv[])
 			info = find_hdrinfo(type);
 			if (info == NULL)
 				showhelp();
-			data = read_file(argv[n], &size);
-			if (data == NULL)
+			in = fopen(argv[n], "r");
+			if (in == NULL)
 				showhelp();
-			makehdr(hdr, info, data, size, last);
-			/* showhdr(hdr); */
-			if (fwrite(hdr, HDRSIZE, 1, of) != 1)
+			/* stream the payload behind a placeholder header, then fill it in */
+			hdrpos = ftell(of);
+			memset(hdr, 0, HDRSIZE);
+			if (hdrpos == -1 || fwrite(hdr, HDRSIZE, 1, of) != 1)
 				oferror(of);
-			if (fwrite(data, size, 1, of) != 1)
+			fw_sum_init(&sum);
+			size = fw_io_copy(of, in, FW_IO_ALL, checksum_sink, &sum);
+			if (size < 0)
+				oferror(of);
+			fclose(in);
+			makehdr(hdr, info, checksum_final(&sum), size, last);
+			/* showhdr(hdr); */
+			if (fseek(of, hdrpos, SEEK_SET) != 0 ||
+			    fwrite(hdr, HDRSIZE, 1, of) != 1 ||
+			    fseek(of, 0, SEEK_END) != 0)
 				oferror(of);
-			free(data);
 		}
 		else
 			n++;
@@ -39,6 +39,8 @@
 
 #include <string.h>
 
+#include "fw_cpu.h"
+#include "fw_stats.h"
 #include "md5.h"
 
 /*
@@ -86,6 +88,83 @@
 	(ctx->block[(n)])
 #endif
 
+/*
+ * All 64 steps of one block. W1(n) fetches message word n the first time it
+ * is used (round 1), W(n) on every later use.
+ */
+#define MD5_ROUNDS(a, b, c, d, W1, W) \
+	/* Round 1 */ \
+	STEP(F, a, b, c, d, W1(0), 0xd76aa478, 7) \
+	STEP(F, d, a, b, c, W1(1), 0xe8c7b756, 12) \
+	STEP(F, c, d, a, b, W1(2), 0x242070db, 17) \
+	STEP(F, b, c, d, a, W1(3), 0xc1bdceee, 22) \
+	STEP(F, a, b, c, d, W1(4), 0xf57c0faf, 7) \
+	STEP(F, d, a, b, c, W1(5), 0x4787c62a, 12) \
+	STEP(F, c, d, a, b, W1(6), 0xa8304613, 17) \
+	STEP(F, b, c, d, a, W1(7), 0xfd469501, 22) \
+	STEP(F, a, b, c, d, W1(8), 0x698098d8, 7) \
+	STEP(F, d, a, b, c, W1(9), 0x8b44f7af, 12) \
+	STEP(F, c, d, a, b, W1(10), 0xffff5bb1, 17) \
+	STEP(F, b, c, d, a, W1(11), 0x895cd7be, 22) \
+	STEP(F, a, b, c, d, W1(12), 0x6b901122, 7) \
+	STEP(F, d, a, b, c, W1(13), 0xfd987193, 12) \
+	STEP(F, c, d, a, b, W1(14), 0xa679438e, 17) \
+	STEP(F, b, c, d, a, W1(15), 0x49b40821, 22) \
+	\
+	/* Round 2 */ \
+	STEP(G, a, b, c, d, W(1), 0xf61e2562, 5) \
+	STEP(G, d, a, b, c, W(6), 0xc040b340, 9) \
+	STEP(G, c, d, a, b, W(11), 0x265e5a51, 14) \
+	STEP(G, b, c, d, a, W(0), 0xe9b6c7aa, 20) \
+	STEP(G, a, b, c, d, W(5), 0xd62f105d, 5) \
+	STEP(G, d, a, b, c, W(10), 0x02441453, 9) \
+	STEP(G, c, d, a, b, W(15), 0xd8a1e681, 14) \
+	STEP(G, b, c, d, a, W(4), 0xe7d3fbc8, 20) \
+	STEP(G, a, b, c, d, W(9), 0x21e1cde6, 5) \
+	STEP(G, d, a, b, c, W(14), 0xc33707d6, 9) \
+	STEP(G, c, d, a, b, W(3), 0xf4d50d87, 14) \
+	STEP(G, b, c, d, a, W(8), 0x455a14ed, 20) \
+	STEP(G, a, b, c, d, W(13), 0xa9e3e905, 5) \
+	STEP(G, d, a, b, c, W(2), 0xfcefa3f8, 9) \
+	STEP(G, c, d, a, b, W(7), 0x676f02d9, 14) \
+	STEP(G, b, c, d, a, W(12), 0x8d2a4c8a, 20) \
+	\
+	/* Round 3 */ \
+	STEP(H, a, b, c, d, W(5), 0xfffa3942, 4) \
+	STEP(H2, d, a, b, c, W(8), 0x8771f681, 11) \
+	STEP(H, c, d, a, b, W(11), 0x6d9d6122, 16) \
+	STEP(H2, b, c, d, a, W(14), 0xfde5380c, 23) \
+	STEP(H, a, b, c, d, W(1), 0xa4beea44, 4) \
+	STEP(H2, d, a, b, c, W(4), 0x4bdecfa9, 11) \
+	STEP(H, c, d, a, b, W(7), 0xf6bb4b60, 16) \
+	STEP(H2, b, c, d, a, W(10), 0xbebfbc70, 23) \
+	STEP(H, a, b, c, d, W(13), 0x289b7ec6, 4) \
+	STEP(H2, d, a, b, c, W(0), 0xeaa127fa, 11) \
+	STEP(H, c, d, a, b, W(3), 0xd4ef3085, 16) \
+	STEP(H2, b, c, d, a, W(6), 0x04881d05, 23) \
+	STEP(H, a, b, c, d, W(9), 0xd9d4d039, 4) \
+	STEP(H2, d, a, b, c, W(12), 0xe6db99e5, 11) \
+	STEP(H, c, d, a, b, W(15), 0x1fa27cf8, 16) \
+	STEP(H2, b, c, d, a, W(2), 0xc4ac5665, 23) \
+	\
+	/* Round 4 */ \
+	STEP(I, a, b, c, d, W(0), 0xf4292244, 6) \
+	STEP(I, d, a, b, c, W(7), 0x432aff97, 10) \
+	STEP(I, c, d, a, b, W(14), 0xab9423a7, 15) \
+	STEP(I, b, c, d, a, W(5), 0xfc93a039, 21) \
+	STEP(I, a, b, c, d, W(12), 0x655b59c3, 6) \
+	STEP(I, d, a, b, c, W(3), 0x8f0ccc92, 10) \
+	STEP(I, c, d, a, b, W(10), 0xffeff47d, 15) \
+	STEP(I, b, c, d, a, W(1), 0x85845dd1, 21) \
+	STEP(I, a, b, c, d, W(8), 0x6fa87e4f, 6) \
+	STEP(I, d, a, b, c, W(15), 0xfe2ce6e0, 10) \
+	STEP(I, c, d, a, b, W(6), 0xa3014314, 15) \
+	STEP(I, b, c, d, a, W(13), 0x4e0811a1, 21) \
+	STEP(I, a, b, c, d, W(4), 0xf7537e82, 6) \
+	STEP(I, d, a, b, c, W(11), 0xbd3af235, 10) \
+	STEP(I, c, d, a, b, W(2), 0x2ad7d2bb, 15) \
+	STEP(I, b, c, d, a, W(9), 0xeb86d391, 21)
+
 /*
  * This processes one or more 64-byte data blocks, but does NOT update
  * the bit counters.  There are no alignment requirements.
@@ -109,77 +188,7 @@ static const void *body(MD5_CTX *ctx, const void *data, unsigned long size)
 		saved_c = c;
 		saved_d = d;
 
-/* Round 1 */
-		STEP(F, a, b, c, d, SET(0), 0xd76aa478, 7)
-		STEP(F, d, a, b, c, SET(1), 0xe8c7b756, 12)
-		STEP(F, c, d, a, b, SET(2), 0x242070db, 17)
-		STEP(F, b, c, d, a, SET(3), 0xc1bdceee, 22)
-		STEP(F, a, b, c, d, SET(4), 0xf57c0faf, 7)
-		STEP(F, d, a, b, c, SET(5), 0x4787c62a, 12)
-		STEP(F, c, d, a, b, SET(6), 0xa8304613, 17)
-		STEP(F, b, c, d, a, SET(7), 0xfd469501, 22)
-		STEP(F, a, b, c, d, SET(8), 0x698098d8, 7)
-		STEP(F, d, a, b, c, SET(9), 0x8b44f7af, 12)
-		STEP(F, c, d, a, b, SET(10), 0xffff5bb1, 17)
-		STEP(F, b, c, d, a, SET(11), 0x895cd7be, 22)
-		STEP(F, a, b, c, d, SET(12), 0x6b901122, 7)
-		STEP(F, d, a, b, c, SET(13), 0xfd987193, 12)
-		STEP(F, c, d, a, b, SET(14), 0xa679438e, 17)
-		STEP(F, b, c, d, a, SET(15), 0x49b40821, 22)
-
-/* Round 2 */
-		STEP(G, a, b, c, d, GET(1), 0xf61e2562, 5)
-		STEP(G, d, a, b, c, GET(6), 0xc040b340, 9)
-		STEP(G, c, d, a, b, GET(11), 0x265e5a51, 14)
-		STEP(G, b, c, d, a, GET(0), 0xe9b6c7aa, 20)
-		STEP(G, a, b, c, d, GET(5), 0xd62f105d, 5)
-		STEP(G, d, a, b, c, GET(10), 0x02441453, 9)
-		STEP(G, c, d, a, b, GET(15), 0xd8a1e681, 14)
-		STEP(G, b, c, d, a, GET(4), 0xe7d3fbc8, 20)
-		STEP(G, a, b, c, d, GET(9), 0x21e1cde6, 5)
-		STEP(G, d, a, b, c, GET(14), 0xc33707d6, 9)
-		STEP(G, c, d, a, b, GET(3), 0xf4d50d87, 14)
-		STEP(G, b, c, d, a, GET(8), 0x455a14ed, 20)
-		STEP(G, a, b, c, d, GET(13), 0xa9e3e905, 5)
-		STEP(G, d, a, b, c, GET(2), 0xfcefa3f8, 9)
-		STEP(G, c, d, a, b, GET(7), 0x676f02d9, 14)
-		STEP(G, b, c, d, a, GET(12), 0x8d2a4c8a, 20)
-
-/* Round 3 */
-		STEP(H, a, b, c, d, GET(5), 0xfffa3942, 4)
-		STEP(H2, d, a, b, c, GET(8), 0x8771f681, 11)
-		STEP(H, c, d, a, b, GET(11), 0x6d9d6122, 16)
-		STEP(H2, b, c, d, a, GET(14), 0xfde5380c, 23)
-		STEP(H, a, b, c, d, GET(1), 0xa4beea44, 4)
-		STEP(H2, d, a, b, c, GET(4), 0x4bdecfa9, 11)
-		STEP(H, c, d, a, b, GET(7), 0xf6bb4b60, 16)
-		STEP(H2, b, c, d, a, GET(10), 0xbebfbc70, 23)
-		STEP(H, a, b, c, d, GET(13), 0x289b7ec6, 4)
-		STEP(H2, d, a, b, c, GET(0), 0xeaa127fa, 11)
-		STEP(H, c, d, a, b, GET(3), 0xd4ef3085, 16)
-		STEP(H2, b, c, d, a, GET(6), 0x04881d05, 23)
-		STEP(H, a, b, c, d, GET(9), 0xd9d4d039, 4)
-		STEP(H2, d, a, b, c, GET(12), 0xe6db99e5, 11)
-		STEP(H, c, d, a, b, GET(15), 0x1fa27cf8, 16)
-		STEP(H2, b, c, d, a, GET(2), 0xc4ac5665, 23)
-
-/* Round 4 */
-		STEP(I, a, b, c, d, GET(0), 0xf4292244, 6)
-		STEP(I, d, a, b, c, GET(7), 0x432aff97, 10)
-		STEP(I, c, d, a, b, GET(14), 0xab9423a7, 15)
-		STEP(I, b, c, d, a, GET(5), 0xfc93a039, 21)
-		STEP(I, a, b, c, d, GET(12), 0x655b59c3, 6)
-		STEP(I, d, a, b, c, GET(3), 0x8f0ccc92, 10)
-		STEP(I, c, d, a, b, GET(10), 0xffeff47d, 15)
-		STEP(I, b, c, d, a, GET(1), 0x85845dd1, 21)
-		STEP(I, a, b, c, d, GET(8), 0x6fa87e4f, 6)
-		STEP(I, d, a, b, c, GET(15), 0xfe2ce6e0, 10)
-		STEP(I, c, d, a, b, GET(6), 0xa3014314, 15)
-		STEP(I, b, c, d, a, GET(13), 0x4e0811a1, 21)
-		STEP(I, a, b, c, d, GET(4), 0xf7537e82, 6)
-		STEP(I, d, a, b, c, GET(11), 0xbd3af235, 10)
-		STEP(I, c, d, a, b, GET(2), 0x2ad7d2bb, 15)
-		STEP(I, b, c, d, a, GET(9), 0xeb86d391, 21)
+		MD5_ROUNDS(a, b, c, d, SET, GET)
 
 		a += saved_a;
 		b += saved_b;
@@ -208,7 +217,7 @@ void MD5_Init(MD5_CTX *ctx)
 	ctx->hi = 0;
 }
 
-void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size)
+static void md5_update(MD5_CTX *ctx, const void *data, unsigned long size)
 {
 	MD5_u32plus saved_lo;
 	unsigned long used, available;
@@ -242,6 +251,26 @@ void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size)
 	memcpy(ctx->buffer, data, size);
 }
 
+void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size)
+{
+	uint64_t start;
+
+	if (!fw_stats_on) {
+		md5_update(ctx, data, size);
+		return;
+	}
+
+	start = fw_stats_now();
+	md5_update(ctx, data, size);
+	fw_stats_kernel(FW_STATS_MD5, start, size);
+}
+
+__attribute__((constructor))
+static void md5_stats_init(void)
+{
+	fw_stats_impl(FW_STATS_MD5, "generic");
+}
+
 void MD5_Final(unsigned char *result, MD5_CTX *ctx)
 {
 	unsigned long used, available;
@@ -293,4 +322,236 @@ void MD5_Final(unsigned char *result, MD5_CTX *ctx)
 	memset(ctx, 0, sizeof(*ctx));
 }
 
+/*
+ * Multi-buffer mode: up to MD5_MB_LANES independent messages are run through
+ * the compression function side by side, one message per vector lane. Lanes
+ * advance in lockstep over the blocks they all have; whatever is left of
+ * each message is finished by the scalar code above.
+ */
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__aarch64__)
+#define MD5_MB_SIMD
+#endif
+
+#define MD5_MB_LANES			8
+
+#ifdef MD5_MB_SIMD
+
+typedef MD5_u32plus md5_v4 __attribute__((vector_size(16)));
+typedef MD5_u32plus md5_v8 __attribute__((vector_size(32)));
+
+#define LE32(p) \
+	((MD5_u32plus)(p)[0] | ((MD5_u32plus)(p)[1] << 8) | \
+	((MD5_u32plus)(p)[2] << 16) | ((MD5_u32plus)(p)[3] << 24))
+
+#define MB_W(n)				(w[(n)])
+
+#define MD5_MB_BLOCKS(name, vtype, lanes, attr) \
+attr static void name(MD5_u32plus state[4][MD5_MB_LANES], \
+		      const unsigned char **ptr, unsigned long nblocks) \
+{ \
+	vtype a, b, c, d, saved_a, saved_b, saved_c, saved_d, w[16]; \
+	unsigned long off; \
+	int i, l; \
+\
+	for (l = 0; l < lanes; l++) { \
+		a[l] = state[0][l]; \
+		b[l] = state[1][l]; \
+		c[l] = state[2][l]; \
+		d[l] = state[3][l]; \
+	} \
+\
+	for (off = 0; nblocks--; off += 64) { \
+		for (i = 0; i < 16; i++) \
+			for (l = 0; l < lanes; l++) \
+				w[i][l] = LE32(ptr[l] + off + i * 4); \
+\
+		saved_a = a; \
+		saved_b = b; \
+		saved_c = c; \
+		saved_d = d; \
+\
+		MD5_ROUNDS(a, b, c, d, MB_W, MB_W) \
+\
+		a += saved_a; \
+		b += saved_b; \
+		c += saved_c; \
+		d += saved_d; \
+	} \
+\
+	for (l = 0; l < lanes; l++) { \
+		state[0][l] = a[l]; \
+		state[1][l] = b[l]; \
+		state[2][l] = c[l]; \
+		state[3][l] = d[l]; \
+	} \
+}
+
+MD5_MB_BLOCKS(md5_mb_blocks_x4, md5_v4, 4, )
+#if defined(__x86_64__) || defined(__i386__)
+MD5_MB_BLOCKS(md5_mb_blocks_x8, md5_v8, 8, __attribute__((target("avx2"))))
 #endif
+
+static void (*md5_mb_blocks)(MD5_u32plus state[4][MD5_MB_LANES],
+			     const unsigned char **ptr,
+			     unsigned long nblocks) = md5_mb_blocks_x4;
+static int md5_mb_lanes = 4;
+
+__attribute__((constructor))
+static void md5_mb_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (fw_cpu_has(FW_CPU_AVX2)) {
+		md5_mb_blocks = md5_mb_blocks_x8;
+		md5_mb_lanes = 8;
+	}
+#endif
+
+	fw_stats_impl(FW_STATS_MD5_MULTI, md5_mb_lanes == 8 ? "avx2-x8" : "simd-x4");
+}
+
+static void md5_mb_group(MD5_CTX *const *ctx, const void *const *data,
+			 const unsigned long *size, unsigned int n)
+{
+	MD5_u32plus state[4][MD5_MB_LANES];
+	const unsigned char *ptr[MD5_MB_LANES];
+	unsigned long left[MD5_MB_LANES];
+	unsigned long nblocks = ~0UL, done, used, head;
+	MD5_u32plus saved_lo;
+	unsigned int l;
+
+	for (l = 0; l < n; l++) {
+		ptr[l] = data[l];
+		left[l] = size[l];
+
+		/* Top up a partially filled block so the lane starts aligned */
+		used = ctx[l]->lo & 0x3f;
+		if (used) {
+			head = 64 - used;
+			if (head > left[l])
+				head = left[l];
+			md5_update(ctx[l], ptr[l], head);
+			ptr[l] += head;
+			left[l] -= head;
+		}
+
+		state[0][l] = ctx[l]->a;
+		state[1][l] = ctx[l]->b;
+		state[2][l] = ctx[l]->c;
+		state[3][l] = ctx[l]->d;
+		if (left[l] / 64 < nblocks)
+			nblocks = left[l] / 64;
+	}
+
+	/* Idle lanes hash a copy of lane 0 and are thrown away */
+	for (; l < (unsigned int)md5_mb_lanes; l++) {
+		ptr[l] = ptr[0];
+		state[0][l] = state[0][0];
+		state[1][l] = state[1][0];
+		state[2][l] = state[2][0];
+		state[3][l] = state[3][0];
+	}
+
+	if (nblocks)
+		md5_mb_blocks(state, ptr, nblocks);
+	done = nblocks * 64;
+
+	for (l = 0; l < n; l++) {
+		ctx[l]->a = state[0][l];
+		ctx[l]->b = state[1][l];
+		ctx[l]->c = state[2][l];
+		ctx[l]->d = state[3][l];
+
+		saved_lo = ctx[l]->lo;
+		if ((ctx[l]->lo = (saved_lo + done) & 0x1fffffff) < saved_lo)
+			ctx[l]->hi++;
+		ctx[l]->hi += done >> 29;
+
+		md5_update(ctx[l], ptr[l] + done, left[l] - done);
+	}
+}
+
+void MD5_Multi_Update(MD5_CTX *const *ctx, const void *const *data,
+		      const unsigned long *size, unsigned int n)
+{
+	unsigned long total = 0;
+	unsigned int i, cnt;
+	uint64_t start = 0;
+
+	if (n == 1) {
+		MD5_Update(ctx[0], data[0], size[0]);
+		return;
+	}
+
+	if (fw_stats_on)
+		start = fw_stats_now();
+
+	for (i = 0; i < n; i += cnt) {
+		cnt = n - i;
+		if (cnt > (unsigned int)md5_mb_lanes)
+			cnt = md5_mb_lanes;
+		md5_mb_group(&ctx[i], &data[i], &size[i], cnt);
+	}
+
+	if (fw_stats_on) {
+		for (i = 0; i < n; i++)
+			total += size[i];
+		fw_stats_kernel(FW_STATS_MD5_MULTI, start, total);
+	}
+}
+
+#else /* !MD5_MB_SIMD */
+
+void MD5_Multi_Update(MD5_CTX *const *ctx, const void *const *data,
+		      const unsigned long *size, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		MD5_Update(ctx[i], data[i], size[i]);
+}
+
+#endif /* MD5_MB_SIMD */
+
+#else /* HAVE_OPENSSL */
+
+#include <string.h>
+
+#include "md5.h"
+
+void MD5_Multi_Update(MD5_CTX *const *ctx, const void *const *data,
+		      const unsigned long *size, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		MD5_Update(ctx[i], data[i], size[i]);
+}
+
+#endif
+
+void MD5_Clone(MD5_CTX *dst, const MD5_CTX *src)
+{
+	memcpy(dst, src, sizeof(*dst));
+}
+
+#define MD5_MULTI_GROUP			8
+
+void MD5_Multi(unsigned char (*results)[16], const void *const *data,
+	       const unsigned long *size, unsigned int n)
+{
+	MD5_CTX ctx[MD5_MULTI_GROUP], *pctx[MD5_MULTI_GROUP];
+	unsigned int i, l, cnt;
+
+	for (i = 0; i < n; i += cnt) {
+		cnt = n - i;
+		if (cnt > MD5_MULTI_GROUP)
+			cnt = MD5_MULTI_GROUP;
+		for (l = 0; l < cnt; l++) {
+			MD5_Init(&ctx[l]);
+			pctx[l] = &ctx[l];
+		}
+		MD5_Multi_Update(pctx, &data[i], &size[i], cnt);
+		for (l = 0; l < cnt; l++)
+			MD5_Final(results[i + l], &ctx[l]);
+	}
+}
@@ -43,3 +43,29 @@ extern void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size);
 extern void MD5_Final(unsigned char *result, MD5_CTX *ctx);
 
 #endif
+
+#ifndef _MD5_MULTI_H
+#define _MD5_MULTI_H
+
+/*
+ * Hash n independent messages: results[i] = MD5(data[i], size[i]). Messages
+ * are processed several at a time in SIMD lanes where the CPU allows, which
+ * is fastest when they are of similar length.
+ */
+extern void MD5_Multi(unsigned char (*results)[16], const void *const *data,
+		      const unsigned long *size, unsigned int n);
+
+/*
+ * Streaming form of MD5_Multi(): feed data[i] (size[i] bytes) into ctx[i],
+ * which may already hold a partial block. Contexts must be distinct.
+ */
+extern void MD5_Multi_Update(MD5_CTX *const *ctx, const void *const *data,
+			     const unsigned long *size, unsigned int n);
+
+/*
+ * Copy a context part way through a message: a prefix that several
+ * messages share is hashed once, each is finished from its own copy.
+ */
+extern void MD5_Clone(MD5_CTX *dst, const MD5_CTX *src);
+
+#endif
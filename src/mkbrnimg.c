@@ -11,11 +11,13 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <sys/mman.h>
 #include <string.h>
 #include <netinet/in.h>
 #include <inttypes.h>
 
+#include "fw_crc32.h"
+#include "fw_io.h"
+
 #define BPB 8 /* bits/byte */
 
 static uint32_t crc32[1<<BPB];
@@ -25,6 +27,12 @@ static uint32_t magic = 0x12345678;
 static char *signature = "BRNDTW502";
 static uint32_t crc32_poly = 0x2083b8ed;
 
+/* The default polynomial, byte swapped, is the one fw_crc32() uses */
+static int crc32_poly_is_std(void)
+{
+	return ntohl(crc32_poly) == 0xedb88320;
+}
+
 static void init_crc32()
 {
 	const uint32_t poly = ntohl(crc32_poly);
@@ -40,14 +48,23 @@ static void init_crc32()
 	}
 }
 
-static uint32_t crc32buf(const void *buf, size_t len)
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
 {
-	uint32_t crc = 0xFFFFFFFF;
 	const uint8_t *in = buf;
 
+	if (crc32_poly_is_std())
+		return fw_crc32(crc, buf, len);
+
 	for (; len; len--, in++)
 		crc = crc32[(uint8_t)crc ^ *in] ^ (crc >> BPB);
-	return ~crc;
+	return crc;
+}
+
+static void crc32_sink(void *priv, const void *buf, size_t len)
+{
+	uint32_t *crc = priv;
+
+	*crc = crc32_update(*crc, buf, len);
 }
 
 static void usage(const char *) __attribute__ (( __noreturn__ ));
@@ -92,49 +109,53 @@ static void parseopts(int *argc, char ***argv)
 	*argv += optind;
 }
 
-static void appendfile(int outfd, char *path, int kernel) {
+#define PADDING	0x400
+#define FOOTER	12
+
+static uint8_t padding[PADDING];
+
+/* One input file and where its part of the image goes */
+struct part {
+	const char *path;
 	int fd;
-	size_t len, padded_len;
-	char *input_file;
+	size_t len;
+	size_t padded_len;
+	off_t offset;
 	uint32_t crc;
-	char padding[0x400];
-	char footer[12];
+};
 
-	memset(padding, 0xff, sizeof(padding));
+static void openpart(struct part *part, char *path, int kernel) {
+	uint8_t sig[4];
+	off_t len;
 
-	// mmap input_file
-	if ((fd = open(path, O_RDONLY))  < 0
-	|| (len = lseek(fd, 0, SEEK_END)) < 0
-	|| (input_file = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0)) == (void *) (-1)
-	|| close(fd) < 0)
+	part->path = path;
+	if ((part->fd = open(path, O_RDONLY)) < 0
+	|| (len = lseek(part->fd, 0, SEEK_END)) < 0)
 	{
-		fprintf(stderr, "Error mapping file '%s': %s\n", path, strerror(errno));
+		fprintf(stderr, "Error opening file '%s': %s\n", path, strerror(errno));
 		exit(1);
 	}
+	part->len = len;
 
 	// kernel should be lzma compressed image, not uImage
 	if (kernel &&
-	    (input_file[0] != (char)0x5d ||
-	     input_file[1] != (char)0x00 ||
-	     input_file[2] != (char)0x00 ||
-	     input_file[3] != (char)0x80)) {
+	    (pread(part->fd, sig, sizeof(sig), 0) != sizeof(sig) ||
+	     sig[0] != 0x5d || sig[1] != 0x00 || sig[2] != 0x00 || sig[3] != 0x80)) {
 		fprintf(stderr, "lzma signature not found on kernel image.\n");
 		exit(1);
 	}
 
-	init_crc32();
-	crc = crc32buf(input_file, len);
-	fprintf(stderr, "crc32 for '%s' is %08x.\n", path, crc);
+	part->padded_len = ((part->len + FOOTER + PADDING - 1) & ~(PADDING - 1)) - FOOTER;
+}
 
-	// write the file
-	write(outfd, input_file, len);
+static void writefooter(int outfd, struct part *part) {
+	uint8_t footer[FOOTER];
+	size_t len = part->len;
+	uint32_t crc = part->crc;
 
-	// write padding
-	padded_len = ((len + sizeof(footer) + sizeof(padding) - 1) & ~(sizeof(padding) - 1)) - sizeof(footer);
-	fprintf(stderr, "len=%08zx padded_len=%08zx\n", len, padded_len);
-	write(outfd, padding, padded_len - len);
+	fprintf(stderr, "crc32 for '%s' is %08x.\n", part->path, crc);
+	fprintf(stderr, "len=%08zx padded_len=%08zx\n", part->len, part->padded_len);
 
-	// write footer
 	footer[0]  = (len   >>  0) & 0xff;
 	footer[1]  = (len   >>  8) & 0xff;
 	footer[2]  = (len   >> 16) & 0xff;
@@ -147,13 +168,19 @@ static void appendfile(int outfd, char *path, int kernel) {
 	footer[9]  = (crc   >>  8) & 0xff;
 	footer[10] = (crc   >> 16) & 0xff;
 	footer[11] = (crc   >> 24) & 0xff;
-	write(outfd, footer, sizeof(footer));
 
-	munmap(input_file, len);
+	if (pwrite(outfd, footer, sizeof(footer), part->offset + part->padded_len) != sizeof(footer)) {
+		fprintf(stderr, "Error writing '%s': %s\n", output_file, strerror(errno));
+		exit(1);
+	}
 }
 
 int main(int argc, char **argv)
 {
+	struct fw_io_extent *ext;
+	struct part *parts;
+	unsigned int n = 0;
+	off_t offset = 0;
 	int outfd;
 	int i;
 
@@ -162,17 +189,60 @@ int main(int argc, char **argv)
 	if (argc < 1)
 		usage("wrong number of arguments");
 
+	if (!crc32_poly_is_std())
+		init_crc32();
+	memset(padding, 0xff, sizeof(padding));
+
+	parts = calloc(argc, sizeof(*parts));
+	ext = calloc(2 * argc + 1, sizeof(*ext));
+	if (!parts || !ext) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	/*
+	 * Lay out every part up front: data, 0xff padding up to the footer,
+	 * footer. All parts are then copied in one go on the worker pool,
+	 * checksummed on the way in, and the footers filled in afterwards.
+	 */
+	for (i = 0; i < argc; i++) {
+		struct part *part = &parts[i];
+
+		openpart(part, argv[i], i == 0);
+		part->offset = offset;
+		part->crc = 0xFFFFFFFF;
+
+		ext[n++] = (struct fw_io_extent){ .fd = part->fd, .len = part->len,
+			.out_off = offset, .sink = crc32_sink, .priv = &part->crc };
+		if (part->padded_len > part->len)
+			ext[n++] = (struct fw_io_extent){ .fd = -1, .buf = padding,
+				.len = part->padded_len - part->len, .out_off = offset + part->len };
+
+		offset += part->padded_len + FOOTER;
+	}
+	ext[n++] = (struct fw_io_extent){ .fd = -1, .buf = signature,
+		.len = strlen(signature) + 1, .out_off = offset };
+
 	if ((outfd = open(output_file, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
 	{
 		fprintf(stderr, "Error opening '%s' for writing: %s\n", output_file, strerror(errno));
 		exit(1);
 	}
 
-	for (i=0; i<argc; i++) {
-		appendfile(outfd, argv[i], i == 0);
+	if (fw_io_copy_extents(outfd, ext, n)) {
+		fprintf(stderr, "Error writing '%s'\n", output_file);
+		exit(1);
+	}
+
+	for (i = 0; i < argc; i++) {
+		parts[i].crc = ~parts[i].crc;
+		writefooter(outfd, &parts[i]);
+		close(parts[i].fd);
 	}
-	write(outfd, signature, strlen(signature)+1);
 	close(outfd);
 
+	free(ext);
+	free(parts);
+
 	return 0;
 }
@@ -16,6 +16,10 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+
+#include "fw_io.h"
+#include "fw_sum.h"
 
 #define DNI_HDR_LEN	128
 
@@ -68,17 +72,26 @@ void usage(int status)
 	exit(status);
 }
 
+/* Turns *priv, the byte sum of the header, into the trailing checksum byte */
+static void buffalo_csum_sink(void *priv, const void *buf, size_t len)
+{
+	uint8_t *csum = priv;
+	struct fw_sum sum;
+
+	fw_sum_init(&sum);
+	fw_sum8_update(&sum, buf, len);
+	*csum = 0xff - (uint8_t)(*csum + sum.sum);
+}
+
 int main(int argc, char *argv[])
 {
 	int res = EXIT_FAILURE;
-	int buflen;
 	int err;
 	struct stat st;
-	char *buf;
+	char buf[DNI_HDR_LEN];
 	int i;
 	uint8_t csum;
-
-	FILE *outfile, *infile;
+	int outfd, infd;
 
 	progname = basename(argv[0]);
 
@@ -151,13 +164,6 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
-	buflen = st.st_size + DNI_HDR_LEN + 1;
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto err;
-	}
-
 	memset(buf, 0, DNI_HDR_LEN);
 	snprintf(buf, DNI_HDR_LEN, "device:%s\nversion:%s\nregion:%s\n"
 		 "RootfsSize:%s\nKernelSize:%s\nInfoHeadSize:128\n",
@@ -165,54 +171,40 @@ int main(int argc, char *argv[])
 	buf[DNI_HDR_LEN - 2] = 0x12;
 	buf[DNI_HDR_LEN - 1] = 0x32;
 
-	infile = fopen(ifname, "r");
-	if (infile == NULL) {
+	infd = open(ifname, O_RDONLY);
+	if (infd < 0) {
 		ERRS("could not open \"%s\" for reading", ifname);
-		goto err_free;
-	}
-
-	errno = 0;
-	fread(buf +  DNI_HDR_LEN, st.st_size, 1, infile);
-	if (errno != 0) {
-		ERRS("unable to read from file %s", ifname);
-		goto err_close_in;
+		goto err;
 	}
 
 	csum = 0;
-	for (i = 0; i < (st.st_size + DNI_HDR_LEN); i++)
+	for (i = 0; i < DNI_HDR_LEN; i++)
 		csum += buf[i];
 
-	csum = 0xff - csum;
-	buf[st.st_size + DNI_HDR_LEN] = csum;
-
-	outfile = fopen(ofname, "w");
-	if (outfile == NULL) {
+	outfd = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (outfd < 0) {
 		ERRS("could not open \"%s\" for writing", ofname);
 		goto err_close_in;
 	}
 
-	errno = 0;
-	fwrite(buf, buflen, 1, outfile);
-	if (errno) {
+	err = fw_io_prepend(outfd, buf, DNI_HDR_LEN, infd, 0, st.st_size,
+			    &csum, 1, buffalo_csum_sink, &csum);
+	if (err) {
+		errno = -err;
 		ERRS("unable to write to file %s", ofname);
 		goto err_close_out;
 	}
 
 	res = EXIT_SUCCESS;
 
-	fflush(outfile);
-
  err_close_out:
-	fclose(outfile);
+	close(outfd);
 	if (res != EXIT_SUCCESS) {
 		unlink(ofname);
 	}
 
  err_close_in:
-	fclose(infile);
-
- err_free:
-	free(buf);
+	close(infd);
 
  err:
 	return res;
@@ -12,11 +12,15 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include "fw_io.h"
+#include "fw_sum.h"
+
 #define MAX_MODEL_LEN		20
 #define MAX_SIGNATURE_LEN	30
 #define MAX_REGION_LEN		4
@@ -127,7 +131,7 @@ static int get_file_stat(struct file_info *fdata)
 	if (fdata->file_name == NULL)
 		return 0;
 
-	res = stat(fdata->file_name, &st);
+	res = fw_io_stat_input(fdata->file_name, &st);
 	if (res){
 		ERRS("stat failed on %s", fdata->file_name);
 		return res;
@@ -135,33 +139,8 @@ static int get_file_stat(struct file_info *fdata)
 
 	fdata->file_size = st.st_size;
 	fdata->write_size = fdata->file_size;
-	return 0;
-}
-
-static int read_to_buf(struct file_info *fdata, char *buf)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(fdata->file_name, "r");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for reading", fdata->file_name);
-		goto out;
-	}
-
-	errno = 0;
-	fread(buf, fdata->file_size, 1, f);
-	if (errno != 0) {
-		ERRS("unable to read from file \"%s\"", fdata->file_name);
-		goto out_close;
-	}
-
-	ret = EXIT_SUCCESS;
 
-out_close:
-	fclose(f);
-out:
-	return ret;
+	return 0;
 }
 
 static int check_options(void)
@@ -248,111 +227,103 @@ static int check_options(void)
 	return 0;
 }
 
-static int write_fw(char *data, int len)
+static void csum_sink(void *priv, const void *buf, size_t len)
 {
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(ofname, "w");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto out;
-	}
-
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
-	}
-
-	DBG("firmware file \"%s\" completed", ofname);
-
-	ret = EXIT_SUCCESS;
-
-out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
-out:
-	return ret;
+	fw_sum8_update(priv, buf, len);
 }
 
-static uint32_t get_csum(unsigned char *p, uint32_t len)
+static int open_input(struct file_info *fdata)
 {
-	uint32_t csum = 0;
+	int fd;
 
-	while (len--)
-		csum += *p++;
+	fd = open(fdata->file_name, O_RDONLY);
+	if (fd < 0)
+		ERRS("could not open \"%s\" for reading", fdata->file_name);
 
-	return csum;
+	return fd;
 }
 
+/*
+ * The inputs are copied straight into the output, kernel-side where
+ * possible, and summed on the way. The header only depends on the sum
+ * and the sizes, so it goes in last. Padding is left as holes.
+ */
 static int build_fw(void)
 {
-	int buflen;
-	char *buf;
-	char *p;
-	uint32_t csum;
-	struct img_header *hdr;
+	struct fw_io_extent ext[2] = {};
+	struct fw_sum sum[2];
+	struct img_header hdr = {};
+	uint32_t buflen;
+	unsigned int i, n;
+	int fd;
 	int ret = EXIT_FAILURE;
 
 	buflen = sizeof(struct img_header) +
 		 kernel_info.write_size + rootfs_info.write_size;
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto out;
+	n = combined ? 1 : 2;
+	for (i = 0; i < n; i++)
+		ext[i].fd = -1;
+
+	for (i = 0; i < n; i++) {
+		struct file_info *fdata = i ? &rootfs_info : &kernel_info;
+
+		fw_sum_init(&sum[i]);
+		ext[i].fd = open_input(fdata);
+		if (ext[i].fd < 0)
+			goto out_close;
+		ext[i].len = fdata->file_size;
+		ext[i].out_off = sizeof(struct img_header) +
+				 (i ? kernel_info.write_size : 0);
+		ext[i].sink = csum_sink;
+		ext[i].priv = &sum[i];
 	}
 
-	memset(buf, 0, buflen);
-
-	p = buf + sizeof(struct img_header);
-
-	/* read kernel data */
-	ret = read_to_buf(&kernel_info, p);
-	if (ret)
-		goto out_free_buf;
-
-	if (!combined) {
-		p += kernel_info.write_size;
-
-		/* read rootfs data */
-		ret = read_to_buf(&rootfs_info, p);
-		if (ret)
-			goto out_free_buf;
+	fd = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		ERRS("could not open \"%s\" for writing", ofname);
+		goto out_close;
 	}
 
-	csum = get_csum((unsigned char *)(buf + sizeof(struct img_header)),
-			buflen - sizeof(struct img_header));
+	ret = fw_io_copy_extents(fd, ext, n);
+	if (ret) {
+		errno = -ret;
+		ret = EXIT_FAILURE;
+		ERRS("unable to write output file");
+		goto out_unlink;
+	}
 
 	/* fill firmware header */
-	hdr = (struct img_header *) buf;
-
-	hdr->checksum = htonl(csum);
-	hdr->image_size = htonl(buflen - sizeof(struct img_header));
+	hdr.checksum = htonl(sum[0].sum + (n > 1 ? sum[1].sum : 0));
+	hdr.image_size = htonl(buflen - sizeof(struct img_header));
 	if (!combined)
-		hdr->kernel_size = htonl(kernel_info.write_size);
+		hdr.kernel_size = htonl(kernel_info.write_size);
 	else
-		hdr->kernel_size = htonl(kernel_size);
-	hdr->header_len = sizeof(struct img_header);
-	strncpy(hdr->model, model, sizeof(hdr->model));
-	strncpy(hdr->signature, signature, sizeof(hdr->signature));
-	strncpy(hdr->version, version, sizeof(hdr->version));
-	strncpy(hdr->region, region, sizeof(hdr->region));
-
-	ret = write_fw(buf, buflen);
-	if (ret)
-		goto out_free_buf;
+		hdr.kernel_size = htonl(kernel_size);
+	hdr.header_len = sizeof(struct img_header);
+	strncpy(hdr.model, model, sizeof(hdr.model));
+	strncpy(hdr.signature, signature, sizeof(hdr.signature));
+	strncpy(hdr.version, version, sizeof(hdr.version));
+	strncpy(hdr.region, region, sizeof(hdr.region));
+
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    ftruncate(fd, buflen) || close(fd)) {
+		ERRS("unable to write output file");
+		goto out_unlink;
+	}
+
+	DBG("firmware file \"%s\" completed", ofname);
 
 	ret = EXIT_SUCCESS;
+	goto out_close;
 
-out_free_buf:
-	free(buf);
-out:
+out_unlink:
+	close(fd);
+	unlink(ofname);
+out_close:
+	for (i = 0; i < n; i++)
+		if (ext[i].fd >= 0)
+			close(ext[i].fd);
 	return ret;
 }
 
@@ -18,6 +18,8 @@
 #include <endian.h>     /* for __BYTE_ORDER */
 #include <byteswap.h>
 
+#include "fw_sum.h"
+
 #if (__BYTE_ORDER == __LITTLE_ENDIAN)
 #  define HOST_TO_LE16(x)	(x)
 #  define HOST_TO_LE32(x)	(x)
@@ -45,9 +47,8 @@
 
 struct csum_state{
 	int	size;
-	uint32_t val;
-	uint32_t tmp;
-	int	odd;
+	uint32_t val;		/* csum32 only */
+	struct fw_sum sum;
 };
 
 struct image_desc {
@@ -440,9 +441,7 @@ is_empty_arg(char *arg)
 void
 csum8_update(uint8_t *p, uint32_t len, struct csum_state *css)
 {
-	for ( ; len > 0; len --) {
-		css->val += *p++;
-	}
+	fw_sum8_update(&css->sum, p, len);
 }
 
 
@@ -451,7 +450,7 @@ csum8_get(struct csum_state *css)
 {
 	uint8_t t;
 
-	t = css->val;
+	t = css->sum.sum;
 	return ~t + 1;
 }
 
@@ -459,36 +458,17 @@ csum8_get(struct csum_state *css)
 void
 csum16_update(void *data, uint32_t len, struct csum_state *css)
 {
-	uint8_t *p = data;
-	uint16_t t;
-
-	if (css->odd) {
-		t = css->tmp + (p[0]<<8);
-		css->val += LE16_TO_HOST(t);
-		css->odd = 0;
-		len--;
-		p++;
-	}
-
-	for ( ; len > 1; len -= 2, p +=2 ) {
-		t = p[0] + (p[1] << 8);
-		css->val += LE16_TO_HOST(t);
-	}
-
-	if (len == 1) {
-		css->tmp = p[0];
-		css->odd = 1;
-	}
+	fw_sum16_le_update(&css->sum, data, len);
 }
 
 
 uint16_t
 csum16_get(struct csum_state *css)
 {
-	char pad = 0;
+	uint16_t t;
 
-	csum16_update(&pad, 1, css);
-	return ~css->val + 1;
+	t = fw_sum16_le_final(&css->sum);
+	return ~t + 1;
 }
 
 void
@@ -512,9 +492,8 @@ csum32_get(struct csum_state *css)
 void
 csum_init(struct csum_state *css, int size)
 {
+	fw_sum_init(&css->sum);
 	css->val = 0;
-	css->tmp = 0;
-	css->odd = 0;
 	css->size = size;
 }
 
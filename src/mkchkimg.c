@@ -14,7 +14,9 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 
-#define BUF_LEN (2048)
+#include "fw_cpu.h"
+
+#define BUF_LEN (64 * 1024)
 
 #define MAX_BOARD_ID_LEN (64)
 
@@ -87,12 +89,155 @@ netgear_checksum_init (struct ngr_checksum * c)
 	c->c0 = c->c1 = 0;
 }
 
+/*
+ * c0 and c1 wrap modulo 2^32 and are only folded in netgear_checksum_fini,
+ * so a block of n bytes can be added in one go:
+ *
+ *	c1 += n * c0 + sum((n - j) * buf[j])
+ *	c0 += sum(buf[j])
+ *
+ * The vector kernels below compute that per 16 or 32 byte block, the same
+ * way Adler-32 is usually vectorized. They return the number of bytes
+ * consumed (a multiple of their block size) and leave the tail to the
+ * scalar loop.
+ */
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+static size_t
+ngr_add_sse2 (struct ngr_checksum * c, const unsigned char * buf, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	const __m128i w_lo = _mm_setr_epi16 (16, 15, 14, 13, 12, 11, 10, 9);
+	const __m128i w_hi = _mm_setr_epi16 (8, 7, 6, 5, 4, 3, 2, 1);
+	__m128i vs1 = zero, vs2 = zero, vps = zero;
+	uint32_t s[4];
+	size_t i, nblk = len / 16;
+
+	for (i = 0; i < nblk; i++) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *) (buf + 16 * i));
+
+		vps = _mm_add_epi32 (vps, vs1);
+		vs1 = _mm_add_epi32 (vs1, _mm_sad_epu8 (v, zero));
+		vs2 = _mm_add_epi32 (vs2, _mm_madd_epi16 (_mm_unpacklo_epi8 (v, zero), w_lo));
+		vs2 = _mm_add_epi32 (vs2, _mm_madd_epi16 (_mm_unpackhi_epi8 (v, zero), w_hi));
+	}
+
+	c->c1 += (uint32_t) (nblk * 16) * c->c0;
+	_mm_storeu_si128 ((__m128i *) s, vps);
+	c->c1 += 16 * (s[0] + s[1] + s[2] + s[3]);
+	_mm_storeu_si128 ((__m128i *) s, vs2);
+	c->c1 += s[0] + s[1] + s[2] + s[3];
+	_mm_storeu_si128 ((__m128i *) s, vs1);
+	c->c0 += s[0] + s[1] + s[2] + s[3];
+
+	return nblk * 16;
+}
+
+__attribute__ ((target ("avx2")))
+static size_t
+ngr_add_avx2 (struct ngr_checksum * c, const unsigned char * buf, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256 ();
+	const __m256i ones = _mm256_set1_epi16 (1);
+	const __m256i w = _mm256_setr_epi8 (32, 31, 30, 29, 28, 27, 26, 25,
+					    24, 23, 22, 21, 20, 19, 18, 17,
+					    16, 15, 14, 13, 12, 11, 10, 9,
+					    8, 7, 6, 5, 4, 3, 2, 1);
+	__m256i vs1 = zero, vs2 = zero, vps = zero;
+	uint32_t s[8];
+	size_t i, nblk = len / 32;
+	int j;
+
+	for (i = 0; i < nblk; i++) {
+		__m256i v = _mm256_loadu_si256 ((const __m256i *) (buf + 32 * i));
+
+		vps = _mm256_add_epi32 (vps, vs1);
+		vs1 = _mm256_add_epi32 (vs1, _mm256_sad_epu8 (v, zero));
+		vs2 = _mm256_add_epi32 (vs2, _mm256_madd_epi16 (_mm256_maddubs_epi16 (v, w), ones));
+	}
+
+	c->c1 += (uint32_t) (nblk * 32) * c->c0;
+	_mm256_storeu_si256 ((__m256i *) s, vps);
+	for (j = 0; j < 8; j++)
+		c->c1 += 32 * s[j];
+	_mm256_storeu_si256 ((__m256i *) s, vs2);
+	for (j = 0; j < 8; j++)
+		c->c1 += s[j];
+	_mm256_storeu_si256 ((__m256i *) s, vs1);
+	for (j = 0; j < 8; j++)
+		c->c0 += s[j];
+
+	return nblk * 32;
+}
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+static size_t
+ngr_add_neon (struct ngr_checksum * c, const unsigned char * buf, size_t len)
+{
+	static const uint8_t w[16] = { 16, 15, 14, 13, 12, 11, 10, 9,
+				       8, 7, 6, 5, 4, 3, 2, 1 };
+	const uint8x8_t w_lo = vld1_u8 (w);
+	const uint8x8_t w_hi = vld1_u8 (w + 8);
+	uint32x4_t vs1 = vdupq_n_u32 (0), vs2 = vdupq_n_u32 (0);
+	uint32x4_t vps = vdupq_n_u32 (0);
+	size_t i, nblk = len / 16;
+
+	for (i = 0; i < nblk; i++) {
+		uint8x16_t v = vld1q_u8 (buf + 16 * i);
+		uint16x8_t p;
+
+		vps = vaddq_u32 (vps, vs1);
+		vs1 = vpadalq_u16 (vs1, vpaddlq_u8 (v));
+		p = vmull_u8 (vget_low_u8 (v), w_lo);
+		p = vmlal_u8 (p, vget_high_u8 (v), w_hi);
+		vs2 = vpadalq_u16 (vs2, p);
+	}
+
+	c->c1 += (uint32_t) (nblk * 16) * c->c0;
+	c->c1 += 16 * vaddvq_u32 (vps);
+	c->c1 += vaddvq_u32 (vs2);
+	c->c0 += vaddvq_u32 (vs1);
+
+	return nblk * 16;
+}
+#else
+static size_t
+ngr_add_none (struct ngr_checksum * c, const unsigned char * buf, size_t len)
+{
+	return 0;
+}
+#endif
+
+static size_t (*ngr_add_vec) (struct ngr_checksum *, const unsigned char *, size_t);
+
+static void
+netgear_checksum_select (void)
+{
+#if defined(__x86_64__)
+	if (fw_cpu_has (FW_CPU_AVX2))
+		ngr_add_vec = ngr_add_avx2;
+	else
+		ngr_add_vec = ngr_add_sse2;
+#elif defined(__aarch64__)
+	ngr_add_vec = ngr_add_neon;
+#else
+	ngr_add_vec = ngr_add_none;
+#endif
+}
+
 static inline void
 netgear_checksum_add (struct ngr_checksum * c, unsigned char * buf, size_t len)
 {
 	size_t i;
 
-	for (i=0; i<len; i++) {
+	if (!ngr_add_vec)
+		netgear_checksum_select ();
+
+	i = ngr_add_vec (c, buf, len);
+
+	for (; i<len; i++) {
 		c->c0 += buf[i] & 0xff;
 		c->c1 += c->c0;
 	}
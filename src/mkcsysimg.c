@@ -22,6 +22,7 @@
 #include <byteswap.h>
 
 #include "csysimg.h"
+#include "fw_sum.h"
 
 #if (__BYTE_ORDER == __LITTLE_ENDIAN)
 #  define HOST_TO_LE16(x)	(x)
@@ -56,9 +57,7 @@
 
 struct csum_state{
 	int	size;
-	uint16_t val;
-	uint16_t tmp;
-	int	odd;
+	struct fw_sum sum;
 };
 
 
@@ -390,9 +389,7 @@ is_empty_arg(char *arg)
 void
 csum8_update(uint8_t *p, uint32_t len, struct csum_state *css)
 {
-	for ( ; len > 0; len --) {
-		css->val += *p++;
-	}
+	fw_sum8_update(&css->sum, p, len);
 }
 
 
@@ -401,7 +398,7 @@ csum8_get(struct csum_state *css)
 {
 	uint8_t t;
 
-	t = css->val;
+	t = css->sum.sum;
 	return ~t + 1;
 }
 
@@ -409,49 +406,27 @@ csum8_get(struct csum_state *css)
 void
 csum16_update(void *data, uint32_t len, struct csum_state *css)
 {
-	uint8_t *p = data;
-	uint16_t t;
-
-	if (css->odd) {
-		t = css->tmp + (p[0]<<8);
-		css->val += LE16_TO_HOST(t);
-		css->odd = 0;
-		len--;
-		p++;
-	}
-
-	for ( ; len > 1; len -= 2, p +=2 ) {
-		t = p[0] + (p[1] << 8);
-		css->val += LE16_TO_HOST(t);
-	}
-
-	if (len == 1) {
-		css->tmp = p[0];
-		css->odd = 1;
-	}
+	fw_sum16_le_update(&css->sum, data, len);
 }
 
 
 uint16_t
 csum16_get(struct csum_state *css)
 {
-	char pad = 0;
+	uint16_t t;
 
-	csum16_update(&pad, 1, css);
-	return ~css->val + 1;
+	t = fw_sum16_le_final(&css->sum);
+	return ~t + 1;
 }
 
 
 void
 csum_init(struct csum_state *css, int size)
 {
-	css->val = 0;
-	css->tmp = 0;
-	css->odd = 0;
+	fw_sum_init(&css->sum);
 	css->size = size;
 }
 
-
 void
 csum_update(void *data, uint32_t len, struct csum_state *css)
 {
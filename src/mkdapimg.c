@@ -8,9 +8,15 @@
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>	// htonl
 
+#include "fw_io.h"
+#include "fw_sum.h"
+
 // Usage: mkdapimg [-p] [-m <model>] -s <sig> -i <input> -o <output>
 //
 // e.g.: mkdapimg -s RT3052-AP-DAP1350-3 -i sysupgrade.bin -o factory.bin
@@ -22,6 +28,9 @@
 // specified model and signature.
 // The "-x" (fix) option will recalculate the payload size and checksum
 // during the patch mode operation.
+//
+// Several -s <sig> -o <output> pairs build the images of several models
+// from one input, which is only checksummed once.
 
 // The img_hdr_struct was taken from the D-Link SDK:
 // DAP-1350_A1_FW1.11NA_GPL/GPL_Source_Code/Uboot/DAP-1350/httpd/header.h
@@ -30,6 +39,7 @@
 #define MAX_SIG_LEN		30
 #define MAX_REGION_LEN		4
 #define MAX_VERSION_LEN		12
+#define MAX_IMAGES		16
 
 struct img_hdr_struct {
 	uint32_t checksum;
@@ -54,24 +64,85 @@ perrexit(int code, char *msg)
 void
 usage()
 {
-	fprintf(stderr, "usage: %s [-p] [-m model] [-r region] [-v version] -s signature -i input -o output\n", progname);
+	fprintf(stderr, "usage: %s [-p] [-m model] [-r region] [-v version] -s signature -i input -o output [-s signature -o output]...\n", progname);
 	exit(1);
 }
 
+// Write one image: header as given plus model and signature, then the payload
+static void
+write_image(const char *output, const char *model, const char *signature,
+	    const char *region, const char *version, int have_regionversion,
+	    int ifd, off_t payload, size_t bcnt)
+{
+	struct img_hdr_struct hdr = imghdr;
+	struct iovec iov[3];
+	size_t len;
+	int ofd;
+
+	strncpy(hdr.model, model, MAX_MODEL_NAME_LEN);
+	strncpy(hdr.sig, signature, MAX_SIG_LEN);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)region;
+	iov[1].iov_len = MAX_REGION_LEN;
+	iov[2].iov_base = (void *)version;
+	iov[2].iov_len = MAX_VERSION_LEN;
+	len = sizeof(hdr);
+	if (have_regionversion)
+		len += MAX_REGION_LEN + MAX_VERSION_LEN;
+
+	if ((ofd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		perrexit(1, (char *)output);
+
+	if (writev(ofd, iov, have_regionversion ? 3 : 1) != len)
+		perrexit(2, "fwrite header on output");
+
+	if (fw_io_copy_fd(ofd, len, ifd, payload, bcnt) != bcnt)
+		perrexit(2, "copy to output");
+
+	if (close(ofd) < 0)
+		perrexit(2, "close output");
+}
+
+// Model name from the signature: the leading characters upto the first "-"
+static void
+auto_model(char *model, char *signature)
+{
+	char *p = strchr(signature, '-');
+	if (p == NULL) {
+		fprintf(stderr, "%s: model name unknown\n", progname);
+		exit(1);
+	}
+	if (p - signature > MAX_MODEL_NAME_LEN) {
+		*p = 0;
+		fprintf(stderr, "%s: auto model name failed, string %s too long\n", progname, signature);
+		exit(1);
+	}
+	memset(model, 0, MAX_MODEL_NAME_LEN + 1);
+	strncpy(model, signature, p - signature);
+}
+
 int
 main(int ac, char *av[])
 {
 	char model[MAX_MODEL_NAME_LEN+1];
-	char signature[MAX_SIG_LEN+1];
+	char signature[MAX_IMAGES][MAX_SIG_LEN+1];
+	char *output[MAX_IMAGES];
 	char region[MAX_REGION_LEN+1];
 	char version[MAX_VERSION_LEN+1];
+	char image_model[MAX_MODEL_NAME_LEN+1];
 	int patchmode = 0;
 	int fixmode = 0;
 	int have_regionversion = 0;
+	int nsig = 0, nout = 0;
+	int i;
 
-	FILE *ifile = NULL;
-	FILE *ofile = NULL;
-	int c;
+	struct fw_io_map map;
+	struct fw_sum sum;
+	struct stat st;
+	off_t payload;
+	int ifd = -1;
 	uint32_t cksum;
 	uint32_t bcnt;
 
@@ -127,49 +198,54 @@ main(int ac, char *av[])
 					progname, MAX_SIG_LEN);
 				exit(1);
 			}
-			strcpy(signature, optarg);
+			if (nsig == MAX_IMAGES) {
+				fprintf(stderr, "%s: more than %d images\n",
+					progname, MAX_IMAGES);
+				exit(1);
+			}
+			strcpy(signature[nsig++], optarg);
 			break;
 		case 'i':
-			if ((ifile = fopen(optarg, "r")) == NULL)
+			if ((ifd = open(optarg, O_RDONLY)) < 0)
 				perrexit(1, optarg);
 			break;
 		case 'o':
-			if ((ofile = fopen(optarg, "w")) == NULL)
-				perrexit(1, optarg);
+			if (nout == MAX_IMAGES) {
+				fprintf(stderr, "%s: more than %d images\n",
+					progname, MAX_IMAGES);
+				exit(1);
+			}
+			output[nout++] = optarg;
 			break;
 		default:
 			usage();
 		}
 	}
 
-	if (signature[0] == 0 || ifile == NULL || ofile == NULL) {
+	if (nsig == 0 || nsig != nout || ifd < 0) {
 		usage();
 	}
 
-	if (model[0] == 0) {
-		char *p = strchr(signature, '-');
-		if (p == NULL) {
-			fprintf(stderr, "%s: model name unknown\n", progname);
-			exit(1);
-		}
-		if (p - signature > MAX_MODEL_NAME_LEN) {
-			*p = 0;
-			fprintf(stderr, "%s: auto model name failed, string %s too long\n", progname, signature);
-			exit(1);
-		}
-		strncpy(model, signature, p - signature);
-	}
+	// Check every model name before writing anything
+	for (i = 0; i < nsig && model[0] == 0; i++)
+		auto_model(image_model, signature[i]);
 
 	if (patchmode) {
-		if (fread(&imghdr, sizeof(imghdr), 1, ifile) < 0)
+		if (pread(ifd, &imghdr, sizeof(imghdr), 0) != sizeof(imghdr))
 			perrexit(2, "fread on input");
 	}
 
-	for (bcnt = 0, cksum = 0 ; (c = fgetc(ifile)) != EOF ; bcnt++)
-		cksum += c & 0xff;
-
-	if (fseek(ifile, patchmode ? sizeof(imghdr) : 0, SEEK_SET) < 0)
-		perrexit(2, "fseek on input");
+	// Checksum the payload straight from the page cache
+	payload = patchmode ? sizeof(imghdr) : 0;
+	if (fstat(ifd, &st) < 0)
+		perrexit(2, "fstat on input");
+	bcnt = st.st_size - payload;
+	if (fw_io_map(&map, ifd, payload, bcnt))
+		perrexit(2, "mmap on input");
+	fw_sum_init(&sum);
+	fw_sum8_update(&sum, map.data, map.len);
+	cksum = sum.sum;
+	fw_io_unmap(&map);
 
 	if (patchmode == 0) {
 		// Fill in the header
@@ -202,27 +278,15 @@ main(int ac, char *av[])
 		}
 	}
 
-	strncpy(imghdr.model, model, MAX_MODEL_NAME_LEN);
-	strncpy(imghdr.sig, signature, MAX_SIG_LEN);
+	for (i = 0; i < nsig; i++) {
+		if (model[0] == 0)
+			auto_model(image_model, signature[i]);
+		else
+			strcpy(image_model, model);
 
-	if (fwrite(&imghdr, sizeof(imghdr), 1, ofile) < 0)
-		perrexit(2, "fwrite header on output");
-	if (have_regionversion) {
-		if (fwrite(&region, MAX_REGION_LEN, 1, ofile) < 0)
-			perrexit(2, "fwrite header on output");
-		if (fwrite(&version, MAX_VERSION_LEN, 1, ofile) < 0)
-			perrexit(2, "fwrite header on output");
+		write_image(output[i], image_model, signature[i], region,
+			    version, have_regionversion, ifd, payload, bcnt);
 	}
 
-	while ((c = fgetc(ifile)) != EOF) {
-		if (fputc(c, ofile) == EOF)
-			perrexit(2, "fputc on output");
-	}
-
-	if (ferror(ifile))
-		perrexit(2, "fgetc on input");
-
-
-	fclose(ofile);
-	fclose(ifile);
+	close(ifd);
 }
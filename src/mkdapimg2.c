@@ -12,9 +12,14 @@
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <netinet/in.h>	// htonl
 
+#include "fw_io.h"
+#include "fw_sum.h"
+
 // Usage: mkdapimg2 -s signature [-v version] [-r region]
 //                  [-k uImage block size] -i <input> -o <output>
 //
@@ -48,12 +53,16 @@
 //                 -k 917504 -i sysupgrade.bin -o factory.bin
 //
 //
+// Several -s <signature> -o <output> pairs build the images of several
+// models from one input, which is only checksummed once.
+//
 // The img_hdr_struct was taken from the D-Link SDK:
 // DAP-1330_OSS-firmware_1.00b21/DAP-1330_OSS-firmware_1.00b21/uboot/uboot.patch
 
 #define MAX_SIGN_LEN	32
 #define MAX_FW_VER_LEN	16
 #define MAX_REG_LEN	8
+#define MAX_IMAGES	16
 
 struct img_hdr_struct {
 	uint32_t hdr_len;
@@ -77,21 +86,26 @@ perrexit(int code, char *msg)
 void
 usage()
 {
-	fprintf(stderr, "usage: %s -s signature [-v version] [-r region] [-k uImage part size] -i <input> -o <output>\n", progname);
+	fprintf(stderr, "usage: %s -s signature [-v version] [-r region] [-k uImage part size] -i <input> -o <output> [-s signature -o <output>]...\n", progname);
 	exit(1);
 }
 
 int
 main(int ac, char *av[])
 {
-	char signature[MAX_SIGN_LEN];
+	char signature[MAX_IMAGES][MAX_SIGN_LEN];
+	char *output[MAX_IMAGES];
 	char version[MAX_FW_VER_LEN];
 	char region[MAX_REG_LEN];
 	int kernel = 0;
+	int nsig = 0, nout = 0;
+	int i;
 
-	FILE *ifile = NULL;
-	FILE *ofile = NULL;
-	int c;
+	struct fw_io_map map;
+	struct fw_sum sum;
+	struct stat st;
+	int ifd = -1;
+	int ofd;
 
 	uint32_t cksum;
 	uint32_t bcnt;
@@ -117,7 +131,12 @@ main(int ac, char *av[])
 					progname, MAX_SIGN_LEN);
 				exit(1);
 			}
-			strcpy(signature, optarg);
+			if (nsig == MAX_IMAGES) {
+				fprintf(stderr, "%s: more than %d images\n",
+					progname, MAX_IMAGES);
+				exit(1);
+			}
+			strcpy(signature[nsig++], optarg);
 			break;
 		case 'v':
 			if (strlen(optarg) > MAX_FW_VER_LEN + 1) {
@@ -142,61 +161,72 @@ main(int ac, char *av[])
 			}
 			break;
 		case 'i':
-			if ((ifile = fopen(optarg, "r")) == NULL)
+			if ((ifd = open(optarg, O_RDONLY)) < 0)
 				perrexit(1, optarg);
 			break;
 		case 'o':
-			if ((ofile = fopen(optarg, "w")) == NULL)
-				perrexit(1, optarg);
+			if (nout == MAX_IMAGES) {
+				fprintf(stderr, "%s: more than %d images\n",
+					progname, MAX_IMAGES);
+				exit(1);
+			}
+			output[nout++] = optarg;
 			break;
 		default:
 			usage();
 		}
 	}
 
-	if (signature[0] == 0 || ifile == NULL || ofile == NULL) {
+	if (nsig == 0 || nsig != nout || ifd < 0) {
 		usage();
 		exit(1);
 	}
 
-	for (bcnt = 0, cksum = 0 ; (c = fgetc(ifile)) != EOF ; bcnt++)
-		cksum += c & 0xff;
-
-	if (fseek(ifile, 0, SEEK_SET) < 0)
-		perrexit(2, "fseek on input");
-
-	// Fill in the header
-	memset(&imghdr, 0, sizeof(imghdr));
-	imghdr.hdr_len = sizeof(imghdr);
-	imghdr.checksum = htonl(cksum);
-	imghdr.total_size = htonl(bcnt);
-	imghdr.kernel_size = htonl(kernel);
-
-	strncpy(imghdr.signature, signature, MAX_SIGN_LEN);
-	strncpy(imghdr.fw_ver, version, MAX_FW_VER_LEN);
-	strncpy(imghdr.fw_reg, region, MAX_REG_LEN);
-
-	if (fwrite(&imghdr, sizeof(imghdr), 1, ofile) < 0)
-		perrexit(2, "fwrite header on output");
-
-	while ((c = fgetc(ifile)) != EOF) {
-		if (fputc(c, ofile) == EOF)
-			perrexit(2, "fputc on output");
+	// Checksum the input straight from the page cache
+	if (fstat(ifd, &st) < 0)
+		perrexit(2, "fstat on input");
+	bcnt = st.st_size;
+	if (fw_io_map(&map, ifd, 0, bcnt))
+		perrexit(2, "mmap on input");
+	fw_sum_init(&sum);
+	fw_sum8_update(&sum, map.data, map.len);
+	cksum = sum.sum;
+	fw_io_unmap(&map);
+
+	for (i = 0; i < nsig; i++) {
+		// Fill in the header
+		memset(&imghdr, 0, sizeof(imghdr));
+		imghdr.hdr_len = sizeof(imghdr);
+		imghdr.checksum = htonl(cksum);
+		imghdr.total_size = htonl(bcnt);
+		imghdr.kernel_size = htonl(kernel);
+
+		strncpy(imghdr.signature, signature[i], MAX_SIGN_LEN);
+		strncpy(imghdr.fw_ver, version, MAX_FW_VER_LEN);
+		strncpy(imghdr.fw_reg, region, MAX_REG_LEN);
+
+		if ((ofd = open(output[i], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+			perrexit(1, output[i]);
+
+		if (write(ofd, &imghdr, sizeof(imghdr)) != sizeof(imghdr))
+			perrexit(2, "fwrite header on output");
+
+		if (fw_io_copy_fd(ofd, sizeof(imghdr), ifd, 0, bcnt) != bcnt)
+			perrexit(2, "copy to output");
+
+		if (close(ofd) < 0)
+			perrexit(2, "close output");
+
+		fprintf(stderr, "imgHdr.hdr_len = %lu\n", sizeof(imghdr));
+		fprintf(stderr, "imgHdr.checksum = 0x%08x\n", cksum);
+		fprintf(stderr, "imgHdr.total_size = 0x%08x\n", bcnt);
+		fprintf(stderr, "imgHdr.kernel_size = 0x%08x\n", kernel);
+		fprintf(stderr, "imgHdr.header = %s\n", signature[i]);
+		fprintf(stderr, "imgHdr.fw_ver = %s\n", version);
+		fprintf(stderr, "imgHdr.fw_reg = %s\n", region);
 	}
 
-	if (ferror(ifile))
-		perrexit(2, "fgetc on input");
-
-	fclose(ofile);
-	fclose(ifile);
-
-	fprintf(stderr, "imgHdr.hdr_len = %lu\n", sizeof(imghdr));
-	fprintf(stderr, "imgHdr.checksum = 0x%08x\n", cksum);
-	fprintf(stderr, "imgHdr.total_size = 0x%08x\n", bcnt);
-	fprintf(stderr, "imgHdr.kernel_size = 0x%08x\n", kernel);
-	fprintf(stderr, "imgHdr.header = %s\n", signature);
-	fprintf(stderr, "imgHdr.fw_ver = %s\n", version);
-	fprintf(stderr, "imgHdr.fw_reg = %s\n", region);
+	close(ifd);
 
 	return 0;
 }
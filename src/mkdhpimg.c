@@ -5,6 +5,7 @@
 
 #include <sys/stat.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,6 +14,7 @@
 #include <unistd.h>
 
 #include "buffalo-lib.h"
+#include "fw_io.h"
 
 #define DHP_HEADER_SIZE	20
 
@@ -26,14 +28,29 @@ usage(void)
 	exit(EXIT_FAILURE);
 }
 
+/* The CRC covers the header, with its CRC field zero, and then the data */
+static void
+dhp_crc_sink(void *priv, const void *data, size_t len)
+{
+	uint8_t *buf = priv;
+	uint32_t crc;
+
+	crc = buffalo_crc_update(0, buf, DHP_HEADER_SIZE);
+	crc = buffalo_crc_update(crc, (void *)data, len);
+	crc = buffalo_crc_final(crc, DHP_HEADER_SIZE + len);
+	buf[0x10] = (crc >> 24) & 0xff;
+	buf[0x11] = (crc >> 16) & 0xff;
+	buf[0x12] = (crc >> 8) & 0xff;
+	buf[0x13] = crc & 0xff;
+}
+
 int
 main(int argc, char *argv[])
 {
 	struct stat in_st;
 	size_t size;
-	uint32_t crc;
-	int in, out;
-	uint8_t *buf;
+	int in, out, ret;
+	uint8_t buf[DHP_HEADER_SIZE];
 
 	progname = argv[0];
 
@@ -48,9 +65,6 @@ main(int argc, char *argv[])
 
 	size = DHP_HEADER_SIZE + in_st.st_size;
 
-	if ((buf = malloc(size)) == NULL)
-		err(EXIT_FAILURE, "malloc");
-
 	memset(buf, 0, DHP_HEADER_SIZE);
 	buf[0x0] = 0x62;
 	buf[0x1] = 0x67;
@@ -61,21 +75,17 @@ main(int argc, char *argv[])
 	buf[0xe] = (size >> 8) & 0xff;
 	buf[0xf] = size & 0xff;
 
-	read(in, &buf[DHP_HEADER_SIZE], in_st.st_size);
-	close(in);
-
-	crc = buffalo_crc(buf, size);
-	buf[0x10] = (crc >> 24) & 0xff;
-	buf[0x11] = (crc >> 16) & 0xff;
-	buf[0x12] = (crc >> 8) & 0xff;
-	buf[0x13] = crc & 0xff;
-
 	if ((out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
 		err(EXIT_FAILURE, "%s", argv[2]);
-	write(out, buf, size);
-	close(out);
 
-	free(buf);
+	ret = fw_io_prepend(out, buf, DHP_HEADER_SIZE, in, 0, in_st.st_size,
+			    NULL, 0, dhp_crc_sink, buf);
+	if (ret) {
+		errno = -ret;
+		err(EXIT_FAILURE, "%s", argv[2]);
+	}
+	close(out);
+	close(in);
 
 	return EXIT_SUCCESS;
 }
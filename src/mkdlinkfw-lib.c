@@ -9,6 +9,8 @@
  * Copyright (C) 2008,2009 Wang Jian <lark@linux.net.cn>
  */
 
+#define _POSIX_C_SOURCE 200809L	/* for fileno() with --std=c99 */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -21,9 +23,12 @@
 #include <endian.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
 #include <sys/stat.h>
-#include <zlib.h>		/*for crc32 */
+#include <sys/uio.h>
 
+#include "fw_io.h"
+#include "fw_sum.h"
 #include "mkdlinkfw-lib.h"
 
 extern char *progname;
@@ -52,16 +57,23 @@ uint32_t jboot_timestamp(void)
 
 uint16_t jboot_checksum(uint16_t start_val, uint16_t *data, int size)
 {
-	uint32_t counter = start_val;
+	uint32_t counter;
 	uint16_t *ptr = data;
-
-	while (size > 1) {
-		counter += *ptr;
-		++ptr;
-		while (counter >> 16)
-			counter = (uint16_t) counter + (counter >> 16);
-		size -= 2;
+	struct fw_sum sum;
+
+	/* words are in host order, like the rest of the headers */
+	fw_sum_init(&sum);
+	sum.sum = start_val;
+	if (size > 1) {
+#if __BYTE_ORDER == __BIG_ENDIAN
+		fw_sum16_be_update(&sum, data, size & ~1);
+#else
+		fw_sum16_le_update(&sum, data, size & ~1);
+#endif
+		ptr += size / 2;
+		size &= 1;
 	}
+	counter = fw_sum16_fold(sum.sum);
 	if (size > 0) {
 		counter += *(uint8_t *) ptr;
 		counter -= 0xFF;
@@ -79,13 +91,14 @@ int get_file_stat(struct file_info *fdata)
 	if (fdata->file_name == NULL)
 		return 0;
 
-	res = stat(fdata->file_name, &st);
+	res = fw_io_stat_input(fdata->file_name, &st);
 	if (res) {
 		ERRS("stat failed on %s", fdata->file_name);
 		return res;
 	}
 
 	fdata->file_size = st.st_size;
+
 	return 0;
 }
 
@@ -101,6 +114,8 @@ int read_to_buf(const struct file_info *fdata, char *buf)
 		goto out;
 	}
 
+	fw_io_advise(fileno(f), 0, fdata->file_size);
+
 	read = fread(buf, fdata->file_size, 1, f);
 	if (ferror(f) || read != 1) {
 		ERRS("unable to read from file \"%s\"", fdata->file_name);
@@ -115,33 +130,76 @@ int read_to_buf(const struct file_info *fdata, char *buf)
 	return ret;
 }
 
-int write_fw(const char *ofname, const char *data, int len)
+int map_file(const struct file_info *fdata, struct fw_io_map *map)
 {
-	FILE *f;
+	int fd, err;
+
+	fd = open(fdata->file_name, O_RDONLY);
+	if (fd < 0) {
+		ERRS("could not open \"%s\" for reading", fdata->file_name);
+		return EXIT_FAILURE;
+	}
+
+	err = fw_io_map(map, fd, 0, fdata->file_size);
+	close(fd);
+	if (err) {
+		errno = -err;
+		ERRS("unable to map file \"%s\"", fdata->file_name);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int write_fw_iov(const char *ofname, struct iovec *iov, int cnt)
+{
+	int fd;
 	int ret = EXIT_FAILURE;
+	ssize_t n;
 
-	f = fopen(ofname, "w");
-	if (f == NULL) {
+	fd = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
 		ERRS("could not open \"%s\" for writing", ofname);
 		goto out;
 	}
 
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
+	while (cnt) {
+		n = writev(fd, iov, cnt);
+		if (n < 0) {
+			ERRS("unable to write output file");
+			goto out_close;
+		}
+
+		/* Pick up after a short write */
+		for (; cnt && (size_t)n >= iov->iov_len; cnt--, iov++)
+			n -= iov->iov_len;
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
 	}
 
 	DBG("firmware file \"%s\" completed", ofname);
 
 	ret = EXIT_SUCCESS;
 
- out_flush:
-	fflush(f);
-	fclose(f);
+ out_close:
+	if (close(fd) && ret == EXIT_SUCCESS) {
+		ERRS("unable to write output file");
+		ret = EXIT_FAILURE;
+	}
 	if (ret != EXIT_SUCCESS)
 		unlink(ofname);
  out:
 	return ret;
 }
+
+int write_fw(const char *ofname, const char *data, int len)
+{
+	struct iovec iov = {
+		.iov_base = (void *)data,
+		.iov_len = len,
+	};
+
+	return write_fw_iov(ofname, &iov, 1);
+}
@@ -66,6 +66,9 @@
 	fprintf(stderr, "[%s] " fmt "\n", progname, ## __VA_ARGS__); \
 } while (0)
 
+struct fw_io_map;
+struct iovec;
+
 struct file_info {
 	char *file_name;	/* name of the file */
 	uint32_t file_size;	/* length of the file */
@@ -75,6 +78,8 @@ uint32_t jboot_timestamp(void);
 uint16_t jboot_checksum(uint16_t start_val, uint16_t *data, int size);
 int get_file_stat(struct file_info *fdata);
 int read_to_buf(const struct file_info *fdata, char *buf);
+int map_file(const struct file_info *fdata, struct fw_io_map *map);
 int write_fw(const char *ofname, const char *data, int len);
+int write_fw_iov(const char *ofname, struct iovec *iov, int cnt);
 
 #endif				/* mkdlinkfw_lib_h */
@@ -21,8 +21,15 @@
 #include <endian.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <zlib.h>		/*for crc32 */
 
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_mem.h"
+#include "fw_pool.h"
+#include "fw_scan.h"
+#include "fw_sum.h"
 #include "mkdlinkfw-lib.h"
 
 /* ARM update header 2.0
@@ -218,43 +225,61 @@ void print_sch2_header(struct sch2_header *printed_header)
 	       printed_header->header_length, printed_header->cmd_line_length);
 }
 
+struct auh_scan {
+	char *buf;
+	struct auh_header *headers[MAX_HEADER_COUNTER];
+	int header_counter;
+};
+
+static int auh_scan_match(void *priv, unsigned int pattern, size_t offset)
+{
+	struct auh_scan *scan = priv;
+	char *tmp_buf = scan->buf + offset;
+	struct auh_header *header = (struct auh_header *)tmp_buf;
+	uint16_t checksum;
+
+	if (offset + AUH_SIZE > inspect_info.file_size)
+		return 1;
+
+	if (header->header_checksum !=
+	    (uint16_t) ~jboot_checksum(0, (uint16_t *) tmp_buf, AUH_SIZE - 2))
+		return 0;
+
+	/* One more than fits is reported as too many */
+	if (scan->header_counter == MAX_HEADER_COUNTER) {
+		scan->header_counter++;
+		return 1;
+	}
+
+	printf("Find proper AUH header at: 0x%zX!\n", offset);
+	scan->headers[scan->header_counter++] = header;
+
+	checksum = jboot_checksum(0, (uint16_t *) (tmp_buf + AUH_SIZE),
+				  header->data_length);
+	if (header->image_checksum == checksum)
+		printf("Image checksum ok.\n");
+	else
+		ERR("Image checksum incorrect! Stored: 0x%X Calculated: 0x%X\n", header->image_checksum, checksum);
+
+	return 0;
+}
+
 static int find_auh_headers(char *buf)
 {
-	char *tmp_buf = buf;
-	struct auh_header *tmp_header[MAX_HEADER_COUNTER];
-	int header_counter = 0;
+	static const struct fw_scan_pattern auh_pattern = {
+		.magic = AUH_MAGIC,
+		.len = 3,
+	};
+	struct auh_scan scan = {
+		.buf = buf,
+	};
+	struct auh_header **tmp_header = scan.headers;
+	int header_counter;
 
 	int ret = EXIT_FAILURE;
 
-	while (tmp_buf - buf <= inspect_info.file_size - AUH_SIZE) {
-		if (!memcmp(tmp_buf, AUH_MAGIC, 3)) {
-			if (((struct auh_header *)tmp_buf)->header_checksum ==
-			    (uint16_t) ~jboot_checksum(0, (uint16_t *) tmp_buf,
-							AUH_SIZE - 2)) {
-				uint16_t checksum = 0;
-				printf("Find proper AUH header at: 0x%lX!\n",
-				       tmp_buf - buf);
-				tmp_header[header_counter] =
-				    (struct auh_header *)tmp_buf;
-				checksum =
-				    jboot_checksum(0, (uint16_t *) ((char *)
-								    tmp_header
-								    [header_counter]
-								    + AUH_SIZE),
-						   tmp_header
-						   [header_counter]->data_length);
-				if (tmp_header[header_counter]->image_checksum
-				    == checksum)
-					printf("Image checksum ok.\n");
-				else
-					ERR("Image checksum incorrect! Stored: 0x%X Calculated: 0x%X\n", tmp_header[header_counter]->image_checksum, checksum);
-				header_counter++;
-				if (header_counter > MAX_HEADER_COUNTER)
-					break;
-			}
-		}
-		tmp_buf++;
-	}
+	fw_scan(buf, inspect_info.file_size, &auh_pattern, 1, auh_scan_match, &scan);
+	header_counter = scan.header_counter;
 
 	if (header_counter == 0)
 		ERR("Can't find proper AUH header!\n");
@@ -342,7 +367,7 @@ static int inspect_fw(void)
 	struct sch2_header *sch2_header_kernel;
 	int ret = EXIT_FAILURE;
 
-	buf = malloc(inspect_info.file_size);
+	buf = fw_mem_alloc(inspect_info.file_size);
 	if (!buf) {
 		ERR("no memory for buffer!\n");
 		goto out;
@@ -369,7 +394,7 @@ static int inspect_fw(void)
 		goto out_free_buf;
 
  out_free_buf:
-	free(buf);
+	fw_mem_free(buf, inspect_info.file_size);
  out:
 	return ret;
 }
@@ -389,7 +414,42 @@ static int check_options(void)
 	return 0;
 }
 
-int fill_sch2(struct sch2_header *header, char *kernel_ptr, char *rootfs_ptr)
+/* What build_fw() needs from the kernel and rootfs, worked out concurrently */
+enum {
+	SUM_KERNEL_CRC,
+	SUM_ROOTFS_CRC,
+	SUM_KERNEL_JBOOT,
+	SUM_COUNT
+};
+
+struct build_sums {
+	const uint8_t *kernel;
+	const uint8_t *rootfs;
+	uint32_t val[SUM_COUNT];
+};
+
+static void build_sum(void *arg, unsigned int idx)
+{
+	struct build_sums *sums = arg;
+
+	switch (idx) {
+	case SUM_KERNEL_CRC:
+		sums->val[idx] = ~fw_crc32(~0, sums->kernel,
+					   kernel_info.file_size);
+		break;
+	case SUM_ROOTFS_CRC:
+		sums->val[idx] = ~fw_crc32(~0, sums->rootfs,
+					   rootfs_info.file_size);
+		break;
+	case SUM_KERNEL_JBOOT:
+		/* The whole words only, the stag checksum adds the sch2 header */
+		sums->val[idx] = jboot_checksum(0, (uint16_t *) sums->kernel,
+						kernel_info.file_size & ~1);
+		break;
+	}
+}
+
+int fill_sch2(struct sch2_header *header, const struct build_sums *sums)
 {
 
 	header->magic = SCH2_MAGIC;
@@ -397,12 +457,12 @@ int fill_sch2(struct sch2_header *header, char *kernel_ptr, char *rootfs_ptr)
 	header->version = SCH2_VER;
 	header->ram_addr = RAM_LOAD_ADDR;
 	header->image_len = kernel_info.file_size;
-	header->image_crc32 = crc32(0, (uint8_t *) kernel_ptr, kernel_info.file_size);
+	header->image_crc32 = sums->val[SUM_KERNEL_CRC];
 	header->start_addr = RAM_ENTRY_ADDR;
 	header->rootfs_addr =
 	    image_offset + STAG_SIZE + SCH2_SIZE + kernel_info.file_size;
 	header->rootfs_len = rootfs_info.file_size;
-	header->rootfs_crc32 = crc32(0, (uint8_t *) rootfs_ptr, rootfs_info.file_size);
+	header->rootfs_crc32 = sums->val[SUM_ROOTFS_CRC];
 	header->header_crc32 = 0;
 	header->header_length = SCH2_SIZE;
 	header->cmd_line_length = 0;
@@ -412,16 +472,29 @@ int fill_sch2(struct sch2_header *header, char *kernel_ptr, char *rootfs_ptr)
 	return EXIT_SUCCESS;
 }
 
-int fill_stag(struct stag_header *header, uint32_t length)
+/*
+ * The image checksum covers the sch2 header and the kernel behind it. Word
+ * sums add up in any order, so the kernel's whole words come from
+ * build_sum() and only a trailing odd byte is left to go in here.
+ */
+int fill_stag(struct stag_header *header, struct sch2_header *sch2,
+	      const struct build_sums *sums)
 {
+	uint32_t length = kernel_info.file_size;
+	uint16_t checksum;
+
+	checksum = jboot_checksum(0, (uint16_t *) sch2, SCH2_SIZE);
+	checksum = fw_sum16_fold(checksum + sums->val[SUM_KERNEL_JBOOT]);
+	checksum = jboot_checksum(checksum,
+				  (uint16_t *) (sums->kernel + (length & ~1)),
+				  length & 1);
+
 	header->cmark = STAG_ID;
 	header->id = STAG_ID;
 	header->magic = STAG_MAGIC;
 	header->time_stamp = jboot_timestamp();
 	header->image_length = length + SCH2_SIZE;
-	header->image_checksum =
-	    jboot_checksum(0, (uint16_t *) ((char *)header + STAG_SIZE),
-			   header->image_length);
+	header->image_checksum = checksum;
 	header->tag_checksum =
 	    ~jboot_checksum(0, (uint16_t *) header, STAG_SIZE - 2);
 
@@ -431,12 +504,12 @@ int fill_stag(struct stag_header *header, uint32_t length)
 	return EXIT_SUCCESS;
 };
 
-int fill_auh(struct auh_header *header, uint32_t length)
+int fill_auh(struct auh_header *header, const uint8_t *image, uint32_t length)
 {
 	memcpy(header->rom_id, rom_id, 12);
 	header->derange = 0;
 	header->image_checksum =
-	    jboot_checksum(0, (uint16_t *) ((char *)header + AUH_SIZE), length);
+	    jboot_checksum(0, (uint16_t *) image, length);
 	header->space1 = 0;
 	header->space2 = 0;
 	header->space3 = 0;
@@ -466,14 +539,13 @@ int fill_auh(struct auh_header *header, uint32_t length)
 
 int build_fw(void)
 {
-	char *buf;
-	char *kernel_ptr;
-	char *rootfs_ptr;
+	struct fw_io_map kernel, rootfs;
+	struct build_sums sums;
+	struct iovec iov[4];
 	int ret = EXIT_FAILURE;
-	int writelen;
 
-	struct stag_header *stag_header_kernel;
-	struct sch2_header *sch2_header_kernel;
+	struct stag_header stag_header_kernel;
+	struct sch2_header sch2_header_kernel;
 
 	if (!kernel_info.file_name | !rootfs_info.file_name)
 		goto out;
@@ -485,61 +557,54 @@ int build_fw(void)
 	if (ret)
 		goto out;
 
-	buf = malloc(firmware_size);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto out;
-	}
-
 	if (rootfs_info.file_size + kernel_info.file_size + ALL_HEADERS_SIZE >
 	    firmware_size) {
 		ERR("data is bigger than firmware_size!\n");
+		ret = EXIT_FAILURE;
 		goto out;
 	}
 
-	memset(buf, 0xff, firmware_size);
-
-	stag_header_kernel = (struct stag_header *)buf;
-
-	sch2_header_kernel =
-	    (struct sch2_header *)((char *)stag_header_kernel + STAG_SIZE);
-	kernel_ptr = (char *)sch2_header_kernel + SCH2_SIZE;
-
-	ret = read_to_buf(&kernel_info, kernel_ptr);
+	ret = map_file(&kernel_info, &kernel);
 	if (ret)
-		goto out_free_buf;
-
-	rootfs_ptr = kernel_ptr + kernel_info.file_size;
-
-	ret = read_to_buf(&rootfs_info, rootfs_ptr);
-	if (ret)
-		goto out_free_buf;
-
-	writelen = rootfs_ptr + rootfs_info.file_size - buf;
-
-	fill_sch2(sch2_header_kernel, kernel_ptr, rootfs_ptr);
-	fill_stag(stag_header_kernel, kernel_info.file_size);
+		goto out;
 
-	ret = write_fw(ofname, buf, writelen);
+	ret = map_file(&rootfs_info, &rootfs);
 	if (ret)
-		goto out_free_buf;
-
-	ret = EXIT_SUCCESS;
-
- out_free_buf:
-	free(buf);
+		goto out_unmap_kernel;
+
+	sums.kernel = kernel.data;
+	sums.rootfs = rootfs.data;
+	fw_pool_run(SUM_COUNT, build_sum, &sums);
+
+	memset(&sch2_header_kernel, 0, sizeof(sch2_header_kernel));
+	fill_sch2(&sch2_header_kernel, &sums);
+	fill_stag(&stag_header_kernel, &sch2_header_kernel, &sums);
+
+	iov[0].iov_base = &stag_header_kernel;
+	iov[0].iov_len = STAG_SIZE;
+	iov[1].iov_base = &sch2_header_kernel;
+	iov[1].iov_len = SCH2_SIZE;
+	iov[2].iov_base = (void *)kernel.data;
+	iov[2].iov_len = kernel_info.file_size;
+	iov[3].iov_base = (void *)rootfs.data;
+	iov[3].iov_len = rootfs_info.file_size;
+
+	ret = write_fw_iov(ofname, iov, 4);
+
+	fw_io_unmap(&rootfs);
+ out_unmap_kernel:
+	fw_io_unmap(&kernel);
  out:
 	return ret;
 }
 
 int wrap_fw(void)
 {
-	char *buf;
-	char *image_ptr;
+	struct fw_io_map image;
+	struct iovec iov[2];
 	int ret = EXIT_FAILURE;
-	int writelen;
 
-	struct auh_header *auh_header_kernel;
+	struct auh_header auh_header_kernel;
 
 	if (!image_info.file_name)
 		goto out;
@@ -548,12 +613,7 @@ int wrap_fw(void)
 	if (ret)
 		goto out;
 
-	buf = malloc(firmware_size);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto out;
-	}
-
+	ret = EXIT_FAILURE;
 	if (image_info.file_size + AUH_SIZE >
 	    firmware_size) {
 		ERR("data is bigger than firmware_size!\n");
@@ -567,27 +627,21 @@ int wrap_fw(void)
 		ERR("No rom_id!\n");
 		goto out;
 	}
-	memset(buf, 0xff, firmware_size);
-
-	image_ptr = (char *)(buf + AUH_SIZE);
 
-	ret = read_to_buf(&image_info, image_ptr);
+	ret = map_file(&image_info, &image);
 	if (ret)
-		goto out_free_buf;
-
-	writelen = image_ptr + image_info.file_size - buf;
+		goto out;
 
-	auh_header_kernel = (struct auh_header *)buf;
-	fill_auh(auh_header_kernel, writelen - AUH_SIZE);
+	fill_auh(&auh_header_kernel, image.data, image_info.file_size);
 
-	ret = write_fw(ofname, buf, writelen);
-	if (ret)
-		goto out_free_buf;
+	iov[0].iov_base = &auh_header_kernel;
+	iov[0].iov_len = AUH_SIZE;
+	iov[1].iov_base = (void *)image.data;
+	iov[1].iov_len = image_info.file_size;
 
-	ret = EXIT_SUCCESS;
+	ret = write_fw_iov(ofname, iov, 2);
 
- out_free_buf:
-	free(buf);
+	fw_io_unmap(&image);
  out:
 	return ret;
 }
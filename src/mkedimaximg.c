@@ -13,6 +13,8 @@
 #include <sys/stat.h>
 #include <endian.h>	/* for __BYTE_ORDER */
 
+#include "fw_sum.h"
+
 #define FALSE 0
 #define TRUE 1
 
@@ -85,17 +87,16 @@ static int strtou32(char *arg, unsigned int *val)
 }
 
 static unsigned short fwcsum (struct buf *buf) {
-    int i;
-    unsigned short ret = 0;
-
-    for (i = 0; i < buf->size / 2; i++) {
-	if (force_be == FALSE)
-	    ret -= ((unsigned short *) buf->start)[i];
-	else
-	    ret -= HOST_TO_BE16(((unsigned short *) buf->start)[i]);
-    }
-    
-    return ret;
+    struct fw_sum sum;
+
+    /* negated sum of the whole 16-bit words, an odd trailing byte is ignored */
+    fw_sum_init(&sum);
+    if (force_be == FALSE)
+	fw_sum16_le_update(&sum, buf->start, buf->size & ~1);
+    else
+	fw_sum16_be_update(&sum, buf->start, buf->size & ~1);
+
+    return -(unsigned short) sum.sum;
 }
 
 static int fwread(struct finfo *finfo, struct buf *buf)
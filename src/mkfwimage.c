@@ -199,21 +199,21 @@ static void write_header(void* mem, const char *magic, const char* version)
 	header->pad = 0L;
 }
 
-static void write_signature(void* mem, u_int32_t sig_offset)
+static void write_signature(void* mem, uLong crc)
 {
 	/* write signature */
-	signature_t* sign = (signature_t*)(mem + sig_offset);
+	signature_t* sign = mem;
 	memset(sign, 0, sizeof(signature_t));
 
 	FW_MEMCPY_STR(sign->magic, MAGIC_END);
-	sign->crc = htonl(crc32(0L,(unsigned char *)mem, sig_offset));
+	sign->crc = htonl(crc);
 	sign->pad = 0L;
 }
 
-static void write_signature_rsa(void* mem, u_int32_t sig_offset)
+static void write_signature_rsa(void* mem)
 {
 	/* write signature */
-	signature_rsa_t* sign = (signature_rsa_t*)(mem + sig_offset);
+	signature_rsa_t* sign = mem;
 	memset(sign, 0, sizeof(signature_rsa_t));
 
 	FW_MEMCPY_STR(sign->magic, MAGIC_ENDS);
@@ -221,12 +221,47 @@ static void write_signature_rsa(void* mem, u_int32_t sig_offset)
 	sign->pad = 0L;
 }
 
-static int write_part(void* mem, part_data_t* d)
+/*
+ * Append len bytes to the image and fold them into the running signature
+ * CRC. Returns 0 or -1 on a short write.
+ */
+static int write_out(FILE* f, const void* buf, size_t len, uLong* sig_crc)
+{
+	*sig_crc = crc32(*sig_crc, buf, len);
+	return fwrite(buf, len, 1, f) == 1 ? 0 : -1;
+}
+
+/* Stand-in for a part whose file couldn't be read: all zeroes */
+static int write_zero_part(FILE* f, part_data_t* d, uLong* sig_crc)
+{
+	static const char zero[4096];
+	size_t left = sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
+
+	while (left) {
+		size_t n = left < sizeof(zero) ? left : sizeof(zero);
+
+		if (write_out(f, zero, n, sig_crc))
+			return -1;
+		left -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Stream one part: header, payload straight from the mapped file and its
+ * CRC. The payload is checksummed once; the signature CRC picks it up with
+ * crc32_combine() instead of a second pass.
+ */
+static int write_part(FILE* f, part_data_t* d, uLong* sig_crc, int* werr)
 {
 	char* addr;
 	int fd;
-	part_t* p = mem;
-	part_crc_t* crc = mem + sizeof(part_t) + d->stats.st_size;
+	part_t p;
+	part_crc_t crc;
+	uLong c;
+
+	*werr = 0;
 
 	fd = open(d->filename, O_RDONLY);
 	if (fd < 0)
@@ -241,23 +276,33 @@ static int write_part(void* mem, part_data_t* d)
 		close(fd);
 		return -2;
 	}
-
-	memcpy(mem + sizeof(part_t), addr, d->stats.st_size);
+	close(fd);
+	madvise(addr, d->stats.st_size, MADV_SEQUENTIAL);
+
+	memset(&p, 0, sizeof(p));
+	FW_MEMCPY_STR(p.magic, MAGIC_PART);
+	FW_MEMCPY_STR(p.name, d->partition_name);
+
+	p.index = htonl(d->partition_index);
+	p.data_size = htonl(d->stats.st_size);
+	p.part_size = htonl(d->partition_length);
+	p.baseaddr = htonl(d->partition_baseaddr);
+	p.memaddr = htonl(d->partition_memaddr);
+	p.entryaddr = htonl(d->partition_entryaddr);
+
+	c = crc32(crc32(0L, (uint8_t*) &p, sizeof(p)), (uint8_t*) addr,
+		  d->stats.st_size);
+	crc.crc = htonl(c);
+	crc.pad = 0L;
+
+	if (fwrite(&p, sizeof(p), 1, f) != 1 ||
+	    fwrite(addr, d->stats.st_size, 1, f) != 1)
+		*werr = -1;
 	munmap(addr, d->stats.st_size);
+	*sig_crc = crc32_combine(*sig_crc, c, sizeof(p) + d->stats.st_size);
 
-	memset(p->name, 0, PART_NAME_LENGTH);
-	FW_MEMCPY_STR(p->magic, MAGIC_PART);
-	FW_MEMCPY_STR(p->name, d->partition_name);
-
-	p->index = htonl(d->partition_index);
-	p->data_size = htonl(d->stats.st_size);
-	p->part_size = htonl(d->partition_length);
-	p->baseaddr = htonl(d->partition_baseaddr);
-	p->memaddr = htonl(d->partition_memaddr);
-	p->entryaddr = htonl(d->partition_entryaddr);
-
-	crc->crc = htonl(crc32(0L, mem, d->stats.st_size + sizeof(part_t)));
-	crc->pad = 0L;
+	if (!*werr)
+		*werr = write_out(f, &crc, sizeof(crc), sig_crc);
 
 	return 0;
 }
@@ -400,13 +445,14 @@ static int validate_image_layout(image_info_t* im)
 
 static int build_image(image_info_t* im)
 {
-	char* mem;
-	char* ptr;
+	header_t header;
 	u_int32_t mem_size;
+	uLong sig_crc = 0L;
 	FILE* f;
 	unsigned int i;
+	int err = 0;
 
-	// build in-memory buffer
+	// size of the whole image
 	mem_size = sizeof(header_t);
 	if(im->fwinfo->sign) {
 		mem_size += sizeof(signature_rsa_t);
@@ -419,53 +465,49 @@ static int build_image(image_info_t* im)
 		mem_size += sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
 	}
 
-	mem = (char*)calloc(mem_size, 1);
-	if (mem == NULL)
+	if ((f = fopen(im->outputfile, "w")) == NULL)
 	{
-		ERROR("Cannot allocate memory chunk of size '%u'\n", mem_size);
-		return -1;
+		ERROR("Can not create output file: '%s'\n", im->outputfile);
+		return -10;
 	}
 
 	// write header
-	write_header(mem, im->magic, im->version);
-	ptr = mem + sizeof(header_t);
-	// write all parts
-	for (i = 0; i < im->part_count; ++i)
+	write_header(&header, im->magic, im->version);
+	err = write_out(f, &header, sizeof(header), &sig_crc);
+	// write all parts, one after the other
+	for (i = 0; i < im->part_count && !err; ++i)
 	{
 		part_data_t* d = &im->parts[i];
 		int rc;
-		if ((rc = write_part(ptr, d)) != 0)
+		if ((rc = write_part(f, d, &sig_crc, &err)) != 0)
 		{
 			ERROR("ERROR: failed writing part %u '%s'\n", i, d->partition_name);
+			err = write_zero_part(f, d, &sig_crc);
 		}
-		ptr += sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
 	}
 	// write signature
-	if(im->fwinfo->sign) {
-		write_signature_rsa(mem, mem_size - sizeof(signature_rsa_t));
-	} else {
-		write_signature(mem, mem_size - sizeof(signature_t));
-	}
+	if (!err && im->fwinfo->sign) {
+		signature_rsa_t sign;
 
-	// write in-memory buffer into file
-	if ((f = fopen(im->outputfile, "w")) == NULL)
-	{
-		ERROR("Can not create output file: '%s'\n", im->outputfile);
-		free(mem);
-		return -10;
+		write_signature_rsa(&sign);
+		err = write_out(f, &sign, sizeof(sign), &sig_crc);
+	} else if (!err) {
+		signature_t sign;
+
+		write_signature(&sign, sig_crc);
+		err = write_out(f, &sign, sizeof(sign), &sig_crc);
 	}
 
-	if (fwrite(mem, mem_size, 1, f) != 1)
+	if (fclose(f))
+		err = -1;
+
+	if (err)
 	{
 		ERROR("Could not write %d bytes into file: '%s'\n",
 				mem_size, im->outputfile);
-		free(mem);
-		fclose(f);
 		return -11;
 	}
 
-	free(mem);
-	fclose(f);
 	return 0;
 }
 
@@ -66,23 +66,40 @@ static void write_header(void* mem, const char* version)
 	header->pad = 0L;
 }
 
-static void write_signature(void* mem, u_int32_t sig_offset)
+static void write_signature(void* mem, uLong crc)
 {
 	/* write signature */
-	signature_t* sign = (signature_t*)(mem + sig_offset);
+	signature_t* sign = mem;
 	memset(sign, 0, sizeof(signature_t));
 
 	memcpy(sign->magic, MAGIC_END, MAGIC_LENGTH);
-	sign->crc = htonl(crc32(0L,(unsigned char *)mem, sig_offset));
+	sign->crc = htonl(crc);
 	sign->pad = 0L;
 }
 
-static int write_part(void* mem, part_data_t* d)
+/*
+ * Append len bytes to the image and fold them into the running signature
+ * CRC. Returns 0 or -1 on a short write.
+ */
+static int write_out(FILE* f, const void* buf, size_t len, uLong* sig_crc)
+{
+	*sig_crc = crc32(*sig_crc, buf, len);
+	return fwrite(buf, len, 1, f) == 1 ? 0 : -1;
+}
+
+/*
+ * Stream one part: header, payload straight from the mapped file and its
+ * CRC. The payload is checksummed once; the signature CRC picks it up with
+ * crc32_combine() instead of a second pass.
+ */
+static int write_part(FILE* f, part_data_t* d, uLong* sig_crc)
 {
 	char* addr;
 	int fd;
-	part_t* p = mem;
-	part_crc_t* crc = mem + sizeof(part_t) + d->stats.st_size;
+	part_t p;
+	part_crc_t crc;
+	uLong c;
+	int err = 0;
 
 	fd = open(d->filename, O_RDONLY);
 	if (fd < 0) {
@@ -95,24 +112,34 @@ static int write_part(void* mem, part_data_t* d)
 		close(fd);
 		return -2;
 	}
-
-	memcpy(mem + sizeof(part_t), addr, d->stats.st_size);
+	close(fd);
+	madvise(addr, d->stats.st_size, MADV_SEQUENTIAL);
+
+	memset(&p, 0, sizeof(p));
+	memcpy(p.magic, MAGIC_PART, MAGIC_LENGTH);
+	strncpy(p.name, d->partition_name, sizeof(p.name));
+	p.index = htonl(d->partition_index);
+	p.data_size = htonl(d->stats.st_size);
+	p.part_size = htonl(d->partition_length);
+	p.baseaddr = htonl(d->partition_baseaddr);
+	p.memaddr = htonl(d->partition_memaddr);
+	p.entryaddr = htonl(d->partition_entryaddr);
+
+	c = crc32(crc32(0L, (unsigned char *)&p, sizeof(p)),
+		  (unsigned char *)addr, d->stats.st_size);
+	crc.crc = htonl(c);
+	crc.pad = 0L;
+
+	if (fwrite(&p, sizeof(p), 1, f) != 1 ||
+	    fwrite(addr, d->stats.st_size, 1, f) != 1)
+		err = -3;
 	munmap(addr, d->stats.st_size);
+	*sig_crc = crc32_combine(*sig_crc, c, sizeof(p) + d->stats.st_size);
 
-	memset(p->name, 0, sizeof(p->name));
-	strncpy(p->magic, MAGIC_PART, MAGIC_LENGTH);
-	strncpy(p->name, d->partition_name, sizeof(p->name));
-	p->index = htonl(d->partition_index);
-	p->data_size = htonl(d->stats.st_size);
-	p->part_size = htonl(d->partition_length);
-	p->baseaddr = htonl(d->partition_baseaddr);
-	p->memaddr = htonl(d->partition_memaddr);
-	p->entryaddr = htonl(d->partition_entryaddr);
-
-	crc->crc = htonl(crc32(0L, mem, d->stats.st_size + sizeof(part_t)));
-	crc->pad = 0L;
+	if (!err && write_out(f, &crc, sizeof(crc), sig_crc))
+		err = -3;
 
-	return 0;
+	return err;
 }
 
 static void usage(const char* progname)
@@ -308,62 +335,62 @@ static int image_layout_verify(void)
 
 static int build_image(void)
 {
-	char* mem;
-	char* ptr;
+	header_t header;
+	signature_t sign;
 	u_int32_t mem_size;
+	uLong sig_crc = 0L;
 	FILE* f;
 	int i;
 
-	/* build in-memory buffer */
+	/* size of the whole image */
 	mem_size = sizeof(header_t) + sizeof(signature_t);
 	for (i = 0; i < im.part_count; ++i) {
 		part_data_t* d = &im.parts[i];
 		mem_size += sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
 	}
 
-	mem = (char*)calloc(mem_size, 1);
-	if (mem == NULL) {
-		ERROR("Cannot allocate memory chunk of size '%u'\n", mem_size);
-		return -1;
+	if ((f = fopen(im.outputfile, "w")) == NULL) {
+		ERROR("Can not create output file: '%s'\n", im.outputfile);
+		return -10;
 	}
 
 	/* write header */
-	write_header(mem, im.version);
-	ptr = mem + sizeof(header_t);
+	write_header(&header, im.version);
+	if (write_out(f, &header, sizeof(header), &sig_crc))
+		goto err_write;
 
-	/* write all parts */
+	/* write all parts, one after the other */
 	for (i = 0; i < im.part_count; ++i) {
 		part_data_t* d = &im.parts[i];
 		int rc;
-		if ((rc = write_part(ptr, d)) != 0) {
+		if ((rc = write_part(f, d, &sig_crc)) == -3)
+			goto err_write;
+		if (rc != 0) {
 			ERROR("ERROR: failed writing part %u '%s'\n", i, d->partition_name);
+			fclose(f);
+			unlink(im.outputfile);
 			return -1;
 		}
-		ptr += sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
 	}
 
-
 	/* write signature */
-	write_signature(mem, mem_size - sizeof(signature_t));
+	write_signature(&sign, sig_crc);
+	if (write_out(f, &sign, sizeof(sign), &sig_crc))
+		goto err_write;
 
-	/* write in-memory buffer into file */
-	if ((f = fopen(im.outputfile, "w")) == NULL) {
-		ERROR("Can not create output file: '%s'\n", im.outputfile);
-		free(mem);
-		return -10;
+	if (fclose(f)) {
+		f = NULL;
+		goto err_write;
 	}
 
-	if (fwrite(mem, mem_size, 1, f) != 1) {
-		ERROR("Could not write %d bytes into file: '%s'\n",
-				mem_size, im.outputfile);
-		free(mem);
-		fclose(f);
-		return -11;
-	}
-
-	free(mem);
-	fclose(f);
 	return 0;
+
+err_write:
+	ERROR("Could not write %d bytes into file: '%s'\n",
+			mem_size, im.outputfile);
+	if (f)
+		fclose(f);
+	return -11;
 }
 
 int main(int argc, char* argv[])
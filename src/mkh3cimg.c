@@ -4,12 +4,17 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <byteswap.h>
 #include <endian.h>
 #include <getopt.h>
 
+#include "fw_crc16.h"
+#include "fw_io.h"
+
 
 #if !defined(__BYTE_ORDER)
 #error "Unknown byte order"
@@ -114,21 +119,39 @@ struct image_header {
 } __attribute__ ((packed));
 
 
-static void *buf;
+#define HEADERS_LEN	(sizeof(struct image_header) + sizeof(struct file_header))
+
+/* Both headers; the payload is copied from the input file behind them */
+static uint8_t headers[HEADERS_LEN];
+static void *buf = headers;
 static size_t buflen;
 
 static size_t length_unpadded;
 static size_t length;
 
-
-static uint32_t crc16_xmodem(char *buf, size_t len) {
+static const uint8_t padding[8];
+
+/*
+ * CRC-16/XMODEM the way the H3C tooling computes it: every byte goes into
+ * a 32-bit register sign-extended, which leaves bits above 15 set that end
+ * up in the 32-bit CRC fields. Those only survive from the last two bytes
+ * of a run, so fw_crc16() takes the rest and the original bit loop just
+ * the tail.
+ */
+static uint32_t crc16_xmodem(uint32_t crc, const void *data, size_t len) {
+	const char *p = data;
 	uint32_t poly = 0x1021;
-	uint32_t crc = 0;
 	char b;
-	int i, j;
+	int j;
 
-	for (i = 0; i < len; i++) {
-		b = buf[i];
+	if (len > 2) {
+		crc = fw_crc16(crc, p, len - 2);
+		p += len - 2;
+		len = 2;
+	}
+
+	for (; len; len--) {
+		b = *p++;
 		crc = crc ^ (b << 8);
 
 		for (j = 0; j < 8; j++) {
@@ -142,50 +165,15 @@ static uint32_t crc16_xmodem(char *buf, size_t len) {
 	return crc;
 }
 
-static int create_buffer_and_read_file(char *filename) {
-	FILE *f;
-
-	f = fopen(filename, "r");
-	if (f == NULL) {
-		fprintf(stderr, "failed to open input file\n");
-		goto err;
-	}
-
-	fseek(f, 0L, SEEK_END);
-	length_unpadded = ftell(f);
-	rewind(f);
-
-	length = length_unpadded;
-	if (length_unpadded % 8 != 0) {
-		length += 8 - length_unpadded % 8;
-	}
-
-	buflen = sizeof(struct file_header) + sizeof(struct image_header) + length;
-	buf = malloc(buflen);
-	if (!buf) {
-		fprintf(stderr, "failed to allocate buffer\n");
-		goto err_close;
-	}
-
-	memset(buf, 0, buflen);
+/* The payload with its zero padding up to length */
+static uint32_t crc16_xmodem_payload(uint32_t crc, const void *data) {
+	crc = crc16_xmodem(crc, data, length_unpadded);
 
-	if (fread(buf + sizeof(struct file_header) + sizeof(struct image_header), length_unpadded, 1, f) != 1) {
-		fprintf(stderr, "failed to read input file\n");
-		goto err_free;
-	}
-
-	fclose(f);
-	return 0;
-
-err_free:
-	free(buf);
-err_close:
-	fclose(f);
-err:
-	return -1;
+	return crc16_xmodem(crc, padding, length - length_unpadded);
 }
 
-static void build_file_header(uint32_t product_id, uint32_t device_id, uint32_t compression_type) {
+static void build_file_header(uint32_t product_id, uint32_t device_id, uint32_t compression_type,
+			      const void *data) {
 	struct file_header *header = buf + sizeof(struct image_header);
 	uint32_t crc;
 
@@ -211,17 +199,17 @@ static void build_file_header(uint32_t product_id, uint32_t device_id, uint32_t
 
 	header->length = cpu_to_be32(length);
 
-	crc = crc16_xmodem(buf + sizeof(struct image_header) + sizeof(struct file_header), length);
+	crc = crc16_xmodem_payload(0, data);
 	header->file_crc = cpu_to_be32(crc);
 
 	header->compression_type = cpu_to_be32(compression_type);
 
-	crc = crc16_xmodem((char *)header + sizeof(header->res1) + sizeof(header->header_crc),
+	crc = crc16_xmodem(0, (char *)header + sizeof(header->res1) + sizeof(header->header_crc),
 		sizeof(struct file_header) - sizeof(header->res1) - sizeof(header->header_crc));
 	header->header_crc = cpu_to_be32(crc);
 }
 
-static void build_image_header(uint32_t product_id, uint32_t device_id) {
+static void build_image_header(uint32_t product_id, uint32_t device_id, const void *data) {
 	struct image_header *header = buf;
 	struct file_header *file_header = buf + sizeof(struct image_header);
 	uint32_t crc;
@@ -240,7 +228,8 @@ static void build_image_header(uint32_t product_id, uint32_t device_id) {
 	header->minute = 0;
 	header->second = 0;
 
-	crc = crc16_xmodem(buf + sizeof(struct file_header), buflen - sizeof(struct file_header));
+	crc = crc16_xmodem(0, buf + sizeof(struct file_header), HEADERS_LEN - sizeof(struct file_header));
+	crc = crc16_xmodem_payload(crc, data);
 	header->package_crc = cpu_to_be16(crc);
 	header->package_flag = cpu_to_be16(PACKAGE_FLAG);
 
@@ -253,28 +242,61 @@ static void build_image_header(uint32_t product_id, uint32_t device_id) {
 	header->files[0].version = file_header->version;
 	header->files[0].type_mask = cpu_to_be32(FILE_TYPE_MASK);
 
-	crc = crc16_xmodem((char *)header, sizeof(struct image_header) - sizeof(header->header_crc));
+	crc = crc16_xmodem(0, (char *)header, sizeof(struct image_header) - sizeof(header->header_crc));
 	header->header_crc = cpu_to_be32(crc);
 }
 
-static int write_output_file(char *filename) {
-	int ret = 0;
-	FILE *f;
+struct build_params {
+	uint32_t product_id;
+	uint32_t device_id;
+	uint32_t compression_type;
+};
+
+/* Both headers are built from the mapped payload before anything is written */
+static void build_headers(void *priv, const void *data, size_t len) {
+	struct build_params *params = priv;
+
+	build_file_header(params->product_id, params->device_id,
+			  params->compression_type, data);
+	build_image_header(params->product_id, params->device_id, data);
+}
+
+static int write_output_file(char *input_filename, char *output_filename,
+			     struct build_params *params) {
+	struct stat st;
+	int in, out;
+	int ret = -1;
 
-	f = fopen(filename, "w");
-	if (f == NULL) {
-		fprintf(stderr, "failed to open output file\n");
-		ret = -1;
+	in = open(input_filename, O_RDONLY);
+	if (in < 0 || fstat(in, &st)) {
+		fprintf(stderr, "failed to open input file\n");
 		goto err;
 	}
 
-	if (fwrite(buf, buflen, 1, f) != 1) {
-		fprintf(stderr, "failed to write output file\n");
-		ret = -1;
+	length_unpadded = st.st_size;
+	length = length_unpadded;
+	if (length_unpadded % 8 != 0) {
+		length += 8 - length_unpadded % 8;
 	}
+	buflen = HEADERS_LEN + length;
 
-	fclose(f);
+	out = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		fprintf(stderr, "failed to open output file\n");
+		goto err_close;
+	}
 
+	if (fw_io_prepend(out, headers, HEADERS_LEN, in, 0, length_unpadded,
+			  padding, length - length_unpadded, build_headers, params)) {
+		fprintf(stderr, "failed to write output file\n");
+	} else {
+		ret = 0;
+	}
+
+	if (close(out))
+		ret = -1;
+err_close:
+	close(in);
 err:
 	return ret;
 }
@@ -300,6 +322,7 @@ int main(int argc, char* argv[]) {
 	static uint32_t compression_type = COMPRESSION_TYPE_NONE;
 	static char *input_filename = NULL;
 	static char *output_filename = NULL;
+	struct build_params params;
 
 	while ( 1 ) {
 		int c;
@@ -345,22 +368,16 @@ int main(int argc, char* argv[]) {
 		goto err;
 	}
 
-	if (create_buffer_and_read_file(input_filename)) {
-		goto err;
-	}
-
-	build_file_header(product_id, device_id, compression_type);
-
-	build_image_header(product_id, device_id);
+	params.product_id = product_id;
+	params.device_id = device_id;
+	params.compression_type = compression_type;
 
-	if (write_output_file(output_filename)) {
-		goto err_free;
+	if (write_output_file(input_filename, output_filename, &params)) {
+		goto err;
 	}
 
 	ret = EXIT_SUCCESS;
 
-err_free:
-	free(buf);
 err:
 	return ret;
 }
@@ -87,7 +87,12 @@ struct file_entry {
 #define FLAG_READONLY   0x01
 
 
-static FILE *f;
+/*
+ * The whole volume is built in memory and written out in one go at the
+ * end; image holds file_size bytes of initialised eraseblocks.
+ */
+static uint8_t *image;
+static size_t image_alloc = 0;
 static size_t file_size = 0;
 
 static int dir_block = 1;
@@ -108,25 +113,32 @@ static inline size_t block_offset(int block) {
 
 static int init_eraseblock(size_t offset) {
 	size_t end = offset - (offset % ERASEBLOCK_SIZE) + ERASEBLOCK_SIZE;
-	char *fill = "\xff";
-	int i;
 
-	while (file_size < end) {
-		if (fseek(f, file_size, SEEK_SET)) {
-			fprintf(stderr, "failed to seek to end\n");
-			return -1;
+	if (end <= file_size) {
+		return 0;
+	}
+
+	if (end > image_alloc) {
+		size_t alloc = image_alloc ? image_alloc : 16 * ERASEBLOCK_SIZE;
+		uint8_t *p;
+
+		while (alloc < end) {
+			alloc *= 2;
 		}
 
-		for (i = 0; i < ERASEBLOCK_SIZE; i++) {
-			if (fwrite(fill, 1, 1, f) != 1) {
-				fprintf(stderr, "failed to write eraseblock\n");
-				return -1;
-			}
+		p = realloc(image, alloc);
+		if (p == NULL) {
+			fprintf(stderr, "failed to allocate eraseblock\n");
+			return -1;
 		}
 
-		file_size += ERASEBLOCK_SIZE;
+		image = p;
+		image_alloc = alloc;
 	}
 
+	memset(image + file_size, 0xff, end - file_size);
+	file_size = end;
+
 	return 0;
 }
 
@@ -141,15 +153,7 @@ static int read_fat_entry(struct fat_entry *out, int block) {
 		return -1;
 	}
 
-	if (fseek(f, offset, SEEK_SET)) {
-		fprintf(stderr, "failed to seek to fat entry\n");
-		return -1;
-	}
-
-	if (fread(out, sizeof(struct fat_entry), 1, f) != 1) {
-		fprintf(stderr, "failed to read fat entry\n");
-		return -1;
-	}
+	memcpy(out, image + offset, sizeof(struct fat_entry));
 
 	return 0;
 }
@@ -161,15 +165,7 @@ static int write_fat_entry(struct fat_entry *in, int block) {
 		return -1;
 	}
 
-	if (fseek(f, offset, SEEK_SET)) {
-		fprintf(stderr, "failed to seek to fat entry\n");
-		return -1;
-	}
-
-	if (fwrite(in, sizeof(struct fat_entry), 1, f) != 1) {
-		fprintf(stderr, "failed to write fat entry\n");
-		return -1;
-	}
+	memcpy(image + offset, in, sizeof(struct fat_entry));
 
 	return 0;
 }
@@ -185,15 +181,7 @@ static int write_file_entry(struct file_entry *in, int block, int index) {
 		return -1;
 	}
 
-	if (fseek(f, offset, SEEK_SET)) {
-		fprintf(stderr, "failed to seek to file entry\n");
-		return -1;
-	}
-
-	if (fwrite(in, sizeof(struct file_entry), 1, f) != 1) {
-		fprintf(stderr, "failed to write file entry\n");
-		return -1;
-	}
+	memcpy(image + offset, in, sizeof(struct file_entry));
 
 	return 0;
 }
@@ -205,15 +193,7 @@ static int write_block(void *in, size_t len, int block) {
 		return -1;
 	}
 
-	if (fseek(f, offset, SEEK_SET)) {
-		fprintf(stderr, "failed to seek to block\n");
-		return -1;
-	}
-
-	if (fwrite(in, len, 1, f) != 1) {
-		fprintf(stderr, "failed to write block\n");
-		return -1;
-	}
+	memcpy(image + offset, in, len);
 
 	return 0;
 }
@@ -367,6 +347,7 @@ static void usage(char* argv[]) {
 
 int main(int argc, char* argv[]) {
 	int ret = EXIT_FAILURE;
+	FILE *f;
 
 	static char *filename = NULL;
 	static char *input_filename = NULL;
@@ -417,10 +398,16 @@ int main(int argc, char* argv[]) {
 		goto err_close;
 	}
 
+	if (fwrite(image, 1, file_size, f) != file_size || fflush(f)) {
+		fprintf(stderr, "failed to write image\n");
+		goto err_close;
+	}
+
 	ret = EXIT_SUCCESS;
 
 err_close:
 	fclose(f);
+	free(image);
 err:
 	return ret;
 }
@@ -11,9 +11,6 @@
  * The resulting image is compatible with the factory firmware
  * web upgrade and TFTP interface.
  *
- * To build:
- *  gcc -O2 -o mkheader_gemtek mkheader_gemtek.c -lz
- *
  * Claudio Leite <leitec@staticky.com>
  */
 
@@ -22,7 +19,8 @@
 #include <stdint.h>
 #include <string.h>
 
-#include <zlib.h>		/* for crc32() */
+#include "fw_crc32.h"
+#include "fw_io.h"
 
 /*
  * The header is in little-endian format. In case
@@ -93,11 +91,10 @@ struct machines mach_def[] = {
 int
 main(int argc, char *argv[])
 {
-	unsigned long 	res, flen;
+	unsigned long 	flen;
 	struct gemtek_header my_hdr;
 	FILE           *f, *f_out;
 	int 		image_type = -1, index;
-	uint8_t        *buf;
 	uint32_t 	crc;
 
 	if (argc < 3) {
@@ -147,19 +144,6 @@ main(int argc, char *argv[])
 		goto f_error;
 	}
 
-	buf = malloc(flen + HDRLEN);
-	if (!buf) {
-		fprintf(stderr, "\nERROR: couldn't allocate buffer\n");
-		goto f_error;
-	}
-	rewind(f);
-	res = fread(buf + HDRLEN, 1, flen, f);
-	if (res != flen) {
-		perror("Couldn't read entire file: fread()");
-		goto f_error;
-	}
-	fclose(f);
-
 	printf("\nCreating %s...\n", argv[2]);
 
 	memcpy(&my_hdr, &mach_def[image_type].header, HDRLEN);
@@ -169,13 +153,20 @@ main(int argc, char *argv[])
 	my_hdr.imagesz = le32(flen + HDRLEN);
 	memcpy(my_hdr.lang, "EN", 2);
 
-	memcpy(buf, &my_hdr, HDRLEN);
-
-	crc = crc32(0, buf, flen + HDRLEN);
+	/*
+	 * The image is the header followed by the untouched input, so the
+	 * input is checksummed where it is and copied kernel-side instead
+	 * of going through a buffer of its own.
+	 */
+	crc = fw_crc32(0xffffffff, &my_hdr, HDRLEN);
+	if (fw_crc32_fd(&crc, fileno(f), 0, flen)) {
+		perror("Couldn't read entire file: mmap()");
+		goto f_error;
+	}
+	crc = ~crc;
 	printf("  CRC32: %08X\n", crc);
 
 	my_hdr.checksum = le32(crc);
-	memcpy(buf, &my_hdr, HDRLEN);
 
 	printf("  Writing...\n");
 
@@ -185,11 +176,16 @@ main(int argc, char *argv[])
 		exit(-1);
 	}
 
-	fwrite(buf, 1, flen + HDRLEN, f_out);
+	if (fwrite(&my_hdr, HDRLEN, 1, f_out) != 1 || fflush(f_out) ||
+	    fw_io_copy_fd(fileno(f_out), HDRLEN, fileno(f), 0, flen) != flen) {
+		perror("Couldn't write output image");
+		fclose(f_out);
+		goto f_error;
+	}
 
 	fclose(f_out);
+	fclose(f);
 
-	free(buf);
 	return 0;
 
 f_error:
@@ -23,6 +23,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+
+#include "fw_pool.h"
  
 #define DES_KEY "H@L9K*(3"
  
@@ -50,14 +52,29 @@ typedef struct image_header {
     uint8_t     ih_name[IH_NMLEN];  /* Image Name       */
 } image_header_t;
  
-static int temp_fd = -1;
+/*
+ * The image is streamed through a window of WINDOW_LEN bytes. Both DES
+ * passes (blocks at offset 0 and at offset 3) are applied to a window
+ * before it is written, except for its last block, which the offset 3
+ * pass still needs together with the start of the next window; that block
+ * is carried over.
+ */
+#define WINDOW_LEN          (1024 * 1024)
+#define BLOCKS_PER_JOB      1024
+ 
 static DES_key_schedule schedule;
  
+struct des_job {
+	unsigned char *p;
+	size_t num_blocks;
+	int enc;
+};
+ 
 static void show_usage(const char *arg0);
-static void exit_cleanup(void);
-static void copy_file(int src, int dst);
-static void do_encrypt(void *p, off_t len);
 static void do_decrypt(void *p, off_t len);
+static void des_blocks(unsigned char *p, size_t num_blocks, int enc);
+static size_t read_full(int fd, void *buf, size_t len);
+static int write_full(int fd, const void *buf, size_t len);
  
  
 int main(int argc, char **argv)
@@ -71,7 +88,8 @@ int main(int argc, char **argv)
  
 	int input_fd;
 	int output_fd;
-	off_t file_len;
+	size_t file_len, carried;
+	ssize_t remain;
 	char *p;
 	char buf[sizeof(image_header_t) + 3];
 	image_header_t *header;
@@ -153,13 +171,6 @@ int main(int argc, char **argv)
 		show_usage(argv[0]);
 	}
  
-	temp_fd = fileno(tmpfile());
-	if (temp_fd < 0) {
-		fprintf(stderr, "Can't create temporary file\n");
-		exit(EXIT_FAILURE);
-	}
- 
-	atexit(exit_cleanup);
 	DES_set_key_unchecked((const_DES_cblock *)DES_KEY, &schedule);
  
 	if (input_filename) {
@@ -169,44 +180,34 @@ int main(int argc, char **argv)
 			        strerror(errno));
 			exit(EXIT_FAILURE);
 		}
-		copy_file(input_fd, temp_fd);
-		close(input_fd);
 	}
 	else {
-		copy_file(STDIN_FILENO, temp_fd);
+		input_fd = STDIN_FILENO;
 	}
  
-	file_len = lseek(temp_fd, 0, SEEK_CUR);
-	if (file_len < 64) {
-		fprintf(stderr, "Not enough data\n");
+	p = malloc(WINDOW_LEN);
+	if (!p) {
+		fprintf(stderr, "Out of memory\n");
 		exit(EXIT_FAILURE);
 	}
  
-	p = mmap(0, file_len, PROT_READ|PROT_WRITE, MAP_SHARED, temp_fd, 0);
-	if (p == MAP_FAILED) {
-		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+	file_len = read_full(input_fd, p, WINDOW_LEN);
+	if (file_len < 64) {
+		fprintf(stderr, "Not enough data\n");
 		exit(EXIT_FAILURE);
-	}	
+	}
  
+	/* encrypted images end at the end of the uImage, dumps may be longer */
+	remain = -1;
 	if (encrypt_opt) {
 		header = (image_header_t *)p;
-		off_t len = min(file_len,
-		                ntohl(header->ih_size) + sizeof(image_header_t));
 		if (ntohl(header->ih_magic) != IH_MAGIC) {
 			fprintf(stderr, "Header magic incorrect: "
 			        "expected 0x%08X, got 0x%08X\n",
 			        IH_MAGIC, ntohl(header->ih_magic));
-			munmap(p, file_len);
 			exit(EXIT_FAILURE);
 		}
-		do_encrypt(p, len);
-		munmap(p, file_len);
-		if (len != file_len) {
-			if (ftruncate(temp_fd, len) < 0) {
-				fprintf(stderr, "ftruncate failed: %s\n", strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-		}		
+		remain = ntohl(header->ih_size) + sizeof(image_header_t);
 	}
  
 	if (decrypt_opt) {
@@ -220,11 +221,8 @@ int main(int argc, char **argv)
 			        IH_MAGIC, ntohl(header->ih_magic));
 			exit(EXIT_FAILURE);
 		}
-		do_decrypt(p, file_len);
-		munmap(p, file_len);
 	}
  
-	lseek(temp_fd, 0, SEEK_SET);
 	if (output_filename) {
 		output_fd = creat(output_filename, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
 		if (output_fd < 0) {
@@ -232,15 +230,61 @@ int main(int argc, char **argv)
 			        output_filename, strerror(errno));
 			exit(EXIT_FAILURE);
 		}
-		copy_file(temp_fd, output_fd);
-		close(output_fd);
 	}
 	else {
-		copy_file(temp_fd, STDOUT_FILENO);
+		output_fd = STDOUT_FILENO;
+	}
+ 
+	carried = 0;
+	while (1) {
+		size_t len = file_len, num_blocks;
+		int last;
+ 
+		if (remain >= 0 && len > (size_t)remain)
+			len = remain;
+		last = len < WINDOW_LEN || (remain >= 0 && (size_t)remain == len);
+ 
+		num_blocks = len / 8;
+		if (encrypt_opt) {
+			des_blocks((unsigned char *)p + carried, num_blocks - carried / 8,
+			           DES_ENCRYPT);
+			if (len >= 3)
+				des_blocks((unsigned char *)p + 3, (len - 3) / 8, DES_ENCRYPT);
+		}
+		else {
+			if (len >= 3)
+				des_blocks((unsigned char *)p + 3, (len - 3) / 8, DES_DECRYPT);
+			des_blocks((unsigned char *)p, num_blocks - !last, DES_DECRYPT);
+		}
+ 
+		if (last) {
+			if (write_full(output_fd, p, len))
+				goto err_write;
+			break;
+		}
+ 
+		if (write_full(output_fd, p, len - 8))
+			goto err_write;
+		if (remain >= 0)
+			remain -= len - 8;
+ 
+		memcpy(p, p + len - 8, 8);
+		carried = encrypt_opt ? 8 : 0;
+		file_len = 8 + read_full(input_fd, p + 8, WINDOW_LEN - 8);
 	}
  
+	free(p);
+	if (output_filename)
+		close(output_fd);
+	if (input_filename)
+		close(input_fd);
+ 
 	exit(EXIT_SUCCESS);
 	return 0;
+ 
+err_write:
+	fprintf(stderr, "Write failed: %s\n", strerror(errno));
+	exit(EXIT_FAILURE);
 }
  
 static void show_usage(const char *arg0)
@@ -253,41 +297,53 @@ static void show_usage(const char *arg0)
 	exit(-1);
 }
  
-static void exit_cleanup(void)
+static size_t read_full(int fd, void *buf, size_t len)
 {
-	if (temp_fd >= 0) {
-		close(temp_fd);
-	}
+	size_t done = 0;
+	ssize_t size;
+ 
+	while (done < len && (size = read(fd, (char *)buf + done, len - done)) > 0)
+		done += size;
+ 
+	return done;
 }
  
-static void copy_file(int src, int dst)
+static int write_full(int fd, const void *buf, size_t len)
 {
-	char buf[4096];
 	ssize_t size;
  
-	while ((size = read(src, buf, 4096)) > 0) {
-        write(dst, buf, size);
-    }
+	while (len) {
+		size = write(fd, buf, len);
+		if (size <= 0)
+			return -1;
+		buf = (const char *)buf + size;
+		len -= size;
+	}
+ 
+	return 0;
 }
  
-static void do_encrypt(void *p, off_t len)
+static void des_job(void *arg, unsigned int idx)
 {
-	DES_cblock *pblock;
-	int num_blocks;
+	struct des_job *job = arg;
+	DES_cblock *pblock = (DES_cblock *)job->p + (size_t)idx * BLOCKS_PER_JOB;
+	size_t num_blocks = job->num_blocks - (size_t)idx * BLOCKS_PER_JOB;
  
-	num_blocks = len / 8;
-	pblock = (DES_cblock *) p;
+	if (num_blocks > BLOCKS_PER_JOB)
+		num_blocks = BLOCKS_PER_JOB;
 	while (num_blocks--) {
-		DES_ecb_encrypt(pblock, pblock, &schedule, DES_ENCRYPT);
+		DES_ecb_encrypt(pblock, pblock, &schedule, job->enc);
 		pblock++;
 	}
+}
  
-	num_blocks = (len - 3) / 8;
-	pblock = (DES_cblock *) (p + 3);
-	while (num_blocks--) {
-		DES_ecb_encrypt(pblock, pblock, &schedule, DES_ENCRYPT);
-		pblock++;
-	}
+/* ECB blocks are independent, so each pass runs in parallel */
+static void des_blocks(unsigned char *p, size_t num_blocks, int enc)
+{
+	struct des_job job = { p, num_blocks, enc };
+ 
+	fw_pool_run((num_blocks + BLOCKS_PER_JOB - 1) / BLOCKS_PER_JOB,
+	            des_job, &job);
 }
  
 static void do_decrypt(void *p, off_t len)
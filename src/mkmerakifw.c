@@ -16,7 +16,11 @@
 #include <libgen.h>
 #include <getopt.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "sha1.h"
 
@@ -171,14 +175,17 @@ void writel(unsigned char *buf, size_t offset, uint32_t value)
 int main(int argc, char *argv[])
 {
 	int ret = EXIT_FAILURE;
-	long klen;
+	size_t klen;
 	size_t kspace;
-	unsigned char *kernel;
+	unsigned char *kernel = NULL;
 	size_t buflen;
-	unsigned char *buf;
+	unsigned char buf[HDR_LENGTH];
+	unsigned char pad[4096];
 	bool strip_padding = false;
 	char *ofname = NULL, *ifname = NULL;
-	FILE *out, *in;
+	struct stat st;
+	FILE *out;
+	int in;
 
 	progname = basename(argv[0]);
 
@@ -232,8 +239,8 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
-	in = fopen(ifname, "r");
-	if (in == NULL) {
+	in = open(ifname, O_RDONLY);
+	if (in < 0 || fstat(in, &st) < 0) {
 		ERRS("could not open \"%s\" for reading: %s", ifname);
 		goto err;
 	}
@@ -242,9 +249,7 @@ int main(int argc, char *argv[])
 	kspace = buflen - HDR_LENGTH;
 
 	/* Get kernel length */
-	fseek(in, 0, SEEK_END);
-	klen = ftell(in);
-	rewind(in);
+	klen = st.st_size;
 
 	if (klen > kspace) {
 		ERR("file \"%s\" is too big - max size: 0x%08lX\n",
@@ -256,17 +261,22 @@ int main(int argc, char *argv[])
 	if (strip_padding)
 		buflen = klen + HDR_LENGTH;
 
-	/* Allocate and initialize buffer for final image */
-	buf = malloc(buflen);
-	if (buf == NULL) {
-		ERRS("no memory for buffer: %s\n");
-		goto err_close_in;
+	/*
+	 * Map the kernel rather than reading it: it is hashed and then
+	 * written straight from the page cache, and only the header and
+	 * the trailing padding are built in memory.
+	 */
+	if (klen) {
+		kernel = mmap(NULL, klen, PROT_READ, MAP_PRIVATE, in, 0);
+		if (kernel == MAP_FAILED) {
+			ERRS("could not map \"%s\": %s", ifname);
+			goto err_close_in;
+		}
+		madvise(kernel, klen, MADV_SEQUENTIAL);
 	}
-	memset(buf, PADDING_BYTE, buflen);
 
-	/* Load kernel */
-	kernel = buf + HDR_LENGTH;
-	fread(kernel, klen, 1, in);
+	memset(buf, PADDING_BYTE, sizeof(buf));
+	memset(pad, PADDING_BYTE, sizeof(pad));
 
 	/* Write magic values */
 	writel(buf, HDR_OFF_MAGIC1, board->magic1);
@@ -297,19 +307,39 @@ int main(int argc, char *argv[])
 	out = fopen(ofname, "w");
 	if (out == NULL) {
 		ERRS("could not open \"%s\" for writing: %s", ofname);
-		goto err_free;
+		goto err_unmap;
+	}
+
+	if (fwrite(buf, sizeof(buf), 1, out) != 1 ||
+	    (klen && fwrite(kernel, klen, 1, out) != 1))
+		goto err_write;
+
+	for (buflen -= HDR_LENGTH + klen; buflen; ) {
+		size_t n = buflen < sizeof(pad) ? buflen : sizeof(pad);
+
+		if (fwrite(pad, n, 1, out) != 1)
+			goto err_write;
+		buflen -= n;
 	}
-	fwrite(buf, buflen, 1, out);
+
+	if (fflush(out))
+		goto err_write;
 
 	ret = EXIT_SUCCESS;
+	goto err_close_out;
+
+err_write:
+	ERRS("could not write \"%s\": %s", ofname);
 
+err_close_out:
 	fclose(out);
 
-err_free:
-	free(buf);
+err_unmap:
+	if (klen)
+		munmap(kernel, klen);
 
 err_close_in:
-	fclose(in);
+	close(in);
 
 err:
 	return ret;
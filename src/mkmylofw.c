@@ -12,6 +12,7 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <endian.h>     /* for __BYTE_ORDER */
 #include <byteswap.h>
@@ -24,12 +25,15 @@
 #  define HOST_TO_LE32(x)	bswap_32(x)
 #endif
 
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_registry.h"
 #include "myloader.h"
 
 #define MAX_FW_BLOCKS  	32
 #define MAX_ARG_COUNT   32
 #define MAX_ARG_LEN     1024
-#define FILE_BUF_LEN    (16*1024)
 #define PART_NAME_LEN	32
 
 struct fw_block {
@@ -236,55 +240,10 @@ usage(int status)
 	exit(status);
 }
 
-/*
- * Code to compute the CRC-32 table. Borrowed from
- * gzip-1.0.3/makecrc.c.
- */
-
-static uint32_t crc_32_tab[256];
-
 void
-init_crc_table(void)
+update_crc(const void *p, uint32_t len, uint32_t *crc)
 {
-	/* Not copyrighted 1990 Mark Adler	*/
-
-	uint32_t c;      /* crc shift register */
-	uint32_t e;      /* polynomial exclusive-or pattern */
-	int i;           /* counter for all possible eight bit values */
-	int k;           /* byte being shifted into crc apparatus */
-
-	/* terms of polynomial defining this crc (except x^32): */
-	static const int p[] = {0,1,2,4,5,7,8,10,11,12,16,22,23,26};
-
-	/* Make exclusive-or pattern from polynomial */
-	e = 0;
-	for (i = 0; i < sizeof(p)/sizeof(int); i++)
-		e |= 1L << (31 - p[i]);
-
-	crc_32_tab[0] = 0;
-
-	for (i = 1; i < 256; i++) {
-		c = 0;
-		for (k = i | 256; k != 1; k >>= 1) {
-			c = c & 1 ? (c >> 1) ^ e : c >> 1;
-			if (k & 1)
-				c ^= e;
-		}
-		crc_32_tab[i] = c;
-	}
-}
-
-
-void
-update_crc(uint8_t *p, uint32_t len, uint32_t *crc)
-{
-	uint32_t t;
-
-	t = *crc ^ 0xFFFFFFFFUL;
-	while (len--) {
-		t = crc_32_tab[(t ^ *p++) & 0xff] ^ (t >> 8);
-	}
-	*crc = t ^ 0xFFFFFFFFUL;
+	*crc = fw_crc32(*crc ^ 0xFFFFFFFFUL, p, len) ^ 0xFFFFFFFFUL;
 }
 
 
@@ -335,65 +294,9 @@ str2u16(char *arg, uint16_t *val)
 
 struct cpx_board *
 find_board(char *model){
-	struct cpx_board *board;
-	struct cpx_board *tmp;
-
-	board = NULL;
-	for (tmp = boards; tmp->model != NULL; tmp++){
-		if (strcasecmp(model, tmp->model) == 0) {
-			board = tmp;
-			break;
-		}
-	};
-
-	return board;
-}
-
-
-int
-get_file_crc(struct fw_block *ff)
-{
-	FILE *f;
-	uint8_t buf[FILE_BUF_LEN];
-	uint32_t readlen = sizeof(buf);
-	int res = -1;
-	size_t len;
-
-	if ((ff->flags & BLOCK_FLAG_HAVEHDR) == 0) {
-		res = 0;
-		goto out;
-	}
-
-	errno = 0;
-	f = fopen(ff->name,"r");
-	if (errno) {
-		errmsg(1,"unable to open file %s", ff->name);
-		goto out;
-	}
-
-	ff->crc = 0;
-	len = ff->size;
-	while (len > 0) {
-		if (len < readlen)
-			readlen = len;
-
-		errno = 0;
-		fread(buf, readlen, 1, f);
-		if (errno) {
-			errmsg(1,"unable to read from file %s",	ff->name);
-			goto out_close;
-		}
+	static struct fw_registry registry = FW_REGISTRY_INIT(boards, model, true);
 
-		update_crc(buf, readlen, &ff->crc);
-		len -= readlen;
-	}
-
-	res = 0;
-
-out_close:
-	fclose(f);
-out:
-	return res;
+	return fw_registry_find(&registry, model);
 }
 
 
@@ -510,66 +413,167 @@ write_out_padding(FILE *outfile, size_t len, uint8_t padc, uint32_t *crc)
 }
 
 
+/*
+ * Block data is written straight to its offset in the output file, so the
+ * blocks are independent of each other and are done on the worker pool.
+ * The image CRC is then assembled from the per-block CRCs in order.
+ */
+struct out_job {
+	struct fw_block	*block;
+	int		fd;	/* output file */
+	off_t		offset;	/* where the block goes in the output file */
+	size_t		len;	/* length of the block in the output file */
+	uint32_t	crc;	/* crc value of the block in the output file */
+	int		err;
+};
+
+
 int
-write_out_file(FILE *outfile, struct fw_block *block, uint32_t *crc)
+pwrite_out_data(int fd, const void *data, size_t len, off_t offset)
 {
-	char buff[FILE_BUF_LEN];
-	size_t  buflen = sizeof(buff);
-	FILE *f;
+	const uint8_t *ptr = data;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, ptr, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			errmsg(1,"unable to write output file");
+			return -1;
+		}
+		ptr += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+
+int
+write_out_file(struct out_job *job)
+{
+	struct fw_block *block = job->block;
+	struct fw_io_map map;
+	uint8_t pad[4];
+	off_t offset = job->offset;
 	size_t len;
+	int res = -1;
+	int f;
 
-	errno = 0;
+	f = open(block->name, O_RDONLY);
+	if (f < 0) {
+		errmsg(1,"unable to open file: %s", block->name);
+		return -1;
+	}
 
-	if (block->name == NULL) {
-		return 0;
+	/* the data is moved by the kernel, the crc is read from a mapping */
+	if (fw_io_map(&map, f, 0, block->size) != 0) {
+		errmsg(1,"unable to read from file: %s",block->name);
+		goto out_close;
 	}
 
+	block->crc = 0;
+	update_crc(map.data, block->size, &block->crc);
+	job->crc = 0;
+
 	if ((block->flags & BLOCK_FLAG_HAVEHDR) != 0) {
 		struct mylo_partition_header ph;
 
-		if (get_file_crc(block) != 0)
-		        return -1;
-
 		ph.crc = HOST_TO_LE32(block->crc);
 		ph.len = HOST_TO_LE32(block->size);
 
-		if (write_out_data(outfile, (uint8_t *)&ph, sizeof(ph), crc) != 0)
-			return -1;
+		if (pwrite_out_data(job->fd, &ph, sizeof(ph), offset) != 0)
+			goto out_unmap;
+
+		update_crc(&ph, sizeof(ph), &job->crc);
+		offset += sizeof(ph);
 	}
 
-	f = fopen(block->name,"r");
-	if (errno) {
-		errmsg(1,"unable to open file: %s", block->name);
+	if (fw_io_copy_fd(job->fd, offset, f, 0, block->size) != block->size) {
+		errmsg(1,"unable to write output file");
+		goto out_unmap;
+	}
+
+	job->crc = fw_crc32_combine(job->crc, block->crc, block->size);
+	offset += block->size;
+
+	/* align next block on a 4 byte boundary */
+	len = block->size % 4;
+	memset(pad, 0xFF, len);
+	if (pwrite_out_data(job->fd, pad, len, offset) != 0)
+		goto out_unmap;
+
+	update_crc(pad, len, &job->crc);
+
+	dbgmsg(1,"file %s written out", block->name);
+	res = 0;
+
+out_unmap:
+	fw_io_unmap(&map);
+out_close:
+	close(f);
+	return res;
+}
+
+
+void
+write_out_file_job(void *arg, unsigned int idx)
+{
+	struct out_job *jobs = arg;
+
+	jobs[idx].err = write_out_file(&jobs[idx]);
+}
+
+
+int
+write_out_files(FILE *outfile, uint32_t *crc)
+{
+	struct out_job jobs[MAX_FW_BLOCKS];
+	struct fw_block *b;
+	off_t offset;
+	int num_jobs = 0;
+	int i;
+
+	if (fflush(outfile) != 0) {
+		errmsg(1,"unable to write output file");
 		return -1;
 	}
 
-	len = block->size;
-	while (len > 0) {
-		if (len < buflen)
-			buflen = len;
+	offset = ftello(outfile);
+	if (offset < 0) {
+		errmsg(1,"output file is not seekable");
+		return -1;
+	}
 
-		/* read data from source file */
-		errno = 0;
-		fread(buff, buflen, 1, f);
-		if (errno != 0) {
-			errmsg(1,"unable to read from file: %s",block->name);
-			return -1;
-		}
+	for (i = 0; i < fw_num_blocks; i++) {
+		b = &fw_blocks[i];
+		if (b->name == NULL)
+			continue;
 
-		if (write_out_data(outfile, buff, buflen, crc) != 0)
-			return -1;
+		memset(&jobs[num_jobs], 0, sizeof(jobs[num_jobs]));
+		jobs[num_jobs].block = b;
+		jobs[num_jobs].fd = fileno(outfile);
+		jobs[num_jobs].offset = offset;
+		jobs[num_jobs].len = b->size + b->size % 4;
+		if ((b->flags & BLOCK_FLAG_HAVEHDR) != 0)
+			jobs[num_jobs].len += sizeof(struct mylo_partition_header);
 
-		len -= buflen;
+		offset += jobs[num_jobs].len;
+		num_jobs++;
 	}
 
-	fclose(f);
+	fw_pool_run(num_jobs, write_out_file_job, jobs);
 
-	/* align next block on a 4 byte boundary */
-	len = block->size % 4;
-	if (write_out_padding(outfile, len, 0xFF, crc))
-		return -1;
+	for (i = 0; i < num_jobs; i++) {
+		if (jobs[i].err != 0)
+			return -1;
+
+		if (crc)
+			*crc = fw_crc32_combine(*crc, jobs[i].crc, jobs[i].len);
+	}
 
-	dbgmsg(1,"file %s written out", block->name);
 	return 0;
 }
 
@@ -702,13 +706,7 @@ write_out_blocks(FILE *outfile, uint32_t *crc)
 	/*
 	 * write out data for each blocks
 	 */
-	for (i = 0; i < fw_num_blocks; i++) {
-		b = &fw_blocks[i];
-		if (write_out_file(outfile, b, crc) != 0)
-		        return -1;
-	}
-
-	return 0;
+	return write_out_files(outfile, crc);
 }
 
 
@@ -1252,7 +1250,6 @@ main(int argc, char *argv[])
 	}
 
 	crc = 0;
-	init_crc_table();
 
 	if (write_out_header(outfile, &crc) != 0)
 		goto out_flush;
@@ -13,8 +13,12 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
+#include "fw_pool.h"
+#include "fw_registry.h"
 #include "sha1.h"
 
 #if (__BYTE_ORDER == __BIG_ENDIAN)
@@ -40,16 +44,35 @@ struct board_info {
 	uint32_t	datalen;
 };
 
+/* seed and payload hashed once for all images of boards with that seed */
+struct prefix {
+	uint32_t		seed;
+	sha1_context		ctx;
+};
+
+struct image {
+	char			*board_id;
+	char			*ofname;
+	struct board_info	*board;
+	const struct prefix	*prefix;
+	int			res;
+};
+
 /*
  * Globals
  */
 static char *ifname;
 static char *progname;
-static char *ofname;
 static char *version = "1.00.00";
 
-static char *board_id;
-static struct board_info *board;
+static struct image *images;
+static struct prefix *prefixes;
+static unsigned int num_prefixes;
+static unsigned int num_boards;
+static unsigned int num_outputs;
+
+static uint8_t *data;
+static size_t data_len;
 
 static struct board_info boards[] = {
 	{
@@ -85,18 +108,9 @@ static struct board_info boards[] = {
 
 static struct board_info *find_board(char *id)
 {
-	struct board_info *ret;
-	struct board_info *board;
+	static struct fw_registry registry = FW_REGISTRY_INIT(boards, id, true);
 
-	ret = NULL;
-	for (board = boards; board->id != NULL; board++){
-		if (strcasecmp(id, board->id) == 0) {
-			ret = board;
-			break;
-		}
-	};
-
-	return ret;
+	return fw_registry_find(&registry, id);
 }
 
 void usage(int status)
@@ -110,6 +124,8 @@ void usage(int status)
 "  -B <board>      create image for the board specified with <board>\n"
 "  -i <file>       read input from the file <file>\n"
 "  -o <file>       write output to the file <file>\n"
+"                  (-B and -o may be repeated to create images for several\n"
+"                  boards from one input; they are paired in order)\n"
 "  -v <version>    set image version to <version>\n"
 "  -h              show this screen\n"
 	);
@@ -117,21 +133,106 @@ void usage(int status)
 	exit(status);
 }
 
+static void hash_prefix(void *arg, unsigned int idx)
+{
+	struct prefix *prefix = (struct prefix *)arg + idx;
+	uint32_t seed = HOST_TO_BE32(prefix->seed);
+
+	sha1_starts(&prefix->ctx);
+	sha1_update(&prefix->ctx, (uchar *) &seed, sizeof(seed));
+	if (data_len)
+		sha1_update(&prefix->ctx, data, data_len);
+}
+
+/*
+ * Builds one board's image. The hash goes on from the board's prefix and
+ * the payload is written straight from the shared mapping; the 0xff
+ * padding up to datalen (and past it, to the end of the image) comes from
+ * a small constant buffer.
+ */
+static void write_image(void *arg, unsigned int idx)
+{
+	struct image *img = (struct image *)arg + idx;
+	struct board_info *board = img->board;
+	uint8_t pad[4096];
+	struct planex_hdr hdr;
+	sha1_context ctx;
+	size_t buflen;
+	size_t left;
+	FILE *outfile;
+
+	img->res = EXIT_FAILURE;
+	buflen = board->datalen + 0x10000;
+
+	memset(&hdr, 0xff, sizeof(hdr));
+	memset(pad, 0xff, sizeof(pad));
+
+	hdr.datalen = HOST_TO_BE32(board->datalen);
+	hdr.unk1[0] = board->unk[0];
+	hdr.unk1[1] = board->unk[1];
+
+	snprintf(hdr.version, sizeof(hdr.version), "%s", version);
+
+	sha1_clone(&ctx, &img->prefix->ctx);
+	for (left = board->datalen - data_len; left; ) {
+		size_t n = left < sizeof(pad) ? left : sizeof(pad);
+
+		sha1_update(&ctx, pad, n);
+		left -= n;
+	}
+	sha1_finish(&ctx, hdr.sha1sum);
+
+	outfile = fopen(img->ofname, "w");
+	if (outfile == NULL) {
+		ERRS("could not open \"%s\" for writing", img->ofname);
+		return;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, outfile) != 1 ||
+	    (data_len && fwrite(data, data_len, 1, outfile) != 1))
+		goto err_write;
+
+	for (left = buflen - sizeof(hdr) - data_len; left; ) {
+		size_t n = left < sizeof(pad) ? left : sizeof(pad);
+
+		if (fwrite(pad, n, 1, outfile) != 1)
+			goto err_write;
+		left -= n;
+	}
+
+	if (fflush(outfile))
+		goto err_write;
+
+	img->res = EXIT_SUCCESS;
+	goto err_close_out;
+
+ err_write:
+	ERRS("unable to write to file %s", img->ofname);
+
+ err_close_out:
+	fclose(outfile);
+	if (img->res != EXIT_SUCCESS) {
+		unlink(img->ofname);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	int res = EXIT_FAILURE;
-	int buflen;
+	unsigned int i;
 	int err;
 	struct stat st;
-	char *buf;
-	struct planex_hdr *hdr;
-	sha1_context ctx;
-	uint32_t seed;
-
-	FILE *outfile, *infile;
+	int infile;
 
 	progname = basename(argv[0]);
 
+	images = calloc(argc, sizeof(*images));
+	prefixes = calloc(argc, sizeof(*prefixes));
+	if (images == NULL || prefixes == NULL) {
+		ERR("out of memory");
+		goto err;
+	}
+
 	while ( 1 ) {
 		int c;
 
@@ -141,13 +242,13 @@ int main(int argc, char *argv[])
 
 		switch (c) {
 		case 'B':
-			board_id = optarg;
+			images[num_boards++].board_id = optarg;
 			break;
 		case 'i':
 			ifname = optarg;
 			break;
 		case 'o':
-			ofname = optarg;
+			images[num_outputs++].ofname = optarg;
 			break;
 		case 'v':
 			version = optarg;
@@ -161,104 +262,94 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (board_id == NULL) {
+	if (num_boards == 0) {
 		ERR("no board specified");
 		goto err;
 	}
 
-	board = find_board(board_id);
-	if (board == NULL) {
-		ERR("unknown board '%s'", board_id);
-		goto err;
-	};
+	for (i = 0; i < num_boards; i++) {
+		images[i].board = find_board(images[i].board_id);
+		if (images[i].board == NULL) {
+			ERR("unknown board '%s'", images[i].board_id);
+			goto err;
+		}
+	}
 
 	if (ifname == NULL) {
 		ERR("no input file specified");
 		goto err;
 	}
 
-	if (ofname == NULL) {
+	if (num_outputs == 0) {
 		ERR("no output file specified");
 		goto err;
 	}
 
+	if (num_outputs != num_boards) {
+		ERR("%u boards but %u output files specified", num_boards, num_outputs);
+		goto err;
+	}
+
 	err = stat(ifname, &st);
 	if (err){
 		ERRS("stat failed on %s", ifname);
 		goto err;
 	}
 
-	if (st.st_size > board->datalen) {
-		ERR("file '%s' is too big - max size: 0x%08X (exceeds %lu bytes)\n",
-		    ifname, board->datalen, st.st_size - board->datalen);
-		goto err;
-	}
+	for (i = 0; i < num_boards; i++) {
+		struct board_info *board = images[i].board;
 
-	buflen = board->datalen + 0x10000;
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto err;
+		if (st.st_size > board->datalen) {
+			ERR("file '%s' is too big - max size: 0x%08X (exceeds %lu bytes)\n",
+			    ifname, board->datalen, st.st_size - board->datalen);
+			goto err;
+		}
 	}
 
-	memset(buf, 0xff, buflen);
-	hdr = (struct planex_hdr *)buf;
-
-	hdr->datalen = HOST_TO_BE32(board->datalen);
-	hdr->unk1[0] = board->unk[0];
-	hdr->unk1[1] = board->unk[1];
-
-	snprintf(hdr->version, sizeof(hdr->version), "%s", version);
-
-	infile = fopen(ifname, "r");
-	if (infile == NULL) {
+	infile = open(ifname, O_RDONLY);
+	if (infile < 0) {
 		ERRS("could not open \"%s\" for reading", ifname);
-		goto err_free;
+		goto err;
 	}
 
-	errno = 0;
-	fread(buf +  sizeof(*hdr), st.st_size, 1, infile);
-	if (errno != 0) {
-		ERRS("unable to read from file %s", ifname);
-		goto err_close_in;
+	/* The payload is mapped once and shared by every board's image */
+	data_len = st.st_size;
+	if (data_len) {
+		data = mmap(NULL, data_len, PROT_READ, MAP_PRIVATE, infile, 0);
+		if (data == MAP_FAILED) {
+			ERRS("unable to read from file %s", ifname);
+			goto err_close_in;
+		}
+		madvise(data, data_len, MADV_SEQUENTIAL);
 	}
 
-	seed = HOST_TO_BE32(board->seed);
-	sha1_starts(&ctx);
-	sha1_update(&ctx, (uchar *) &seed, sizeof(seed));
-	sha1_update(&ctx, buf + sizeof(*hdr), board->datalen);
-	sha1_finish(&ctx, hdr->sha1sum);
+	for (i = 0; i < num_boards; i++) {
+		unsigned int j;
 
-	outfile = fopen(ofname, "w");
-	if (outfile == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto err_close_in;
+		for (j = 0; j < num_prefixes; j++)
+			if (prefixes[j].seed == images[i].board->seed)
+				break;
+		if (j == num_prefixes)
+			prefixes[num_prefixes++].seed = images[i].board->seed;
+		images[i].prefix = &prefixes[j];
 	}
 
-	errno = 0;
-	fwrite(buf, buflen, 1, outfile);
-	if (errno) {
-		ERRS("unable to write to file %s", ofname);
-		goto err_close_out;
-	}
+	fw_pool_run(num_prefixes, hash_prefix, prefixes);
+	fw_pool_run(num_boards, write_image, images);
 
 	res = EXIT_SUCCESS;
+	for (i = 0; i < num_boards; i++)
+		if (images[i].res != EXIT_SUCCESS)
+			res = EXIT_FAILURE;
 
-	fflush(outfile);
-
- err_close_out:
-	fclose(outfile);
-	if (res != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
+	if (data_len)
+		munmap(data, data_len);
 
  err_close_in:
-	fclose(infile);
-
- err_free:
-	free(buf);
+	close(infile);
 
  err:
+	free(prefixes);
+	free(images);
 	return res;
 }
-
@@ -29,6 +29,11 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include "fw_mem.h"
+#include "fw_registry.h"
+#include "fw_sum.h"
+#include "fw_xor.h"
+
 #if (__BYTE_ORDER == __BIG_ENDIAN)
 #  define HOST_TO_BE32(x)	(x)
 #  define BE32_TO_HOST(x)	(x)
@@ -262,18 +267,9 @@ static struct board_info boards[] = {
  */
 static struct board_info *find_board(char *id)
 {
-	struct board_info *ret;
-	struct board_info *board;
+	static struct fw_registry registry = FW_REGISTRY_INIT(boards, id, true);
 
-	ret = NULL;
-	for (board = boards; board->id != NULL; board++){
-		if (strcasecmp(id, board->id) == 0) {
-			ret = board;
-			break;
-		}
-	};
-
-	return ret;
+	return fw_registry_find(&registry, id);
 }
 
 /*
@@ -296,18 +292,9 @@ static struct board_info *find_board_by_hwid(uint32_t hw_id)
  */
 static struct flash_layout *find_layout(char *id)
 {
-	struct flash_layout *ret;
-	struct flash_layout *l;
+	static struct fw_registry registry = FW_REGISTRY_INIT(layouts, id, true);
 
-	ret = NULL;
-	for (l = layouts; l->id != NULL; l++){
-		if (strcasecmp(id, l->id) == 0) {
-			ret = l;
-			break;
-		}
-	};
-
-	return ret;
+	return fw_registry_find(&registry, id);
 }
 
 /*
@@ -460,70 +447,77 @@ static void fill_header(uint8_t *buf)
 	hdr->flags = HOST_TO_LE32(HEADER_FLAGS);
 }
 
+/* Firmware data is processed in chunks that stay in the cache */
+#define CHUNK_LEN		(16 * 1024)
+
 /*
- * Compute firmware checksum
+ * Finish the firmware checksum: a 16-bit one's-complement sum of
+ * little-endian words, folded the way the vendor tool does it
  */
-static uint16_t checksum_fw(uint8_t *data, int len)
+static uint16_t checksum_fw(const struct fw_sum *sum)
 {
-	int i;
-	int32_t checksum = 0;
+	int32_t checksum = (uint32_t) fw_sum16_le_final(sum);
 
-	for (i = 0; i < len - 1; i += 2) {
-		checksum += (data[i + 1] << 8) | data[i];
-	}
-	if (i < len) {
-		checksum += data[i];
-	}
 	checksum = checksum + (checksum >> 16) + 0xffff;
 	checksum = ~(checksum + (checksum >> 16)) & 0xffff;
 	return (uint16_t) checksum;
 }
 
 /*
- * (De)obfuscate firmware using an XOR operation with a fixed length key
+ * (De)obfuscate len bytes of firmware data and the two checksum bytes
+ * following it using an XOR operation with a fixed length key, and return
+ * the checksum of the plain data. Both are done chunk by chunk, so the
+ * data is only pulled into the cache once. When encoding, the checksum is
+ * stored behind the data before it is obfuscated, and every chunk is
+ * written to out (if not NULL) as soon as it is done.
  */
-static void xor_fw(uint8_t *data, int len)
+static int crypt_fw(uint8_t *data, int len, int encode, FILE *out,
+		    uint16_t *checksum)
 {
-	int i;
+	struct fw_xor xor;
+	struct fw_sum sum;
+	int done, n;
 
-	for (i = 0; i <= len; i++) {
-		data[i] ^= key[board->key][i % KEY_LEN];
+	if (fw_xor_init(&xor, key[board->key], KEY_LEN, 0)) {
+		ERR("no memory for XOR key");
+		return -1;
 	}
-}
+	fw_sum_init(&sum);
 
-/*
- * Write firmware to file
- */
-static int write_fw(uint8_t *data, int len)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
+	for (done = 0; done < len; done += n) {
+		n = len - done < CHUNK_LEN ? len - done : CHUNK_LEN;
 
-	f = fopen(ofname, "wb");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto out;
+		if (encode) {
+			fw_sum16_le_update(&sum, data + done, n);
+			fw_xor_apply(&xor, data + done, n);
+		} else {
+			fw_xor_apply(&xor, data + done, n);
+			fw_sum16_le_update(&sum, data + done, n);
+		}
+
+		if (out && fwrite(data + done, n, 1, out) != 1)
+			goto err;
 	}
 
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
+	*checksum = checksum_fw(&sum);
+
+	/* Cannot use network order function because checksum is not word-aligned */
+	if (encode) {
+		data[len + 1] = *checksum >> 8;
+		data[len] = *checksum & 0xff;
 	}
+	fw_xor_apply(&xor, data + len, 2);
 
-	DBG("firmware file \"%s\" completed", ofname);
+	if (out && fwrite(data + len, 2, 1, out) != 1)
+		goto err;
 
-	ret = EXIT_SUCCESS;
+	fw_xor_free(&xor);
+	return 0;
 
- out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
- out:
-	return ret;
+ err:
+	ERRS("unable to write output file");
+	fw_xor_free(&xor);
+	return -1;
 }
 
 /*
@@ -534,12 +528,12 @@ static int build_fw(void)
 	int buflen;
 	uint8_t *buf, *p;
 	int ret = EXIT_FAILURE;
-	int writelen = 0;
 	uint16_t checksum;
+	FILE *f;
 
 	buflen = layout->fw_max_len;
 
-	buf = (uint8_t *) malloc(buflen);
+	buf = (uint8_t *) fw_mem_alloc(buflen);
 	if (!buf) {
 		ERR("no memory for buffer\n");
 		goto out;
@@ -551,30 +545,40 @@ static int build_fw(void)
 	if (ret) {
 		goto out_free_buf;
 	}
-	writelen = sizeof (struct fw_header) + firmware_len + 2;
 
 	/* Fill in header */
 	fill_header(buf);
 
-	/* Compute firmware checksum */
-	checksum = checksum_fw(buf + sizeof (struct fw_header), firmware_len);
+	f = fopen(ofname, "wb");
+	if (f == NULL) {
+		ERRS("could not open \"%s\" for writing", ofname);
+		ret = EXIT_FAILURE;
+		goto out_free_buf;
+	}
 
-	/* Cannot use network order function because checksum is not word-aligned */
-	buf[writelen - 1] = checksum >> 8;
-	buf[writelen - 2] = checksum & 0xff;
+	ret = EXIT_FAILURE;
+	if (fwrite(buf, sizeof (struct fw_header), 1, f) != 1) {
+		ERRS("unable to write output file");
+		goto out_close;
+	}
 
-	/* XOR obfuscate firmware */
-	xor_fw(buf + sizeof (struct fw_header), firmware_len + 2);
+	/* Checksum, XOR obfuscate and write firmware in one pass */
+	if (crypt_fw(p, firmware_len, 1, f, &checksum))
+		goto out_close;
 
-	/* Write firmware file */
-	ret = write_fw(buf, writelen);
-	if (ret) {
-		goto out_free_buf;
-	}
+	DBG("firmware file \"%s\" completed", ofname);
 	ret = EXIT_SUCCESS;
 
+ out_close:
+	if (fclose(f) && ret == EXIT_SUCCESS) {
+		ERRS("unable to write output file");
+		ret = EXIT_FAILURE;
+	}
+	if (ret != EXIT_SUCCESS) {
+		unlink(ofname);
+	}
  out_free_buf:
-	free(buf);
+	fw_mem_free(buf, buflen);
  out:
 	return ret;
 }
@@ -643,7 +647,7 @@ static int inspect_fw(void)
 	int ret = EXIT_FAILURE;
 	uint16_t computed_checksum, file_checksum;
 
-	buf = (uint8_t *) malloc(firmware_info.file_size);
+	buf = (uint8_t *) fw_mem_alloc(firmware_info.file_size);
 	if (!buf) {
 		ERR("no memory for buffer!\n");
 		goto out;
@@ -677,11 +681,12 @@ static int inspect_fw(void)
 			   LE32_TO_HOST(hdr->flags), HEADER_FLAGS);
 	printf("\n");
 
-	/* XOR unobfuscate firmware */
-	xor_fw(buf + sizeof (struct fw_header), LE32_TO_HOST(hdr->firmware_len) + 2);
-
-	/* Compute firmware checksum */
-	computed_checksum = checksum_fw(buf + sizeof (struct fw_header), LE32_TO_HOST(hdr->firmware_len));
+	/* XOR unobfuscate firmware and compute its checksum */
+	ret = crypt_fw(buf + sizeof (struct fw_header),
+		       LE32_TO_HOST(hdr->firmware_len), 0, NULL, &computed_checksum);
+	if (ret) {
+		goto out_free_buf;
+	}
 
 	/* Cannot use network order function because checksum is not word-aligned */
 	file_checksum = (buf[firmware_info.file_size - 1] << 8) | buf[firmware_info.file_size - 2];
@@ -724,7 +729,7 @@ static int inspect_fw(void)
 	}
 
  out_free_buf:
-	free(buf);
+	fw_mem_free(buf, firmware_info.file_size);
  out:
 	return ret;
 }
@@ -44,6 +44,9 @@
 
 #include <arpa/inet.h>
 
+#include "fw_io.h"
+#include "fw_sum.h"
+
 #define VERSION_STRING_LEN 31
 #define ROOTFS_HEADER_LEN 40
 
@@ -59,6 +62,8 @@ struct file_info {
     char *name;    /* name of the file */
     char *data;    /* file content */
     size_t size;   /* length of the file */
+    int fd;        /* open while mapped, the data is copied from it */
+    unsigned int chksm; /* zyxel_chksm() of the data */
 };
 
 static char *progname;
@@ -68,16 +73,38 @@ static char *version_name = 0;
 static unsigned int rootfs_size = 0;
 static unsigned int header_length = HEADER_PARTITION_LENGTH;
 
-static struct file_info kernel = { NULL, NULL, 0 };
-static struct file_info rootfs = { NULL, NULL, 0 };
-static struct file_info rootfs_out = { NULL, NULL, 0 };
-static struct file_info out = { NULL, NULL, 0 };
+static struct file_info kernel = { NULL, NULL, 0, -1, 0 };
+static struct file_info rootfs = { NULL, NULL, 0, -1, 0 };
+static struct file_info rootfs_out = { NULL, NULL, 0, -1, 0 };
+static struct file_info out = { NULL, NULL, 0, -1, 0 };
 
 #define ERR(fmt, ...) do { \
     fprintf(stderr, "[%s] *** error: " fmt "\n", \
             progname, ## __VA_ARGS__ ); \
 } while (0)
 
+static int sysv_chksm(const unsigned char *data, size_t size)
+{
+    int r;
+    int checksum;
+    unsigned int s; /* The sum of all the input bytes, modulo (UINT_MAX + 1).  */
+    struct fw_sum sum;
+
+    fw_sum_init(&sum);
+    fw_sum8_update(&sum, data, size);
+    s = sum.sum;
+
+    r = (s & 0xffff) + ((s & 0xffffffff) >> 16);
+    checksum = (r & 0xffff) + (r >> 16);
+
+    return checksum;
+}
+
+static int zyxel_chksm(const unsigned char *data, size_t size)
+{
+     return htonl(sysv_chksm(data, size));
+}
+
 void map_file(struct file_info *finfo)
 {
     struct stat file_stat = {0};
@@ -102,7 +129,9 @@ void map_file(struct file_info *finfo)
         exit(EXIT_FAILURE);
     }
 
-    close(fd);
+    /* This is the only pass over the data, it's copied by the kernel */
+    finfo->fd = fd;
+    finfo->chksm = zyxel_chksm((const unsigned char *)finfo->data, finfo->size);
 }
 
 void unmap_file(struct file_info *finfo)
@@ -111,20 +140,8 @@ void unmap_file(struct file_info *finfo)
         ERR("Error unmapping file %s.", finfo->name);
         exit(EXIT_FAILURE);
     }
-}
-
-void write_file(struct file_info *finfo)
-{
-    FILE *fout = fopen(finfo->name, "w");
-
-    fwrite(finfo->data, finfo->size, 1, fout);
-
-    if (ferror(fout)) {
-        ERR("Wanted to write, but something went wrong.");
-        exit(EXIT_FAILURE);
-    }
-
-    fclose(fout);
+    close(finfo->fd);
+    finfo->fd = -1;
 }
 
 void usage(int status)
@@ -148,28 +165,6 @@ void usage(int status)
     exit(status);
 }
 
-static int sysv_chksm(const unsigned char *data, int size)
-{
-    int r;
-    int checksum;
-    unsigned int s = 0; /* The sum of all the input bytes, modulo (UINT_MAX + 1).  */
-
-
-    for (int i = 0; i < size; i++) {
-        s += data[i];
-    }
-
-    r = (s & 0xffff) + ((s & 0xffffffff) >> 16);
-    checksum = (r & 0xffff) + (r >> 16);
-
-    return checksum;
-}
-
-static int zyxel_chksm(const unsigned char *data, int size)
-{
-     return htonl(sysv_chksm(data, size));
-}
-
 char *generate_rootfs_header(struct file_info filesystem, char *version)
 {
     size_t version_string_length;
@@ -186,7 +181,7 @@ char *generate_rootfs_header(struct file_info filesystem, char *version)
     /* Prepare padding for firmware-version string here */
     memset(rootfs_header, 0xff, ROOTFS_HEADER_LEN);
 
-    chksm = zyxel_chksm((const unsigned char *)filesystem.data, filesystem.size);
+    chksm = filesystem.chksm;
     size = htonl(filesystem.size);
 
     /* 4 bytes:  checksum of the rootfs image */
@@ -219,7 +214,7 @@ char *generate_kernel_header(struct file_info kernel)
         exit(EXIT_FAILURE);
     }
 
-    chksm = zyxel_chksm((const unsigned char *)kernel.data, kernel.size);
+    chksm = kernel.chksm;
     size = htonl(kernel.size);
 
     /* 4 bytes:  checksum of the kernel image */
@@ -300,11 +295,39 @@ char *generate_board_header(char *kernel_hdr, char *rootfs_hdr, char *boardname)
     return board_hdr;
 }
 
+static void write_out(int fd, const void *data, size_t len, off_t offset)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (len) {
+        n = pwrite(fd, p, len, offset);
+        if (n <= 0) {
+            ERR("Wanted to write, but something went wrong.");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+static void copy_out(int fd, struct file_info *finfo, off_t offset)
+{
+    if (fw_io_copy_fd(fd, offset, finfo->fd, 0, finfo->size) != finfo->size) {
+        ERR("Wanted to write, but something went wrong.");
+        exit(EXIT_FAILURE);
+    }
+}
+
 int build_image()
 {
     char *rootfs_header = NULL;
     char *kernel_header = NULL;
     char *board_header = NULL;
+    char *header;
+    size_t header_alloc;
+    int fd;
 
     size_t ptr;
 
@@ -324,16 +347,12 @@ int build_image()
     rootfs_out.size = rootfs_size < rootfs.size ? rootfs.size : rootfs_size;
 
     /*
-     * Allocate memory and copy input rootfs for temporary output rootfs.
-     * This is important as we have to generate the rootfs checksum over the
-     * entire rootfs partition. As we might have to pad the partition to allow
-     * for flashing via ZyXEL's Web-GUI, we prepare the rootfs partition for the
-     * output image here (and also use it for calculating the rootfs checksum).
-     *
-     * The roofs padding has to be done with 0x00.
+     * The rootfs checksum covers the entire rootfs partition. As we might have
+     * to pad the partition to allow for flashing via ZyXEL's Web-GUI, it has
+     * to be the checksum of the padded rootfs, but the padding is done with
+     * 0x00, which adds nothing to the sum.
      */
-    rootfs_out.data = calloc(rootfs_out.size, sizeof(char));
-    memcpy(rootfs_out.data, rootfs.data, rootfs.size);
+    rootfs_out.chksm = rootfs.chksm;
 
     /* Prepare headers */
     rootfs_header = generate_rootfs_header(rootfs_out, version_name);
@@ -341,33 +360,49 @@ int build_image()
         kernel_header = generate_kernel_header(kernel);
     board_header = generate_board_header(kernel_header, rootfs_header, board_name);
 
-    /* Prepare output file */
+    /* Prepare header partition, the rest of the output comes from the files */
     out.size = header_length + rootfs_out.size;
     if (kernel.name)
         out.size += kernel.size;
-    out.data = malloc(out.size);
-    memset(out.data, 0xFF, out.size);
+    header_alloc = ROOTFS_HEADER_LEN + BOARD_HEADER_LEN + KERNEL_HEADER_LEN;
+    if (header_alloc < header_length)
+        header_alloc = header_length;
+    header = malloc(header_alloc);
+    if (!header) {
+        ERR("Couldn't allocate memory for header partition!");
+        exit(EXIT_FAILURE);
+    }
+    memset(header, 0xFF, header_alloc);
 
-    /* Build output image */
-    memcpy(out.data, rootfs_header, ROOTFS_HEADER_LEN);
-    memcpy(out.data + ROOTFS_HEADER_LEN, board_header, BOARD_HEADER_LEN);
+    memcpy(header, rootfs_header, ROOTFS_HEADER_LEN);
+    memcpy(header + ROOTFS_HEADER_LEN, board_header, BOARD_HEADER_LEN);
     if (kernel.name)
-        memcpy(out.data + ROOTFS_HEADER_LEN + BOARD_HEADER_LEN, kernel_header, KERNEL_HEADER_LEN);
+        memcpy(header + ROOTFS_HEADER_LEN + BOARD_HEADER_LEN, kernel_header, KERNEL_HEADER_LEN);
+
+    /* Write output image, the rootfs padding is left as a hole */
+    fd = open(out.name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1 || ftruncate(fd, out.size) == -1) {
+        ERR("Wanted to write, but something went wrong.");
+        exit(EXIT_FAILURE);
+    }
+
+    write_out(fd, header, header_length, 0);
     ptr = header_length;
-    memcpy(out.data + ptr, rootfs_out.data, rootfs_out.size);
+    copy_out(fd, &rootfs, ptr);
     ptr += rootfs_out.size;
     if (kernel.name)
-        memcpy(out.data + ptr, kernel.data, kernel.size);
+        copy_out(fd, &kernel, ptr);
 
-    /* Write back output image */
-    write_file(&out);
+    if (close(fd) == -1) {
+        ERR("Wanted to write, but something went wrong.");
+        exit(EXIT_FAILURE);
+    }
 
     /* Free allocated memory */
     if (kernel.name)
         unmap_file(&kernel);
     unmap_file(&rootfs);
-    free(out.data);
-    free(rootfs_out.data);
+    free(header);
 
     free(rootfs_header);
     if (kernel.name)
@@ -7,6 +7,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,7 +15,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <zlib.h>
+
+#include "fw_crc32.h"
 
 #define IH_MAGIC	0x27051956
 #define IH_NMLEN	32
@@ -78,19 +80,36 @@ typedef enum {
 	NONE, FACTORY, SYSUPGRADE,
 } op_mode_t;
 
+static uint32_t
+data_crc(const void *data, uint32_t len)
+{
+	return ~fw_crc32_parallel(~0u, data, len);
+}
+
+static uint32_t
+header_crc(image_header_t *hdr)
+{
+	uint32_t hcrc = hdr->ih_hcrc, crc;
+
+	hdr->ih_hcrc = 0;
+	crc = ~fw_crc32(~0u, hdr, sizeof(image_header_t));
+	hdr->ih_hcrc = hcrc;
+
+	return crc;
+}
+
 void
-calc_crc(image_header_t *hdr, void *data, uint32_t len)
+calc_crc(image_header_t *hdr, uint32_t dcrc, uint32_t len)
 {
 	/*
-	 * Calculate payload checksum
+	 * Store payload checksum
 	 */
-	hdr->ih_dcrc = htonl(crc32(0, (Bytef *)data, len));
+	hdr->ih_dcrc = htonl(dcrc);
 	hdr->ih_size = htonl(len);
 	/*
 	 * Calculate header checksum
 	 */
-	hdr->ih_hcrc = 0;
-	hdr->ih_hcrc = htonl(crc32(0, (Bytef *)hdr, sizeof(image_header_t)));
+	hdr->ih_hcrc = htonl(header_crc(hdr));
 }
 
 
@@ -117,6 +136,8 @@ process_image(char *progname, char *filename, op_mode_t opmode)
 	struct 		stat sbuf;
 	uint32_t	offset_kernel, offset_sqfs, offset_end,
 			offset_sec_header, offset_eb, offset_image_end;
+	uint32_t	kernel_crc;
+	bool		kernel_crc_valid;
 	squashfs_sb_t *sqs;
 	image_header_t *hdr;
 
@@ -159,6 +180,16 @@ process_image(char *progname, char *filename, op_mode_t opmode)
 		return (EXIT_FAILURE);
 	}
 
+	/*
+	 * An intact header from mkimage, or from an earlier sysupgrade run,
+	 * already carries the CRC of exactly the kernel, so it is reused
+	 * instead of going over the kernel again.
+	 */
+	kernel_crc = ntohl(hdr->ih_dcrc);
+	kernel_crc_valid = ntohl(hdr->ih_hcrc) == header_crc(hdr) &&
+		(hdr->tail.asus.ih_ksz == 0 ||
+		 ntohl(hdr->tail.asus.ih_ksz) == ntohl(hdr->ih_size) + sizeof(image_header_t));
+
 	if (opmode == FACTORY) {
 		strncpy(namebuf, hdr->tail.ih_name, IH_NMLEN);
 		hdr->tail.asus.kernel.major = 0;
@@ -222,14 +253,25 @@ process_image(char *progname, char *filename, op_mode_t opmode)
 	/*
 	 * Calculate checksums for the second header to be used after flashing.
 	 */
+	if (!kernel_crc_valid)
+		kernel_crc = data_crc(ptr+offset_kernel, offset_sqfs - offset_kernel);
+
 	if (opmode == FACTORY) {
 		hdr = ptr+offset_sec_header;
 		memcpy(hdr, ptr, sizeof(image_header_t));
 		strncpy(hdr->tail.ih_name, namebuf, IH_NMLEN);
-		calc_crc(hdr, ptr+offset_kernel, offset_sqfs - offset_kernel);
-		calc_crc((image_header_t *)ptr, ptr+offset_kernel, offset_image_end - offset_kernel);
+		calc_crc(hdr, kernel_crc, offset_sqfs - offset_kernel);
+		/*
+		 * The first header covers the kernel and everything after it;
+		 * only the part past the kernel needs a pass of its own.
+		 */
+		calc_crc((image_header_t *)ptr,
+			 fw_crc32_combine(kernel_crc,
+					  data_crc(ptr+offset_sqfs, offset_image_end - offset_sqfs),
+					  offset_image_end - offset_sqfs),
+			 offset_image_end - offset_kernel);
 	} else {
-		calc_crc((image_header_t *)ptr, ptr+offset_kernel, offset_sqfs - offset_kernel);
+		calc_crc((image_header_t *)ptr, kernel_crc, offset_sqfs - offset_kernel);
 	}
 
 	if (sbuf.st_size > offset_image_end)
@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include "fw_io.h"
 #include "md5.h"
 
 #define HDR_LEN                 0x60
@@ -134,6 +135,23 @@ static int md5_file(const char *filename, uint8_t *dst)
 	return 0;
 }
 
+/* Checksums the header and writes it out in network byte order */
+static void finish_header(img_header *header, int cw_sum, FILE *fp_output)
+{
+	header->zero = 0;
+	header->chksum = header_checksum(header, HDR_LEN) + cw_sum;
+
+	header->head = htonl(header->head);
+	header->vendor_id = htonl(header->vendor_id);
+	header->product_id = htonl(header->product_id);
+	header->firmware_type = htonl(header->firmware_type);
+	header->filesize = htonl(header->filesize);
+	header->chksum = htonl(header->chksum);
+	header->magic = htonl(header->magic);
+
+	fwrite(header, HDR_LEN, 1, fp_output);
+}
+
 static int encode_image(const char *input_file_name,
 			const char *output_file_name, img_header *header,
 			struct capwap_header *cw_header, int block_size)
@@ -150,6 +168,11 @@ static int encode_image(const char *input_file_name,
 	long magic;
 	size_t i;
 
+	size_t data_len;
+	MD5_CTX ctx;
+	int seekable;
+	int cw_sum;
+
 	fp_input = fopen(input_file_name, "r+b");
 	if (!fp_input) {
 		fprintf(stderr, "Cannot open %s !!\n", input_file_name);
@@ -177,29 +200,31 @@ static int encode_image(const char *input_file_name,
 		pad_len = block_size - (header->filesize % block_size);
 	}
 
-	if (md5_file(input_file_name, (uint8_t *) &header->md5sum) < 0) {
+	MD5_Init(&ctx);
+
+	/*
+	 * The MD5 of the data goes into the header, so on a seekable output
+	 * the header is written last and the data is hashed as it is copied.
+	 * Anything else needs the extra pass over the input up front.
+	 */
+	seekable = !fseek(fp_output, HDR_LEN, SEEK_SET);
+	if (!seekable &&
+	    md5_file(input_file_name, (uint8_t *) &header->md5sum) < 0) {
 		fprintf(stderr, "MD5 failed on file %s\n", input_file_name);
 		fclose(fp_input);
 		fclose(fp_output);
 		return -1;
 	}
-	header->zero = 0;
-	header->chksum = header_checksum(header, HDR_LEN);
+
+	cw_sum = 0;
 	if (cw_header) {
-		header->chksum += header_checksum(cw_header,
+		cw_sum = header_checksum(cw_header,
 			sizeof(struct capwap_header) + cw_header->model_size);
 	}
 
-	header->head = htonl(header->head);
-	header->vendor_id = htonl(header->vendor_id);
-	header->product_id = htonl(header->product_id);
-	header->firmware_type = htonl(header->firmware_type);
-	header->filesize = htonl(header->filesize);
-	header->chksum = htonl(header->chksum);
 	magic = header->magic;
-	header->magic = htonl(header->magic);
-
-	fwrite(header, HDR_LEN, 1, fp_output);
+	if (!seekable)
+		finish_header(header, cw_sum, fp_output);
 
 	if (cw_header) {
 		model_size = cw_header->model_size;
@@ -223,6 +248,7 @@ static int encode_image(const char *input_file_name,
 			bytes_read = fread(&buf, 1, BUF_SIZE, fp_input);
 		else
 			bytes_read = 0;
+		data_len = bytes_read;
 
 		/*
 		 * No more bytes read, start padding
@@ -234,11 +260,21 @@ static int encode_image(const char *input_file_name,
 			pad_len -= bytes_avail < pad_len ? bytes_avail : pad_len;
 		}
 
+		if (seekable)
+			MD5_Update(&ctx, &buf, data_len);
+		data_len = 0;
+
 		for (i = 0; i < bytes_read; i++)
 			buf[i] ^= magic >> (i % 8) & 0xff;
 		fwrite(&buf, bytes_read, 1, fp_output);
 	}
 
+	if (seekable) {
+		MD5_Final(header->md5sum, &ctx);
+		fseek(fp_output, 0, SEEK_SET);
+		finish_header(header, cw_sum, fp_output);
+	}
+
 	fclose(fp_input);
 	fclose(fp_output);
 	return 1;
@@ -258,6 +294,12 @@ int decode_image(const char *input_file_name, const char *output_file_name)
 	size_t bytes_written;
 	unsigned int i;
 
+	uint8_t md5sum[MD5_SIZE];
+	struct fw_io_map map;
+	const uint8_t *data;
+	MD5_CTX ctx;
+	long offset;
+
 	fp_input = fopen(input_file_name, "r+b");
 	if (!fp_input) {
 		fprintf(stderr, "Cannot open %s !!\n", input_file_name);
@@ -326,6 +368,30 @@ int decode_image(const char *input_file_name, const char *output_file_name)
 		}
 	}
 
+	MD5_Init(&ctx);
+
+	/*
+	 * Decode straight from a mapping of the input where possible. The
+	 * key repeats every 8 bytes, so it lines up with any chunk of
+	 * BUF_SIZE.
+	 */
+	offset = ftell(fp_input);
+	if (!fw_io_map(&map, fileno(fp_input), offset,
+		       get_file_size(input_file_name) - offset)) {
+		data = map.data;
+		bytes_read = map.len < header.filesize ? map.len : header.filesize;
+		for (bytes_written = 0; bytes_written < bytes_read;
+		     bytes_written += i) {
+			for (i = 0; i < BUF_SIZE && bytes_written + i < bytes_read; i++)
+				buf[i] = data[bytes_written + i] ^
+					 (header.magic >> (i % 8) & 0xff);
+			MD5_Update(&ctx, &buf, i);
+			fwrite(&buf, i, 1, fp_output);
+		}
+		fw_io_unmap(&map);
+		goto out;
+	}
+
 	bytes_written = 0;
 	while (!feof(fp_input)) {
 
@@ -338,15 +404,23 @@ int decode_image(const char *input_file_name, const char *output_file_name)
 		 */
 		if (bytes_written + bytes_read > header.filesize) {
 			bytes_read = header.filesize - bytes_written;
-			if (bytes_read > 0)
+			if (bytes_read > 0) {
+				MD5_Update(&ctx, &buf, bytes_read);
 				fwrite(&buf, bytes_read, 1, fp_output);
+			}
 			break;
 		}
 
+		MD5_Update(&ctx, &buf, bytes_read);
 		fwrite(&buf, bytes_read, 1, fp_output);
 		bytes_written += bytes_read;
 	}
 
+out:
+	MD5_Final(md5sum, &ctx);
+	if (memcmp(md5sum, header.md5sum, MD5_SIZE))
+		fprintf(stderr, "Warning: MD5 of the decoded data does not match the header\n");
+
 	fclose(fp_input);
 	fclose(fp_output);
 
@@ -7,6 +7,12 @@
 #include <byteswap.h>
 #include <endian.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_sum.h"
 
 #if !defined(__BYTE_ORDER)
 #error "Unknown byte order"
@@ -53,122 +59,208 @@ static int is_header = 1;
 
 struct file_info {
 	char* file_name; /* name of the file */
-	char* file_data; /* data of the file in memory */
 	u_int32_t file_size; /* length of the file */
 };
 
-static u_int8_t getCheckSum(char* data, int len) {
-	u_int8_t new = 0;
-	int i;
-
-	if (!data) {
-		ERR("Invalid pointer provided!\n");
-		return 0;
-	}
+/* One image of a multi-output build, see writeVariants() */
+struct variant {
+	const char* file_name;
+	char hdr[512];
+	int err;
+};
 
-	for (i = 0; i < len; i++) {
-		new += data[i];
-	}
+struct variants {
+	struct file_info* finfo;
+	int fd;
+	u_int8_t sum; /* of the input, for the header checksums */
+	struct variant* v;
+	int n;
+};
 
-	return new;
+static void sumSink(void* priv, const void* buf, size_t len) {
+	fw_sum8_update(priv, buf, len);
 }
 
 /*
- * read file into buffer
- * add space for header/footer
+ * get the size of the input file
  */
-static int copyToOutputBuf(struct file_info* finfo) {
-	FILE* fp = NULL;
-
-	int file_sz = 0;
-	int extra_sz;
-	int hdr_pos;
-	int img_pos;
+static int getFileSize(struct file_info* finfo, int fd) {
+	struct stat st;
 
-	if (!finfo || !finfo->file_name) {
-		ERR("Invalid pointer provided!\n");
+	if (fstat(fd, &st) || st.st_size < 1) {
+		ERR("Error getting filesize: %s\n", finfo->file_name);
 		return -1;
 	}
 
-	DBG("Opening file: %s\n", finfo->file_name);
+	DBG("Filesize: %i\n", (int) st.st_size);
+	finfo->file_size = st.st_size;
+
+	return 0;
+}
 
-	if (!(fp = fopen(finfo->file_name, "rb"))) {
-		ERR("Error opening file: %s\n", finfo->file_name);
+/*
+ * a footer is simply appended to the input file
+ */
+static int writeFooter(struct file_info* finfo, int fd, const char* footer) {
+	if (pwrite(fd, footer, footer_sz, finfo->file_size) != footer_sz) {
+		ERR("Wanted to write, but something went wrong!\n");
 		return -1;
 	}
 
-	/* Get filesize */
-	rewind(fp);
-	fseek(fp, 0L, SEEK_END);
-	file_sz = ftell(fp);
-	rewind(fp);
+	return 0;
+}
 
-	if (file_sz < 1) {
-		ERR("Error getting filesize: %s\n", finfo->file_name);
-		fclose(fp);
-		return -1;
-	}
+/*
+ * a header goes in front of the input, so the image is built next to it
+ * and renamed over it: the input is copied behind the header by the
+ * kernel and summed on the way, then the header is written with the
+ * checksum of both
+ */
+static int writeHeader(struct file_info* finfo, int fd, char* header) {
+	struct fw_io_extent ext = {
+		.fd = fd, .len = finfo->file_size, .out_off = header_sz,
+		.sink = sumSink,
+	};
+	struct fw_sum sum;
+	struct stat st;
+	u_int8_t chkSum;
+	char* tmp_name;
+	int out_fd;
 
-	if (is_header) {
-		extra_sz = header_sz;
-		hdr_pos = 0;
-		img_pos = header_sz;
-	} else {
-		extra_sz = footer_sz;
-		hdr_pos = file_sz;
-		img_pos = 0;
+	if (!(tmp_name = malloc(strlen(finfo->file_name) + 8))) {
+		ERR("Out of memory!\n");
+		return -1;
 	}
+	sprintf(tmp_name, "%s.XXXXXX", finfo->file_name);
 
-	DBG("Filesize: %i\n", file_sz);
-	finfo->file_size = file_sz + extra_sz;
+	DBG("Opening file: %s\n", tmp_name);
 
-	if (!(finfo->file_data = malloc(finfo->file_size))) {
-		ERR("Out of memory!\n");
-		fclose(fp);
+	if ((out_fd = mkstemp(tmp_name)) < 0) {
+		ERR("Error opening file: %s\n", tmp_name);
+		free(tmp_name);
 		return -1;
 	}
 
-	/* init header/footer bytes */
-	memset(finfo->file_data + hdr_pos, 0, extra_sz);
+	fw_sum_init(&sum);
+	fw_sum8_update(&sum, header, header_sz);
+	ext.priv = &sum;
 
-	/* read file and take care of leading header if exists */
-	if (fread(finfo->file_data + img_pos, 1, file_sz, fp) != file_sz) {
+	DBG("Writing file: %s\n", finfo->file_name);
+
+	if (fw_io_copy_extents(out_fd, &ext, 1)) {
 		ERR("Error reading file %s\n", finfo->file_name);
-		fclose(fp);
-		return -1;
+		goto err;
 	}
 
-	DBG("File: read successful\n");
-	fclose(fp);
+	/* calculate checksum and invert checksum */
+	chkSum = sum.sum;
+	chkSum = (chkSum ^ 0xFF) + 1;
+	DBG("Checksum for Image: %hhX\n", chkSum);
 
-	return hdr_pos;
-}
+	/* write checksum to header */
+	header[511] = (char) chkSum;
 
-static int writeFile(struct file_info* finfo) {
-	FILE* fp;
+	if (pwrite(out_fd, header, header_sz, 0) != header_sz) {
+		ERR("Wanted to write, but something went wrong!\n");
+		goto err;
+	}
 
-	if (!finfo || !finfo->file_name) {
-		ERR("Invalid pointer provided!\n");
+	/* overwrite input file, keeping its permissions */
+	if (fstat(fd, &st) || fchmod(out_fd, st.st_mode & 07777) ||
+	    close(out_fd) || rename(tmp_name, finfo->file_name)) {
+		ERR("Wanted to write, but something went wrong!\n");
+		unlink(tmp_name);
+		free(tmp_name);
 		return -1;
 	}
 
-	DBG("Opening file: %s\n", finfo->file_name);
+	free(tmp_name);
+	return 0;
 
-	if (!(fp = fopen(finfo->file_name, "w"))) {
-		ERR("Error opening file: %s\n", finfo->file_name);
-		return -1;
+err:
+	close(out_fd);
+	unlink(tmp_name);
+	free(tmp_name);
+	return -1;
+}
+
+/*
+ * with -o the input stays as it is and each output gets the input with its
+ * own header or footer: the input is summed once for all of them and each
+ * is written by its own job, the payload copied by the kernel
+ */
+static void writeVariant(void* arg, unsigned int idx) {
+	struct variants* vs = arg;
+	struct variant* v = &vs->v[idx];
+	struct fw_sum sum;
+	u_int8_t chkSum;
+	int out_fd, err;
+
+	DBG("Writing file: %s\n", v->file_name);
+
+	if ((out_fd = open(v->file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		ERR("Error opening file: %s\n", v->file_name);
+		v->err = 1;
+		return;
 	}
 
-	DBG("Writing file: %s\n", finfo->file_name);
+	if (is_header) {
+		fw_sum_init(&sum);
+		fw_sum8_update(&sum, v->hdr, header_sz);
+		chkSum = sum.sum + vs->sum;
+		chkSum = (chkSum ^ 0xFF) + 1;
+		DBG("Checksum for Image: %hhX\n", chkSum);
+		v->hdr[511] = (char) chkSum;
+
+		err = fw_io_prepend(out_fd, v->hdr, header_sz, vs->fd, 0,
+				    vs->finfo->file_size, NULL, 0, NULL, NULL);
+	} else {
+		err = fw_io_prepend(out_fd, NULL, 0, vs->fd, 0, vs->finfo->file_size,
+				    v->hdr, footer_sz, NULL, NULL);
+	}
 
-	if (fwrite(finfo->file_data, 1, finfo->file_size, fp) != finfo->file_size) {
+	if (close(out_fd) || err) {
 		ERR("Wanted to write, but something went wrong!\n");
-		fclose(fp);
-		return -1;
+		unlink(v->file_name);
+		v->err = 1;
 	}
+}
 
-	fclose(fp);
-	return 0;
+static int writeVariants(struct file_info* finfo, int fd, struct variant* v, int n) {
+	struct variants vs = { .finfo = finfo, .fd = fd, .v = v, .n = n };
+	struct fw_io_map map;
+	struct fw_sum sum;
+	int i, ret = 0;
+
+	if (is_header) {
+		if (fw_io_map(&map, fd, 0, finfo->file_size)) {
+			ERR("Error reading file %s\n", finfo->file_name);
+			return -1;
+		}
+		fw_sum_init(&sum);
+		fw_sum8_update(&sum, map.data, map.len);
+		fw_io_unmap(&map);
+		vs.sum = sum.sum;
+	}
+
+	fw_pool_run(n, writeVariant, &vs);
+
+	for (i = 0; i < n; i++)
+		if (v[i].err)
+			ret = -1;
+
+	return ret;
+}
+
+static void fillHeader(char* hdr, const char* hwID, const char* hwVer, u_int32_t swVer) {
+	DBG("Filling header: %s %s %2X %s\n", hwID, hwVer, swVer, magic);
+
+	strncpy(hdr + 0, magic, 7);
+	memcpy(hdr + 7, version, sizeof(version));
+	strncpy(hdr + 11, hwID, 34);
+	strncpy(hdr + 45, hwVer, 10);
+	memcpy(hdr + 55, &swVer, sizeof(swVer));
+	strncpy(hdr + 63, magic, 7);
 }
 
 static void usage(char* argv[]) {
@@ -180,6 +272,8 @@ static void usage(char* argv[]) {
 	       "  -r <hwrev>    use hardware revision specified with <hwrev> (ASCII)\n"
 	       "  -v <version>  set image version to <version> (decimal, hex or octal notation)\n"
 	       "  -i <file>     input file\n"
+	       "  -o <file>     write the image to <file> instead of over the input, with\n"
+	       "                the -b, -r and -v given before it; may be repeated\n"
 	       , argv[0]);
 }
 
@@ -189,13 +283,16 @@ int main(int argc, char* argv[]) {
 	char* hwID = NULL;
 	char* hwVer = NULL;
 	u_int32_t swVer = 0;
-	u_int8_t chkSum;
-	int hdr_offset;
+	char hdr[512] = { 0 };
+	struct variant* variants = NULL;
+	int n_variants = 0;
+	struct variant* v;
+	int fd, ret;
 
 	while ( 1 ) {
 		int c;
 
-		c = getopt(argc, argv, "b:i:r:v:f");
+		c = getopt(argc, argv, "b:i:o:r:v:f");
 		if (c == -1)
 			break;
 
@@ -209,6 +306,21 @@ int main(int argc, char* argv[]) {
 		case 'i':
 			image.file_name = optarg;
 			break;
+		case 'o':
+			if (!hwID || !hwVer) {
+				usage(argv);
+				return EXIT_FAILURE;
+			}
+			if (!(v = realloc(variants, (n_variants + 1) * sizeof(*v)))) {
+				ERR("Out of memory!\n");
+				return EXIT_FAILURE;
+			}
+			variants = v;
+			v = &variants[n_variants++];
+			memset(v, 0, sizeof(*v));
+			v->file_name = optarg;
+			fillHeader(v->hdr, hwID, hwVer, swVer);
+			break;
 		case 'r':
 			hwVer = optarg;
 			break;
@@ -227,35 +339,31 @@ int main(int argc, char* argv[]) {
 			return EXIT_FAILURE;
 	}
 
-	/*
-	 * copy input to buffer, add extra space for header/footer and return
-	 * header position
-	 */
-	hdr_offset = copyToOutputBuf(&image);
-	if (hdr_offset < 0)
-		return EXIT_FAILURE;
-
-	DBG("Filling header: %s %s %2X %s\n", hwID, hwVer, swVer, magic);
+	DBG("Opening file: %s\n", image.file_name);
 
-	strncpy(image.file_data + hdr_offset + 0, magic, 7);
-	memcpy(image.file_data + hdr_offset + 7, version, sizeof(version));
-	strncpy(image.file_data + hdr_offset + 11, hwID, 34);
-	strncpy(image.file_data + hdr_offset + 45, hwVer, 10);
-	memcpy(image.file_data + hdr_offset + 55, &swVer, sizeof(swVer));
-	strncpy(image.file_data + hdr_offset + 63, magic, 7);
+	if ((fd = open(image.file_name, n_variants ? O_RDONLY : O_RDWR)) < 0) {
+		ERR("Error opening file: %s\n", image.file_name);
+		return EXIT_FAILURE;
+	}
 
-	/* calculate checksum and invert checksum */
-	if (is_header) {
-		chkSum = getCheckSum(image.file_data, image.file_size);
-		chkSum = (chkSum ^ 0xFF) + 1;
-		DBG("Checksum for Image: %hhX\n", chkSum);
+	if (getFileSize(&image, fd)) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
 
-		/* write checksum to header */
-		image.file_data[511] = (char) chkSum;
+	if (n_variants) {
+		ret = writeVariants(&image, fd, variants, n_variants);
+	} else {
+		fillHeader(hdr, hwID, hwVer, swVer);
+		if (is_header)
+			ret = writeHeader(&image, fd, hdr);
+		else
+			ret = writeFooter(&image, fd, hdr);
 	}
 
-	/* overwrite input file */
-	if (writeFile(&image))
+	close(fd);
+	free(variants);
+	if (ret)
 		return EXIT_FAILURE;
 
 	return EXIT_SUCCESS;
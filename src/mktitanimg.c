@@ -3,7 +3,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "mktitanimg.h"
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_pool.h"
+
+/* -o takes one or more output files, all built from the same -i images */
+#define NSP_MAX_IMAGES	16
 
 
 struct checksumrecord
@@ -13,6 +22,186 @@ struct checksumrecord
  Excepting the
                                            checksum block */
 };
+
+/*
+ * Everything after the header is the same in every image of a run, and in
+ * each image's .non_web copy: header padding, kernel, kernel padding, root
+ * filesystem and its trailer. It is laid out once as pieces that are either
+ * an input file or a constant buffer, with the MSB-first CRC over all of
+ * it, so the images are written without reading anything back.
+ */
+#define NSP_MAX_PIECES	7
+
+struct nsp_piece
+{
+	int		fd;	/* input file, or -1 for buf */
+	const void	*buf;
+	size_t		len;
+};
+
+struct nsp_body
+{
+	struct nsp_piece	piece[NSP_MAX_PIECES];
+	int			num_pieces;
+	uint32_t		crc;
+	uintmax_t		len;
+};
+
+static struct nsp_body body;
+
+/* Append a buffer of len bytes of c */
+static int nsp_add_fill(int c, size_t len)
+{
+	struct nsp_piece *piece = &body.piece[body.num_pieces];
+	void *buf;
+
+	if(!len)
+		return 1;
+	buf = malloc(len);
+	if(buf == NULL)
+		return 0;
+	memset(buf, c, len);
+
+	piece->fd = -1;
+	piece->buf = buf;
+	piece->len = len;
+	body.num_pieces++;
+
+	body.crc = fw_crc32_be(body.crc, buf, len);
+	body.len += len;
+
+	return 1;
+}
+
+/* Append an input image, returning its cs sum in *sum */
+static int nsp_add_file(const char *file_name, size_t *size, unsigned long *sum)
+{
+	struct nsp_piece *piece = &body.piece[body.num_pieces];
+	struct fw_io_map map;
+	struct stat st;
+	uint32_t crc;
+	int fd;
+
+	fd = open(file_name, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	if(fstat(fd, &st) < 0 || fw_io_map(&map, fd, 0, st.st_size) < 0) {
+		close(fd);
+		return 0;
+	}
+
+	crc = fw_crc32_be(0, map.data, map.len);
+	fw_io_unmap(&map);
+
+	piece->fd = fd;
+	piece->buf = NULL;
+	piece->len = st.st_size;
+	body.num_pieces++;
+
+	*size = st.st_size;
+	*sum = cs_finish_sum(crc, st.st_size);
+	body.crc = fw_crc32_be_combine(body.crc, crc, st.st_size);
+	body.len += st.st_size;
+
+	return 1;
+}
+
+static void nsp_free_body(void)
+{
+	int i;
+
+	for(i = 0; i < body.num_pieces; i++) {
+		if(body.piece[i].fd >= 0)
+			close(body.piece[i].fd);
+		else
+			free((void *)body.piece[i].buf);
+	}
+}
+
+/* Write header, body and an optional trailer to a new file */
+static int nsp_write_file(const char *name, const void *hdr, size_t hdr_len,
+			  const void *tail, size_t tail_len)
+{
+	off_t off = hdr_len;
+	int i, fd;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0)
+		return 0;
+
+	if(pwrite(fd, hdr, hdr_len, 0) != (ssize_t)hdr_len)
+		goto err;
+
+	for(i = 0; i < body.num_pieces; i++) {
+		struct nsp_piece *piece = &body.piece[i];
+		ssize_t n;
+
+		if(piece->fd >= 0)
+			n = fw_io_copy_fd(fd, off, piece->fd, 0, piece->len);
+		else
+			n = pwrite(fd, piece->buf, piece->len, off);
+		if(n != (ssize_t)piece->len)
+			goto err;
+		off += piece->len;
+	}
+
+	if(tail_len && pwrite(fd, tail, tail_len, off) != (ssize_t)tail_len)
+		goto err;
+
+	return close(fd) == 0;
+
+err:
+	close(fd);
+	return 0;
+}
+
+/* One output image: its own header copy, and the name to write it to */
+struct nsp_image
+{
+	char				*filen_out;
+	struct nsp_img_hdr_head		*hdr;
+	int				res;
+};
+
+static int header_size;
+
+static void nsp_write_image(void *arg, unsigned int idx)
+{
+	struct nsp_image *image = (struct nsp_image *)arg + idx;
+	struct checksumrecord cr;
+	char non_web_name[256];
+	uint32_t crc;
+	char flags;
+
+	/* header + everything after it */
+	cr.magic = CKSUM_MAGIC_NUMBER;
+	crc = fw_crc32_be(0, image->hdr, header_size);
+	crc = fw_crc32_be_combine(crc, body.crc, body.len);
+	cr.chksum = cs_finish_sum(crc, header_size + body.len);
+
+	image->res = nsp_write_file(image->filen_out, image->hdr, header_size,
+				    &cr, sizeof(cr));
+	if(!image->res)
+		return;
+
+	/* the .non_web copy is the same image without the checksum record */
+	snprintf(non_web_name, sizeof(non_web_name), "%s.non_web", image->filen_out);
+	flags = ((char *)image->hdr)[0xb];
+	((char *)image->hdr)[0xb] = 0x17;
+	image->res = nsp_write_file(non_web_name, image->hdr, header_size, NULL, 0);
+	((char *)image->hdr)[0xb] = flags;
+}
+
+/* Argument i of opt, or its only one when it applies to every image */
+static char *nsp_optarg(char *argv[], char opt, int i)
+{
+	void *list = cmdline_getarg_list(opt);
+
+	if(i >= cmdline_getarg_count(list))
+		i = 0;
+	return argv[cmdline_getarg(list, i)];
+}
+
 /***************************************************************************
  * void print_help(void)
  ***************************************************************************/
@@ -23,9 +212,12 @@ void print_help(void)
 		"mknspimg version 1.0, Texas Instruments, 2004",
 		"Syntax:",
 		"        mknspimg -o outfile -i image1 image2 -a align1 align2 [-v] [-b] [-p prod_id] [-r rel_id] [-s rel_name] [-f flags]",
+		"        mknspimg -o outfile1 outfile2 ... -i image1 image2 -a align1 align2 [-p prod_id1 prod_id2 ...] ...",
 		"Example:",
 		"        mknspimg -o nsp_image.bin -i kernel.bin files.img -a 0 4096",
-		"This generates 'nsp_image.bin' from two input files aligning first to 0 and second to 4096 bytes."
+		"This generates 'nsp_image.bin' from two input files aligning first to 0 and second to 4096 bytes.",
+		"With several output files, each of -p, -r, -s and -f takes either one value for all",
+		"images or one per output file."
 	};
 
 	int num_lines = sizeof(help_page)/sizeof(char*);
@@ -56,8 +248,10 @@ void mknspimg_print_hdr(struct nsp_img_hdr *hdr)
 	printf("Offset Sect info:  0x%x\n",		hdr->head.sect_info_offset);
 	printf("Offset Sections:   0x%x\n",		hdr->sect_info.sections_offset);
 
-	chksum=(struct nsp_img_hdr_chksum *)(hdr+hdr->head.chksum_offset);
-	printf("Header Checksum:   0x%x\n",		chksum->hdr_chksum);
+	if(hdr->head.chksum_offset != 0xffffffff) {
+		chksum=(struct nsp_img_hdr_chksum *)((char *)hdr+hdr->head.chksum_offset);
+		printf("Header Checksum:   0x%x\n",		chksum->hdr_chksum);
+	}
 
 	printf("+++ Section Information +++\n");
 	printf("# of sections:     %u\n", hdr->sect_info.num_sects);
@@ -82,7 +276,7 @@ CMDLINE_CFG	cmd_line_cfg =
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-c' */
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-d' */
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-e' */
-		{	1,	1,	CMDLINE_OPTFLAG_ALLOW },		/* '-f' flags */
+		{	1,	NSP_MAX_IMAGES,	CMDLINE_OPTFLAG_ALLOW },		/* '-f' flags */
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-g' */
 		{	1,	1,	CMDLINE_OPTFLAG_ALLOW },		/* '-h' */
 		{	2,	2,	(CMDLINE_OPTFLAG_ALLOW | CMDLINE_OPTFLAG_MANDAT) },	/* '-i arg1 arg2 ' */
@@ -91,11 +285,11 @@ CMDLINE_CFG	cmd_line_cfg =
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-l' */
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-m' */
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-n' */
-		{	1,	1,	(CMDLINE_OPTFLAG_ALLOW | CMDLINE_OPTFLAG_MANDAT) },	/* '-o arg' */
-		{	1,	1,	CMDLINE_OPTFLAG_ALLOW },		/* '-p' PROD_ID */
+		{	1,	NSP_MAX_IMAGES,	(CMDLINE_OPTFLAG_ALLOW | CMDLINE_OPTFLAG_MANDAT) },	/* '-o arg' */
+		{	1,	NSP_MAX_IMAGES,	CMDLINE_OPTFLAG_ALLOW },		/* '-p' PROD_ID */
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-q' */
-		{	1,	1,	CMDLINE_OPTFLAG_ALLOW },		/* '-r' REL_ID */
-		{	1,	1,	CMDLINE_OPTFLAG_ALLOW },		/* '-s' "Release XXX.XXX" */
+		{	1,	NSP_MAX_IMAGES,	CMDLINE_OPTFLAG_ALLOW },		/* '-r' REL_ID */
+		{	1,	NSP_MAX_IMAGES,	CMDLINE_OPTFLAG_ALLOW },		/* '-s' "Release XXX.XXX" */
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-t' */
 		{	0,	0,	!CMDLINE_OPTFLAG_ALLOW },		/* '-u' */
 		{	0,	0,	CMDLINE_OPTFLAG_ALLOW },		/* '-v' control VERBOSE/NON-VERBOSE mode */
@@ -113,19 +307,18 @@ CMDLINE_CFG	cmd_line_cfg =
  ***************************************************************************/
 int main(int argc, char* argv[], char* env[])
 {
-	FILE*	nsp_image	= NULL;
 	int header_version=1;
 	int	cmdline_err;
 	char*	cmdline_error_msg;
 
-	char*	filen_out;
+	struct nsp_image	images[NSP_MAX_IMAGES];
+	int	num_images;
 
-	int	i,count;			/* loop variables */
+	int	i,j;			/* loop variables */
 	int	num_sects = 2;			/* We require exactly two image with -i option
 							   (see CMDLINE_CFG structure above) */
 	int	total = 0;
 
-	int	header_size=0;
 	struct nsp_img_hdr_head		*img_hdr_head;	/* Start of image header */
 	struct nsp_img_hdr_info *img_hdr_info;
 	struct nsp_img_hdr_section_info *img_hdr_section_info ;
@@ -155,7 +348,19 @@ int main(int argc, char* argv[], char* env[])
 		header_version=atoi(argv[cmdline_getarg(cmdline_getarg_list('h'),0)]);
 	}
 	/* Set up arguments */
-	filen_out	= argv[cmdline_getarg(cmdline_getarg_list('o'),0)];
+	num_images = cmdline_getarg_count(cmdline_getarg_list('o'));
+	{
+		static const char per_image[] = "fprs";
+
+		for(i = 0; per_image[i]; i++) {
+			int n = cmdline_getarg_count(cmdline_getarg_list(per_image[i]));
+
+			if(n > 1 && n != num_images) {
+				printf("ERROR: -%c needs one value, or one per output file.\n", per_image[i]);
+				return -1;
+			}
+		}
+	}
 	/* Command line arguments have been parsed. Start doing our work. */
 
 	/* Caculate the header size, and allocate the memory, and assign the sub pointers */
@@ -186,22 +391,12 @@ int main(int argc, char* argv[], char* env[])
 /*	chksum = (struct nsp_img_hdr_chksum *)
 			((unsigned int)image_hdr + header_size - sizeof(struct nsp_img_hdr_chksum));*/
 
-	/* Open the out file */
-	nsp_image = fopen(filen_out,"wb+");
-	if(nsp_image==NULL) {
-		printf("ERROR: can't open %s for writing.\n", filen_out);
-		return -1;
-	}
-
-	/* Skip image header. We'll come back to it after we've written out the images. */	
-	fseek(nsp_image,header_size,SEEK_SET);
-	total = ftell(nsp_image);
+	/* Skip image header. We'll come back to it after we've laid out the images. */	
 	total = header_size;
 	printf("total=%x\n",total);
 	{
 		int align;
 		int	padding;
-		char * buf;
 		align = (header_version==1?0x10000:0x4000);
 		if(align==0) {
 			/* The user indicated no padding */
@@ -213,46 +408,30 @@ int main(int argc, char* argv[], char* env[])
 			else
 				padding = align - (total % align);
 		}
-		if(padding>0)
-		{
-			buf=malloc(padding);
-			memset(buf, 0xff, padding);
-			if(fwrite((void*)buf,1,padding,nsp_image)!=padding) {
-				printf("ERROR: can't write to %s.\n", filen_out);
-				free(buf);
-				fclose(nsp_image);
-				return -1;
-			}
-			free(buf);
-			
+		if(!nsp_add_fill(0xff, padding)) {
+			printf("ERROR: out of memory.\n");
+			return -1;
 		}
 		total+=padding;
 		
 
 	}
-	/* Write out all specified images (with -i option) */
+	/* Lay out all specified images (with -i option) */
 	for(i=0; i < num_sects; i++) {
 		char*	file_name;		/* input file name */
-		FILE*	filep;			/* input file pointer */
+		size_t	raw_size;		/* input file size */
 		int	padding;		/* number of padding bytes to prepend */
 		int	align;			/* align factor from command line */
-		int	result;			/* intermediate result */
-		char * buf;
+		unsigned long	sum;		/* section checksum */
 
-		/* Open the specified image for reading */
+		/* Map the specified image, checksumming it once for all outputs */
 		file_name	= argv[cmdline_getarg(cmdline_getarg_list('i'),i)];
-		filep		= fopen(file_name, "rb");
-		if(filep==NULL) {
+		if(!nsp_add_file(file_name, &raw_size, &sum)) {
 			printf("ERROR: can't open file %s for reading.\n", file_name);
 			return -1;
 		}
 		section->flags = ~0x00;
-		/* Determine file size */
-		fseek(filep,0,SEEK_END);
-		section->raw_size=ftell(filep);
-		fseek(filep,0,SEEK_SET);
-		cs_calc_sum(filep,(unsigned long *)&section->chksum,0);
-		fseek(filep,0,SEEK_SET);
+		section->raw_size=raw_size;
 
 		/* Retrieve the alignment constant */
 		/* Set image offset from the beginning of the out file */
@@ -260,12 +439,7 @@ int main(int argc, char* argv[], char* env[])
 
 		//total += padding;
 
-		/* Copy the image file into nsp_image */
-		count = section->raw_size;
-		buf=malloc(count);
-		result=fread(buf, 1, count, filep);
-		fwrite(buf, 1, result, nsp_image);
-		free(buf);
+		section->chksum = sum;
 		
 		/* HACK: This is a hack to get the names and types to the files.
 			TODO: Fix this to be a real method */
@@ -290,15 +464,22 @@ int main(int argc, char* argv[], char* env[])
 		else{
 			#define EXTRA_BLOCK 0x10000
 			unsigned int squash_padding;
+			char * buf;
 			squash_padding = EXTRA_BLOCK - section->raw_size % EXTRA_BLOCK;
 			buf=malloc(EXTRA_BLOCK + 4);
-			memset(buf, 0, squash_padding);
-			fwrite(buf, 1, squash_padding, nsp_image);
+			if(buf == NULL || !nsp_add_fill(0, squash_padding)) {
+				printf("ERROR: out of memory.\n");
+				return -1;
+			}
 			memset(buf, 0, EXTRA_BLOCK + 4);
 			*((unsigned int *)buf)=0xdec0adde;
 			*((unsigned int *)(buf+EXTRA_BLOCK))=0xdec0adde;
-			fwrite(buf, 1, EXTRA_BLOCK+4, nsp_image);
-			free(buf);
+			body.piece[body.num_pieces].fd = -1;
+			body.piece[body.num_pieces].buf = buf;
+			body.piece[body.num_pieces].len = EXTRA_BLOCK + 4;
+			body.num_pieces++;
+			body.crc = fw_crc32_be(body.crc, buf, EXTRA_BLOCK + 4);
+			body.len += EXTRA_BLOCK + 4;
 			
 			if(align==0 || (((section->raw_size + (EXTRA_BLOCK + 4 + squash_padding)) %align)==0))
 				padding=0;
@@ -306,19 +487,15 @@ int main(int argc, char* argv[], char* env[])
 				padding = align - ((section->raw_size + (EXTRA_BLOCK + 4 + squash_padding)) % align);
 			section->total_size=section->raw_size + (EXTRA_BLOCK + 4 + squash_padding) + padding;
 		}
-		if(padding>0){
-			buf=malloc(padding);
-			memset(buf, 0xff, padding);
-			fwrite(buf, 1, padding, nsp_image);
-			free(buf);
+		if(padding>0 && !nsp_add_fill(0xff, padding)) {
+			printf("ERROR: out of memory.\n");
+			return -1;
 		}
 		printf("*****padding is %d\ttotal_size=%d\traw_size=%d\n",padding, section->total_size, section->raw_size);
 
 		//total += section->raw_size;
 		total = section->total_size + section->offset;
 		printf("total=0x%x\n",total);
-		/* Close the input file */
-		fclose(filep);
 
 		/* Move the section pointer to the next slot */
 		section++;
@@ -329,33 +506,12 @@ int main(int argc, char* argv[], char* env[])
 	/* head fields */
 	img_hdr_head->magic		= NSP_IMG_MAGIC_NUMBER;
 	img_hdr_head->boot_offset	= img_hdr_sections->offset;
-	img_hdr_head->flags		= ~0x00;			/* Set to all 1's */
-
-	if(cmdline_getopt_count('b'))
-		img_hdr_head->flags	&= ~(NSP_IMG_FLAG_FAILBACK_5 | NSP_IMG_FLAG_FAILBACK_1);
-
-	if(cmdline_getopt_count('f'))
-		img_hdr_head->flags	= strtoul(argv[cmdline_getarg(cmdline_getarg_list('f'),0)], 0, 16);
 
 #if 0
 	img_hdr_head->hdr_version	= 2;
 	img_hdr_head->hdr_size	= header_size;
 #endif
 
-	if(cmdline_getopt_count('p'))
-		img_hdr_head->prod_id		= strtoul(argv[cmdline_getarg(cmdline_getarg_list('p'),0)], 0, 16);
-	else
-		img_hdr_head->prod_id		= 0x4C575943;
-
-	if(cmdline_getopt_count('r'))
-		img_hdr_head->rel_id		= strtoul(argv[cmdline_getarg(cmdline_getarg_list('r'),0)], 0, 0);
-	else
-		img_hdr_head->rel_id		= 0x10203040;
-
-	if(cmdline_getopt_count('s'))
-		img_hdr_head->version		= strtoul(argv[cmdline_getarg(cmdline_getarg_list('s'),0)], 0, 0);
-	else
-		img_hdr_head->version		= 0x0b040000;
 	img_hdr_head->image_size	= total;
 #if 0
 	img_hdr_head->info_offset	= (unsigned int)(&(image_hdr->info)) -
@@ -369,7 +525,6 @@ int main(int argc, char* argv[], char* env[])
 	/* info fields */
 	/* TODO: Fix. Do nothing yet */
 //	strncpy(nsp_img_hdr.id.prod_info,NSP_PRODINFO_STRING,sizeof(NSP_PRODINFO_STRING));
-	strcpy(img_hdr_info->image_filename, (const char *)basename(filen_out));
 	/* section fields */
 #if 0
 	img_hdr_section_info->num_sects=		num_sects;
@@ -383,72 +538,75 @@ int main(int argc, char* argv[], char* env[])
 	chksum->hdr_chksum = cs_calc_buf_sum((char*)image_hdr,
 			header_size - sizeof(struct nsp_img_hdr_chksum));
 #endif
-	/* Write out the NSP header. */
-	fseek(nsp_image,0,SEEK_SET);
-	count = fwrite((void*)img_hdr_head, header_size, 1, nsp_image);
-	if(count!=1) {
-		printf("ERROR: can't write to %s.\n", filen_out);
-		return -1;
-	}
 
-	/* Check if -v option was specified (no arg needed) */
-	if(cmdline_getopt_count('v') > 0)
-	{
-		struct nsp_img_hdr_head	head;
-		struct nsp_img_hdr	*hdr;
+	/* Every output gets its own copy of the header with its own ids */
+	for(i = 0; i < num_images; i++) {
+		struct nsp_img_hdr_head *head;
+		struct nsp_img_hdr_info *info;
 
-		/* Rewind the file back to the beginning */
-		fseek(nsp_image,0,SEEK_SET);
+		head = malloc(header_size);
+		if(head == NULL) {
+			printf("ERROR: out of memory.\n");
+			return -1;
+		}
+		memcpy(head, img_hdr_head, header_size);
+		info = (struct nsp_img_hdr_info *)((char *)head + ((char *)img_hdr_info - (char *)img_hdr_head));
 
-		/* Read header from the file */
-		fread((void*)&head, sizeof(struct nsp_img_hdr_head),
-				1, nsp_image);
+		images[i].filen_out = argv[cmdline_getarg(cmdline_getarg_list('o'),i)];
+		images[i].hdr = head;
 
-		/* Get memory to store the complete header */
-		hdr = (struct nsp_img_hdr *)malloc(head.hdr_size);
+		head->flags		= ~0x00;			/* Set to all 1's */
 
-		/* Read header from the file */
-		fseek(nsp_image,0,SEEK_SET);
-		fread((void*)hdr, head.hdr_size, 1, nsp_image);
+		if(cmdline_getopt_count('b'))
+			head->flags	&= ~(NSP_IMG_FLAG_FAILBACK_5 | NSP_IMG_FLAG_FAILBACK_1);
 
-		/* Print it out */
-		mknspimg_print_hdr(hdr);
-		printf("Generated total %d bytes\n",total);
-		free(hdr);
+		if(cmdline_getopt_count('f'))
+			head->flags	= strtoul(nsp_optarg(argv, 'f', i), 0, 16);
+
+		if(cmdline_getopt_count('p'))
+			head->prod_id		= strtoul(nsp_optarg(argv, 'p', i), 0, 16);
+		else
+			head->prod_id		= 0x4C575943;
+
+		if(cmdline_getopt_count('r'))
+			head->rel_id		= strtoul(nsp_optarg(argv, 'r', i), 0, 0);
+		else
+			head->rel_id		= 0x10203040;
+
+		if(cmdline_getopt_count('s'))
+			head->version		= strtoul(nsp_optarg(argv, 's', i), 0, 0);
+		else
+			head->version		= 0x0b040000;
+
+		strcpy(info->image_filename, (const char *)basename(images[i].filen_out));
 	}
 
-	free(img_hdr_head);
+	/* Write out the images */
+	fw_pool_run(num_images, nsp_write_image, images);
+
+	for(i = 0, j = 0; i < num_images; i++) {
+		if(!images[i].res) {
+			printf("ERROR: can't write to %s.\n", images[i].filen_out);
+			j = -1;
+			continue;
+		}
 
-      {
-	  struct checksumrecord cr;
-      cr.magic=CKSUM_MAGIC_NUMBER;
-      cs_calc_sum(nsp_image, (unsigned long *)&cr.chksum, 0);
-      fseek(nsp_image,0, SEEK_END);
-      fwrite(&cr, 1, sizeof(cr), nsp_image);
-	  }
-	  {
-		FILE * non_web;
-		char fname[256];
-		char * img_buf;
-		unsigned int len;
-		strcpy(fname, filen_out);
-		strcat(fname, ".non_web");
-		non_web = fopen(fname,"wb+");
-		fseek(nsp_image, 0, SEEK_END);
-		len = ftell(nsp_image);
-		img_buf=malloc(len);
-		fseek(nsp_image, 0, SEEK_SET);
-		fread(img_buf, 1, len, nsp_image);
-		img_buf[0xb] = 0x17;
-		fwrite(img_buf, 1, len-sizeof(struct checksumrecord), non_web);
-		fclose(non_web);
-		free(img_buf);
-	  }
-	  /* Close NSP image file */
-	fclose(nsp_image);
+		/* Check if -v option was specified (no arg needed) */
+		if(cmdline_getopt_count('v') > 0)
+		{
+			/* Print it out */
+			mknspimg_print_hdr((struct nsp_img_hdr *)images[i].hdr);
+			printf("Generated total %d bytes\n",total);
+		}
+	}
+
+	for(i = 0; i < num_images; i++)
+		free(images[i].hdr);
+	free(img_hdr_head);
+	nsp_free_body();
 
 	/* return result */
-	return(0);
+	return(j);
 }
 
 #ifdef DMALLOC
@@ -457,62 +615,6 @@ int main(int argc, char* argv[], char* env[])
 
 #define BUFLEN (1 << 16)
 
-static unsigned long crctab[256] =
-{
-	0x0,
-	0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B,
-	0x1A864DB2, 0x1E475005, 0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6,
-	0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD,
-	0x4C11DB70, 0x48D0C6C7, 0x4593E01E, 0x4152FDA9, 0x5F15ADAC,
-	0x5BD4B01B, 0x569796C2, 0x52568B75, 0x6A1936C8, 0x6ED82B7F,
-	0x639B0DA6, 0x675A1011, 0x791D4014, 0x7DDC5DA3, 0x709F7B7A,
-	0x745E66CD, 0x9823B6E0, 0x9CE2AB57, 0x91A18D8E, 0x95609039,
-	0x8B27C03C, 0x8FE6DD8B, 0x82A5FB52, 0x8664E6E5, 0xBE2B5B58,
-	0xBAEA46EF, 0xB7A96036, 0xB3687D81, 0xAD2F2D84, 0xA9EE3033,
-	0xA4AD16EA, 0xA06C0B5D, 0xD4326D90, 0xD0F37027, 0xDDB056FE,
-	0xD9714B49, 0xC7361B4C, 0xC3F706FB, 0xCEB42022, 0xCA753D95,
-	0xF23A8028, 0xF6FB9D9F, 0xFBB8BB46, 0xFF79A6F1, 0xE13EF6F4,
-	0xE5FFEB43, 0xE8BCCD9A, 0xEC7DD02D, 0x34867077, 0x30476DC0,
-	0x3D044B19, 0x39C556AE, 0x278206AB, 0x23431B1C, 0x2E003DC5,
-	0x2AC12072, 0x128E9DCF, 0x164F8078, 0x1B0CA6A1, 0x1FCDBB16,
-	0x018AEB13, 0x054BF6A4, 0x0808D07D, 0x0CC9CDCA, 0x7897AB07,
-	0x7C56B6B0, 0x71159069, 0x75D48DDE, 0x6B93DDDB, 0x6F52C06C,
-	0x6211E6B5, 0x66D0FB02, 0x5E9F46BF, 0x5A5E5B08, 0x571D7DD1,
-	0x53DC6066, 0x4D9B3063, 0x495A2DD4, 0x44190B0D, 0x40D816BA,
-	0xACA5C697, 0xA864DB20, 0xA527FDF9, 0xA1E6E04E, 0xBFA1B04B,
-	0xBB60ADFC, 0xB6238B25, 0xB2E29692, 0x8AAD2B2F, 0x8E6C3698,
-	0x832F1041, 0x87EE0DF6, 0x99A95DF3, 0x9D684044, 0x902B669D,
-	0x94EA7B2A, 0xE0B41DE7, 0xE4750050, 0xE9362689, 0xEDF73B3E,
-	0xF3B06B3B, 0xF771768C, 0xFA325055, 0xFEF34DE2, 0xC6BCF05F,
-	0xC27DEDE8, 0xCF3ECB31, 0xCBFFD686, 0xD5B88683, 0xD1799B34,
-	0xDC3ABDED, 0xD8FBA05A, 0x690CE0EE, 0x6DCDFD59, 0x608EDB80,
-	0x644FC637, 0x7A089632, 0x7EC98B85, 0x738AAD5C, 0x774BB0EB,
-	0x4F040D56, 0x4BC510E1, 0x46863638, 0x42472B8F, 0x5C007B8A,
-	0x58C1663D, 0x558240E4, 0x51435D53, 0x251D3B9E, 0x21DC2629,
-	0x2C9F00F0, 0x285E1D47, 0x36194D42, 0x32D850F5, 0x3F9B762C,
-	0x3B5A6B9B, 0x0315D626, 0x07D4CB91, 0x0A97ED48, 0x0E56F0FF,
-	0x1011A0FA, 0x14D0BD4D, 0x19939B94, 0x1D528623, 0xF12F560E,
-	0xF5EE4BB9, 0xF8AD6D60, 0xFC6C70D7, 0xE22B20D2, 0xE6EA3D65,
-	0xEBA91BBC, 0xEF68060B, 0xD727BBB6, 0xD3E6A601, 0xDEA580D8,
-	0xDA649D6F, 0xC423CD6A, 0xC0E2D0DD, 0xCDA1F604, 0xC960EBB3,
-	0xBD3E8D7E, 0xB9FF90C9, 0xB4BCB610, 0xB07DABA7, 0xAE3AFBA2,
-	0xAAFBE615, 0xA7B8C0CC, 0xA379DD7B, 0x9B3660C6, 0x9FF77D71,
-	0x92B45BA8, 0x9675461F, 0x8832161A, 0x8CF30BAD, 0x81B02D74,
-	0x857130C3, 0x5D8A9099, 0x594B8D2E, 0x5408ABF7, 0x50C9B640,
-	0x4E8EE645, 0x4A4FFBF2, 0x470CDD2B, 0x43CDC09C, 0x7B827D21,
-	0x7F436096, 0x7200464F, 0x76C15BF8, 0x68860BFD, 0x6C47164A,
-	0x61043093, 0x65C52D24, 0x119B4BE9, 0x155A565E, 0x18197087,
-	0x1CD86D30, 0x029F3D35, 0x065E2082, 0x0B1D065B, 0x0FDC1BEC,
-	0x3793A651, 0x3352BBE6, 0x3E119D3F, 0x3AD08088, 0x2497D08D,
-	0x2056CD3A, 0x2D15EBE3, 0x29D4F654, 0xC5A92679, 0xC1683BCE,
-	0xCC2B1D17, 0xC8EA00A0, 0xD6AD50A5, 0xD26C4D12, 0xDF2F6BCB,
-	0xDBEE767C, 0xE3A1CBC1, 0xE760D676, 0xEA23F0AF, 0xEEE2ED18,
-	0xF0A5BD1D, 0xF464A0AA, 0xF9278673, 0xFDE69BC4, 0x89B8FD09,
-	0x8D79E0BE, 0x803AC667, 0x84FBDBD0, 0x9ABC8BD5, 0x9E7D9662,
-	0x933EB0BB, 0x97FFAD0C, 0xAFB010B1, 0xAB710D06, 0xA6322BDF,
-	0xA2F33668, 0xBCB4666D, 0xB8757BDA, 0xB5365D03, 0xB1F740B4
-};
-
 int cs_is_tagged(FILE *fp)
 {
 	char buf[8];
@@ -533,80 +635,74 @@ unsigned long cs_read_sum(FILE *fp)
 	return *((unsigned long*)&buf[4]);
 }
 
+/*
+ * The sums are POSIX cksum style: an MSB-first CRC-32 over the data, then
+ * over the significant bytes of the length (least significant first),
+ * inverted. cs_finish_sum() does the last two steps for a register that
+ * fw_crc32_be() has run over length bytes.
+ */
+unsigned long cs_finish_sum(uint32_t crc, uintmax_t length)
+{
+	unsigned char lenbuf[sizeof(length)];
+	size_t n = 0;
+
+	for(; length; length >>= 8)
+		lenbuf[n++] = length & 0xFF;
+
+	crc = fw_crc32_be(crc, lenbuf, n);
+
+	return ~crc & 0xFFFFFFFF;
+}
+
 int cs_calc_sum(FILE *fp, unsigned long *res, int tagged)
 {
 	unsigned char buf[BUFLEN];
-	unsigned long crc = 0;
-	uintmax_t length = 0;
+	uint32_t crc = 0;
+	uintmax_t length = 0, remain = UINTMAX_MAX;
 	size_t bytes_read;
 
+	/* a tagged file ends in its 8 byte checksum record, leave that out */
+	if(tagged) {
+		fseek(fp, 0, SEEK_END);
+		remain = ftell(fp);
+		if(remain < 8)
+			return 0;
+		remain -= 8;
+	}
+
 	fseek(fp, 0, SEEK_SET);
 
-	while((bytes_read = fread(buf, 1, BUFLEN, fp)) > 0)
+	while(remain && (bytes_read = fread(buf, 1, remain < BUFLEN ? remain : BUFLEN, fp)) > 0)
 	{
-		unsigned char *cp = buf;
-
 		if(length + bytes_read < length)
 			return 0;
 
-		if(bytes_read != BUFLEN && tagged)
-			bytes_read -= 8;
-
 		length += bytes_read;
-		while(bytes_read--)
-			crc =(crc << 8) ^ crctab[((crc >> 24) ^ *cp++) & 0xFF];
+		remain -= bytes_read;
+		crc = fw_crc32_be(crc, buf, bytes_read);
 	}
 
 	if(ferror(fp))
 		return 0;
 
-	for(; length; length >>= 8)
-		crc =(crc << 8) ^ crctab[((crc >> 24) ^ length) & 0xFF];
-
-	crc = ~crc & 0xFFFFFFFF;
-
-	*res = crc;
+	*res = cs_finish_sum(crc, length);
 
 	return 1;
 }
 
 unsigned long cs_calc_buf_sum(char *buf, int size)
 {
-	unsigned long crc = 0;
-	char *cp = buf;
-	unsigned long length = size;
-
-	while(size--)
-		crc =(crc << 8) ^ crctab[((crc >> 24) ^ *cp++) & 0xFF];
-
-	for(; length; length >>= 8)
-		crc =(crc << 8) ^ crctab[((crc >> 24) ^ length) & 0xFF];
-
-	crc = ~crc & 0xFFFFFFFF;
-
-	return crc;
+	return cs_finish_sum(fw_crc32_be(0, buf, size), size);
 }
 
 unsigned long cs_calc_buf_sum_ds(char *buf, int buf_size, char *sign, int sign_len)
 {
-	unsigned long crc = 0;
-	char *cp = buf;
-	unsigned long length = buf_size+sign_len;
-
-	while(buf_size--)
-		crc =(crc << 8) ^ crctab[((crc >> 24) ^ *cp++) & 0xFF];
-
-	cp = sign;
-	while(sign_len--)
-		crc =(crc << 8) ^ crctab[((crc >> 24) ^ *cp++) & 0xFF];
-
-
-	for(; length; length >>= 8)
-		crc =(crc << 8) ^ crctab[((crc >> 24) ^ length) & 0xFF];
+	uint32_t crc;
 
-	crc = ~crc & 0xFFFFFFFF;
+	crc = fw_crc32_be(0, buf, buf_size);
+	crc = fw_crc32_be(crc, sign, sign_len);
 
-	return crc;
+	return cs_finish_sum(crc, buf_size + sign_len);
 }
 
 int cs_set_sum(FILE *fp, unsigned long sum, int tagged)
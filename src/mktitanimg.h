@@ -17,6 +17,7 @@ int cs_calc_sum(FILE*, unsigned long*, int);
 int cs_set_sum(FILE*, unsigned long, int);
 void cs_get_sum(FILE*, unsigned long*);
 unsigned long cs_calc_buf_sum(char*, int);
+unsigned long cs_finish_sum(uint32_t, uintmax_t);
 int cs_validate_file(char*);
 
 #endif
@@ -18,12 +18,18 @@
 #include <stdbool.h>
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
 #include "mktplinkfw-lib.h"
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_registry.h"
+#include "fw_trace.h"
 #include "md5.h"
 
 extern char *ofname;
@@ -44,18 +50,15 @@ void fill_header(char *buf, int len);
 
 struct flash_layout *find_layout(struct flash_layout *layouts, const char *id)
 {
-	struct flash_layout *ret;
-	struct flash_layout *l;
-
-	ret = NULL;
-	for (l = layouts; l->id != NULL; l++){
-		if (strcasecmp(id, l->id) == 0) {
-			ret = l;
-			break;
-		}
-	};
+	/* Every tool passes the same table each time */
+	static struct fw_registry registry;
 
-	return ret;
+	if (registry.table != layouts) {
+		free(registry.slots);
+		registry = (struct fw_registry)FW_REGISTRY_INIT(layouts, id, true);
+	}
+
+	return fw_registry_find(&registry, id);
 }
 
 void get_md5(const char *data, int size, uint8_t *md5)
@@ -75,13 +78,14 @@ int get_file_stat(struct file_info *fdata)
 	if (fdata->file_name == NULL)
 		return 0;
 
-	res = stat(fdata->file_name, &st);
+	res = fw_io_stat_input(fdata->file_name, &st);
 	if (res){
 		ERRS("stat failed on %s", fdata->file_name);
 		return res;
 	}
 
 	fdata->file_size = st.st_size;
+
 	return 0;
 }
 
@@ -96,6 +100,8 @@ int read_to_buf(const struct file_info *fdata, char *buf)
 		goto out;
 	}
 
+	fw_io_advise(fileno(f), 0, fdata->file_size);
+
 	errno = 0;
 	fread(buf, fdata->file_size, 1, f);
 	if (errno != 0) {
@@ -111,6 +117,7 @@ out:
 	return ret;
 }
 
+/* With buf == NULL only the padded length is computed */
 static int pad_jffs2(char *buf, int currlen, int maxlen)
 {
 	int len;
@@ -136,8 +143,9 @@ static int pad_jffs2(char *buf, int currlen, int maxlen)
 				pad_mask &= ~mask;
 		}
 
-		for (i = 0; i < sizeof(jffs2_eof_mark); i++)
-			buf[len + i] = jffs2_eof_mark[i];
+		if (buf)
+			for (i = 0; i < sizeof(jffs2_eof_mark); i++)
+				buf[len + i] = jffs2_eof_mark[i];
 
 		len += sizeof(jffs2_eof_mark);
 	}
@@ -177,6 +185,154 @@ out:
 	return ret;
 }
 
+static int inspect_map(struct inspect_file *f)
+{
+	struct stat st;
+	int fd, err;
+
+	fd = open(f->file_name, O_RDONLY);
+	if (fd < 0) {
+		ERRS("could not open \"%s\" for reading", f->file_name);
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		ERRS("stat failed on %s", f->file_name);
+		close(fd);
+		return -1;
+	}
+
+	err = fw_io_map(&f->map, fd, 0, st.st_size);
+	close(fd);
+	if (err) {
+		errno = -err;
+		ERRS("unable to read from file \"%s\"", f->file_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct inspect_md5_job {
+	struct inspect_file *files;
+	unsigned int n;
+};
+
+#define INSPECT_MD5_GROUP	8
+
+/* One MD5_Multi_Update() over a group of images */
+static void inspect_md5_group(void *arg, unsigned int idx)
+{
+	struct inspect_md5_job *job = arg;
+	struct inspect_file *f, *group[INSPECT_MD5_GROUP];
+	MD5_CTX ctx[INSPECT_MD5_GROUP], *pctx[INSPECT_MD5_GROUP];
+	const void *data[INSPECT_MD5_GROUP];
+	unsigned long size[INSPECT_MD5_GROUP];
+	unsigned int i, m = 0;
+	size_t rest;
+
+	for (i = idx * INSPECT_MD5_GROUP;
+	     i < job->n && i < (idx + 1) * INSPECT_MD5_GROUP; i++) {
+		f = &job->files[i];
+		if (!f->salt)
+			continue;
+
+		rest = f->md5_ofs + MD5SUM_LEN;
+		MD5_Init(&ctx[m]);
+		MD5_Update(&ctx[m], f->map.data, f->md5_ofs);
+		MD5_Update(&ctx[m], f->salt, MD5SUM_LEN);
+		pctx[m] = &ctx[m];
+		data[m] = f->map.data + rest;
+		size[m] = f->map.len - rest;
+		group[m++] = f;
+	}
+
+	MD5_Multi_Update(pctx, data, size, m);
+
+	for (i = 0; i < m; i++)
+		MD5_Final(group[i]->md5, &ctx[i]);
+}
+
+int inspect_files(char **names, int n,
+		  void (*prepare)(struct inspect_file *f),
+		  void (*print)(struct inspect_file *f))
+{
+	struct inspect_md5_job job;
+	struct inspect_file *files;
+	bool *mapped;
+	int i, printed = 0, ret = EXIT_SUCCESS;
+
+	files = calloc(n, sizeof(*files));
+	mapped = calloc(n, sizeof(*mapped));
+	if (!files || !mapped) {
+		ERR("no memory for buffer!\n");
+		free(files);
+		free(mapped);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < n; i++) {
+		files[i].file_name = names[i];
+		if (inspect_map(&files[i])) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		mapped[i] = true;
+		prepare(&files[i]);
+	}
+
+	job.files = files;
+	job.n = n;
+	fw_pool_run((n + INSPECT_MD5_GROUP - 1) / INSPECT_MD5_GROUP,
+		    inspect_md5_group, &job);
+
+	for (i = 0; i < n; i++) {
+		if (!mapped[i])
+			continue;
+		if (printed++)
+			printf("\n");
+		print(&files[i]);
+		fw_io_unmap(&files[i].map);
+	}
+
+	free(mapped);
+	free(files);
+
+	return ret;
+}
+
+void inspect_extract(const struct inspect_file *f, const char *what,
+		     uint32_t ofs, uint32_t len)
+{
+	char *filename;
+	FILE *fp;
+
+	filename = malloc(strlen(f->file_name) + strlen(what) + 2);
+	if (!filename) {
+		ERR("no memory for buffer!\n");
+		return;
+	}
+	sprintf(filename, "%s-%s", f->file_name, what);
+	printf("Extracting %s to \"%s\"...\n", what, filename);
+
+	if (ofs > f->map.len || len > f->map.len - ofs) {
+		ERR("%s data lies beyond the end of the file", what);
+		free(filename);
+		return;
+	}
+
+	fp = fopen(filename, "w");
+	if (fp)	{
+		if (!fwrite(f->map.data + ofs, len, 1, fp)) {
+			ERR("error in fwrite(): %s", strerror(errno));
+		}
+		fclose(fp);
+	} else {
+		ERR("error in fopen(): %s", strerror(errno));
+	}
+	free(filename);
+}
+
 /* Helper functions to inspect_fw() representing different output formats */
 inline void inspect_fw_pstr(const char *label, const char *str)
 {
@@ -203,14 +359,104 @@ inline void inspect_fw_pmd5sum(const char *label, const uint8_t *val, const char
 	printf(" %s\n", text);
 }
 
+/*
+ * Lay the image out in buf, which must hold maplen bytes. The regions the
+ * kernel and rootfs are read into are the only ones not filled here, so
+ * every byte of buf is written once before the header MD5 reads it back.
+ */
+static int assemble_fw(char *buf, size_t maplen, size_t header_size,
+		       int writelen)
+{
+	size_t end;
+	int ret;
+
+	end = header_size + kernel_info.file_size;
+	ret = read_to_buf(&kernel_info, buf + header_size);
+	if (ret)
+		return ret;
+
+	if (!combined) {
+		if (rootfs_ofs > end)
+			memset(buf + end, 0xff, rootfs_ofs - end);
+
+		ret = read_to_buf(&rootfs_info, buf + rootfs_ofs);
+		if (ret)
+			return ret;
+
+		end = rootfs_ofs + rootfs_info.file_size;
+	}
+
+	if (maplen > end)
+		memset(buf + end, 0xff, maplen - end);
+
+	if (!combined && add_jffs2_eof)
+		pad_jffs2(buf, rootfs_ofs + rootfs_info.file_size,
+			  layout->fw_max_len);
+
+	fill_header(buf, writelen);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Build the image straight in a shared mapping of the output file, so the
+ * inputs are read into their final place and only the MD5 pass reads them
+ * again. Returns -1 without having written anything if the output can't be
+ * mapped, e.g. because it is a pipe.
+ */
+static int build_fw_mapped(size_t header_size, size_t maplen, int writelen)
+{
+	char *buf;
+	int ret;
+	int fd;
+
+	fd = open(ofname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, maplen)) {
+		close(fd);
+		return -1;
+	}
+
+	buf = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	ret = assemble_fw(buf, maplen, header_size, writelen);
+	munmap(buf, maplen);
+
+	if (!ret && maplen != writelen && ftruncate(fd, writelen)) {
+		ERRS("unable to write output file");
+		ret = EXIT_FAILURE;
+	}
+
+	if (close(fd) && !ret) {
+		ERRS("unable to write output file");
+		ret = EXIT_FAILURE;
+	}
+
+	if (ret)
+		unlink(ofname);
+	else
+		DBG("firmware file \"%s\" completed", ofname);
+
+	return ret;
+}
+
 // header_size = sizeof(struct fw_header)
 int build_fw(size_t header_size)
 {
 	int buflen;
 	char *buf;
-	char *p;
 	int ret = EXIT_FAILURE;
 	int writelen = 0;
+	struct fw_trace t;
+	int padlen;
+
+	fw_trace_begin(&t, "build_fw");
 
 	writelen = header_size + kernel_len;
 
@@ -219,35 +465,34 @@ int build_fw(size_t header_size)
 	else
 		buflen = layout->fw_max_len;
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto out;
-	}
-
-	memset(buf, 0xff, buflen);
-	p = buf + header_size;
-	ret = read_to_buf(&kernel_info, p);
-	if (ret)
-		goto out_free_buf;
-
 	if (!combined) {
-		p = buf + rootfs_ofs;
-
-		ret = read_to_buf(&rootfs_info, p);
-		if (ret)
-			goto out_free_buf;
-
 		writelen = rootfs_ofs + rootfs_info.file_size;
 
 		if (add_jffs2_eof)
-			writelen = pad_jffs2(buf, writelen, layout->fw_max_len);
+			writelen = pad_jffs2(NULL, writelen, layout->fw_max_len);
 	}
 
+	/* The last EOF marker may stick out past the flash */
+	padlen = writelen > buflen ? writelen : buflen;
+
 	if (!strip_padding)
 		writelen = buflen;
 
-	fill_header(buf, writelen);
+	ret = build_fw_mapped(header_size, padlen, writelen);
+	if (ret >= 0)
+		goto out;
+
+	buf = malloc(padlen);
+	if (!buf) {
+		ERR("no memory for buffer\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	ret = assemble_fw(buf, padlen, header_size, writelen);
+	if (ret)
+		goto out_free_buf;
+
 	ret = write_fw(ofname, buf, writelen);
 	if (ret)
 		goto out_free_buf;
@@ -257,5 +502,6 @@ int build_fw(size_t header_size)
 out_free_buf:
 	free(buf);
 out:
+	fw_trace_end(&t, writelen);
 	return ret;
 }
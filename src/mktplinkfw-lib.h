@@ -11,6 +11,8 @@
 #ifndef mktplinkfw_lib_h
 #define mktplinkfw_lib_h
 
+#include "fw_io.h"
+
 #define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
 #define ARRAY_SIZE(a) (sizeof((a)) / sizeof((a)[0]))
 
@@ -61,4 +63,31 @@ inline void inspect_fw_phexdec(const char *label, uint32_t val);
 inline void inspect_fw_pmd5sum(const char *label, const uint8_t *val, const char *text);
 int build_fw(size_t header_size);
 
+/*
+ * An image being inspected. The tool's prepare() sets salt once the
+ * header looks right; the MD5 of the image is then computed with salt in
+ * place of the 16 bytes at md5_ofs, without copying anything.
+ */
+struct inspect_file {
+	const char		*file_name;
+	struct fw_io_map	map;
+	size_t			md5_ofs;
+	const uint8_t		*salt;
+	uint8_t			md5[MD5SUM_LEN];
+};
+
+/*
+ * Map all n files, call prepare() for each, run the MD5 checks of all of
+ * them on the worker pool with the multi-buffer MD5 and then print() them
+ * in order, a blank line apart. Returns EXIT_FAILURE if any file couldn't
+ * be mapped.
+ */
+int inspect_files(char **names, int n,
+		  void (*prepare)(struct inspect_file *f),
+		  void (*print)(struct inspect_file *f));
+
+/* For -x: write len bytes of f from ofs to "<file_name>-<what>" */
+void inspect_extract(const struct inspect_file *f, const char *what,
+		     uint32_t ofs, uint32_t len);
+
 #endif /* mktplinkfw_lib_h */
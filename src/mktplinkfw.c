@@ -17,6 +17,7 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <endian.h>
 #include <errno.h>
 #include <sys/stat.h>
@@ -101,7 +102,8 @@ int add_jffs2_eof;
 static uint32_t fw_max_len;
 static uint32_t reserved_space;
 
-static struct file_info inspect_info;
+static char **inspect_names;
+static int num_inspect;
 static int extract = 0;
 static bool endian_swap = false;
 static bool rootfs_ofs_calc = false;
@@ -214,7 +216,7 @@ static void usage(int status)
 "  -V <version>    set image version to <version>\n"
 "  -v <version>    set firmware version to <version>\n"
 "  -m <version>    set header version to <version>\n"
-"  -i <file>       inspect given firmware file <file>\n"
+"  -i <file>       inspect given firmware file <file>, may be repeated\n"
 "  -x              extract kernel and rootfs while inspecting (requires -i)\n"
 "  -X <size>       reserve <size> bytes in the firmware image (hexval prefixed with 0x)\n"
 "  -h              show this screen\n"
@@ -228,10 +230,12 @@ static int check_options(void)
 	int ret;
 	int exceed_bytes;
 
-	if (inspect_info.file_name) {
-		ret = get_file_stat(&inspect_info);
-		if (ret)
-			return ret;
+	if (num_inspect) {
+		struct file_info inspect_info = { .file_name = inspect_names[0] };
+
+		/* A single image is still stat()ed up front, as before -i repeated */
+		if (num_inspect == 1)
+			return get_file_stat(&inspect_info);
 
 		return 0;
 	} else if (extract) {
@@ -418,47 +422,45 @@ void fill_header(char *buf, int len)
 		get_md5(buf, len, hdr->md5sum1);
 }
 
-static int inspect_fw(void)
+static void inspect_fw_prepare(struct inspect_file *f)
 {
-	char *buf;
-	struct fw_header *hdr;
-	uint8_t md5sum[MD5SUM_LEN];
-	int ret = EXIT_FAILURE;
+	const struct fw_header *hdr = (const struct fw_header *)f->map.data;
 
-	buf = malloc(inspect_info.file_size);
-	if (!buf) {
-		ERR("no memory for buffer!\n");
-		goto out;
-	}
+	if (f->map.len < sizeof(*hdr))
+		return;
 
-	ret = read_to_buf(&inspect_info, buf);
-	if (ret)
-		goto out_free_buf;
-	hdr = (struct fw_header *)buf;
+	if ((ntohl(hdr->version) != HEADER_VERSION_V1) &&
+	    (ntohl(hdr->version) != HEADER_VERSION_V2))
+		return;
 
-	inspect_fw_pstr("File name", inspect_info.file_name);
-	inspect_fw_phexdec("File size", inspect_info.file_size);
+	f->md5_ofs = offsetof(struct fw_header, md5sum1);
+	if (ntohl(hdr->boot_len) == 0)
+		f->salt = (const uint8_t *)md5salt_normal;
+	else
+		f->salt = (const uint8_t *)md5salt_boot;
+}
 
-	if ((ntohl(hdr->version) != HEADER_VERSION_V1) &&
-	    (ntohl(hdr->version) != HEADER_VERSION_V2)) {
+static void inspect_fw_print(struct inspect_file *f)
+{
+	struct fw_header hdr_buf;
+	struct fw_header *hdr = &hdr_buf;
+
+	inspect_fw_pstr("File name", f->file_name);
+	inspect_fw_phexdec("File size", f->map.len);
+
+	if (!f->salt) {
 		ERR("file does not seem to have V1/V2 header!\n");
-		goto out_free_buf;
+		return;
 	}
+	memcpy(hdr, f->map.data, sizeof(*hdr));
 
 	inspect_fw_phexdec("Version 1 Header size", sizeof(struct fw_header));
 
-	memcpy(md5sum, hdr->md5sum1, sizeof(md5sum));
-	if (ntohl(hdr->boot_len) == 0)
-		memcpy(hdr->md5sum1, md5salt_normal, sizeof(md5sum));
-	else
-		memcpy(hdr->md5sum1, md5salt_boot, sizeof(md5sum));
-	get_md5(buf, inspect_info.file_size, hdr->md5sum1);
-
-	if (memcmp(md5sum, hdr->md5sum1, sizeof(md5sum))) {
-		inspect_fw_pmd5sum("Header MD5Sum1", md5sum, "(*ERROR*)");
-		inspect_fw_pmd5sum("          --> expected", hdr->md5sum1, "");
+	if (memcmp(hdr->md5sum1, f->md5, sizeof(f->md5))) {
+		inspect_fw_pmd5sum("Header MD5Sum1", hdr->md5sum1, "(*ERROR*)");
+		inspect_fw_pmd5sum("          --> expected", f->md5, "");
 	} else {
-		inspect_fw_pmd5sum("Header MD5Sum1", md5sum, "(ok)");
+		inspect_fw_pmd5sum("Header MD5Sum1", hdr->md5sum1, "(ok)");
 	}
 	if (ntohl(hdr->unk2) != 0)
 		inspect_fw_phexdec("Unknown value 2", hdr->unk2);
@@ -497,46 +499,13 @@ static int inspect_fw(void)
 	                   ntohl(hdr->fw_length));
 
 	if (extract) {
-		FILE *fp;
-		char *filename;
-
 		printf("\n");
 
-		filename = malloc(strlen(inspect_info.file_name) + 8);
-		sprintf(filename, "%s-kernel", inspect_info.file_name);
-		printf("Extracting kernel to \"%s\"...\n", filename);
-		fp = fopen(filename, "w");
-		if (fp)	{
-			if (!fwrite(buf + ntohl(hdr->kernel_ofs),
-			            ntohl(hdr->kernel_len), 1, fp)) {
-				ERR("error in fwrite(): %s", strerror(errno));
-			}
-			fclose(fp);
-		} else {
-			ERR("error in fopen(): %s", strerror(errno));
-		}
-		free(filename);
-
-		filename = malloc(strlen(inspect_info.file_name) + 8);
-		sprintf(filename, "%s-rootfs", inspect_info.file_name);
-		printf("Extracting rootfs to \"%s\"...\n", filename);
-		fp = fopen(filename, "w");
-		if (fp)	{
-			if (!fwrite(buf + ntohl(hdr->rootfs_ofs),
-			            ntohl(hdr->rootfs_len), 1, fp)) {
-				ERR("error in fwrite(): %s", strerror(errno));
-			}
-			fclose(fp);
-		} else {
-			ERR("error in fopen(): %s", strerror(errno));
-		}
-		free(filename);
+		inspect_extract(f, "kernel", ntohl(hdr->kernel_ofs),
+				ntohl(hdr->kernel_len));
+		inspect_extract(f, "rootfs", ntohl(hdr->rootfs_ofs),
+				ntohl(hdr->rootfs_len));
 	}
-
- out_free_buf:
-	free(buf);
- out:
-	return ret;
 }
 
 int main(int argc, char *argv[])
@@ -608,7 +577,13 @@ int main(int argc, char *argv[])
 			strip_padding = 1;
 			break;
 		case 'i':
-			inspect_info.file_name = optarg;
+			inspect_names = realloc(inspect_names, (num_inspect + 1) *
+						sizeof(*inspect_names));
+			if (!inspect_names) {
+				ERR("no memory for buffer!\n");
+				goto out;
+			}
+			inspect_names[num_inspect++] = optarg;
 			break;
 		case 'j':
 			add_jffs2_eof = 1;
@@ -635,10 +610,11 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto out;
 
-	if (!inspect_info.file_name)
+	if (!num_inspect)
 		ret = build_fw(sizeof(struct fw_header));
 	else
-		ret = inspect_fw();
+		ret = inspect_files(inspect_names, num_inspect,
+				    inspect_fw_prepare, inspect_fw_print);
 
  out:
 	return ret;
@@ -18,12 +18,14 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <endian.h>
 #include <sys/stat.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include "fw_mem.h"
 #include "md5.h"
 #include "mktplinkfw-lib.h"
 
@@ -105,7 +107,8 @@ int combined;
 int strip_padding;
 int add_jffs2_eof;
 
-static struct file_info inspect_info;
+static char **inspect_names;
+static int num_inspect;
 static int extract = 0;
 
 char md5salt_normal[MD5SUM_LEN] = {
@@ -207,7 +210,7 @@ static void usage(int status)
 "  -V <version>    set image version to <version>\n"
 "  -v <version>    set firmware version to <version>\n"
 "  -y <version>    set secondary version to <version>\n"
-"  -i <file>       inspect given firmware file <file>\n"
+"  -i <file>       inspect given firmware file <file>, may be repeated\n"
 "  -x              extract bootloader, kernel and rootfs while inspecting (requires -i)\n"
 "  -h              show this screen\n"
 	);
@@ -220,10 +223,12 @@ static int check_options(void)
 	int ret;
 	int exceed_bytes;
 
-	if (inspect_info.file_name) {
-		ret = get_file_stat(&inspect_info);
-		if (ret)
-			return ret;
+	if (num_inspect) {
+		struct file_info inspect_info = { .file_name = inspect_names[0] };
+
+		/* A single image is still stat()ed up front, as before -i repeated */
+		if (num_inspect == 1)
+			return get_file_stat(&inspect_info);
 
 		return 0;
 	} else if (extract) {
@@ -432,24 +437,42 @@ void fill_header(char *buf, int len) {
 	fill_header_bootloader(buf, len, 0);
 }
 
-static int inspect_fw(void)
+static void inspect_fw_prepare(struct inspect_file *f)
 {
-	char *buf;
-	struct fw_header *hdr;
-	uint8_t md5sum[MD5SUM_LEN];
-	struct board_info *board;
-	int ret = EXIT_FAILURE;
+	const struct fw_header *hdr = (const struct fw_header *)f->map.data;
 
-	buf = malloc(inspect_info.file_size);
-	if (!buf) {
-		ERR("no memory for buffer!\n");
-		goto out;
+	if (f->map.len < sizeof(*hdr))
+		return;
+
+	switch(bswap_32(ntohl(hdr->version))) {
+	case 2:
+	case 3:
+		break;
+	default:
+		return;
 	}
 
-	ret = read_to_buf(&inspect_info, buf);
-	if (ret)
-		goto out_free_buf;
-	hdr = (struct fw_header *)buf;
+	f->md5_ofs = offsetof(struct fw_header, md5sum1);
+	if (ntohl(hdr->boot_len) == 0)
+		f->salt = (const uint8_t *)md5salt_normal;
+	else
+		f->salt = (const uint8_t *)md5salt_boot;
+}
+
+static void inspect_fw_print(struct inspect_file *f)
+{
+	struct fw_header hdr_buf;
+	struct fw_header *hdr = &hdr_buf;
+	struct board_info *board;
+
+	inspect_fw_pstr("File name", f->file_name);
+	inspect_fw_phexdec("File size", f->map.len);
+
+	if (!f->salt) {
+		ERR("file does not seem to have V2/V3 header!\n");
+		return;
+	}
+	memcpy(hdr, f->map.data, sizeof(*hdr));
 
 	board = &custom_board;
 
@@ -458,32 +481,13 @@ static int inspect_fw(void)
 		hdr->kernel_ep = bswap_32(hdr->kernel_ep);
 	}
 
-	inspect_fw_pstr("File name", inspect_info.file_name);
-	inspect_fw_phexdec("File size", inspect_info.file_size);
-
-	switch(bswap_32(ntohl(hdr->version))) {
-	case 2:
-	case 3:
-		break;
-	default:
-		ERR("file does not seem to have V2/V3 header!\n");
-		goto out_free_buf;
-	}
-
 	inspect_fw_phexdec("Version 2 Header size", sizeof(struct fw_header));
 
-	memcpy(md5sum, hdr->md5sum1, sizeof(md5sum));
-	if (ntohl(hdr->boot_len) == 0)
-		memcpy(hdr->md5sum1, md5salt_normal, sizeof(md5sum));
-	else
-		memcpy(hdr->md5sum1, md5salt_boot, sizeof(md5sum));
-	get_md5(buf, inspect_info.file_size, hdr->md5sum1);
-
-	if (memcmp(md5sum, hdr->md5sum1, sizeof(md5sum))) {
-		inspect_fw_pmd5sum("Header MD5Sum1", md5sum, "(*ERROR*)");
-		inspect_fw_pmd5sum("          --> expected", hdr->md5sum1, "");
+	if (memcmp(hdr->md5sum1, f->md5, sizeof(f->md5))) {
+		inspect_fw_pmd5sum("Header MD5Sum1", hdr->md5sum1, "(*ERROR*)");
+		inspect_fw_pmd5sum("          --> expected", f->md5, "");
 	} else {
-		inspect_fw_pmd5sum("Header MD5Sum1", md5sum, "(ok)");
+		inspect_fw_pmd5sum("Header MD5Sum1", hdr->md5sum1, "(ok)");
 	}
 	if (ntohl(hdr->unk2) != 0)
 		inspect_fw_phexdec("Unknown value 2", hdr->unk2);
@@ -534,63 +538,16 @@ static int inspect_fw(void)
 	                   ntohl(hdr->fw_length));
 
 	if (extract) {
-		FILE *fp;
-		char *filename;
-
 		printf("\n");
 
-		if (hdr->boot_len) {
-			filename = malloc(strlen(inspect_info.file_name) + 8);
-			sprintf(filename, "%s-bootloader", inspect_info.file_name);
-			printf("Extracting bootloader to \"%s\"...\n", filename);
-			fp = fopen(filename, "w");
-			if (fp)	{
-				if (!fwrite(buf + sizeof(struct fw_header) + ntohl(hdr->boot_ofs),
-					ntohl(hdr->boot_len), 1, fp)) {
-					ERR("error in fwrite(): %s", strerror(errno));
-				}
-				fclose(fp);
-			} else {
-				ERR("error in fopen(): %s", strerror(errno));
-			}
-			free(filename);
-		}
-
-		filename = malloc(strlen(inspect_info.file_name) + 8);
-		sprintf(filename, "%s-kernel", inspect_info.file_name);
-		printf("Extracting kernel to \"%s\"...\n", filename);
-		fp = fopen(filename, "w");
-		if (fp)	{
-			if (!fwrite(buf + ntohl(hdr->kernel_ofs),
-			            ntohl(hdr->kernel_len), 1, fp)) {
-				ERR("error in fwrite(): %s", strerror(errno));
-			}
-			fclose(fp);
-		} else {
-			ERR("error in fopen(): %s", strerror(errno));
-		}
-		free(filename);
-
-		filename = malloc(strlen(inspect_info.file_name) + 8);
-		sprintf(filename, "%s-rootfs", inspect_info.file_name);
-		printf("Extracting rootfs to \"%s\"...\n", filename);
-		fp = fopen(filename, "w");
-		if (fp)	{
-			if (!fwrite(buf + ntohl(hdr->rootfs_ofs),
-			            ntohl(hdr->rootfs_len), 1, fp)) {
-				ERR("error in fwrite(): %s", strerror(errno));
-			}
-			fclose(fp);
-		} else {
-			ERR("error in fopen(): %s", strerror(errno));
-		}
-		free(filename);
+		if (hdr->boot_len)
+			inspect_extract(f, "bootloader", sizeof(struct fw_header) +
+					ntohl(hdr->boot_ofs), ntohl(hdr->boot_len));
+		inspect_extract(f, "kernel", ntohl(hdr->kernel_ofs),
+				ntohl(hdr->kernel_len));
+		inspect_extract(f, "rootfs", ntohl(hdr->rootfs_ofs),
+				ntohl(hdr->rootfs_len));
 	}
-
- out_free_buf:
-	free(buf);
- out:
-	return ret;
 }
 
 /* prepend a second image header and the bootloader.
@@ -630,7 +587,7 @@ int prepend_bootloader() {
 	}
 
 	buflen = image.file_size + bootloader_padded + sizeof(struct fw_header);
-	buf = malloc(buflen);
+	buf = fw_mem_alloc(buflen);
 	if (buf == NULL) {
 		ERR("Can not allocate buffer %d bytes", buflen);
 		return -1;
@@ -657,7 +614,7 @@ int prepend_bootloader() {
 	ret = EXIT_SUCCESS;
 
 out_free_buf:
-	free(buf);
+	fw_mem_free(buf, buflen);
 
 	return ret;
 }
@@ -731,7 +688,13 @@ int main(int argc, char *argv[])
 			strip_padding = 1;
 			break;
 		case 'i':
-			inspect_info.file_name = optarg;
+			inspect_names = realloc(inspect_names, (num_inspect + 1) *
+						sizeof(*inspect_names));
+			if (!inspect_names) {
+				ERR("no memory for buffer!\n");
+				goto out;
+			}
+			inspect_names[num_inspect++] = optarg;
 			break;
 		case 'j':
 			add_jffs2_eof = 1;
@@ -758,13 +721,14 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto out;
 
-	if (!inspect_info.file_name) {
+	if (!num_inspect) {
 		ret = build_fw(sizeof(struct fw_header));
 		if (ret == 0 && boot_info.file_size > 0)
 			ret = prepend_bootloader();
 	}
 	else
-		ret = inspect_fw();
+		ret = inspect_files(inspect_names, num_inspect,
+				    inspect_fw_prepare, inspect_fw_print);
 
  out:
 	return ret;
@@ -100,25 +100,51 @@ static void put_u32(void *data, uint32_t val, int swap)
 	}
 }
 
-static void get_digest(struct wrgg03_header *header, char *data, int size)
+#define COPY_BUF_LEN	(64 * 1024)
+
+/*
+ * Copy size bytes of payload from infile to outfile and fill in
+ * header->digest on the way, so the payload is never held in memory.
+ */
+static int get_digest(struct wrgg03_header *header, FILE *infile, FILE *outfile,
+		      size_t size)
 {
+	static char buf[COPY_BUF_LEN];
 	MD5_CTX ctx;
+	size_t n;
 
 	MD5_Init(&ctx);
 
 	MD5_Update(&ctx, (char *)&header->offset, sizeof(header->offset));
 	MD5_Update(&ctx, (char *)&header->devname, sizeof(header->devname));
-	MD5_Update(&ctx, data, size);
+
+	for (; size; size -= n) {
+		n = size < sizeof(buf) ? size : sizeof(buf);
+
+		errno = 0;
+		if (fread(buf, n, 1, infile) != 1) {
+			ERRS("unable to read from file %s", ifname);
+			return -1;
+		}
+
+		MD5_Update(&ctx, buf, n);
+
+		errno = 0;
+		if (fwrite(buf, n, 1, outfile) != 1) {
+			ERRS("unable to write to file %s", ofname);
+			return -1;
+		}
+	}
 
 	MD5_Final((unsigned char *)header->digest, &ctx);
+
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
-	struct wrgg03_header *header;
-	char *buf;
+	struct wrgg03_header hdr, *header = &hdr;
 	struct stat st;
-	int buflen;
 	int err;
 	int res = EXIT_FAILURE;
 
@@ -212,27 +238,12 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
-	buflen = st.st_size + sizeof(struct wrgg03_header);
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto err;
-	}
-
 	infile = fopen(ifname, "r");
 	if (infile == NULL) {
 		ERRS("could not open \"%s\" for reading", ifname);
-		goto err_free;
-	}
-
-	errno = 0;
-	fread(buf + sizeof(struct wrgg03_header), st.st_size, 1, infile);
-	if (errno != 0) {
-		ERRS("unable to read from file %s", ifname);
-		goto close_in;
+		goto err;
 	}
 
-	header = (struct wrgg03_header *) buf;
 	memset(header, '\0', sizeof(struct wrgg03_header));
 
 	strncpy(header->signature, signature, sizeof(header->signature));
@@ -247,22 +258,32 @@ int main(int argc, char *argv[])
 	put_u32(&header->offset, offset, big_endian);
 	strncpy(header->devname, devname, sizeof(header->devname));
 
-	get_digest(header, buf + sizeof(struct wrgg03_header), st.st_size);
-
 	outfile = fopen(ofname, "w");
 	if (outfile == NULL) {
 		ERRS("could not open \"%s\" for writing", ofname);
 		goto close_in;
 	}
 
+	/* payload first, the header is written once the digest is known */
+	if (fseek(outfile, sizeof(struct wrgg03_header), SEEK_SET)) {
+		ERRS("unable to write to file %s", ofname);
+		goto close_out;
+	}
+
+	if (get_digest(header, infile, outfile, st.st_size))
+		goto close_out;
+
 	errno = 0;
-	fwrite(buf, buflen, 1, outfile);
-	if (errno) {
+	rewind(outfile);
+	if (fwrite(header, sizeof(struct wrgg03_header), 1, outfile) != 1) {
 		ERRS("unable to write to file %s", ofname);
 		goto close_out;
 	}
 
-	fflush(outfile);
+	if (fflush(outfile)) {
+		ERRS("unable to write to file %s", ofname);
+		goto close_out;
+	}
 
 	res = EXIT_SUCCESS;
 
@@ -272,8 +293,6 @@ close_out:
 		unlink(ofname);
 close_in:
 	fclose(infile);
-err_free:
-	free(buf);
 err:
 	return res;
 }
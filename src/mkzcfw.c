@@ -16,6 +16,7 @@
 #include <sys/stat.h>
 
 #include "cyg_crc.h"
+#include "fw_mem.h"
 
 #if (__BYTE_ORDER == __BIG_ENDIAN)
 #  define HOST_TO_BE32(x)	(x)
@@ -279,7 +280,7 @@ static int build_fw(void)
 		 kernel_info.file_size + rootfs_info.file_size +
 		 3 * sizeof(struct fw_tail);
 
-	buf = malloc(buflen);
+	buf = fw_mem_alloc(buflen);
 	if (!buf) {
 		ERR("no memory for buffer\n");
 		goto out;
@@ -347,7 +348,7 @@ static int build_fw(void)
 	ret = EXIT_SUCCESS;
 
  out_free_buf:
-	free(buf);
+	fw_mem_free(buf, buflen);
  out:
 	return ret;
 }
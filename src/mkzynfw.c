@@ -21,7 +21,11 @@
 #  include <byteswap.h>
 #endif
 #include <inttypes.h>
+#include <fcntl.h>
 
+#include "fw_io.h"
+#include "fw_sum.h"
+#include "fw_trace.h"
 #include "zynos.h"
 
 #if (__BYTE_ORDER == __LITTLE_ENDIAN)
@@ -49,13 +53,10 @@
 #define MAX_NUM_BLOCKS	8
 #define MAX_ARG_COUNT	32
 #define MAX_ARG_LEN	1024
-#define FILE_BUF_LEN	(16*1024)
 
 
 struct csum_state{
-	int		odd;
-	uint32_t	sum;
-	uint32_t	tmp;
+	struct fw_sum	sum;	/* one's-complement, big-endian words */
 };
 
 struct fw_block {
@@ -430,53 +431,21 @@ is_empty_arg(char *arg)
 void
 csum_init(struct csum_state *css)
 {
-	css->odd = 0;
-	css->sum = 0;
-	css->tmp = 0;
+	fw_sum_init(&css->sum);
 }
 
 
 void
 csum_update(void *data, uint32_t len, struct csum_state *css)
 {
-	uint8_t *p = data;
-
-	if (len == 0)
-		return;
-
-	if (css->odd) {
-		css->sum += (css->tmp << 8) + p[0];
-		if (css->sum > 0xFFFF) {
-			css->sum += 1;
-			css->sum &= 0xFFFF;
-		}
-		css->odd = 0;
-		len--;
-		p++;
-	}
-
-	for ( ; len > 1; len -= 2, p +=2 ) {
-		css->sum  += (p[0] << 8) + p[1];
-		if (css->sum > 0xFFFF) {
-			css->sum += 1;
-			css->sum &= 0xFFFF;
-		}
-	}
-
-	if (len == 1){
-		css->tmp = p[0];
-		css->odd = 1;
-	}
+	fw_sum16_be_update(&css->sum, data, len);
 }
 
 
 uint16_t
 csum_get(struct csum_state *css)
 {
-	char pad = 0;
-
-	csum_update(&pad, 1, css);
-	return css->sum;
+	return fw_sum16_fold(fw_sum16_be_final(&css->sum));
 }
 
 uint16_t
@@ -491,81 +460,136 @@ csum_buf(uint8_t *p, uint32_t len)
 }
 
 /*
- * routines to write data to the output file
+ * The image is laid out up front as a list of extents, every block and
+ * every run of padding at its final offset. The extents are then copied
+ * and checksummed concurrently, each into a partial sum of its own, and
+ * the header and checksum fix are written last.
  */
-int
-write_out_data(FILE *outfile, void *data, size_t len,
-		struct csum_state *css)
+#define MAX_NUM_EXTENTS	(2 * MAX_NUM_BLOCKS + 4)
+
+struct csum_part {
+	struct fw_sum	sum;
+	int		odd;	/* starts at an odd offset of the summed data */
+};
+
+struct image_layout {
+	struct fw_io_extent	ext[MAX_NUM_EXTENTS];
+	struct csum_part	csum[MAX_NUM_EXTENTS];
+	int			fds[MAX_NUM_BLOCKS];
+	unsigned int		num_ext;
+	unsigned int		num_fds;
+	uint32_t		offset;		/* flash offset of the next extent */
+	off_t			out_off;	/* and its offset in the image */
+	uint32_t		max_padlen;
+};
+
+
+void
+csum_part_sink(void *priv, const void *buf, size_t len)
 {
-	uint8_t *ptr = data;
+	struct csum_part *cp = priv;
 
-	errno = 0;
+	/* Shifted by a byte, the big-endian words read as little-endian ones */
+	if (cp->odd)
+		fw_sum16_le_update(&cp->sum, buf, len);
+	else
+		fw_sum16_be_update(&cp->sum, buf, len);
+}
 
-	fwrite(ptr, len, 1, outfile);
-	if (errno) {
-		ERR("unable to write output file");
-		return -1;
-	}
 
-	if (css) {
-		csum_update(ptr, len, css);
+/* Everything after the header is summed, in image order */
+uint16_t
+csum_layout(struct image_layout *layout)
+{
+	struct csum_part *cp;
+	uint64_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < layout->num_ext; i++) {
+		cp = &layout->csum[i];
+		sum += cp->odd ? fw_sum16_le_final(&cp->sum) :
+				 fw_sum16_be_final(&cp->sum);
 	}
 
-	return 0;
+	return fw_sum16_fold(sum);
 }
 
 
-int
-write_out_padding(FILE *outfile, size_t len, uint8_t padc,
-		 struct csum_state *css)
+/* fd -1 with buf NULL is padding, filled in once the layout is done */
+void
+layout_add(struct image_layout *layout, int fd, const void *buf,
+	   uint32_t len)
 {
-	uint8_t buf[512];
-	size_t buflen = sizeof(buf);
+	struct fw_io_extent *ext = &layout->ext[layout->num_ext];
+	struct csum_part *cp = &layout->csum[layout->num_ext];
+	off_t out_off = layout->out_off;
 
-	memset(buf, padc, buflen);
-	while (len > 0) {
-		if (len < buflen)
-			buflen = len;
+	layout->num_ext++;
 
-		if (write_out_data(outfile, buf, buflen, css))
-			return -1;
+	memset(ext, 0, sizeof(*ext));
+	ext->fd = fd;
+	ext->buf = buf;
+	ext->len = len;
+	ext->out_off = out_off;
+	ext->sink = csum_part_sink;
+	ext->priv = cp;
 
-		len -= buflen;
-	}
+	fw_sum_init(&cp->sum);
+	cp->odd = (out_off - sizeof(struct zyn_rombin_hdr)) & 1;
 
-	return 0;
+	layout->offset += len;
+	layout->out_off += len;
 }
 
 
-int
-write_out_data_align(FILE *outfile, void *data, size_t len, size_t align,
-		struct csum_state *css)
+void
+layout_padding(struct image_layout *layout, uint32_t padlen)
 {
-	size_t padlen;
-	int res;
-
-	res = write_out_data(outfile, data, len, css);
-	if (res)
-		return res;
+	if (padlen == 0)
+		return;
 
-	padlen = ALIGN(len,align) - len;
-	res = write_out_padding(outfile, padlen, 0xFF, css);
+	if (padlen > layout->max_padlen)
+		layout->max_padlen = padlen;
 
-	return res;
+	layout_add(layout, -1, NULL, padlen);
 }
 
 
 int
-write_out_header(FILE *outfile, struct zyn_rombin_hdr *hdr)
+layout_block(struct image_layout *layout, struct fw_block *block)
 {
-	struct zyn_rombin_hdr t;
+	int fd;
 
-	errno = 0;
-	if (fseek(outfile, 0, SEEK_SET) != 0) {
-		ERRS("fseek failed on output file");
+	if (block == NULL)
+		return 0;
+
+	if (block->file_name == NULL)
+		return 0;
+
+	if (block->file_size == 0)
+		return 0;
+
+	DBG(2, "writing out file, name=%s, len=%" PRIu32,
+		block->file_name, block->file_size);
+
+	fd = open(block->file_name, O_RDONLY);
+	if (fd < 0) {
+		ERRS("unable to open file: %s", block->file_name);
 		return -1;
 	}
 
+	layout->fds[layout->num_fds++] = fd;
+	layout_add(layout, fd, NULL, block->file_size);
+
+	return 0;
+}
+
+
+int
+write_out_header(int outfd, struct zyn_rombin_hdr *hdr)
+{
+	struct zyn_rombin_hdr t;
+
 	/* setup temporary header fields */
 	memset(&t, 0, sizeof(t));
 	t.addr = HOST_TO_BE32(hdr->addr);
@@ -587,20 +611,23 @@ write_out_header(FILE *outfile, struct zyn_rombin_hdr *hdr)
 	DBG(2, "hdr.ccsum     = 0x%04x", hdr->ccsum);
 	DBG(2, "hdr.mmap_addr = 0x%08x", hdr->mmap_addr);
 
-	return write_out_data(outfile, (uint8_t *)&t, sizeof(t), NULL);
+	if (pwrite(outfd, &t, sizeof(t), 0) != sizeof(t)) {
+		ERR("unable to write output file");
+		return -1;
+	}
+
+	return 0;
 }
 
 
-int
-write_out_mmap(FILE *outfile, struct fw_mmap *mmap, struct csum_state *css)
+void
+build_mmap(struct fw_mmap *mmap, uint8_t *buf)
 {
 	struct zyn_mmt_hdr *mh;
-	uint8_t buf[MMAP_DATA_SIZE];
 	uint32_t user_size;
 	char *data;
-	int res;
 
-	memset(buf, 0, sizeof(buf));
+	memset(buf, 0, MMAP_DATA_SIZE);
 
 	mh = (struct zyn_mmt_hdr *)buf;
 
@@ -621,10 +648,6 @@ write_out_mmap(FILE *outfile, struct fw_mmap *mmap, struct csum_state *css)
 	mh->user_start= HOST_TO_BE32(mmap->addr+sizeof(*mh));
 	mh->user_end= HOST_TO_BE32(mmap->addr+user_size);
 	mh->csum = HOST_TO_BE16(csum_buf(buf+sizeof(*mh), user_size));
-
-	res = write_out_data(outfile, buf, sizeof(buf), css);
-
-	return res;
 }
 
 
@@ -678,80 +701,19 @@ err:
 
 
 int
-write_out_file(FILE *outfile, char *name, size_t len, struct csum_state *css)
-{
-	char buf[FILE_BUF_LEN];
-	size_t buflen = sizeof(buf);
-	FILE *f;
-	int res;
-
-	DBG(2, "writing out file, name=%s, len=%zu",
-		name, len);
-
-	errno = 0;
-	f = fopen(name,"r");
-	if (errno) {
-		ERRS("unable to open file: %s", name);
-		return -1;
-	}
-
-	while (len > 0) {
-		if (len < buflen)
-			buflen = len;
-
-		/* read data from source file */
-		errno = 0;
-		fread(buf, buflen, 1, f);
-		if (errno != 0) {
-			ERRS("unable to read from file: %s",name);
-			res = -1;
-			break;
-		}
-
-		res = write_out_data(outfile, buf, buflen, css);
-		if (res)
-			break;
-
-		len -= buflen;
-	}
-
-	fclose(f);
-	return res;
-}
-
-
-int
-write_out_block(FILE *outfile, struct fw_block *block, struct csum_state *css)
-{
-	int res;
-
-	if (block == NULL)
-		return 0;
-
-	if (block->file_name == NULL)
-		return 0;
-
-	if (block->file_size == 0)
-		return 0;
-
-	res = write_out_file(outfile, block->file_name,
-			block->file_size, css);
-	return res;
-}
-
-
-int
-write_out_image(FILE *outfile)
+write_out_image(int outfd)
 {
+	struct image_layout layout;
 	struct fw_block *block;
 	struct fw_mmap mmap;
 	struct zyn_rombin_hdr hdr;
-	struct csum_state css;
-	int i, res;
-	uint32_t offset;
+	uint8_t mmap_buf[MMAP_DATA_SIZE];
+	uint8_t *padbuf = NULL;
+	unsigned int i;
 	uint32_t padlen;
 	uint16_t csum;
 	uint16_t t;
+	int res;
 
 	/* setup header fields */
 	memset(&hdr, 0, sizeof(hdr));
@@ -759,47 +721,31 @@ write_out_image(FILE *outfile)
 	hdr.type = OBJECT_TYPE_BOOTEXT;
 	hdr.flags = ROMBIN_FLAG_OCSUM;
 
-	offset = board->romio_offs;
-
-	res = write_out_header(outfile, &hdr);
-	if (res)
-		return res;
-
-	offset += sizeof(hdr);
+	memset(&layout, 0, sizeof(layout));
+	layout.offset = board->romio_offs + sizeof(hdr);
+	layout.out_off = sizeof(hdr);
 
-	csum_init(&css);
-	res = write_out_block(outfile, bootext_block, &css);
+	res = layout_block(&layout, bootext_block);
 	if (res)
-		return res;
+		goto out;
 
-	offset += bootext_block->file_size;
-	if (offset > (board->romio_offs + board->bootext_size)) {
+	if (layout.offset > (board->romio_offs + board->bootext_size)) {
 		ERR("bootext file '%s' is too big", bootext_block->file_name);
-		return -1;
+		res = -1;
+		goto out;
 	}
 
-	padlen = ALIGN(offset, MMAP_ALIGN) - offset;
-	res = write_out_padding(outfile, padlen, 0xFF, &css);
-	if (res)
-		return res;
+	layout_padding(&layout, ALIGN(layout.offset, MMAP_ALIGN) - layout.offset);
 
-	offset += padlen;
+	mmap.addr = board->flash_base + layout.offset;
+	build_mmap(&mmap, mmap_buf);
+	layout_add(&layout, -1, mmap_buf, sizeof(mmap_buf));
 
-	mmap.addr = board->flash_base + offset;
-	res = write_out_mmap(outfile, &mmap, &css);
-	if (res)
-		return res;
+	if ((layout.offset - board->romio_offs) < board->bootext_size) {
+		layout_padding(&layout, board->romio_offs +
+			       board->bootext_size - layout.offset);
 
-	offset += MMAP_DATA_SIZE;
-
-	if ((offset - board->romio_offs) < board->bootext_size) {
-		padlen = board->romio_offs + board->bootext_size - offset;
-		res = write_out_padding(outfile, padlen, 0xFF, &css);
-		if (res)
-			return res;
-		offset += padlen;
-
-		DBG(2, "bootext end at %08x", offset);
+		DBG(2, "bootext end at %08x", layout.offset);
 	}
 
 	for (i = 0; i < num_blocks; i++) {
@@ -808,31 +754,45 @@ write_out_image(FILE *outfile)
 		if (block->type == BLOCK_TYPE_BOOTEXT)
 			continue;
 
-		padlen = ALIGN(offset, block->align) - offset;
-		res = write_out_padding(outfile, padlen, 0xFF, &css);
-		if (res)
-			return res;
-		offset += padlen;
+		padlen = ALIGN(layout.offset, block->align) - layout.offset;
+		layout_padding(&layout, padlen);
 
-		res = write_out_block(outfile, block, &css);
+		res = layout_block(&layout, block);
 		if (res)
-			return res;
-		offset += block->file_size;
+			goto out;
 	}
 
-	padlen = ALIGN(offset, 4) - offset;
-	res = write_out_padding(outfile, padlen, 0xFF, &css);
-	if (res)
-		return res;
-	offset += padlen;
+	layout_padding(&layout, ALIGN(layout.offset, 4) - layout.offset);
 
-	csum = csum_get(&css);
+	if (layout.max_padlen) {
+		padbuf = malloc(layout.max_padlen);
+		if (padbuf == NULL) {
+			ERR("not enough memory");
+			res = -1;
+			goto out;
+		}
+		memset(padbuf, 0xFF, layout.max_padlen);
+	}
+
+	for (i = 0; i < layout.num_ext; i++)
+		if (layout.ext[i].fd < 0 && layout.ext[i].buf == NULL)
+			layout.ext[i].buf = padbuf;
+
+	res = fw_io_copy_extents(outfd, layout.ext, layout.num_ext);
+	if (res) {
+		errno = -res;
+		ERRS("unable to write output file");
+		res = -1;
+		goto out;
+	}
+
+	csum = csum_layout(&layout);
 	hdr.mmap_addr = mmap.addr;
 	hdr.osize = 2;
 
 	res = read_magic(&hdr.ocsum);
 	if (res)
-		return res;
+		goto out;
 	hdr.ocsum = BE16_TO_HOST(hdr.ocsum);
 
 	if (csum <= hdr.ocsum)
@@ -843,12 +803,18 @@ write_out_image(FILE *outfile)
 	DBG(2, "ocsum=%04x, csum=%04x, fix=%04x", hdr.ocsum, csum, t);
 
 	t = HOST_TO_BE16(t);
-	res = write_out_data(outfile, (uint8_t *)&t, 2, NULL);
-	if (res)
-		return res;
+	if (pwrite(outfd, &t, 2, layout.out_off) != 2) {
+		ERR("unable to write output file");
+		res = -1;
+		goto out;
+	}
 
+	res = write_out_header(outfd, &hdr);
 
-	res = write_out_header(outfile, &hdr);
+out:
+	for (i = 0; i < layout.num_fds; i++)
+		close(layout.fds[i]);
+	free(padbuf);
 
 	return res;
 }
@@ -1045,7 +1011,8 @@ main(int argc, char *argv[])
 	int c;
 	int res = EXIT_FAILURE;
 
-	FILE *outfile;
+	int outfd;
+	struct fw_trace trace;
 
 	progname=basename(argv[0]);
 
@@ -1103,22 +1070,23 @@ main(int argc, char *argv[])
 		goto out;
 	}
 
-	outfile = fopen(ofname, "w");
-	if (outfile == NULL) {
+	outfd = open(ofname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (outfd < 0) {
 		ERRS("could not open \"%s\" for writing", ofname);
 		goto out;
 	}
 
-	if (write_out_image(outfile) != 0)
+	fw_trace_begin(&trace, "write_out_image");
+	if (write_out_image(outfd) != 0)
 		goto out_flush;
+	fw_trace_end(&trace, lseek(outfd, 0, SEEK_END));
 
 	DBG(1,"Image file %s completed.", ofname);
 
 	res = EXIT_SUCCESS;
 
 out_flush:
-	fflush(outfile);
-	fclose(outfile);
+	close(outfd);
 	if (res != EXIT_SUCCESS) {
 		unlink(ofname);
 	}
@@ -18,6 +18,7 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <limits.h>
+#include "fw_io.h"
 #include "md5.h"
 
 #define ZYXEL_MAGIC	0xdeadbeaf
@@ -126,46 +127,24 @@ static size_t get_file_size(FILE *fp)
 	return file_size;
 }
 
-static void copy_from_to_file(FILE *fp_src, size_t src_offset, FILE *fp_dst,
-		       size_t dst_offset, size_t length)
+static void checksum_sink(void *priv, const void *buf, size_t len)
 {
-	int buf[512];
-	size_t len;
+	MD5_Update(priv, buf, len);
+}
 
+/* Moves length bytes with fw_io_copy(), feeding ctx on the way if given */
+static void copy_from_to_file(FILE *fp_src, size_t src_offset, FILE *fp_dst,
+		       size_t dst_offset, size_t length, MD5_CTX *ctx)
+{
 	if (src_offset)
 		fseek(fp_src, (long int)src_offset, SEEK_SET);
 
 	if (dst_offset)
-		fseek(fp_src, (long int)dst_offset, SEEK_SET);
-
-	while (length) {
-		if (length >= sizeof(buf)) {
-			len = sizeof(buf);
-		} else {
-			len = length;
-		}
-
-		length -= len;
-
-		if (fread(buf, len, 1, fp_src) != 1)
-			error("Failed to read");
-
-		if (fwrite(buf, len, 1, fp_dst) != 1)
-			error("Failed to write");
-	}
-}
-
-static void extract_to_file(FILE *fp_src, char *dst, size_t length,
-			    size_t offset)
-{
-	FILE *fp_dst;
-
-	if (!(fp_dst = fopen(dst, "wb")))
-		error("Failed to open %s for writing", dst);
+		fseek(fp_dst, (long int)dst_offset, SEEK_SET);
 
-	copy_from_to_file(fp_src, offset, fp_dst, 0, length);
-
-	fclose(fp_dst);
+	if (fw_io_copy(fp_dst, fp_src, length, ctx ? checksum_sink : NULL,
+		       ctx) != (ssize_t)length)
+		error("Failed to copy");
 }
 
 static void dump_firmware_header(struct fw_header *header_p)
@@ -304,34 +283,16 @@ static void checksum_add_from_buf(MD5_CTX *ctx, void *buf,
 static void checksum_add_from_file(MD5_CTX *ctx, FILE *fp_src,
 			    size_t length, size_t offset)
 {
-	int buf[512];
-	size_t len;
-
 	fseek(fp_src, (long int)offset, SEEK_SET);
-	while (length) {
-		if (length >= sizeof(buf)) {
-			len = sizeof(buf);
-		} else {
-			len = length;
-		}
-
-		length -= len;
-
-		if (fread(buf, len, 1, fp_src) != 1)
-			error("Failed to read for checksum calculation");
-
-		checksum_add_from_buf(ctx, buf, len, 0);
-	}
+	if (fw_io_copy(NULL, fp_src, length, checksum_sink, ctx) != (ssize_t)length)
+		error("Failed to read for checksum calculation");
 }
 
-static uint32_t checksum_finish(MD5_CTX *ctx)
+static uint32_t checksum_fold(const unsigned char *md5sum)
 {
-	unsigned char md5sum[16];
 	uint32_t checksum = 0;
 	int i;
 
-	MD5_Final(md5sum, ctx);
-
 	for (i = 0; i < 16; i += 4)
 		checksum += ((uint32_t)md5sum[i] << 24 |
 			     (uint32_t)md5sum[i + 1] << 16 |
@@ -344,6 +305,34 @@ static uint32_t checksum_finish(MD5_CTX *ctx)
 	return checksum;
 }
 
+static uint32_t checksum_finish(MD5_CTX *ctx)
+{
+	unsigned char md5sum[16];
+
+	MD5_Final(md5sum, ctx);
+
+	return checksum_fold(md5sum);
+}
+
+/* Extracts a file and returns its checksum taken on the way */
+static uint32_t extract_to_file(FILE *fp_src, char *dst, size_t length,
+			    size_t offset)
+{
+	FILE *fp_dst;
+	MD5_CTX ctx;
+
+	if (!(fp_dst = fopen(dst, "wb")))
+		error("Failed to open %s for writing", dst);
+
+	MD5_Init(&ctx);
+	copy_from_to_file(fp_src, offset, fp_dst, 0, length, &ctx);
+
+	if (fclose(fp_dst))
+		error("Failed to write %s", dst);
+
+	return checksum_finish(&ctx);
+}
+
 static uint32_t checksum_calculate(FILE *fp, size_t kernel_offset)
 {
 	struct fw_header_kernel dummy;
@@ -369,26 +358,6 @@ static uint32_t checksum_calculate(FILE *fp, size_t kernel_offset)
 	return checksum_finish(&ctx);
 }
 
-static uint32_t checksum_calculate_file(char *filename)
-{
-	MD5_CTX ctx;
-	FILE *fp;
-	size_t file_size;
-
-	if (!(fp = fopen(filename, "rb")))
-		error("Failed to open %s for writing\n", filename);
-
-	file_size = get_file_size(fp);
-
-	MD5_Init(&ctx);
-
-	checksum_add_from_file(&ctx, fp, file_size, 0);
-
-	fclose(fp);
-
-	return checksum_finish(&ctx);
-}
-
 static void parse_firmware(struct firmware *fw, FILE *fp)
 {
 	struct firmware_file *file;
@@ -495,22 +464,24 @@ static void extract_firmware(struct firmware *fw, char *filename)
 
 	printf("Extracting files...");
 
+	/* The files follow each other, so this is one pass over the archive */
 	for (i = 0, file = fw->files; i < fw->header.files_count; i++, file++) {
+		uint32_t checksum;
+
 		dump_file_header(&file->header);
 		if (file->header.type == FILE_TYPE_KERNEL) {
 			/* strip kernel header */
-			extract_to_file(
+			checksum = extract_to_file(
 				fp, file->header.filename,
 				file->header.length -
 					sizeof(struct fw_header_kernel),
 				file->offset + sizeof(struct fw_header_kernel));
 		} else {
-			extract_to_file(fp, file->header.filename,
+			checksum = extract_to_file(fp, file->header.filename,
 					file->header.length, file->offset);
 		}
 
-		printf("Calculated file checksum is 0x%08x\n",
-		       checksum_calculate_file(file->header.filename));
+		printf("Calculated file checksum is 0x%08x\n", checksum);
 	}
 
 	free(fw->files);
@@ -582,6 +553,7 @@ int main(int argc, char *argv[])
 	FILE *fp_src, *fp_dst;
 	size_t kernel_offset = 0;
 	unsigned int i;
+	MD5_CTX ctx;
 	int opt;
 
 	memset(&fw, 0, sizeof(fw));
@@ -744,8 +716,6 @@ int main(int argc, char *argv[])
 
 	fw.header.total_length = fw.header.files_offset;
 	for (i = 0, file = fw.files; i < fw.files_count; i++, file++) {
-		file->header.checksum = checksum_calculate_file(file->filepath);
-
 		if (!(fp_src = fopen(file->filepath, "rb")))
 			error("Failed to open %s for writing\n", filename);
 
@@ -758,7 +728,10 @@ int main(int argc, char *argv[])
 					sizeof(fw.kernel_header), 1, fp_dst))
 				error("Failed to write kernel header\n");
 
-		copy_from_to_file(fp_src, 0, fp_dst, 0, file->header.length);
+		/* the file is checksummed on its way into the image */
+		MD5_Init(&ctx);
+		copy_from_to_file(fp_src, 0, fp_dst, 0, file->header.length, &ctx);
+		file->header.checksum = checksum_finish(&ctx);
 
 		if (file->header.type == FILE_TYPE_KERNEL) {
 			file->header.length += sizeof(fw.kernel_header);
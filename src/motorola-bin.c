@@ -38,32 +38,12 @@
 #include <netinet/in.h>
 #include <inttypes.h>
 
-#define BPB 8 /* bits/byte */
+#include "fw_crc32.h"
+#include "fw_io.h"
 
-static uint32_t crc32[1<<BPB];
-
-static void init_crc32()
+static uint32_t crc32buf(uint32_t crc, const void *buf, size_t len)
 {
-	const uint32_t poly = ntohl(0x2083b8ed);
-	int n;
-
-	for (n = 0; n < 1<<BPB; n++) {
-		uint32_t crc = n;
-		int bit;
-
-		for (bit = 0; bit < BPB; bit++)
-			crc = (crc & 1) ? (poly ^ (crc >> 1)) : (crc >> 1);
-		crc32[n] = crc;
-	}
-}
-
-static uint32_t crc32buf(unsigned char *buf, size_t len)
-{
-	uint32_t crc = 0xFFFFFFFF;
-
-	for (; len; len--, buf++)
-		crc = crc32[(uint8_t)crc ^ *buf] ^ (crc >> BPB);
-	return crc;
+	return fw_crc32_parallel(crc, buf, len);
 }
 
 struct motorola {
@@ -102,9 +82,10 @@ static void usage(const char *mess)
 int main(int argc, char **argv)
 {
 	off_t len;	// of original firmware
-	int fd;
+	int fd, outfd;
 	void *trx;	// pointer to original firmware (mmmapped)
-	struct motorola *firmware;	// pionter to prefix + copy of original firmware
+	struct motorola *firmware;	// pointer to prefix of original firmware
+	struct motorola prefix;		// prefix of the new firmware
 	uint32_t flags;
 
 	// verify parameters
@@ -115,15 +96,12 @@ int main(int argc, char **argv)
 	// mmap trx file
 	if ((fd = open(argv[2], O_RDONLY))  < 0
 	|| (len = lseek(fd, 0, SEEK_END)) < 0
-	|| (trx = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0)) == (void *) (-1)
-	|| close(fd) < 0)
+	|| (trx = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0)) == (void *) (-1))
 	{
 		fprintf(stderr, "Error loading file %s: %s\n", argv[2], strerror(errno));
 		exit(1);
 	}
 
-	init_crc32();
-
 	if (strcmp(argv[1], "--strip") == 0)
 	{
 		const char *ugh = NULL;
@@ -134,7 +112,7 @@ int main(int argc, char **argv)
 			const struct model *m;
 
 			firmware = trx;
-			if (htonl(crc32buf(trx + offsetof(struct motorola, flags), len - offsetof(struct motorola, flags))) != firmware->crc)
+			if (htonl(crc32buf(0xFFFFFFFF, trx + offsetof(struct motorola, flags), len - offsetof(struct motorola, flags))) != firmware->crc)
 				ugh = "Invalid CRC";
 			for (m = models; ; m++) {
 				if (m->digit == '\0') {
@@ -154,9 +132,9 @@ int main(int argc, char **argv)
 			exit(3);
 		} else {
 			// all is well, write the file without the prefix
-			if ((fd = open(argv[3], O_CREAT|O_WRONLY|O_TRUNC,0644)) < 0
-			|| write(fd, trx + sizeof(struct motorola), len - sizeof(struct motorola)) !=  len - sizeof(struct motorola)
-			|| close(fd) < 0)
+			if ((outfd = open(argv[3], O_CREAT|O_WRONLY|O_TRUNC,0644)) < 0
+			|| fw_io_copy_fd(outfd, 0, fd, sizeof(struct motorola), len - sizeof(struct motorola)) != len - sizeof(struct motorola)
+			|| close(outfd) < 0)
 			{
 				fprintf(stderr, "Error storing file %s: %s\n", argv[3], strerror(errno));
 				exit(2);
@@ -183,30 +161,26 @@ int main(int argc, char **argv)
 		}
 
 
-		// create a firmware image in memory
-		// and copy the trx to it
-		firmware = malloc(sizeof(struct motorola) + len);
-		memcpy(&firmware[1], trx, len);
-
 		// setup the motorola headers
-		firmware->flags = htonl(flags);
+		prefix.flags = htonl(flags);
 
-		// CRC of flags + firmware
-		firmware->crc = htonl(crc32buf((unsigned char *)&firmware->flags, sizeof(firmware->flags) + len));
+		// CRC of flags + firmware, straight from the mapping
+		prefix.crc = crc32buf(0xFFFFFFFF, &prefix.flags, sizeof(prefix.flags));
+		prefix.crc = htonl(crc32buf(prefix.crc, trx, len));
 
-		// write the firmware
-		if ((fd = open(argv[3], O_CREAT|O_WRONLY|O_TRUNC,0644)) < 0
-		|| write(fd, firmware, sizeof(struct motorola) + len) != sizeof(struct motorola) + len
-		|| close(fd) < 0)
+		// write the prefix and copy the trx behind it
+		if ((outfd = open(argv[3], O_CREAT|O_WRONLY|O_TRUNC,0644)) < 0
+		|| pwrite(outfd, &prefix, sizeof(prefix), 0) != sizeof(prefix)
+		|| fw_io_copy_fd(outfd, sizeof(prefix), fd, 0, len) != len
+		|| close(outfd) < 0)
 		{
 			fprintf(stderr, "Error storing file %s: %s\n", argv[3], strerror(errno));
 			exit(2);
 		}
-
-		free(firmware);
 	}
 
 	munmap(trx,len);
+	close(fd);
 
 	return 0;
 }
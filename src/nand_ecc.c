@@ -8,20 +8,32 @@
 
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
 
+#include "fw_pool.h"
+
 #define DEF_NAND_PAGE_SIZE   2048
 #define DEF_NAND_OOB_SIZE     64
 #define DEF_NAND_ECC_OFFSET   0x28
+#define NAND_ECC_STEP         256
+#define NAND_ECC_BYTES        3
+#define DEF_BCH_STEP          512
 
 static int page_size = DEF_NAND_PAGE_SIZE;
 static int oob_size = DEF_NAND_OOB_SIZE;
-static int ecc_offset = DEF_NAND_ECC_OFFSET;
+static int ecc_offset = -1;
+static int ecc_stride = -1;
+static int ecc_step = NAND_ECC_STEP;
+static int ecc_bytes = NAND_ECC_BYTES;
+static int bch_t;
+static uint8_t oob_fill;
 
 /*
  * Pre-calculated 256-way 1 byte column parity
@@ -54,23 +66,45 @@ int nand_calculate_ecc(const uint8_t *dat,
 		       uint8_t *ecc_code)
 {
 	uint8_t idx, reg1, reg2, reg3, tmp1, tmp2;
-	int i;
+	uint64_t w, all, acc[5];
+	uint8_t bytes[8];
+	int i, k;
 
-	/* Initialize variables */
-	reg1 = reg2 = reg3 = 0;
+	/*
+	 * Both parities are linear, so instead of a table lookup per byte
+	 * the block is folded 64 bits at a time: column parity comes from
+	 * the XOR of all bytes, and line parity bit k from the parity of the
+	 * XOR of every byte whose index has bit k set. Index bits 3-7 select
+	 * the word, bits 0-2 the byte within the word.
+	 */
+	all = 0;
+	memset(acc, 0, sizeof(acc));
+	for (i = 0; i < 32; i++) {
+		memcpy(&w, dat + i * 8, sizeof(w));
+		all ^= w;
+		for (k = 0; k < 5; k++)
+			acc[k] ^= (i >> k) & 1 ? w : 0;
+	}
 
-	/* Build up column parity */
-	for(i = 0; i < 256; i++) {
-		/* Get CP0 - CP5 from table */
-		idx = nand_ecc_precalc_table[*dat++];
-		reg1 ^= (idx & 0x3f);
+	memcpy(bytes, &all, sizeof(bytes));
+	tmp1 = bytes[1] ^ bytes[3] ^ bytes[5] ^ bytes[7];
+	tmp2 = bytes[2] ^ bytes[3] ^ bytes[6] ^ bytes[7];
+	idx = bytes[4] ^ bytes[5] ^ bytes[6] ^ bytes[7];
 
-		/* All bit XOR = 1 ? */
-		if (idx & 0x40) {
-			reg3 ^= (uint8_t) i;
-			reg2 ^= ~((uint8_t) i);
-		}
-	}
+	reg3 = __builtin_parity(tmp1) |
+	       __builtin_parity(tmp2) << 1 |
+	       __builtin_parity(idx) << 2;
+	for (k = 0; k < 5; k++)
+		reg3 |= __builtin_parityll(acc[k]) << (k + 3);
+
+	all ^= all >> 32;
+	all ^= all >> 16;
+	all ^= all >> 8;
+	idx = nand_ecc_precalc_table[(uint8_t)all];
+	reg1 = idx & 0x3f;
+
+	/* reg2 accumulates ~i, i.e. reg3 inverted once per odd-parity byte */
+	reg2 = (idx & 0x40) ? ~reg3 : reg3;
 
 	/* Create non-inverted ECC code from line parity */
 	tmp1  = (reg3 & 0x80) >> 0; /* B7 -> B7 */
@@ -104,6 +138,285 @@ int nand_calculate_ecc(const uint8_t *dat,
 	return 0;
 }
 
+/*
+ * BCH, as done by the Linux software BCH engine (lib/bch.c and the NAND
+ * glue on top of it): GF(2^m) with the kernel's default primitive
+ * polynomial and m chosen from the step size, a generator polynomial of
+ * degree m*t and the parity bits stored MSB first in ceil(m*t/8) bytes.
+ * The parity is XORed with a mask that turns the code of an erased step
+ * into all 0xff.
+ *
+ * The remainder register is kept left-justified in 64-bit words, so
+ * dividing by the generator polynomial is a shift and XOR of whole words,
+ * and the data is consumed 32 bits at a time through four tables holding
+ * the remainders of each byte lane.
+ */
+#define BCH_MAX_M		14
+#define BCH_MAX_T		16
+#define BCH_MAX_WORDS		((BCH_MAX_M * BCH_MAX_T + 63) / 64)
+
+static unsigned int bch_deg;
+static unsigned int bch_words;
+static uint64_t bch_tab[4][256][BCH_MAX_WORDS];
+static uint8_t bch_mask[(BCH_MAX_M * BCH_MAX_T + 7) / 8];
+
+static void bch_shift(uint64_t *r, unsigned int bits)
+{
+	unsigned int i;
+
+	for (i = 0; i + 1 < bch_words; i++)
+		r[i] = r[i] << bits | r[i + 1] >> (64 - bits);
+	r[i] <<= bits;
+}
+
+static void bch_xor(uint64_t *r, const uint64_t *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < bch_words; i++)
+		r[i] ^= p[i];
+}
+
+static void bch_encode(const uint8_t *data, size_t len, uint8_t *ecc)
+{
+	uint64_t r[BCH_MAX_WORDS] = {};
+	unsigned int i;
+	uint32_t w;
+
+	for (; len >= 4; data += 4, len -= 4) {
+		w = (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+		w ^= r[0] >> 32;
+		bch_shift(r, 32);
+		bch_xor(r, bch_tab[0][w & 0xff]);
+		bch_xor(r, bch_tab[1][(w >> 8) & 0xff]);
+		bch_xor(r, bch_tab[2][(w >> 16) & 0xff]);
+		bch_xor(r, bch_tab[3][w >> 24]);
+	}
+
+	for (; len; data++, len--) {
+		w = *data ^ r[0] >> 56;
+		bch_shift(r, 8);
+		bch_xor(r, bch_tab[0][w]);
+	}
+
+	for (i = 0; i < (unsigned int)ecc_bytes; i++)
+		ecc[i] = r[i / 8] >> (56 - 8 * (i % 8));
+}
+
+static unsigned int gf_n;
+static uint16_t *gf_pow, *gf_log;
+
+/* a * alpha^e in GF(2^m) */
+static uint16_t gf_mul(uint16_t a, unsigned int e)
+{
+	return a ? gf_pow[(gf_log[a] + e) % gf_n] : 0;
+}
+
+static int bch_init(void)
+{
+	/* lib/bch.c's default primitive polynomials for m = 5..15 */
+	static const unsigned int prim_poly[] = {
+		0x25, 0x43, 0x83, 0x11d, 0x211, 0x409, 0x805, 0x1053,
+		0x201b, 0x402b, 0x8003,
+	};
+	uint64_t g[BCH_MAX_WORDS] = {}, r[BCH_MAX_WORDS];
+	uint16_t genpoly[BCH_MAX_M * BCH_MAX_T + 1];
+	uint8_t *roots, *erased;
+	unsigned int m, i, j, b, x, deg;
+
+	/* Same choice as the NAND layer: the smallest code spanning the step */
+	for (m = 0; (1u << m) <= 8u * ecc_step + 1; m++)
+		;
+	if (m < 5 || m > BCH_MAX_M || bch_t < 1 || bch_t > BCH_MAX_T)
+		return -1;
+	gf_n = (1u << m) - 1;
+
+	gf_pow = malloc((gf_n + 1) * sizeof(*gf_pow));
+	gf_log = malloc((gf_n + 1) * sizeof(*gf_log));
+	roots = calloc(gf_n + 1, 1);
+	erased = malloc(ecc_step);
+	if (!gf_pow || !gf_log || !roots || !erased)
+		return -1;
+
+	for (i = 0, x = 1; i < gf_n; i++) {
+		gf_pow[i] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & (1u << m))
+			x ^= prim_poly[m - 5];
+	}
+
+	/* g(X) has every alpha^r in the cyclotomic cosets of 1, 3, ... 2t-1 */
+	for (i = 0; i < (unsigned int)bch_t; i++)
+		for (j = 0, x = 2 * i + 1; j < m; j++, x = 2 * x % gf_n)
+			roots[x] = 1;
+
+	/* Multiply out the (X + alpha^r); the product ends up in GF(2)[X] */
+	genpoly[0] = 1;
+	for (i = 0, deg = 0; i < gf_n; i++) {
+		if (!roots[i])
+			continue;
+		genpoly[deg + 1] = 1;
+		for (j = deg; j > 0; j--)
+			genpoly[j] = gf_mul(genpoly[j], i) ^ genpoly[j - 1];
+		genpoly[0] = gf_mul(genpoly[0], i);
+		deg++;
+	}
+	bch_deg = deg;
+
+	bch_words = (bch_deg + 63) / 64;
+	ecc_bytes = (bch_deg + 7) / 8;
+
+	/* g(X) without its leading term, left-justified like the register */
+	for (i = 0; i < bch_deg; i++)
+		if (genpoly[i])
+			g[(bch_deg - 1 - i) / 64] |= 1ULL << (63 - (bch_deg - 1 - i) % 64);
+
+	/* bch_tab[k][b]: remainder of b(X) * X^(8k + deg), bit by bit */
+	for (b = 0; b < 256; b++) {
+		memset(r, 0, sizeof(r));
+		for (i = 0; i < 32; i++) {
+			unsigned int bit = i < 8 ? (b >> (7 - i)) & 1 : 0;
+			unsigned int fb = bit ^ (r[0] >> 63);
+
+			bch_shift(r, 1);
+			if (fb)
+				bch_xor(r, g);
+			if (i % 8 == 7)
+				memcpy(bch_tab[i / 8][b], r, sizeof(r));
+		}
+	}
+
+	memset(erased, 0xff, ecc_step);
+	bch_encode(erased, ecc_step, bch_mask);
+	for (i = 0; i < (unsigned int)ecc_bytes; i++)
+		bch_mask[i] ^= 0xff;
+
+	free(gf_pow);
+	free(gf_log);
+	free(roots);
+	free(erased);
+	gf_pow = gf_log = NULL;
+
+	return 0;
+}
+
+static void nand_bch_calculate_ecc(const uint8_t *dat, uint8_t *ecc_code)
+{
+	int i;
+
+	bch_encode(dat, ecc_step, ecc_code);
+	for (i = 0; i < ecc_bytes; i++)
+		ecc_code[i] ^= bch_mask[i];
+}
+
+struct nand_image {
+	const uint8_t *in;
+	uint8_t *out;
+	size_t pages;
+};
+
+#define NAND_PAGES_PER_JOB	64
+
+static int nand_page_erased(const uint8_t *in)
+{
+	uint64_t w, all = ~0ULL;
+	int i;
+
+	for (i = 0; i < page_size; i += sizeof(w)) {
+		memcpy(&w, in + i, sizeof(w));
+		all &= w;
+	}
+
+	return all == ~0ULL;
+}
+
+/*
+ * Build one page plus its OOB: the OOB is filled with oob_fill and the
+ * code of each step goes ecc_stride bytes after the previous one, starting
+ * at ecc_offset. The code of an erased step is all 0xff with either ECC,
+ * so erased pages skip the calculation altogether.
+ */
+static void nand_ecc_page(const uint8_t *in, uint8_t *out)
+{
+	uint8_t *ecc_data = out + page_size + ecc_offset;
+	int erased;
+	int j;
+
+	if (out != in)
+		memcpy(out, in, page_size);
+	memset(out + page_size, oob_fill, oob_size);
+
+	erased = nand_page_erased(in);
+	for (j = 0; j < page_size / ecc_step; j++) {
+		if (erased)
+			memset(ecc_data, 0xff, ecc_bytes);
+		else if (bch_t)
+			nand_bch_calculate_ecc(in + j * ecc_step, ecc_data);
+		else
+			nand_calculate_ecc(in + j * ecc_step, ecc_data);
+		ecc_data += ecc_stride;
+	}
+}
+
+static void nand_ecc_job(void *arg, unsigned int idx)
+{
+	struct nand_image *img = arg;
+	size_t page = (size_t)idx * NAND_PAGES_PER_JOB;
+	size_t end = page + NAND_PAGES_PER_JOB;
+
+	if (end > img->pages)
+		end = img->pages;
+
+	for (; page < end; page++)
+		nand_ecc_page(img->in + page * page_size,
+			      img->out + page * (page_size + oob_size));
+}
+
+/*
+ * Whole-image mode: map input and output and generate all pages in
+ * parallel. Returns 1 if either side can't be mapped, in which case the
+ * caller falls back to streaming page by page.
+ */
+static int nand_ecc_mapped(int infd, int outfd)
+{
+	struct nand_image img;
+	size_t out_len;
+	struct stat st;
+	void *in, *out;
+	int ret = 1;
+
+	if (fstat(infd, &st) || !S_ISREG(st.st_mode))
+		return 1;
+
+	img.pages = st.st_size / page_size;
+	if (!img.pages)
+		return 1;
+
+	out_len = img.pages * (page_size + oob_size);
+	if (ftruncate(outfd, out_len))
+		return 1;
+
+	in = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, infd, 0);
+	if (in == MAP_FAILED)
+		return 1;
+
+	out = mmap(NULL, out_len, PROT_READ | PROT_WRITE, MAP_SHARED, outfd, 0);
+	if (out == MAP_FAILED)
+		goto out_unmap_in;
+
+	img.in = in;
+	img.out = out;
+	fw_pool_run((img.pages + NAND_PAGES_PER_JOB - 1) / NAND_PAGES_PER_JOB,
+		    nand_ecc_job, &img);
+
+	ret = munmap(out, out_len) ? -1 : 0;
+
+out_unmap_in:
+	munmap(in, st.st_size);
+	return ret;
+}
+
 /*
  *  usage: bb-nandflash-ecc    start_address  size
  */
@@ -113,9 +426,19 @@ void usage(const char *prog)
 		"Options:\n"
 		"    -p <pagesize>      NAND page size (default: %d)\n"
 		"    -o <oobsize>       NAND OOB size (default: %d)\n"
-		"    -e <offset>        NAND ECC offset (default: %d)\n"
+		"    -e <offset>        NAND ECC offset (default: %d, or the end of\n"
+		"                       the OOB with -b)\n"
+		"    -s <stride>        OOB bytes from one step's ECC to the next\n"
+		"                       (default: the size of one code)\n"
+		"    -f <byte>          fill the rest of the OOB with <byte> (default: 0)\n"
+		"    -b <strength>      use BCH correcting <strength> bits per step\n"
+		"                       instead of the 1-bit Hamming code\n"
+		"    -c <stepsize>      BCH step size (default: %d)\n"
+		"\n"
+		"Hamming gives each %d-byte step a %d-byte code, BCH each step\n"
+		"ceil(m * strength / 8) bytes like the Linux software BCH engine.\n"
 		"\n", prog, DEF_NAND_PAGE_SIZE, DEF_NAND_OOB_SIZE,
-		DEF_NAND_ECC_OFFSET);
+		DEF_NAND_ECC_OFFSET, DEF_BCH_STEP, NAND_ECC_STEP, NAND_ECC_BYTES);
 	exit(1);
 }
 
@@ -124,13 +447,12 @@ void usage(const char *prog)
 int main(int argc, char **argv)
 {
 	uint8_t *page_data = NULL;
-	uint8_t *ecc_data;
 	int infd = -1, outfd = -1;
 	int ret = 1;
 	ssize_t bytes;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "e:o:p:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:c:e:f:o:p:s:")) != -1) {
 		switch(ch) {
 		case 'p':
 			page_size = strtoul(optarg, NULL, 0);
@@ -141,6 +463,18 @@ int main(int argc, char **argv)
 		case 'e':
 			ecc_offset = strtoul(optarg, NULL, 0);
 			break;
+		case 's':
+			ecc_stride = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			oob_fill = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bch_t = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			ecc_step = strtoul(optarg, NULL, 0);
+			break;
 		default:
 			usage(argv[0]);
 		}
@@ -151,29 +485,62 @@ int main(int argc, char **argv)
 
 	argv += optind;
 
+	if (bch_t) {
+		if (ecc_step == NAND_ECC_STEP)
+			ecc_step = DEF_BCH_STEP;
+		if (ecc_step <= 0 || ecc_step % 8 || bch_init()) {
+			fprintf(stderr, "unsupported BCH step size/strength\n");
+			goto out;
+		}
+	} else if (ecc_step != NAND_ECC_STEP) {
+		fprintf(stderr, "Hamming ECC only works on %d-byte steps\n",
+			NAND_ECC_STEP);
+		goto out;
+	}
+
+	if (ecc_stride < 0)
+		ecc_stride = ecc_bytes;
+	if (ecc_offset < 0 && bch_t && page_size > 0 && ecc_step > 0)
+		ecc_offset = oob_size - ecc_stride * (page_size / ecc_step - 1) -
+			     ecc_bytes;
+	else if (ecc_offset < 0)
+		ecc_offset = DEF_NAND_ECC_OFFSET;
+
+	if (page_size <= 0 || page_size % ecc_step ||
+	    ecc_stride < ecc_bytes || ecc_offset < 0 ||
+	    ecc_offset + ecc_stride * (page_size / ecc_step - 1) +
+	    ecc_bytes > oob_size) {
+		fprintf(stderr, "ECC layout doesn't fit the page/OOB size\n");
+		goto out;
+	}
+
 	infd = open(argv[0], O_RDONLY, 0);
 	if (infd < 0) {
 		perror("open input file");
 		goto out;
 	}
 
-	outfd = open(argv[1], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	outfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0644);
 	if (outfd < 0) {
 		perror("open output file");
 		goto out;
 	}
 
-	page_data = malloc(page_size + oob_size);
+	switch (nand_ecc_mapped(infd, outfd)) {
+	case 0:
+		ret = 0;
+		goto out;
+	case 1:
+		break;
+	default:
+		perror("write output file");
+		goto out;
+	}
 
-	while ((bytes = read(infd, page_data, page_size)) == page_size) {
-		int j;
+	page_data = calloc(1, page_size + oob_size);
 
-		ecc_data = page_data + page_size + ecc_offset;
-		for (j = 0; j < page_size / 256; j++)
-		{
-			nand_calculate_ecc(page_data + j * 256, ecc_data);
-			ecc_data += 3;
-		}
+	while ((bytes = read(infd, page_data, page_size)) == page_size) {
+		nand_ecc_page(page_data, page_data);
 		write(outfd, page_data, page_size + oob_size);
 	}
 
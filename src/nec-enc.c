@@ -12,44 +12,26 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include "fw_xor.h"
+
 #define KEY_LEN     16
 #define PATTERN_LEN 251
 
-static int
-xor_pattern(uint8_t *data, size_t len, const char *key, int k_len, int k_off)
-{
-	int offset = k_off;
-
-	while (len--) {
-		*data ^= key[offset];
-		data++;
-		offset = (offset + 1) % k_len;
-	}
-
-	return offset;
-}
-
-static void xor_data(uint8_t *data, size_t len, const uint8_t *pattern)
-{
-	for (int i = 0; i < len; i++) {
-		*data ^= pattern[i];
-		data++;
-	}
-}
-
 static void __attribute__((noreturn)) usage(void)
 {
 	fprintf(stderr, "Usage: nec-enc -i infile -o outfile -k <key>\n");
 	exit(EXIT_FAILURE);
 }
 
-static unsigned char buf_pattern[4096], buf[4096];
+static unsigned char buf[64 * 1024];
 
 int main(int argc, char **argv)
 {
-	int k_off = 0, ptn = 1, c, ret = EXIT_SUCCESS;
 	char *ifn = NULL, *ofn = NULL, *key = NULL;
+	int c, ret = EXIT_SUCCESS;
+	uint8_t *stream;
 	size_t n, k_len;
+	struct fw_xor xor;
 	FILE *out, *in;
 
 	while ((c = getopt(argc, argv, "i:o:k:h")) != -1) {
@@ -97,31 +79,46 @@ int main(int argc, char **argv)
 		usage();
 	}
 
-	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
-		for (int i = 0; i < n; i++) {
-			buf_pattern[i] = ptn;
-			ptn++;
+	/*
+	 * The data is XORed with a 1..PATTERN_LEN counter that is itself XORed
+	 * with the key. Both repeat, so their combination repeats every
+	 * PATTERN_LEN * k_len bytes and can be handed to fw_xor as one pattern.
+	 */
+	stream = malloc(PATTERN_LEN * k_len);
+	if (!stream) {
+		perror("failed to allocate key stream");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+	for (size_t i = 0; i < PATTERN_LEN * k_len; i++)
+		stream[i] = (i % PATTERN_LEN + 1) ^ key[i % k_len];
 
-			if (ptn > PATTERN_LEN)
-				ptn = 1;
-		}
+	c = fw_xor_init(&xor, stream, PATTERN_LEN * k_len, 0);
+	free(stream);
+	if (c) {
+		perror("failed to allocate key stream");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
 
-		k_off = xor_pattern(buf_pattern, n, key, k_len, k_off);
-		xor_data(buf, n, buf_pattern);
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		fw_xor_apply(&xor, buf, n);
 
 		if (fwrite(buf, 1, n, out) != n) {
 			perror("failed to write");
 			ret = EXIT_FAILURE;
-			goto out;
+			goto out_free;
 		}
 	}
 
 	if (ferror(in)) {
 		perror("failed to read");
 		ret = EXIT_FAILURE;
-		goto out;
+		goto out_free;
 	}
 
+out_free:
+	fw_xor_free(&xor);
 out:
 	fclose(in);
 	fclose(out);
@@ -8,12 +8,20 @@
 #include <byteswap.h>
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "fw_dcache.h"
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_trace.h"
 #include "md5.h"
 
 #if !defined(__BYTE_ORDER)
@@ -35,6 +43,7 @@
 #endif
 
 #define SEAMA_MAGIC			0x5ea3a417
+#define OSEAMA_MAX_EXTRACT		64
 
 struct seama_seal_header {
 	uint32_t magic;
@@ -54,6 +63,11 @@ struct seama_entity_header {
 char *seama_path;
 int entity_idx = -1;
 char *out_path;
+int extract_idx[OSEAMA_MAX_EXTRACT];
+char *extract_path[OSEAMA_MAX_EXTRACT];
+int n_extract_idx, n_extract_path;
+bool extract_check = false;
+char *update_path;
 
 static inline size_t oseama_min(size_t x, size_t y) {
 	return x < y ? x : y;
@@ -97,6 +111,85 @@ static void oseama_close(FILE *fp) {
 		fclose(fp);
 }
 
+/**************************************************
+ * Entity index
+ **************************************************/
+
+struct oseama_entity {
+	off_t offset;			/* of the entity header */
+	size_t metasize;
+	size_t imagesize;
+	uint8_t md5[16];
+};
+
+struct oseama_index {
+	struct oseama_entity *entities;
+	size_t n;
+};
+
+static size_t oseama_entity_len(const struct oseama_entity *entity) {
+	return sizeof(struct seama_entity_header) + entity->metasize + entity->imagesize;
+}
+
+/*
+ * Index the entities following the seal, which fp is positioned right
+ * after at offset pos. Only the entity headers are read.
+ */
+static int oseama_index_build(FILE *seama, off_t pos, struct oseama_index *index) {
+	struct seama_entity_header hdr;
+	size_t alloc = 0;
+
+	index->entities = NULL;
+	index->n = 0;
+
+	while (fread(&hdr, 1, sizeof(hdr), seama) == sizeof(hdr)) {
+		struct oseama_entity *entity;
+
+		if (be32_to_cpu(hdr.magic) != SEAMA_MAGIC) {
+			fprintf(stderr, "Invalid Seama magic: 0x%08x\n", be32_to_cpu(hdr.magic));
+			return -EINVAL;
+		}
+
+		if (index->n == alloc) {
+			alloc = alloc ? 2 * alloc : 8;
+			entity = realloc(index->entities, alloc * sizeof(*entity));
+			if (!entity)
+				return -ENOMEM;
+			index->entities = entity;
+		}
+
+		entity = &index->entities[index->n++];
+		entity->offset = pos;
+		entity->metasize = be16_to_cpu(hdr.metasize);
+		entity->imagesize = be32_to_cpu(hdr.imagesize);
+		memcpy(entity->md5, hdr.md5, sizeof(entity->md5));
+
+		pos += oseama_entity_len(entity);
+		if (fseeko(seama, pos, SEEK_SET))
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * MD5 of an entity's image. map covers the whole entity, fd is only used
+ * as the digest cache key.
+ */
+static void oseama_entity_md5(int fd, const struct oseama_entity *entity,
+			      const struct fw_io_map *map, uint8_t *digest) {
+	off_t image = entity->offset + sizeof(struct seama_entity_header) + entity->metasize;
+	MD5_CTX md5;
+
+	if (fw_dcache_get(fd, image, entity->imagesize, FW_DCACHE_MD5, digest, 16))
+		return;
+
+	MD5_Init(&md5);
+	MD5_Update(&md5, map->data + (image - entity->offset), entity->imagesize);
+	MD5_Final(digest, &md5);
+	fw_dcache_put(fd, image, entity->imagesize, FW_DCACHE_MD5, digest, 16);
+}
+
 /**************************************************
  * Info
  **************************************************/
@@ -264,11 +357,13 @@ out:
  * Create
  **************************************************/
 
-static ssize_t oseama_entity_append_file(FILE *seama, const char *in_path) {
+static void oseama_md5_sink(void *priv, const void *buf, size_t len) {
+	MD5_Update(priv, buf, len);
+}
+
+static ssize_t oseama_entity_append_file(FILE *seama, const char *in_path, MD5_CTX *md5) {
 	FILE *in;
-	size_t bytes;
-	ssize_t length = 0;
-	uint8_t buf[128];
+	ssize_t length;
 
 	in = fopen(in_path, "r");
 	if (!in) {
@@ -276,31 +371,27 @@ static ssize_t oseama_entity_append_file(FILE *seama, const char *in_path) {
 		return -EACCES;
 	}
 
-	while ((bytes = fread(buf, 1, sizeof(buf), in)) > 0) {
-		if (fwrite(buf, 1, bytes, seama) != bytes) {
-			fprintf(stderr, "Couldn't write %zu B to %s\n", bytes, seama_path);
-			length = -EIO;
-			break;
-		}
-		length += bytes;
-	}
+	length = fw_io_copy(seama, in, FW_IO_ALL, oseama_md5_sink, md5);
+	if (length < 0)
+		fprintf(stderr, "Couldn't copy %s to %s\n", in_path, seama_path);
 
 	fclose(in);
 
 	return length;
 }
 
-static ssize_t oseama_entity_append_zeros(FILE *seama, size_t length) {
-	uint8_t *buf;
-
-	buf = malloc(length);
-	if (!buf)
-		return -ENOMEM;
-	memset(buf, 0, length);
+static ssize_t oseama_entity_append_zeros(FILE *seama, size_t length, MD5_CTX *md5) {
+	static const uint8_t zeros[4096];
+	size_t left, n;
 
-	if (fwrite(buf, 1, length, seama) != length) {
-		fprintf(stderr, "Couldn't write %zu B to %s\n", length, seama_path);
-		return -EIO;
+	for (left = length; left; left -= n) {
+		n = left < sizeof(zeros) ? left : sizeof(zeros);
+		if (fwrite(zeros, 1, n, seama) != n) {
+			fprintf(stderr, "Couldn't write %zu B to %s\n", length, seama_path);
+			return -EIO;
+		}
+		if (md5)
+			MD5_Update(md5, zeros, n);
 	}
 
 	return length;
@@ -310,34 +401,27 @@ static ssize_t oseama_entity_align(FILE *seama, size_t curr_offset, size_t align
 	if (curr_offset & (alignment - 1)) {
 		size_t length = alignment - (curr_offset % alignment);
 
-		return oseama_entity_append_zeros(seama, length);
+		return oseama_entity_append_zeros(seama, length, NULL);
 	}
 
 	return 0;
 }
 
-static int oseama_entity_write_hdr(FILE *seama, size_t metasize, size_t imagesize) {
+/*
+ * The image MD5 has been accumulated while the data was written, so only
+ * the header itself needs to go out here.
+ */
+static int oseama_entity_write_hdr(FILE *seama, size_t metasize, size_t imagesize, MD5_CTX *md5) {
 	struct seama_entity_header hdr = {};
-	uint8_t buf[128];
-	size_t length = imagesize;
-	size_t bytes;
-	MD5_CTX ctx;
 
-	fseek(seama, sizeof(hdr) + metasize, SEEK_SET);
-	MD5_Init(&ctx);
-	while ((bytes = fread(buf, 1, oseama_min(sizeof(buf), length), seama)) > 0) {
-		MD5_Update(&ctx, buf, bytes);
-		length -= bytes;
-	}
-	MD5_Final(hdr.md5, &ctx);
+	MD5_Final(hdr.md5, md5);
 
 	hdr.magic = cpu_to_be32(SEAMA_MAGIC);
 	hdr.metasize = cpu_to_be16(metasize);
 	hdr.imagesize = cpu_to_be32(imagesize);
 
-	fseek(seama, 0, SEEK_SET);
-	bytes = fwrite(&hdr, 1, sizeof(hdr), seama);
-	if (bytes != sizeof(hdr)) {
+	if (fflush(seama) ||
+	    pwrite(fileno(seama), &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
 		fprintf(stderr, "Couldn't write Seama entity header to %s\n", seama_path);
 		return -EIO;
 	}
@@ -345,14 +429,48 @@ static int oseama_entity_write_hdr(FILE *seama, size_t metasize, size_t imagesiz
 	return 0;
 }
 
+static const struct option oseama_entity_long_options[] = {
+	{ "update", required_argument, NULL, 'u' },
+	{ }
+};
+
+/*
+ * With --update the entity is built in memory and only the blocks that
+ * differ from the earlier build are written out.
+ */
+static int oseama_entity_update(FILE *seama) {
+	int fd, err;
+
+	if (fflush(seama))
+		return -EIO;
+
+	fd = fw_io_open_update(seama_path, update_path);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s\n", seama_path);
+		return fd;
+	}
+
+	err = fw_io_update_file(fd, fileno(seama), NULL);
+	if (close(fd) && !err)
+		err = -EIO;
+	if (err)
+		fprintf(stderr, "Couldn't update %s\n", seama_path);
+
+	return err;
+}
+
 static int oseama_entity(int argc, char **argv) {
 	FILE *seama;
 	ssize_t sbytes;
 	size_t curr_offset = sizeof(struct seama_entity_header);
 	size_t metasize = 0, imagesize = 0;
+	struct fw_trace t;
+	MD5_CTX md5;
 	int c;
 	int err = 0;
 
+	fw_trace_begin(&t, "oseama_entity");
+
 	if (argc < 3) {
 		fprintf(stderr, "No Seama file passed\n");
 		err = -EINVAL;
@@ -360,7 +478,14 @@ static int oseama_entity(int argc, char **argv) {
 	}
 	seama_path = argv[2];
 
-	seama = fopen(seama_path, "w+");
+	MD5_Init(&md5);
+
+	optind = 3;
+	while ((c = getopt_long(argc, argv, "m:f:b:u:", oseama_entity_long_options, NULL)) != -1)
+		if (c == 'u')
+			update_path = optarg;
+
+	seama = update_path ? fw_io_stage() : fopen(seama_path, "w+");
 	if (!seama) {
 		fprintf(stderr, "Couldn't open %s\n", seama_path);
 		err = -EACCES;
@@ -369,7 +494,7 @@ static int oseama_entity(int argc, char **argv) {
 	fseek(seama, curr_offset, SEEK_SET);
 
 	optind = 3;
-	while ((c = getopt(argc, argv, "m:f:b:")) != -1) {
+	while ((c = getopt_long(argc, argv, "m:f:b:u:", oseama_entity_long_options, NULL)) != -1) {
 		switch (c) {
 		case 'm':
 			sbytes = fwrite(optarg, 1, strlen(optarg) + 1, seama);
@@ -396,12 +521,12 @@ static int oseama_entity(int argc, char **argv) {
 	}
 
 	optind = 3;
-	while ((c = getopt(argc, argv, "m:f:b:")) != -1) {
+	while ((c = getopt_long(argc, argv, "m:f:b:u:", oseama_entity_long_options, NULL)) != -1) {
 		switch (c) {
 		case 'm':
 			break;
 		case 'f':
-			sbytes = oseama_entity_append_file(seama, optarg);
+			sbytes = oseama_entity_append_file(seama, optarg, &md5);
 			if (sbytes < 0) {
 				fprintf(stderr, "Failed to append file %s\n", optarg);
 			} else {
@@ -414,7 +539,7 @@ static int oseama_entity(int argc, char **argv) {
 			if (sbytes < 0) {
 				fprintf(stderr, "Current Seama entity length is 0x%zx, can't pad it with zeros to 0x%lx\n", curr_offset, strtol(optarg, NULL, 0));
 			} else {
-				sbytes = oseama_entity_append_zeros(seama, sbytes);
+				sbytes = oseama_entity_append_zeros(seama, sbytes, &md5);
 				if (sbytes < 0) {
 					fprintf(stderr, "Failed to append zeros\n");
 				} else {
@@ -428,10 +553,14 @@ static int oseama_entity(int argc, char **argv) {
 			break;
 	}
 
-	oseama_entity_write_hdr(seama, metasize, imagesize);
+	oseama_entity_write_hdr(seama, metasize, imagesize, &md5);
+
+	if (update_path)
+		err = oseama_entity_update(seama);
 
 	fclose(seama);
 out:
+	fw_trace_end(&t, metasize + imagesize);
 	return err;
 }
 
@@ -442,18 +571,148 @@ out:
 static void oseama_extract_parse_options(int argc, char **argv) {
 	int c;
 
-	while ((c = getopt(argc, argv, "e:o:")) != -1) {
+	while ((c = getopt(argc, argv, "ce:o:")) != -1) {
 		switch (c) {
+		case 'c':
+			extract_check = true;
+			break;
 		case 'e':
-			entity_idx = atoi(optarg);
+			if (n_extract_idx < OSEAMA_MAX_EXTRACT)
+				extract_idx[n_extract_idx] = atoi(optarg);
+			n_extract_idx++;
 			break;
 		case 'o':
-			out_path = optarg;
+			if (n_extract_path < OSEAMA_MAX_EXTRACT)
+				extract_path[n_extract_path] = optarg;
+			n_extract_path++;
 			break;
 		}
 	}
 }
 
+struct oseama_extract_job {
+	const struct oseama_entity *entity;
+	int idx;
+	const char *path;
+	int in_fd;
+	FILE *out;
+	int err;
+};
+
+static void oseama_extract_job(void *arg, unsigned int idx) {
+	struct oseama_extract_job *job = (struct oseama_extract_job *)arg + idx;
+	const struct oseama_entity *entity = job->entity;
+	size_t length = oseama_entity_len(entity);
+	struct fw_io_map map = {};
+	uint8_t digest[16];
+	ssize_t bytes;
+
+	if (extract_check || job->out == stdout) {
+		job->err = fw_io_map(&map, job->in_fd, entity->offset, length);
+		if (job->err)
+			return;
+	}
+
+	if (extract_check) {
+		oseama_entity_md5(job->in_fd, entity, &map, digest);
+		if (memcmp(digest, entity->md5, sizeof(digest))) {
+			job->err = -EBADMSG;
+			goto out;
+		}
+	}
+
+	if (job->out == stdout) {
+		if (fwrite(map.data, 1, length, stdout) != length)
+			job->err = -EIO;
+	} else {
+		bytes = fw_io_copy_fd(fileno(job->out), 0, job->in_fd, entity->offset, length);
+		if (bytes != length)
+			job->err = -EIO;
+	}
+
+out:
+	fw_io_unmap(&map);
+}
+
+/*
+ * Extracts all requested entities at once from a regular file, reading
+ * them by offset from the index.
+ */
+static int oseama_extract_indexed(FILE *seama, off_t pos) {
+	struct oseama_extract_job jobs[OSEAMA_MAX_EXTRACT] = {};
+	struct oseama_index index;
+	struct stat st;
+	int i, err;
+
+	if (fstat(fileno(seama), &st))
+		return -EIO;
+
+	err = oseama_index_build(seama, pos, &index);
+	if (err) {
+		fprintf(stderr, "Couldn't index entities of %s\n", seama_path);
+		goto out;
+	}
+
+	for (i = 0; i < n_extract_idx; i++) {
+		struct oseama_extract_job *job = &jobs[i];
+
+		if (extract_idx[i] < 0 || (size_t)extract_idx[i] >= index.n) {
+			fprintf(stderr, "Couldn't find entity %d in %s\n", extract_idx[i], seama_path);
+			err = -EINVAL;
+			goto out;
+		}
+
+		job->entity = &index.entities[extract_idx[i]];
+		job->idx = extract_idx[i];
+		job->path = extract_path[i];
+		job->in_fd = fileno(seama);
+
+		if (job->entity->offset + oseama_entity_len(job->entity) > (uint64_t)st.st_size) {
+			fprintf(stderr, "Couldn't extract whole entity %d from %s\n", job->idx, seama_path);
+			err = -EIO;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < n_extract_idx; i++) {
+		struct oseama_extract_job *job = &jobs[i];
+
+		if (!job->path) {
+			job->out = stdout;
+			continue;
+		}
+
+		job->out = fopen(job->path, "w");
+		if (!job->out) {
+			fprintf(stderr, "Couldn't open %s\n", job->path);
+			err = -EACCES;
+			goto out;
+		}
+	}
+
+	fw_pool_run(n_extract_idx, oseama_extract_job, jobs);
+
+	for (i = 0; i < n_extract_idx; i++) {
+		struct oseama_extract_job *job = &jobs[i];
+
+		if (job->err == -EBADMSG)
+			fprintf(stderr, "Invalid MD5 of entity %d in %s\n", job->idx, seama_path);
+		else if (job->err)
+			fprintf(stderr, "Couldn't extract entity %d to %s\n", job->idx,
+				job->path ? job->path : "stdout");
+		if (job->err)
+			err = job->err;
+	}
+
+out:
+	for (i = 0; i < n_extract_idx; i++)
+		if (jobs[i].out && jobs[i].out != stdout)
+			fclose(jobs[i].out);
+	free(index.entities);
+
+	return err;
+}
+
 static int oseama_extract_entity(FILE *seama, FILE *out) {
 	struct seama_entity_header hdr;
 	size_t bytes, metasize, imagesize, length;
@@ -508,6 +767,7 @@ static int oseama_extract(int argc, char **argv) {
 	FILE *seama;
 	FILE *out;
 	struct seama_seal_header hdr;
+	struct stat st;
 	size_t bytes;
 	uint16_t metasize;
 	int err = 0;
@@ -521,11 +781,23 @@ static int oseama_extract(int argc, char **argv) {
 
 	optind = 3;
 	oseama_extract_parse_options(argc, argv);
-	if (entity_idx < 0) {
+	if (!n_extract_idx || extract_idx[0] < 0) {
 		fprintf(stderr, "No entity specified\n");
 		err = -EINVAL;
 		goto out;
 	}
+	if (n_extract_idx > OSEAMA_MAX_EXTRACT) {
+		fprintf(stderr, "Can't extract more than %d entities at once\n", OSEAMA_MAX_EXTRACT);
+		err = -EINVAL;
+		goto out;
+	}
+	if (n_extract_path > n_extract_idx || (n_extract_idx > 1 && n_extract_path != n_extract_idx)) {
+		fprintf(stderr, "Every extracted entity needs its own output file\n");
+		err = -EINVAL;
+		goto out;
+	}
+	entity_idx = extract_idx[0];
+	out_path = extract_path[0];
 
 	seama = oseama_open(seama_path, "r");
 	if (!seama) {
@@ -534,6 +806,32 @@ static int oseama_extract(int argc, char **argv) {
 		goto out;
 	}
 
+	/* Anything that can't be read by offset goes through the stream once */
+	if (!fstat(fileno(seama), &st) && S_ISREG(st.st_mode)) {
+		bytes = fread(&hdr, 1, sizeof(hdr), seama);
+		if (bytes != sizeof(hdr)) {
+			fprintf(stderr, "Couldn't read %s header\n", seama_path);
+			err =  -EIO;
+			goto err_close_seama;
+		}
+		metasize = be16_to_cpu(hdr.metasize);
+
+		if (fseeko(seama, sizeof(hdr) + metasize, SEEK_SET)) {
+			fprintf(stderr, "Couldn't seek past %s meta\n", seama_path);
+			err = -EIO;
+			goto err_close_seama;
+		}
+
+		err = oseama_extract_indexed(seama, sizeof(hdr) + metasize);
+		goto err_close_seama;
+	}
+
+	if (n_extract_idx > 1 || extract_check) {
+		fprintf(stderr, "Extracting several entities or checking them needs a regular file\n");
+		err = -EINVAL;
+		goto err_close_seama;
+	}
+
 	if (out_path) {
 		out = fopen(out_path, "w");
 		if (!out) {
@@ -566,6 +864,591 @@ out:
 	return err;
 }
 
+/**************************************************
+ * Verify
+ **************************************************/
+
+struct oseama_verify_job {
+	const struct oseama_entity *entity;
+	int fd;
+	off_t file_size;
+	uint8_t digest[16];
+	int err;
+};
+
+static void oseama_verify_job(void *arg, unsigned int idx) {
+	struct oseama_verify_job *job = (struct oseama_verify_job *)arg + idx;
+	const struct oseama_entity *entity = job->entity;
+	struct fw_io_map map;
+
+	if (entity->offset + oseama_entity_len(entity) > (uint64_t)job->file_size) {
+		job->err = -EIO;
+		return;
+	}
+
+	job->err = fw_io_map(&map, job->fd, entity->offset, oseama_entity_len(entity));
+	if (job->err)
+		return;
+
+	oseama_entity_md5(job->fd, entity, &map, job->digest);
+	if (memcmp(job->digest, entity->md5, sizeof(job->digest)))
+		job->err = -EBADMSG;
+
+	fw_io_unmap(&map);
+}
+
+/*
+ * Checks the MD5 of every entity. Only the headers are read in order, the
+ * images are hashed by offset on the worker pool.
+ */
+static int oseama_verify(int argc, char **argv) {
+	struct oseama_verify_job *jobs = NULL;
+	struct seama_seal_header hdr;
+	struct oseama_index index = {};
+	struct stat st;
+	FILE *seama;
+	size_t i;
+	int err = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "No Seama file passed\n");
+		err = -EINVAL;
+		goto out;
+	}
+	seama_path = argv[2];
+
+	seama = fopen(seama_path, "r");
+	if (!seama) {
+		fprintf(stderr, "Couldn't open %s\n", seama_path);
+		err = -EACCES;
+		goto out;
+	}
+
+	if (fstat(fileno(seama), &st) || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s is not a regular file\n", seama_path);
+		err = -EINVAL;
+		goto err_close;
+	}
+
+	if (fread(&hdr, 1, sizeof(hdr), seama) != sizeof(hdr)) {
+		fprintf(stderr, "Couldn't read %s header\n", seama_path);
+		err =  -EIO;
+		goto err_close;
+	}
+
+	if (be32_to_cpu(hdr.magic) != SEAMA_MAGIC) {
+		fprintf(stderr, "Invalid Seama magic: 0x%08x\n", be32_to_cpu(hdr.magic));
+		err =  -EINVAL;
+		goto err_close;
+	}
+
+	if (fseeko(seama, sizeof(hdr) + be16_to_cpu(hdr.metasize), SEEK_SET)) {
+		err = -EIO;
+		goto err_close;
+	}
+
+	err = oseama_index_build(seama, sizeof(hdr) + be16_to_cpu(hdr.metasize), &index);
+	if (err) {
+		fprintf(stderr, "Couldn't index entities of %s\n", seama_path);
+		goto err_close;
+	}
+
+	jobs = calloc(index.n ? index.n : 1, sizeof(*jobs));
+	if (!jobs) {
+		err = -ENOMEM;
+		goto err_close;
+	}
+
+	for (i = 0; i < index.n; i++) {
+		jobs[i].entity = &index.entities[i];
+		jobs[i].fd = fileno(seama);
+		jobs[i].file_size = st.st_size;
+	}
+
+	fw_pool_run(index.n, oseama_verify_job, jobs);
+
+	for (i = 0; i < index.n; i++) {
+		struct oseama_verify_job *job = &jobs[i];
+		int j;
+
+		printf("Entity %zu:\t", i);
+		if (job->err == -EBADMSG) {
+			printf("MD5 mismatch, expected ");
+			for (j = 0; j < 16; j++)
+				printf("%02x", job->entity->md5[j]);
+			printf(" calculated ");
+			for (j = 0; j < 16; j++)
+				printf("%02x", job->digest[j]);
+			printf("\n");
+		} else if (job->err) {
+			printf("truncated\n");
+		} else {
+			printf("MD5 ok\n");
+		}
+
+		if (job->err)
+			err = job->err;
+	}
+
+err_close:
+	free(jobs);
+	free(index.entities);
+	fclose(seama);
+out:
+	return err;
+}
+
+/**************************************************
+ * Build
+ **************************************************/
+
+/* Entities with images up to this size are hashed side by side */
+#define OSEAMA_BUILD_SMALL		(1024 * 1024)
+#define OSEAMA_BUILD_LANES		8
+
+/* A file or, with path NULL, a run of zeros in an entity's image */
+struct oseama_part {
+	const char *path;
+	int fd;
+	struct fw_io_map map;
+	size_t len;
+};
+
+struct oseama_build_entity {
+	struct seama_entity_header hdr;
+	uint8_t *meta;
+	size_t metasize;
+	struct oseama_part *parts;
+	size_t n_parts;
+	size_t imagesize;
+	off_t offset;			/* of the entity header in the output */
+};
+
+struct oseama_build {
+	bool seal;
+	struct seama_seal_header seal_hdr;
+	uint8_t *seal_meta;
+	size_t seal_metasize;
+	struct oseama_build_entity *entities;
+	size_t n;
+	uint8_t *zeros;			/* as long as the longest run of zeros */
+	size_t zeros_len;
+};
+
+static int oseama_build_meta(uint8_t **meta, size_t *metasize, const char *str, bool align) {
+	size_t len = strlen(str) + 1;
+	size_t size = *metasize + len;
+	uint8_t *buf;
+
+	if (align)
+		size = (size + 3) & ~3;
+	if (size > UINT16_MAX) {
+		fprintf(stderr, "Too much meta info (%zu B)\n", size);
+		return -EINVAL;
+	}
+
+	buf = realloc(*meta, size);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf + *metasize, str, len);
+	memset(buf + *metasize + len, 0, size - *metasize - len);
+
+	*meta = buf;
+	*metasize = size;
+
+	return 0;
+}
+
+static struct oseama_part *oseama_build_part(struct oseama_build_entity *entity) {
+	struct oseama_part *part;
+
+	part = realloc(entity->parts, (entity->n_parts + 1) * sizeof(*part));
+	if (!part)
+		return NULL;
+	entity->parts = part;
+	part += entity->n_parts++;
+	memset(part, 0, sizeof(*part));
+	part->fd = -1;
+
+	return part;
+}
+
+static int oseama_build_file(struct oseama_build_entity *entity, const char *path) {
+	struct oseama_part *part;
+	struct stat st;
+	int err;
+
+	part = oseama_build_part(entity);
+	if (!part)
+		return -ENOMEM;
+	part->path = path;
+
+	part->fd = open(path, O_RDONLY);
+	if (part->fd < 0) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return -EACCES;
+	}
+	if (fstat(part->fd, &st) || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s is not a regular file\n", path);
+		return -EINVAL;
+	}
+
+	err = fw_io_map(&part->map, part->fd, 0, st.st_size);
+	if (err) {
+		fprintf(stderr, "Couldn't map %s\n", path);
+		return err;
+	}
+	part->len = st.st_size;
+	entity->imagesize += part->len;
+
+	return 0;
+}
+
+static int oseama_build_pad(struct oseama_build *build, struct oseama_build_entity *entity,
+			    const char *arg) {
+	size_t curr_offset = sizeof(entity->hdr) + entity->metasize + entity->imagesize;
+	long offset = strtol(arg, NULL, 0);
+	struct oseama_part *part;
+
+	if (offset < 0 || (size_t)offset < curr_offset) {
+		fprintf(stderr, "Current Seama entity length is 0x%zx, can't pad it with zeros to 0x%lx\n", curr_offset, offset);
+		return -EINVAL;
+	}
+
+	part = oseama_build_part(entity);
+	if (!part)
+		return -ENOMEM;
+	part->len = offset - curr_offset;
+	entity->imagesize += part->len;
+
+	if (part->len > build->zeros_len)
+		build->zeros_len = part->len;
+
+	return 0;
+}
+
+/*
+ * The manifest has one directive per line; empty lines and lines starting
+ * with '#' are skipped. "seal" (first, if at all) and "entity" start a
+ * section, "meta <info>" adds meta info to the current one, "file <path>"
+ * and "pad <offset>" add to the image of the current entity like -f and -b
+ * of oseama entity do.
+ */
+static int oseama_build_parse(FILE *manifest, struct oseama_build *build) {
+	struct oseama_build_entity *entity = NULL;
+	char line[4096];
+	unsigned int lineno = 0;
+	char *key, *arg, *end;
+	int err = 0;
+
+	while (!err && fgets(line, sizeof(line), manifest)) {
+		lineno++;
+
+		end = line + strlen(line);
+		while (end > line && (end[-1] == '\n' || end[-1] == '\r' ||
+				      end[-1] == ' ' || end[-1] == '\t'))
+			*--end = '\0';
+		for (key = line; *key == ' ' || *key == '\t'; key++)
+			;
+		if (!*key || *key == '#')
+			continue;
+
+		arg = key + strcspn(key, " \t");
+		if (*arg)
+			*arg++ = '\0';
+		while (*arg == ' ' || *arg == '\t')
+			arg++;
+
+		if (!strcmp(key, "seal") && !*arg) {
+			if (build->seal || build->n) {
+				fprintf(stderr, "Line %u: seal has to come first\n", lineno);
+				err = -EINVAL;
+			}
+			build->seal = true;
+		} else if (!strcmp(key, "entity") && !*arg) {
+			entity = realloc(build->entities, (build->n + 1) * sizeof(*entity));
+			if (!entity) {
+				err = -ENOMEM;
+				break;
+			}
+			build->entities = entity;
+			entity += build->n++;
+			memset(entity, 0, sizeof(*entity));
+		} else if (!strcmp(key, "meta") && *arg && (entity || build->seal)) {
+			if (entity)
+				err = oseama_build_meta(&entity->meta, &entity->metasize,
+							arg, true);
+			else
+				err = oseama_build_meta(&build->seal_meta,
+							&build->seal_metasize, arg, false);
+		} else if (!strcmp(key, "file") && *arg && entity) {
+			arg = strdup(arg);
+			err = arg ? oseama_build_file(entity, arg) : -ENOMEM;
+		} else if (!strcmp(key, "pad") && *arg && entity) {
+			err = oseama_build_pad(build, entity, arg);
+		} else {
+			fprintf(stderr, "Line %u: invalid directive \"%s\"\n", lineno, key);
+			err = -EINVAL;
+		}
+	}
+
+	if (!err && !build->n) {
+		fprintf(stderr, "No entities in the manifest\n");
+		err = -EINVAL;
+	}
+
+	/* Like seama -s, the seal's meta info only ends on a 4 B boundary */
+	if (!err && build->seal_metasize & 3)
+		err = oseama_build_meta(&build->seal_meta, &build->seal_metasize, "", true);
+
+	return err;
+}
+
+struct oseama_build_md5 {
+	struct oseama_build_entity *entity[OSEAMA_BUILD_LANES];
+	unsigned int n;
+	const uint8_t *zeros;
+};
+
+/*
+ * Hash the images of a group of entities together, one part of each per
+ * MD5_Multi_Update() round
+ */
+static void oseama_build_md5_job(void *arg, unsigned int idx) {
+	struct oseama_build_md5 *job = (struct oseama_build_md5 *)arg + idx;
+	MD5_CTX ctx[OSEAMA_BUILD_LANES], *pctx[OSEAMA_BUILD_LANES];
+	const void *data[OSEAMA_BUILD_LANES];
+	unsigned long size[OSEAMA_BUILD_LANES];
+	struct oseama_build_entity *entity;
+	struct oseama_part *part;
+	unsigned int i, m;
+	size_t k;
+
+	for (i = 0; i < job->n; i++)
+		MD5_Init(&ctx[i]);
+
+	for (k = 0; ; k++) {
+		for (i = m = 0; i < job->n; i++) {
+			entity = job->entity[i];
+			if (k >= entity->n_parts)
+				continue;
+			part = &entity->parts[k];
+			pctx[m] = &ctx[i];
+			data[m] = part->path ? part->map.data : job->zeros;
+			size[m++] = part->len;
+		}
+		if (!m)
+			break;
+		MD5_Multi_Update(pctx, data, size, m);
+	}
+
+	for (i = 0; i < job->n; i++)
+		MD5_Final(job->entity[i]->hdr.md5, &ctx[i]);
+}
+
+static int oseama_build_md5(struct oseama_build *build) {
+	struct oseama_build_md5 *jobs, *small = NULL;
+	unsigned int n = 0;
+	size_t i;
+
+	jobs = calloc(build->n, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	/* Small entities share lanes, every big one hashes on its own */
+	for (i = 0; i < build->n; i++) {
+		struct oseama_build_entity *entity = &build->entities[i];
+		struct oseama_build_md5 *job;
+
+		if (entity->imagesize > OSEAMA_BUILD_SMALL) {
+			job = &jobs[n++];
+		} else {
+			if (!small || small->n == OSEAMA_BUILD_LANES)
+				small = &jobs[n++];
+			job = small;
+		}
+		job->entity[job->n++] = entity;
+		job->zeros = build->zeros;
+	}
+
+	fw_pool_run(n, oseama_build_md5_job, jobs);
+	free(jobs);
+
+	return 0;
+}
+
+/* Lay the output out as extents: headers and meta from memory, files, holes */
+static struct fw_io_extent *oseama_build_layout(struct oseama_build *build,
+						unsigned int *n_ext, off_t *total) {
+	struct fw_io_extent *ext, *e;
+	unsigned int n = 2;
+	off_t off = 0;
+	size_t i, k;
+
+	for (i = 0; i < build->n; i++)
+		n += 2 + build->entities[i].n_parts;
+	ext = calloc(n, sizeof(*ext));
+	if (!ext)
+		return NULL;
+	e = ext;
+
+#define OSEAMA_EXTENT(_buf, _len) do {			\
+	e->fd = -1;					\
+	e->buf = (_buf);				\
+	e->len = (_len);				\
+	e->out_off = off;				\
+	off += e->len;					\
+	e++;						\
+} while (0)
+
+	if (build->seal) {
+		build->seal_hdr.magic = cpu_to_be32(SEAMA_MAGIC);
+		build->seal_hdr.metasize = cpu_to_be16(build->seal_metasize);
+		OSEAMA_EXTENT(&build->seal_hdr, sizeof(build->seal_hdr));
+		OSEAMA_EXTENT(build->seal_meta, build->seal_metasize);
+	}
+
+	for (i = 0; i < build->n; i++) {
+		struct oseama_build_entity *entity = &build->entities[i];
+
+		entity->offset = off;
+		entity->hdr.magic = cpu_to_be32(SEAMA_MAGIC);
+		entity->hdr.metasize = cpu_to_be16(entity->metasize);
+		entity->hdr.imagesize = cpu_to_be32(entity->imagesize);
+		OSEAMA_EXTENT(&entity->hdr, sizeof(entity->hdr));
+		OSEAMA_EXTENT(entity->meta, entity->metasize);
+
+		for (k = 0; k < entity->n_parts; k++) {
+			struct oseama_part *part = &entity->parts[k];
+
+			OSEAMA_EXTENT(NULL, part->len);
+			e[-1].fd = part->fd;
+		}
+	}
+
+#undef OSEAMA_EXTENT
+
+	*n_ext = e - ext;
+	*total = off;
+
+	return ext;
+}
+
+static void oseama_build_free(struct oseama_build *build) {
+	size_t i, k;
+
+	for (i = 0; i < build->n; i++) {
+		struct oseama_build_entity *entity = &build->entities[i];
+
+		for (k = 0; k < entity->n_parts; k++) {
+			struct oseama_part *part = &entity->parts[k];
+
+			if (part->path) {
+				fw_io_unmap(&part->map);
+				free((char *)part->path);
+			}
+			if (part->fd >= 0)
+				close(part->fd);
+		}
+		free(entity->parts);
+		free(entity->meta);
+	}
+	free(build->entities);
+	free(build->seal_meta);
+	free(build->zeros);
+}
+
+static const struct option oseama_build_long_options[] = {
+	{ "update", required_argument, NULL, 'u' },
+	{ }
+};
+
+/*
+ * Whole image from a manifest: every input is mapped and hashed once, the
+ * MD5s of all entities are taken on the worker pool, and the output is
+ * written in one go with the payload files copied kernel-side.
+ */
+static int oseama_build(int argc, char **argv) {
+	struct oseama_build build = {};
+	struct fw_io_extent *ext = NULL;
+	struct fw_trace t;
+	unsigned int n_ext;
+	FILE *manifest;
+	off_t total = 0;
+	int c, fd = -1;
+	int err = 0;
+
+	fw_trace_begin(&t, "oseama_build");
+
+	if (argc < 4) {
+		fprintf(stderr, "No Seama file or manifest passed\n");
+		err = -EINVAL;
+		goto out;
+	}
+	seama_path = argv[2];
+
+	optind = 4;
+	while ((c = getopt_long(argc, argv, "u:", oseama_build_long_options, NULL)) != -1)
+		if (c == 'u')
+			update_path = optarg;
+
+	manifest = oseama_open(argv[3], "r");
+	if (!manifest) {
+		fprintf(stderr, "Couldn't open %s\n", argv[3]);
+		err = -EACCES;
+		goto out;
+	}
+	err = oseama_build_parse(manifest, &build);
+	oseama_close(manifest);
+	if (err)
+		goto out;
+
+	if (build.zeros_len) {
+		build.zeros = calloc(1, build.zeros_len);
+		if (!build.zeros) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	err = oseama_build_md5(&build);
+	if (err)
+		goto out;
+
+	ext = oseama_build_layout(&build, &n_ext, &total);
+	if (!ext) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (update_path)
+		fd = fw_io_open_update(seama_path, update_path);
+	else
+		fd = open(seama_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s\n", seama_path);
+		err = -EACCES;
+		goto out;
+	}
+
+	if (update_path)
+		err = fw_io_update_extents(fd, ext, n_ext);
+	else
+		err = fw_io_copy_extents(fd, ext, n_ext);
+	if (!err && ftruncate(fd, total))
+		err = -errno;
+	if (close(fd) && !err)
+		err = -EIO;
+	if (err)
+		fprintf(stderr, "Couldn't write %s\n", seama_path);
+
+out:
+	free(ext);
+	oseama_build_free(&build);
+	fw_trace_end(&t, total);
+	return err;
+}
+
 /**************************************************
  * Start
  **************************************************/
@@ -582,11 +1465,21 @@ static void usage() {
 	printf("\t-m meta\t\t\t\tmeta into to put in header\n");
 	printf("\t-f file\t\t\t\tappend content from file\n");
 	printf("\t-b offset\t\t\tappend zeros till reaching absolute offset\n");
+	printf("\t-u, --update file\t\tonly rewrite what differs from file, an earlier build\n");
 	printf("\n");
 	printf("Extract from Seama seal (container):\n");
 	printf("\toseama extract <file> [options]\n");
-	printf("\t-e\t\t\t\tindex of entity to extract\n");
-	printf("\t-o file\t\t\t\toutput file\n");
+	printf("\t-e\t\t\t\tindex of entity to extract, may be repeated\n");
+	printf("\t-o file\t\t\t\toutput file, one for each -e\n");
+	printf("\t-c\t\t\t\tverify the MD5 of the extracted entities\n");
+	printf("\n");
+	printf("Verify Seama seal (container):\n");
+	printf("\toseama verify <file>\n");
+	printf("\n");
+	printf("Build Seama seal or entities from a manifest:\n");
+	printf("\toseama build <file> <manifest> [options]\n");
+	printf("\t-u, --update file\t\tonly rewrite what differs from file, an earlier build\n");
+	printf("\tmanifest lines: seal, entity, meta <info>, file <path>, pad <offset>\n");
 }
 
 int main(int argc, char **argv) {
@@ -597,6 +1490,10 @@ int main(int argc, char **argv) {
 			return oseama_entity(argc, argv);
 		else if (!strcmp(argv[1], "extract"))
 			return oseama_extract(argc, argv);
+		else if (!strcmp(argv[1], "verify"))
+			return oseama_verify(argc, argv);
+		else if (!strcmp(argv[1], "build"))
+			return oseama_build(argc, argv);
 	}
 
 	usage();
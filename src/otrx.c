@@ -8,6 +8,9 @@
 #include <byteswap.h>
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,6 +18,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_pool.h"
+#include "fw_trace.h"
+
 #if !defined(__BYTE_ORDER)
 #error "Unknown byte order"
 #endif
@@ -57,6 +65,8 @@ struct otrx_ctx {
 char *trx_path;
 size_t trx_offset = 0;
 char *partition[TRX_MAX_PARTS] = {};
+bool extract_parallel = false;
+char *update_path;
 
 static inline size_t otrx_min(size_t x, size_t y) {
 	return x < y ? x : y;
@@ -66,81 +76,8 @@ static inline size_t otrx_min(size_t x, size_t y) {
  * CRC32
  **************************************************/
 
-static const uint32_t crc32_tbl[] = {
-	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
-	0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
-	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
-	0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
-	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,
-	0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
-	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
-	0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940,
-	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116,
-	0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
-	0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
-	0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a,
-	0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818,
-	0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
-	0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
-	0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c,
-	0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
-	0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
-	0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
-	0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086,
-	0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4,
-	0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
-	0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
-	0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
-	0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe,
-	0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
-	0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
-	0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252,
-	0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60,
-	0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
-	0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
-	0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04,
-	0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a,
-	0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
-	0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
-	0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e,
-	0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
-	0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
-	0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
-	0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0,
-	0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6,
-	0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
-	0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
-};
-
 uint32_t otrx_crc32(uint32_t crc, uint8_t *buf, size_t len) {
-	while (len) {
-		crc = crc32_tbl[(crc ^ *buf) & 0xff] ^ (crc >> 8);
-		buf++;
-		len--;
-	}
-
-	return crc;
+	return fw_crc32(crc, buf, len);
 }
 
 /**************************************************
@@ -176,6 +113,31 @@ static int otrx_skip(FILE *fp, size_t length)
 	return 0;
 }
 
+/*
+ * Checksum the next length bytes of fp in place by mapping them. Fails for
+ * anything that isn't a regular file holding all of the data, in which case
+ * the caller reads it the slow way.
+ */
+static int otrx_crc32_mapped(FILE *fp, uint32_t *crc, size_t length)
+{
+	struct stat st;
+	off_t offset;
+	int err;
+
+	if (fflush(fp) || fstat(fileno(fp), &st) || !S_ISREG(st.st_mode))
+		return -EINVAL;
+
+	offset = ftello(fp);
+	if (offset < 0 || (uint64_t)st.st_size < offset + (uint64_t)length)
+		return -EINVAL;
+
+	err = fw_crc32_fd(crc, fileno(fp), offset, length);
+	if (err)
+		return err;
+
+	return fseeko(fp, offset + length, SEEK_SET) ? -EIO : 0;
+}
+
 static void otrx_close(FILE *fp) {
 	if (fp != stdin)
 		fclose(fp);
@@ -302,7 +264,9 @@ static int otrx_check(int argc, char **argv) {
 	crc32 = 0xffffffff;
 	crc32 = otrx_crc32(crc32, (uint8_t *)&otrx.hdr + TRX_FLAGS_OFFSET, sizeof(otrx.hdr) - TRX_FLAGS_OFFSET);
 	length = le32_to_cpu(otrx.hdr.length) - sizeof(otrx.hdr);
-	while ((bytes = fread(buf, 1, otrx_min(sizeof(buf), length), otrx.fp)) > 0) {
+	if (!otrx_crc32_mapped(otrx.fp, &crc32, length))
+		length = 0;
+	while (length && (bytes = fread(buf, 1, otrx_min(sizeof(buf), length), otrx.fp)) > 0) {
 		crc32 = otrx_crc32(crc32, buf, bytes);
 		length -= bytes;
 	}
@@ -331,88 +295,150 @@ out:
  * Create
  **************************************************/
 
-static ssize_t otrx_create_append_file(FILE *trx, const char *in_path) {
-	FILE *in;
-	size_t bytes;
-	ssize_t length = 0;
-	uint8_t buf[1024];
+/*
+ * The image is laid out first: every input, padding and hole becomes an
+ * extent at its final offset. The extents are then written concurrently,
+ * each input checksummed on the way with a CRC register started from zero,
+ * and the registers are combined in file order. Padding is left as holes
+ * and only advances the CRC.
+ *
+ * With --update the extents are compared against an earlier build instead
+ * and only the blocks that differ are written; the CRC is assembled the
+ * same way from every input's own register.
+ */
+struct otrx_create {
+	struct fw_io_extent *ext;
+	unsigned int n;
+	size_t offset;
+};
+
+static int otrx_create_add(struct otrx_create *layout, int fd, const void *buf, size_t len) {
+	struct fw_io_extent *ext;
+
+	ext = realloc(layout->ext, (layout->n + 1) * sizeof(*ext));
+	if (!ext)
+		return -ENOMEM;
+	layout->ext = ext;
+
+	layout->ext[layout->n++] = (struct fw_io_extent) {
+		.fd = fd,
+		.buf = buf,
+		.len = len,
+		.out_off = layout->offset,
+	};
+	layout->offset += len;
 
-	in = fopen(in_path, "r");
-	if (!in) {
+	return 0;
+}
+
+static ssize_t otrx_create_append_file(struct otrx_create *layout, const char *in_path) {
+	struct stat st;
+	void *buf = NULL;
+	ssize_t length;
+	int fd;
+
+	fd = open(in_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		fprintf(stderr, "Couldn't open %s\n", in_path);
 		return -EACCES;
 	}
 
-	while ((bytes = fread(buf, 1, sizeof(buf), in)) > 0) {
-		if (fwrite(buf, 1, bytes, trx) != bytes) {
-			fprintf(stderr, "Couldn't write %zu B to %s\n", bytes, trx_path);
-			length = -EIO;
-			break;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		length = st.st_size;
+	} else {
+		/* A pipe's length is only known once it has been read */
+		length = fw_io_slurp(fd, &buf);
+		close(fd);
+		fd = -1;
+		if (length < 0) {
+			fprintf(stderr, "Couldn't read %s\n", in_path);
+			return length;
 		}
-		length += bytes;
 	}
 
-	fclose(in);
+	if (otrx_create_add(layout, fd, buf, length)) {
+		if (fd >= 0)
+			close(fd);
+		free(buf);
+		return -ENOMEM;
+	}
 
 	return length;
 }
 
-static ssize_t otrx_create_append_zeros(FILE *trx, size_t length) {
-	uint8_t *buf;
-
-	buf = malloc(length);
-	if (!buf)
+static ssize_t otrx_create_append_zeros(struct otrx_create *layout, size_t length) {
+	if (otrx_create_add(layout, -1, NULL, length))
 		return -ENOMEM;
-	memset(buf, 0, length);
-
-	if (fwrite(buf, 1, length, trx) != length) {
-		fprintf(stderr, "Couldn't write %zu B to %s\n", length, trx_path);
-		free(buf);
-		return -EIO;
-	}
-
-	free(buf);
 
 	return length;
 }
 
-static ssize_t otrx_create_align(FILE *trx, size_t curr_offset, size_t alignment) {
+static ssize_t otrx_create_align(struct otrx_create *layout, size_t curr_offset, size_t alignment) {
 	if (curr_offset & (alignment - 1)) {
 		size_t length = alignment - (curr_offset % alignment);
-		return otrx_create_append_zeros(trx, length);
+		return otrx_create_append_zeros(layout, length);
 	}
 
 	return 0;
 }
 
-static int otrx_create_write_hdr(FILE *trx, struct trx_header *hdr) {
-	size_t bytes, length;
-	uint8_t buf[1024];
+static void otrx_crc32_sink(void *priv, const void *buf, size_t len) {
+	uint32_t *crc = priv;
+
+	*crc = fw_crc32_parallel(*crc, buf, len);
+}
+
+static int otrx_create_write(int fd, struct otrx_create *layout, struct trx_header *hdr) {
+	uint32_t data_crc = 0;
+	uint32_t *crc;
 	uint32_t crc32;
+	unsigned int i;
+	int err;
 
-	hdr->version = 1;
+	crc = calloc(layout->n ?: 1, sizeof(*crc));
+	if (!crc)
+		return -ENOMEM;
 
-	fseek(trx, 0, SEEK_SET);
-	bytes = fwrite(hdr, 1, sizeof(struct trx_header), trx);
-	if (bytes != sizeof(struct trx_header)) {
-		fprintf(stderr, "Couldn't write TRX header to %s\n", trx_path);
-		return -EIO;
+	for (i = 0; i < layout->n; i++) {
+		layout->ext[i].sink = otrx_crc32_sink;
+		layout->ext[i].priv = &crc[i];
 	}
 
-	length = le32_to_cpu(hdr->length);
+	/* Sizing the file first lets trailing holes compare as zeros */
+	if (update_path && ftruncate(fd, le32_to_cpu(hdr->length))) {
+		fprintf(stderr, "Couldn't resize %s\n", trx_path);
+		free(crc);
+		return -EIO;
+	}
 
-	crc32 = 0xffffffff;
-	fseek(trx, TRX_FLAGS_OFFSET, SEEK_SET);
-	length -= TRX_FLAGS_OFFSET;
-	while ((bytes = fread(buf, 1, otrx_min(sizeof(buf), length), trx)) > 0) {
-		crc32 = otrx_crc32(crc32, buf, bytes);
-		length -= bytes;
+	if (update_path)
+		err = fw_io_update_extents(fd, layout->ext, layout->n);
+	else
+		err = fw_io_copy_extents(fd, layout->ext, layout->n);
+	if (err) {
+		fprintf(stderr, "Couldn't write data to %s\n", trx_path);
+		free(crc);
+		return err;
 	}
+
+	/* Holes have crc[i] == 0, which just shifts the register over them */
+	for (i = 0; i < layout->n; i++)
+		data_crc = fw_crc32_combine(data_crc, crc[i], layout->ext[i].len);
+	free(crc);
+
+	hdr->version = 1;
+
+	crc32 = otrx_crc32(0xffffffff, (uint8_t *)hdr + TRX_FLAGS_OFFSET,
+			   sizeof(struct trx_header) - TRX_FLAGS_OFFSET);
+	crc32 = fw_crc32_combine(crc32, data_crc, le32_to_cpu(hdr->length) - sizeof(struct trx_header));
 	hdr->crc32 = cpu_to_le32(crc32);
 
-	fseek(trx, 0, SEEK_SET);
-	bytes = fwrite(hdr, 1, sizeof(struct trx_header), trx);
-	if (bytes != sizeof(struct trx_header)) {
+	if (update_path)
+		err = fw_io_pwrite_changed(fd, hdr, sizeof(struct trx_header), 0, NULL);
+	else if (ftruncate(fd, le32_to_cpu(hdr->length)) ||
+		 pwrite(fd, hdr, sizeof(struct trx_header), 0) != sizeof(struct trx_header))
+		err = -EIO;
+	if (err) {
 		fprintf(stderr, "Couldn't write TRX header to %s\n", trx_path);
 		return -EIO;
 	}
@@ -420,17 +446,27 @@ static int otrx_create_write_hdr(FILE *trx, struct trx_header *hdr) {
 	return 0;
 }
 
+static const struct option otrx_create_long_options[] = {
+	{ "update", required_argument, NULL, 'u' },
+	{ }
+};
+
 static int otrx_create(int argc, char **argv) {
-	FILE *trx;
+	struct otrx_create layout = { .offset = sizeof(struct trx_header) };
 	struct trx_header hdr = {};
 	ssize_t sbytes;
 	size_t curr_idx = 0;
 	size_t curr_offset = sizeof(hdr);
+	struct fw_trace t;
+	unsigned int i;
 	char *e;
 	uint32_t magic;
 	int c;
+	int trx = -1;
 	int err = 0;
 
+	fw_trace_begin(&t, "otrx_create");
+
 	hdr.magic = cpu_to_le32(TRX_MAGIC);
 
 	if (argc < 3) {
@@ -440,16 +476,8 @@ static int otrx_create(int argc, char **argv) {
 	}
 	trx_path = argv[2];
 
-	trx = fopen(trx_path, "w+");
-	if (!trx) {
-		fprintf(stderr, "Couldn't open %s\n", trx_path);
-		err = -EACCES;
-		goto out;
-	}
-	fseek(trx, curr_offset, SEEK_SET);
-
 	optind = 3;
-	while ((c = getopt(argc, argv, "f:A:a:b:M:")) != -1) {
+	while ((c = getopt_long(argc, argv, "f:A:a:b:M:u:", otrx_create_long_options, NULL)) != -1) {
 		switch (c) {
 		case 'f':
 			if (curr_idx >= TRX_MAX_PARTS) {
@@ -458,7 +486,7 @@ static int otrx_create(int argc, char **argv) {
 				goto err_close;
 			}
 
-			sbytes = otrx_create_append_file(trx, optarg);
+			sbytes = otrx_create_append_file(&layout, optarg);
 			if (sbytes < 0) {
 				fprintf(stderr, "Failed to append file %s\n", optarg);
 			} else {
@@ -466,7 +494,7 @@ static int otrx_create(int argc, char **argv) {
 				curr_offset += sbytes;
 			}
 
-			sbytes = otrx_create_align(trx, curr_offset, 4);
+			sbytes = otrx_create_align(&layout, curr_offset, 4);
 			if (sbytes < 0)
 				fprintf(stderr, "Failed to append zeros\n");
 			else
@@ -474,21 +502,21 @@ static int otrx_create(int argc, char **argv) {
 
 			break;
 		case 'A':
-			sbytes = otrx_create_append_file(trx, optarg);
+			sbytes = otrx_create_append_file(&layout, optarg);
 			if (sbytes < 0) {
 				fprintf(stderr, "Failed to append file %s\n", optarg);
 			} else {
 				curr_offset += sbytes;
 			}
 
-			sbytes = otrx_create_align(trx, curr_offset, 4);
+			sbytes = otrx_create_align(&layout, curr_offset, 4);
 			if (sbytes < 0)
 				fprintf(stderr, "Failed to append zeros\n");
 			else
 				curr_offset += sbytes;
 			break;
 		case 'a':
-			sbytes = otrx_create_align(trx, curr_offset, strtol(optarg, NULL, 0));
+			sbytes = otrx_create_align(&layout, curr_offset, strtol(optarg, NULL, 0));
 			if (sbytes < 0)
 				fprintf(stderr, "Failed to append zeros\n");
 			else
@@ -499,7 +527,7 @@ static int otrx_create(int argc, char **argv) {
 			if (sbytes < 0) {
 				fprintf(stderr, "Current TRX length is 0x%zx, can't pad it with zeros to 0x%lx\n", curr_offset, strtol(optarg, NULL, 0));
 			} else {
-				sbytes = otrx_create_append_zeros(trx, sbytes);
+				sbytes = otrx_create_append_zeros(&layout, sbytes);
 				if (sbytes < 0)
 					fprintf(stderr, "Failed to append zeros\n");
 				else
@@ -514,22 +542,44 @@ static int otrx_create(int argc, char **argv) {
 			else
 				hdr.magic = cpu_to_le32(magic);
 			break;
+		case 'u':
+			update_path = optarg;
+			break;
 		}
 		if (err)
 			break;
 	}
 
-	sbytes = otrx_create_align(trx, curr_offset, 0x1000);
+	sbytes = otrx_create_align(&layout, curr_offset, 0x1000);
 	if (sbytes < 0)
 		fprintf(stderr, "Failed to append zeros\n");
 	else
 		curr_offset += sbytes;
 
 	hdr.length = curr_offset;
-	otrx_create_write_hdr(trx, &hdr);
+
+	if (update_path)
+		trx = fw_io_open_update(trx_path, update_path);
+	else
+		trx = open(trx_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (trx < 0) {
+		fprintf(stderr, "Couldn't open %s\n", trx_path);
+		err = -EACCES;
+		goto err_close;
+	}
+
+	err = otrx_create_write(trx, &layout, &hdr);
 err_close:
-	fclose(trx);
+	for (i = 0; i < layout.n; i++) {
+		if (layout.ext[i].fd >= 0)
+			close(layout.ext[i].fd);
+		free((void *)layout.ext[i].buf);
+	}
+	free(layout.ext);
+	if (trx >= 0)
+		close(trx);
 out:
+	fw_trace_end(&t, curr_offset);
 	return err;
 }
 
@@ -540,11 +590,14 @@ out:
 static void otrx_extract_parse_options(int argc, char **argv) {
 	int c;
 
-	while ((c = getopt(argc, argv, "c:e:o:1:2:3:")) != -1) {
+	while ((c = getopt(argc, argv, "c:e:o:p1:2:3:")) != -1) {
 		switch (c) {
 		case 'o':
 			trx_offset = atoi(optarg);
 			break;
+		case 'p':
+			extract_parallel = true;
+			break;
 		case '1':
 			partition[0] = optarg;
 			break;
@@ -560,8 +613,7 @@ static void otrx_extract_parse_options(int argc, char **argv) {
 
 static int otrx_extract_copy(struct otrx_ctx *otrx, size_t length, char *out_path) {
 	FILE *out;
-	size_t bytes;
-	uint8_t *buf;
+	ssize_t bytes;
 	int err = 0;
 
 	out = fopen(out_path, "w");
@@ -571,37 +623,165 @@ static int otrx_extract_copy(struct otrx_ctx *otrx, size_t length, char *out_pat
 		goto out;
 	}
 
-	buf = malloc(length);
-	if (!buf) {
-		fprintf(stderr, "Couldn't alloc %zu B buffer\n", length);
+	bytes = fw_io_copy(out, otrx->fp, length, NULL, NULL);
+	if (bytes < 0) {
+		fprintf(stderr, "Couldn't write %zu B to %s\n", length, out_path);
 		err =  -ENOMEM;
 		goto err_close;
 	}
-
-	bytes = fread(buf, 1, length, otrx->fp);
 	if (bytes != length) {
 		fprintf(stderr, "Couldn't read %zu B of data from %s\n", length, trx_path);
 		err =  -ENOMEM;
-		goto err_free_buf;
-	};
-
-	bytes = fwrite(buf, 1, length, out);
-	if (bytes != length) {
-		fprintf(stderr, "Couldn't write %zu B to %s\n", length, out_path);
-		err =  -ENOMEM;
-		goto err_free_buf;
+		goto err_close;
 	}
 
 	printf("Extracted 0x%zx bytes into %s\n", length, out_path);
 
-err_free_buf:
-	free(buf);
 err_close:
 	fclose(out);
 out:
 	return err;
 }
 
+/*
+ * One stretch of the checksummed data: the gap between the header and the
+ * first partition or a partition, copied out if it was asked for.
+ */
+struct otrx_extract_seg {
+	int in_fd;
+	int out_fd;			/* -1 if only checksummed */
+	const char *out_path;
+	off_t offset;			/* in the input file */
+	size_t length;
+	uint32_t crc;			/* from a zero register */
+	ssize_t bytes;
+	int err;
+};
+
+static void otrx_extract_seg(void *arg, unsigned int idx) {
+	struct otrx_extract_seg *seg = (struct otrx_extract_seg *)arg + idx;
+
+	seg->err = fw_crc32_fd(&seg->crc, seg->in_fd, seg->offset, seg->length);
+	if (!seg->err && seg->out_fd >= 0)
+		seg->bytes = fw_io_copy_fd(seg->out_fd, 0, seg->in_fd, seg->offset, seg->length);
+}
+
+/*
+ * Extracts all partitions at once with positioned I/O and verifies the
+ * TRX CRC on the way by combining the CRCs of the pieces. Returns 1 if
+ * the input isn't a regular file, leaving it to the sequential code.
+ */
+static int otrx_extract_parallel(struct otrx_ctx *otrx) {
+	struct otrx_extract_seg segs[TRX_MAX_PARTS + 1] = {};
+	size_t length = le32_to_cpu(otrx->hdr.length);
+	size_t pos = sizeof(otrx->hdr);
+	int fd = fileno(otrx->fp);
+	unsigned int n = 0, i;
+	struct stat st;
+	uint32_t crc32;
+	int err = 0;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return 1;
+
+	if ((uint64_t)st.st_size < trx_offset + (uint64_t)length) {
+		fprintf(stderr, "Couldn't read %zu B of data from %s\n", length, trx_path);
+		return -EIO;
+	}
+
+	for (i = 0; i <= TRX_MAX_PARTS; i++) {
+		struct otrx_part *part = i < TRX_MAX_PARTS ? &otrx->parts[i] : NULL;
+		size_t end = part && part->offset ? part->offset : length;
+
+		if (end < pos || end > length) {
+			fprintf(stderr, "Invalid partition offset 0x%zx in %s\n", end, trx_path);
+			return -EINVAL;
+		}
+		if (end > pos) {
+			segs[n].in_fd = fd;
+			segs[n].out_fd = -1;
+			segs[n].offset = trx_offset + pos;
+			segs[n].length = end - pos;
+			n++;
+		}
+		if (!part || !part->offset)
+			break;
+
+		segs[n].in_fd = fd;
+		segs[n].out_fd = -1;
+		segs[n].out_path = partition[part->idx];
+		segs[n].offset = trx_offset + part->offset;
+		segs[n].length = part->length;
+		pos = part->offset + part->length;
+		n++;
+	}
+
+	for (i = 0; i < TRX_MAX_PARTS; i++) {
+		struct otrx_part *part = &otrx->parts[i];
+
+		if (!part->offset && partition[part->idx])
+			printf("TRX doesn't contain partition %d, can't extract %s\n", part->idx + 1, partition[part->idx]);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!segs[i].out_path)
+			continue;
+
+		segs[i].out_fd = open(segs[i].out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (segs[i].out_fd < 0) {
+			fprintf(stderr, "Couldn't open %s\n", segs[i].out_path);
+			err = -EACCES;
+			goto out;
+		}
+	}
+
+	fw_pool_run(n, otrx_extract_seg, segs);
+
+	crc32 = 0xffffffff;
+	crc32 = otrx_crc32(crc32, (uint8_t *)&otrx->hdr + TRX_FLAGS_OFFSET, sizeof(otrx->hdr) - TRX_FLAGS_OFFSET);
+	for (i = 0; i < n; i++) {
+		if (segs[i].err) {
+			fprintf(stderr, "Couldn't read %zu B of data from %s\n", segs[i].length, trx_path);
+			err = -EIO;
+			goto out;
+		}
+		crc32 = fw_crc32_combine(crc32, segs[i].crc, segs[i].length);
+	}
+
+	if (crc32 != le32_to_cpu(otrx->hdr.crc32)) {
+		fprintf(stderr, "Invalid data crc32: 0x%08x instead of 0x%08x\n", crc32, le32_to_cpu(otrx->hdr.crc32));
+		err = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (segs[i].out_fd >= 0 && segs[i].bytes != segs[i].length) {
+			fprintf(stderr, "Couldn't write %zu B to %s\n", segs[i].length, segs[i].out_path);
+			err = -EIO;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		if (segs[i].out_fd >= 0)
+			printf("Extracted 0x%zx bytes into %s\n", segs[i].length, segs[i].out_path);
+
+out:
+	/*
+	 * The partitions were written while the CRC was being worked out, so
+	 * none of them may be left behind if it or anything else failed.
+	 */
+	for (i = 0; i < n; i++) {
+		if (segs[i].out_fd < 0)
+			continue;
+		close(segs[i].out_fd);
+		if (err)
+			unlink(segs[i].out_path);
+	}
+
+	return err;
+}
+
 static int otrx_extract(int argc, char **argv) {
 	struct otrx_ctx otrx = { };
 	int i;
@@ -624,6 +804,13 @@ static int otrx_extract(int argc, char **argv) {
 		goto err_out;
 	}
 
+	if (extract_parallel) {
+		err = otrx_extract_parallel(&otrx);
+		if (err <= 0)
+			goto err_close;
+		err = 0;
+	}
+
 	for (i = 0; i < TRX_MAX_PARTS; i++) {
 		struct otrx_part *part = &otrx.parts[i];
 
@@ -635,6 +822,7 @@ static int otrx_extract(int argc, char **argv) {
 			otrx_extract_copy(&otrx, part->length, partition[part->idx]);
 	}
 
+err_close:
 	otrx_close(otrx.fp);
 err_out:
 	return err;
@@ -657,10 +845,12 @@ static void usage() {
 	printf("\t-A file\t\t\t\t[partition] append current partition with content copied from file\n");
 	printf("\t-a alignment\t\t\t[partition] align current partition\n");
 	printf("\t-b offset\t\t\t[partition] append zeros to partition till reaching absolute offset\n");
+	printf("\t-u, --update file\t\tonly rewrite what differs from file, an earlier build\n");
 	printf("\n");
 	printf("Extracting from TRX file:\n");
 	printf("\totrx extract <file> [options]\textract partitions from TRX file\n");
 	printf("\t-o offset\t\t\toffset of TRX data in file (default: 0)\n");
+	printf("\t-p\t\t\t\textract all partitions at once and verify the CRC\n");
 	printf("\t-1 file\t\t\t\tfile to extract 1st partition to (optional)\n");
 	printf("\t-2 file\t\t\t\tfile to extract 2nd partition to (optional)\n");
 	printf("\t-3 file\t\t\t\tfile to extract 3rd partition to (optional)\n");
@@ -24,22 +24,9 @@
 #include <sys/stat.h>
 
 struct pc1_ctx {
-	unsigned short	ax;
-	unsigned short	bx;
-	unsigned short	cx;
-	unsigned short	dx;
-	unsigned short	si;
-	unsigned short	tmp;
-	unsigned short	x1a2;
-	unsigned short	x1a0[8];
-	unsigned short	res;
-	unsigned short	i;
-	unsigned short	inter;
-	unsigned short	cfc;
-	unsigned short	cfd;
-	unsigned short	compte;
-	unsigned char	cle[17];
-	short		c;
+	uint16_t	si;
+	uint16_t	x1a2;
+	uint16_t	key[8];		/* the 128 bit key as big endian words */
 };
 
 static void pc1_finish(struct pc1_ctx *pc1)
@@ -48,141 +35,91 @@ static void pc1_finish(struct pc1_ctx *pc1)
 	memset(pc1, 0, sizeof(struct pc1_ctx));
 }
 
-static void pc1_code(struct pc1_ctx *pc1)
-{
-	pc1->dx = pc1->x1a2 + pc1->i;
-	pc1->ax = pc1->x1a0[pc1->i];
-	pc1->cx = 0x015a;
-	pc1->bx = 0x4e35;
-
-	pc1->tmp = pc1->ax;
-	pc1->ax = pc1->si;
-	pc1->si = pc1->tmp;
-
-	pc1->tmp = pc1->ax;
-	pc1->ax = pc1->dx;
-	pc1->dx = pc1->tmp;
-
-	if (pc1->ax != 0) {
-		pc1->ax = pc1->ax * pc1->bx;
-	}
-
-	pc1->tmp = pc1->ax;
-	pc1->ax = pc1->cx;
-	pc1->cx = pc1->tmp;
-
-	if (pc1->ax != 0) {
-		pc1->ax = pc1->ax * pc1->si;
-		pc1->cx = pc1->ax + pc1->cx;
-	}
-
-	pc1->tmp = pc1->ax;
-	pc1->ax = pc1->si;
-	pc1->si = pc1->tmp;
-	pc1->ax = pc1->ax * pc1->bx;
-	pc1->dx = pc1->cx + pc1->dx;
-
-	pc1->ax = pc1->ax + 1;
-
-	pc1->x1a2 = pc1->dx;
-	pc1->x1a0[pc1->i] = pc1->ax;
-
-	pc1->res = pc1->ax ^ pc1->dx;
-	pc1->i = pc1->i + 1;
-}
-
-static void pc1_assemble(struct pc1_ctx *pc1)
+static void pc1_init(struct pc1_ctx *pc1)
 {
-	pc1->x1a0[0] = (pc1->cle[0] * 256) + pc1->cle[1];
-
-	pc1_code(pc1);
-	pc1->inter = pc1->res;
-
-	pc1->x1a0[1] = pc1->x1a0[0] ^ ((pc1->cle[2]*256) + pc1->cle[3]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
-
-	pc1->x1a0[2] = pc1->x1a0[1] ^ ((pc1->cle[4]*256) + pc1->cle[5]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
-
-	pc1->x1a0[3] = pc1->x1a0[2] ^ ((pc1->cle[6]*256) + pc1->cle[7]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
-
-	pc1->x1a0[4] = pc1->x1a0[3] ^ ((pc1->cle[8]*256) + pc1->cle[9]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
-
-	pc1->x1a0[5] = pc1->x1a0[4] ^ ((pc1->cle[10]*256) + pc1->cle[11]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
-
-	pc1->x1a0[6] = pc1->x1a0[5] ^ ((pc1->cle[12]*256) + pc1->cle[13]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
+	/* ('Remsaalps!123456') is the key used, you can change it */
+	static const unsigned char cle[16] = "Remsaalps!123456";
+	int k;
 
-	pc1->x1a0[7] = pc1->x1a0[6] ^ ((pc1->cle[14]*256) + pc1->cle[15]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
+	memset(pc1, 0, sizeof(struct pc1_ctx));
 
-	pc1->i = 0;
+	for (k = 0; k < 8; k++)
+		pc1->key[k] = (cle[2 * k] << 8) | cle[2 * k + 1];
 }
 
-static unsigned char pc1_decrypt(struct pc1_ctx *pc1, short c)
+/*
+ * One turn of the original pc1_assemble(): eight rounds of pc1_code()
+ * chained through the key words, reduced to the 16 bit arithmetic the
+ * register shuffling boils down to. Returns the keystream byte (cfc ^ cfd).
+ */
+static inline uint8_t pc1_keystream(uint16_t *si_p, uint16_t *x1a2_p,
+				    const uint16_t *key)
 {
-	pc1_assemble(pc1);
-	pc1->cfc = pc1->inter >> 8;
-	pc1->cfd = pc1->inter & 255; /* cfc^cfd = random byte */
-
-	c = c ^ (pc1->cfc ^ pc1->cfd);
-	for (pc1->compte = 0; pc1->compte <= 15; pc1->compte++) {
-		/* we mix the plaintext byte with the key */
-		pc1->cle[pc1->compte] = pc1->cle[pc1->compte] ^ c;
+	uint16_t si = *si_p, x1a2 = *x1a2_p;
+	uint16_t v, ax = 0, dx, inter = 0;
+	int k;
+
+	for (k = 0; k < 8; k++) {
+		v = k ? ax ^ key[k] : key[0];
+		dx = 0x015a * v + (uint16_t)(x1a2 + k) * 0x4e35 + si;
+		si = 0x015a * v;
+		ax = v * 0x4e35 + 1;
+		x1a2 = dx;
+		inter ^= ax ^ dx;
 	}
 
-	return c;
-}
-
-static unsigned char pc1_encrypt(struct pc1_ctx *pc1, short c)
-{
-	pc1_assemble(pc1);
-	pc1->cfc = pc1->inter >> 8;
-	pc1->cfd = pc1->inter & 255; /* cfc^cfd = random byte */
-
-	for (pc1->compte = 0; pc1->compte <= 15; pc1->compte++) {
-		/* we mix the plaintext byte with the key */
-		pc1->cle[pc1->compte] = pc1->cle[pc1->compte] ^ c;
-	}
-	c = c ^ (pc1->cfc ^ pc1->cfd);
+	*si_p = si;
+	*x1a2_p = x1a2;
 
-	return c;
+	return (inter >> 8) ^ inter;
 }
 
-static void pc1_init(struct pc1_ctx *pc1)
+/* every key byte is mixed with the plaintext byte */
+static inline void pc1_mix(uint16_t *key, uint8_t c)
 {
-	memset(pc1, 0, sizeof(struct pc1_ctx));
+	uint16_t m = c * 0x0101;
+	int k;
 
-	/* ('Remsaalps!123456') is the key used, you can change it */
-	strcpy(pc1->cle, "Remsaalps!123456");
+	for (k = 0; k < 8; k++)
+		key[k] ^= m;
 }
 
 static void pc1_decrypt_buf(struct pc1_ctx *pc1, unsigned char *buf,
 			    unsigned len)
 {
+	uint16_t si = pc1->si, x1a2 = pc1->x1a2, key[8];
 	unsigned i;
 
-	for (i = 0; i < len; i++)
-		buf[i] = pc1_decrypt(pc1, buf[i]);
+	memcpy(key, pc1->key, sizeof(key));
+
+	for (i = 0; i < len; i++) {
+		buf[i] ^= pc1_keystream(&si, &x1a2, key);
+		pc1_mix(key, buf[i]);
+	}
+
+	pc1->si = si;
+	pc1->x1a2 = x1a2;
+	memcpy(pc1->key, key, sizeof(key));
 }
 
 static void pc1_encrypt_buf(struct pc1_ctx *pc1, unsigned char *buf,
 			    unsigned len)
 {
+	uint16_t si = pc1->si, x1a2 = pc1->x1a2, key[8];
 	unsigned i;
 
-	for (i = 0; i < len; i++)
-		buf[i] = pc1_encrypt(pc1, buf[i]);
+	memcpy(key, pc1->key, sizeof(key));
+
+	for (i = 0; i < len; i++) {
+		uint8_t ks = pc1_keystream(&si, &x1a2, key);
+
+		pc1_mix(key, buf[i]);
+		buf[i] ^= ks;
+	}
+
+	pc1->si = si;
+	pc1->x1a2 = x1a2;
+	memcpy(pc1->key, key, sizeof(key));
 }
 
 /*
@@ -226,7 +163,7 @@ void usage(int status)
 	exit(status);
 }
 
-#define BUFSIZE		(64 * 1024)
+#define BUFSIZE		(1024 * 1024)
 
 int main(int argc, char *argv[])
 {
@@ -234,7 +171,7 @@ int main(int argc, char *argv[])
 	int res = EXIT_FAILURE;
 	int err;
 	struct stat st;
-	char *buf;
+	unsigned char *buf;
 	unsigned total;
 
 	FILE *outfile, *infile;
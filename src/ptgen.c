@@ -23,7 +23,9 @@
 #include <inttypes.h>
 #include <fcntl.h>
 #include <stdint.h>
-#include "cyg_crc.h"
+#include <sys/uio.h>
+#include "fw_crc32.h"
+#include "fw_io.h"
 
 #if __BYTE_ORDER == __BIG_ENDIAN
 #define cpu_to_le16(x) bswap_16(x)
@@ -93,8 +95,9 @@ typedef struct {
 #define GPT_HEADER_SIZE         92
 #define GPT_ENTRY_SIZE          128
 #define GPT_ENTRY_MAX           128
+#define GPT_ENTRY_LIMIT         4096
 #define GPT_ENTRY_NAME_SIZE     72
-#define GPT_SIZE		GPT_ENTRY_SIZE * GPT_ENTRY_MAX / DISK_SECTOR_SIZE
+#define GPT_SIZE		(GPT_ENTRY_SIZE * gpt_entries / DISK_SECTOR_SIZE)
 
 #define GPT_ATTR_PLAT_REQUIRED  BIT(0)
 #define GPT_ATTR_EFI_IGNORE     BIT(1)
@@ -131,6 +134,7 @@ struct partinfo {
 	bool has_guid;
 	guid_t guid;
 	uint64_t gattr;  /* GPT partition attributes */
+	char *payload;   /* file to copy into the partition */
 };
 
 /* GPT Partition table header */
@@ -169,7 +173,16 @@ int sectors = -1;
 int kb_align = 0;
 bool ignore_null_sized_partition = false;
 bool use_guid_partition_table = false;
-struct partinfo parts[GPT_ENTRY_MAX];
+bool disk_image = false;
+/* GPT entry array size: GPT_ENTRY_MAX, or more with -e for A/B layouts */
+unsigned gpt_entries = GPT_ENTRY_MAX;
+
+#ifdef WANT_ALTERNATE_PTABLE
+#define want_alternate_ptable	true
+#else
+#define want_alternate_ptable	disk_image
+#endif
+struct partinfo parts[GPT_ENTRY_LIMIT];
 char *filename = NULL;
 
 
@@ -243,7 +256,7 @@ static inline unsigned long round_to_kb(long sect) {
 /* Compute a CRC for guid partition table */
 static inline unsigned long gpt_crc32(void *buf, unsigned long len)
 {
-	return cyg_crc32_accumulate(~0L, buf, len) ^ ~0L;
+	return fw_crc32_parallel(~0U, buf, len) ^ ~0U;
 }
 
 /* Parse a guid string to guid_t struct */
@@ -323,6 +336,52 @@ static inline void init_utf16(char *str, uint16_t *buf, unsigned bufsize)
 	}
 }
 
+/*
+ * Make the output a whole disk of sectors: everything not written stays a
+ * hole, and the payloads are copied into their partitions by the kernel.
+ */
+static int write_disk_image(int fd, uint64_t sectors, unsigned nr)
+{
+	struct stat st;
+	ssize_t bytes;
+	unsigned i;
+	int in;
+
+	if (ftruncate(fd, sectors * DISK_SECTOR_SIZE)) {
+		fputs("truncate failed.\n", stderr);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (!parts[i].payload)
+			continue;
+
+		if ((in = open(parts[i].payload, O_RDONLY)) < 0 || fstat(in, &st)) {
+			fprintf(stderr, "Can't open payload '%s'\n", parts[i].payload);
+			if (in >= 0)
+				close(in);
+			return -1;
+		}
+
+		if (!parts[i].size || (uint64_t)st.st_size > (uint64_t)parts[i].size * 1024) {
+			fprintf(stderr, "Payload '%s' does not fit into partition %d!\n",
+				parts[i].payload, i);
+			close(in);
+			return -1;
+		}
+
+		bytes = fw_io_copy_fd(fd, (off_t)parts[i].actual_start * DISK_SECTOR_SIZE,
+				      in, 0, st.st_size);
+		close(in);
+		if (bytes != st.st_size) {
+			fputs("write failed.\n", stderr);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 /* check the partition sizes and write the partition table */
 static int gen_ptable(uint32_t signature, int nr)
 {
@@ -353,6 +412,7 @@ static int gen_ptable(uint32_t signature, int nr)
 		} else if (kb_align != 0) {
 			start = round_to_kb(start);
 		}
+		parts[i].actual_start = start;
 		pte[i].start = cpu_to_le32(start);
 
 		sect = start + parts[i].size * 2;
@@ -395,6 +455,9 @@ static int gen_ptable(uint32_t signature, int nr)
 		goto fail;
 	}
 
+	if (disk_image && write_disk_image(fd, sect, nr))
+		goto fail;
+
 	ret = 0;
 fail:
 	close(fd);
@@ -410,33 +473,48 @@ static int gen_gptable(uint32_t signature, guid_t guid, unsigned nr)
 		.revision = cpu_to_le32(GPT_REVISION),
 		.size = cpu_to_le32(GPT_HEADER_SIZE),
 		.self = cpu_to_le64(GPT_HEADER_SECTOR),
-		.first_usable = cpu_to_le64(GPT_FIRST_ENTRY_SECTOR + GPT_ENTRY_SIZE * GPT_ENTRY_MAX / DISK_SECTOR_SIZE),
+		.first_usable = cpu_to_le64(GPT_FIRST_ENTRY_SECTOR + GPT_SIZE),
 		.first_entry = cpu_to_le64(GPT_FIRST_ENTRY_SECTOR),
 		.disk_guid = guid,
-		.entry_num = cpu_to_le32(GPT_ENTRY_MAX),
+		.entry_num = cpu_to_le32(gpt_entries),
 		.entry_size = cpu_to_le32(GPT_ENTRY_SIZE),
 	};
-	struct gpte  gpte[GPT_ENTRY_MAX];
+	/* the rest of the sectors the MBR and the GPT header are written in */
+	static const uint8_t zero[DISK_SECTOR_SIZE - GPT_HEADER_SIZE];
+	struct gpte *gpte;
+	struct iovec iov[4];
+	size_t gpte_len = GPT_ENTRY_SIZE * gpt_entries;
+	uint8_t mbr[DISK_SECTOR_SIZE] = {};
 	uint64_t start, end;
 	uint64_t sect = GPT_SIZE + GPT_FIRST_ENTRY_SECTOR;
 	int fd, ret = -1;
 	unsigned i, pmbr = 1;
 
+	if (nr > gpt_entries) {
+		fputs("Too many partitions\n", stderr);
+		return ret;
+	}
+
+	gpte = calloc(gpt_entries, GPT_ENTRY_SIZE);
+	if (!gpte) {
+		fputs("Out of memory\n", stderr);
+		return ret;
+	}
+
 	memset(pte, 0, sizeof(struct pte) * MBR_ENTRY_MAX);
-	memset(gpte, 0, GPT_ENTRY_SIZE * GPT_ENTRY_MAX);
 	for (i = 0; i < nr; i++) {
 		if (!parts[i].size) {
 			if (ignore_null_sized_partition)
 				continue;
 			fprintf(stderr, "Invalid size in partition %d!\n", i);
-			return ret;
+			goto out;
 		}
 		start = sect;
 		if (parts[i].start != 0) {
 			if (parts[i].start * 2 < start) {
 				fprintf(stderr, "Invalid start %ld for partition %d!\n",
 					parts[i].start, i);
-				return ret;
+				goto out;
 			}
 			start = parts[i].start * 2;
 		} else if (kb_align != 0) {
@@ -481,11 +559,11 @@ static int gen_gptable(uint32_t signature, guid_t guid, unsigned nr)
 	}
 
 	if (parts[0].actual_start > GPT_FIRST_ENTRY_SECTOR + GPT_SIZE) {
-		gpte[GPT_ENTRY_MAX - 1].start = cpu_to_le64(GPT_FIRST_ENTRY_SECTOR + GPT_SIZE);
-		gpte[GPT_ENTRY_MAX - 1].end = cpu_to_le64(parts[0].actual_start - 1);
-		gpte[GPT_ENTRY_MAX - 1].type = GUID_PARTITION_BIOS_BOOT;
-		gpte[GPT_ENTRY_MAX - 1].guid = guid;
-		gpte[GPT_ENTRY_MAX - 1].guid.b[sizeof(guid_t) -1] += GPT_ENTRY_MAX;
+		gpte[gpt_entries - 1].start = cpu_to_le64(GPT_FIRST_ENTRY_SECTOR + GPT_SIZE);
+		gpte[gpt_entries - 1].end = cpu_to_le64(parts[0].actual_start - 1);
+		gpte[gpt_entries - 1].type = GUID_PARTITION_BIOS_BOOT;
+		gpte[gpt_entries - 1].guid = guid;
+		gpte[gpt_entries - 1].guid.b[sizeof(guid_t) -1] += gpt_entries;
 	}
 
 	end = sect + GPT_SIZE;
@@ -498,79 +576,64 @@ static int gen_gptable(uint32_t signature, guid_t guid, unsigned nr)
 
 	gpth.last_usable = cpu_to_le64(end - GPT_SIZE - 1);
 	gpth.alternate = cpu_to_le64(end);
-	gpth.entry_crc32 = cpu_to_le32(gpt_crc32(gpte, GPT_ENTRY_SIZE * GPT_ENTRY_MAX));
+	gpth.entry_crc32 = cpu_to_le32(gpt_crc32(gpte, gpte_len));
 	gpth.crc32 = cpu_to_le32(gpt_crc32((char *)&gpth, GPT_HEADER_SIZE));
 
+	memcpy(mbr + MBR_DISK_SIGNATURE_OFFSET, &signature, sizeof(signature));
+	memcpy(mbr + MBR_PARTITION_ENTRY_OFFSET, pte, sizeof(struct pte) * MBR_ENTRY_MAX);
+	memcpy(mbr + MBR_BOOT_SIGNATURE_OFFSET, "\x55\xaa", 2);
+
 	if ((fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
 		fprintf(stderr, "Can't open output file '%s'\n",filename);
-		return ret;
-	}
-
-	lseek(fd, MBR_DISK_SIGNATURE_OFFSET, SEEK_SET);
-	if (write(fd, &signature, sizeof(signature)) != sizeof(signature)) {
-		fputs("write failed.\n", stderr);
-		goto fail;
-	}
-
-	lseek(fd, MBR_PARTITION_ENTRY_OFFSET, SEEK_SET);
-	if (write(fd, pte, sizeof(struct pte) * MBR_ENTRY_MAX) != sizeof(struct pte) * MBR_ENTRY_MAX) {
-		fputs("write failed.\n", stderr);
-		goto fail;
-	}
-
-	lseek(fd, MBR_BOOT_SIGNATURE_OFFSET, SEEK_SET);
-	if (write(fd, "\x55\xaa", 2) != 2) {
-		fputs("write failed.\n", stderr);
-		goto fail;
+		goto out;
 	}
 
-	if (write(fd, &gpth, GPT_HEADER_SIZE) != GPT_HEADER_SIZE) {
+	/* Protective MBR, GPT header and entries are one contiguous write */
+	iov[0] = (struct iovec){ mbr, sizeof(mbr) };
+	iov[1] = (struct iovec){ &gpth, GPT_HEADER_SIZE };
+	iov[2] = (struct iovec){ (void *)zero, sizeof(zero) };
+	iov[3] = (struct iovec){ gpte, gpte_len };
+	if (pwritev(fd, iov, 4, 0) != (ssize_t)(GPT_FIRST_ENTRY_SECTOR * DISK_SECTOR_SIZE + gpte_len)) {
 		fputs("write failed.\n", stderr);
 		goto fail;
 	}
 
-	lseek(fd, GPT_FIRST_ENTRY_SECTOR * DISK_SECTOR_SIZE, SEEK_SET);
-	if (write(fd, &gpte, GPT_ENTRY_SIZE * GPT_ENTRY_MAX) != GPT_ENTRY_SIZE * GPT_ENTRY_MAX) {
-		fputs("write failed.\n", stderr);
-		goto fail;
+	/* The alternate partition table (omitted unless the whole disk is built) */
+	if (want_alternate_ptable) {
+		swap(gpth.self, gpth.alternate);
+		gpth.first_entry = cpu_to_le64(end - GPT_SIZE);
+		gpth.crc32 = 0;
+		gpth.crc32 = cpu_to_le32(gpt_crc32(&gpth, GPT_HEADER_SIZE));
+
+		/* Entries followed by the header in the last sector */
+		iov[0] = (struct iovec){ gpte, gpte_len };
+		iov[1] = (struct iovec){ &gpth, GPT_HEADER_SIZE };
+		iov[2] = (struct iovec){ (void *)zero, sizeof(zero) };
+		if (pwritev(fd, iov, 3, end * DISK_SECTOR_SIZE - gpte_len) !=
+		    (ssize_t)(gpte_len + DISK_SECTOR_SIZE)) {
+			fputs("write failed.\n", stderr);
+			goto fail;
+		}
 	}
 
-#ifdef WANT_ALTERNATE_PTABLE
-	/* The alternate partition table (We omit it by default) */
-	swap(gpth.self, gpth.alternate);
-	gpth.first_entry = cpu_to_le64(end - GPT_ENTRY_SIZE * GPT_ENTRY_MAX / DISK_SECTOR_SIZE),
-	gpth.crc32 = 0;
-	gpth.crc32 = cpu_to_le32(gpt_crc32(&gpth, GPT_HEADER_SIZE));
-
-	lseek(fd, end * DISK_SECTOR_SIZE - GPT_ENTRY_SIZE * GPT_ENTRY_MAX, SEEK_SET);
-	if (write(fd, &gpte, GPT_ENTRY_SIZE * GPT_ENTRY_MAX) != GPT_ENTRY_SIZE * GPT_ENTRY_MAX) {
-		fputs("write failed.\n", stderr);
+	if (disk_image && write_disk_image(fd, end + 1, nr))
 		goto fail;
-	}
-
-	lseek(fd, end * DISK_SECTOR_SIZE, SEEK_SET);
-	if (write(fd, &gpth, GPT_HEADER_SIZE) != GPT_HEADER_SIZE) {
-		fputs("write failed.\n", stderr);
-		goto fail;
-	}
-	lseek(fd, (end + 1) * DISK_SECTOR_SIZE -1, SEEK_SET);
-	if (write(fd, "\x00", 1) != 1) {
-		fputs("write failed.\n", stderr);
-		goto fail;
-	}
-#endif
 
 	ret = 0;
 fail:
 	close(fd);
+out:
+	free(gpte);
 	return ret;
 }
 
 static void usage(char *prog)
 {
 	fprintf(stderr, "Usage: %s [-v] [-n] [-g] -h <heads> -s <sectors> -o <outputfile>\n"
-			"          [-a 0..4] [-l <align kB>] [-G <guid>]\n"
-			"          [[-t <type> | -T <GPT part type>] [-r] [-N <name>] -p <size>[@<start>]...] \n", prog);
+			"          [-a 0..4] [-l <align kB>] [-G <guid>] [-e <GPT entries>]\n"
+			"          [-D] [[-t <type> | -T <GPT part type>] [-r] [-N <name>] [-f <file>] -p <size>[@<start>]...] \n"
+			"  -D         write the whole disk image (sparse), with -f payloads in place\n"
+			"  -e         size of the GPT entry array (default %d)\n", prog, GPT_ENTRY_MAX);
 	exit(EXIT_FAILURE);
 }
 
@@ -601,13 +664,13 @@ int main (int argc, char **argv)
 	char *p;
 	int ch;
 	int part = 0;
-	char *name = NULL;
+	char *name = NULL, *payload = NULL;
 	unsigned short int hybrid = 0, required = 0;
 	uint32_t signature = 0x5452574F; /* 'OWRT' */
 	guid_t guid = GUID_INIT( signature, 0x2211, 0x4433, \
 			0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0x00);
 
-	while ((ch = getopt(argc, argv, "h:s:p:a:t:T:o:vnHN:gl:rS:G:")) != -1) {
+	while ((ch = getopt(argc, argv, "h:s:p:a:t:T:o:vnHN:gl:rS:G:Df:e:")) != -1) {
 		switch (ch) {
 		case 'o':
 			filename = optarg;
@@ -631,7 +694,7 @@ int main (int argc, char **argv)
 			sectors = (int)strtoul(optarg, NULL, 0);
 			break;
 		case 'p':
-			if (part > GPT_ENTRY_MAX - 1 || (!use_guid_partition_table && part > 3)) {
+			if (part > GPT_ENTRY_LIMIT - 1 || (!use_guid_partition_table && part > 3)) {
 				fputs("Too many partitions\n", stderr);
 				exit(EXIT_FAILURE);
 			}
@@ -647,16 +710,25 @@ int main (int argc, char **argv)
 			parts[part].required = required;
 			parts[part].name = name;
 			parts[part].hybrid = hybrid;
+			parts[part].payload = payload;
 			fprintf(stderr, "part %ld %ld\n", parts[part].start, parts[part].size);
 			parts[part++].type = type;
 			/*
-			 * reset 'name','required' and 'hybrid'
+			 * reset 'name', 'payload', 'required' and 'hybrid'
 			 * 'type' is deliberately inherited from the previous delcaration
 			 */
 			name = NULL;
+			payload = NULL;
 			required = 0;
 			hybrid = 0;
 			break;
+		case 'D':
+			disk_image = true;
+			break;
+		case 'f':
+			payload = optarg;
+			disk_image = true;
+			break;
 		case 'N':
 			name = optarg;
 			break;
@@ -685,6 +757,16 @@ int main (int argc, char **argv)
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'e':
+			gpt_entries = strtoul(optarg, NULL, 0);
+			/* Whole sectors of entries, at least the 16 KiB UEFI asks for */
+			if (gpt_entries < GPT_ENTRY_MAX || gpt_entries > GPT_ENTRY_LIMIT ||
+			    gpt_entries % (DISK_SECTOR_SIZE / GPT_ENTRY_SIZE)) {
+				fprintf(stderr, "Invalid number of GPT entries, must be a multiple of %d from %d to %d\n",
+					DISK_SECTOR_SIZE / GPT_ENTRY_SIZE, GPT_ENTRY_MAX, GPT_ENTRY_LIMIT);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'G':
 			if (guid_parse(optarg, &guid)) {
 				fputs("Invalid guid string\n", stderr);
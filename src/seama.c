@@ -14,10 +14,14 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <arpa/inet.h>
 
+#include "fw_dcache.h"
+#include "fw_io.h"
+#include "fw_pool.h"
 #include "md5.h"
 #include "seama.h"
 
@@ -109,58 +113,68 @@ static int parse_args(int argc, char * argv[])
 
 /*******************************************************************/
 
-static size_t calculate_digest(FILE * fh, size_t size, uint8_t * digest)
+static void seama_md5_sink(void * priv, const void * buf, size_t len)
 {
-	MD5_CTX ctx;
-	size_t bytes_left, bytes_read, i;
-	uint8_t buf[MAX_SEAMA_META_SIZE];
+	MD5_Update(priv, buf, len);
+}
 
-	bytes_left = size ? size : sizeof(buf);
-	bytes_read = 0;
+static void calculate_digest(const uint8_t * data, size_t size, uint8_t * digest)
+{
+	MD5_CTX ctx;
 
 	MD5_Init(&ctx);
-	while (!feof(fh) && !ferror(fh) && bytes_left > 0)
-	{
-		i = bytes_left < sizeof(buf) ? bytes_left : sizeof(buf);
-		i = fread(buf, sizeof(char), i, fh);
-		if (i > 0)
-		{
-			MD5_Update(&ctx, buf, i);
-			bytes_read += i;
-		}
-		if (size) bytes_left -= i;
-	}
+	if (size) seama_md5_sink(&ctx, data, size);
 	MD5_Final(digest, &ctx);
-	return bytes_read;
 }
 
-#define READ_BUFF_SIZE 8*1024
-static size_t copy_file(FILE * to, FILE * from)
+/* An entity located by the header walk of verify_seama() */
+struct seama_entity
+{
+	size_t		isize;		/* as in the header */
+	size_t		msize;
+	size_t		meta;		/* offset of the META data */
+	size_t		pos;		/* offset of the image */
+	size_t		len;		/* of the image, as far as the file goes */
+	uint8_t		checksum[16];
+	uint8_t		digest[16];
+};
+
+struct seama_verify
+{
+	int						fd;
+	const uint8_t *			data;
+	struct seama_entity *	entities;
+};
+
+static void seama_digest_job(void * arg, unsigned int idx)
 {
-	size_t i, fsize = 0;
-	uint8_t buf[READ_BUFF_SIZE];
+	struct seama_verify * v = arg;
+	struct seama_entity * e = &v->entities[idx];
 
-	while (!feof(from) && !ferror(from))
+	if (!e->isize) return;
+	if (!fw_dcache_get(v->fd, e->pos, e->len, FW_DCACHE_MD5, e->digest, sizeof(e->digest)))
 	{
-		i = fread(buf, sizeof(uint8_t), READ_BUFF_SIZE, from);
-		if (i > 0)
-		{
-			fsize += i;
-			fwrite(buf, sizeof(uint8_t), i, to);
-		}
+		calculate_digest(v->data + e->pos, e->len, e->digest);
+		fw_dcache_put(v->fd, e->pos, e->len, FW_DCACHE_MD5, e->digest, sizeof(e->digest));
 	}
-	return fsize;
 }
 
+/*
+ * The headers are walked first, then every entity is checksummed on its own
+ * thread straight out of the mapping, and the results are reported in file
+ * order just like a sequential walk would have.
+ */
 static int verify_seama(const char * fname, int msg)
 {
-	FILE * fh = NULL;
+	struct fw_io_map map = {};
 	struct stat st;
 	seamahdr_t shdr;
-	uint8_t checksum[16];
-	uint8_t digest[16];
+	struct seama_verify v = {};
+	struct seama_entity * e;
+	const char * stop = NULL;
 	uint8_t buf[MAX_SEAMA_META_SIZE];
-	size_t msize, isize, i;
+	size_t msize, isize, i, n = 0, alloc = 0, pos = 0;
+	int fd = -1;
 	int ret = -1;
 
 #define ERRBREAK(fmt, args...) { if (msg) printf(fmt, ##args); break; }
@@ -168,19 +182,32 @@ static int verify_seama(const char * fname, int msg)
 	do
 	{
 		if (stat(fname, &st) < 0)				ERRBREAK("Unable to get the info of '%s'\n",fname);
-		if ((fh = fopen(fname, "r+"))==NULL)	ERRBREAK("Unable to open '%s' for reading!\n",fname);
+		if ((fd = open(fname, O_RDONLY)) < 0)	ERRBREAK("Unable to open '%s' for reading!\n",fname);
+		if (fw_io_map(&map, fd, 0, st.st_size) < 0)
+			ERRBREAK("Unable to map '%s'!\n",fname);
 
 		/* Dump SEAMA header */
 		if (msg) printf("FILE - %s (%d bytes)\n", fname, (int)st.st_size);
 
-		/* SEAMA */
-		while (!feof(fh) && !ferror(fh))
+		/* SEAMA, walked straight out of the mapping */
+		while (pos < map.len)
 		{
 			/* read header */
-			if (fread(&shdr, sizeof(shdr), 1, fh) != 1) break;
+			if (map.len - pos < sizeof(shdr)) break;
+			memcpy(&shdr, map.data + pos, sizeof(shdr));
+			pos += sizeof(shdr);
 
 			/* Check the magic number */
-			if (shdr.magic != htonl(SEAMA_MAGIC)) ERRBREAK("Invalid SEAMA magic. Probably no more SEAMA!\n");
+			if (shdr.magic != htonl(SEAMA_MAGIC)) { stop = "Invalid SEAMA magic. Probably no more SEAMA!\n"; break; }
+
+			if (n == alloc)
+			{
+				alloc = alloc ? 2 * alloc : 8;
+				e = realloc(v.entities, alloc * sizeof(*e));
+				if (!e) { stop = "Out of memory!\n"; break; }
+				v.entities = e;
+			}
+			e = &v.entities[n];
 
 			/* Get the size */
 			isize = ntohl(shdr.size);
@@ -189,60 +216,74 @@ static int verify_seama(const char * fname, int msg)
 			/* The checksum exist only if size is greater than zero. */
 			if (isize > 0)
 			{
-				if (fread(checksum, sizeof(checksum), 1, fh) != 1)
-					ERRBREAK("Error reading checksum !\n");
+				if (map.len - pos < sizeof(e->checksum)) { stop = "Error reading checksum !\n"; break; }
+				memcpy(e->checksum, map.data + pos, sizeof(e->checksum));
+				pos += sizeof(e->checksum);
 			}
 
 			/* Check the META size. */
-			if (msize > sizeof(buf)) ERRBREAK("META data in SEAMA header is too large!\n");
+			if (msize > sizeof(buf)) { stop = "META data in SEAMA header is too large!\n"; break; }
 
 			/* Read META data. */
-			if (fread(buf, sizeof(char), msize, fh) != msize)
-				ERRBREAK("Unable to read SEAMA META data!\n");
+			if (map.len - pos < msize) { stop = "Unable to read SEAMA META data!\n"; break; }
+			e->meta = pos;
+			pos += msize;
+
+			/* The checksum covers whatever is left of the image */
+			e->isize = isize;
+			e->msize = msize;
+			e->pos = pos;
+			e->len = isize > map.len - pos ? map.len - pos : isize;
+			pos += e->len;
+			n++;
+		}
+
+		v.fd = fd;
+		v.data = map.data;
+		fw_pool_run(n, seama_digest_job, &v);
 
+		for (e = v.entities; e < v.entities + n; e++)
+		{
 			/* dump header */
 			if (msg)
 			{
+				memcpy(buf, map.data + e->meta, e->msize);
 				printf("SEAMA ==========================================\n");
-				printf("  magic      : %08x\n", ntohl(shdr.magic));
-				printf("  meta size  : %zu bytes\n", msize);
-				for (i=0; i<msize; i+=(strlen((const char *)&buf[i])+1))
+				printf("  magic      : %08x\n", SEAMA_MAGIC);
+				printf("  meta size  : %zu bytes\n", e->msize);
+				for (i=0; i<e->msize; i+=(strlen((const char *)&buf[i])+1))
 					printf("  meta data  : %s\n", &buf[i]);
-				printf("  image size : %zu bytes\n", isize);
+				printf("  image size : %zu bytes\n", e->isize);
 			}
 
 			/* verify checksum */
-			if (isize > 0)
+			if (e->isize > 0)
 			{
 				if (msg)
 				{
 					printf("  checksum   : ");
-					for (i=0; i<16; i++) printf("%02X", checksum[i]);
+					for (i=0; i<16; i++) printf("%02X", e->checksum[i]);
 					printf("\n");
-				}
-
-				/* Calculate the checksum */
-				calculate_digest(fh, isize, digest);
-				if (msg)
-				{
 					printf("  digest     : ");
-					for (i=0; i<16; i++) printf("%02X", digest[i]);
+					for (i=0; i<16; i++) printf("%02X", e->digest[i]);
 					printf("\n");
 				}
 
-				if (memcmp(checksum, digest, 16)!=0) ERRBREAK("!!ERROR!! checksum error !!\n");
+				if (memcmp(e->checksum, e->digest, 16)!=0) ERRBREAK("!!ERROR!! checksum error !!\n");
 				ret = 0;
 			}
 		}
+		if (e == v.entities + n && stop && msg) printf("%s", stop);
 		if (msg) printf("================================================\n");
 	} while (0);
-	if (fh) fclose(fh);
+	free(v.entities);
+	fw_io_unmap(&map);
+	if (fd >= 0) close(fd);
 	return ret;
 }
 
-static size_t write_seama_header(FILE * fh, char * meta[], size_t msize, size_t size)
+static void fill_seama_header(seamahdr_t * shdr, char * meta[], size_t msize, size_t size)
 {
-	seamahdr_t shdr;
 	size_t i;
 	uint16_t metasize = 0;
 
@@ -250,13 +291,20 @@ static size_t write_seama_header(FILE * fh, char * meta[], size_t msize, size_t
 	for (i=0; i<msize; i++) metasize += (strlen(meta[i]) + 1);
 	//+++ let meta data end on 4 alignment by siyou. 2010/3/1 03:58pm
 	metasize = ((metasize+3)/4)*4;
-	verbose("SEAMA META : %d bytes\n", metasize);
 
 	/* Fill up the header, all the data endian should be network byte order. */
-	shdr.magic		= htonl(SEAMA_MAGIC);
-	shdr.reserved	= 0;
-	shdr.metasize	= htons(metasize);
-	shdr.size		= htonl(size);
+	shdr->magic		= htonl(SEAMA_MAGIC);
+	shdr->reserved	= 0;
+	shdr->metasize	= htons(metasize);
+	shdr->size		= htonl(size);
+}
+
+static size_t write_seama_header(FILE * fh, char * meta[], size_t msize, size_t size)
+{
+	seamahdr_t shdr;
+
+	fill_seama_header(&shdr, meta, msize, size);
+	verbose("SEAMA META : %d bytes\n", ntohs(shdr.metasize));
 
 	/* Write the header */
 	return fwrite(&shdr, sizeof(seamahdr_t), 1, fh);
@@ -321,10 +369,11 @@ static void seal_files(const char * file)
 		/* Write image files */
 		for (i=0; i<o_isize; i++)
 		{
-			ifh = fopen(o_images[i], "r+");
+			ifh = fopen(o_images[i], "r");
 			if (ifh)
 			{
-				copy_file(fh, ifh);
+				if (fw_io_copy(fh, ifh, FW_IO_ALL, NULL, NULL) < 0)
+					printf("Unable to copy '%s' to '%s'\n", o_images[i], file);
 				fclose(ifh);
 			}
 		}
@@ -337,29 +386,57 @@ static void pack_files(void)
 {
 	FILE * fh;
 	FILE * ifh;
-	size_t i, fsize;
+	size_t i;
+	ssize_t fsize;
 	char filename[512];
-	uint8_t digest[16];
+	uint8_t digest[16] = {};
+	seamahdr_t shdr;
+	MD5_CTX ctx;
 
 	for (i=0; i<o_isize; i++)
 	{
 		/* Open the input file. */
-		ifh = fopen(o_images[i], "r+");
+		ifh = fopen(o_images[i], "r");
 		if (ifh)
 		{
-			fsize = calculate_digest(ifh, 0, digest);
-			verbose("file size (%s) : %d\n", o_images[i], fsize);
-			rewind(ifh);
-
 			/* Open the output file. */
 			sprintf(filename, "%s.seama", o_images[i]);
 			fh = fopen(filename, "w+");
 			if (fh)
 			{
-				write_seama_header(fh, o_meta, o_msize, fsize);
+				/*
+				 * Write a placeholder header, hash the image while it is
+				 * copied and patch size and checksum in afterwards, so the
+				 * input is only read once.
+				 */
+				write_seama_header(fh, o_meta, o_msize, 0);
 				write_checksum(fh, digest);
 				write_meta_data(fh, o_meta, o_msize);
-				copy_file(fh, ifh);
+
+				MD5_Init(&ctx);
+				fsize = fw_io_copy(fh, ifh, FW_IO_ALL, seama_md5_sink, &ctx);
+				MD5_Final(digest, &ctx);
+
+				if (fsize < 0 || fflush(fh))
+				{
+					printf("Unable to write '%s'\n", filename);
+					fclose(fh);
+					unlink(filename);
+					fclose(ifh);
+					continue;
+				}
+				verbose("file size (%s) : %zd\n", o_images[i], fsize);
+
+				fill_seama_header(&shdr, o_meta, o_msize, fsize);
+				if (pwrite(fileno(fh), &shdr, sizeof(shdr), 0) != sizeof(shdr) ||
+				    pwrite(fileno(fh), digest, sizeof(digest), sizeof(shdr)) != sizeof(digest))
+				{
+					printf("Unable to write '%s'\n", filename);
+					fclose(fh);
+					unlink(filename);
+					fclose(ifh);
+					continue;
+				}
 				fclose(fh);
 			}
 			fclose(ifh);
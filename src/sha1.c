@@ -29,7 +29,22 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHA1_HAVE_SHANI
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SHA1_HAVE_ARMV8
+#endif
 
+#include "fw_cpu.h"
+#include "fw_stats.h"
 #include "sha1.h"
 
 /* 
@@ -69,7 +84,7 @@ void sha1_starts( sha1_context *ctx )
     ctx->state[4] = 0xC3D2E1F0;
 }
 
-void sha1_process( sha1_context *ctx, uchar data[64] )
+static void sha1_process_generic( sha1_context *ctx, const uchar *data )
 {
     ulong temp, W[16], A, B, C, D, E;
 
@@ -225,7 +240,204 @@ void sha1_process( sha1_context *ctx, uchar data[64] )
     ctx->state[4] += E;
 }
 
-void sha1_update( sha1_context *ctx, void *data, uint length )
+static void sha1_blocks_generic( sha1_context *ctx, const uchar *data,
+                                 ulong nblocks )
+{
+    while( nblocks-- )
+    {
+        sha1_process_generic( ctx, data );
+        data += 64;
+    }
+}
+
+#ifdef SHA1_HAVE_SHANI
+/*
+ * SHA-NI: four rounds per sha1rnds4, message schedule in sha1msg1/sha1msg2.
+ * Group g (rounds 4g..4g+3) uses M[g & 3]; from g = 4 on it is derived in
+ * place from the previous four groups.
+ */
+#define SHANI_SCHED(g)                                                      M[(g) & 3] = _mm_sha1msg2_epu32(                                            _mm_xor_si128( _mm_sha1msg1_epu32( M[(g) & 3], M[((g) + 1) & 3] ),                        M[((g) + 2) & 3] ),                                      M[((g) + 3) & 3] )
+
+#define SHANI_ROUNDS(g)                                                     E = _mm_sha1nexte_epu32( P, M[(g) & 3] );                               P = ABCD;                                                               ABCD = _mm_sha1rnds4_epu32( ABCD, E, (g) / 5 )
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1_blocks_shani( sha1_context *ctx, const uchar *data,
+                               ulong nblocks )
+{
+    const __m128i mask = _mm_set_epi64x( 0x0001020304050607ULL,
+                                         0x08090a0b0c0d0e0fULL );
+    __m128i ABCD, ABCD_SAVE, E, E_SAVE, P, M[4];
+    int i;
+
+    ABCD = _mm_set_epi32( ctx->state[0], ctx->state[1],
+                          ctx->state[2], ctx->state[3] );
+    E = _mm_set_epi32( ctx->state[4], 0, 0, 0 );
+
+    while( nblocks-- )
+    {
+        ABCD_SAVE = ABCD;
+        E_SAVE = E;
+
+        for( i = 0; i < 4; i++ )
+            M[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128( (const __m128i *) ( data + 16 * i ) ), mask );
+
+        E = _mm_add_epi32( E, M[0] );
+        P = ABCD;
+        ABCD = _mm_sha1rnds4_epu32( ABCD, E, 0 );
+
+        SHANI_ROUNDS( 1 );  SHANI_ROUNDS( 2 );  SHANI_ROUNDS( 3 );
+        SHANI_SCHED( 4 );   SHANI_ROUNDS( 4 );
+        SHANI_SCHED( 5 );   SHANI_ROUNDS( 5 );
+        SHANI_SCHED( 6 );   SHANI_ROUNDS( 6 );
+        SHANI_SCHED( 7 );   SHANI_ROUNDS( 7 );
+        SHANI_SCHED( 8 );   SHANI_ROUNDS( 8 );
+        SHANI_SCHED( 9 );   SHANI_ROUNDS( 9 );
+        SHANI_SCHED( 10 );  SHANI_ROUNDS( 10 );
+        SHANI_SCHED( 11 );  SHANI_ROUNDS( 11 );
+        SHANI_SCHED( 12 );  SHANI_ROUNDS( 12 );
+        SHANI_SCHED( 13 );  SHANI_ROUNDS( 13 );
+        SHANI_SCHED( 14 );  SHANI_ROUNDS( 14 );
+        SHANI_SCHED( 15 );  SHANI_ROUNDS( 15 );
+        SHANI_SCHED( 16 );  SHANI_ROUNDS( 16 );
+        SHANI_SCHED( 17 );  SHANI_ROUNDS( 17 );
+        SHANI_SCHED( 18 );  SHANI_ROUNDS( 18 );
+        SHANI_SCHED( 19 );  SHANI_ROUNDS( 19 );
+
+        E = _mm_sha1nexte_epu32( P, E_SAVE );
+        ABCD = _mm_add_epi32( ABCD, ABCD_SAVE );
+
+        data += 64;
+    }
+
+    ctx->state[0] = (uint32_t) _mm_extract_epi32( ABCD, 3 );
+    ctx->state[1] = (uint32_t) _mm_extract_epi32( ABCD, 2 );
+    ctx->state[2] = (uint32_t) _mm_extract_epi32( ABCD, 1 );
+    ctx->state[3] = (uint32_t) _mm_extract_epi32( ABCD, 0 );
+    ctx->state[4] = (uint32_t) _mm_extract_epi32( E, 3 );
+}
+#endif /* SHA1_HAVE_SHANI */
+
+#ifdef SHA1_HAVE_ARMV8
+/*
+ * ARMv8 Cryptography Extensions: sha1c/p/m do four rounds each, the
+ * schedule comes from sha1su0/sha1su1 exactly as above.
+ */
+#define ARMV8_SCHED(g)                                                      M[(g) & 3] = vsha1su1q_u32( vsha1su0q_u32( M[(g) & 3], M[((g) + 1) & 3],                                                M[((g) + 2) & 3] ),                                      M[((g) + 3) & 3] )
+
+#define ARMV8_ROUNDS(g, op, k)                                              E1 = vsha1h_u32( vgetq_lane_u32( ABCD, 0 ) );                           ABCD = op( ABCD, E0, vaddq_u32( M[(g) & 3], vdupq_n_u32( k ) ) );       E0 = E1
+
+#define ARMV8_ROUNDS_C(g)   ARMV8_ROUNDS( g, vsha1cq_u32, 0x5A827999 )
+#define ARMV8_ROUNDS_P1(g)  ARMV8_ROUNDS( g, vsha1pq_u32, 0x6ED9EBA1 )
+#define ARMV8_ROUNDS_M(g)   ARMV8_ROUNDS( g, vsha1mq_u32, 0x8F1BBCDC )
+#define ARMV8_ROUNDS_P2(g)  ARMV8_ROUNDS( g, vsha1pq_u32, 0xCA62C1D6 )
+
+__attribute__((target("+crypto")))
+static void sha1_blocks_armv8( sha1_context *ctx, const uchar *data,
+                               ulong nblocks )
+{
+    uint32_t state[4] = { ctx->state[0], ctx->state[1],
+                          ctx->state[2], ctx->state[3] };
+    uint32x4_t ABCD, ABCD_SAVE, M[4];
+    uint32_t E0, E0_SAVE, E1;
+    int i;
+
+    ABCD = vld1q_u32( state );
+    E0 = ctx->state[4];
+
+    while( nblocks-- )
+    {
+        ABCD_SAVE = ABCD;
+        E0_SAVE = E0;
+
+        for( i = 0; i < 4; i++ )
+            M[i] = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 16 * i ) ) );
+
+        ARMV8_ROUNDS_C( 0 );
+        ARMV8_ROUNDS_C( 1 );
+        ARMV8_ROUNDS_C( 2 );
+        ARMV8_ROUNDS_C( 3 );
+        ARMV8_SCHED( 4 );   ARMV8_ROUNDS_C( 4 );
+        ARMV8_SCHED( 5 );   ARMV8_ROUNDS_P1( 5 );
+        ARMV8_SCHED( 6 );   ARMV8_ROUNDS_P1( 6 );
+        ARMV8_SCHED( 7 );   ARMV8_ROUNDS_P1( 7 );
+        ARMV8_SCHED( 8 );   ARMV8_ROUNDS_P1( 8 );
+        ARMV8_SCHED( 9 );   ARMV8_ROUNDS_P1( 9 );
+        ARMV8_SCHED( 10 );  ARMV8_ROUNDS_M( 10 );
+        ARMV8_SCHED( 11 );  ARMV8_ROUNDS_M( 11 );
+        ARMV8_SCHED( 12 );  ARMV8_ROUNDS_M( 12 );
+        ARMV8_SCHED( 13 );  ARMV8_ROUNDS_M( 13 );
+        ARMV8_SCHED( 14 );  ARMV8_ROUNDS_M( 14 );
+        ARMV8_SCHED( 15 );  ARMV8_ROUNDS_P2( 15 );
+        ARMV8_SCHED( 16 );  ARMV8_ROUNDS_P2( 16 );
+        ARMV8_SCHED( 17 );  ARMV8_ROUNDS_P2( 17 );
+        ARMV8_SCHED( 18 );  ARMV8_ROUNDS_P2( 18 );
+        ARMV8_SCHED( 19 );  ARMV8_ROUNDS_P2( 19 );
+
+        ABCD = vaddq_u32( ABCD, ABCD_SAVE );
+        E0 += E0_SAVE;
+
+        data += 64;
+    }
+
+    vst1q_u32( state, ABCD );
+    for( i = 0; i < 4; i++ )
+        ctx->state[i] = state[i];
+    ctx->state[4] = E0;
+}
+#endif /* SHA1_HAVE_ARMV8 */
+
+/*
+ * Block function backends, best first. sha1_blocks points at the first
+ * one the CPU supports.
+ */
+struct sha1_backend
+{
+    const char *name;
+    void (*blocks)( sha1_context *ctx, const uchar *data, ulong nblocks );
+    unsigned int features;      /* FW_CPU_* the backend needs */
+};
+
+static const struct sha1_backend sha1_backends[] =
+{
+#ifdef SHA1_HAVE_SHANI
+    { "sha-ni", sha1_blocks_shani, FW_CPU_SHA | FW_CPU_SSE41 },
+#endif
+#ifdef SHA1_HAVE_ARMV8
+    { "armv8-ce", sha1_blocks_armv8, FW_CPU_ARM_SHA1 },
+#endif
+    { "generic", sha1_blocks_generic, 0 },
+};
+
+#define SHA1_NUM_BACKENDS \
+    ( sizeof( sha1_backends ) / sizeof( sha1_backends[0] ) )
+
+static void (*sha1_blocks)( sha1_context *ctx, const uchar *data,
+                            ulong nblocks ) = sha1_blocks_generic;
+
+__attribute__((constructor))
+static void sha1_init( void )
+{
+    uint i;
+
+    for( i = 0; i < SHA1_NUM_BACKENDS; i++ )
+    {
+        if( fw_cpu_has( sha1_backends[i].features ) )
+        {
+            sha1_blocks = sha1_backends[i].blocks;
+            break;
+        }
+    }
+
+    fw_stats_impl( FW_STATS_SHA1, sha1_backends[i].name );
+}
+
+void sha1_process( sha1_context *ctx, uchar data[64] )
+{
+    sha1_blocks( ctx, data, 1 );
+}
+
+static void sha1_do_update( sha1_context *ctx, void *data, uint length )
 {
     uchar *input = data;
     ulong left, fill;
@@ -251,11 +463,11 @@ void sha1_update( sha1_context *ctx, void *data, uint length )
         left = 0;
     }
 
-    while( length >= 64 )
+    if( length >= 64 )
     {
-        sha1_process( ctx, input );
-        length -= 64;
-        input  += 64;
+        sha1_blocks( ctx, input, length / 64 );
+        input  += length & ~0x3F;
+        length &= 0x3F;
     }
 
     if( length )
@@ -265,6 +477,21 @@ void sha1_update( sha1_context *ctx, void *data, uint length )
     }
 }
 
+void sha1_update( sha1_context *ctx, void *data, uint length )
+{
+    uint64_t start;
+
+    if( ! fw_stats_on )
+    {
+        sha1_do_update( ctx, data, length );
+        return;
+    }
+
+    start = fw_stats_now();
+    sha1_do_update( ctx, data, length );
+    fw_stats_kernel( FW_STATS_SHA1, start, length );
+}
+
 static uchar sha1_padding[64] =
 {
  0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -289,8 +516,8 @@ void sha1_finish( sha1_context *ctx, uchar digest[20] )
     last = ctx->total[0] & 0x3F;
     padn = ( last < 56 ) ? ( 56 - last ) : ( 120 - last );
 
-    sha1_update( ctx, sha1_padding, padn );
-    sha1_update( ctx, msglen, 8 );
+    sha1_do_update( ctx, sha1_padding, padn );
+    sha1_do_update( ctx, msglen, 8 );
 
     PUT_UINT32_BE( ctx->state[0], digest,  0 );
     PUT_UINT32_BE( ctx->state[1], digest,  4 );
@@ -299,6 +526,11 @@ void sha1_finish( sha1_context *ctx, uchar digest[20] )
     PUT_UINT32_BE( ctx->state[4], digest, 16 );
 }
 
+void sha1_clone( sha1_context *dst, const sha1_context *src )
+{
+    memcpy( dst, src, sizeof( sha1_context ) );
+}
+
 /*
  * Output SHA-1(file contents), returns 0 if successful.
  */
@@ -308,9 +540,48 @@ int sha1_file( char *filename, uchar digest[20] )
     size_t n;
     sha1_context ctx;
     uchar buf[1024];
+    struct stat st;
+    uchar *map;
+    int fd;
+
+    /*
+     * Regular files are hashed straight out of the page cache; anything
+     * that can't be mapped (pipes, empty files) goes through stdio.
+     */
+    if( ( fd = open( filename, O_RDONLY ) ) < 0 )
+        return( 1 );
 
-    if( ( f = fopen( filename, "rb" ) ) == NULL )
+    if( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 &&
+        ( map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                      fd, 0 ) ) != MAP_FAILED )
+    {
+        size_t left = st.st_size;
+        uchar *p = map;
+
+        madvise( map, st.st_size, MADV_SEQUENTIAL );
+
+        sha1_starts( &ctx );
+
+        while( left > 0 )
+        {
+            n = left > 0x40000000 ? 0x40000000 : left;
+            sha1_update( &ctx, p, (uint) n );
+            p += n;
+            left -= n;
+        }
+
+        sha1_finish( &ctx, digest );
+
+        munmap( map, st.st_size );
+        close( fd );
+        return( 0 );
+    }
+
+    if( ( f = fdopen( fd, "rb" ) ) == NULL )
+    {
+        close( fd );
         return( 1 );
+    }
 
     sha1_starts( &ctx );
 
@@ -374,7 +645,6 @@ void sha1_hmac( uchar *key, uint keylen, uchar *buf, uint buflen,
     memset( &ctx, 0, sizeof( sha1_context ) );
 }
 
-#ifdef SELF_TEST
 /* 
  * FIPS-180-1 test vectors
  */
@@ -396,49 +666,58 @@ static uchar sha1_test_sum[3][20] =
 };
 
 /*
- * Checkup routine
+ * Checkup routine, run against every backend the CPU supports
  */
 int sha1_self_test( void )
 {
-    int i, j;
+    void (*saved)( sha1_context *, const uchar *, ulong ) = sha1_blocks;
+    int i, j, ret = 0;
+    uint b;
     uchar buf[1000];
     uchar sha1sum[20];
     sha1_context ctx;
 
-    for( i = 0; i < 3; i++ )
+    for( b = 0; b < SHA1_NUM_BACKENDS; b++ )
     {
-        printf( "  SHA-1 test #%d: ", i + 1 );
-
-        sha1_starts( &ctx );
-
-        if( i < 2 )
-            sha1_update( &ctx, (uchar *) sha1_test_str[i],
-                         strlen( sha1_test_str[i] ) );
-        else
+        if( ! fw_cpu_has( sha1_backends[b].features ) )
         {
-            memset( buf, 'a', 1000 );
-            for( j = 0; j < 1000; j++ )
-                sha1_update( &ctx, (uchar *) buf, 1000 );
+            printf( "  SHA-1 %s: not supported\n", sha1_backends[b].name );
+            continue;
         }
 
-        sha1_finish( &ctx, sha1sum );
+        sha1_blocks = sha1_backends[b].blocks;
 
-        if( memcmp( sha1sum, sha1_test_sum[i], 20 ) != 0 )
+        for( i = 0; i < 3; i++ )
         {
-            printf( "failed\n" );
-            return( 1 );
+            printf( "  SHA-1 %s test #%d: ", sha1_backends[b].name, i + 1 );
+
+            sha1_starts( &ctx );
+
+            if( i < 2 )
+                sha1_update( &ctx, (uchar *) sha1_test_str[i],
+                             strlen( sha1_test_str[i] ) );
+            else
+            {
+                memset( buf, 'a', 1000 );
+                for( j = 0; j < 1000; j++ )
+                    sha1_update( &ctx, (uchar *) buf, 1000 );
+            }
+
+            sha1_finish( &ctx, sha1sum );
+
+            if( memcmp( sha1sum, sha1_test_sum[i], 20 ) != 0 )
+            {
+                printf( "failed\n" );
+                ret = 1;
+                break;
+            }
+
+            printf( "passed\n" );
         }
-
-        printf( "passed\n" );
     }
 
+    sha1_blocks = saved;
+
     printf( "\n" );
-    return( 0 );
+    return( ret );
 }
-#else
-int sha1_self_test( void )
-{
-    printf( "SHA-1 self-test not available\n\n" );
-    return( 1 );
-}
-#endif
@@ -29,6 +29,12 @@ void sha1_starts( sha1_context *ctx );
 void sha1_update( sha1_context *ctx, void *input, uint length );
 void sha1_finish( sha1_context *ctx, uchar digest[20] );
 
+/*
+ * Copy a context part way through a message: a prefix that several
+ * messages share is hashed once, each is finished from its own copy.
+ */
+void sha1_clone( sha1_context *dst, const sha1_context *src );
+
 /*
  * Output SHA-1(file contents), returns 0 if successful.
  */
@@ -46,7 +52,8 @@ void sha1_hmac( uchar *key, uint keylen, uchar *buf, uint buflen,
                 uchar digest[20] );
 
 /*
- * Checkup routine
+ * Checkup routine, covers every block function backend the CPU supports.
+ * Returns 0 if all of them pass.
  */
 int sha1_self_test( void );
 
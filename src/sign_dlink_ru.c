@@ -14,66 +14,53 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "fw_pool.h"
 #include "md5.h"
 
 #define BUF_SIZE 4096
 #define MD5_HASH_LEN 16
 
 
-typedef struct _md5_digest_t {
-	uint8_t digest[MD5_HASH_LEN];
-} md5_digest_t;
-
 typedef struct _salt_t {
 	char* salt_ascii;
 	uint8_t* salt_bin;
 	size_t salt_bin_len;
 } salt_t;
 
-void read_file_bytes(FILE* f, MD5_CTX* md5_ctx) {
-	uint8_t buf[BUF_SIZE];
-	size_t bytes_read;
-	rewind(f);
-	
-	while (0 != (bytes_read = fread(buf, sizeof(uint8_t), BUF_SIZE, f))) {
-		MD5_Update(md5_ctx, buf, bytes_read);
-	}
+static const char magic_bytes[] = { 0x00, 0xc0, 0xff, 0xee };
+#define MAGIC_BYTES_LEN 4
+#define SIGNATURE_LEN (MD5_HASH_LEN + MAGIC_BYTES_LEN)
 
-	if (!feof(f)) {
-		printf("Error: expected to be at EOF\n");
-		exit(-1);
-	}
-}
-
-void add_magic_bytes(FILE* f) {
-	char magic_bytes[] = { 0x00, 0xc0, 0xff, 0xee };
-	size_t magic_bytes_len = 4;
-	fwrite(magic_bytes, magic_bytes_len, 1, f);
-}
+static const char version_suffix[] = "c0ffeef0rge";
 
 /**
- * Add the signature produced by this salt to the file
- * The signature consists by creating an MD5 digest wht the salt bytes plus
- * all of the bytes in the firmware file, then adding the magic bytes to the
- * file
+ * Read the whole firmware file into memory, leaving room for the version
+ * suffix and one signature per salt after it
  */
-void add_signature(FILE* f, salt_t* salt) {
-	md5_digest_t digest;
-	MD5_CTX md5_context;
+uint8_t* read_file_bytes(FILE* f, size_t* len, size_t reserve) {
+	size_t size = BUF_SIZE + reserve, bytes_read;
+	uint8_t* buf = malloc(size);
+
+	*len = 0;
+	while (buf && 0 != (bytes_read = fread(buf + *len, sizeof(uint8_t), size - reserve - *len, f))) {
+		*len += bytes_read;
+		if (size - reserve - *len < BUF_SIZE) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+	}
 
-	MD5_Init(&md5_context);
-	MD5_Update(&md5_context, salt->salt_bin, salt->salt_bin_len);
-	read_file_bytes(f, &md5_context);
-	MD5_Final(digest.digest, &md5_context);
+	if (!buf) {
+		printf("Error: out of memory\n");
+		exit(-1);
+	}
 
-	fwrite(&digest.digest, sizeof(uint8_t), MD5_HASH_LEN, f);
-	add_magic_bytes(f);
-}
+	if (!feof(f)) {
+		printf("Error: expected to be at EOF\n");
+		exit(-1);
+	}
 
-void add_version_suffix(FILE* f) {
-	char* version_suffix = "c0ffeef0rge";
-	fseek(f, 0, SEEK_END);
-	fwrite(version_suffix, sizeof(char), strlen(version_suffix), f);
+	return buf;
 }
 
 int asciihex_to_int(char c) {
@@ -134,6 +121,12 @@ void free_salt(salt_t* salt) {
 	free(salt->salt_bin);
 }
 
+void usage(char* prog) {
+	printf("Usage: %s <firmware file> <signing hash1> <signing hash2> ... <signing hash n>\n", prog);
+	printf("       %s -s <signing hash1> [-s <signing hash2>]... <firmware file>...\n", prog);
+	exit(1);
+}
+
 /**
  * Verify that the arguments are valid, or exit with failure
  */
@@ -141,8 +134,7 @@ void verify_args(int argc, char** argv) {
 	int i;
 
 	if (argc < 3) {
-		printf("Usage: %s <firmware file> <signing hash1> <signing hash2> ... <signing hash n>\n", argv[0]);
-		exit(1);
+		usage(argv[0]);
 	}
 
 	for (i = 2; i < argc; i++) {
@@ -150,63 +142,195 @@ void verify_args(int argc, char** argv) {
 	}
 }
 
-FILE* make_out_file(char* filename) {
-	uint8_t buf[BUF_SIZE];
-	int bytes_read;
+/**
+ * Sort the batch mode arguments into salts and firmware files, or exit
+ * with failure
+ */
+void parse_batch_args(int argc, char** argv, char** salts, int* num_salts,
+		      char** files, int* num_files) {
+	int i;
+
+	*num_salts = *num_files = 0;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			verify_valid_hex_str(argv[++i]);
+			salts[(*num_salts)++] = argv[i];
+		} else {
+			files[(*num_files)++] = argv[i];
+		}
+	}
+
+	if (*num_salts == 0 || *num_files == 0) {
+		usage(argv[0]);
+	}
+}
+
+/**
+ * Sign the firmware file after all of our checks have completed
+ *
+ * Signature i is the MD5 digest of salt i, the firmware with its version
+ * suffix and the signatures 0..i-1 (each followed by the magic bytes). The
+ * firmware is read once and the shared part is hashed for all salts at the
+ * same time in multi-buffer MD5 lanes; only the short tail of previous
+ * signatures is hashed per salt afterwards.
+ *
+ * Nothing is printed, so batch mode can sign files concurrently. Returns 0,
+ * or the exit code for a file that cannot be opened.
+ */
+int sign_file(const char* filename, const salt_t* salt, int num_salts) {
+	int i;
+	size_t len, suffix_len = strlen(version_suffix);
+	size_t tail_len = 0;
+	MD5_CTX* md5_context = calloc(num_salts, sizeof(*md5_context));
+	MD5_CTX** ctx = calloc(num_salts, sizeof(*ctx));
+	const void** data = calloc(num_salts, sizeof(*data));
+	unsigned long* size = calloc(num_salts, sizeof(*size));
+	uint8_t* buf;
+	uint8_t* tail;
 	char* suffix = ".new";
 	int new_filename_len = strlen(filename) + strlen(suffix) + 1;
 	char* new_filename = malloc(new_filename_len);
+	FILE* f;
+	FILE* out;
+
 	strcpy(new_filename, filename);
 	strcat(new_filename, suffix);
 
-	FILE* f = fopen(filename, "r+");
+	f = fopen(filename, "r+");
 	if (!f) {
-		printf("cannot open file %s\n", filename);
-		exit(2);
+		free(new_filename);
+		return 2;
 	}
 
-	FILE* out = fopen(new_filename, "w+");
+	out = fopen(new_filename, "w+");
 	free(new_filename);
 	if (!out) {
-		printf("cannot open file %s\n", filename);
-		exit(2);
+		fclose(f);
+		return 2;
 	}
 
-	while (0 != (bytes_read = fread(buf, sizeof(uint8_t), BUF_SIZE, f))) {
-		fwrite(buf, sizeof(uint8_t), bytes_read, out);
-	}
+	buf = read_file_bytes(f, &len, suffix_len + num_salts * SIGNATURE_LEN);
 	fclose(f);
-	return out;
+
+	// add a version suffix string - dlink versions do something similar before the first signature
+	memcpy(buf + len, version_suffix, suffix_len);
+	len += suffix_len;
+	tail = buf + len;
+
+	// every salt prefixes its own lane, the firmware itself is shared
+	for (i = 0; i < num_salts; i++) {
+		MD5_Init(&md5_context[i]);
+		MD5_Update(&md5_context[i], salt[i].salt_bin, salt[i].salt_bin_len);
+		ctx[i] = &md5_context[i];
+		data[i] = buf;
+		size[i] = len;
+	}
+	MD5_Multi_Update(ctx, data, size, num_salts);
+
+	// add the signature produced by each salt, in order
+	for (i = 0; i < num_salts; i++) {
+		MD5_Update(&md5_context[i], tail, tail_len);
+		MD5_Final(tail + tail_len, &md5_context[i]);
+		memcpy(tail + tail_len + MD5_HASH_LEN, magic_bytes, MAGIC_BYTES_LEN);
+		tail_len += SIGNATURE_LEN;
+	}
+
+	fwrite(buf, sizeof(uint8_t), len + tail_len, out);
+	fclose(out);
+
+	free(buf);
+	free(size);
+	free(data);
+	free(ctx);
+	free(md5_context);
+
+	return 0;
+}
+
+typedef struct _batch_t {
+	char** files;
+	const salt_t* salt;
+	int num_salts;
+	int* res;
+} batch_t;
+
+static void sign_batch_file(void* arg, unsigned int idx) {
+	batch_t* batch = arg;
+
+	batch->res[idx] = sign_file(batch->files[idx], batch->salt, batch->num_salts);
 }
 
 /**
- * Sign the firmware file after all of our checks have completed
+ * Sign every file with the same salts. The files are signed concurrently
+ * on the worker pool, but reported in command line order.
  */
+int sign_batch(char** files, int num_files, char** salts, int num_salts) {
+	int i, j, ret = 0;
+	salt_t* salt = calloc(num_salts, sizeof(*salt));
+	batch_t batch = {
+		.files = files,
+		.salt = salt,
+		.num_salts = num_salts,
+		.res = calloc(num_files, sizeof(*batch.res)),
+	};
+
+	for (i = 0; i < num_salts; i++) {
+		init_salt(&salt[i], salts[i]);
+	}
+
+	fw_pool_run(num_files, sign_batch_file, &batch);
+
+	for (i = 0; i < num_files; i++) {
+		if (batch.res[i]) {
+			printf("cannot open file %s\n", files[i]);
+			ret = batch.res[i];
+			continue;
+		}
+		for (j = 0; j < num_salts; j++) {
+			printf("Signed %s with salt: %s\n", files[i], salts[j]);
+		}
+	}
+
+	for (i = 0; i < num_salts; i++) {
+		free_salt(&salt[i]);
+	}
+	free(batch.res);
+	free(salt);
+
+	return ret;
+}
+
 void sign_firmware(char* filename, char** salts, int num_salts) {
 	int i;
-	salt_t salt;
-	FILE* f = make_out_file(filename);
+	salt_t* salt = calloc(num_salts, sizeof(*salt));
 
-	// add a version suffix string - dlink versions do something similar before the first signature
-	add_version_suffix(f);
-
-	//for each of the salts we are supplied with
 	for (i = 0; i < num_salts; i++) {
-		char* salt_str = salts[i];
-		// convert this str to binary
-		init_salt(&salt, salt_str);
+		init_salt(&salt[i], salts[i]);
+	}
 
-		// add the signature to the firmware file produced from this salt
-		add_signature(f, &salt);
-		free_salt(&salt);
-		printf("Signed with salt: %s\n", salt_str);
+	if (sign_file(filename, salt, num_salts)) {
+		printf("cannot open file %s\n", filename);
+		exit(2);
 	}
 
-	fclose(f);
+	for (i = 0; i < num_salts; i++) {
+		free_salt(&salt[i]);
+		printf("Signed with salt: %s\n", salts[i]);
+	}
+	free(salt);
 }
 
 
 int main(int argc, char ** argv) {
+	if (argc > 1 && !strcmp(argv[1], "-s")) {
+		char** salts = calloc(argc, sizeof(*salts));
+		char** files = calloc(argc, sizeof(*files));
+		int num_salts, num_files;
+
+		parse_batch_args(argc, argv, salts, &num_salts, files, &num_files);
+		return sign_batch(files, num_files, salts, num_salts);
+	}
+
 	verify_args(argc, argv);
 	sign_firmware(argv[1], argv+2, argc-2);
 	return 0;
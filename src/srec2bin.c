@@ -1,7 +1,11 @@
 // SPDX-License-Identifier: GPL-2.0-only
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#include "fw_io.h"
 
 //Rev 0.1 Original
 // 8 Jan 2001  MJH  Added code to write data to Binary file
@@ -58,18 +62,26 @@ bit32u RecLength=0;
 
 bit32u AddressCurrent;
 
+// The record being built: LENGTH, ADDRESS, DATA and CHECKSUM are collected
+// here and written out in one go once the address run ends
+bit8u *RecBuf;
+bit32u RecAlloc;
+
 bit32u gh(char *cp,int nibs);
 
 int BigEndian;
 
 int inputline;
 
-// char buf[16*1024];
-
-char buffer[2048];
-char *cur_ptr;
+// The whole input, mapped when it is a regular file
+struct fw_io_map InputMap;
+char *InputBuf;
+const char *cur_ptr;
+size_t cur_len=0;
 int cur_line=0;
-int cur_len=0;
+
+// Hex digit values, 0xFF for anything else
+bit8u HexVal[256];
 
 int s1s2s3_total=0;
 
@@ -108,17 +120,23 @@ void WaitDisplay(void)
 }
 
 
+void binPut32 ( bit8u *p, bit32u Data )
+{
+   int i;
+
+   for(i=0;i<4;i++)
+    p[i]=(bit8u)(Data>>(i*8));
+}
+
 void binOut32 ( bit32u Data )
 {
 // On UNIX machine all 32bit writes need ENDIAN switched
 //    Data = EndianSwitch(Data);
 //    fwrite( &Data, sizeof(bit32u), 1, fOut);
 
-   char sdat[4];
-   int i;
+   bit8u sdat[4];
 
-   for(i=0;i<4;i++)
-    sdat[i]=(char)(Data>>(i*8));
+   binPut32(sdat, Data);
    fwrite( sdat, 1, 4, fOut);
    dumpfTell("Out32" , Data);
 }
@@ -126,14 +144,33 @@ void binOut32 ( bit32u Data )
 // Only update RecLength on Byte Writes
 // All 32 bit writes will be for Length etc
 
-void binOut8 ( bit8u Data )
+void binRecData ( const bit8u *Data, int Count )
 {
-    int n;
-    dumpfTell("B4Data" , (bit32u) (Data & 0xFF) );
-    n = fwrite( &Data, sizeof(bit8u), 1, fOut);
-    if (n != 1)
-        printf("Error in writing %X for Address 0x%8X\n", Data, AddressCurrent);
-    RecLength += 1;
+    bit32u need = 8 + RecLength + Count + 4;
+    int i;
+
+    if (need > RecAlloc)
+    {
+        bit8u *p;
+        bit32u n = RecAlloc ? RecAlloc : 64 * 1024;
+
+        while (n < need)
+            n *= 2;
+        p = realloc(RecBuf, n);
+        if (!p)
+        {
+            printf("Error in allocating record for Address 0x%8X\n", AddressCurrent);
+            return;
+        }
+        RecBuf = p;
+        RecAlloc = n;
+    }
+
+    if (Count)
+        memcpy(RecBuf + 8 + RecLength, Data, Count);
+    for (i = 0; i < Count; i++)
+        CheckSum += Data[i];
+    RecLength += Count;
 }
 
 //  Currently ONLY used for outputting Program Start
@@ -148,16 +185,14 @@ void binRecStart(bit32u Address)
           printf("[RecStart] CheckSum[0x%08X] Length[%4d] Address[0x%08X]\n",
                 CheckSum, RecLength, Address);
 
-
-    dumpfTell("RecLength", RecLength);
-    binOut32( RecLength );
-    dumpfTell("Address", Address);
-    binOut32( Address );
+    // Room for LENGTH, ADDRESS and CHECKSUM of an empty record
+    binRecData(NULL, 0);
+    binPut32(RecBuf + 4, Address);
 }
 
 void binRecEnd(void)
 {
-    long RecEnd;
+    bit32u Total;
 
     if (!RecStart)   //  if no record started, do not end it
     {
@@ -166,34 +201,20 @@ void binRecEnd(void)
 
     RecStart = FALSE;
 
-
-    RecEnd = ftell(fOut);         // Save Current position
-
     if (debug)
-          printf("[RecEnd  ] CheckSum[0x%08X] Length[%4d] Length[0x%X] RecEnd[0x%08lX]\n",
-                CheckSum, RecLength, RecLength, RecEnd);
-
-    fseek( fOut, -((long) RecLength), SEEK_CUR);  // move back Start Of Data
-
-    dumpfTell("Data   ", -1);
-
-    fseek( fOut, -4, SEEK_CUR);  // move back Start Of Address
-
-    dumpfTell("Address   ", -1);
-
-    fseek( fOut, -4, SEEK_CUR);  // move back Start Of Length
-
-    dumpfTell("Length   ", -1);
-
-    binOut32( RecLength );
-
-    fseek( fOut, RecEnd, SEEK_SET);  // move to end of Record
+          printf("[RecEnd  ] CheckSum[0x%08X] Length[%4d] Length[0x%X] RecStart[0x%08lX]\n",
+                CheckSum, RecLength, RecLength, ftell(fOut));
 
     CheckSum += RecLength;
 
     CheckSum =  ~CheckSum + 1;  // Two's complement
 
-    binOut32( CheckSum );
+    // The whole record goes out with a single write
+    binPut32(RecBuf, RecLength);
+    binPut32(RecBuf + 8 + RecLength, CheckSum);
+    Total = 8 + RecLength + 4;
+    if (fwrite(RecBuf, 1, Total, fOut) != Total)
+        printf("Error in writing record for Address 0x%8X\n", AddressCurrent);
 
     if (verbose)
         printf("[Created Record of %d Bytes with CheckSum [0x%8X]\n", RecLength, CheckSum);
@@ -208,78 +229,105 @@ void binRecOutProgramStart(bit32u Address)
     }
     AddressCurrent = Address;
 }
-void binRecOutByte(bit32u Address, bit8u Data)
+
+void binRecOutBytes(bit32u Address, const bit8u *Data, int Count)
 {
-    //  If Address is one after Current Address, output Byte
+    //  If Address is one after Current Address, append the bytes
     //  If not, close out last record, update Length, write checksum
     //  Then Start New Record, updating Current Address
 
+    if (!Count)
+        return;
+
     if (Address != (AddressCurrent+1))
     {
         binRecEnd();
         binRecStart(Address);
     }
-    AddressCurrent = Address;
-    CheckSum += Data;
-    binOut8( Data );
+    AddressCurrent = Address + Count - 1;
+
+    // Data running on from the initial address goes out bare, outside
+    // of any record
+    if (!RecStart)
+    {
+        if (fwrite(Data, 1, Count, fOut) != Count)
+            printf("Error in writing data for Address 0x%8X\n", Address);
+        return;
+    }
+    binRecData( Data, Count );
 }
 
 //=============================================================================
 //       SUPPORT FUNCTIONS
 //=============================================================================
-int readline(FILE *fil,char *buf,int len)
+int loadinput(FILE *fil)
 {
-    int rlen;
-    
-    rlen=0;
-    if (len==0)  return(0);
+    struct stat st;
+    size_t alloc=0, n;
+
+    // Map regular files, slurp anything else
+    if (!fstat(fileno(fil), &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        !fw_io_map(&InputMap, fileno(fil), 0, st.st_size))
+    {
+      cur_ptr=(const char *)InputMap.data;
+      cur_len=InputMap.len;
+      return(0);
+    }
+
     while(1)
     {
-      if (cur_len==0)
+      if (cur_len==alloc)
       {
-        cur_len=fread(buffer, 1, sizeof(buffer), fil);
-        if (cur_len==0)
-        {
-          if (rlen)
-          {
-            *buf=0;
-            return(rlen);
-          }
+        char *p;
+
+        alloc = alloc ? alloc * 2 : 256 * 1024;
+        p = realloc(InputBuf, alloc);
+        if (!p)
           return(-1);
-        }
-        cur_ptr=buffer;
-      }
-      if (cur_len)
-      {
-        if (*cur_ptr=='\n')
-        {
-          *buf=0;
-          cur_ptr++;
-          cur_len--;
-          return(rlen);
-        }
-         else
-         {
-           if ((len>1)&&(*cur_ptr!='\r'))
-           {
-             *buf++=*cur_ptr++;
-             len--;
-           }
-           else
-             cur_ptr++;
-
-           rlen++;
-           cur_len--;
-         }
+        InputBuf = p;
       }
-      else
+      n=fread(InputBuf + cur_len, 1, alloc - cur_len, fil);
+      if (n==0)
+        break;
+      cur_len+=n;
+    }
+    cur_ptr=InputBuf;
+    return(ferror(fil) ? -1 : 0);
+}
+
+void freeinput(void)
+{
+    fw_io_unmap(&InputMap);
+    free(InputBuf);
+}
+
+int readline(char *buf,int len)
+{
+    const char *eol;
+    size_t n, i;
+    int rlen;
+
+    if (len==0)  return(0);
+    if (cur_len==0)  return(-1);
+
+    eol=memchr(cur_ptr, '\n', cur_len);
+    n = eol ? (size_t)(eol - cur_ptr) : cur_len;
+
+    // Keep the first len-1 characters of the line, dropping CRs
+    for (i=0, rlen=0; i<n; i++, rlen++)
+    {
+      if ((len>1)&&(cur_ptr[i]!='\r'))
       {
-        *buf=0;
-        cur_ptr++;
-        cur_len--;
-        return(rlen);
+        *buf++=cur_ptr[i];
+        len--;
       }
     }
+    *buf=0;
+
+    if (eol) n++;
+    cur_ptr+=n;
+    cur_len-=n;
+    return(rlen);
 }
 
 
@@ -319,24 +367,39 @@ int checksum(char *cp,int count)
   return(cksum==0x0ff);
 }
 
+void hexinit(void)
+{
+  int i;
+
+  memset(HexVal, 0xFF, sizeof(HexVal));
+  for(i=0;i<10;i++)
+    HexVal['0'+i]=i;
+  for(i=0;i<6;i++)
+    HexVal['A'+i]=HexVal['a'+i]=10+i;
+}
+
 bit32u gh(char *cp,int nibs)
 {
   int i;
   bit32u j;
+  bit8u v;
 
   j=0;
 
   for(i=0;i<nibs;i++)
   {
     j<<=4;
-    if ((*cp>='a')&&(*cp<='z')) *cp &= 0x5f;
-    if ((*cp>='0')&&(*cp<='9')) 
-      j += (*cp-0x30);
-     else
-      if ((*cp>='A')&&(*cp<='F'))
-        j += (*cp-0x37);
-       else
-        SRLerrorout("Bad Hex char", cp);
+    v=HexVal[(bit8u)*cp];
+    if (v>15)
+    {
+      if ((*cp>='a')&&(*cp<='z')) *cp &= 0x5f;
+      SRLerrorout("Bad Hex char", cp);
+    }
+    else
+    {
+      if (*cp>='a') *cp &= 0x5f;
+      j += v;
+    }
     cp++;
   }
   return(j);
@@ -350,7 +413,8 @@ bit32u gh(char *cp,int nibs)
 int srecLine(char *pSrecLine)
 {
     char *scp,ch;
-    int  itmp,count,dat;
+    int  itmp,count,n;
+    bit8u dat[128];
     bit32u adr;
     static bit32u RecordCounter=0;
 
@@ -393,12 +457,9 @@ int srecLine(char *pSrecLine)
         case '3': if (count<5) return(SRLerrorout("Invalid Srecord count field",scp));
                   adr=gh(pSrecLine,8); pSrecLine+=8; count-=4;
                   count--;
-                  while(count)
-                  {
-                    dat=gh(pSrecLine,2); pSrecLine+=2; count--;
-                    binRecOutByte(adr, (char) (dat & 0xFF));
-                    adr++;
-                  }
+                  for (n=0; n<count; n++, pSrecLine+=2)
+                    dat[n]=(HexVal[(bit8u)pSrecLine[0]]<<4) | HexVal[(bit8u)pSrecLine[1]];
+                  binRecOutBytes(adr, dat, count);
                   s1s2s3_total++;
         break;
         case '4': return(SRLerrorout("Invalid Srecord type",scp));
@@ -476,6 +537,16 @@ int srec2bin(int argc,char *argv[],int verbose)
       return(0);
     }
  
+    if (loadinput(fp))
+    {
+      printf("\nError: Reading input file, %s.", argv[1]);
+      fclose(fp);
+      fclose(fOut);
+      return(0);
+    }
+
+    hexinit();
+
     RecStart = FALSE;
 
     AddressCurrent = 0xFFFFFFFFL;
@@ -490,7 +561,7 @@ int srec2bin(int argc,char *argv[],int verbose)
     inputline=0;
     sts=TRUE;
 
-    rlen = readline(fp,buff,sizeof buff);
+    rlen = readline(buff,sizeof buff);
 
     while( (sts) && (rlen != -1))
     {
@@ -499,7 +570,7 @@ int srec2bin(int argc,char *argv[],int verbose)
             sts &= srecLine(buff);
             WaitDisplay();
         }
-       rlen = readline(fp,buff,sizeof buff);
+       rlen = readline(buff,sizeof buff);
     }
 
   
@@ -507,6 +578,8 @@ int srec2bin(int argc,char *argv[],int verbose)
   
     binRecEnd();
 
+    freeinput();
+    free(RecBuf);
     if(fp) fclose(fp);
     if(fOut) fclose(fOut);
 
@@ -16,6 +16,9 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -27,10 +30,17 @@
 
 #include <arpa/inet.h>
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <limits.h>
 
+#include "fw_io.h"
+#include "fw_mem.h"
+#include "fw_pool.h"
+#include "fw_registry.h"
+#include "fw_trace.h"
 #include "md5.h"
 
 
@@ -44,6 +54,19 @@ struct image_partition_entry {
 	const char *name;
 	size_t size;
 	uint8_t *data;
+	size_t pad;		/* trailing 0xff bytes of size not backed by data */
+	bool jffs2_eof;		/* the padding ends in a JFFS2 EOF mark */
+	bool borrowed;		/* data belongs to an input_file or the part arena */
+};
+
+/** A kernel or rootfs image, mapped once and shared by all images built from it
+ * It is opened up front but only mapped by the first image that fits. */
+struct input_file {
+	const char *filename;
+	int fd;
+	bool mapped;
+	uint8_t *data;
+	size_t size;
 };
 
 /** A flash partition table entry */
@@ -3324,6 +3347,80 @@ static inline bool meta_partition_should_pad(enum partition_trail_value pv)
 	return (pv >= 0) && (pv <= PART_TRAIL_MAX);
 }
 
+/** Bump allocator for the metadata partitions of one image build
+ * The partition table, soft-version, support-list and extra-para entries
+ * are carved out of one block per thread that is kept from build to build
+ * and reset once at the end of each. Whatever didn't fit goes to blocks of
+ * its own until the reset, which grows the main block to the high-water
+ * mark, so a batch of boards settles on one allocation per worker. */
+#define PART_ARENA_MIN	0x4000
+
+struct part_arena_block {
+	struct part_arena_block *next;
+	uint8_t data[];
+};
+
+struct part_arena {
+	uint8_t *buf;
+	size_t size;
+	size_t used;
+	size_t want;
+	struct part_arena_block *extra;
+};
+
+static __thread struct part_arena part_arena;
+
+static void *part_arena_alloc(size_t len)
+{
+	struct part_arena *a = &part_arena;
+	struct part_arena_block *block;
+	void *ret;
+
+	len = ALIGN(len, (size_t)16);
+	a->want += len;
+
+	if (!a->buf) {
+		a->size = a->want > PART_ARENA_MIN ? ALIGN(a->want, (size_t)PART_ARENA_MIN) : PART_ARENA_MIN;
+		a->buf = malloc(a->size);
+		if (!a->buf)
+			error(1, errno, "malloc");
+	}
+
+	if (a->size - a->used >= len) {
+		ret = a->buf + a->used;
+		a->used += len;
+		return ret;
+	}
+
+	block = malloc(sizeof(*block) + len);
+	if (!block)
+		error(1, errno, "malloc");
+	block->next = a->extra;
+	a->extra = block;
+
+	return block->data;
+}
+
+/** Releases everything part_arena_alloc() handed out since the last reset */
+static void part_arena_reset(void)
+{
+	struct part_arena *a = &part_arena;
+	struct part_arena_block *block;
+
+	while ((block = a->extra)) {
+		a->extra = block->next;
+		free(block);
+	}
+
+	if (a->want > a->size) {
+		free(a->buf);
+		a->buf = NULL;
+		a->size = 0;
+	}
+
+	a->used = a->want = 0;
+}
+
 /** Allocate a padded meta partition with a correctly initialised header
  * If the `data` pointer is NULL, then the required space is only allocated,
  * otherwise `data_len` bytes will be copied from `data` into the partition
@@ -3339,10 +3436,9 @@ static struct image_partition_entry init_meta_partition_entry(
 	struct image_partition_entry entry = {
 		.name = name,
 		.size = total_len,
-		.data = malloc(total_len)
+		.data = part_arena_alloc(total_len),
+		.borrowed = true,
 	};
-	if (!entry.data)
-		error(1, errno, "failed to allocate meta partition entry");
 
 	struct meta_header *header = (struct meta_header *)entry.data;
 	header->length = htonl(data_len);
@@ -3357,11 +3453,14 @@ static struct image_partition_entry init_meta_partition_entry(
 	return entry;
 }
 
-/** Allocates a new image partition */
+/** Allocates a new image partition from the part arena */
 static struct image_partition_entry alloc_image_partition(const char *name, size_t len) {
-	struct image_partition_entry entry = {name, len, malloc(len)};
-	if (!entry.data)
-		error(1, errno, "malloc");
+	struct image_partition_entry entry = {
+		.name = name,
+		.size = len,
+		.data = part_arena_alloc(len),
+		.borrowed = true,
+	};
 
 	return entry;
 }
@@ -3388,11 +3487,10 @@ static void free_image_partition(struct image_partition_entry *entry)
 {
 	void *data = entry->data;
 
-	entry->name = NULL;
-	entry->size = 0;
-	entry->data = NULL;
+	if (!entry->borrowed)
+		fw_mem_free(data, entry->size);
 
-	free(data);
+	memset(entry, 0, sizeof(*entry));
 }
 
 static time_t source_date_epoch = -1;
@@ -3400,6 +3498,7 @@ static void set_source_date_epoch() {
 	char *env = getenv("SOURCE_DATE_EPOCH");
 	char *endptr = env;
 	errno = 0;
+	source_date_epoch = -1;
 	if (env && *env) {
 		source_date_epoch = strtoull(env, &endptr, 10);
 		if (errno || (endptr && *endptr != '\0')) {
@@ -3447,8 +3546,22 @@ static inline uint8_t bcd(uint8_t v) {
 }
 
 
+/** Returns the date soft-version partitions are stamped with */
+static void soft_version_date(struct tm *tm)
+{
+	time_t t;
+
+	if (source_date_epoch != -1)
+		t = source_date_epoch;
+	else if (time(&t) == (time_t)(-1))
+		error(1, errno, "time");
+
+	gmtime_r(&t, tm);
+}
+
 /** Generates the soft-version partition */
-static struct image_partition_entry make_soft_version(const struct device_info *info, uint32_t rev)
+static struct image_partition_entry make_soft_version(const struct device_info *info, uint32_t rev,
+	const struct tm *tm)
 {
 	/** If an info string is provided, use this instead of
 	 * the structured data, and include the null-termination */
@@ -3458,15 +3571,6 @@ static struct image_partition_entry make_soft_version(const struct device_info *
 			info->soft_ver.text, len, info->part_trail);
 	}
 
-	time_t t;
-
-	if (source_date_epoch != -1)
-		t = source_date_epoch;
-	else if (time(&t) == (time_t)(-1))
-		error(1, errno, "time");
-
-	struct tm *tm = gmtime(&t);
-
 	struct soft_version s = {
 		.pad1 = 0xff,
 
@@ -3509,14 +3613,251 @@ static struct image_partition_entry make_extra_para(
 		info->part_trail);
 }
 
-/** Creates a new image partition with an arbitrary name from a file */
-static struct image_partition_entry read_file(const char *part_name, const char *filename, bool add_jffs2_eof, struct flash_partition_entry *file_system_partition) {
+/** Some devices need the extra-para partition to accept the firmware
+ * Returns the length of its data, 0 for boards without one. */
+static size_t board_extra_para(const struct device_info *info, uint8_t extra_para[2])
+{
+	if (strcasecmp(info->id, "ARCHER-A6-V3") == 0 ||
+	    strcasecmp(info->id, "ARCHER-A7-V5") == 0 ||
+	    strcasecmp(info->id, "ARCHER-A9-V6") == 0 ||
+	    strcasecmp(info->id, "ARCHER-AX23-V1") == 0 ||
+	    strcasecmp(info->id, "ARCHER-C2-V3") == 0 ||
+	    strcasecmp(info->id, "ARCHER-C7-V4") == 0 ||
+	    strcasecmp(info->id, "ARCHER-C7-V5") == 0 ||
+	    strcasecmp(info->id, "ARCHER-C25-V1") == 0 ||
+	    strcasecmp(info->id, "ARCHER-C59-V2") == 0 ||
+	    strcasecmp(info->id, "ARCHER-C60-V2") == 0 ||
+	    strcasecmp(info->id, "ARCHER-C60-V3") == 0 ||
+	    strcasecmp(info->id, "ARCHER-C6U-V1") == 0 ||
+	    strcasecmp(info->id, "ARCHER-C6-V3") == 0 ||
+	    strcasecmp(info->id, "DECO-M4R-V4") == 0 ||
+	    strcasecmp(info->id, "MR70X") == 0 ||
+	    strcasecmp(info->id, "TLWR1043NV5") == 0) {
+		extra_para[0] = 0x01;
+		extra_para[1] = 0x00;
+	} else if (strcasecmp(info->id, "ARCHER-C6-V2") == 0 ||
+		   strcasecmp(info->id, "TL-WA1201-V2") == 0) {
+		extra_para[0] = 0x00;
+		extra_para[1] = 0x01;
+	} else if (strcasecmp(info->id, "ARCHER-C6-V2-US") == 0 ||
+		   strcasecmp(info->id, "EAP245-V3") == 0) {
+		extra_para[0] = 0x01;
+		extra_para[1] = 0x01;
+	} else {
+		return 0;
+	}
+
+	return 2;
+}
+
+/** Metadata of a board that is kept for the rest of the run
+ * Batch builds and factory plus sysupgrade runs make several images per
+ * board, and support lists alone are several KB each. Next to the
+ * support-list and extra-para partitions this keeps the vendor block and
+ * the MD5 state after the salt and it, where every factory image hash of
+ * the board starts. Most boards have the same vendor block, so those
+ * states are shared. Soft-version partitions are kept per revision and
+ * build date. Nothing is changed or freed once added, so images use the
+ * entries without holding the lock. */
+#define META_CACHE_BUCKETS	64
+
+struct meta_vendor {
+	struct meta_vendor *next;
+	uint8_t vendor[SAFELOADER_HEADER_SIZE];
+	MD5_CTX md5;		/* after md5_salt and vendor */
+};
+
+struct meta_soft_ver {
+	struct meta_soft_ver *next;
+	uint32_t rev;
+	uint32_t date;		/* yyyymmdd, 0 for text soft-versions */
+	struct image_partition_entry part;
+};
+
+struct meta_cache {
+	struct meta_cache *next;
+	const char *id;		/* of the boards[] entry, compared by address */
+	struct image_partition_entry support_list;
+	struct image_partition_entry extra_para;	/* name is NULL without one */
+	struct meta_soft_ver *soft_vers;
+	const struct meta_vendor *vendor;
+};
+
+static struct meta_cache *meta_cache[META_CACHE_BUCKETS];
+static struct meta_vendor *meta_vendors;
+static pthread_mutex_t meta_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Moves a partition out of the part arena for good */
+static struct image_partition_entry meta_cache_keep(struct image_partition_entry part)
+{
+	uint8_t *data = fw_mem_alloc(part.size);
+
+	if (!data)
+		error(1, errno, "malloc");
+	memcpy(data, part.data, part.size);
+	part.data = data;
+
+	return part;
+}
+
+/** Returns the vendor block for a vendor string with its MD5 state
+ * Called with meta_cache_lock held. */
+static const struct meta_vendor *meta_cache_vendor(const char *vendor)
+{
+	static MD5_CTX salt_md5;
+	uint8_t block[SAFELOADER_HEADER_SIZE];
+	struct meta_vendor *v;
+
+	memset(block, 0xff, sizeof(block));
+	if (vendor) {
+		size_t vendor_len = strlen(vendor);
+		put32(block, vendor_len);
+		memcpy(block + 0x4, vendor, vendor_len);
+	}
+
+	for (v = meta_vendors; v; v = v->next)
+		if (!memcmp(v->vendor, block, sizeof(block)))
+			return v;
+
+	if (!meta_vendors) {
+		MD5_Init(&salt_md5);
+		MD5_Update(&salt_md5, md5_salt, (unsigned int)sizeof(md5_salt));
+	}
+
+	v = malloc(sizeof(*v));
+	if (!v)
+		error(1, errno, "malloc");
+	memcpy(v->vendor, block, sizeof(block));
+	MD5_Clone(&v->md5, &salt_md5);
+	MD5_Update(&v->md5, v->vendor, sizeof(v->vendor));
+	v->next = meta_vendors;
+	meta_vendors = v;
+
+	return v;
+}
+
+/** Returns the cached metadata of a board, set up on first use
+ * info is a copy of the boards[] entry with the partition names set. */
+static const struct meta_cache *meta_cache_get(const struct device_info *info)
+{
+	size_t bucket = ((uintptr_t)info->id >> 4) % META_CACHE_BUCKETS;
+	struct meta_cache *c;
+	uint8_t extra_para[2];
+	size_t len;
+
+	pthread_mutex_lock(&meta_cache_lock);
+
+	for (c = meta_cache[bucket]; c; c = c->next)
+		if (c->id == info->id)
+			goto out;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		error(1, errno, "calloc");
+	c->id = info->id;
+
+	c->support_list = meta_cache_keep(make_support_list(info));
+
+	len = board_extra_para(info, extra_para);
+	if (len)
+		c->extra_para = meta_cache_keep(make_extra_para(info, extra_para, len));
+
+	c->vendor = meta_cache_vendor(info->vendor);
+
+	c->next = meta_cache[bucket];
+	meta_cache[bucket] = c;
+
+out:
+	pthread_mutex_unlock(&meta_cache_lock);
+
+	return c;
+}
+
+/** Returns the board's soft-version partition for rev, made on first use */
+static struct image_partition_entry meta_cache_soft_version(const struct meta_cache *cache,
+	const struct device_info *info, uint32_t rev)
+{
+	struct meta_cache *c = (struct meta_cache *)cache;
+	struct meta_soft_ver *v;
+	uint32_t date = 0;
+	struct tm tm = {};
+
+	if (info->soft_ver.type == SOFT_VER_TYPE_TEXT) {
+		rev = 0;
+	} else {
+		soft_version_date(&tm);
+		date = (1900 + tm.tm_year) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+	}
+
+	pthread_mutex_lock(&meta_cache_lock);
+
+	for (v = c->soft_vers; v; v = v->next)
+		if (v->rev == rev && v->date == date)
+			goto out;
+
+	v = malloc(sizeof(*v));
+	if (!v)
+		error(1, errno, "malloc");
+	v->rev = rev;
+	v->date = date;
+	v->part = meta_cache_keep(make_soft_version(info, rev, &tm));
+	v->next = c->soft_vers;
+	c->soft_vers = v;
+
+out:
+	pthread_mutex_unlock(&meta_cache_lock);
+
+	return v->part;
+}
+
+/** Opens an input file for use by one or more images */
+static void open_input_file(struct input_file *in, const char *filename) {
 	struct stat statbuf;
 
 	if (stat(filename, &statbuf) < 0)
 		error(1, errno, "unable to stat file `%s'", filename);
 
-	size_t len = statbuf.st_size;
+	in->filename = filename;
+	in->mapped = false;
+	in->data = NULL;
+	in->size = statbuf.st_size;
+
+	in->fd = open(filename, O_RDONLY);
+	if (in->fd < 0)
+		error(1, errno, "unable to open file `%s'", filename);
+}
+
+static pthread_mutex_t input_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Returns the data of an input file, mapping it on first use */
+static uint8_t *map_input_file(struct input_file *in) {
+	pthread_mutex_lock(&input_file_lock);
+	if (!in->mapped && in->size) {
+		in->data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+		if (in->data == MAP_FAILED)
+			error(1, errno, "unable to read file `%s'", in->filename);
+		madvise(in->data, in->size, MADV_SEQUENTIAL);
+		madvise(in->data, in->size, MADV_WILLNEED);
+	}
+	in->mapped = true;
+	pthread_mutex_unlock(&input_file_lock);
+
+	return in->data;
+}
+
+static void close_input_file(struct input_file *in) {
+	if (in->data)
+		munmap(in->data, in->size);
+	close(in->fd);
+	memset(in, 0, sizeof(*in));
+}
+
+/** Creates a new image partition with an arbitrary name from an input file
+ * The data stays in the input file's mapping, which build_image() only adds
+ * once the image is known to fit; any jffs2 EOF padding is only recorded
+ * and generated by the image writer. */
+static struct image_partition_entry file_partition(const char *part_name, const struct input_file *in, bool add_jffs2_eof, struct flash_partition_entry *file_system_partition) {
+	size_t len = in->size;
 
 	if (add_jffs2_eof) {
 		if (file_system_partition)
@@ -3525,29 +3866,180 @@ static struct image_partition_entry read_file(const char *part_name, const char
 			len = ALIGN(len, 0x10000) + sizeof(jffs2_eof_mark);
 	}
 
-	struct image_partition_entry entry = alloc_image_partition(part_name, len);
+	struct image_partition_entry entry = {
+		.name = part_name,
+		.size = len,
+		.pad = len - in->size,
+		.jffs2_eof = add_jffs2_eof,
+		.borrowed = true,
+	};
 
-	FILE *file = fopen(filename, "rb");
-	if (!file)
-		error(1, errno, "unable to open file `%s'", filename);
+	return entry;
+}
 
-	if (fread(entry.data, statbuf.st_size, 1, file) != 1)
-		error(1, errno, "unable to read file `%s'", filename);
+/** Returns a buffer of 0xff bytes to emit padding from */
+static const uint8_t *ff_block(size_t *len)
+{
+	static uint8_t buf[0x10000];
+	static bool init;
 
-	if (add_jffs2_eof) {
-		uint8_t *eof = entry.data + statbuf.st_size, *end = entry.data+entry.size;
+	if (!init) {
+		memset(buf, 0xff, sizeof(buf));
+		init = true;
+	}
 
-		memset(eof, 0xff, end - eof - sizeof(jffs2_eof_mark));
-		memcpy(end - sizeof(jffs2_eof_mark), jffs2_eof_mark, sizeof(jffs2_eof_mark));
+	*len = sizeof(buf);
+	return buf;
+}
+
+#define IMAGE_WRITER_IOV	64
+
+/** Output stream of the image generators
+ *
+ * Buffers are queued by reference and written out in pwritev() batches
+ * (writev() for unseekable outputs), optionally feeding everything into an
+ * MD5 context on the way. With fd < 0 nothing is written, which is used to
+ * hash an image before streaming it into a pipe. With update set the output
+ * holds an earlier build and only the blocks that changed are written. */
+struct image_writer {
+	int fd;
+	bool seekable;
+	bool update;
+	off_t offset;		/* output offset of the first queued buffer */
+	off_t pos;		/* output offset after the queued buffers */
+	MD5_CTX *md5;
+	struct iovec iov[IMAGE_WRITER_IOV];
+	int iovcnt;
+};
+
+static void writer_init(struct image_writer *w, int fd)
+{
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->seekable = fd >= 0 && lseek(fd, 0, SEEK_CUR) >= 0;
+}
+
+static void writer_flush(struct image_writer *w)
+{
+	struct iovec *iov = w->iov;
+	int cnt = w->iovcnt;
+
+	for (; w->update && cnt; iov++, cnt--) {
+		int err = fw_io_pwrite_changed(w->fd, iov->iov_base, iov->iov_len, w->offset, NULL);
+
+		if (err)
+			error(1, -err, "unable to write output file");
+		w->offset += iov->iov_len;
 	}
 
-	fclose(file);
+	while (cnt) {
+		ssize_t ret;
 
-	return entry;
+		if (w->seekable)
+			ret = pwritev(w->fd, iov, cnt, w->offset);
+		else
+			ret = writev(w->fd, iov, cnt);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			error(1, ret ? errno : EIO, "unable to write output file");
+
+		w->offset += ret;
+		while (cnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	w->iovcnt = 0;
+	w->offset = w->pos;
+}
+
+/** Queues len bytes of buf, which must stay valid until the next flush */
+static void writer_write(struct image_writer *w, const void *buf, size_t len)
+{
+	if (!len)
+		return;
+
+	if (w->md5)
+		MD5_Update(w->md5, buf, len);
+
+	w->pos += len;
+	if (w->fd < 0) {
+		w->offset = w->pos;
+		return;
+	}
+
+	w->iov[w->iovcnt].iov_base = (void *)buf;
+	w->iov[w->iovcnt].iov_len = len;
+	if (++w->iovcnt == IMAGE_WRITER_IOV)
+		writer_flush(w);
+}
+
+static void writer_fill(struct image_writer *w, size_t len)
+{
+	size_t n;
+	const uint8_t *ff = ff_block(&n);
+
+	while (len) {
+		if (n > len)
+			n = len;
+		writer_write(w, ff, n);
+		len -= n;
+	}
+}
+
+static void writer_seek(struct image_writer *w, off_t offset)
+{
+	if (offset == w->pos)
+		return;
+
+	if (w->fd >= 0 && !w->seekable)
+		error(1, ESPIPE, "unable to write output file");
+
+	writer_flush(w);
+	w->offset = w->pos = offset;
+}
+
+/** Overwrites already flushed output, e.g. a checksum in a header */
+static void writer_pwrite(struct image_writer *w, const void *buf, size_t len, off_t offset)
+{
+	int err = 0;
+
+	if (w->update)
+		err = fw_io_pwrite_changed(w->fd, buf, len, offset, NULL);
+	else if (pwrite(w->fd, buf, len, offset) != (ssize_t)len)
+		err = errno ? -errno : -EIO;
+	if (err)
+		error(1, -err, "unable to write output file");
+}
+
+/** Cuts an updated earlier build off at the end of the new image */
+static void writer_truncate(struct image_writer *w, off_t len)
+{
+	if (w->update && ftruncate(w->fd, len))
+		error(1, errno, "unable to write output file");
+}
+
+static void writer_partition(struct image_writer *w, const struct image_partition_entry *part)
+{
+	writer_write(w, part->data, part->size - part->pad);
+
+	if (part->jffs2_eof) {
+		writer_fill(w, part->pad - sizeof(jffs2_eof_mark));
+		writer_write(w, jffs2_eof_mark, sizeof(jffs2_eof_mark));
+	} else {
+		writer_fill(w, part->pad);
+	}
 }
 
 /**
-   Copies a list of image partitions into an image buffer and generates the image partition table while doing so
+   Generates the image partition table for a list of image partitions
 
    Example image partition table:
 
@@ -3580,17 +4072,12 @@ static void put_partitions(uint8_t *buffer, const struct flash_partition_entry *
 	size_t base = SAFELOADER_PAYLOAD_TABLE_SIZE;
 	for (i = 0; parts[i].name; i++) {
 		for (j = 0; flash_parts[j].name; j++) {
-			if (!strcmp(flash_parts[j].name, parts[i].name)) {
-				if (parts[i].size > flash_parts[j].size)
-					error(1, 0, "%s partition too big (more than %u bytes)", flash_parts[j].name, (unsigned)flash_parts[j].size);
+			if (!strcmp(flash_parts[j].name, parts[i].name))
 				break;
-			}
 		}
 
 		assert(flash_parts[j].name);
 
-		memcpy(buffer + base, parts[i].data, parts[i].size);
-
 		size_t len = end-image_pt;
 		size_t w = snprintf(image_pt, len, "fwup-ptn %s base 0x%05x size 0x%05x\t\r\n", parts[i].name, (unsigned)base, (unsigned)parts[i].size);
 
@@ -3603,17 +4090,6 @@ static void put_partitions(uint8_t *buffer, const struct flash_partition_entry *
 	}
 }
 
-/** Generates and writes the image MD5 checksum */
-static void put_md5(uint8_t *md5, uint8_t *buffer, unsigned int len) {
-	MD5_CTX ctx;
-
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, md5_salt, (unsigned int)sizeof(md5_salt));
-	MD5_Update(&ctx, buffer, len);
-	MD5_Final(md5, &ctx);
-}
-
-
 /**
    Generates the firmware image in factory format
 
@@ -3629,60 +4105,132 @@ static void put_md5(uint8_t *md5, uint8_t *buffer, unsigned int len) {
      1014-1813    Image partition table (2048 bytes, padded with 0xff)
      1814-xxxx    Firmware partitions
 */
-static void * generate_factory_image(struct device_info *info, const struct image_partition_entry *parts, size_t *len) {
-	*len = SAFELOADER_PAYLOAD_OFFSET + SAFELOADER_PAYLOAD_TABLE_SIZE;
+static void write_factory_payload(struct image_writer *w, const struct meta_cache *meta, const uint8_t *table, const struct image_partition_entry *parts) {
+	MD5_CTX *md5 = w->md5;
+	size_t i;
+
+	/* The hash starts from the board's state after the vendor block */
+	w->md5 = NULL;
+	writer_write(w, meta->vendor->vendor, SAFELOADER_HEADER_SIZE);
+	w->md5 = md5;
+	writer_write(w, table, SAFELOADER_PAYLOAD_TABLE_SIZE);
+	for (i = 0; parts[i].name; i++)
+		writer_partition(w, &parts[i]);
+	writer_flush(w);
+}
+
+static void write_factory_image(int fd, bool update, struct device_info *info, const struct meta_cache *meta, const struct image_partition_entry *parts) {
+	uint8_t preamble[SAFELOADER_PREAMBLE_SIZE] = {};
+	uint8_t table[SAFELOADER_PAYLOAD_TABLE_SIZE];
+	struct image_writer w;
+	MD5_CTX ctx;
+	size_t len = SAFELOADER_PAYLOAD_OFFSET + SAFELOADER_PAYLOAD_TABLE_SIZE;
 
 	size_t i;
 	for (i = 0; parts[i].name; i++)
-		*len += parts[i].size;
+		len += parts[i].size;
 
-	uint8_t *image = malloc(*len);
-	if (!image)
-		error(1, errno, "malloc");
+	put32(preamble, len);
+
+	memset(table, 0xff, sizeof(table));
+	put_partitions(table, info->partitions, parts);
 
-	memset(image, 0xff, *len);
-	put32(image, *len);
+	writer_init(&w, fd);
+	w.update = update;
 
-	if (info->vendor) {
-		size_t vendor_len = strlen(info->vendor);
-		put32(image + SAFELOADER_PREAMBLE_SIZE, vendor_len);
-		memcpy(image + SAFELOADER_PREAMBLE_SIZE + 0x4, info->vendor, vendor_len);
+	/* A pipe can't be patched afterwards, so hash everything up front */
+	if (!w.seekable) {
+		struct image_writer dry;
+
+		writer_init(&dry, -1);
+		dry.md5 = &ctx;
+		MD5_Clone(&ctx, &meta->vendor->md5);
+		write_factory_payload(&dry, meta, table, parts);
+		MD5_Final(preamble + 0x04, &ctx);
 	}
 
-	put_partitions(image + SAFELOADER_PAYLOAD_OFFSET, info->partitions, parts);
-	put_md5(image + 0x04, image + SAFELOADER_PREAMBLE_SIZE, *len - SAFELOADER_PREAMBLE_SIZE);
+	writer_write(&w, preamble, sizeof(preamble));
 
-	return image;
-}
+	if (w.seekable) {
+		w.md5 = &ctx;
+		MD5_Clone(&ctx, &meta->vendor->md5);
+	}
 
-/**
-   Generates the firmware image in sysupgrade format
+	write_factory_payload(&w, meta, table, parts);
 
-   This makes some assumptions about the provided flash and image partition tables and
-   should be generalized when TP-LINK starts building its safeloader into hardware with
-   different flash layouts.
-*/
-static void * generate_sysupgrade_image(struct device_info *info, const struct image_partition_entry *image_parts, size_t *len) {
-	size_t i, j;
-	size_t flash_first_partition_index = 0;
-	size_t flash_last_partition_index = 0;
+	if (w.seekable) {
+		MD5_Final(preamble + 0x04, &ctx);
+		writer_pwrite(&w, preamble + 0x04, 16, 0x04);
+	}
+	writer_truncate(&w, w.pos);
+}
+
+/** Finds the first and last flash partitions of a sysupgrade image */
+static void sysupgrade_partition_range(const struct device_info *info, size_t *first, size_t *last) {
 	const struct flash_partition_entry *flash_first_partition = NULL;
 	const struct flash_partition_entry *flash_last_partition = NULL;
-	const struct image_partition_entry *image_last_partition = NULL;
+	size_t i;
 
-	/** Find first and last partitions */
+	*first = *last = 0;
 	for (i = 0; info->partitions[i].name; i++) {
 		if (!strcmp(info->partitions[i].name, info->first_sysupgrade_partition)) {
 			flash_first_partition = &info->partitions[i];
-			flash_first_partition_index = i;
+			*first = i;
 		} else if (!strcmp(info->partitions[i].name, info->last_sysupgrade_partition)) {
 			flash_last_partition = &info->partitions[i];
-			flash_last_partition_index = i;
+			*last = i;
 		}
 	}
 
 	assert(flash_first_partition && flash_last_partition);
-	assert(flash_first_partition_index < flash_last_partition_index);
+	assert(*first < *last);
+}
+
+/** Checks that every image partition fits its flash partition
+ * Only sizes are looked at, so this is done before any input is mapped or
+ * the output is touched. A sysupgrade image only holds the flash partitions
+ * from first_sysupgrade_partition to last_sysupgrade_partition. */
+static void check_image_fits(const struct device_info *info, const struct image_partition_entry *parts, bool sysupgrade) {
+	size_t first = 0, last = SIZE_MAX;
+	size_t i, j;
+
+	if (sysupgrade)
+		sysupgrade_partition_range(info, &first, &last);
+
+	for (i = 0; parts[i].name; i++) {
+		for (j = 0; info->partitions[j].name && j <= last; j++) {
+			if (strcmp(info->partitions[j].name, parts[i].name))
+				continue;
+
+			if (j >= first && parts[i].size > info->partitions[j].size)
+				error(1, 0, "%s partition too big (more than %u bytes)", info->partitions[j].name, (unsigned)info->partitions[j].size);
+			if (!sysupgrade)
+				break;
+		}
+	}
+}
+
+/**
+   Generates the firmware image in sysupgrade format
+
+   This makes some assumptions about the provided flash and image partition tables and
+   should be generalized when TP-LINK starts building its safeloader into hardware with
+   different flash layouts.
+*/
+static void write_sysupgrade_image(int fd, bool update, struct device_info *info, const struct image_partition_entry *image_parts) {
+	size_t i, j;
+	size_t flash_first_partition_index;
+	size_t flash_last_partition_index;
+	const struct flash_partition_entry *flash_first_partition;
+	const struct flash_partition_entry *flash_last_partition;
+	const struct image_partition_entry *image_last_partition = NULL;
+	struct image_writer w;
+	off_t end = 0;
+	size_t len;
+
+	sysupgrade_partition_range(info, &flash_first_partition_index, &flash_last_partition_index);
+	flash_first_partition = &info->partitions[flash_first_partition_index];
+	flash_last_partition = &info->partitions[flash_last_partition_index];
 
 	/** Find last partition from image to calculate needed size */
 	for (i = 0; image_parts[i].name; i++) {
@@ -3694,20 +4242,25 @@ static void * generate_sysupgrade_image(struct device_info *info, const struct i
 
 	assert(image_last_partition);
 
-	*len = flash_last_partition->base - flash_first_partition->base + image_last_partition->size;
+	len = flash_last_partition->base - flash_first_partition->base + image_last_partition->size;
 
-	uint8_t *image = malloc(*len);
-	if (!image)
-		error(1, errno, "malloc");
-
-	memset(image, 0xff, *len);
+	writer_init(&w, fd);
+	w.update = update;
 
 	for (i = flash_first_partition_index; i <= flash_last_partition_index; i++) {
 		for (j = 0; image_parts[j].name; j++) {
 			if (!strcmp(info->partitions[i].name, image_parts[j].name)) {
-				if (image_parts[j].size > info->partitions[i].size)
-					error(1, 0, "%s partition too big (more than %u bytes)", info->partitions[i].name, (unsigned)info->partitions[i].size);
-				memcpy(image + info->partitions[i].base - flash_first_partition->base, image_parts[j].data, image_parts[j].size);
+				/* Gaps between partitions are 0xff, later partitions win on overlap */
+				off_t offset = info->partitions[i].base - flash_first_partition->base;
+				if (offset > end) {
+					writer_seek(&w, end);
+					writer_fill(&w, offset - end);
+				} else {
+					writer_seek(&w, offset);
+				}
+				writer_partition(&w, &image_parts[j]);
+				if (w.pos > end)
+					end = w.pos;
 				break;
 			}
 
@@ -3715,18 +4268,31 @@ static void * generate_sysupgrade_image(struct device_info *info, const struct i
 		}
 	}
 
-	return image;
+	if ((off_t)len > end) {
+		writer_seek(&w, end);
+		writer_fill(&w, len - end);
+		end = len;
+	}
+	writer_flush(&w);
+	writer_truncate(&w, end);
 }
 
-/** Generates an image according to a given layout and writes it to a file */
+/** Generates an image according to a given layout and writes it to a file
+ * The board's entry is copied first, so several images may be built from
+ * the same board, also concurrently. With update, output is rebuilt over
+ * that earlier image, see fw_io_open_update(). */
 static void build_image(const char *output,
-		const char *kernel_image,
-		const char *rootfs_image,
+		const char *update,
+		struct input_file *kernel_image,
+		struct input_file *rootfs_image,
 		uint32_t rev,
 		bool add_jffs2_eof,
 		bool sysupgrade,
-		struct device_info *info) {
+		const struct device_info *board) {
 
+	struct device_info board_copy = *board;
+	struct device_info *info = &board_copy;
+	struct fw_trace t;
 	size_t i;
 
 	struct image_partition_entry parts[7] = {};
@@ -3736,6 +4302,8 @@ static void build_image(const char *output,
 	struct flash_partition_entry *file_system_partition = NULL;
 	size_t firmware_partition_index = 0;
 
+	fw_trace_begin(&t, "build_image");
+
 	set_partition_names(info);
 
 	for (i = 0; info->partitions[i].name; i++) {
@@ -3751,11 +4319,9 @@ static void build_image(const char *output,
 		os_image_partition = &info->partitions[firmware_partition_index];
 		file_system_partition = &info->partitions[firmware_partition_index + 1];
 
-		struct stat kernel;
-		if (stat(kernel_image, &kernel) < 0)
-			error(1, errno, "unable to stat file `%s'", kernel_image);
+		size_t kernel_size = kernel_image->size;
 
-		if (kernel.st_size > firmware_partition->size)
+		if (kernel_size > firmware_partition->size)
 			error(1, 0, "kernel overflowed firmware partition\n");
 
 		for (i = MAX_PARTITIONS-1; i >= firmware_partition_index + 1; i--)
@@ -3763,78 +4329,62 @@ static void build_image(const char *output,
 
 		file_system_partition->name = info->partition_names.file_system;
 
-		file_system_partition->base = firmware_partition->base + kernel.st_size;
+		file_system_partition->base = firmware_partition->base + kernel_size;
 
 		/* Align partition start to erase blocks for factory images only */
 		if (!sysupgrade)
-			file_system_partition->base = ALIGN(firmware_partition->base + kernel.st_size, 0x10000);
+			file_system_partition->base = ALIGN(firmware_partition->base + kernel_size, 0x10000);
 
 		file_system_partition->size = firmware_partition->size - file_system_partition->base;
 
 		os_image_partition->name = info->partition_names.os_image;
 
-		os_image_partition->size = kernel.st_size;
+		os_image_partition->size = kernel_size;
 	}
 
-	parts[0] = make_partition_table(info);
-	parts[1] = make_soft_version(info, rev);
-	parts[2] = make_support_list(info);
-	parts[3] = read_file(info->partition_names.os_image, kernel_image, false, NULL);
-	parts[4] = read_file(info->partition_names.file_system, rootfs_image, add_jffs2_eof, file_system_partition);
+	const struct meta_cache *meta = meta_cache_get(info);
 
-
-	/* Some devices need the extra-para partition to accept the firmware */
-	if (strcasecmp(info->id, "ARCHER-A6-V3") == 0 ||
-	    strcasecmp(info->id, "ARCHER-A7-V5") == 0 ||
-	    strcasecmp(info->id, "ARCHER-A9-V6") == 0 ||
-	    strcasecmp(info->id, "ARCHER-AX23-V1") == 0 ||
-	    strcasecmp(info->id, "ARCHER-C2-V3") == 0 ||
-	    strcasecmp(info->id, "ARCHER-C7-V4") == 0 ||
-	    strcasecmp(info->id, "ARCHER-C7-V5") == 0 ||
-	    strcasecmp(info->id, "ARCHER-C25-V1") == 0 ||
-	    strcasecmp(info->id, "ARCHER-C59-V2") == 0 ||
-	    strcasecmp(info->id, "ARCHER-C60-V2") == 0 ||
-	    strcasecmp(info->id, "ARCHER-C60-V3") == 0 ||
-	    strcasecmp(info->id, "ARCHER-C6U-V1") == 0 ||
-	    strcasecmp(info->id, "ARCHER-C6-V3") == 0 ||
-	    strcasecmp(info->id, "DECO-M4R-V4") == 0 ||
-	    strcasecmp(info->id, "MR70X") == 0 ||
-	    strcasecmp(info->id, "TLWR1043NV5") == 0) {
-		const uint8_t extra_para[2] = {0x01, 0x00};
-		parts[5] = make_extra_para(info, extra_para,
-			sizeof(extra_para));
-	} else if (strcasecmp(info->id, "ARCHER-C6-V2") == 0 ||
-		   strcasecmp(info->id, "TL-WA1201-V2") == 0) {
-		const uint8_t extra_para[2] = {0x00, 0x01};
-		parts[5] = make_extra_para(info, extra_para,
-			sizeof(extra_para));
-	} else if (strcasecmp(info->id, "ARCHER-C6-V2-US") == 0 ||
-		   strcasecmp(info->id, "EAP245-V3") == 0) {
-		const uint8_t extra_para[2] = {0x01, 0x01};
-		parts[5] = make_extra_para(info, extra_para,
-			sizeof(extra_para));
+	parts[0] = make_partition_table(info);
+	parts[1] = meta_cache_soft_version(meta, info, rev);
+	parts[2] = meta->support_list;
+	parts[3] = file_partition(info->partition_names.os_image, kernel_image, false, NULL);
+	parts[4] = file_partition(info->partition_names.file_system, rootfs_image, add_jffs2_eof, file_system_partition);
+	if (meta->extra_para.name)
+		parts[5] = meta->extra_para;
+
+	check_image_fits(info, parts, sysupgrade);
+	parts[3].data = map_input_file(kernel_image);
+	parts[4].data = map_input_file(rootfs_image);
+
+	int fd;
+
+	if (update) {
+		fd = fw_io_open_update(output, update);
+		if (fd < 0)
+			error(1, -fd, "unable to open output file `%s'", output);
+	} else {
+		fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0)
+			error(1, errno, "unable to open output file `%s'", output);
 	}
 
-	size_t len;
-	void *image;
+	struct fw_trace tw;
+
+	fw_trace_begin(&tw, "write_image");
 	if (sysupgrade)
-		image = generate_sysupgrade_image(info, parts, &len);
+		write_sysupgrade_image(fd, update, info, parts);
 	else
-		image = generate_factory_image(info, parts, &len);
-
-	FILE *file = fopen(output, "wb");
-	if (!file)
-		error(1, errno, "unable to open output file");
-
-	if (fwrite(image, len, 1, file) != 1)
-		error(1, 0, "unable to write output file");
+		write_factory_image(fd, update, info, meta, parts);
+	fw_trace_end(&tw, lseek(fd, 0, SEEK_END));
 
-	fclose(file);
-
-	free(image);
+	if (close(fd))
+		error(1, errno, "unable to write output file");
 
 	for (i = 0; parts[i].name; i++)
 		free_image_partition(&parts[i]);
+	part_arena_reset();
+
+	fw_trace_end(&t, kernel_image->size + rootfs_image->size);
 }
 
 /** Usage output */
@@ -3855,10 +4405,19 @@ static void usage(const char *argv0) {
 		"  -V <rev>        sets the revision number to <rev>\n"
 		"  -j              add jffs2 end-of-filesystem markers\n"
 		"  -S              create sysupgrade instead of factory image\n"
+		"  -U <file>       also write a sysupgrade image to <file>\n"
+		"  -u, --update <file>\n"
+		"                  only rewrite what differs from <file>, an earlier build of\n"
+		"                  the -o image\n"
+		"  -b <file>       build several images from the same kernel and rootfs,\n"
+		"                  one \"<board> <output> [factory|sysupgrade]\" per line\n"
 		"Extract an old image:\n"
 		"  -x <file>       extract all oem firmware partition\n"
 		"  -d <dir>        destination to extract the firmware partition\n"
-		"  -z <file>       convert an oem firmware into a sysupgade file. Use -o for output file\n",
+		"  -z <file>       convert an oem firmware into a sysupgade file. Use -o for output file\n"
+		"Inspect many images:\n"
+		"  -J <file>...    report partitions and versions of all images as JSON,\n"
+		"                  extracting each into <dir>/<file name> with -d <dir>\n",
 		argv0
 	);
 };
@@ -3866,13 +4425,134 @@ static void usage(const char *argv0) {
 
 static struct device_info *find_board(const char *id)
 {
-	struct device_info *board = NULL;
+	static struct fw_registry registry = FW_REGISTRY_INIT(boards, id, true);
 
-	for (board = boards; board->id != NULL; board++)
-		if (strcasecmp(id, board->id) == 0)
-			return board;
+	return fw_registry_find(&registry, id);
+}
 
-	return NULL;
+/** One image of a batch build */
+struct batch_job {
+	const struct device_info *info;
+	const char *output;
+	bool sysupgrade;
+};
+
+struct batch {
+	struct input_file *kernel_image;
+	struct input_file *rootfs_image;
+	uint32_t rev;
+	bool add_jffs2_eof;
+	struct batch_job *jobs;
+	size_t n_jobs;
+};
+
+static void batch_build_one(void *arg, unsigned int idx)
+{
+	const struct batch *b = arg;
+	const struct batch_job *job = &b->jobs[idx];
+
+	build_image(job->output, NULL, b->kernel_image, b->rootfs_image, b->rev,
+		    b->add_jffs2_eof, job->sysupgrade, job->info);
+}
+
+/** Reads a batch manifest: one "<board> <output> [factory|sysupgrade]" per
+ * line, '#' starts a comment. The image type defaults to -S. */
+static void read_batch(const char *manifest, bool sysupgrade, struct batch *b)
+{
+	char *line = NULL;
+	size_t line_len = 0, alloc = 0;
+	unsigned lineno = 0;
+	FILE *f;
+
+	f = fopen(manifest, "r");
+	if (!f)
+		error(1, errno, "unable to open batch file `%s'", manifest);
+
+	while (getline(&line, &line_len, f) >= 0) {
+		char *save, *board, *output, *type, *p;
+		struct batch_job *job;
+
+		lineno++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+
+		board = strtok_r(line, " \t\r\n", &save);
+		if (!board)
+			continue;
+		output = strtok_r(NULL, " \t\r\n", &save);
+		type = strtok_r(NULL, " \t\r\n", &save);
+		if (!output || strtok_r(NULL, " \t\r\n", &save))
+			error(1, 0, "%s:%u: expected <board> <output> [factory|sysupgrade]", manifest, lineno);
+
+		if (b->n_jobs == alloc) {
+			alloc = alloc ? 2 * alloc : 16;
+			b->jobs = realloc(b->jobs, alloc * sizeof(*b->jobs));
+			if (!b->jobs)
+				error(1, errno, "malloc");
+		}
+		job = &b->jobs[b->n_jobs++];
+
+		job->info = find_board(board);
+		if (!job->info)
+			error(1, 0, "%s:%u: unsupported board %s", manifest, lineno, board);
+
+		job->output = strdup(output);
+		if (!job->output)
+			error(1, errno, "malloc");
+
+		if (!type)
+			job->sysupgrade = sysupgrade;
+		else if (!strcmp(type, "factory"))
+			job->sysupgrade = false;
+		else if (!strcmp(type, "sysupgrade"))
+			job->sysupgrade = true;
+		else
+			error(1, 0, "%s:%u: unknown image type %s", manifest, lineno, type);
+	}
+
+	if (ferror(f))
+		error(1, errno, "unable to read batch file `%s'", manifest);
+
+	free(line);
+	fclose(f);
+}
+
+/** Builds the images of a batch on the worker pool */
+static void run_batch(const struct batch *b)
+{
+	size_t len;
+
+	/* Set up the shared padding block before any worker needs it */
+	ff_block(&len);
+
+	fw_pool_run(b->n_jobs, batch_build_one, (void *)b);
+}
+
+/** Builds every image of a batch manifest
+ * The kernel and rootfs are mapped once for all of them and the images are
+ * generated on the worker pool; only the per-board tables, headers and MD5
+ * are computed for each. */
+static void build_batch(const char *manifest,
+		struct input_file *kernel_image,
+		struct input_file *rootfs_image,
+		uint32_t rev,
+		bool add_jffs2_eof,
+		bool sysupgrade) {
+	struct batch b = {
+		.kernel_image = kernel_image,
+		.rootfs_image = rootfs_image,
+		.rev = rev,
+		.add_jffs2_eof = add_jffs2_eof,
+	};
+	size_t i;
+
+	read_batch(manifest, sysupgrade, &b);
+	run_batch(&b);
+
+	for (i = 0; i < b.n_jobs; i++)
+		free((char *)b.jobs[i].output);
+	free(b.jobs);
 }
 
 static int add_flash_partition(
@@ -3891,14 +4571,12 @@ static int add_flash_partition(
 			break;
 	}
 
-	if (ptr == max_entries) {
-		error(1, 0, "No free flash part entry available.");
-	}
+	if (ptr == max_entries)
+		return -ENOSPC;
 
 	part_list->name = calloc(1, strlen(name) + 1);
-	if (!part_list->name) {
-		error(1, 0, "Unable to allocate memory");
-	}
+	if (!part_list->name)
+		return -ENOMEM;
 
 	memcpy((char *)part_list->name, name, strlen(name));
 	part_list->base = base;
@@ -3913,19 +4591,22 @@ enum PARTITION_TABLE_TYPE {
 	PARTITION_TABLE_FLASH,
 };
 
-static int read_partition_table(
-		FILE *file, long offset,
+/**
+ * Parses a partition table from buf, which is SAFELOADER_PAYLOAD_TABLE_SIZE
+ * bytes long. Returns 1 if the table header is missing, 0 on success and a
+ * negative error code if the entries can't be parsed or stored. Never
+ * exits, so it is safe to use from the worker pool.
+ */
+static int parse_partition_table(
+		char *buf,
 		struct flash_partition_entry *entries, size_t max_entries,
 		int type)
 {
-	char buf[SAFELOADER_PAYLOAD_TABLE_SIZE];
 	char *ptr, *end;
 	const char *parthdr = NULL;
 	const char *fwuphdr = "fwup-ptn";
 	const char *flashhdr = "partition";
 
-	/* TODO: search for the partition table */
-
 	switch(type) {
 	case PARTITION_TABLE_FWUP:
 		parthdr = fwuphdr;
@@ -3934,25 +4615,17 @@ static int read_partition_table(
 		parthdr = flashhdr;
 		break;
 	default:
-		error(1, 0, "Invalid partition table");
+		return -EINVAL;
 	}
 
-	if (fseek(file, offset, SEEK_SET) < 0)
-		error(1, errno, "Can not seek in the firmware");
-
-	if (fread(buf, sizeof(buf), 1, file) != 1)
-		error(1, errno, "Can not read fwup-ptn from the firmware");
-
-	buf[sizeof(buf) - 1] = '\0';
+	buf[SAFELOADER_PAYLOAD_TABLE_SIZE - 1] = '\0';
 
 	/* look for the partition header */
-	if (memcmp(buf, parthdr, strlen(parthdr)) != 0) {
-		fprintf(stderr, "DEBUG: can not find fwuphdr\n");
+	if (memcmp(buf, parthdr, strlen(parthdr)) != 0)
 		return 1;
-	}
 
 	ptr = buf;
-	end = buf + sizeof(buf);
+	end = buf + SAFELOADER_PAYLOAD_TABLE_SIZE;
 	while ((ptr + strlen(parthdr)) < end &&
 			memcmp(ptr, parthdr, strlen(parthdr)) == 0) {
 		char *end_part;
@@ -3962,6 +4635,7 @@ static int read_partition_table(
 		int name_len = 0;
 		unsigned long base = 0;
 		unsigned long size = 0;
+		int ret;
 
 		end_part = memchr(ptr, '\n', (end - ptr));
 		if (end_part == NULL) {
@@ -3974,10 +4648,8 @@ static int read_partition_table(
 				break;
 
 			end_element = memchr(ptr, 0x20, (end_part - ptr));
-			if (end_element == NULL) {
-				error(1, errno, "Ignoring the rest of the partition entries.");
-				break;
-			}
+			if (end_element == NULL)
+				return -EINVAL;
 
 			switch (i) {
 				/* partition header */
@@ -4010,7 +4682,9 @@ static int read_partition_table(
 					size = strtoul(ptr, NULL, 16);
 					/* the part ends with 0x09, 0x0d, 0x0a */
 					ptr = end_part + 1;
-					add_flash_partition(entries, max_entries, name, base, size);
+					ret = add_flash_partition(entries, max_entries, name, base, size);
+					if (ret)
+						return ret;
 					continue;
 			}
 		}
@@ -4019,12 +4693,50 @@ static int read_partition_table(
 	return 0;
 }
 
+static int read_partition_table(
+		FILE *file, long offset,
+		struct flash_partition_entry *entries, size_t max_entries,
+		int type)
+{
+	char buf[SAFELOADER_PAYLOAD_TABLE_SIZE];
+	int ret;
+
+	/* TODO: search for the partition table */
+
+	if (type != PARTITION_TABLE_FWUP && type != PARTITION_TABLE_FLASH)
+		error(1, 0, "Invalid partition table");
+
+	if (fseek(file, offset, SEEK_SET) < 0)
+		error(1, errno, "Can not seek in the firmware");
+
+	if (fread(buf, sizeof(buf), 1, file) != 1)
+		error(1, errno, "Can not read fwup-ptn from the firmware");
+
+	ret = parse_partition_table(buf, entries, max_entries, type);
+	switch (ret) {
+	case 1:
+		fprintf(stderr, "DEBUG: can not find fwuphdr\n");
+		break;
+	case -ENOSPC:
+		error(1, 0, "No free flash part entry available.");
+		break;
+	case -ENOMEM:
+		error(1, 0, "Unable to allocate memory");
+		break;
+	case -EINVAL:
+		error(1, 0, "Ignoring the rest of the partition entries.");
+		break;
+	}
+
+	return ret;
+}
+
 static void safeloader_read_partition(FILE *input_file, size_t payload_offset,
 				      struct flash_partition_entry *entry,
 				      struct image_partition_entry *part)
 {
 	size_t part_size = entry->size;
-	void *part_data = malloc(part_size);
+	void *part_data = fw_mem_alloc(part_size);
 
 	if (fseek(input_file, payload_offset, SEEK_SET))
 		error(1, errno, "Failed to seek to partition data");
@@ -4040,21 +4752,12 @@ static void safeloader_read_partition(FILE *input_file, size_t payload_offset,
 	part->name = entry->name;
 }
 
-static void safeloader_parse_image(FILE *input_file, struct safeloader_image_info *image)
+/** Tells the image type from the 64 bytes following the preamble */
+static void safeloader_detect_type(const char *buf, struct safeloader_image_info *image)
 {
 	static const char *HEADER_ID_CLOUD = "fw-type:Cloud";
 	static const char *HEADER_ID_QNEW = "?NEW";
 
-	char buf[64];
-
-	if (!input_file)
-		return;
-
-	fseek(input_file, SAFELOADER_PREAMBLE_SIZE, SEEK_SET);
-
-	if (fread(buf, sizeof(buf), 1, input_file) != 1)
-		error(1, errno, "Can not read image header");
-
 	if (memcmp(HEADER_ID_QNEW, &buf[0], strlen(HEADER_ID_QNEW)) == 0)
 		image->type = SAFELOADER_TYPE_QNEW;
 	else if (memcmp(HEADER_ID_CLOUD, &buf[0], strlen(HEADER_ID_CLOUD)) == 0)
@@ -4074,54 +4777,60 @@ static void safeloader_parse_image(FILE *input_file, struct safeloader_image_inf
 		image->payload_offset = SAFELOADER_QNEW_PAYLOAD_OFFSET;
 		break;
 	}
+}
+
+static void safeloader_parse_image(FILE *input_file, struct safeloader_image_info *image)
+{
+	char buf[64];
+
+	if (!input_file)
+		return;
+
+	fseek(input_file, SAFELOADER_PREAMBLE_SIZE, SEEK_SET);
+
+	if (fread(buf, sizeof(buf), 1, input_file) != 1)
+		error(1, errno, "Can not read image header");
+
+	safeloader_detect_type(buf, image);
 
 	/* Parse image partition table */
 	read_partition_table(input_file, image->payload_offset, &image->entries[0],
 			     MAX_PARTITIONS, PARTITION_TABLE_FWUP);
 }
 
+/** Copies a partition of the input image to output_offset of the output file,
+ * kernel-side where possible */
 static void write_partition(
 		FILE *input_file,
 		size_t firmware_offset,
 		struct flash_partition_entry *entry,
-		FILE *output_file)
+		int output_fd,
+		off_t output_offset)
 {
-	char buf[4096];
-	size_t offset;
-
-	fseek(input_file, entry->base + firmware_offset, SEEK_SET);
-
-	for (offset = 0; sizeof(buf) + offset <= entry->size; offset += sizeof(buf)) {
-		if (fread(buf, sizeof(buf), 1, input_file) != 1)
-			error(1, errno, "Can not read partition from input_file");
-
-		if (fwrite(buf, sizeof(buf), 1, output_file) != 1)
-			error(1, errno, "Can not write partition to output_file");
-	}
-	/* write last chunk smaller than buffer */
-	if (offset < entry->size) {
-		offset = entry->size - offset;
-		if (fread(buf, offset, 1, input_file) != 1)
-			error(1, errno, "Can not read partition from input_file");
-		if (fwrite(buf, offset, 1, output_file) != 1)
-			error(1, errno, "Can not write partition to output_file");
-	}
+	ssize_t ret;
+
+	ret = fw_io_copy_fd(output_fd, output_offset, fileno(input_file),
+			    entry->base + firmware_offset, entry->size);
+	if (ret < 0)
+		error(1, -ret, "Can not write partition to output_file");
+	if (ret != entry->size)
+		error(1, EIO, "Can not read partition from input_file");
 }
 
 static int extract_firmware_partition(FILE *input_file, size_t firmware_offset, struct flash_partition_entry *entry, const char *output_directory)
 {
-	FILE *output_file;
+	int output_fd;
 	char output[PATH_MAX];
 
 	snprintf(output, PATH_MAX, "%s/%s", output_directory, entry->name);
-	output_file = fopen(output, "wb+");
-	if (output_file == NULL) {
+	output_fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (output_fd < 0) {
 		error(1, errno, "Can not open output file %s", output);
 	}
 
-	write_partition(input_file, firmware_offset, entry, output_file);
+	write_partition(input_file, firmware_offset, entry, output_fd, 0);
 
-	fclose(output_file);
+	close(output_fd);
 
 	return 0;
 }
@@ -4160,7 +4869,7 @@ static struct flash_partition_entry *find_partition(
 		struct flash_partition_entry *entries, size_t max_entries,
 		const char *name, const char *error_msg)
 {
-	for (size_t i = 0; i < max_entries; i++, entries++) {
+	for (size_t i = 0; i < max_entries && entries->name; i++, entries++) {
 		if (strcmp(entries->name, name) == 0)
 			return entries;
 	}
@@ -4276,24 +4985,15 @@ static int firmware_info(const char *input)
 	return 0;
 }
 
-static void write_ff(FILE *output_file, size_t size)
+/** Fills size bytes at offset of the output file with 0xff */
+static void write_ff(int output_fd, off_t offset, size_t size)
 {
-	char buf[4096];
-	size_t offset;
-
-	memset(buf, 0xff, sizeof(buf));
+	struct image_writer w;
 
-	for (offset = 0; offset + sizeof(buf) < size ; offset += sizeof(buf)) {
-		if (fwrite(buf, sizeof(buf), 1, output_file) != 1)
-			error(1, errno, "Can not write 0xff to output_file");
-	}
-
-	/* write last chunk smaller than buffer */
-	if (offset < size) {
-		offset = size - offset;
-		if (fwrite(buf, offset, 1, output_file) != 1)
-			error(1, errno, "Can not write partition to output_file");
-	}
+	writer_init(&w, output_fd);
+	writer_seek(&w, offset);
+	writer_fill(&w, size);
+	writer_flush(&w);
 }
 
 static void convert_firmware(const char *input, const char *output)
@@ -4307,8 +5007,8 @@ static void convert_firmware(const char *input, const char *output)
 	struct safeloader_image_info info = {};
 	size_t flash_table_offset;
 	struct stat statbuf;
-	FILE *output_file;
 	FILE *input_file;
+	int output_fd;
 
 	/* check input file */
 	if (stat(input, &statbuf)) {
@@ -4319,8 +5019,8 @@ static void convert_firmware(const char *input, const char *output)
 	if (!input_file)
 		error(1, 0, "Can not open input firmware %s", input);
 
-	output_file = fopen(output, "wb");
-	if (!output_file)
+	output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (output_fd < 0)
 		error(1, 0, "Can not open output firmware %s", output);
 
 	input_file = fopen(input, "rb");
@@ -4344,20 +5044,309 @@ static void convert_firmware(const char *input, const char *output)
 			"file-system", "Error can not find file-system partition (flash)");
 
 	/* write os_image to 0x0 */
-	write_partition(input_file, info.payload_offset, fwup_os_image, output_file);
-	write_ff(output_file, flash_os_image->size - fwup_os_image->size);
+	write_partition(input_file, info.payload_offset, fwup_os_image, output_fd, 0);
+	write_ff(output_fd, fwup_os_image->size, flash_os_image->size - fwup_os_image->size);
 
 	/* write file-system behind os_image */
-	fseek(output_file, flash_file_system->base - flash_os_image->base, SEEK_SET);
-	write_partition(input_file, info.payload_offset, fwup_file_system, output_file);
+	write_partition(input_file, info.payload_offset, fwup_file_system, output_fd,
+			flash_file_system->base - flash_os_image->base);
 
-	fclose(output_file);
+	close(output_fd);
 	fclose(input_file);
 }
 
+static void free_flash_partitions(struct flash_partition_entry *entries, size_t max_entries)
+{
+	for (size_t i = 0; i < max_entries && entries[i].name; i++)
+		free((char *)entries[i].name);
+}
+
+static void json_string(FILE *out, const char *s, size_t len)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < len && s[i]; i++) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", out);
+		else if (c == '\r')
+			fputs("\\r", out);
+		else if (c == '\t')
+			fputs("\\t", out);
+		else if (c < 0x20 || c >= 0x7f)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+static void json_partitions(FILE *out, const char *key, const struct flash_partition_entry *e)
+{
+	fprintf(out, ",\"%s\":[", key);
+	for (unsigned int i = 0; i < MAX_PARTITIONS && e[i].name; i++) {
+		fprintf(out, "%s{\"name\":", i ? "," : "");
+		json_string(out, e[i].name, strlen(e[i].name));
+		fprintf(out, ",\"base\":%u,\"size\":%u}", e[i].base, e[i].size);
+	}
+	fputc(']', out);
+}
+
+static const char *safeloader_type_name(enum safeloader_image_type type)
+{
+	switch (type) {
+	case SAFELOADER_TYPE_VENDOR:
+		return "vendor";
+	case SAFELOADER_TYPE_CLOUD:
+		return "cloud";
+	case SAFELOADER_TYPE_QNEW:
+		return "qnew";
+	default:
+		return "default";
+	}
+}
+
+/** One image of a corpus report */
+struct corpus_job {
+	const char *input;
+	const char *output_directory;
+	char *report;
+	size_t report_len;
+	bool failed;
+};
+
+/** Data and length of a partition's meta_header payload, NULL if it doesn't fit */
+static const uint8_t *corpus_meta(const struct fw_io_map *map, size_t payload_offset,
+				  const struct flash_partition_entry *e, size_t *len)
+{
+	const uint8_t *data = map->data + payload_offset + e->base;
+	size_t data_len;
+
+	if (payload_offset + e->base + (uint64_t)e->size > map->len ||
+	    e->size < sizeof(struct meta_header))
+		return NULL;
+
+	data_len = ntohl(((const struct meta_header *)data)->length);
+	*len = data_len < e->size - sizeof(struct meta_header) ?
+	       data_len : e->size - sizeof(struct meta_header);
+
+	return data + sizeof(struct meta_header);
+}
+
+static const char *corpus_extract(const struct corpus_job *job, int fd, const struct safeloader_image_info *info)
+{
+	char dir[PATH_MAX], output[PATH_MAX];
+	const char *name = strrchr(job->input, '/');
+
+	name = name ? name + 1 : job->input;
+	if (snprintf(dir, sizeof(dir), "%s/%s", job->output_directory, name) >= sizeof(dir))
+		return "output path too long";
+	if (mkdir(dir, 0777) && errno != EEXIST)
+		return "can not create output directory";
+
+	for (size_t i = 0; i < MAX_PARTITIONS && info->entries[i].name; i++) {
+		const struct flash_partition_entry *e = &info->entries[i];
+		ssize_t ret;
+		int output_fd;
+
+		/* Names come from the image, keep them inside dir */
+		if (strchr(e->name, '/') || !strcmp(e->name, ".") || !strcmp(e->name, ".."))
+			return "invalid partition name";
+		if (snprintf(output, sizeof(output), "%s/%s", dir, e->name) >= sizeof(output))
+			return "output path too long";
+		output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (output_fd < 0)
+			return "can not open output file";
+
+		ret = fw_io_copy_fd(output_fd, 0, fd, info->payload_offset + e->base, e->size);
+		close(output_fd);
+		if (ret != e->size)
+			return "can not extract partition";
+	}
+
+	return NULL;
+}
+
+static const char *corpus_report(FILE *out, const struct corpus_job *job, int fd, const struct fw_io_map *map)
+{
+	struct flash_partition_entry flash[MAX_PARTITIONS] = {};
+	struct safeloader_image_info info = {};
+	char table[SAFELOADER_PAYLOAD_TABLE_SIZE];
+	const struct flash_partition_entry *e;
+	const char *msg = NULL;
+	const uint8_t *buf;
+	size_t data_len;
+
+	if (map->len < SAFELOADER_PREAMBLE_SIZE + 64)
+		return "image too small";
+
+	safeloader_detect_type((const char *)map->data + SAFELOADER_PREAMBLE_SIZE, &info);
+	fprintf(out, ",\"type\":\"%s\"", safeloader_type_name(info.type));
+
+	if (info.payload_offset + sizeof(table) > map->len)
+		return "image too small";
+	memcpy(table, map->data + info.payload_offset, sizeof(table));
+	if (parse_partition_table(table, info.entries, MAX_PARTITIONS, PARTITION_TABLE_FWUP)) {
+		msg = "can not parse the partition table (fwup)";
+		goto out;
+	}
+
+	if (info.type == SAFELOADER_TYPE_VENDOR) {
+		data_len = ntohl(*(const uint32_t *)(map->data + SAFELOADER_PREAMBLE_SIZE));
+		if (data_len > SAFELOADER_HEADER_SIZE - 4)
+			data_len = SAFELOADER_HEADER_SIZE - 4;
+		fprintf(out, ",\"vendor\":");
+		json_string(out, (const char *)map->data + SAFELOADER_PREAMBLE_SIZE + 4, data_len);
+	}
+
+	json_partitions(out, "partitions", info.entries);
+
+	e = find_partition(info.entries, MAX_PARTITIONS, "soft-version", NULL);
+	if (e && (buf = corpus_meta(map, info.payload_offset, e, &data_len))) {
+		const struct soft_version *v = (const struct soft_version *)buf;
+		unsigned int ascii_len = 0;
+
+		while (ascii_len < data_len && isascii(buf[ascii_len]))
+			ascii_len++;
+
+		fprintf(out, ",\"soft_version\":");
+		if (ascii_len == data_len)
+			json_string(out, (const char *)buf, data_len);
+		else if (data_len >= offsetof(struct soft_version, rev) + sizeof(v->rev))
+			fprintf(out, "{\"version\":\"%d.%d.%d\",\"date\":\"%02x%02x-%02x-%02x\",\"revision\":%u}",
+				v->version_major, v->version_minor, v->version_patch,
+				v->year_hi, v->year_lo, v->month, v->day, ntohl(v->rev));
+		else
+			fprintf(out, "null");
+	}
+
+	e = find_partition(info.entries, MAX_PARTITIONS, "support-list", NULL);
+	if (e && (buf = corpus_meta(map, info.payload_offset, e, &data_len))) {
+		fprintf(out, ",\"support_list\":");
+		json_string(out, (const char *)buf, data_len);
+	}
+
+	e = find_partition(info.entries, MAX_PARTITIONS, "partition-table", NULL);
+	if (e) {
+		size_t flash_table_offset = info.payload_offset + e->base + 4;
+
+		if (flash_table_offset + sizeof(table) > map->len) {
+			msg = "can not read the partition table (flash)";
+			goto out;
+		}
+		memcpy(table, map->data + flash_table_offset, sizeof(table));
+		if (parse_partition_table(table, flash, MAX_PARTITIONS, PARTITION_TABLE_FLASH)) {
+			msg = "can not parse the partition table (flash)";
+			goto out;
+		}
+		json_partitions(out, "flash_partitions", flash);
+	}
+
+	if (job->output_directory)
+		msg = corpus_extract(job, fd, &info);
+
+out:
+	free_flash_partitions(flash, MAX_PARTITIONS);
+	free_flash_partitions(info.entries, MAX_PARTITIONS);
+
+	return msg;
+}
+
+static void corpus_job(void *arg, unsigned int idx)
+{
+	struct corpus_job *job = (struct corpus_job *)arg + idx;
+	struct fw_io_map map = {};
+	const char *msg = NULL;
+	struct stat st;
+	FILE *out;
+	int fd;
+
+	out = open_memstream(&job->report, &job->report_len);
+	if (!out) {
+		job->failed = true;
+		return;
+	}
+
+	fprintf(out, "{\"image\":");
+	json_string(out, job->input, strlen(job->input));
+
+	fd = open(job->input, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		msg = strerror(errno);
+	else if (fw_io_map(&map, fd, 0, st.st_size))
+		msg = "can not map image";
+	else
+		msg = corpus_report(out, job, fd, &map);
+
+	if (msg) {
+		fprintf(out, ",\"error\":");
+		json_string(out, msg, strlen(msg));
+		job->failed = true;
+	}
+	fputc('}', out);
+	fclose(out);
+
+	fw_io_unmap(&map);
+	if (fd >= 0)
+		close(fd);
+}
+
+/**
+ * Reports on (and with an output directory extracts) many images at once.
+ * Every image is parsed from a mapping on the worker pool; the reports are
+ * printed as one JSON array in the order given.
+ */
+static int corpus_info(char **inputs, int n, const char *output_directory)
+{
+	struct corpus_job *jobs;
+	struct stat statbuf;
+	int ret = 0;
+
+	if (output_directory && (stat(output_directory, &statbuf) || !S_ISDIR(statbuf.st_mode)))
+		error(1, errno, "Given output directory is not a directory %s", output_directory);
+
+	jobs = calloc(n, sizeof(*jobs));
+	if (!jobs)
+		error(1, ENOMEM, "Failed to allocate corpus jobs");
+
+	for (int i = 0; i < n; i++) {
+		jobs[i].input = inputs[i];
+		jobs[i].output_directory = output_directory;
+	}
+
+	fw_pool_run(n, corpus_job, jobs);
+
+	printf("[");
+	for (int i = 0; i < n; i++) {
+		printf("%s\n", i ? "," : "");
+		if (jobs[i].report)
+			fwrite(jobs[i].report, 1, jobs[i].report_len, stdout);
+		else
+			printf("null");
+		if (jobs[i].failed)
+			ret = 1;
+		free(jobs[i].report);
+	}
+	printf("\n]\n");
+
+	free(jobs);
+
+	return ret;
+}
+
+static const struct option long_options[] = {
+	{ "update", required_argument, NULL, 'u' },
+	{ }
+};
+
 int main(int argc, char *argv[]) {
 	const char *info_image = NULL, *board = NULL, *kernel_image = NULL, *rootfs_image = NULL, *output = NULL;
 	const char *extract_image = NULL, *output_directory = NULL, *convert_image = NULL;
+	const char *batch_file = NULL, *sysupgrade_output = NULL, *update_image = NULL;
+	struct input_file kernel, rootfs;
+	bool corpus = false;
 	bool add_jffs2_eof = false, sysupgrade = false;
 	unsigned rev = 0;
 	struct device_info *info;
@@ -4366,7 +5355,7 @@ int main(int argc, char *argv[]) {
 	while (true) {
 		int c;
 
-		c = getopt(argc, argv, "i:B:k:r:o:V:jSh:x:d:z:");
+		c = getopt_long(argc, argv, "i:B:b:k:r:o:V:jSU:u:h:x:d:z:J", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -4379,6 +5368,10 @@ int main(int argc, char *argv[]) {
 			board = optarg;
 			break;
 
+		case 'b':
+			batch_file = optarg;
+			break;
+
 		case 'k':
 			kernel_image = optarg;
 			break;
@@ -4403,6 +5396,14 @@ int main(int argc, char *argv[]) {
 			sysupgrade = true;
 			break;
 
+		case 'U':
+			sysupgrade_output = optarg;
+			break;
+
+		case 'u':
+			update_image = optarg;
+			break;
+
 		case 'h':
 			usage(argv[0]);
 			return 0;
@@ -4419,13 +5420,21 @@ int main(int argc, char *argv[]) {
 			convert_image = optarg;
 			break;
 
+		case 'J':
+			corpus = true;
+			break;
+
 		default:
 			usage(argv[0]);
 			return 1;
 		}
 	}
 
-	if (info_image) {
+	if (corpus) {
+		if (optind == argc)
+			error(1, 0, "No images given for -J");
+		return corpus_info(argv + optind, argc - optind, output_directory);
+	} else if (info_image) {
 		firmware_info(info_image);
 	} else if (extract_image || output_directory) {
 		if (!extract_image)
@@ -4437,6 +5446,19 @@ int main(int argc, char *argv[]) {
 		if (!output)
 			error(1, 0, "Can not convert a factory/oem image into sysupgrade image without output file. Use -o <file>");
 		convert_firmware(convert_image, output);
+	} else if (batch_file) {
+		if (update_image)
+			error(1, 0, "--update only works for a single image, not with -b");
+		if (!kernel_image)
+			error(1, 0, "no kernel image has been specified");
+		if (!rootfs_image)
+			error(1, 0, "no rootfs image has been specified");
+
+		open_input_file(&kernel, kernel_image);
+		open_input_file(&rootfs, rootfs_image);
+		build_batch(batch_file, &kernel, &rootfs, rev, add_jffs2_eof, sysupgrade);
+		close_input_file(&kernel);
+		close_input_file(&rootfs);
 	} else {
 		if (!board)
 			error(1, 0, "no board has been specified");
@@ -4452,7 +5474,32 @@ int main(int argc, char *argv[]) {
 		if (info == NULL)
 			error(1, 0, "unsupported board %s", board);
 
-		build_image(output, kernel_image, rootfs_image, rev, add_jffs2_eof, sysupgrade, info);
+		if (update_image && sysupgrade_output)
+			error(1, 0, "--update only works for a single image, not with -U");
+
+		open_input_file(&kernel, kernel_image);
+		open_input_file(&rootfs, rootfs_image);
+		if (sysupgrade_output) {
+			/* Both images come from the same mapped partitions */
+			struct batch_job jobs[2] = {
+				{ .info = info, .output = output, .sysupgrade = sysupgrade },
+				{ .info = info, .output = sysupgrade_output, .sysupgrade = true },
+			};
+			struct batch b = {
+				.kernel_image = &kernel,
+				.rootfs_image = &rootfs,
+				.rev = rev,
+				.add_jffs2_eof = add_jffs2_eof,
+				.jobs = jobs,
+				.n_jobs = 2,
+			};
+
+			run_batch(&b);
+		} else {
+			build_image(output, update_image, &kernel, &rootfs, rev, add_jffs2_eof, sysupgrade, info);
+		}
+		close_input_file(&kernel);
+		close_input_file(&rootfs);
 	}
 
 	return 0;
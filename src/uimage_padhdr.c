@@ -13,7 +13,9 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
-#include <zlib.h>
+
+#include "fw_crc32.h"
+#include "fw_io.h"
 
 
 /* from u-boot/include/image.h */
@@ -109,7 +111,8 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	filebuf = malloc(statbuf.st_size + padsz);
+	/* Only the header is rewritten, the payload is copied as is */
+	filebuf = calloc(1, sizeof(*imgh) + padsz);
 	if (!filebuf) {
 		fprintf(stderr, "buffer allocation failed\n");
 		exit(1);
@@ -122,24 +125,19 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	memset(&(filebuf[sizeof(*imgh)]), 0, padsz);
-
-	rsz = read(ifd, &(filebuf[sizeof(*imgh) + padsz]),
-				statbuf.st_size - sizeof(*imgh));
-	if (rsz != (int32_t)(statbuf.st_size - sizeof(*imgh))) {
-		fprintf(stderr,
-			"could not read input file (errno = %d).\n", errno);
-		exit(1);
-	}
-
 	imgh = (image_header_t *)filebuf;
 
+	/* The padding is zeros, so the header CRC just runs on over them */
 	imgh->ih_hcrc = 0;
-	crc_recalc = crc32(0, filebuf, sizeof(*imgh) + padsz);
+	crc_recalc = fw_crc32(~0u, filebuf, sizeof(*imgh));
+	crc_recalc = ~fw_crc32_shift(crc_recalc, padsz);
 	imgh->ih_hcrc = htonl(crc_recalc);
 
-	rsz = write(ofd, filebuf, statbuf.st_size + padsz);
-	if (rsz != (int32_t)statbuf.st_size + padsz) {
+	rsz = write(ofd, filebuf, sizeof(*imgh) + padsz);
+	if (rsz != (ssize_t)sizeof(*imgh) + padsz ||
+	    fw_io_copy_fd(ofd, sizeof(*imgh) + padsz, ifd, sizeof(*imgh),
+			  statbuf.st_size - sizeof(*imgh)) !=
+	    (ssize_t)(statbuf.st_size - sizeof(*imgh))) {
 		fprintf(stderr,
 			"could not write output file (errnor = %d).\n", errno);
 		exit(1);
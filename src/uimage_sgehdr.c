@@ -14,7 +14,9 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
-#include <zlib.h>
+
+#include "fw_crc32.h"
+#include "fw_io.h"
 
 
 /* from u-boot/include/image.h */
@@ -122,7 +124,8 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	filebuf = malloc(statbuf.st_size + padsz);
+	/* Only the header is rewritten, the payload is copied as is */
+	filebuf = calloc(1, OrignalHL + padsz);
 	if (!filebuf) {
 		fprintf(stderr, "buffer allocation failed\n");
 		exit(1);
@@ -135,29 +138,30 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	memset(&(filebuf[OrignalHL]), 0, padsz);
-
-	rsz = read(ifd, &(filebuf[sizeof(*imgh)]),
-				statbuf.st_size - OrignalHL);
-	if (rsz != (int32_t)(statbuf.st_size - OrignalHL)) {
-		fprintf(stderr,
-			"could not read input file (errno = %d).\n", errno);
-		exit(1);
-	}
-
 	imgh = (struct image_header *)filebuf;
 
 	imgh->ih_hcrc = 0;
 
+	/*
+	 * Run the CRC of the original header on over the zeroed extension,
+	 * then patch in just the bytes the SGE fields put there.
+	 */
+	crc_recalc = fw_crc32(~0u, filebuf, OrignalHL);
+	crc_recalc = ~fw_crc32_shift(crc_recalc, padsz);
+
 	strncpy(imgh->sgeih_p, model, sizeof(imgh->sgeih_p));
 	strncpy(imgh->sgeih_sv, sversion, sizeof(imgh->sgeih_sv));
 	strncpy(imgh->sgeih_hv, hversion, sizeof(imgh->sgeih_hv));
 
-	crc_recalc = crc32(0, filebuf, sizeof(*imgh));
+	crc_recalc = fw_crc32_patch(crc_recalc, sizeof(*imgh), OrignalHL,
+				    NULL, &filebuf[OrignalHL], padsz);
 	imgh->ih_hcrc = htonl(crc_recalc);
 
-	rsz = write(ofd, filebuf, statbuf.st_size + padsz);
-	if (rsz != (int32_t)statbuf.st_size + padsz) {
+	rsz = write(ofd, filebuf, OrignalHL + padsz);
+	if (rsz != OrignalHL + padsz ||
+	    fw_io_copy_fd(ofd, OrignalHL + padsz, ifd, OrignalHL,
+			  statbuf.st_size - OrignalHL) !=
+	    (ssize_t)(statbuf.st_size - OrignalHL)) {
 		fprintf(stderr,
 			"could not write output file (errnor = %d).\n", errno);
 		exit(1);
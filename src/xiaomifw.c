@@ -21,6 +21,7 @@
 #include <byteswap.h>
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -30,6 +31,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_pool.h"
+
 #if !defined(__BYTE_ORDER)
 #error "Unknown byte order"
 #endif
@@ -164,83 +169,8 @@ const int xiaomifw_device_id(const char *device_name) {
  * CRC32
  **************************************************/
 
-static const uint32_t crc32_tbl[] = {
-	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
-	0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
-	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
-	0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
-	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,
-	0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
-	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
-	0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940,
-	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116,
-	0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
-	0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
-	0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a,
-	0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818,
-	0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
-	0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
-	0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c,
-	0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
-	0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
-	0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
-	0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086,
-	0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4,
-	0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
-	0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
-	0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
-	0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe,
-	0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
-	0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
-	0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252,
-	0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60,
-	0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
-	0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
-	0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04,
-	0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a,
-	0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
-	0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
-	0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e,
-	0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
-	0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
-	0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
-	0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0,
-	0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6,
-	0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
-	0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
-};
-
 uint32_t xiaomifw_crc32(uint32_t crc, const void *buf, size_t len) {
-	const uint8_t *in = buf;
-
-	while (len) {
-		crc = crc32_tbl[(crc ^ *in) & 0xff] ^ (crc >> 8);
-		in++;
-		len--;
-	}
-
-	return crc;
+	return fw_crc32(crc, buf, len);
 }
 
 /**************************************************
@@ -280,12 +210,16 @@ static void xiaomifw_close(FILE *fp) {
  * Existing firmware parser
  **************************************************/
 
-static int xiaomifw_parse(FILE *fp, struct xiaomifw_info *info) {
+/*
+ * Parses the image from a mapping of the whole file, so only the CRC pass
+ * touches the data. Errors go to log, which lets several images be parsed
+ * at once without mixing up their messages. threads picks the worker pool
+ * CRC for a single large image over the plain one for many parallel ones.
+ */
+static int xiaomifw_parse(FILE *fp, struct xiaomifw_info *info, FILE *log, bool threads) {
 	struct xiaomi_header *header = &info->header;
+	struct fw_io_map map;
 	struct stat st;
-	uint8_t buf[1024];
-	size_t length;
-	size_t bytes;
 	int i;
 	int err = 0;
 
@@ -295,47 +229,49 @@ static int xiaomifw_parse(FILE *fp, struct xiaomifw_info *info) {
 
 	if (fstat(fileno(fp), &st)) {
 		err = -errno;
-		fprintf(stderr, "Failed to fstat: %d\n", err);
+		fprintf(log, "Failed to fstat: %d\n", err);
 		return err;
 	}
 	info->file_size = st.st_size;
 
 	/* Header */
 
-	if (fread(header, 1, sizeof(*header), fp) != sizeof(*header)) {
-		fprintf(stderr, "Failed to read Xiaomi header\n");
+	if (info->file_size < sizeof(*header)) {
+		fprintf(log, "Failed to read Xiaomi header\n");
 		return -EIO;
 	}
 
+	err = fw_io_map(&map, fileno(fp), 0, info->file_size);
+	if (err) {
+		fprintf(log, "Failed to map Xiaomi firmware image: %d\n", err);
+		return err;
+	}
+
+	memcpy(header, map.data, sizeof(*header));
+
 	if (strncmp(header->magic, "HDR1", 4)) {
-		fprintf(stderr, "Invalid Xiaomi header magic\n");
-		return -EPROTO;
+		fprintf(log, "Invalid Xiaomi header magic\n");
+		err = -EPROTO;
+		goto out;
 	}
 	info->signature_offset = le32_to_cpu(header->signature_offset);
 
 	/* CRC32 */
 
-	fseek(fp, 12, SEEK_SET);
-
-	info->crc32 = 0xffffffff;
-	length = info->file_size - 12;
-	while (length && (bytes = fread(buf, 1, xiaomifw_min(sizeof(buf), length), fp)) > 0) {
-		info->crc32 = xiaomifw_crc32(info->crc32, buf, bytes);
-		length -= bytes;
-	}
-	if (length) {
-		fprintf(stderr, "Failed to read last %zd B of data\n", length);
-		return -EIO;
-	}
+	if (threads)
+		info->crc32 = fw_crc32_parallel(0xffffffff, map.data + 12, info->file_size - 12);
+	else
+		info->crc32 = xiaomifw_crc32(0xffffffff, map.data + 12, info->file_size - 12);
 
 	if (info->crc32 != le32_to_cpu(header->crc32)) {
-		fprintf(stderr, "Invalid data crc32: 0x%08x instead of 0x%08x\n", info->crc32, le32_to_cpu(header->crc32));
-		return -EPROTO;
+		fprintf(log, "Invalid data crc32: 0x%08x instead of 0x%08x\n", info->crc32, le32_to_cpu(header->crc32));
+		err = -EPROTO;
+		goto out;
 	}
 
 	/* Blobs */
 
-	for (i = 0; i < sizeof(info->blobs); i++) {
+	for (i = 0; i < sizeof(info->blobs) / sizeof(info->blobs[0]); i++) {
 		size_t offset = le32_to_cpu(info->header.blob_offsets[i]);
 		struct xiaomifw_blob_info *file_info = &info->blobs[i];
 
@@ -343,66 +279,55 @@ static int xiaomifw_parse(FILE *fp, struct xiaomifw_info *info) {
 			break;
 		}
 
-		fseek(fp, offset, SEEK_SET);
-
-		if (fread(&file_info->header, 1, sizeof(file_info->header), fp) != sizeof(file_info->header)) {
-			fprintf(stderr, "Failed to read file Xiaomi header\n");
-			return -EIO;
+		if (offset + sizeof(file_info->header) > info->file_size) {
+			fprintf(log, "Failed to read file Xiaomi header\n");
+			err = -EIO;
+			goto out;
 		}
+		memcpy(&file_info->header, map.data + offset, sizeof(file_info->header));
 
 		file_info->offset = offset;
 		file_info->size = le32_to_cpu(file_info->header.size);
-
-		offset += sizeof(file_info->header) + file_info->size;
-		offset = (offset + 4) & ~(0x4 - 1);
 	}
 
-	return 0;
+out:
+	fw_io_unmap(&map);
+	return err;
 }
 
 /**************************************************
  * Info
  **************************************************/
 
-static int xiaomifw_info(int argc, char **argv) {
+static int xiaomifw_info_one(const char *pathname, FILE *out, FILE *log, bool threads) {
 	struct xiaomifw_info info;
-	const char *pathname = NULL;
 	uint16_t device_id;
 	FILE *fp;
 	int i;
-	int c;
 	int err = 0;
 
-	while ((c = getopt(argc, argv, "i:")) != -1) {
-		switch (c) {
-		case 'i':
-			pathname = optarg;
-			break;
-		}
-	}
-
 	fp = xiaomifw_open(pathname, "r");
 	if (!fp) {
-		fprintf(stderr, "Failed to open Xiaomi firmware image\n");
+		fprintf(log, "Failed to open Xiaomi firmware image\n");
 		err = -EACCES;
 		goto out;
 	}
 
-	err = xiaomifw_parse(fp, &info);
+	err = xiaomifw_parse(fp, &info, log, threads);
 	if (err) {
-		fprintf(stderr, "Failed to parse Xiaomi firmware image\n");
+		fprintf(log, "Failed to parse Xiaomi firmware image\n");
 		goto err_close;
 	}
 
 	device_id = le16_to_cpu(info.header.device_id);
 
-	printf("Device ID: 0x%04x (%s)\n", device_id, xiaomifw_device_name(device_id));
-	printf("CRC32: 0x%08x\n", info.crc32);
-	printf("Signature offset: 0x%08zx\n", info.signature_offset);
-	for (i = 0; i < sizeof(info.blobs) && info.blobs[i].offset; i++) {
+	fprintf(out, "Device ID: 0x%04x (%s)\n", device_id, xiaomifw_device_name(device_id));
+	fprintf(out, "CRC32: 0x%08x\n", info.crc32);
+	fprintf(out, "Signature offset: 0x%08zx\n", info.signature_offset);
+	for (i = 0; i < sizeof(info.blobs) / sizeof(info.blobs[0]) && info.blobs[i].offset; i++) {
 		struct xiaomifw_blob_info *file_info = &info.blobs[i];
 
-		printf("[Blob %d] offset:0x%08zx flash_offset:0x%08x size:0x%08zx type:0x%04x name:%s\n", i, file_info->offset, file_info->header.flash_offset, file_info->size, file_info->header.type, file_info->header.name);
+		fprintf(out, "[Blob %d] offset:0x%08zx flash_offset:0x%08x size:0x%08zx type:0x%04x name:%s\n", i, file_info->offset, file_info->header.flash_offset, file_info->size, file_info->header.type, file_info->header.name);
 	}
 
 err_close:
@@ -411,45 +336,169 @@ out:
 	return err;
 }
 
+struct xiaomifw_info_job {
+	const char *pathname;
+	char *out;
+	size_t out_len;
+	char *log;
+	size_t log_len;
+	int err;
+};
+
+static void xiaomifw_info_job(void *arg, unsigned int idx) {
+	struct xiaomifw_info_job *job = (struct xiaomifw_info_job *)arg + idx;
+	FILE *out, *log;
+
+	out = open_memstream(&job->out, &job->out_len);
+	log = open_memstream(&job->log, &job->log_len);
+	if (!out || !log) {
+		if (out)
+			fclose(out);
+		if (log)
+			fclose(log);
+		job->err = -ENOMEM;
+		return;
+	}
+
+	job->err = xiaomifw_info_one(job->pathname, out, log, false);
+
+	fclose(out);
+	fclose(log);
+}
+
+/* Every image on its own thread, printed in the order given */
+static int xiaomifw_info_many(char **pathnames, int n) {
+	struct xiaomifw_info_job *jobs;
+	int i;
+	int err = 0;
+
+	jobs = calloc(n, sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++)
+		jobs[i].pathname = pathnames[i];
+
+	fw_pool_run(n, xiaomifw_info_job, jobs);
+
+	for (i = 0; i < n; i++) {
+		struct xiaomifw_info_job *job = &jobs[i];
+
+		printf("%s%s:\n", i ? "\n" : "", job->pathname);
+		fflush(stdout);
+		if (job->out)
+			fwrite(job->out, 1, job->out_len, stdout);
+		fflush(stdout);
+		if (job->log)
+			fwrite(job->log, 1, job->log_len, stderr);
+		if (job->err == -ENOMEM)
+			fprintf(stderr, "Out of memory\n");
+		if (job->err && !err)
+			err = job->err;
+
+		free(job->out);
+		free(job->log);
+	}
+
+	free(jobs);
+
+	return err;
+}
+
+static int xiaomifw_info(int argc, char **argv) {
+	char **pathnames;
+	int n = 0;
+	int c;
+	int err = 0;
+
+	pathnames = calloc(argc, sizeof(*pathnames));
+	if (!pathnames)
+		return -ENOMEM;
+
+	while ((c = getopt(argc, argv, "i:")) != -1) {
+		switch (c) {
+		case 'i':
+			pathnames[n++] = optarg;
+			break;
+		}
+	}
+	while (optind < argc)
+		pathnames[n++] = argv[optind++];
+
+	if (n > 1)
+		err = xiaomifw_info_many(pathnames, n);
+	else
+		err = xiaomifw_info_one(pathnames[0], stdout, stderr, true);
+
+	free(pathnames);
+
+	return err;
+}
+
 /**************************************************
  * Create
  **************************************************/
 
-static ssize_t xiaomifw_create_append_zeros(FILE *fp, size_t length) {
-	uint8_t *buf;
+/*
+ * Blob headers, blob data and the signature are collected as extents at
+ * their final offsets first and then written concurrently, each with its
+ * own CRC register started from zero. Blob files are cut into pieces so a
+ * single big one is spread over the pool as well. Alignment padding is
+ * left as holes.
+ */
+#define XIAOMIFW_PIECE_LEN	(8 * 1024 * 1024)
 
-	buf = malloc(length);
-	if (!buf)
-		return -ENOMEM;
-	memset(buf, 0, length);
+struct xiaomifw_create {
+	struct fw_io_extent *ext;
+	unsigned int n;
+	size_t offset;
+};
 
-	if (fwrite(buf, 1, length, fp) != length) {
-		fprintf(stderr, "Failed to write %zu B of zeros\n", length);
-		free(buf);
-		return -EIO;
-	}
+static int xiaomifw_create_add(struct xiaomifw_create *layout, int fd, void *buf, size_t len) {
+	size_t done = 0, n;
+	struct fw_io_extent *ext;
 
-	free(buf);
+	do {
+		n = len - done;
+		if (fd >= 0 && n > XIAOMIFW_PIECE_LEN)
+			n = XIAOMIFW_PIECE_LEN;
+
+		ext = realloc(layout->ext, (layout->n + 1) * sizeof(*ext));
+		if (!ext)
+			return -ENOMEM;
+		layout->ext = ext;
+
+		ext[layout->n++] = (struct fw_io_extent) {
+			.fd = fd,
+			.in_off = done,
+			.buf = buf,
+			.len = n,
+			.out_off = layout->offset,
+		};
+		layout->offset += n;
+		done += n;
+	} while (done < len);
 
-	return length;
+	return 0;
 }
 
-static ssize_t xiaomifw_create_append_file(FILE *fp, char *blob) {
+static ssize_t xiaomifw_create_append_file(struct xiaomifw_create *layout, char *blob) {
 	struct xiaomi_blob_header header = {
 		.magic = le32_to_cpu(0x0000babe),
 		.flash_offset = ~0,
 		.type = ~0,
 	};
+	struct xiaomi_blob_header *hdr_buf;
 	struct stat st;
 	char *in_path = NULL;
 	ssize_t length = 0;
+	void *data = NULL;
 	char *type = NULL;
 	char *resptr;
 	char *tok;
 	char *p;
-	uint8_t buf[1024];
-	size_t bytes;
-	FILE *in;
+	ssize_t bytes;
+	int in;
 	int err;
 	int i = 0;
 
@@ -487,18 +536,31 @@ static ssize_t xiaomifw_create_append_file(FILE *fp, char *blob) {
 		return -EPROTO;
 	}
 
-	in = fopen(in_path, "r");
-	if (!in) {
+	in = open(in_path, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
 		fprintf(stderr, "Failed to open %s\n", in_path);
 		return -EACCES;
 	}
 
-	if (fstat(fileno(in), &st)) {
+	if (fstat(in, &st)) {
 		err = -errno;
 		fprintf(stderr, "Failed to fstat: %d\n", err);
+		close(in);
 		return err;
 	}
-	header.size = cpu_to_le32(st.st_size);
+
+	if (S_ISREG(st.st_mode)) {
+		bytes = st.st_size;
+	} else {
+		bytes = fw_io_slurp(in, &data);
+		close(in);
+		in = -1;
+		if (bytes < 0) {
+			fprintf(stderr, "Failed to read %s\n", in_path);
+			return bytes;
+		}
+	}
+	header.size = cpu_to_le32(bytes);
 
 	if (*type) {
 		if (!strcmp(type, "uimage")) {
@@ -507,67 +569,72 @@ static ssize_t xiaomifw_create_append_file(FILE *fp, char *blob) {
 			header.type = cpu_to_le32(BLOB_TYPE_FW_UIMAGE2);
 		} else {
 			fprintf(stderr, "Unsupported blob type: %s\n", type);
+			if (in >= 0)
+				close(in);
+			free(data);
 			return -ENOENT;
 		}
 	}
 
-	bytes = fwrite(&header, 1, sizeof(header), fp);
-	if (bytes != sizeof(header)) {
-		fprintf(stderr, "Failed to write blob header\n");
-		return -EIO;
+	hdr_buf = malloc(sizeof(header));
+	if (!hdr_buf) {
+		if (in >= 0)
+			close(in);
+		free(data);
+		return -ENOMEM;
 	}
-	length += bytes;
+	memcpy(hdr_buf, &header, sizeof(header));
 
-	while ((bytes = fread(buf, 1, sizeof(buf), in)) > 0) {
-		if (fwrite(buf, 1, bytes, fp) != bytes) {
-			fprintf(stderr, "Failed to write %zu B of blob\n", bytes);
-			return -EIO;
-		}
-		length += bytes;
+	/* From here on the layout owns in, data and hdr_buf */
+	if (xiaomifw_create_add(layout, -1, hdr_buf, sizeof(header)) ||
+	    xiaomifw_create_add(layout, in, data, bytes)) {
+		if (in >= 0)
+			close(in);
+		free(data);
+		free(hdr_buf);
+		return -ENOMEM;
 	}
-
-	fclose(in);
+	length += sizeof(header) + bytes;
 
 	if (length & (BLOB_ALIGNMENT - 1)) {
 		size_t padding = BLOB_ALIGNMENT - (length % BLOB_ALIGNMENT);
 
-		bytes = xiaomifw_create_append_zeros(fp, padding);
-		if (bytes != padding) {
-			fprintf(stderr, "Failed to align blob\n");
-			return -EIO;
-		}
-		length += bytes;
+		if (xiaomifw_create_add(layout, -1, NULL, padding))
+			return -ENOMEM;
+		length += padding;
 	}
 
 	return length;
 }
 
-static ssize_t xiaomifw_create_write_signature(FILE *fp) {
-	struct xiaomi_signature_header header = {
-	};
-	size_t bytes;
+static ssize_t xiaomifw_create_write_signature(struct xiaomifw_create *layout) {
+	struct xiaomi_signature_header *header;
 
-	bytes = fwrite(&header, 1, sizeof(header), fp);
-	if (bytes != sizeof(header)) {
-		fprintf(stderr, "Failed to write blob header\n");
-		return -EIO;
+	header = calloc(1, sizeof(*header));
+	if (!header)
+		return -ENOMEM;
+
+	if (xiaomifw_create_add(layout, -1, header, sizeof(*header))) {
+		free(header);
+		return -ENOMEM;
 	}
 
-	return bytes;
+	return sizeof(*header);
 }
 
 static int xiaomifw_create(int argc, char **argv) {
 	struct xiaomi_header header = {
 		.magic = { 'H', 'D', 'R', '1' },
 	};
-	uint32_t crc32 = 0xffffffff;
-	uint8_t buf[1024];
+	struct xiaomifw_create layout = { .offset = sizeof(header) };
+	uint32_t data_crc32 = 0;
+	uint32_t crc32;
 	int blob_idx = 0;
-	ssize_t length;
+	unsigned int i;
 	ssize_t offset;
 	ssize_t bytes;
 	int device_id;
-	FILE *fp;
+	int fd;
 	int c;
 	int err = 0;
 
@@ -596,15 +663,14 @@ static int xiaomifw_create(int argc, char **argv) {
 			goto out;
 	}
 
-	fp = fopen(argv[2], "w+");
-	if (!fp) {
+	fd = open(argv[2], O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
 		fprintf(stderr, "Failed to open %s\n", argv[2]);
 		err = -EACCES;
 		goto out;
 	}
 
 	offset = sizeof(header);
-	fseek(fp, offset, SEEK_SET);
 
 	optind = 3;
 	while ((c = getopt(argc, argv, "m:b:")) != -1) {
@@ -612,12 +678,12 @@ static int xiaomifw_create(int argc, char **argv) {
 		case 'm':
 			break;
 		case 'b':
-			if (blob_idx >= sizeof(header.blob_offsets)) {
+			if (blob_idx >= sizeof(header.blob_offsets) / sizeof(header.blob_offsets[0])) {
 				err = -ENOENT;
 				fprintf(stderr, "Too many blobs specified\n");
 				goto err_close;
 			}
-			bytes = xiaomifw_create_append_file(fp, optarg);
+			bytes = xiaomifw_create_append_file(&layout, optarg);
 			if (bytes < 0) {
 				err = bytes;
 				fprintf(stderr, "Failed to append blob: %d\n", err);
@@ -631,7 +697,7 @@ static int xiaomifw_create(int argc, char **argv) {
 			goto err_close;
 	}
 
-	bytes = xiaomifw_create_write_signature(fp);
+	bytes = xiaomifw_create_write_signature(&layout);
 	if (bytes < 0) {
 		err = bytes;
 		fprintf(stderr, "Failed to write signature: %d\n", err);
@@ -640,31 +706,35 @@ static int xiaomifw_create(int argc, char **argv) {
 	header.signature_offset = cpu_to_le32(offset);
 	offset += bytes;
 
-	crc32 = xiaomifw_crc32(crc32, (uint8_t *)&header + 12, sizeof(header) - 12);
-	fseek(fp, sizeof(header), SEEK_SET);
-	length = offset - sizeof(header);
-	while (length && (bytes = fread(buf, 1, xiaomifw_min(sizeof(buf), length), fp)) > 0) {
-		crc32 = xiaomifw_crc32(crc32, buf, bytes);
-		length -= bytes;
-	}
-	if (length) {
-		err = -EIO;
-		fprintf(stderr, "Failed to calculate CRC32 over the last %zd B of data\n", length);
+	/* The extent CRCs are combined in file order, holes count as zeros */
+	err = fw_io_copy_extents_crc32(fd, layout.ext, layout.n, &data_crc32);
+	if (err) {
+		fprintf(stderr, "Failed to write blobs: %d\n", err);
 		goto err_close;
 	}
 
-	header.crc32 = cpu_to_le32(crc32);
+	/* Then put the header fields in front */
+	crc32 = xiaomifw_crc32(0xffffffff, (uint8_t *)&header + 12, sizeof(header) - 12);
+	crc32 = fw_crc32_combine(crc32, data_crc32, offset - sizeof(header));
 
-	rewind(fp);
+	header.crc32 = cpu_to_le32(crc32);
 
-	bytes = fwrite(&header, 1, sizeof(header), fp);
-	if (bytes != sizeof(header)) {
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
 		fprintf(stderr, "Failed to write header\n");
-		return -EIO;
+		err = -EIO;
 	}
 
 err_close:
-	fclose(fp);
+	/* Only the first piece of a blob file or buffer owns it */
+	for (i = 0; i < layout.n; i++) {
+		if (layout.ext[i].in_off)
+			continue;
+		if (layout.ext[i].fd >= 0)
+			close(layout.ext[i].fd);
+		free((void *)layout.ext[i].buf);
+	}
+	free(layout.ext);
+	close(fd);
 out:
 	return err;
 }
@@ -677,10 +747,9 @@ static int xiaomifw_extract(int argc, char **argv) {
 	struct xiaomifw_info info;
 	const char *pathname = NULL;
 	const char *name = NULL;
-	uint8_t buf[1024];
 	size_t offset = 0;
 	size_t size = 0;
-	size_t bytes;
+	ssize_t bytes;
 	FILE *fp;
 	int i;
 	int c;
@@ -710,7 +779,7 @@ static int xiaomifw_extract(int argc, char **argv) {
 		goto err_out;
 	}
 
-	err = xiaomifw_parse(fp, &info);
+	err = xiaomifw_parse(fp, &info, stderr, true);
 	if (err) {
 		fprintf(stderr, "Failed to parse Xiaomi firmware image\n");
 		goto err_close;
@@ -732,10 +801,9 @@ static int xiaomifw_extract(int argc, char **argv) {
 	}
 
 	fseek(fp, offset + sizeof(struct xiaomi_blob_header), SEEK_SET);
-	while (size && (bytes = fread(buf, 1, xiaomifw_min(sizeof(buf), size), fp)) > 0) {
-		fwrite(buf, bytes, 1, stdout);
+	bytes = fw_io_copy(stdout, fp, size, NULL, NULL);
+	if (bytes > 0)
 		size -= bytes;
-	}
 	if (size) {
 		err = -EIO;
 		fprintf(stderr, "Failed to read last %zd B of data\n", size);
@@ -756,8 +824,8 @@ static void usage() {
 	printf("Usage:\n");
 	printf("\n");
 	printf("Info about a Xiaomi firmware image:\n");
-	printf("\txiaomifw info <options>\n");
-	printf("\t-i <file>\t\t\t\t\tinput Xiaomi firmware image\n");
+	printf("\txiaomifw info <options> [<file>...]\n");
+	printf("\t-i <file>\t\t\t\t\tinput Xiaomi firmware image, several are checked in parallel\n");
 	printf("\n");
 	printf("Creating a new Xiaomi firmware image:\n");
 	printf("\txiaomifw create <file> [options]\n");
@@ -12,24 +12,12 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
+#include "fw_xor.h"
+
 static char default_pattern[] = "12345678";
 static int is_hex_pattern;
 
 
-int xor_data(void *data, size_t len, const void *pattern, int p_len, int p_off)
-{
-	const uint8_t *key = pattern;
-	uint8_t *d = data;
-
-	while (len--) {
-		*d ^= key[p_off];
-		d++;
-		p_off = (p_off + 1) % p_len;
-	}
-	return p_off;
-}
-
-
 void usage(void) __attribute__ (( __noreturn__ ));
 
 void usage(void)
@@ -41,7 +29,7 @@ void usage(void)
 
 int main(int argc, char **argv)
 {
-	char buf[1024];	/* keep this at 1k or adjust garbage calc below */
+	static char buf[64 * 1024];
 	FILE *in = stdin;
 	FILE *out = stdout;
 	char *ifn = NULL;
@@ -51,7 +39,8 @@ int main(int argc, char **argv)
 	unsigned int hex_buf;
 	int c;
 	size_t n;
-	int p_len, p_off = 0;
+	int p_len;
+	struct fw_xor xor;
 
 	while ((c = getopt(argc, argv, "i:o:p:xh")) != -1) {
 		switch (c) {
@@ -117,6 +106,12 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (fw_xor_init(&xor, is_hex_pattern ? hex_pattern : pattern,
+			is_hex_pattern ? p_len / 2 : p_len, 0)) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
 	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
 		if (n < sizeof(buf)) {
 			if (ferror(in)) {
@@ -126,12 +121,7 @@ int main(int argc, char **argv)
 			}
 		}
 
-		if (is_hex_pattern) {
-			p_off = xor_data(buf, n, hex_pattern, (p_len / 2),
-					 p_off);
-		} else {
-			p_off = xor_data(buf, n, pattern, p_len, p_off);
-		}
+		fw_xor_apply(&xor, buf, n);
 
 		if (!fwrite(buf, n, 1, out)) {
 		FWRITE_ERROR:
@@ -148,6 +138,7 @@ int main(int argc, char **argv)
 		goto FWRITE_ERROR;
 	}
 
+	fw_xor_free(&xor);
 	fclose(in);
 	fclose(out);
 
@@ -5,51 +5,33 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <string.h>
 #include <unistd.h>
 
-#define szbuf 32768
+#include "fw_crc32.h"
 
-u_int32_t crc_tab[256];
+#define szbuf 32768
 
 u_int32_t chksum_crc32 (FILE *f)
 {
-  register unsigned long crc;
-  unsigned long i, j;
-  char *buffer = malloc(szbuf);
-  char *buf;
+  u_int32_t crc;
+  struct stat st;
+  size_t j;
+  char *buffer;
 
   crc = 0xFFFFFFFF;
-  while (!feof(f))
-  {
-    j = fread(buffer, 1, szbuf, f);
-    buf = buffer;
-    for (i = 0; i < j; i++)
-      crc = ((crc >> 8) & 0x00FFFFFF) ^ crc_tab[(crc ^ *buf++) & 0xFF];
-  }
-  free(buffer);
-  return crc;
-}
 
-void chksum_crc32gentab ()
-{
-  unsigned long crc, poly;
-  int i, j;
+  /* Regular files are mapped and checksummed on all CPUs */
+  if (!fstat(fileno(f), &st) && !fw_crc32_fd(&crc, fileno(f), 0, st.st_size))
+    return crc;
 
-  poly = 0xEDB88320L;
-  for (i = 0; i < 256; i++)
-  {
-    crc = i;
-    for (j = 8; j > 0; j--)
-    {
-      if (crc & 1)
-        crc = (crc >> 1) ^ poly;
-      else
-        crc >>= 1;
-    }
-    crc_tab[i] = crc;
-  }
+  buffer = malloc(szbuf);
+  while ((j = fread(buffer, 1, szbuf, f)) > 0)
+    crc = fw_crc32(crc, buffer, j);
+  free(buffer);
+  return crc;
 }
 
 void usage(char *progname)
@@ -111,8 +93,6 @@ int main(int argc, char *argv[]) {
     opt = getopt( argc, argv, optString );
   }
 
-  chksum_crc32gentab();
-
   filename=argv[optind];
   if (access(filename, W_OK) || access(filename, R_OK))
   {
@@ -133,6 +113,7 @@ int main(int argc, char *argv[]) {
 
     fseek(f, 0, SEEK_SET);
     sign.crc32 = chksum_crc32(f);
+    fseek(f, 0, SEEK_END);
     fwrite(&sign, sizeof(sign), 1, f);
     fclose(f);
 
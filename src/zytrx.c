@@ -22,32 +22,13 @@
 #include <netinet/in.h>
 #include <inttypes.h>
 
-#define BPB 8 /* bits/byte */
-
-static uint32_t crc32[1<<BPB];
-
-static void init_crc32(void)
-{
-	const uint32_t poly = ntohl(0x2083b8ed);
-	int n;
-
-	for (n = 0; n < 1<<BPB; n++) {
-		uint32_t crc = n;
-		int bit;
-
-		for (bit = 0; bit < BPB; bit++)
-			crc = (crc & 1) ? (poly ^ (crc >> 1)) : (crc >> 1);
-		crc32[n] = crc;
-	}
-}
+#include "fw_crc32.h"
+#include "fw_io.h"
+#include "fw_pool.h"
 
 static uint32_t crc32buf(const unsigned char *buf, size_t len)
 {
-	uint32_t crc = 0xFFFFFFFF;
-
-	for (; len; len--, buf++)
-		crc = crc32[(uint8_t)crc ^ *buf] ^ (crc >> BPB);
-	return ~crc;
+	return ~fw_crc32_parallel(0xFFFFFFFF, buf, len);
 }
 
 /* HDR0 reversed, to be stored as BE */
@@ -112,12 +93,21 @@ static int find_board(struct zytrx_t *h, char *board)
 	return -1;
 }
 
+/* One output of a run: -B and -o are paired in order */
+struct image_t {
+	const char *board;
+	const char *outfile;
+	struct zytrx_t h;
+	int res;
+};
+
 static void usage(const char *name)
 {
 	struct board_t *p;
 
 	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, " %s -B <board> -v <versionstr> -i <file> [-o <outputfile>]\n\n", name);
+	fprintf(stderr, " %s -B <board> -v <versionstr> -i <file> [-o <outputfile>]\n", name);
+	fprintf(stderr, " %s -B <board> -o <outputfile> [-B <board> -o <outputfile>]... -v <versionstr> -i <file>\n\n", name);
 	fprintf(stderr, "Supported <board> values:\n");
 	for (p = boards; p->modelid; p++)
 		fprintf(stderr, "\t%-12s\n", p->boardid);
@@ -133,7 +123,11 @@ static void errexit(const char *msg)
 	exit(EXIT_FAILURE);
 }
 
-static void *map_input(const char *name, size_t *len)
+/*
+ * The descriptor is kept open in *fdp, so that outputs can be filled from
+ * it kernel-side rather than by writing the mapping out again.
+ */
+static void *map_input(const char *name, size_t *len, int *fdp)
 {
 	struct stat stat;
 	void *mapped;
@@ -148,18 +142,52 @@ static void *map_input(const char *name, size_t *len)
 	}
 	*len = stat.st_size;
 	mapped = mmap(NULL, stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (close(fd) < 0) {
-		(void) munmap(mapped, stat.st_size);
+	if (mapped == MAP_FAILED) {
+		close(fd);
 		return NULL;
 	}
+	*fdp = fd;
 	return mapped;
 }
 
+static int fdin = -1;
+static size_t file_len;
+
+/*
+ * Only the header differs between boards: it is written from memory and
+ * the payload copied from the input file behind it.
+ */
+static void write_image(void *arg, unsigned int idx)
+{
+	struct image_t *img = (struct image_t *)arg + idx;
+	int fdout;
+
+	img->res = -1;
+	fdout = open(img->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fdout < 0) {
+		fprintf(stderr, "ERR: %s: %s\n", img->outfile, strerror(errno));
+		return;
+	}
+	if (pwrite(fdout, &img->h, sizeof(img->h), 0) != sizeof(img->h) ||
+	    fw_io_copy_fd(fdout, sizeof(img->h), fdin, 0, file_len) != (ssize_t)file_len) {
+		fprintf(stderr, "ERR: %s: write error\n", img->outfile);
+		close(fdout);
+		return;
+	}
+	if (close(fdout) < 0) {
+		fprintf(stderr, "ERR: %s: %s\n", img->outfile, strerror(errno));
+		return;
+	}
+	img->res = 0;
+}
+
 int main(int argc, char **argv)
 {
 	int c, fdout = STDOUT_FILENO;
 	void *input_file = NULL;
-	size_t file_len, len;
+	struct image_t *images;
+	unsigned int num_boards = 0, num_outputs = 0, i;
+	size_t len;
 	uint32_t crc;
 	struct zytrx_t h = {
 		.magic		= htonl(MAGIC),
@@ -170,11 +198,17 @@ int main(int argc, char **argv)
 		.kernelChksum	= htonl(KERNELCHKSUM),
 	};
 
+	images = calloc(argc, sizeof(*images));
+	if (!images)
+		errexit("out of memory");
+
 	while ((c = getopt(argc, argv, "B:v:i:o:")) != -1) {
 		switch (c) {
 		case 'B':
-			if (find_board(&h, optarg) < 0)
+			images[num_boards].h = h;
+			if (find_board(&images[num_boards].h, optarg) < 0)
 				errexit("unsupported board");
+			images[num_boards++].board = optarg;
 			break;
 		case 'v':
 			len = strlen(optarg);
@@ -184,14 +218,12 @@ int main(int argc, char **argv)
 			memcpy(h.swVersionExt, optarg, len);
 			break;
 		case 'i':
-			input_file = map_input(optarg, &file_len);
+			input_file = map_input(optarg, &file_len, &fdin);
 			if (!input_file)
 				errexit(optarg);
 			break;
 		case 'o':
-			fdout = open(optarg, O_WRONLY | O_CREAT, 0644);
-			if (fdout < 0)
-				errexit(optarg);
+			images[num_outputs++].outfile = optarg;
 			break;
 		default:
 			usage(argv[0]);
@@ -199,28 +231,47 @@ int main(int argc, char **argv)
 	}
 
 	/* required paremeters */
-	if (!input_file || !h.modelid || !h.swVersionInt[0])
+	if (!input_file || !num_boards || !h.swVersionInt[0])
 		usage(argv[0]);
+	if (num_outputs > num_boards || (num_boards > 1 && num_outputs != num_boards)) {
+		errno = EINVAL;
+		errexit("each board needs its own output file");
+	}
 
-	/* length fields */
-	h.len_t = htonl(sizeof(h) + file_len);
-	h.len_p = htonl(file_len);
-
-	/* crc fields */
-	init_crc32();
+	/* payload crc, the same for every board */
 	crc = crc32buf(input_file, file_len);
-	h.crc32_p = htonl(~crc);
-	crc = crc32buf((unsigned char *)&h, sizeof(h));
-	h.crc32_h = htonl(~crc);
 
-	/* dump new image */
-	write(fdout, &h, sizeof(h));
-	write(fdout, input_file, file_len);
+	for (i = 0; i < num_boards; i++) {
+		struct zytrx_t *p = &images[i].h;
+
+		/* -v may come after -B */
+		memcpy(p->swVersionInt, h.swVersionInt, sizeof(p->swVersionInt));
+		memcpy(p->swVersionExt, h.swVersionExt, sizeof(p->swVersionExt));
+
+		/* length fields */
+		p->len_t = htonl(sizeof(*p) + file_len);
+		p->len_p = htonl(file_len);
+
+		/* crc fields */
+		p->crc32_p = htonl(~crc);
+		p->crc32_h = htonl(~crc32buf((unsigned char *)p, sizeof(*p)));
+	}
+
+	if (num_outputs) {
+		fw_pool_run(num_boards, write_image, images);
+		for (i = 0; i < num_boards; i++)
+			if (images[i].res < 0)
+				return EXIT_FAILURE;
+	} else {
+		/* dump new image */
+		write(fdout, &images[0].h, sizeof(images[0].h));
+		write(fdout, input_file, file_len);
+	}
 
 	/* close files */
 	munmap(input_file, file_len);
-	if (fdout != STDOUT_FILENO)
-		close(fdout);
+	close(fdin);
+	free(images);
 
 	return EXIT_SUCCESS;
 }